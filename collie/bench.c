@@ -0,0 +1,603 @@
+/*
+ * Copyright (C) 2013 Taobao Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Benchmarks which run against a live cluster, so that changes to the I/O
+ * path can be measured the same way everywhere.  The raw output (-r) is one
+ * line per result, space separated, for scripts to compare runs with.
+ */
+
+#include <pthread.h>
+
+#include "collie.h"
+
+#define BENCH_MAX_DEPTH 64
+#define BENCH_DEFAULT_SECONDS 10
+#define BENCH_DEFAULT_SNAPSHOTS 10
+#define BENCH_POLL_US 10000
+#define MAX_METRICS 512
+
+static struct sd_option bench_options[] = {
+	{'m', "mix", true, "percentage of reads, the rest are writes"},
+	{'b', "block", true, "size of each I/O"},
+	{'n', "depth", true, "number of requests in flight"},
+	{'t', "time", true, "how long to run, in seconds"},
+	{'c', "count", true, "number of snapshots to take"},
+	{ 0, NULL, false, NULL },
+};
+
+static struct bench_cmd_data {
+	int read_pct;
+	uint32_t block_size;
+	int depth;
+	int seconds;
+	int count;
+} bench_cmd_data = {
+	.read_pct = 100,
+	.block_size = 4096,
+	.depth = 1,
+	.count = BENCH_DEFAULT_SNAPSHOTS,
+};
+
+enum { BENCH_READ, BENCH_WRITE, BENCH_NR_OPS };
+
+static const char *bench_op_names[BENCH_NR_OPS] = { "read", "write" };
+
+/* The latencies of one kind of operation, in microseconds */
+struct bench_lat {
+	uint32_t *us;
+	size_t nr;
+	size_t alloc;
+};
+
+struct bench_io {
+	uint32_t vid;
+	int copies;
+	uint32_t *idxs;		/* the data objects owned by the VDI */
+	int nr_idxs;
+	uint32_t objsize;
+	uint64_t end_time;
+};
+
+struct bench_worker {
+	pthread_t thread;
+	struct bench_io *io;
+	unsigned int seed;
+	int err;
+	struct bench_lat lat[BENCH_NR_OPS];
+};
+
+static void lat_add(struct bench_lat *lat, uint64_t us)
+{
+	if (lat->nr == lat->alloc) {
+		lat->alloc = lat->alloc ? lat->alloc * 2 : 4096;
+		lat->us = xrealloc(lat->us, lat->alloc * sizeof(*lat->us));
+	}
+	lat->us[lat->nr++] = min(us, (uint64_t)UINT32_MAX);
+}
+
+static void lat_merge(struct bench_lat *to, struct bench_lat *from)
+{
+	size_t i;
+
+	for (i = 0; i < from->nr; i++)
+		lat_add(to, from->us[i]);
+	free(from->us);
+}
+
+static int lat_cmp(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* lat must be sorted */
+static uint32_t lat_pct(const struct bench_lat *lat, int pct)
+{
+	if (!lat->nr)
+		return 0;
+	return lat->us[(lat->nr - 1) * pct / 100];
+}
+
+static void print_lat_header(const char *what)
+{
+	if (!raw_output)
+		printf("%-9s %9s %10s %12s %9s %9s %9s %9s\n", what, "Ops",
+		       "IOPS", "Bandwidth", "p50(us)", "p90(us)", "p99(us)",
+		       "Max(us)");
+}
+
+/*
+ * Print one line of results.  len is the size of each operation, 0 if it
+ * doesn't move data.  The bandwidth is in bytes per second in raw output.
+ */
+static void print_lat(const char *name, struct bench_lat *lat, uint32_t len,
+		      uint64_t elapsed_us)
+{
+	double secs = (double)elapsed_us / 1000000;
+	double iops = secs > 0 ? lat->nr / secs : 0;
+	uint64_t bw = iops * len;
+	char str[UINT64_DECIMAL_SIZE], bw_str[UINT64_DECIMAL_SIZE + 2] = "-";
+
+	qsort(lat->us, lat->nr, sizeof(*lat->us), lat_cmp);
+
+	if (raw_output) {
+		printf("%s %zu %.1f %" PRIu64 " %u %u %u %u\n", name, lat->nr,
+		       iops, bw, lat_pct(lat, 50), lat_pct(lat, 90),
+		       lat_pct(lat, 99), lat_pct(lat, 100));
+		return;
+	}
+
+	if (len)
+		snprintf(bw_str, sizeof(bw_str), "%s/s",
+			 size_to_str(bw, str, sizeof(str)));
+	printf("%-9s %9zu %10.1f %12s %9u %9u %9u %9u\n", name, lat->nr,
+	       iops, bw_str, lat_pct(lat, 50), lat_pct(lat, 90),
+	       lat_pct(lat, 99), lat_pct(lat, 100));
+}
+
+static void *bench_io_worker(void *arg)
+{
+	struct bench_worker *w = arg;
+	struct bench_io *io = w->io;
+	uint32_t bs = bench_cmd_data.block_size;
+	uint32_t nr_blocks = io->objsize / bs;
+	struct sd_req hdr;
+	struct sd_rsp *rsp = (struct sd_rsp *)&hdr;
+	uint64_t start, now;
+	void *buf;
+	int fd, op, ret;
+
+	/*
+	 * Unlike sd_read_object() and sd_write_object(), keep the connection
+	 * across the requests, or we would be timing connect() too.
+	 */
+	fd = connect_to(sdhost, sdport);
+	if (fd < 0) {
+		w->err = EXIT_SYSFAIL;
+		return NULL;
+	}
+
+	buf = xzalloc(bs);
+	memset(buf, rand_r(&w->seed), bs);
+
+	for (now = get_usec_time(); now < io->end_time; now = get_usec_time()) {
+		op = rand_r(&w->seed) % 100 < bench_cmd_data.read_pct ?
+			BENCH_READ : BENCH_WRITE;
+
+		if (op == BENCH_READ) {
+			sd_init_req(&hdr, SD_OP_READ_OBJ);
+		} else {
+			sd_init_req(&hdr, SD_OP_WRITE_OBJ);
+			hdr.flags = SD_FLAG_CMD_WRITE;
+			hdr.obj.copies = io->copies;
+		}
+		hdr.flags |= SD_FLAG_CMD_DIRECT;
+		hdr.data_length = bs;
+		hdr.obj.oid = vid_to_data_oid(io->vid,
+				io->idxs[rand_r(&w->seed) % io->nr_idxs]);
+		hdr.obj.offset = (uint64_t)(rand_r(&w->seed) % nr_blocks) * bs;
+
+		start = now;
+		ret = collie_exec_req(fd, &hdr, buf);
+		if (ret || rsp->result != SD_RES_SUCCESS) {
+			fprintf(stderr, "Failed to %s object %" PRIx64 ": %s\n",
+				bench_op_names[op], hdr.obj.oid,
+				ret ? "I/O error" : sd_strerror(rsp->result));
+			w->err = EXIT_FAILURE;
+			break;
+		}
+		lat_add(&w->lat[op], get_usec_time() - start);
+	}
+
+	free(buf);
+	close(fd);
+	return NULL;
+}
+
+static int bench_io(int argc, char **argv)
+{
+	const char *vdiname = argv[optind++];
+	struct sheepdog_inode *inode;
+	struct bench_worker *workers;
+	struct bench_lat total[BENCH_NR_OPS] = {};
+	struct bench_io io = {};
+	int seconds = bench_cmd_data.seconds ? : BENCH_DEFAULT_SECONDS;
+	int depth = bench_cmd_data.depth, i, op, ret;
+	uint64_t start, elapsed;
+
+	inode = xmalloc(sizeof(*inode));
+	ret = read_vdi_obj(vdiname, 0, "", &io.vid, inode, SD_INODE_SIZE);
+	if (ret != EXIT_SUCCESS)
+		goto out;
+
+	/*
+	 * Only touch the objects which the VDI owns, so that neither reads of
+	 * holes nor copy-on-write get timed.
+	 */
+	io.idxs = xmalloc(sizeof(*io.idxs) * MAX_DATA_OBJS);
+	for (i = 0; i < MAX_DATA_OBJS; i++)
+		if (inode->data_vdi_id[i] == io.vid)
+			io.idxs[io.nr_idxs++] = i;
+	if (!io.nr_idxs) {
+		fprintf(stderr, "%s has no data objects of its own, please "
+			"preallocate it with 'collie vdi create -P'\n",
+			vdiname);
+		ret = EXIT_FAILURE;
+		goto out;
+	}
+	io.copies = inode->nr_copies;
+	io.objsize = get_inode_objsize(inode);
+	if (bench_cmd_data.block_size > io.objsize) {
+		fprintf(stderr, "The block size is larger than the %" PRIu32
+			" bytes objects of %s\n", io.objsize, vdiname);
+		ret = EXIT_FAILURE;
+		goto out;
+	}
+
+	workers = xzalloc(sizeof(*workers) * depth);
+	start = get_usec_time();
+	io.end_time = start + (uint64_t)seconds * 1000000;
+	for (i = 0; i < depth; i++) {
+		workers[i].io = &io;
+		workers[i].seed = start + i;
+		ret = pthread_create(&workers[i].thread, NULL, bench_io_worker,
+				     workers + i);
+		if (ret) {
+			fprintf(stderr, "Failed to create a thread: %m\n");
+			exit(EXIT_SYSFAIL);
+		}
+	}
+
+	ret = EXIT_SUCCESS;
+	for (i = 0; i < depth; i++) {
+		pthread_join(workers[i].thread, NULL);
+		if (workers[i].err)
+			ret = workers[i].err;
+		for (op = 0; op < BENCH_NR_OPS; op++)
+			lat_merge(total + op, workers[i].lat + op);
+	}
+	elapsed = get_usec_time() - start;
+	free(workers);
+
+	print_lat_header("Op");
+	for (op = 0; op < BENCH_NR_OPS; op++) {
+		if (total[op].nr)
+			print_lat(bench_op_names[op], total + op,
+				  bench_cmd_data.block_size, elapsed);
+		free(total[op].us);
+	}
+out:
+	free(io.idxs);
+	free(inode);
+	return ret;
+}
+
+/* Take a snapshot of vid and return the VDI which becomes the current one */
+static int take_snapshot(const struct sheepdog_inode *inode, uint32_t vid,
+			 uint32_t *new_vid)
+{
+	struct sd_req hdr;
+	struct sd_rsp *rsp = (struct sd_rsp *)&hdr;
+	char buf[SD_MAX_VDI_LEN] = {};
+	int fd, ret;
+
+	fd = connect_to(sdhost, sdport);
+	if (fd < 0) {
+		fprintf(stderr, "Failed to connect\n");
+		return EXIT_SYSFAIL;
+	}
+
+	pstrcpy(buf, sizeof(buf), inode->name);
+	sd_init_req(&hdr, SD_OP_NEW_VDI);
+	hdr.flags = SD_FLAG_CMD_WRITE;
+	hdr.data_length = SD_MAX_VDI_LEN;
+	hdr.vdi.base_vdi_id = vid;
+	hdr.vdi.snapid = 1;
+	hdr.vdi.vdi_size = inode->vdi_size;
+	hdr.vdi.copies = inode->nr_copies;
+
+	ret = collie_exec_req(fd, &hdr, buf);
+	close(fd);
+
+	if (ret) {
+		fprintf(stderr, "Failed to send a request\n");
+		return EXIT_SYSFAIL;
+	}
+	if (rsp->result != SD_RES_SUCCESS) {
+		fprintf(stderr, "Failed to snapshot %s: %s\n", inode->name,
+			sd_strerror(rsp->result));
+		return EXIT_FAILURE;
+	}
+
+	*new_vid = rsp->vdi.vdi_id;
+	return EXIT_SUCCESS;
+}
+
+static int bench_snapshot(int argc, char **argv)
+{
+	const char *vdiname = argv[optind++];
+	struct sheepdog_inode *inode;
+	struct bench_lat lat = {};
+	uint64_t start, begin;
+	uint32_t vid;
+	int i, ret;
+
+	inode = xmalloc(sizeof(*inode));
+	ret = read_vdi_obj(vdiname, 0, "", &vid, inode, SD_INODE_HEADER_SIZE);
+	if (ret != EXIT_SUCCESS)
+		goto out;
+
+	begin = get_usec_time();
+	for (i = 0; i < bench_cmd_data.count; i++) {
+		start = get_usec_time();
+		ret = take_snapshot(inode, vid, &vid);
+		if (ret != EXIT_SUCCESS)
+			break;
+		lat_add(&lat, get_usec_time() - start);
+	}
+
+	print_lat_header("Scenario");
+	print_lat("snapshot", &lat, 0, get_usec_time() - begin);
+	free(lat.us);
+out:
+	free(inode);
+	return ret;
+}
+
+/*
+ * Return the value of the counter called name on the node idx, or -1 if we
+ * can't get it, e.g. because the node has left.
+ */
+static int64_t get_node_counter(int idx, const char *name)
+{
+	char host[128];
+	struct sd_req hdr;
+	struct sd_rsp *rsp = (struct sd_rsp *)&hdr;
+	struct sd_metric *metrics;
+	int64_t value = -1;
+	int fd, ret, i, nr;
+
+	addr_to_str(host, sizeof(host), sd_nodes[idx].nid.addr, 0);
+	fd = connect_to(host, sd_nodes[idx].nid.port);
+	if (fd < 0)
+		return -1;
+
+	metrics = xcalloc(MAX_METRICS, sizeof(*metrics));
+	sd_init_req(&hdr, SD_OP_STAT_METRICS);
+	hdr.data_length = MAX_METRICS * sizeof(*metrics);
+
+	ret = collie_exec_req(fd, &hdr, metrics);
+	close(fd);
+	if (ret || rsp->result != SD_RES_SUCCESS)
+		goto out;
+
+	nr = rsp->data_length / sizeof(*metrics);
+	for (i = 0; i < nr; i++) {
+		if (metrics[i].type == SD_METRIC_COUNTER &&
+		    !strcmp(metrics[i].name, name)) {
+			value = metrics[i].value;
+			break;
+		}
+	}
+out:
+	free(metrics);
+	return value;
+}
+
+/*
+ * Return whether the node idx is recovering and store the epoch it is at to
+ * epoch.  A node which we can't reach counts as done, at epoch 0.
+ */
+static bool node_in_recovery(int idx, uint32_t *epoch)
+{
+	char host[128];
+	struct sd_req hdr;
+	struct sd_rsp *rsp = (struct sd_rsp *)&hdr;
+	struct recovery_wait_stat stat;
+	int fd, ret;
+
+	*epoch = 0;
+	addr_to_str(host, sizeof(host), sd_nodes[idx].nid.addr, 0);
+	fd = connect_to(host, sd_nodes[idx].nid.port);
+	if (fd < 0)
+		return false;
+
+	sd_init_req(&hdr, SD_OP_STAT_RECOVERY);
+	hdr.data_length = sizeof(stat);
+
+	ret = collie_exec_req(fd, &hdr, &stat);
+	close(fd);
+	if (ret)
+		return false;
+
+	*epoch = rsp->epoch;
+	return rsp->result == SD_RES_NODE_IN_RECOVERY;
+}
+
+static bool timed_out(uint64_t start)
+{
+	uint64_t timeout = (uint64_t)bench_cmd_data.seconds * 1000000;
+
+	return timeout && get_usec_time() - start > timeout;
+}
+
+/*
+ * Time the next recovery.  The clock starts when a node moves to a new
+ * epoch, so that the membership change can be made after running this
+ * command, and stops for each node of the new membership when it has no
+ * more objects to recover.
+ */
+static int bench_recovery(int argc, char **argv)
+{
+	struct sd_node *old_nodes;
+	uint64_t start, begin = 0, end = 0, now, *done;
+	int64_t *old_objs, n, total = 0;
+	uint32_t epoch;
+	int i, j, left, old_nr = sd_nodes_nr, ret = EXIT_SUCCESS;
+	char host[128];
+
+	old_nodes = xmalloc(sizeof(*old_nodes) * old_nr);
+	memcpy(old_nodes, sd_nodes, sizeof(*old_nodes) * old_nr);
+	old_objs = xmalloc(sizeof(*old_objs) * old_nr);
+	for (i = 0; i < old_nr; i++)
+		old_objs[i] = get_node_counter(i, "recovery_objects");
+	done = xzalloc(sizeof(*done) * SD_MAX_NODES);
+
+	start = get_usec_time();
+	while (!begin) {
+		for (i = 0; i < sd_nodes_nr && !begin; i++)
+			if (node_in_recovery(i, &epoch) || epoch > sd_epoch)
+				begin = get_usec_time();
+		if (begin)
+			break;
+		if (timed_out(start)) {
+			fprintf(stderr, "Timed out, the cluster didn't change\n");
+			ret = EXIT_FAILURE;
+			goto out;
+		}
+		usleep(BENCH_POLL_US);
+	}
+
+	/* the nodes which joined recover too */
+	if (update_node_list(SD_MAX_NODES, 0) < 0) {
+		fprintf(stderr, "Failed to get the new node list\n");
+		ret = EXIT_SYSFAIL;
+		goto out;
+	}
+
+	for (left = sd_nodes_nr; left; usleep(BENCH_POLL_US)) {
+		for (i = 0; i < sd_nodes_nr; i++) {
+			if (done[i] || node_in_recovery(i, &epoch))
+				continue;
+			done[i] = end = get_usec_time();
+			left--;
+		}
+		if (left && timed_out(start)) {
+			fprintf(stderr, "Timed out, %d nodes in recovery\n",
+				left);
+			ret = EXIT_FAILURE;
+			goto out;
+		}
+	}
+
+	if (!raw_output)
+		printf("Id   Host:Port          Recovered objects  Time(ms)\n");
+	for (i = 0; i < sd_nodes_nr; i++) {
+		n = get_node_counter(i, "recovery_objects");
+		/* the nodes which joined started from zero */
+		for (j = 0; j < old_nr; j++)
+			if (node_eq(sd_nodes + i, old_nodes + j))
+				break;
+		if (j < old_nr && old_objs[j] > 0 && n > 0)
+			n -= old_objs[j];
+		n = max(n, (int64_t)0);
+		total += n;
+		addr_to_str(host, sizeof(host), sd_nodes[i].nid.addr,
+			    sd_nodes[i].nid.port);
+		printf(raw_output ? "%d %s %" PRId64 " %" PRIu64 "\n" :
+		       "%2d   %-20s%17" PRId64 "%10" PRIu64 "\n", i, host, n,
+		       (done[i] - begin) / 1000);
+	}
+	now = max(end, begin + 1);
+	if (raw_output)
+		printf("total - %" PRId64 " %" PRIu64 "\n", total,
+		       (now - begin) / 1000);
+	else
+		printf("Total %" PRId64 " objects in %" PRIu64 " ms, "
+		       "%.1f objects/s\n", total, (now - begin) / 1000,
+		       total * 1000000.0 / (now - begin));
+out:
+	free(done);
+	free(old_objs);
+	free(old_nodes);
+	return ret;
+}
+
+static struct subcommand bench_cmd[] = {
+	{"io", "<vdiname>", "mbntaprh",
+	 "time reads and writes of the objects of a VDI", NULL,
+	 SUBCMD_FLAG_NEED_THIRD_ARG, bench_io, bench_options},
+	{"snapshot", "<vdiname>", "captrh",
+	 "time taking snapshots of a VDI", NULL,
+	 SUBCMD_FLAG_NEED_THIRD_ARG, bench_snapshot, bench_options},
+	{"recovery", NULL, "taprh",
+	 "time the next recovery of the cluster", NULL,
+	 SUBCMD_FLAG_NEED_NODELIST, bench_recovery, bench_options},
+	{NULL,},
+};
+
+static int bench_parser(int ch, char *opt)
+{
+	uint64_t size;
+	char *p;
+	int v;
+
+	switch (ch) {
+	case 'm':
+		v = strtol(opt, &p, 10);
+		if (opt == p || *p || v < 0 || v > 100) {
+			fprintf(stderr, "The read percentage must be between "
+				"0 and 100\n");
+			exit(EXIT_FAILURE);
+		}
+		bench_cmd_data.read_pct = v;
+		break;
+	case 'b':
+		if (parse_option_size(opt, &size) < 0)
+			exit(EXIT_FAILURE);
+		if (size < SECTOR_SIZE ||
+		    size > UINT32_C(1) << SD_MAX_BLOCK_SIZE_SHIFT ||
+		    size % SECTOR_SIZE) {
+			fprintf(stderr, "The block size must be a multiple of "
+				"%u up to %" PRIu32 "\n", SECTOR_SIZE,
+				UINT32_C(1) << SD_MAX_BLOCK_SIZE_SHIFT);
+			exit(EXIT_FAILURE);
+		}
+		bench_cmd_data.block_size = size;
+		break;
+	case 'n':
+		v = strtol(opt, &p, 10);
+		if (opt == p || *p || v < 1 || v > BENCH_MAX_DEPTH) {
+			fprintf(stderr, "The number of requests in flight "
+				"must be between 1 and %d\n", BENCH_MAX_DEPTH);
+			exit(EXIT_FAILURE);
+		}
+		bench_cmd_data.depth = v;
+		break;
+	case 't':
+		v = strtol(opt, &p, 10);
+		if (opt == p || *p || v < 1) {
+			fprintf(stderr, "The time must be a positive number "
+				"of seconds\n");
+			exit(EXIT_FAILURE);
+		}
+		bench_cmd_data.seconds = v;
+		break;
+	case 'c':
+		v = strtol(opt, &p, 10);
+		if (opt == p || *p || v < 1) {
+			fprintf(stderr, "The count must be a positive number\n");
+			exit(EXIT_FAILURE);
+		}
+		bench_cmd_data.count = v;
+		break;
+	}
+
+	return 0;
+}
+
+struct command bench_command = {
+	"bench",
+	bench_cmd,
+	bench_parser
+};
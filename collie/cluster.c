@@ -20,6 +20,7 @@ static struct sd_option cluster_options[] = {
 	{'b', "store", true, "specify backend store"},
 	{'c', "copies", true, "specify the default data redundancy (number of copies)"},
 	{'m', "mode", true, "mode (safe, quorum, unsafe)"},
+	{'P', "placement", true, "specify the placement engine (ring, straw2)"},
 	{'f', "force", false, "do not prompt for confirmation"},
 	{'R', "restore", true, "restore the cluster"},
 	{'l', "list", false, "list the user epoch information"},
@@ -33,6 +34,7 @@ static struct cluster_cmd_data {
 	int copies;
 	bool nohalt;
 	bool quorum;
+	int placement;
 	bool force;
 	char name[STORE_LEN];
 } cluster_cmd_data;
@@ -132,6 +134,7 @@ static int cluster_format(int argc, char **argv)
 		hdr.flags |= SD_FLAG_NOHALT;
 	if (cluster_cmd_data.quorum)
 		hdr.flags |= SD_FLAG_QUORUM;
+	hdr.placement = cluster_cmd_data.placement;
 
 	hdr.ctime = (uint64_t) tv.tv_sec << 32 | tv.tv_usec * 1000;
 
@@ -425,6 +428,60 @@ static int cluster_enable_recover(int argc, char **argv)
 	return EXIT_SUCCESS;
 }
 
+static int cluster_recover_throttle(int argc, char **argv)
+{
+	struct recovery_throttle rt = {
+		.max_latency = SD_DEFAULT_RECOVERY_LATENCY,
+	};
+	uint32_t *vals[] = {
+		&rt.max_bandwidth, &rt.max_iops, &rt.max_latency,
+	};
+	struct sd_req hdr;
+	struct sd_rsp *rsp = (struct sd_rsp *)&hdr;
+	unsigned long v;
+	int i, fd, ret;
+	char *arg, *p;
+
+	for (i = 0; i < ARRAY_SIZE(vals); i++) {
+		arg = argv[optind + 1 + i];
+		if (!arg)
+			break;
+		v = strtoul(arg, &p, 10);
+		if (arg == p || *p || v > UINT32_MAX) {
+			fprintf(stderr, "Invalid throttle value %s\n", arg);
+			return EXIT_USAGE;
+		}
+		*vals[i] = v;
+	}
+
+	fd = connect_to(sdhost, sdport);
+	if (fd < 0)
+		return EXIT_FAILURE;
+
+	sd_init_req(&hdr, SD_OP_SET_RECOVERY);
+	hdr.flags = SD_FLAG_CMD_WRITE;
+	hdr.data_length = sizeof(rt);
+
+	ret = collie_exec_req(fd, &hdr, &rt);
+	close(fd);
+
+	if (ret) {
+		fprintf(stderr, "Failed to connect\n");
+		return EXIT_FAILURE;
+	}
+
+	if (rsp->result != SD_RES_SUCCESS) {
+		fprintf(stderr, "Failed to set recovery throttle: %s\n",
+			sd_strerror(rsp->result));
+		return EXIT_FAILURE;
+	}
+
+	printf("Cluster recovery throttle: %"PRIu32" MB/s, %"PRIu32
+	       " objects/s, backs off above %"PRIu32" ms (0 for unlimited)\n",
+	       rt.max_bandwidth, rt.max_iops, rt.max_latency);
+	return EXIT_SUCCESS;
+}
+
 /* Subcommand list of recover */
 static struct subcommand cluster_recover_cmd[] = {
 	{"force", NULL, NULL, "force recover cluster immediately",
@@ -434,6 +491,9 @@ static struct subcommand cluster_recover_cmd[] = {
 	 NULL, 0, cluster_enable_recover},
 	{"disable", NULL, NULL, "disable automatic recovery",
 	 NULL, 0, cluster_disable_recover},
+	{"throttle", "[<MB/s> [<objects/s> [<latency ms>]]]", NULL,
+	 "limit the recovery rate and the I/O latency it may cause",
+	 NULL, 0, cluster_recover_throttle},
 	{NULL},
 };
 
@@ -453,7 +513,7 @@ static int cluster_recover(int argc, char **argv)
 static struct subcommand cluster_cmd[] = {
 	{"info", NULL, "aprh", "show cluster information",
 	 NULL, SUBCMD_FLAG_NEED_NODELIST, cluster_info, cluster_options},
-	{"format", NULL, "bcmaph", "create a Sheepdog store",
+	{"format", NULL, "bcmPaph", "create a Sheepdog store",
 	 NULL, 0, cluster_format, cluster_options},
 	{"shutdown", NULL, "aph", "stop Sheepdog",
 	 NULL, 0, cluster_shutdown, cluster_options},
@@ -503,6 +563,13 @@ static int cluster_parser(int ch, char *opt)
 			exit(EXIT_FAILURE);
 		}
 		break;
+	case 'P':
+		cluster_cmd_data.placement = str_to_placement(opt);
+		if (cluster_cmd_data.placement < 0) {
+			fprintf(stderr, "Unknown placement '%s'\n", opt);
+			exit(EXIT_FAILURE);
+		}
+		break;
 	case 'f':
 		cluster_cmd_data.force = true;
 		break;
@@ -43,9 +43,10 @@ uint32_t sd_epoch;
 struct sd_node sd_nodes[SD_MAX_NODES];
 struct sd_vnode sd_vnodes[SD_MAX_VNODES];
 int sd_nodes_nr, sd_vnodes_nr;
+int sd_placement = SD_PLACEMENT_RING;
 unsigned master_idx;
 
-static int update_node_list(int max_nodes, uint32_t epoch)
+int update_node_list(int max_nodes, uint32_t epoch)
 {
 	int fd, ret;
 	unsigned int size;
@@ -140,6 +141,7 @@ static void init_commands(const struct command **commands)
 		vdi_command,
 		node_command,
 		cluster_command,
+		bench_command,
 		debug_command,
 		{NULL,}
 	};
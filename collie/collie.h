@@ -54,20 +54,48 @@ extern uint32_t sd_epoch;
 extern struct sd_node sd_nodes[SD_MAX_NODES];
 extern struct sd_vnode sd_vnodes[SD_MAX_VNODES];
 extern int sd_nodes_nr, sd_vnodes_nr;
+extern int sd_placement;
 extern unsigned master_idx;
 
 bool is_current(const struct sheepdog_inode *i);
 char *size_to_str(uint64_t _size, char *str, int str_size);
+int parse_option_size(const char *value, uint64_t *ret);
+int update_node_list(int max_nodes, uint32_t epoch);
 typedef void (*vdi_parser_func_t)(uint32_t vid, const char *name,
 				  const char *tag, uint32_t snapid,
 				  uint32_t flags,
 				  const struct sheepdog_inode *i, void *data);
 int parse_vdi(vdi_parser_func_t func, size_t size, void *data);
+int read_vdi_obj(const char *vdiname, int snapid, const char *tag,
+		 uint32_t *pvid, struct sheepdog_inode *inode, size_t size);
 int sd_read_object(uint64_t oid, void *data, unsigned int datalen,
 		   uint64_t offset, bool direct);
 int sd_write_object(uint64_t oid, uint64_t cow_oid, void *data,
 		    unsigned int datalen, uint64_t offset, uint32_t flags,
 		    int copies, bool create, bool direct);
+
+/*
+ * A pipeline of object requests to sdhost, one connection per slot, so that
+ * up to 'depth' requests are in flight at once.  They are completed in the
+ * order that they are submitted in.
+ */
+struct sd_pipe_req {
+	struct sd_req hdr;
+	void *data;
+	int idx;		/* slot index, to find the buffers of the caller */
+
+	unsigned int rlen;
+};
+
+/* returns EXIT_SUCCESS, or an error which stops the pipeline */
+typedef int (*sd_pipe_done_t)(struct sd_pipe_req *req, void *arg);
+
+struct sd_pipe;
+struct sd_pipe *sd_pipe_open(int depth, sd_pipe_done_t done, void *arg);
+struct sd_pipe_req *sd_pipe_get(struct sd_pipe *pipe);
+int sd_pipe_submit(struct sd_pipe *pipe, struct sd_pipe_req *req);
+int sd_pipe_close(struct sd_pipe *pipe);
+
 int send_light_req(struct sd_req *hdr, const char *host, int port);
 int send_light_req_get_response(struct sd_req *hdr, const char *host, int port);
 int collie_exec_req(int sockfd, struct sd_req *hdr, void *data);
@@ -75,6 +103,7 @@ int collie_exec_req(int sockfd, struct sd_req *hdr, void *data);
 extern struct command vdi_command;
 extern struct command node_command;
 extern struct command cluster_command;
+extern struct command bench_command;
 
 #ifdef ENABLE_TRACE
   extern struct command debug_command;
@@ -42,6 +42,36 @@ char *size_to_str(uint64_t _size, char *str, int str_size)
 	return str;
 }
 
+int parse_option_size(const char *value, uint64_t *ret)
+{
+	char *postfix;
+	double sizef;
+
+	sizef = strtod(value, &postfix);
+	switch (*postfix) {
+	case 'T':
+		sizef *= 1024;
+	case 'G':
+		sizef *= 1024;
+	case 'M':
+		sizef *= 1024;
+	case 'K':
+	case 'k':
+		sizef *= 1024;
+	case 'b':
+	case '\0':
+		*ret = (uint64_t) sizef;
+		break;
+	default:
+		fprintf(stderr, "Invalid size '%s'\n", value);
+		fprintf(stderr, "You may use k, M, G or T suffixes for "
+			"kilobytes, megabytes, gigabytes and terabytes.\n");
+		return -1;
+	}
+
+	return 0;
+}
+
 int sd_read_object(uint64_t oid, void *data, unsigned int datalen,
 		   uint64_t offset, bool direct)
 {
@@ -129,6 +159,125 @@ int sd_write_object(uint64_t oid, uint64_t cow_oid, void *data,
 	return SD_RES_SUCCESS;
 }
 
+struct sd_pipe {
+	int depth;
+	int head;		/* the oldest slot in flight */
+	int nr;			/* number of slots in flight */
+	int err;
+	sd_pipe_done_t done;
+	void *arg;
+	struct sd_pipe_req *reqs;
+	int fds[];
+};
+
+struct sd_pipe *sd_pipe_open(int depth, sd_pipe_done_t done, void *arg)
+{
+	struct sd_pipe *pipe;
+	int i;
+
+	pipe = xzalloc(sizeof(*pipe) + sizeof(pipe->fds[0]) * depth);
+	pipe->depth = depth;
+	pipe->done = done;
+	pipe->arg = arg;
+	pipe->reqs = xzalloc(sizeof(pipe->reqs[0]) * depth);
+
+	for (i = 0; i < depth; i++) {
+		pipe->reqs[i].idx = i;
+		pipe->fds[i] = connect_to(sdhost, sdport);
+		if (pipe->fds[i] < 0) {
+			fprintf(stderr, "Failed to connect\n");
+			while (i--)
+				close(pipe->fds[i]);
+			free(pipe->reqs);
+			free(pipe);
+			return NULL;
+		}
+	}
+
+	return pipe;
+}
+
+/* wait for the oldest request and pass it to the done callback */
+static void sd_pipe_complete(struct sd_pipe *pipe)
+{
+	struct sd_pipe_req *req = pipe->reqs + pipe->head;
+	int ret;
+
+	/* a slot without a request only keeps its place in the order */
+	if (req->hdr.opcode &&
+	    wait_rsp(pipe->fds[req->idx], &req->hdr, req->data, req->rlen,
+		     NULL, 0)) {
+		fprintf(stderr, "Failed to read a response\n");
+		ret = EXIT_FAILURE;
+	} else if (pipe->err)
+		ret = pipe->err;
+	else
+		ret = pipe->done(req, pipe->arg);
+
+	if (!pipe->err)
+		pipe->err = ret;
+	pipe->head = (pipe->head + 1) % pipe->depth;
+	pipe->nr--;
+}
+
+/*
+ * Return a free slot, waiting for the oldest request if all of them are in
+ * flight, or NULL if a request has failed.  The caller fills the header and
+ * the data of the slot, and passes it to sd_pipe_submit().
+ */
+struct sd_pipe_req *sd_pipe_get(struct sd_pipe *pipe)
+{
+	struct sd_pipe_req *req;
+
+	if (pipe->nr == pipe->depth)
+		sd_pipe_complete(pipe);
+	if (pipe->err)
+		return NULL;
+
+	req = pipe->reqs + (pipe->head + pipe->nr) % pipe->depth;
+	memset(&req->hdr, 0, sizeof(req->hdr));
+	req->data = NULL;
+
+	return req;
+}
+
+/*
+ * Send the request of the slot.  A slot whose opcode is left zero is
+ * completed in order without sending anything.
+ */
+int sd_pipe_submit(struct sd_pipe *pipe, struct sd_pipe_req *req)
+{
+	pipe->nr++;
+	if (req->hdr.opcode &&
+	    submit_req(pipe->fds[req->idx], &req->hdr, req->data, &req->rlen,
+		       NULL, 0)) {
+		fprintf(stderr, "Failed to send a request\n");
+		/* no response comes back now */
+		req->hdr.opcode = 0;
+		if (!pipe->err)
+			pipe->err = EXIT_FAILURE;
+	}
+
+	return pipe->err;
+}
+
+/* complete the requests in flight and return the first error */
+int sd_pipe_close(struct sd_pipe *pipe)
+{
+	int i, ret;
+
+	while (pipe->nr)
+		sd_pipe_complete(pipe);
+	ret = pipe->err;
+
+	for (i = 0; i < pipe->depth; i++)
+		close(pipe->fds[i]);
+	free(pipe->reqs);
+	free(pipe);
+
+	return ret;
+}
+
 int parse_vdi(vdi_parser_func_t func, size_t size, void *data)
 {
 	int ret, fd;
@@ -177,7 +326,7 @@ int parse_vdi(vdi_parser_func_t func, size_t size, void *data)
 			continue;
 
 		if (size > SD_INODE_HEADER_SIZE) {
-			rlen = DIV_ROUND_UP(i.vdi_size, SD_DATA_OBJ_SIZE) *
+			rlen = DIV_ROUND_UP(i.vdi_size, get_inode_objsize(&i)) *
 				sizeof(i.data_vdi_id[0]);
 			if (rlen > size - SD_INODE_HEADER_SIZE)
 				rlen = size - SD_INODE_HEADER_SIZE;
@@ -11,6 +11,16 @@
 
 #include "collie.h"
 
+static struct sd_option node_options[] = {
+	{'w', "waits", false, "show the requests blocked on recovery"},
+
+	{ 0, NULL, false, NULL },
+};
+
+static struct node_cmd_data {
+	bool waits;
+} node_cmd_data;
+
 static void cal_total_vdi_size(uint32_t vid, const char *name, const char *tag,
 			       uint32_t snapid, uint32_t flags,
 			       const struct sheepdog_inode *i, void *data)
@@ -108,10 +118,132 @@ static int node_info(int argc, char **argv)
 	return EXIT_SUCCESS;
 }
 
+static int get_recovery_stat(int idx, struct recovery_wait_stat *stat)
+{
+	char host[128];
+	struct sd_req hdr;
+	struct sd_rsp *rsp = (struct sd_rsp *)&hdr;
+	int fd, ret;
+
+	addr_to_str(host, sizeof(host), sd_nodes[idx].nid.addr, 0);
+	fd = connect_to(host, sd_nodes[idx].nid.port);
+	if (fd < 0)
+		return -1;
+
+	memset(stat, 0, sizeof(*stat));
+	sd_init_req(&hdr, SD_OP_STAT_RECOVERY);
+	hdr.data_length = sizeof(*stat);
+
+	ret = collie_exec_req(fd, &hdr, stat);
+	close(fd);
+	if (ret) {
+		fprintf(stderr, "failed to connect to  %s:%d\n",
+			host, sd_nodes[idx].nid.port);
+		return -1;
+	}
+
+	return rsp->result;
+}
+
+static void print_recovery_waits(struct recovery_wait_stat *stats)
+{
+	struct recovery_wait_stat total = { 0 };
+	char host[128];
+	int i, j, last = 0;
+
+	for (i = 0; i < sd_nodes_nr; i++) {
+		total.nr_waits += stats[i].nr_waits;
+		for (j = 0; j < SD_NR_WAIT_BUCKETS; j++) {
+			total.buckets[j] += stats[i].buckets[j];
+			if (total.buckets[j])
+				last = max(last, j);
+		}
+	}
+	if (!total.nr_waits)
+		return;
+
+	if (!raw_output) {
+		printf("Requests Blocked On Recovery:\n");
+		printf("  Id   Host:Port         Waits    Avg(ms)    Max(ms)\n");
+	}
+	for (i = 0; i < sd_nodes_nr; i++) {
+		struct recovery_wait_stat *st = stats + i;
+
+		if (!st->nr_waits)
+			continue;
+		addr_to_str(host, sizeof(host), sd_nodes[i].nid.addr,
+			    sd_nodes[i].nid.port);
+		printf(raw_output ? "wait %d %s %" PRIu64 " %.3f %.3f\n" :
+		       "%4d   %-16s%7" PRIu64 "%11.3f%11.3f\n", i, host,
+		       st->nr_waits, (double)st->total_us / st->nr_waits / 1000,
+		       (double)st->max_us / 1000);
+	}
+
+	if (!raw_output)
+		printf("\n  Wait(ms)    Requests\n");
+	for (j = 0; j <= last; j++) {
+		if (j < SD_NR_WAIT_BUCKETS - 1)
+			printf(raw_output ? "bucket <%d %" PRIu64 "\n" :
+			       "  < %-8d%10" PRIu64 "\n", 1 << j,
+			       total.buckets[j]);
+		else
+			printf(raw_output ? "bucket >=%d %" PRIu64 "\n" :
+			       "  >= %-7d%10" PRIu64 "\n", 1 << (j - 1),
+			       total.buckets[j]);
+	}
+}
+
+static void print_request_wakeups(struct recovery_wait_stat *stats)
+{
+	char host[128];
+	int i;
+
+	for (i = 0; i < sd_nodes_nr; i++)
+		if (stats[i].wakeups[SD_WAKEUP_EPOCH] ||
+		    stats[i].wakeups[SD_WAKEUP_OID] ||
+		    stats[i].wakeups[SD_WAKEUP_ALL])
+			break;
+	if (i == sd_nodes_nr)
+		return;
+
+	if (!raw_output) {
+		printf("\nRequest Wakeups:\n");
+		printf("  Id   Host:Port          Epoch     Object"
+		       "        All\n");
+	}
+	for (i = 0; i < sd_nodes_nr; i++) {
+		struct recovery_wait_stat *st = stats + i;
+
+		addr_to_str(host, sizeof(host), sd_nodes[i].nid.addr,
+			    sd_nodes[i].nid.port);
+		printf(raw_output ?
+		       "wakeup %d %s %" PRIu64 " %" PRIu64 " %" PRIu64 "\n" :
+		       "%4d   %-16s%8" PRIu64 "%11" PRIu64 "%11" PRIu64 "\n",
+		       i, host, st->wakeups[SD_WAKEUP_EPOCH],
+		       st->wakeups[SD_WAKEUP_OID], st->wakeups[SD_WAKEUP_ALL]);
+	}
+}
+
+/*
+ * Show the nodes in recovery, or with '-w' the requests which have been
+ * blocked on it, so that scripts get one table either way.
+ */
 static int node_recovery(int argc, char **argv)
 {
+	struct recovery_wait_stat *stats;
 	int i, ret;
 
+	stats = xcalloc(sd_nodes_nr, sizeof(*stats));
+
+	if (node_cmd_data.waits) {
+		for (i = 0; i < sd_nodes_nr; i++)
+			get_recovery_stat(i, stats + i);
+		print_recovery_waits(stats);
+		print_request_wakeups(stats);
+		free(stats);
+		return EXIT_SUCCESS;
+	}
+
 	if (!raw_output) {
 		printf("Nodes In Recovery:\n");
 		printf("  Id   Host:Port         V-Nodes       Zone\n");
@@ -119,14 +251,8 @@ static int node_recovery(int argc, char **argv)
 
 	for (i = 0; i < sd_nodes_nr; i++) {
 		char host[128];
-		struct sd_node_req req;
-
-		addr_to_str(host, sizeof(host), sd_nodes[i].nid.addr, 0);
 
-		sd_init_req((struct sd_req *)&req, SD_OP_STAT_RECOVERY);
-
-		ret = send_light_req_get_response((struct sd_req *)&req, host,
-						  sd_nodes[i].nid.port);
+		ret = get_recovery_stat(i, stats + i);
 		if (ret == SD_RES_NODE_IN_RECOVERY) {
 			addr_to_str(host, sizeof(host),
 					sd_nodes[i].nid.addr, sd_nodes[i].nid.port);
@@ -135,6 +261,7 @@ static int node_recovery(int argc, char **argv)
 				   sd_nodes[i].zone);
 		}
 	}
+	free(stats);
 
 	return EXIT_SUCCESS;
 }
@@ -180,6 +307,395 @@ static int node_cache(int argc, char **argv)
 	return EXIT_SUCCESS;
 }
 
+#define MAX_WQUEUES 256
+
+/* in the order of enum wq_thread_control */
+static const char * const wqueue_types[] = {
+	"ordered", "dynamic", "unlimited", "bounded",
+};
+
+static int node_queue_set(int argc, char **argv)
+{
+	struct wqueue_stat st;
+	struct sd_req hdr;
+	struct sd_rsp *rsp = (struct sd_rsp *)&hdr;
+	const char *name = argv[optind++];
+	int fd, ret;
+
+	if (!argv[optind] || !argv[optind + 1] ||
+	    !is_numeric(argv[optind]) || !is_numeric(argv[optind + 1])) {
+		fprintf(stderr, "Please specify the min and max threads\n");
+		return EXIT_USAGE;
+	}
+
+	memset(&st, 0, sizeof(st));
+	pstrcpy(st.name, sizeof(st.name), name);
+	st.min_threads = strtoul(argv[optind], NULL, 10);
+	st.max_threads = strtoul(argv[optind + 1], NULL, 10);
+
+	fd = connect_to(sdhost, sdport);
+	if (fd < 0)
+		return EXIT_FAILURE;
+
+	sd_init_req(&hdr, SD_OP_SET_WQUEUE);
+	hdr.flags = SD_FLAG_CMD_WRITE;
+	hdr.data_length = sizeof(st);
+
+	ret = collie_exec_req(fd, &hdr, &st);
+	close(fd);
+
+	if (ret) {
+		fprintf(stderr, "Failed to connect\n");
+		return EXIT_FAILURE;
+	}
+
+	if (rsp->result == SD_RES_NO_OBJ) {
+		fprintf(stderr, "No such work queue %s\n", name);
+		return EXIT_FAILURE;
+	}
+	if (rsp->result != SD_RES_SUCCESS) {
+		fprintf(stderr, "Failed to set the threads of %s: %s\n", name,
+			sd_strerror(rsp->result));
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
+
+/*
+ * Without arguments, show the thread pools of the work queues of the node.
+ * With a queue name, bound its threads to the given min and max, 0 for the
+ * default.
+ */
+static int node_queue(int argc, char **argv)
+{
+	struct wqueue_stat *stats, *st;
+	struct sd_req hdr;
+	struct sd_rsp *rsp = (struct sd_rsp *)&hdr;
+	int fd, ret, i, nr;
+	char limit[32], roof[16];
+
+	if (argv[optind])
+		return node_queue_set(argc, argv);
+
+	fd = connect_to(sdhost, sdport);
+	if (fd < 0)
+		return EXIT_FAILURE;
+
+	stats = xcalloc(MAX_WQUEUES, sizeof(*stats));
+	sd_init_req(&hdr, SD_OP_STAT_WQUEUE);
+	hdr.data_length = MAX_WQUEUES * sizeof(*stats);
+
+	ret = collie_exec_req(fd, &hdr, stats);
+	close(fd);
+
+	if (ret) {
+		fprintf(stderr, "Failed to connect\n");
+		ret = EXIT_FAILURE;
+		goto out;
+	}
+	if (rsp->result != SD_RES_SUCCESS) {
+		fprintf(stderr, "Failed to get the work queues: %s\n",
+			sd_strerror(rsp->result));
+		ret = EXIT_FAILURE;
+		goto out;
+	}
+
+	nr = rsp->data_length / sizeof(*stats);
+	if (!raw_output)
+		printf("Name          Type       Threads    Limit      Roof  "
+		       "Pending  Running  Queued      Wait(us) Run(us)  "
+		       "CPU(us)\n");
+	for (i = nr - 1; i >= 0; i--) {
+		st = stats + i;
+		if (st->min_threads || st->max_threads)
+			snprintf(limit, sizeof(limit), "%u-%u",
+				 st->min_threads, st->max_threads);
+		else
+			snprintf(limit, sizeof(limit), "-");
+		if (st->roof == UINT32_MAX)
+			snprintf(roof, sizeof(roof), "-");
+		else
+			snprintf(roof, sizeof(roof), "%u", st->roof);
+		printf(raw_output ?
+		       "%s %s %u %s %s %u %u %"PRIu64" %"PRIu64" %"PRIu64
+		       " %"PRIu64"\n" :
+		       "%-13s %-10s %7u    %-10s %4s %8u %8u  %-11"PRIu64
+		       " %-8"PRIu64" %-8"PRIu64" %"PRIu64"\n",
+		       st->name, st->type < ARRAY_SIZE(wqueue_types) ?
+		       wqueue_types[st->type] : "unknown", st->nr_threads,
+		       limit, roof, st->nr_pending, st->nr_running,
+		       st->nr_queued, st->wait_us, st->run_us, st->cpu_us);
+	}
+	ret = EXIT_SUCCESS;
+out:
+	free(stats);
+	return ret;
+}
+
+#define TRACE_MAX_RECS 65536
+
+static const char * const trace_stage_names[] = {
+	[SD_REQ_STAGE_RX] = "rx",
+	[SD_REQ_STAGE_QUEUED] = "queued",
+	[SD_REQ_STAGE_WORKER] = "worker",
+	[SD_REQ_STAGE_LOCAL_IO] = "local_io",
+	[SD_REQ_STAGE_FORWARD] = "forward",
+	[SD_REQ_STAGE_ACKS] = "acks",
+	[SD_REQ_STAGE_DONE] = "done",
+	[SD_REQ_STAGE_TX] = "tx",
+};
+
+static const char * const trace_op_names[] = {
+	[SD_OP_CREATE_AND_WRITE_OBJ] = "create_and_write",
+	[SD_OP_READ_OBJ] = "read",
+	[SD_OP_WRITE_OBJ] = "write",
+	[SD_OP_REMOVE_OBJ] = "remove",
+	[SD_OP_READ_OBJS] = "read_vec",
+	[SD_OP_WRITE_OBJS] = "write_vec",
+	[SD_OP_DISCARD_OBJ] = "discard",
+	[SD_OP_CREATE_AND_WRITE_PEER] = "create_and_write_peer",
+	[SD_OP_READ_PEER] = "read_peer",
+	[SD_OP_WRITE_PEER] = "write_peer",
+	[SD_OP_REMOVE_PEER] = "remove_peer",
+	[SD_OP_DISCARD_PEER] = "discard_peer",
+	[SD_OP_REMOVE_PEERS] = "remove_peers",
+};
+
+static const char *trace_op_name(uint8_t opcode)
+{
+	static char name[8];
+
+	if (opcode < ARRAY_SIZE(trace_op_names) && trace_op_names[opcode])
+		return trace_op_names[opcode];
+	snprintf(name, sizeof(name), "0x%02x", opcode);
+	return name;
+}
+
+/*
+ * The time spent in each stage of a traced request, from the previous stage
+ * it went through, or SD_REQ_STAGE_NONE.  The stages aren't always in the
+ * order of enum sd_req_stage, e.g. the gateway forwards the writes before its
+ * local I/O.  Return the total time.
+ */
+static uint32_t trace_deltas(const struct sd_req_trace *t,
+			     uint32_t deltas[SD_NR_REQ_STAGES])
+{
+	uint32_t prev = 0, next;
+	int i, st;
+
+	for (i = 0; i < SD_NR_REQ_STAGES; i++)
+		deltas[i] = SD_REQ_STAGE_NONE;
+
+	for (;;) {
+		st = -1;
+		next = SD_REQ_STAGE_NONE;
+		for (i = 0; i < SD_NR_REQ_STAGES; i++) {
+			if (deltas[i] != SD_REQ_STAGE_NONE ||
+			    t->stages[i] == SD_REQ_STAGE_NONE)
+				continue;
+			if (st < 0 || t->stages[i] < next) {
+				st = i;
+				next = t->stages[i];
+			}
+		}
+		if (st < 0)
+			return prev;
+		deltas[st] = next - prev;
+		prev = next;
+	}
+}
+
+static int trace_cmp_op(const void *a, const void *b)
+{
+	const struct sd_req_trace *ta = a, *tb = b;
+
+	return ta->opcode - tb->opcode;
+}
+
+static int cmp_u32(const void *a, const void *b)
+{
+	uint32_t ua = *(const uint32_t *)a, ub = *(const uint32_t *)b;
+
+	return ua < ub ? -1 : ua > ub;
+}
+
+static uint32_t percentile(const uint32_t *sorted, int nr, int pct)
+{
+	return sorted[(nr - 1) * pct / 100];
+}
+
+/*
+ * Show a row for each stage of the requests with the same opcode, with the
+ * median and the 99th percentile of the time spent there, and the average of
+ * it in the slowest 1% of the requests, i.e. where their latency comes from.
+ */
+static void trace_show_op(const struct sd_req_trace *recs, int nr)
+{
+	uint32_t (*deltas)[SD_NR_REQ_STAGES], *totals, *vals, slow;
+	uint64_t sum;
+	const char *name = trace_op_name(recs[0].opcode);
+	int i, st, n, nr_slow;
+
+	deltas = xcalloc(nr, sizeof(*deltas));
+	totals = xcalloc(nr, sizeof(*totals));
+	vals = xcalloc(nr, sizeof(*vals));
+
+	for (i = 0; i < nr; i++)
+		totals[i] = trace_deltas(recs + i, deltas[i]);
+	memcpy(vals, totals, nr * sizeof(*vals));
+	qsort(vals, nr, sizeof(*vals), cmp_u32);
+	slow = percentile(vals, nr, 99);
+
+	for (st = 0; st <= SD_NR_REQ_STAGES; st++) {
+		n = nr_slow = 0;
+		sum = 0;
+		for (i = 0; i < nr; i++) {
+			uint32_t d = st < SD_NR_REQ_STAGES ?
+				deltas[i][st] : totals[i];
+
+			if (d == SD_REQ_STAGE_NONE)
+				continue;
+			vals[n++] = d;
+			if (totals[i] >= slow) {
+				sum += d;
+				nr_slow++;
+			}
+		}
+		if (!n)
+			continue;
+		qsort(vals, n, sizeof(*vals), cmp_u32);
+		printf(raw_output ? "%s %s %d %u %u %"PRIu64"\n" :
+		       "%-22s %-9s %7d %9u %9u %12"PRIu64"\n", name,
+		       st < SD_NR_REQ_STAGES ? trace_stage_names[st] : "total",
+		       n, percentile(vals, n, 50), percentile(vals, n, 99),
+		       nr_slow ? sum / nr_slow : 0);
+	}
+
+	free(vals);
+	free(totals);
+	free(deltas);
+}
+
+/* Show where the time of the requests traced by the node goes */
+static int node_trace(int argc, char **argv)
+{
+	struct sd_req_trace *recs;
+	struct sd_req hdr;
+	struct sd_rsp *rsp = (struct sd_rsp *)&hdr;
+	int fd, ret, i, j, nr;
+
+	fd = connect_to(sdhost, sdport);
+	if (fd < 0)
+		return EXIT_FAILURE;
+
+	recs = xcalloc(TRACE_MAX_RECS, sizeof(*recs));
+	sd_init_req(&hdr, SD_OP_TRACE_READ_REQS);
+	hdr.data_length = TRACE_MAX_RECS * sizeof(*recs);
+
+	ret = collie_exec_req(fd, &hdr, recs);
+	close(fd);
+
+	if (ret) {
+		fprintf(stderr, "Failed to connect\n");
+		ret = EXIT_FAILURE;
+		goto out;
+	}
+	if (rsp->result != SD_RES_SUCCESS) {
+		fprintf(stderr, "Failed to read the traced requests: %s\n",
+			sd_strerror(rsp->result));
+		ret = EXIT_FAILURE;
+		goto out;
+	}
+
+	nr = rsp->data_length / sizeof(*recs);
+	if (!nr) {
+		printf("No traced requests\n");
+		ret = EXIT_SUCCESS;
+		goto out;
+	}
+
+	qsort(recs, nr, sizeof(*recs), trace_cmp_op);
+	if (!raw_output)
+		printf("Op                     Stage       Count   p50(us)   "
+		       "p99(us)  Slow 1%%(us)\n");
+	for (i = 0; i < nr; i = j) {
+		for (j = i + 1; j < nr; j++)
+			if (recs[j].opcode != recs[i].opcode)
+				break;
+		trace_show_op(recs + i, j - i);
+	}
+	ret = EXIT_SUCCESS;
+out:
+	free(recs);
+	return ret;
+}
+
+#define MAX_METRICS 512
+
+/* Show the counters, gauges and latency histograms of the node */
+static int node_stat(int argc, char **argv)
+{
+	struct sd_metric *metrics, *m;
+	struct sd_req hdr;
+	struct sd_rsp *rsp = (struct sd_rsp *)&hdr;
+	int fd, ret, i, nr;
+	char name[SD_METRIC_NAME_LEN + SD_METRIC_LABEL_LEN + 2];
+
+	fd = connect_to(sdhost, sdport);
+	if (fd < 0)
+		return EXIT_FAILURE;
+
+	metrics = xcalloc(MAX_METRICS, sizeof(*metrics));
+	sd_init_req(&hdr, SD_OP_STAT_METRICS);
+	hdr.data_length = MAX_METRICS * sizeof(*metrics);
+
+	ret = collie_exec_req(fd, &hdr, metrics);
+	close(fd);
+
+	if (ret) {
+		fprintf(stderr, "Failed to connect\n");
+		ret = EXIT_FAILURE;
+		goto out;
+	}
+	if (rsp->result != SD_RES_SUCCESS) {
+		fprintf(stderr, "Failed to get the metrics: %s\n",
+			sd_strerror(rsp->result));
+		ret = EXIT_FAILURE;
+		goto out;
+	}
+
+	nr = rsp->data_length / sizeof(*metrics);
+	if (!raw_output)
+		printf("Name                            Value      Avg(us)  "
+		       "p50(us)  p99(us)  Max(us)\n");
+	for (i = 0; i < nr; i++) {
+		m = metrics + i;
+		if (m->label[0])
+			snprintf(name, sizeof(name), "%s/%s", m->name,
+				 m->label);
+		else
+			snprintf(name, sizeof(name), "%s", m->name);
+
+		if (m->type != SD_METRIC_HISTOGRAM) {
+			printf(raw_output ? "%s %"PRIu64"\n" :
+			       "%-31s %-10"PRIu64"\n", name, m->value);
+			continue;
+		}
+		printf(raw_output ?
+		       "%s %"PRIu64" %"PRIu64" %"PRIu64" %"PRIu64" %"PRIu64
+		       "\n" :
+		       "%-31s %-10"PRIu64" %-8"PRIu64" %-8"PRIu64" %-8"PRIu64
+		       " %"PRIu64"\n", name, m->value,
+		       m->value ? m->sum / m->value : 0, m->p50, m->p99,
+		       m->max);
+	}
+	ret = EXIT_SUCCESS;
+out:
+	free(metrics);
+	return ret;
+}
+
 static int node_kill(int argc, char **argv)
 {
 	char host[128];
@@ -220,14 +736,34 @@ static struct subcommand node_cmd[] = {
 	 SUBCMD_FLAG_NEED_NODELIST, node_list},
 	{"info", NULL, "aprh", "show information about each node", NULL,
 	 SUBCMD_FLAG_NEED_NODELIST, node_info},
-	{"recovery", NULL, "aprh", "show nodes in recovery", NULL,
-	 SUBCMD_FLAG_NEED_NODELIST, node_recovery},
+	{"recovery", NULL, "aprwh", "show nodes in recovery", NULL,
+	 SUBCMD_FLAG_NEED_NODELIST, node_recovery, node_options},
 	{"cache", "<cache size>", "aprh", "specify max cache size", NULL,
 	 SUBCMD_FLAG_NEED_THIRD_ARG, node_cache},
+	{"queue", "[<queue> <min> <max>]", "aprh",
+	 "show or bound the threads of the work queues", NULL, 0, node_queue},
+	{"trace", NULL, "aprh",
+	 "show where the time of the sampled requests goes", NULL, 0,
+	 node_trace},
+	{"stat", NULL, "aprh",
+	 "show the counters and the latencies of the node", NULL, 0,
+	 node_stat},
 	{NULL,},
 };
 
+static int node_parser(int ch, char *opt)
+{
+	switch (ch) {
+	case 'w':
+		node_cmd_data.waits = true;
+		break;
+	}
+
+	return 0;
+}
+
 struct command node_command = {
 	"node",
 	node_cmd,
+	node_parser
 };
@@ -18,6 +18,13 @@
 
 #include "collie.h"
 #include "treeview.h"
+#include "fec.h"
+#include "sha1.h"
+
+/* upper bound of the objects that read, write, etc. keep in flight */
+#define VDI_MAX_PARALLEL 64
+/* default number of objects whose replicas check compares at once */
+#define VDI_CHECK_PARALLEL 16
 
 static struct sd_option vdi_options[] = {
 	{'P', "prealloc", false, "preallocate all the data objects"},
@@ -28,6 +35,10 @@ static struct sd_option vdi_options[] = {
 	{'w', "writeback", false, "use writeback mode"},
 	{'c', "copies", true, "specify the data redundancy (number of copies)"},
 	{'F', "from", true, "create a differential backup from the snapshot"},
+	{'z', "compress", false, "compress the cold data objects"},
+	{'n', "parallel", true, "number of object requests kept in flight"},
+	{'o', "object_size", true, "specify the size of the data objects, "
+	 "a power of two from 1M to 64M"},
 	{ 0, NULL, false, NULL },
 };
 
@@ -42,46 +53,26 @@ static struct vdi_cmd_data {
 	bool writeback;
 	int from_snapshot_id;
 	char from_snapshot_tag[SD_MAX_VDI_TAG_LEN];
+	uint16_t copy_policy;
+	int nr_parallel;
+	uint8_t block_size_shift;
 } vdi_cmd_data = { ~0, };
 
+/* the number of requests kept in flight, 'def' unless specified with '-n' */
+static int get_nr_parallel(int def)
+{
+	return vdi_cmd_data.nr_parallel ? vdi_cmd_data.nr_parallel : def;
+}
+
 struct get_vdi_info {
 	const char *name;
 	const char *tag;
 	uint32_t vid;
 	uint32_t snapid;
 	uint8_t nr_copies;
+	uint32_t objsize;
 };
 
-static int parse_option_size(const char *value, uint64_t *ret)
-{
-	char *postfix;
-	double sizef;
-
-	sizef = strtod(value, &postfix);
-	switch (*postfix) {
-	case 'T':
-		sizef *= 1024;
-	case 'G':
-		sizef *= 1024;
-	case 'M':
-		sizef *= 1024;
-	case 'K':
-	case 'k':
-		sizef *= 1024;
-	case 'b':
-	case '\0':
-		*ret = (uint64_t) sizef;
-		break;
-	default:
-		fprintf(stderr, "Invalid size '%s'\n", value);
-		fprintf(stderr, "You may use k, M, G or T suffixes for "
-			"kilobytes, megabytes, gigabytes and terabytes.\n");
-		return -1;
-	}
-
-	return 0;
-}
-
 static void print_vdi_list(uint32_t vid, const char *name, const char *tag,
 			   uint32_t snapid, uint32_t flags,
 			   const struct sheepdog_inode *i, void *data)
@@ -119,8 +110,10 @@ static void print_vdi_list(uint32_t vid, const char *name, const char *tag,
 	}
 
 	size_to_str(i->vdi_size, vdi_size_str, sizeof(vdi_size_str));
-	size_to_str(my_objs * SD_DATA_OBJ_SIZE, my_objs_str, sizeof(my_objs_str));
-	size_to_str(cow_objs * SD_DATA_OBJ_SIZE, cow_objs_str, sizeof(cow_objs_str));
+	size_to_str(my_objs * get_inode_objsize(i), my_objs_str,
+		    sizeof(my_objs_str));
+	size_to_str(cow_objs * get_inode_objsize(i), cow_objs_str,
+		    sizeof(cow_objs_str));
 
 	if (i->snap_id == 1 && i->parent_vdi_id != 0)
 		is_clone = true;
@@ -210,17 +203,20 @@ static void get_oid(uint32_t vid, const char *name, const char *tag,
 			    !strcmp(tag, info->tag)) {
 				info->vid = vid;
 			info->nr_copies = i->nr_copies;
+			info->objsize = get_inode_objsize(i);
 			}
 		} else if (info->snapid) {
 			if (!strcmp(name, info->name) &&
 			    snapid == info->snapid) {
 				info->vid = vid;
 				info->nr_copies = i->nr_copies;
+				info->objsize = get_inode_objsize(i);
 			}
 		} else {
 			if (!strcmp(name, info->name)) {
 				info->vid = vid;
 				info->nr_copies = i->nr_copies;
+				info->objsize = get_inode_objsize(i);
 			}
 		}
 	}
@@ -427,9 +423,8 @@ out:
 	return ret;
 }
 
-static int read_vdi_obj(const char *vdiname, int snapid, const char *tag,
-			uint32_t *pvid, struct sheepdog_inode *inode,
-			size_t size)
+int read_vdi_obj(const char *vdiname, int snapid, const char *tag,
+		 uint32_t *pvid, struct sheepdog_inode *inode, size_t size)
 {
 	int ret;
 	uint32_t vid;
@@ -486,6 +481,10 @@ static int do_vdi_create(const char *vdiname, int64_t vdi_size,
 	hdr.vdi.snapid = snapshot ? 1 : 0;
 	hdr.vdi.vdi_size = roundup(vdi_size, 512);
 	hdr.vdi.copies = nr_copies;
+	/* 0 keeps the policy of the base VDI */
+	hdr.vdi.copy_policy = vdi_cmd_data.copy_policy;
+	/* the object size of a snapshot or a clone is always the base's */
+	hdr.vdi.block_size_shift = vdi_cmd_data.block_size_shift;
 
 	ret = collie_exec_req(fd, &hdr, buf);
 
@@ -516,6 +515,7 @@ static int vdi_create(int argc, char **argv)
 	uint64_t oid;
 	int idx, max_idx, ret, nr_copies = vdi_cmd_data.nr_copies;
 	struct sheepdog_inode *inode = NULL;
+	uint32_t objsize;
 
 	if (!argv[optind]) {
 		fprintf(stderr, "Please specify the VDI size\n");
@@ -524,7 +524,8 @@ static int vdi_create(int argc, char **argv)
 	ret = parse_option_size(argv[optind], &size);
 	if (ret < 0)
 		return EXIT_USAGE;
-	if (size > SD_MAX_VDI_SIZE) {
+	objsize = block_size_shift_to_objsize(vdi_cmd_data.block_size_shift);
+	if (size > (uint64_t)objsize * MAX_DATA_OBJS) {
 		fprintf(stderr, "VDI size is too large\n");
 		return EXIT_USAGE;
 	}
@@ -548,7 +549,7 @@ static int vdi_create(int argc, char **argv)
 		ret = EXIT_FAILURE;
 		goto out;
 	}
-	max_idx = DIV_ROUND_UP(size, SD_DATA_OBJ_SIZE);
+	max_idx = DIV_ROUND_UP(size, objsize);
 
 	for (idx = 0; idx < max_idx; idx++) {
 		oid = vid_to_data_oid(vid, idx);
@@ -611,6 +612,7 @@ static int vdi_clone(int argc, char **argv)
 	uint64_t oid;
 	int idx, max_idx, ret;
 	struct sheepdog_inode *inode = NULL;
+	uint32_t objsize;
 	char *buf = NULL;
 
 	dst_vdi = argv[optind];
@@ -640,22 +642,23 @@ static int vdi_clone(int argc, char **argv)
 	if (ret != EXIT_SUCCESS || !vdi_cmd_data.prealloc)
 		goto out;
 
-	buf = xzalloc(SD_DATA_OBJ_SIZE);
-	max_idx = DIV_ROUND_UP(inode->vdi_size, SD_DATA_OBJ_SIZE);
+	objsize = get_inode_objsize(inode);
+	buf = xzalloc(objsize);
+	max_idx = DIV_ROUND_UP(inode->vdi_size, objsize);
 
 	for (idx = 0; idx < max_idx; idx++) {
 		if (inode->data_vdi_id[idx]) {
 			oid = vid_to_data_oid(inode->data_vdi_id[idx], idx);
-			ret = sd_read_object(oid, buf, SD_DATA_OBJ_SIZE, 0, true);
+			ret = sd_read_object(oid, buf, objsize, 0, true);
 			if (ret) {
 				ret = EXIT_FAILURE;
 				goto out;
 			}
 		} else
-			memset(buf, 0, SD_DATA_OBJ_SIZE);
+			memset(buf, 0, objsize);
 
 		oid = vid_to_data_oid(new_vid, idx);
-		ret = sd_write_object(oid, 0, buf, SD_DATA_OBJ_SIZE, 0, 0,
+		ret = sd_write_object(oid, 0, buf, objsize, 0, 0,
 				      inode->nr_copies, true, true);
 		if (ret != SD_RES_SUCCESS) {
 			ret = EXIT_FAILURE;
@@ -693,15 +696,17 @@ static int vdi_resize(int argc, char **argv)
 	ret = parse_option_size(argv[optind], &new_size);
 	if (ret < 0)
 		return EXIT_USAGE;
-	if (new_size > SD_MAX_VDI_SIZE) {
-		fprintf(stderr, "New VDI size is too large\n");
-		return EXIT_USAGE;
-	}
 
 	ret = read_vdi_obj(vdiname, 0, "", &vid, inode, SD_INODE_HEADER_SIZE);
 	if (ret != EXIT_SUCCESS)
 		return ret;
 
+	if (new_size > (uint64_t)block_size_shift_to_objsize(
+			inode->block_size_shift) * MAX_DATA_OBJS) {
+		fprintf(stderr, "New VDI size is too large\n");
+		return EXIT_USAGE;
+	}
+
 	if (new_size < inode->vdi_size) {
 		fprintf(stderr, "Shrinking VDIs is not implemented\n");
 		return EXIT_USAGE;
@@ -848,7 +853,8 @@ static int vdi_object(int argc, char **argv)
 			exit(EXIT_FAILURE);
 		}
 
-		parse_objs(vid_to_vdi_oid(vid), get_data_oid, &oid_info, SD_DATA_OBJ_SIZE);
+		parse_objs(vid_to_vdi_oid(vid), get_data_oid, &oid_info,
+			   info.objsize);
 
 		if (oid_info.success) {
 			if (oid_info.data_oid) {
@@ -856,7 +862,8 @@ static int vdi_object(int argc, char **argv)
 				       " (the inode vid 0x%" PRIx32 " idx %u) with %d nodes\n\n",
 				       oid_info.data_oid, vid, idx, sd_nodes_nr);
 
-				parse_objs(oid_info.data_oid, do_print_obj, NULL, SD_DATA_OBJ_SIZE);
+				parse_objs(oid_info.data_oid, do_print_obj,
+					   NULL, info.objsize);
 			} else
 				printf("The inode object 0x%" PRIx32 " idx %u is not allocated\n",
 				       vid, idx);
@@ -918,9 +925,11 @@ static int do_track_object(uint64_t oid, uint8_t nr_copies)
 			}
 			continue;
 		}
-		vnodes_nr = nodes_to_vnodes(logs[i].nodes,
-					    logs[i].nr_nodes, vnodes);
-		oid_to_vnodes(vnodes, vnodes_nr, oid, nr_copies, vnode_buf);
+		vnodes_nr = placement_nodes_to_vnodes(logs[i].placement,
+						      logs[i].nodes,
+						      logs[i].nr_nodes, vnodes);
+		placement_oid_to_vnodes(logs[i].placement, vnodes, vnodes_nr,
+					oid, nr_copies, vnode_buf);
 		for (j = 0; j < nr_copies; j++) {
 			addr_to_str(host, sizeof(host), vnode_buf[j]->nid.addr,
 				    vnode_buf[j]->nid.port);
@@ -977,7 +986,7 @@ static int vdi_track(int argc, char **argv)
 	}
 
 	parse_objs(vid_to_vdi_oid(vid), get_data_oid,
-		   &oid_info, SD_DATA_OBJ_SIZE);
+		   &oid_info, info.objsize);
 
 	if (!oid_info.success) {
 		fprintf(stderr, "Failed to read the inode object 0x%"PRIx32"\n",
@@ -1159,14 +1168,186 @@ static int vdi_getattr(int argc, char **argv)
 	return EXIT_SUCCESS;
 }
 
+static int vdi_qos_req(uint8_t opcode, struct sd_vdi_qos *qos)
+{
+	struct sd_req hdr;
+	struct sd_rsp *rsp = (struct sd_rsp *)&hdr;
+	int fd, ret;
+
+	fd = connect_to(sdhost, sdport);
+	if (fd < 0)
+		return SD_RES_EIO;
+
+	sd_init_req(&hdr, opcode);
+	hdr.data_length = sizeof(*qos);
+	if (opcode == SD_OP_GET_VDI_QOS)
+		hdr.vdi.base_vdi_id = qos->vid;
+	else
+		hdr.flags = SD_FLAG_CMD_WRITE;
+
+	ret = collie_exec_req(fd, &hdr, qos);
+	close(fd);
+
+	return ret ? SD_RES_EIO : rsp->result;
+}
+
+/*
+ * Show the I/O limits of the VDI, or set those given as iops=N, bps=N and
+ * weight=N, leaving the others as they are.
+ */
+static int vdi_qos(int argc, char **argv)
+{
+	const char *vdiname = argv[optind++];
+	char value[SD_MAX_VDI_ATTR_VALUE_LEN], bps_str[16], *arg, *p;
+	struct sd_vdi_qos qos;
+	uint32_t vid, nr_copies, weight;
+	uint64_t oid, bps;
+	int ret;
+
+	ret = find_vdi_name(vdiname, 0, "", &vid, 0);
+	if (ret < 0)
+		return EXIT_MISSING;
+
+	memset(&qos, 0, sizeof(qos));
+	qos.vid = vid;
+	ret = vdi_qos_req(SD_OP_GET_VDI_QOS, &qos);
+	if (ret != SD_RES_SUCCESS) {
+		fprintf(stderr, "Failed to get the limits: %s\n",
+			sd_strerror(ret));
+		return EXIT_FAILURE;
+	}
+
+	if (!argv[optind]) {
+		weight = qos.weight ? : SD_QOS_DEFAULT_WEIGHT;
+		if (raw_output) {
+			printf("%"PRIu32" %"PRIu64" %"PRIu32"\n", qos.iops,
+			       qos.bps, weight);
+			return EXIT_SUCCESS;
+		}
+		if (qos.iops)
+			printf("IOPS: %"PRIu32"\n", qos.iops);
+		else
+			printf("IOPS: unlimited\n");
+		if (qos.bps)
+			printf("Bandwidth: %s/s\n",
+			       size_to_str(qos.bps, bps_str, sizeof(bps_str)));
+		else
+			printf("Bandwidth: unlimited\n");
+		printf("Weight: %"PRIu32"\n", weight);
+		return EXIT_SUCCESS;
+	}
+
+	while ((arg = argv[optind++])) {
+		if (!strncmp(arg, "iops=", 5)) {
+			qos.iops = strtoul(arg + 5, &p, 10);
+			if (p == arg + 5 || *p)
+				goto invalid;
+		} else if (!strncmp(arg, "bps=", 4)) {
+			if (parse_option_size(arg + 4, &bps) < 0)
+				return EXIT_USAGE;
+			qos.bps = bps;
+		} else if (!strncmp(arg, "weight=", 7)) {
+			qos.weight = strtoul(arg + 7, &p, 10);
+			if (p == arg + 7 || *p)
+				goto invalid;
+		} else
+			goto invalid;
+	}
+
+	snprintf(value, sizeof(value), "iops=%"PRIu32" bps=%"PRIu64
+		 " weight=%"PRIu32, qos.iops, qos.bps, qos.weight);
+	ret = find_vdi_attr_oid(vdiname, "", 0, SD_QOS_ATTR_KEY, value,
+				strlen(value), &vid, &oid, &nr_copies, true,
+				false, false);
+	if (ret != SD_RES_SUCCESS) {
+		fprintf(stderr, "Failed to save the limits: %s\n",
+			sd_strerror(ret));
+		return EXIT_FAILURE;
+	}
+
+	qos.vid = vid;
+	ret = vdi_qos_req(SD_OP_NOTIFY_VDI_QOS, &qos);
+	if (ret != SD_RES_SUCCESS) {
+		fprintf(stderr, "Failed to notify the limits: %s\n",
+			sd_strerror(ret));
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+invalid:
+	fprintf(stderr, "Invalid limit '%s', use iops=N, bps=N or "
+		"weight=N\n", arg);
+	return EXIT_USAGE;
+}
+
+/* number of objects read with one vectored request */
+#define VDI_READ_BATCH 4
+
+struct read_batch {
+	char *buf;		/* the vector entries, followed by the data */
+	int nr;			/* number of objects */
+	int nr_vec;		/* number of allocated objects */
+	unsigned int len[VDI_READ_BATCH];
+	bool allocated[VDI_READ_BATCH];
+};
+
+static char *zero_obj;
+
+/* write the data of a batch to stdout, in the order of the batches */
+static int vdi_read_done(struct sd_pipe_req *req, void *arg)
+{
+	struct read_batch *batch = (struct read_batch *)arg + req->idx;
+	struct sd_rsp *rsp = (struct sd_rsp *)&req->hdr;
+	struct sd_vec_entry *vec = (struct sd_vec_entry *)batch->buf;
+	unsigned int remain;
+	char *p, *out;
+	int i, ret;
+
+	if (batch->nr_vec && rsp->result != SD_RES_SUCCESS) {
+		for (i = 0; i < batch->nr_vec; i++)
+			if (vec[i].result != SD_RES_SUCCESS)
+				fprintf(stderr, "Failed to read object %" PRIx64
+					" %s\n", vec[i].oid,
+					sd_strerror(vec[i].result));
+		fprintf(stderr, "Failed to read VDI\n");
+		return EXIT_FAILURE;
+	}
+
+	p = batch->buf + batch->nr_vec * sizeof(*vec);
+	for (i = 0; i < batch->nr; i++) {
+		if (batch->allocated[i]) {
+			out = p;
+			p += batch->len[i];
+		} else
+			out = zero_obj;
+
+		remain = batch->len[i];
+		while (remain) {
+			ret = write(STDOUT_FILENO,
+				    out + (batch->len[i] - remain), remain);
+			if (ret < 0) {
+				fprintf(stderr, "Failed to write to "
+					"stdout: %m\n");
+				return EXIT_SYSFAIL;
+			}
+			remain -= ret;
+		}
+	}
+
+	return EXIT_SUCCESS;
+}
+
 static int vdi_read(int argc, char **argv)
 {
 	const char *vdiname = argv[optind++];
-	int ret, idx;
+	int ret, idx, i, nr, nr_vec, depth = get_nr_parallel(1);
 	struct sheepdog_inode *inode = NULL;
-	uint64_t offset = 0, oid, done = 0, total = (uint64_t) -1;
-	unsigned int len, remain;
-	char *buf = NULL;
+	struct sd_vec_entry *vec;
+	struct read_batch *batches, *batch;
+	struct sd_pipe *pipe;
+	struct sd_pipe_req *req;
+	uint64_t offset = 0, done = 0, pos, total = (uint64_t) -1;
+	unsigned int datalen, objsize;
 
 	if (argv[optind]) {
 		ret = parse_option_size(argv[optind++], &offset);
@@ -1183,14 +1364,21 @@ static int vdi_read(int argc, char **argv)
 		}
 	}
 
-	inode = malloc(sizeof(*inode));
-	buf = xmalloc(SD_DATA_OBJ_SIZE);
-
+	inode = xmalloc(sizeof(*inode));
 	ret = read_vdi_obj(vdiname, vdi_cmd_data.snapshot_id,
 			   vdi_cmd_data.snapshot_tag, NULL, inode,
 			   SD_INODE_SIZE);
-	if (ret != EXIT_SUCCESS)
-		goto out;
+	if (ret != EXIT_SUCCESS) {
+		free(inode);
+		return ret;
+	}
+
+	objsize = get_inode_objsize(inode);
+	batches = xzalloc(sizeof(*batches) * depth);
+	for (i = 0; i < depth; i++)
+		batches[i].buf = xmalloc(VDI_READ_BATCH *
+					 (sizeof(*vec) + objsize));
+	zero_obj = xzalloc(objsize);
 
 	if (inode->vdi_size < offset) {
 		fprintf(stderr, "Read offset is beyond the end of the VDI\n");
@@ -1198,58 +1386,131 @@ static int vdi_read(int argc, char **argv)
 		goto out;
 	}
 
+	pipe = sd_pipe_open(depth, vdi_read_done, batches);
+	if (!pipe) {
+		ret = EXIT_SYSFAIL;
+		goto out;
+	}
+
 	total = min(total, inode->vdi_size - offset);
 	total = roundup(total, 512);
-	idx = offset / SD_DATA_OBJ_SIZE;
-	offset %= SD_DATA_OBJ_SIZE;
+	idx = offset / objsize;
+	offset %= objsize;
 	while (done < total) {
-		len = min(total - done, SD_DATA_OBJ_SIZE - offset);
-
-		if (inode->data_vdi_id[idx]) {
-			oid = vid_to_data_oid(inode->data_vdi_id[idx], idx);
-			ret = sd_read_object(oid, buf, len, offset, false);
-			if (ret != SD_RES_SUCCESS) {
-				fprintf(stderr, "Failed to read VDI\n");
-				ret = EXIT_FAILURE;
-				goto out;
-			}
-		} else
-			memset(buf, 0, len);
-
-		remain = len;
-		while (remain) {
-			ret = write(STDOUT_FILENO, buf + (len - remain), len);
-			if (ret < 0) {
-				fprintf(stderr, "Failed to write to stdout: %m\n");
-				ret = EXIT_SYSFAIL;
-				goto out;
+		req = sd_pipe_get(pipe);
+		if (!req)
+			break;
+		batch = batches + req->idx;
+		vec = (struct sd_vec_entry *)batch->buf;
+
+		/* read the allocated objects of the next batch at once */
+		pos = done;
+		datalen = 0;
+		nr_vec = 0;
+		for (nr = 0; nr < VDI_READ_BATCH && pos < total; nr++) {
+			batch->len[nr] = min(total - pos, objsize - offset);
+			batch->allocated[nr] = !!inode->data_vdi_id[idx + nr];
+			if (batch->allocated[nr]) {
+				memset(vec + nr_vec, 0, sizeof(*vec));
+				vec[nr_vec].oid = vid_to_data_oid(
+					inode->data_vdi_id[idx + nr], idx + nr);
+				vec[nr_vec].offset = offset;
+				vec[nr_vec].length = batch->len[nr];
+				vec[nr_vec].result = SD_RES_SUCCESS;
+				datalen += batch->len[nr];
+				nr_vec++;
 			}
-			remain -= ret;
+			offset = 0;
+			pos += batch->len[nr];
 		}
+		batch->nr = nr;
+		batch->nr_vec = nr_vec;
+
+		if (nr_vec) {
+			sd_init_req(&req->hdr, SD_OP_READ_OBJS);
+			req->hdr.data_length = datalen + nr_vec * sizeof(*vec);
+			req->hdr.vec.nr = nr_vec;
+			req->data = batch->buf;
+		}
+		if (sd_pipe_submit(pipe, req))
+			break;
 
-		offset = 0;
-		idx++;
-		done += len;
+		idx += nr;
+		done = pos;
 	}
-	fsync(STDOUT_FILENO);
-	ret = EXIT_SUCCESS;
+	ret = sd_pipe_close(pipe);
+	if (ret == EXIT_SUCCESS)
+		fsync(STDOUT_FILENO);
 out:
 	free(inode);
-	free(buf);
+	for (i = 0; i < depth; i++)
+		free(batches[i].buf);
+	free(batches);
+	free(zero_obj);
 
 	return ret;
 }
 
+struct write_slot {
+	char *buf;
+	int idx;		/* index of the data object */
+	bool create;
+};
+
+struct vdi_write_info {
+	struct write_slot *slots;
+	uint32_t vid;
+	uint32_t flags;
+	int nr_copies;
+};
+
+/*
+ * The created data objects are linked to the inode by the gateway, see
+ * SD_FLAG_CMD_LINK.  A gateway which doesn't know the flag doesn't echo it,
+ * and then the slot is written here.
+ */
+static int vdi_write_done(struct sd_pipe_req *req, void *arg)
+{
+	struct vdi_write_info *info = arg;
+	struct write_slot *slot = info->slots + req->idx;
+	struct sd_rsp *rsp = (struct sd_rsp *)&req->hdr;
+	int ret;
+
+	if (rsp->result != SD_RES_SUCCESS) {
+		fprintf(stderr, "Failed to write object %" PRIx64 ": %s\n",
+			vid_to_data_oid(info->vid, slot->idx),
+			sd_strerror(rsp->result));
+		fprintf(stderr, "Failed to write VDI\n");
+		return EXIT_FAILURE;
+	}
+
+	if (slot->create && !(rsp->flags & SD_FLAG_CMD_LINK)) {
+		ret = sd_write_object(vid_to_vdi_oid(info->vid), 0, &info->vid,
+				      sizeof(info->vid),
+				      SD_INODE_HEADER_SIZE +
+				      sizeof(info->vid) * slot->idx,
+				      info->flags, info->nr_copies, false,
+				      false);
+		if (ret)
+			return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
+
 static int vdi_write(int argc, char **argv)
 {
 	const char *vdiname = argv[optind++];
-	uint32_t vid, flags;
-	int ret, idx;
+	uint32_t vid, flags = 0;
+	int ret, idx, i, depth = get_nr_parallel(1);
 	struct sheepdog_inode *inode = NULL;
-	uint64_t offset = 0, oid, old_oid, done = 0, total = (uint64_t) -1;
-	unsigned int len, remain;
-	char *buf = NULL;
-	bool create;
+	uint64_t offset = 0, old_oid, done = 0, total = (uint64_t) -1;
+	unsigned int len, remain, objsize;
+	struct vdi_write_info info;
+	struct write_slot *slot;
+	struct sd_pipe *pipe;
+	struct sd_pipe_req *req;
+	char *buf;
 
 	if (argv[optind]) {
 		ret = parse_option_size(argv[optind++], &offset);
@@ -1267,11 +1528,16 @@ static int vdi_write(int argc, char **argv)
 	}
 
 	inode = xmalloc(sizeof(*inode));
-	buf = xmalloc(SD_DATA_OBJ_SIZE);
-
 	ret = read_vdi_obj(vdiname, 0, "", &vid, inode, SD_INODE_SIZE);
-	if (ret != EXIT_SUCCESS)
-		goto out;
+	if (ret != EXIT_SUCCESS) {
+		free(inode);
+		return ret;
+	}
+
+	objsize = get_inode_objsize(inode);
+	info.slots = xzalloc(sizeof(*info.slots) * depth);
+	for (i = 0; i < depth; i++)
+		info.slots[i].buf = xmalloc(objsize);
 
 	if (inode->vdi_size < offset) {
 		fprintf(stderr, "Write offset is beyond the end of the VDI\n");
@@ -1279,40 +1545,54 @@ static int vdi_write(int argc, char **argv)
 		goto out;
 	}
 
+	if (vdi_cmd_data.writeback)
+		flags |= SD_FLAG_CMD_CACHE;
+
+	info.vid = vid;
+	info.flags = flags;
+	info.nr_copies = inode->nr_copies;
+	pipe = sd_pipe_open(depth, vdi_write_done, &info);
+	if (!pipe) {
+		ret = EXIT_SYSFAIL;
+		goto out;
+	}
+
 	total = min(total, inode->vdi_size - offset);
 	total = roundup(total, 512);
-	idx = offset / SD_DATA_OBJ_SIZE;
-	offset %= SD_DATA_OBJ_SIZE;
+	idx = offset / objsize;
+	offset %= objsize;
 	while (done < total) {
-		create = false;
+		req = sd_pipe_get(pipe);
+		if (!req)
+			break;
+		slot = info.slots + req->idx;
+		buf = slot->buf;
+
+		slot->idx = idx;
+		slot->create = false;
 		old_oid = 0;
-		flags = 0;
-		len = min(total - done, SD_DATA_OBJ_SIZE - offset);
+		len = min(total - done, objsize - offset);
 
 		if (!inode->data_vdi_id[idx])
-			create = true;
+			slot->create = true;
 		else if (!is_data_obj_writeable(inode, idx)) {
-			create = true;
+			slot->create = true;
 			old_oid = vid_to_data_oid(inode->data_vdi_id[idx], idx);
 		}
 
-		if (vdi_cmd_data.writeback)
-			flags |= SD_FLAG_CMD_CACHE;
-
 		remain = len;
 		while (remain > 0) {
 			ret = read(STDIN_FILENO, buf + (len - remain), remain);
 			if (ret == 0) {
-				if (len == remain) {
-					ret = EXIT_SUCCESS;
-					goto out;
-				}
+				if (len == remain)
+					goto drain;
 				/* exit after this buffer is sent */
 				memset(buf + (len - remain), 0, remain);
 				total = done + len;
 				break;
 			} else if (ret < 0) {
 				fprintf(stderr, "Failed to read from stdin: %m\n");
+				sd_pipe_close(pipe);
 				ret = EXIT_SYSFAIL;
 				goto out;
 			}
@@ -1320,49 +1600,50 @@ static int vdi_write(int argc, char **argv)
 		}
 
 		inode->data_vdi_id[idx] = inode->vdi_id;
-		oid = vid_to_data_oid(inode->data_vdi_id[idx], idx);
-		ret = sd_write_object(oid, old_oid, buf, len, offset, flags,
-				      inode->nr_copies, create, false);
-		if (ret != SD_RES_SUCCESS) {
-			fprintf(stderr, "Failed to write VDI\n");
-			ret = EXIT_FAILURE;
-			goto out;
-		}
-
-		if (create) {
-			ret = sd_write_object(vid_to_vdi_oid(vid), 0, &vid, sizeof(vid),
-					      SD_INODE_HEADER_SIZE + sizeof(vid) * idx,
-					      flags, inode->nr_copies, false, false);
-			if (ret) {
-				ret = EXIT_FAILURE;
-				goto out;
-			}
-		}
+		if (slot->create)
+			sd_init_req(&req->hdr, SD_OP_CREATE_AND_WRITE_OBJ);
+		else
+			sd_init_req(&req->hdr, SD_OP_WRITE_OBJ);
+		req->hdr.data_length = len;
+		req->hdr.flags = flags | SD_FLAG_CMD_WRITE;
+		if (slot->create)
+			req->hdr.flags |= SD_FLAG_CMD_LINK;
+		if (old_oid)
+			req->hdr.flags |= SD_FLAG_CMD_COW;
+		req->hdr.obj.copies = inode->nr_copies;
+		req->hdr.obj.oid = vid_to_data_oid(inode->vdi_id, idx);
+		req->hdr.obj.cow_oid = old_oid;
+		req->hdr.obj.offset = offset;
+		req->data = buf;
+		if (sd_pipe_submit(pipe, req))
+			break;
 
 		offset += len;
-		if (offset == SD_DATA_OBJ_SIZE) {
+		if (offset == objsize) {
 			offset = 0;
 			idx++;
 		}
 		done += len;
 	}
-	ret = EXIT_SUCCESS;
+drain:
+	ret = sd_pipe_close(pipe);
 out:
 	free(inode);
-	free(buf);
+	for (i = 0; i < depth; i++)
+		free(info.slots[i].buf);
+	free(info.slots);
 
 	return ret;
 }
 
-static void *read_object_from(const struct sd_vnode *vnode, uint64_t oid)
+static void write_object_to(const struct sd_vnode *vnode, uint64_t oid,
+			    void *buf, uint32_t len, uint8_t ec_index,
+			    bool create)
 {
 	struct sd_req hdr;
 	struct sd_rsp *rsp = (struct sd_rsp *)&hdr;
 	int fd, ret;
 	char name[128];
-	void *buf;
-
-	buf = xmalloc(SD_DATA_OBJ_SIZE);
 
 	addr_to_str(name, sizeof(name), vnode->nid.addr, 0);
 	fd = connect_to(name, vnode->nid.port);
@@ -1372,12 +1653,15 @@ static void *read_object_from(const struct sd_vnode *vnode, uint64_t oid)
 		exit(EXIT_FAILURE);
 	}
 
-	sd_init_req(&hdr, SD_OP_READ_PEER);
+	if (create)
+		sd_init_req(&hdr, SD_OP_CREATE_AND_WRITE_PEER);
+	else
+		sd_init_req(&hdr, SD_OP_WRITE_PEER);
 	hdr.epoch = sd_epoch;
-	hdr.flags = 0;
-	hdr.data_length = SD_DATA_OBJ_SIZE;
-
+	hdr.flags = SD_FLAG_CMD_WRITE;
+	hdr.data_length = len;
 	hdr.obj.oid = oid;
+	hdr.obj.ec_index = ec_index;
 
 	ret = collie_exec_req(fd, &hdr, buf);
 	close(fd);
@@ -1387,105 +1671,294 @@ static void *read_object_from(const struct sd_vnode *vnode, uint64_t oid)
 		exit(EXIT_FAILURE);
 	}
 
-	switch (rsp->result)  {
-	case SD_RES_SUCCESS:
-		untrim_zero_sectors(buf, rsp->obj.offset, rsp->data_length,
-				    SD_DATA_OBJ_SIZE);
-		break;
-	case SD_RES_NO_OBJ:
-		free(buf);
-		return NULL;
-	default:
-		fprintf(stderr, "FATAL: failed to read, %s\n",
+	if (rsp->result != SD_RES_SUCCESS) {
+		fprintf(stderr, "FATAL: failed to write, %s\n",
 			sd_strerror(rsp->result));
 		exit(EXIT_FAILURE);
 	}
-	return buf;
 }
 
-static void write_object_to(const struct sd_vnode *vnode, uint64_t oid,
-			    void *buf, bool create)
+/*
+ * The node list only tells the ring layout, so ask the cluster which
+ * placement engine it was formatted with before locating the replicas.
+ */
+static int update_placement(void)
 {
 	struct sd_req hdr;
 	struct sd_rsp *rsp = (struct sd_rsp *)&hdr;
+	struct epoch_log *log = xzalloc(sizeof(*log));
 	int fd, ret;
-	char name[128];
 
-	addr_to_str(name, sizeof(name), vnode->nid.addr, 0);
-	fd = connect_to(name, vnode->nid.port);
+	fd = connect_to(sdhost, sdport);
 	if (fd < 0) {
-		fprintf(stderr, "FATAL: failed to connect to %s:%"PRIu32"\n",
-			name, vnode->nid.port);
-		exit(EXIT_FAILURE);
+		free(log);
+		return EXIT_SYSFAIL;
 	}
 
-	if (create)
-		sd_init_req(&hdr, SD_OP_CREATE_AND_WRITE_PEER);
-	else
-		sd_init_req(&hdr, SD_OP_WRITE_PEER);
-	hdr.epoch = sd_epoch;
-	hdr.flags = SD_FLAG_CMD_WRITE;
-	hdr.data_length = SD_DATA_OBJ_SIZE;
-	hdr.obj.oid = oid;
+	sd_init_req(&hdr, SD_OP_STAT_CLUSTER);
+	hdr.data_length = sizeof(*log);
 
-	ret = collie_exec_req(fd, &hdr, buf);
+	ret = collie_exec_req(fd, &hdr, log);
 	close(fd);
 
-	if (ret) {
-		fprintf(stderr, "FATAL: failed to execute request\n");
-		exit(EXIT_FAILURE);
+	if (ret || rsp->result != SD_RES_SUCCESS) {
+		fprintf(stderr, "Failed to get the cluster placement\n");
+		free(log);
+		return EXIT_SYSFAIL;
 	}
 
-	if (rsp->result != SD_RES_SUCCESS) {
-		fprintf(stderr, "FATAL: failed to write, %s\n",
-			sd_strerror(rsp->result));
-		exit(EXIT_FAILURE);
+	sd_placement = log->placement;
+	sd_vnodes_nr = placement_nodes_to_vnodes(sd_placement, sd_nodes,
+						 sd_nodes_nr, sd_vnodes);
+	free(log);
+	return EXIT_SUCCESS;
+}
+
+struct check_obj {
+	uint64_t oid;
+	uint32_t len;		/* length of each replica or strip */
+	int nr;			/* number of replicas or strips */
+	int d, p;		/* erasure code, or zero */
+	const struct sd_vnode *vnodes[SD_MAX_COPIES];
+	struct sd_req hdrs[SD_MAX_COPIES];
+	int fds[SD_MAX_COPIES];
+	uint8_t *digests;	/* of each replica, nr_ranges(len) per replica */
+};
+
+static int nr_ranges(uint32_t len)
+{
+	return DIV_ROUND_UP(len, SD_DIGEST_RANGE_SIZE);
+}
+
+static uint8_t *replica_digests(const struct check_obj *obj, int i)
+{
+	return obj->digests + i * nr_ranges(obj->len) * SHA1_LEN;
+}
+
+/*
+ * Ask every replica of the objects for the digests of its data.  All the
+ * requests are sent before the first response is read, so the replicas hash
+ * in parallel, and only the digests come over the network.
+ */
+static void get_replica_digests(struct check_obj *objs, int nr_objs)
+{
+	struct check_obj *obj;
+	unsigned int rlen;
+	char name[128];
+	int i, j;
+
+	for (i = 0, obj = objs; i < nr_objs; i++, obj++) {
+		for (j = 0; j < obj->nr; j++) {
+			struct sd_req *hdr = obj->hdrs + j;
+			const struct sd_vnode *vnode = obj->vnodes[j];
+
+			addr_to_str(name, sizeof(name), vnode->nid.addr, 0);
+			obj->fds[j] = connect_to(name, vnode->nid.port);
+			if (obj->fds[j] < 0) {
+				fprintf(stderr, "FATAL: failed to connect to "
+					"%s:%"PRIu32"\n", name,
+					vnode->nid.port);
+				exit(EXIT_FAILURE);
+			}
+
+			sd_init_req(hdr, SD_OP_GET_OBJ_DIGEST);
+			hdr->epoch = sd_epoch;
+			hdr->data_length = nr_ranges(obj->len) * SHA1_LEN;
+			hdr->obj.oid = obj->oid;
+			hdr->obj.ec_index = obj->d ? j + 1 : 0;
+			if (submit_req(obj->fds[j], hdr, NULL, &rlen, NULL, 0)) {
+				fprintf(stderr, "FATAL: failed to execute "
+					"request\n");
+				exit(EXIT_FAILURE);
+			}
+		}
 	}
+
+	for (i = 0, obj = objs; i < nr_objs; i++, obj++) {
+		for (j = 0; j < obj->nr; j++) {
+			struct sd_rsp *rsp = (struct sd_rsp *)(obj->hdrs + j);
+
+			rlen = nr_ranges(obj->len) * SHA1_LEN;
+			if (wait_rsp(obj->fds[j], obj->hdrs + j,
+				     replica_digests(obj, j), rlen, NULL, 0)) {
+				fprintf(stderr, "FATAL: failed to execute "
+					"request\n");
+				exit(EXIT_FAILURE);
+			}
+			close(obj->fds[j]);
+
+			if (rsp->result != SD_RES_SUCCESS &&
+			    rsp->result != SD_RES_NO_OBJ) {
+				fprintf(stderr, "FATAL: failed to read, %s\n",
+					sd_strerror(rsp->result));
+				exit(EXIT_FAILURE);
+			}
+		}
+	}
+}
+
+static bool replica_exists(const struct check_obj *obj, int i)
+{
+	const struct sd_rsp *rsp = (const struct sd_rsp *)(obj->hdrs + i);
+
+	return rsp->result == SD_RES_SUCCESS;
 }
 
 /*
  * Fix consistency of the replica of oid.
  *
  * XXX: The fix is rather dumb, just read the random copy and write it
- * to other replica.
+ * to the replicas which differ from it.
+ */
+static void do_check_repair(struct check_obj *obj)
+{
+	uint32_t dlen = nr_ranges(obj->len) * SHA1_LEN;
+	uint8_t *digests;
+	void *buf;
+	int i, ret;
+
+	/* nothing is transferred when all the replicas agree */
+	for (i = 0; i < obj->nr; i++)
+		if (!replica_exists(obj, i) ||
+		    memcmp(replica_digests(obj, i), obj->digests, dlen))
+			break;
+	if (i == obj->nr)
+		return;
+
+	buf = xmalloc(obj->len);
+	ret = sd_read_object(obj->oid, buf, obj->len, 0, true);
+	if (ret != SD_RES_SUCCESS) {
+		fprintf(stderr, "FATAL: read %"PRIx64" failed\n", obj->oid);
+		exit(EXIT_FAILURE);
+	}
+	digests = xmalloc(dlen);
+	sha1_ranges(buf, obj->len, SD_DIGEST_RANGE_SIZE, digests);
+
+	for (i = 0; i < obj->nr; i++) {
+		if (!replica_exists(obj, i)) {
+			write_object_to(obj->vnodes[i], obj->oid, buf,
+					obj->len, 0, true);
+			fprintf(stdout, "fixed missing %"PRIx64"\n", obj->oid);
+		} else if (memcmp(replica_digests(obj, i), digests, dlen)) {
+			write_object_to(obj->vnodes[i], obj->oid, buf,
+					obj->len, 0, false);
+			fprintf(stdout, "fixed replica %"PRIx64"\n", obj->oid);
+		}
+	}
+	free(digests);
+	free(buf);
+}
+
+/*
+ * The object read through the gateway, which decodes it if it has to, is
+ * encoded again and the digests of the strips are compared with the ones of
+ * the stored strips.
  */
-static void do_check_repair(uint64_t oid, int nr_copies)
+static void do_check_repair_erasure(struct check_obj *obj)
 {
-	const struct sd_vnode *tgt_vnodes[SD_MAX_COPIES];
-	void *buf = xmalloc(SD_DATA_OBJ_SIZE), *buf_cmp;
+	int d = obj->d, p = obj->p;
+	uint32_t len = obj->len, dlen = nr_ranges(len) * SHA1_LEN, s;
+	uint8_t *buf = xmalloc(SD_DATA_OBJ_SIZE), *strips[SD_EC_MAX_STRIPS];
+	uint8_t *digests = xmalloc(dlen);
+	struct fec fec;
 	int i, ret;
 
-	ret = sd_read_object(oid, buf, SD_DATA_OBJ_SIZE, 0, true);
+	ret = sd_read_object(obj->oid, buf, SD_DATA_OBJ_SIZE, 0, true);
 	if (ret != SD_RES_SUCCESS) {
-		fprintf(stderr, "FATAL: read %"PRIx64" failed\n", oid);
+		fprintf(stderr, "FATAL: read %"PRIx64" failed\n", obj->oid);
 		exit(EXIT_FAILURE);
 	}
 
-	oid_to_vnodes(sd_vnodes, sd_vnodes_nr, oid, nr_copies, tgt_vnodes);
-	for (i = 0; i < nr_copies; i++) {
-		buf_cmp = read_object_from(tgt_vnodes[i], oid);
-		if (!buf_cmp) {
-			write_object_to(tgt_vnodes[i], oid, buf, true);
-			fprintf(stdout, "fixed missing %"PRIx64"\n", oid);
+	for (i = 0; i < d + p; i++)
+		strips[i] = xmalloc(len);
+	for (s = 0; s < len / SD_EC_STRIP_SIZE; s++)
+		for (i = 0; i < d; i++)
+			memcpy(strips[i] + s * SD_EC_STRIP_SIZE,
+			       buf + (s * d + i) * SD_EC_STRIP_SIZE,
+			       SD_EC_STRIP_SIZE);
+	fec_init(&fec, d, p);
+	fec_encode(&fec, strips, len);
+
+	for (i = 0; i < d + p; i++) {
+		if (!replica_exists(obj, i)) {
+			write_object_to(obj->vnodes[i], obj->oid, strips[i],
+					len, i + 1, true);
+			fprintf(stdout, "fixed missing %"PRIx64" strip %d\n",
+				obj->oid, i);
 			continue;
 		}
-		if (memcmp(buf, buf_cmp, SD_DATA_OBJ_SIZE)) {
-			write_object_to(tgt_vnodes[i], oid, buf, false);
-			fprintf(stdout, "fixed replica %"PRIx64"\n", oid);
+		sha1_ranges(strips[i], len, SD_DIGEST_RANGE_SIZE, digests);
+		if (memcmp(replica_digests(obj, i), digests, dlen)) {
+			write_object_to(obj->vnodes[i], obj->oid, strips[i],
+					len, i + 1, false);
+			fprintf(stdout, "fixed strip %"PRIx64" strip %d\n",
+				obj->oid, i);
 		}
-		free(buf_cmp);
 	}
+
+	for (i = 0; i < d + p; i++)
+		free(strips[i]);
+	free(digests);
 	free(buf);
-	return;
+}
+
+static void init_check_obj(struct check_obj *obj, uint64_t oid, int nr_copies,
+			   uint16_t copy_policy, uint32_t objsize)
+{
+	obj->oid = oid;
+	if (ec_policy_to_dp(copy_policy, &obj->d, &obj->p)) {
+		obj->nr = obj->d + obj->p;
+		obj->len = SD_DATA_OBJ_SIZE / obj->d;
+	} else {
+		obj->d = obj->p = 0;
+		obj->nr = nr_copies;
+		obj->len = objsize;
+	}
+	placement_oid_to_vnodes(sd_placement, sd_vnodes, sd_vnodes_nr, oid,
+				obj->nr, obj->vnodes);
+}
+
+/* check and repair a batch of objects */
+static void check_objs(struct check_obj *objs, int nr_objs)
+{
+	int i;
+
+	get_replica_digests(objs, nr_objs);
+	for (i = 0; i < nr_objs; i++) {
+		if (objs[i].d)
+			do_check_repair_erasure(objs + i);
+		else
+			do_check_repair(objs + i);
+	}
+}
+
+/* The objects shared with the base VDI are stored with its policy */
+static uint16_t get_copy_policy(const struct sheepdog_inode *inode,
+				uint32_t vid)
+{
+	static struct sheepdog_inode base;
+
+	if (vid == inode->vdi_id)
+		return inode->copy_policy;
+	if (vid != base.vdi_id &&
+	    sd_read_object(vid_to_vdi_oid(vid), &base, SD_INODE_HEADER_SIZE, 0,
+			   true) != SD_RES_SUCCESS) {
+		fprintf(stderr, "FATAL: failed to read inode %"PRIx32"\n", vid);
+		exit(EXIT_FAILURE);
+	}
+
+	return base.copy_policy;
 }
 
 static int vdi_check(int argc, char **argv)
 {
 	const char *vdiname = argv[optind++];
-	int ret;
-	uint64_t total, done = 0, oid;
+	int ret, i, nr_objs = 0, depth = get_nr_parallel(VDI_CHECK_PARALLEL);
+	uint64_t total, done = 0;
 	uint32_t idx = 0, vid;
 	struct sheepdog_inode *inode = xmalloc(sizeof(*inode));
+	struct check_obj *objs;
+	uint32_t dlen, objsize;
 
 	ret = read_vdi_obj(vdiname, vdi_cmd_data.snapshot_id,
 			   vdi_cmd_data.snapshot_tag, &vid, inode,
@@ -1500,24 +1973,123 @@ static int vdi_check(int argc, char **argv)
 		return EXIT_FAILURE;
 	}
 
-	do_check_repair(vid_to_vdi_oid(vid), inode->nr_copies);
+	ret = update_placement();
+	if (ret != EXIT_SUCCESS)
+		goto out;
+
+	/* sized for the inode or the data object, whichever is larger */
+	objsize = get_inode_objsize(inode);
+	dlen = nr_ranges(max((uint32_t)SD_INODE_SIZE, objsize)) * SHA1_LEN *
+		SD_MAX_COPIES;
+	objs = xzalloc(sizeof(*objs) * depth);
+	for (i = 0; i < depth; i++)
+		objs[i].digests = xmalloc(dlen);
+
+	init_check_obj(objs, vid_to_vdi_oid(vid), inode->nr_copies, 0,
+		       SD_INODE_SIZE);
+	check_objs(objs, 1);
+
 	total = inode->vdi_size;
 	while (done < total) {
 		vid = inode->data_vdi_id[idx];
-		if (vid) {
-			oid = vid_to_data_oid(vid, idx);
-			do_check_repair(oid, inode->nr_copies);
-		}
-		done += SD_DATA_OBJ_SIZE;
+		if (vid)
+			init_check_obj(objs + nr_objs++,
+				       vid_to_data_oid(vid, idx),
+				       inode->nr_copies,
+				       get_copy_policy(inode, vid), objsize);
+		done += objsize;
 		idx++;
+
+		if (nr_objs == depth || (nr_objs && done >= total)) {
+			check_objs(objs, nr_objs);
+			nr_objs = 0;
+		}
 	}
 
+	for (i = 0; i < depth; i++)
+		free(objs[i].digests);
+	free(objs);
 	fprintf(stdout, "finish check&repair %s\n", vdiname);
 	return EXIT_SUCCESS;
 out:
 	return ret;
 }
 
+/*
+ * Deallocate the range, which reads back as zeros afterwards.  The objects
+ * which aren't allocated yet or are shared with a snapshot are left alone.
+ */
+static int vdi_discard(int argc, char **argv)
+{
+	const char *vdiname = argv[optind++];
+	struct sheepdog_inode *inode;
+	struct sd_req hdr;
+	struct sd_rsp *rsp = (struct sd_rsp *)&hdr;
+	uint64_t offset, total, len, oid;
+	uint32_t vid, objsize;
+	int fd, idx, ret = EXIT_SUCCESS;
+
+	if (!argv[optind] || !argv[optind + 1]) {
+		fprintf(stderr, "Please specify the offset and the length\n");
+		return EXIT_USAGE;
+	}
+	if (parse_option_size(argv[optind++], &offset) < 0 ||
+	    parse_option_size(argv[optind++], &total) < 0)
+		return EXIT_USAGE;
+	if (offset % 512 != 0 || total % 512 != 0) {
+		fprintf(stderr, "Discard range must be block-aligned\n");
+		return EXIT_USAGE;
+	}
+
+	inode = xmalloc(sizeof(*inode));
+	ret = read_vdi_obj(vdiname, 0, "", &vid, inode, SD_INODE_SIZE);
+	if (ret != EXIT_SUCCESS)
+		goto out;
+
+	if (inode->vdi_size < offset + total) {
+		fprintf(stderr, "Discard range is beyond the end of the VDI\n");
+		ret = EXIT_FAILURE;
+		goto out;
+	}
+
+	fd = connect_to(sdhost, sdport);
+	if (fd < 0) {
+		ret = EXIT_SYSFAIL;
+		goto out;
+	}
+
+	objsize = get_inode_objsize(inode);
+	for (; total; offset += len, total -= len) {
+		idx = offset / objsize;
+		len = min(total, objsize - offset % objsize);
+		if (!inode->data_vdi_id[idx] ||
+		    !is_data_obj_writeable(inode, idx))
+			continue;
+
+		oid = vid_to_data_oid(vid, idx);
+		sd_init_req(&hdr, SD_OP_DISCARD_OBJ);
+		hdr.obj.copies = inode->nr_copies;
+		hdr.obj.oid = oid;
+		hdr.obj.offset = offset % objsize;
+		hdr.obj.length = len;
+		if (collie_exec_req(fd, &hdr, NULL)) {
+			fprintf(stderr, "Failed to connect\n");
+			ret = EXIT_SYSFAIL;
+			break;
+		}
+		if (rsp->result != SD_RES_SUCCESS) {
+			fprintf(stderr, "Failed to discard object %"PRIx64": %s\n",
+				oid, sd_strerror(rsp->result));
+			ret = EXIT_FAILURE;
+			break;
+		}
+	}
+	close(fd);
+out:
+	free(inode);
+	return ret;
+}
+
 static int vdi_flush(int argc, char **argv)
 {
 	const char *vdiname = argv[optind++];
@@ -1562,63 +2134,261 @@ struct obj_backup {
 	uint8_t data[SD_DATA_OBJ_SIZE];
 };
 
-/* discards redundant area from backup data */
-static void compact_obj_backup(struct obj_backup *backup, uint8_t *from_data)
+/*
+ * discards redundant area from backup data
+ *
+ * 'to_data' and 'from_head' point to the data of both versions at
+ * backup->offset, 'from_tail' to the end of the old one at backup->offset +
+ * backup->length.  At most 'max' bytes are trimmed at each end.
+ */
+static void compact_obj_backup(struct obj_backup *backup, uint8_t *to_data,
+			       uint8_t *from_head, uint8_t *from_tail,
+			       uint32_t max)
 {
 	uint8_t *p1, *p2;
+	uint32_t n;
+
+	p1 = to_data + backup->length - SECTOR_SIZE;
+	p2 = from_tail - SECTOR_SIZE;
+	for (n = 0; backup->length > 0 && n < max &&
+		     memcmp(p1, p2, SECTOR_SIZE) == 0; n += SECTOR_SIZE) {
+		p1 -= SECTOR_SIZE;
+		p2 -= SECTOR_SIZE;
+		backup->length -= SECTOR_SIZE;
+	}
 
-	p1 = backup->data;
-	p2 = from_data;
-	while (backup->length > 0 && memcmp(p1, p2, SECTOR_SIZE) == 0) {
+	p1 = to_data;
+	p2 = from_head;
+	for (n = 0; backup->length > 0 && n < max &&
+		     memcmp(p1, p2, SECTOR_SIZE) == 0; n += SECTOR_SIZE) {
 		p1 += SECTOR_SIZE;
 		p2 += SECTOR_SIZE;
 		backup->offset += SECTOR_SIZE;
 		backup->length -= SECTOR_SIZE;
 	}
+}
 
-	p1 = backup->data + SD_DATA_OBJ_SIZE - SECTOR_SIZE;
-	p2 = from_data + SD_DATA_OBJ_SIZE - SECTOR_SIZE;
-	while (backup->length > 0 && memcmp(p1, p2, SECTOR_SIZE) == 0) {
-		p1 -= SECTOR_SIZE;
-		p2 -= SECTOR_SIZE;
-		backup->length -= SECTOR_SIZE;
+struct backup_slot {
+	char *buf;		/* the vector entries, followed by the data */
+	uint32_t idx;
+	bool to, from;		/* which of the two objects are read */
+	int nr_vec;
+
+	/* only the ranges from 'offset' that differ are read if set */
+	bool ranged;
+	uint32_t offset;
+	uint32_t length;
+};
+
+struct vdi_backup_info {
+	struct backup_slot *slots;
+	struct obj_backup *backup;	/* only the header is used */
+	struct check_obj *objs;		/* the digests of both versions */
+	uint32_t *idxs;			/* the changed objects of a batch */
+};
+
+/* write the difference of an object to stdout, in the order of indexes */
+static int vdi_backup_done(struct sd_pipe_req *req, void *arg)
+{
+	struct vdi_backup_info *info = arg;
+	struct backup_slot *slot = info->slots + req->idx;
+	struct obj_backup *backup = info->backup;
+	struct sd_rsp *rsp = (struct sd_rsp *)&req->hdr;
+	struct sd_vec_entry *vec = (struct sd_vec_entry *)slot->buf;
+	int nr_vec = slot->nr_vec, i, ret;
+	uint8_t *to_data, *from_head, *from_tail, *p;
+
+	if (rsp->result != SD_RES_SUCCESS) {
+		for (i = 0; i < nr_vec; i++)
+			if (vec[i].result != SD_RES_SUCCESS)
+				fprintf(stderr, "Failed to read object %"PRIx32
+					", %d\n", oid_to_vid(vec[i].oid),
+					slot->idx);
+		return EXIT_FAILURE;
+	}
+
+	backup->idx = slot->idx;
+	p = (uint8_t *)(vec + nr_vec);
+	if (slot->ranged) {
+		/* the new span, then the first and last old ranges */
+		to_data = p;
+		from_head = p + slot->length;
+		from_tail = from_head + (nr_vec - 1) * SD_DIGEST_RANGE_SIZE;
+		backup->offset = slot->offset;
+		backup->length = slot->length;
+		compact_obj_backup(backup, to_data, from_head, from_tail,
+				   SD_DIGEST_RANGE_SIZE);
+	} else {
+		to_data = slot->to ? p : (uint8_t *)zero_obj;
+		if (slot->to)
+			p += SD_DATA_OBJ_SIZE;
+		from_head = slot->from ? p : (uint8_t *)zero_obj;
+		backup->offset = 0;
+		backup->length = SD_DATA_OBJ_SIZE;
+		compact_obj_backup(backup, to_data, from_head,
+				   from_head + SD_DATA_OBJ_SIZE,
+				   SD_DATA_OBJ_SIZE);
+	}
+	if (backup->length == 0)
+		return EXIT_SUCCESS;
+
+	ret = xwrite(STDOUT_FILENO, backup,
+		     sizeof(*backup) - sizeof(backup->data));
+	if (ret < 0) {
+		fprintf(stderr, "failed to write backup data, %m\n");
+		return EXIT_SYSFAIL;
+	}
+	ret = xwrite(STDOUT_FILENO,
+		     to_data + (backup->offset - (slot->ranged ?
+						  slot->offset : 0)),
+		     backup->length);
+	if (ret < 0) {
+		fprintf(stderr, "failed to write backup data, %m\n");
+		return EXIT_SYSFAIL;
 	}
+
+	return EXIT_SUCCESS;
 }
 
-static int get_obj_backup(int idx, uint32_t from_vid, uint32_t to_vid,
-			  struct obj_backup *backup)
+static bool is_erasure_vid(const struct sheepdog_inode *inode, uint32_t vid)
 {
-	int ret;
-	uint8_t *from_data = xzalloc(SD_DATA_OBJ_SIZE);
+	int d, p;
 
-	backup->idx = idx;
-	backup->offset = 0;
-	backup->length = SD_DATA_OBJ_SIZE;
+	return ec_policy_to_dp(get_copy_policy(inode, vid), &d, &p);
+}
 
-	if (to_vid) {
-		ret = sd_read_object(vid_to_data_oid(to_vid, idx), backup->data,
-				     SD_DATA_OBJ_SIZE, 0, true);
-		if (ret != SD_RES_SUCCESS) {
-			fprintf(stderr, "Failed to read object %"PRIx32", %d\n",
-				to_vid, idx);
-			return EXIT_FAILURE;
+/*
+ * Find the first and the last ranges in which the two versions of the
+ * object differ, by the digests that a replica of each one computes.
+ * Return false if they can't be compared.
+ */
+static bool diff_obj_ranges(const struct check_obj *to,
+			    const struct check_obj *from, int *first,
+			    int *last)
+{
+	int i, nr = nr_ranges(SD_DATA_OBJ_SIZE);
+
+	if (!replica_exists(to, 0) || !replica_exists(from, 0))
+		return false;
+
+	*first = -1;
+	for (i = 0; i < nr; i++) {
+		if (!memcmp(to->digests + i * SHA1_LEN,
+			    from->digests + i * SHA1_LEN, SHA1_LEN))
+			continue;
+		if (*first < 0)
+			*first = i;
+		*last = i;
+	}
+
+	return true;
+}
+
+/* queue the reads of a batch of changed objects */
+static int backup_objs(struct sd_pipe *pipe, struct vdi_backup_info *info,
+		       const struct sheepdog_inode *from_inode,
+		       const struct sheepdog_inode *to_inode, int nr)
+{
+	struct check_obj *objs = info->objs;
+	struct backup_slot *slot;
+	struct sd_vec_entry *vec;
+	struct sd_pipe_req *req;
+	int i, j, nr_objs = 0, nr_vec, first, last;
+	int digest[VDI_MAX_PARALLEL];
+
+	/*
+	 * The objects which were copied on write have digests compared
+	 * first, so that the ranges that didn't change are never read.
+	 */
+	for (i = 0; i < nr; i++) {
+		uint32_t idx = info->idxs[i];
+		uint32_t from_vid = from_inode->data_vdi_id[idx];
+		uint32_t to_vid = to_inode->data_vdi_id[idx];
+
+		digest[i] = -1;
+		if (!to_vid || !from_vid || is_erasure_vid(to_inode, to_vid) ||
+		    is_erasure_vid(from_inode, from_vid))
+			continue;
+
+		digest[i] = nr_objs;
+		init_check_obj(objs + nr_objs++, vid_to_data_oid(to_vid, idx),
+			       to_inode->nr_copies, 0, SD_DATA_OBJ_SIZE);
+		init_check_obj(objs + nr_objs++,
+			       vid_to_data_oid(from_vid, idx),
+			       from_inode->nr_copies, 0, SD_DATA_OBJ_SIZE);
+		objs[nr_objs - 2].nr = objs[nr_objs - 1].nr = 1;
+	}
+	if (nr_objs)
+		get_replica_digests(objs, nr_objs);
+
+	for (i = 0; i < nr; i++) {
+		uint32_t idx = info->idxs[i];
+		uint32_t from_vid = from_inode->data_vdi_id[idx];
+		uint32_t to_vid = to_inode->data_vdi_id[idx];
+		bool ranged = false;
+
+		if (digest[i] >= 0 &&
+		    diff_obj_ranges(objs + digest[i], objs + digest[i] + 1,
+				    &first, &last)) {
+			/* the object was copied but left as it was */
+			if (first < 0)
+				continue;
+			ranged = true;
 		}
-	} else
-		memset(backup->data, 0, SD_DATA_OBJ_SIZE);
 
-	if (from_vid) {
-		ret = sd_read_object(vid_to_data_oid(from_vid, idx), from_data,
-				     SD_DATA_OBJ_SIZE, 0, true);
-		if (ret != SD_RES_SUCCESS) {
-			fprintf(stderr, "Failed to read object %"PRIx32", %d\n",
-				from_vid, idx);
+		req = sd_pipe_get(pipe);
+		if (!req)
 			return EXIT_FAILURE;
+		slot = info->slots + req->idx;
+		vec = (struct sd_vec_entry *)slot->buf;
+
+		slot->idx = idx;
+		slot->to = !!to_vid;
+		slot->from = !!from_vid;
+		slot->ranged = ranged;
+		nr_vec = 0;
+		memset(vec, 0, 3 * sizeof(*vec));
+		if (ranged) {
+			/* the new span, and the old ranges at its ends */
+			slot->offset = first * SD_DIGEST_RANGE_SIZE;
+			slot->length = (last - first + 1) *
+				SD_DIGEST_RANGE_SIZE;
+			vec[nr_vec].oid = vid_to_data_oid(to_vid, idx);
+			vec[nr_vec].offset = slot->offset;
+			vec[nr_vec++].length = slot->length;
+			vec[nr_vec].oid = vid_to_data_oid(from_vid, idx);
+			vec[nr_vec].offset = slot->offset;
+			vec[nr_vec++].length = SD_DIGEST_RANGE_SIZE;
+			if (last != first) {
+				vec[nr_vec].oid = vid_to_data_oid(from_vid,
+								  idx);
+				vec[nr_vec].offset = last *
+					SD_DIGEST_RANGE_SIZE;
+				vec[nr_vec++].length = SD_DIGEST_RANGE_SIZE;
+			}
+		} else {
+			/* read both versions of the object with one request */
+			if (to_vid)
+				vec[nr_vec++].oid = vid_to_data_oid(to_vid,
+								    idx);
+			if (from_vid)
+				vec[nr_vec++].oid = vid_to_data_oid(from_vid,
+								    idx);
+			for (j = 0; j < nr_vec; j++)
+				vec[j].length = SD_DATA_OBJ_SIZE;
 		}
-	}
 
-	compact_obj_backup(backup, from_data);
-
-	free(from_data);
+		sd_init_req(&req->hdr, SD_OP_READ_OBJS);
+		req->hdr.data_length = nr_vec * sizeof(*vec);
+		for (j = 0; j < nr_vec; j++)
+			req->hdr.data_length += vec[j].length;
+		req->hdr.vec.nr = nr_vec;
+		req->hdr.flags = SD_FLAG_CMD_DIRECT;
+		req->data = slot->buf;
+		slot->nr_vec = nr_vec;
+		if (sd_pipe_submit(pipe, req))
+			return EXIT_FAILURE;
+	}
 
 	return EXIT_SUCCESS;
 }
@@ -1626,7 +2396,8 @@ static int get_obj_backup(int idx, uint32_t from_vid, uint32_t to_vid,
 static int vdi_backup(int argc, char **argv)
 {
 	const char *vdiname = argv[optind++];
-	int ret = EXIT_SUCCESS, idx, nr_objs;
+	int ret = EXIT_SUCCESS, idx, nr_objs, nr = 0, i;
+	int depth = get_nr_parallel(1);
 	struct sheepdog_inode *from_inode = xzalloc(sizeof(*from_inode));
 	struct sheepdog_inode *to_inode = xzalloc(sizeof(*to_inode));
 	struct backup_hdr hdr = {
@@ -1634,6 +2405,21 @@ static int vdi_backup(int argc, char **argv)
 		.magic = VDI_BACKUP_MAGIC,
 	};
 	struct obj_backup *backup = xzalloc(sizeof(*backup));
+	struct vdi_backup_info info;
+	struct sd_vec_entry *vec;
+	struct sd_pipe *pipe;
+
+	info.backup = backup;
+	info.slots = xzalloc(sizeof(*info.slots) * depth);
+	for (i = 0; i < depth; i++)
+		info.slots[i].buf = xmalloc(3 * sizeof(*vec) +
+					    2 * SD_DATA_OBJ_SIZE);
+	info.objs = xzalloc(sizeof(*info.objs) * depth * 2);
+	for (i = 0; i < depth * 2; i++)
+		info.objs[i].digests = xmalloc(nr_ranges(SD_DATA_OBJ_SIZE) *
+					       SHA1_LEN);
+	info.idxs = xzalloc(sizeof(*info.idxs) * depth);
+	zero_obj = xzalloc(SD_DATA_OBJ_SIZE);
 
 	if ((!vdi_cmd_data.snapshot_id && !vdi_cmd_data.snapshot_tag[0]) ||
 	    (!vdi_cmd_data.from_snapshot_id &&
@@ -1656,6 +2442,18 @@ static int vdi_backup(int argc, char **argv)
 	if (ret != EXIT_SUCCESS)
 		goto out;
 
+	/* the objects of a backup are always of the default size */
+	if (get_inode_objsize(to_inode) != SD_DATA_OBJ_SIZE) {
+		fprintf(stderr, "Backing up VDIs with a non-default object "
+			"size is not supported\n");
+		ret = EXIT_FAILURE;
+		goto out;
+	}
+
+	ret = update_placement();
+	if (ret != EXIT_SUCCESS)
+		goto out;
+
 	nr_objs = DIV_ROUND_UP(to_inode->vdi_size, SD_DATA_OBJ_SIZE);
 
 	ret = xwrite(STDOUT_FILENO, &hdr, sizeof(hdr));
@@ -1665,35 +2463,25 @@ static int vdi_backup(int argc, char **argv)
 		goto out;
 	}
 
-	for (idx = 0; idx < nr_objs; idx++) {
-		uint32_t from_vid = from_inode->data_vdi_id[idx];
-		uint32_t to_vid = to_inode->data_vdi_id[idx];
-
-		if (to_vid == 0 && from_vid == 0)
-			continue;
-
-		ret = get_obj_backup(idx, from_vid, to_vid, backup);
-		if (ret != EXIT_SUCCESS)
-			goto out;
-
-		if (backup->length == 0)
-			continue;
+	pipe = sd_pipe_open(depth, vdi_backup_done, &info);
+	if (!pipe) {
+		ret = EXIT_SYSFAIL;
+		goto out;
+	}
 
-		ret = xwrite(STDOUT_FILENO, backup,
-			     sizeof(*backup) - sizeof(backup->data));
-		if (ret < 0) {
-			fprintf(stderr, "failed to write backup data, %m\n");
-			ret = EXIT_SYSFAIL;
-			goto out;
-		}
-		ret = xwrite(STDOUT_FILENO, backup->data + backup->offset,
-			     backup->length);
-		if (ret < 0) {
-			fprintf(stderr, "failed to write backup data, %m\n");
-			ret = EXIT_SYSFAIL;
-			goto out;
+	/* only the objects whose owners differ can have changed */
+	for (idx = 0; idx < nr_objs; idx++) {
+		if (to_inode->data_vdi_id[idx] != from_inode->data_vdi_id[idx])
+			info.idxs[nr++] = idx;
+		if (nr == depth || (nr && idx == nr_objs - 1)) {
+			if (backup_objs(pipe, &info, from_inode, to_inode, nr))
+				break;
+			nr = 0;
 		}
 	}
+	ret = sd_pipe_close(pipe);
+	if (ret != EXIT_SUCCESS)
+		goto out;
 
 	/* write end marker */
 	memset(backup, 0, sizeof(*backup) - sizeof(backup->data));
@@ -1707,18 +2495,56 @@ static int vdi_backup(int argc, char **argv)
 	}
 
 	fsync(STDOUT_FILENO);
+	ret = EXIT_SUCCESS;
 out:
 	free(from_inode);
 	free(to_inode);
 	free(backup);
+	for (i = 0; i < depth; i++)
+		free(info.slots[i].buf);
+	free(info.slots);
+	for (i = 0; i < depth * 2; i++)
+		free(info.objs[i].digests);
+	free(info.objs);
+	free(info.idxs);
+	free(zero_obj);
 	return ret;
 }
 
+struct vdi_restore_info {
+	struct obj_backup **slots;
+	uint32_t vid;
+	int nr_copies;
+};
+
+/* link a restored object to the inode once its data is written */
+static int restore_obj_done(struct sd_pipe_req *req, void *arg)
+{
+	struct vdi_restore_info *info = arg;
+	struct obj_backup *backup = info->slots[req->idx];
+	struct sd_rsp *rsp = (struct sd_rsp *)&req->hdr;
+	int ret;
+
+	if (rsp->result != SD_RES_SUCCESS) {
+		fprintf(stderr, "Failed to write object %" PRIx64 ": %s\n",
+			vid_to_data_oid(info->vid, backup->idx),
+			sd_strerror(rsp->result));
+		return EXIT_FAILURE;
+	}
+
+	ret = sd_write_object(vid_to_vdi_oid(info->vid), 0, &info->vid,
+			      sizeof(info->vid),
+			      SD_INODE_HEADER_SIZE +
+			      sizeof(info->vid) * backup->idx,
+			      0, info->nr_copies, false, true);
+	return ret == SD_RES_SUCCESS ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
 /* restore backup data to vdi */
-static int restore_obj(struct obj_backup *backup, uint32_t vid,
+static int restore_obj(struct sd_pipe *pipe, struct sd_pipe_req *req,
+		       struct obj_backup *backup, uint32_t vid,
 		       struct sheepdog_inode *parent_inode)
 {
-	int ret;
 	uint32_t parent_vid = parent_inode->data_vdi_id[backup->idx];
 	uint64_t parent_oid = 0;
 
@@ -1726,24 +2552,34 @@ static int restore_obj(struct obj_backup *backup, uint32_t vid,
 		parent_oid = vid_to_data_oid(parent_vid, backup->idx);
 
 	/* send a copy-on-write request */
-	ret = sd_write_object(vid_to_data_oid(vid, backup->idx), parent_oid,
-			      backup->data, backup->length, backup->offset,
-			      0, parent_inode->nr_copies, true, true);
-	if (ret != SD_RES_SUCCESS)
-		return ret;
-
-	return sd_write_object(vid_to_vdi_oid(vid), 0, &vid, sizeof(vid),
-			       SD_INODE_HEADER_SIZE + sizeof(vid) * backup->idx,
-			       0, parent_inode->nr_copies, false, true);
+	sd_init_req(&req->hdr, SD_OP_CREATE_AND_WRITE_OBJ);
+	req->hdr.data_length = backup->length;
+	req->hdr.flags = SD_FLAG_CMD_WRITE | SD_FLAG_CMD_DIRECT;
+	if (parent_oid)
+		req->hdr.flags |= SD_FLAG_CMD_COW;
+	req->hdr.obj.copies = parent_inode->nr_copies;
+	req->hdr.obj.oid = vid_to_data_oid(vid, backup->idx);
+	req->hdr.obj.cow_oid = parent_oid;
+	req->hdr.obj.offset = backup->offset;
+	req->data = backup->data;
+
+	return sd_pipe_submit(pipe, req);
 }
 
 static uint32_t do_restore(const char *vdiname, int snapid, const char *tag)
 {
-	int ret;
+	int ret, i, depth = get_nr_parallel(1);
 	uint32_t vid;
 	struct backup_hdr hdr;
-	struct obj_backup *backup = xzalloc(sizeof(*backup));
+	struct obj_backup *backup;
 	struct sheepdog_inode *inode = xzalloc(sizeof(*inode));
+	struct vdi_restore_info info;
+	struct sd_pipe *pipe;
+	struct sd_pipe_req *req;
+
+	info.slots = xzalloc(sizeof(*info.slots) * depth);
+	for (i = 0; i < depth; i++)
+		info.slots[i] = xzalloc(sizeof(*backup));
 
 	ret = xread(STDIN_FILENO, &hdr, sizeof(hdr));
 	if (ret != sizeof(hdr))
@@ -1759,6 +2595,12 @@ static uint32_t do_restore(const char *vdiname, int snapid, const char *tag)
 	ret = read_vdi_obj(vdiname, snapid, tag, NULL, inode, SD_INODE_SIZE);
 	if (ret != EXIT_SUCCESS)
 		goto out;
+	if (get_inode_objsize(inode) != SD_DATA_OBJ_SIZE) {
+		fprintf(stderr, "Restoring VDIs with a non-default object "
+			"size is not supported\n");
+		ret = EXIT_FAILURE;
+		goto out;
+	}
 
 	ret = do_vdi_create(vdiname, inode->vdi_size, inode->vdi_id, &vid,
 			    false, inode->nr_copies);
@@ -1767,37 +2609,54 @@ static uint32_t do_restore(const char *vdiname, int snapid, const char *tag)
 		goto out;
 	}
 
+	info.vid = vid;
+	info.nr_copies = inode->nr_copies;
+	pipe = sd_pipe_open(depth, restore_obj_done, &info);
+	if (!pipe) {
+		ret = EXIT_SYSFAIL;
+		goto out;
+	}
+
 	while (true) {
+		req = sd_pipe_get(pipe);
+		if (!req)
+			break;
+		backup = info.slots[req->idx];
+
 		ret = xread(STDIN_FILENO, backup,
 			    sizeof(*backup) - sizeof(backup->data));
 		if (ret != sizeof(*backup) - sizeof(backup->data)) {
 			fprintf(stderr, "failed to read backup data\n");
+			sd_pipe_close(pipe);
 			ret = EXIT_SYSFAIL;
-			break;
+			goto out;
 		}
 
-		if (backup->idx == UINT32_MAX) {
-			ret = EXIT_SUCCESS;
+		if (backup->idx == UINT32_MAX)
 			break;
-		}
 
 		ret = xread(STDIN_FILENO, backup->data, backup->length);
 		if (ret != backup->length) {
 			fprintf(stderr, "failed to read backup data\n");
+			sd_pipe_close(pipe);
 			ret = EXIT_SYSFAIL;
-			break;
+			goto out;
 		}
 
-		ret = restore_obj(backup, vid, inode);
-		if (ret != SD_RES_SUCCESS) {
-			fprintf(stderr, "failed to restore backup\n");
-			do_vdi_delete(vdiname, 0, NULL);
-			ret = EXIT_FAILURE;
+		if (restore_obj(pipe, req, backup, vid, inode))
 			break;
-		}
+	}
+
+	ret = sd_pipe_close(pipe);
+	if (ret != EXIT_SUCCESS) {
+		fprintf(stderr, "failed to restore backup\n");
+		do_vdi_delete(vdiname, 0, NULL);
+		ret = EXIT_FAILURE;
 	}
 out:
-	free(backup);
+	for (i = 0; i < depth; i++)
+		free(info.slots[i]);
+	free(info.slots);
 	free(inode);
 
 	return ret;
@@ -1940,16 +2799,16 @@ static int vdi_cache(int argc, char **argv)
 }
 
 static struct subcommand vdi_cmd[] = {
-	{"check", "<vdiname>", "saph", "check and repair image's consistency",
+	{"check", "<vdiname>", "snaph", "check and repair image's consistency",
 	 NULL, SUBCMD_FLAG_NEED_NODELIST|SUBCMD_FLAG_NEED_THIRD_ARG,
 	 vdi_check, vdi_options},
-	{"create", "<vdiname> <size>", "Pcaph", "create an image",
+	{"create", "<vdiname> <size>", "Pczoaph", "create an image",
 	 NULL, SUBCMD_FLAG_NEED_NODELIST|SUBCMD_FLAG_NEED_THIRD_ARG,
 	 vdi_create, vdi_options},
 	{"snapshot", "<vdiname>", "saph", "create a snapshot",
 	 NULL, SUBCMD_FLAG_NEED_THIRD_ARG,
 	 vdi_snapshot, vdi_options},
-	{"clone", "<src vdi> <dst vdi>", "sPcaph", "clone an image",
+	{"clone", "<src vdi> <dst vdi>", "sPczaph", "clone an image",
 	 NULL, SUBCMD_FLAG_NEED_THIRD_ARG,
 	 vdi_clone, vdi_options},
 	{"delete", "<vdiname>", "saph", "delete an image",
@@ -1976,22 +2835,28 @@ static struct subcommand vdi_cmd[] = {
 	{"getattr", "<vdiname> <key>", "aph", "get a VDI attribute",
 	 NULL, SUBCMD_FLAG_NEED_THIRD_ARG,
 	 vdi_getattr, vdi_options},
+	{"qos", "<vdiname> [iops=N] [bps=N] [weight=N]", "aprh",
+	 "show or set the I/O limits of an image", NULL,
+	 SUBCMD_FLAG_NEED_THIRD_ARG, vdi_qos, vdi_options},
 	{"resize", "<vdiname> <new size>", "aph", "resize an image",
 	 NULL, SUBCMD_FLAG_NEED_THIRD_ARG,
 	 vdi_resize, vdi_options},
-	{"read", "<vdiname> [<offset> [<len>]]", "saph", "read data from an image",
+	{"read", "<vdiname> [<offset> [<len>]]", "snaph", "read data from an image",
 	 NULL, SUBCMD_FLAG_NEED_THIRD_ARG,
 	 vdi_read, vdi_options},
-	{"write", "<vdiname> [<offset> [<len>]]", "apwh", "write data to an image",
+	{"write", "<vdiname> [<offset> [<len>]]", "apwnh", "write data to an image",
 	 NULL, SUBCMD_FLAG_NEED_THIRD_ARG,
 	 vdi_write, vdi_options},
+	{"discard", "<vdiname> <offset> <len>", "aph",
+	 "deallocate a range of an image", NULL, SUBCMD_FLAG_NEED_THIRD_ARG,
+	 vdi_discard, vdi_options},
 	{"flush", "<vdiname>", "aph", "flush data to cluster",
 	 NULL, SUBCMD_FLAG_NEED_THIRD_ARG,
 	 vdi_flush, vdi_options},
-	{"backup", "<vdiname> <backup>", "sFaph", "create an incremental backup between two snapshots",
+	{"backup", "<vdiname> <backup>", "sFnaph", "create an incremental backup between two snapshots",
 	 NULL, SUBCMD_FLAG_NEED_NODELIST|SUBCMD_FLAG_NEED_THIRD_ARG,
 	 vdi_backup, vdi_options},
-	{"restore", "<vdiname> <backup>", "saph", "restore snapshot images from a backup",
+	{"restore", "<vdiname> <backup>", "snaph", "restore snapshot images from a backup",
 	 NULL, SUBCMD_FLAG_NEED_NODELIST|SUBCMD_FLAG_NEED_THIRD_ARG,
 	 vdi_restore, vdi_options},
 	{"cache", NULL, "saph", "Run 'collie vdi cache' for more information\n",
@@ -2003,7 +2868,8 @@ static struct subcommand vdi_cmd[] = {
 static int vdi_parser(int ch, char *opt)
 {
 	char *p;
-	int nr_copies;
+	int nr_copies, nr_parity;
+	uint64_t objsize;
 
 	switch (ch) {
 	case 'P':
@@ -2039,13 +2905,50 @@ static int vdi_parser(int ch, char *opt)
 		break;
 	case 'c':
 		nr_copies = strtol(opt, &p, 10);
-		if (opt == p || nr_copies < 0 || nr_copies > SD_MAX_COPIES) {
+		if (*p == ':') {
+			/* d:p, erasure coded with d data and p parity strips */
+			nr_parity = strtol(p + 1, &p, 10);
+			if (*p || !ec_policy_valid(nr_copies, nr_parity)) {
+				fprintf(stderr, "Invalid erasure code, the data "
+					"strips must be a power of two and the "
+					"strips no more than %d\n",
+					SD_EC_MAX_STRIPS);
+				exit(EXIT_FAILURE);
+			}
+			vdi_cmd_data.copy_policy |= nr_copies << 4 | nr_parity;
+			nr_copies += nr_parity;
+		} else if (opt == p || nr_copies < 0 ||
+			   nr_copies > SD_MAX_COPIES) {
 			fprintf(stderr, "Invalid copies number, must be "
 				"an integer between 0 and %d\n", SD_MAX_COPIES);
 			exit(EXIT_FAILURE);
 		}
 		vdi_cmd_data.nr_copies = nr_copies;
 		break;
+	case 'z':
+		vdi_cmd_data.copy_policy |= SD_COPY_POLICY_COMPRESS;
+		break;
+	case 'n':
+		vdi_cmd_data.nr_parallel = strtol(opt, &p, 10);
+		if (opt == p || *p || vdi_cmd_data.nr_parallel < 1 ||
+		    vdi_cmd_data.nr_parallel > VDI_MAX_PARALLEL) {
+			fprintf(stderr, "The number of requests in flight "
+				"must be between 1 and %d\n",
+				VDI_MAX_PARALLEL);
+			exit(EXIT_FAILURE);
+		}
+		break;
+	case 'o':
+		if (parse_option_size(opt, &objsize) < 0 ||
+		    objsize & (objsize - 1) ||
+		    objsize < (UINT64_C(1) << SD_MIN_BLOCK_SIZE_SHIFT) ||
+		    objsize > (UINT64_C(1) << SD_MAX_BLOCK_SIZE_SHIFT)) {
+			fprintf(stderr, "Invalid object size, must be a power "
+				"of two from 1M to 64M\n");
+			exit(EXIT_FAILURE);
+		}
+		vdi_cmd_data.block_size_shift = ffsll(objsize) - 1;
+		break;
 	case 'F':
 		vdi_cmd_data.from_snapshot_id = strtol(opt, &p, 10);
 		if (opt == p) {
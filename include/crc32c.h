@@ -0,0 +1,25 @@
+/*
+ * Copyright (C) 2013 Taobao Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __CRC32C_H__
+#define __CRC32C_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * CRC-32C (Castagnoli) for checking the integrity against accidental
+ * corruption, where a cryptographic hash like SHA1 isn't needed.  Start with
+ * crc 0 and pass the result to go on with the next buffer.
+ */
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+const char *crc32c_kernel_name(void);
+
+#endif
@@ -4,10 +4,12 @@
 #include "list.h"
 
 struct event_info;
+struct sd_transport;
 
 typedef void (*event_handler_t)(int fd, int events, void *data);
 
 int init_event(int nr);
+int init_event_transport(int nr, const struct sd_transport *tp);
 int register_event(int fd, event_handler_t h, void *data);
 void unregister_event(int fd);
 int modify_event(int fd, unsigned int events);
@@ -0,0 +1,39 @@
+/*
+ * Copyright (C) 2013 Taobao Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __FEC_H__
+#define __FEC_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Systematic Reed-Solomon code over GF(2^8)
+ *
+ * d data strips are extended with p parity strips, and any d of the d + p
+ * strips are enough to rebuild the others.  The strips of a code have the same
+ * length and are processed byte by byte, so a strip may hold any number of
+ * stripes back to back.
+ */
+#define FEC_MAX_STRIPS 16
+
+struct fec {
+	int d, p;
+	/* (d + p) x d generator matrix, the identity on top of a Cauchy one */
+	uint8_t matrix[FEC_MAX_STRIPS][FEC_MAX_STRIPS];
+};
+
+void fec_init(struct fec *fec, int d, int p);
+void fec_encode(const struct fec *fec, uint8_t *const *strips, size_t len);
+int fec_reconstruct(const struct fec *fec, uint8_t *const *strips,
+		    uint32_t avail, uint32_t want, size_t len);
+const char *fec_kernel_name(void);
+
+#endif
@@ -20,7 +20,7 @@
 #include <stdint.h>
 #include <netinet/in.h>
 
-#define SD_SHEEP_PROTO_VER 0x07
+#define SD_SHEEP_PROTO_VER 0x0b
 
 #define SD_DEFAULT_COPIES 3
 #define SD_MAX_COPIES 8
@@ -69,9 +69,23 @@
 #define SD_OP_FLUSH_PEER 0xAE
 #define SD_OP_NOTIFY_VDI_ADD  0xAF
 #define SD_OP_DELETE_CACHE    0xB0
+#define SD_OP_SET_RECOVERY    0xB1
+#define SD_OP_GET_OBJ_DIGEST  0xB2
+#define SD_OP_DISCARD_PEER    0xB3
+#define SD_OP_REMOVE_PEERS    0xB4
+#define SD_OP_STAT_WQUEUE     0xB5
+#define SD_OP_SET_WQUEUE      0xB6
+#define SD_OP_NOTIFY_VDI_QOS  0xB7
+#define SD_OP_GET_VDI_QOS     0xB8
+#define SD_OP_TRACE_READ_REQS 0xB9
+#define SD_OP_STAT_METRICS    0xBA
+#define SD_OP_NOTIFY_INODE_UPDATE 0xBB
 
 /* internal flags for hdr.flags, must be above 0x80 */
 #define SD_FLAG_CMD_RECOVERY 0x0080
+#define SD_FLAG_CMD_SPARSE   0x0800 /* return the non-zero extents only */
+#define SD_FLAG_CMD_COMPRESS 0x1000 /* data is a compressed object image */
+#define SD_FLAG_CMD_CHAIN    0x2000 /* pass the write on, see below */
 
 /* flags for VDI attribute operations */
 #define SD_FLAG_CMD_CREAT    0x0100
@@ -88,6 +102,106 @@
 #define SD_RES_NO_CACHE      0x87 /* No cache object found */
 #define SD_RES_BUFFER_SMALL  0x88 /* The buffer is too small */
 
+/*
+ * flags for SD_OP_GET_OBJ_LIST
+ *
+ * With SD_LIST_PAGED, the oids not less than hdr.cursor are returned in
+ * ascending order as many as fit in the buffer.  If there are more left,
+ * SD_LIST_MORE is set in the response and rsp.cursor is the next oid.
+ */
+#define SD_LIST_PAGED        0x01
+#define SD_LIST_MORE         0x01
+
+/*
+ * flags for SD_OP_GET_VDI_COPIES
+ *
+ * Only the entries changed at or after epoch hdr.since are returned, the
+ * whole list if it is 0.  SD_VDI_COPIES_COMPLETE is set when the responder
+ * knows every VDI of the cluster, so there is no need to ask other nodes.
+ */
+#define SD_VDI_COPIES_COMPLETE 0x01
+
+/* SD_OP_GET_OBJ_DIGEST returns the SHA1 of each range of this size */
+#define SD_DIGEST_RANGE_SIZE (64 * 1024)
+
+/*
+ * Sparse reads
+ *
+ * With SD_FLAG_CMD_SPARSE, SD_OP_READ_PEER may answer with SD_FLAG_CMD_SPARSE
+ * set in rsp.flags.  The data then starts with a struct sd_extent_list and
+ * its extents, followed by the data of the extents in the same order, and
+ * everything else of the range is zero.  The offsets are relative to
+ * hdr.obj.offset and aligned to SD_SPARSE_BLOCK_SIZE.
+ */
+#define SD_SPARSE_BLOCK_SIZE 4096
+
+struct sd_extent {
+	uint32_t	offset;
+	uint32_t	length;
+};
+
+struct sd_extent_list {
+	uint32_t	nr;
+	uint32_t	__pad;
+	struct sd_extent extents[0];
+};
+
+/*
+ * Compressed objects
+ *
+ * A compressed image of a range is a struct sd_zobj_header followed by the
+ * data of its chunks in order.  Chunk i is the compressed data of the
+ * SD_ZCHUNK_SIZE bytes at i * SD_ZCHUNK_SIZE of the range, the last one
+ * possibly shorter.  A zero length chunk is all zeros and a chunk as long as
+ * its uncompressed data is stored as is.
+ *
+ * With SD_FLAG_CMD_COMPRESS, SD_OP_READ_PEER may answer with the image of the
+ * range as stored by the peer, SD_FLAG_CMD_COMPRESS set in rsp.flags.  The
+ * same flag in a create request means the data to write is such an image of
+ * the whole object.
+ */
+#define SD_ZCHUNK_SIZE       (64 * 1024)
+#define SD_ZOBJ_MAX_CHUNKS   (SD_DATA_OBJ_SIZE / SD_ZCHUNK_SIZE)
+#define SD_ZOBJ_MAGIC        0x5a4f424a
+#define SD_ZALGO_DEFLATE     0x01
+
+struct sd_zobj_header {
+	uint32_t	magic;
+	uint8_t		algo;
+	uint8_t		__pad;
+	uint16_t	nr_chunks;
+	uint32_t	length; /* of the uncompressed range */
+	uint32_t	__pad2;
+	uint32_t	chunk_len[SD_ZOBJ_MAX_CHUNKS];
+};
+
+/*
+ * Chain replication
+ *
+ * With SD_FLAG_CMD_CHAIN, the data of SD_OP_WRITE_PEER or
+ * SD_OP_CREATE_AND_WRITE_PEER is followed by the struct node_id of the
+ * hdr.obj.nr_chain replicas to write next.  The peer passes the write on to
+ * the first of them with the rest of the list while it writes its own copy,
+ * and answers once both are done, so the result covers the whole chain.
+ */
+
+/*
+ * Erasure coded objects
+ *
+ * A data object of an erasure coded VDI is cut into stripes of d strips of
+ * SD_EC_STRIP_SIZE bytes, which p parity strips are computed for.  The node at
+ * the n'th position of the object stores the n'th strip of every stripe, back
+ * to back, as an object of SD_DATA_OBJ_SIZE / d bytes.  The peer requests to
+ * these objects carry the strip index plus one in hdr.obj.ec_index, and a node
+ * which has another strip of the object answers SD_RES_NO_OBJ.
+ */
+#define SD_EC_STRIP_SIZE     4096
+#define SD_EC_MAX_STRIPS     SD_MAX_COPIES
+
+/* Placement engines, chosen at format time */
+#define SD_PLACEMENT_RING    0x00 /* consistent hashing over vnodes */
+#define SD_PLACEMENT_STRAW2  0x01 /* weighted rendezvous hashing */
+
 #define SD_FLAG_NOHALT       0x0004 /* Serve the IO rquest even lack of nodes */
 #define SD_FLAG_QUORUM       0x0008 /* Serve the IO rquest as long we are quorate */
 
@@ -109,7 +223,8 @@ struct sd_so_req {
 	uint64_t	ctime;
 	uint32_t	copies;
 	uint32_t	tag;
-	uint32_t	opcode_specific[2];
+	uint32_t	placement;
+	uint32_t	__pad;
 };
 
 struct sd_so_rsp {
@@ -134,7 +249,9 @@ struct sd_list_req {
 	uint32_t        id;
 	uint32_t        data_length;
 	uint32_t        tgt_epoch;
-	uint32_t        pad[7];
+	uint32_t        list_flags;
+	uint64_t        cursor;
+	uint32_t        pad[4];
 };
 
 struct sd_list_rsp {
@@ -145,9 +262,156 @@ struct sd_list_rsp {
 	uint32_t        id;
 	uint32_t        data_length;
 	uint32_t        result;
+	uint32_t        list_flags;
+	uint64_t        cursor;
+	uint32_t        pad[4];
+};
+
+struct sd_vdi_copies_req {
+	uint8_t		proto_ver;
+	uint8_t		opcode;
+	uint16_t	flags;
+	uint32_t	epoch;
+	uint32_t        id;
+	uint32_t        data_length;
+	uint32_t        since;
 	uint32_t        pad[7];
 };
 
+struct sd_vdi_copies_rsp {
+	uint8_t		proto_ver;
+	uint8_t		opcode;
+	uint16_t	flags;
+	uint32_t	epoch;
+	uint32_t        id;
+	uint32_t        data_length;
+	uint32_t        result;
+	uint32_t        list_flags;
+	uint32_t        pad[6];
+};
+
+#define SD_NR_WAIT_BUCKETS 16
+
+/*
+ * The latency of the requests blocked on objects in recovery, returned in
+ * the data of SD_OP_STAT_RECOVERY.  buckets[i] counts the waits shorter than
+ * 2^i ms, and the last one the rest.
+ */
+/* why the sleeping requests were woken up, wakeups[] counts the requests */
+#define SD_WAKEUP_EPOCH      0 /* the epoch was lifted */
+#define SD_WAKEUP_OID        1 /* the object was recovered */
+#define SD_WAKEUP_ALL        2 /* recovery finished or was cancelled */
+#define SD_NR_WAKEUPS        3
+
+struct recovery_wait_stat {
+	uint64_t nr_waits;
+	uint64_t total_us;
+	uint64_t max_us;
+	uint64_t buckets[SD_NR_WAIT_BUCKETS];
+	uint64_t wakeups[SD_NR_WAKEUPS];
+};
+
+#define SD_WQUEUE_NAME_LEN   16
+
+/*
+ * The state of a work queue of the node, SD_OP_STAT_WQUEUE returns one for
+ * each queue.  SD_OP_SET_WQUEUE takes one naming the queue, and sets the
+ * bounds of its thread pool to min_threads and max_threads, 0 for the
+ * default.  type is one of enum wq_thread_control, and roof the most threads
+ * the queue grows to now.  The times are moving averages in usec.
+ */
+struct wqueue_stat {
+	char name[SD_WQUEUE_NAME_LEN];
+	uint32_t type;
+	uint32_t nr_threads;
+	uint32_t min_threads;
+	uint32_t max_threads;
+	uint32_t roof;
+	uint32_t nr_pending;
+	uint32_t nr_running;
+	uint32_t max_pending;
+	uint64_t nr_queued;
+	uint64_t wait_us;
+	uint64_t run_us;
+	uint64_t cpu_us;
+};
+
+/*
+ * The I/O limits of a VDI at the gateways, 0 for unlimited.  They are kept in
+ * the SD_QOS_ATTR_KEY attribute as "iops=N bps=N weight=N", shared by all the
+ * snapshots of the VDI, sent to all the nodes with SD_OP_NOTIFY_VDI_QOS when
+ * set, and looked up with SD_OP_GET_VDI_QOS.  The notification carries the
+ * VDI id of the attribute, the hash of the name.  Under contention, the VDIs
+ * get their share of the gateway by their weight, SD_QOS_DEFAULT_WEIGHT if 0.
+ */
+#define SD_QOS_ATTR_KEY      "sheepdog.qos"
+#define SD_QOS_DEFAULT_WEIGHT 100
+
+struct sd_vdi_qos {
+	uint32_t vid;
+	uint32_t iops;
+	uint64_t bps;
+	uint32_t weight;
+	uint32_t __pad;
+};
+
+/*
+ * The stages of a request traced by the sheep, see trace/reqtrace.c.  Each
+ * stage is stamped in usec after the request header is received, or
+ * SD_REQ_STAGE_NONE if the request didn't go through it.  A gateway request
+ * has FORWARD when it sent to the remote replicas and ACKS when they all
+ * answered, a peer or local request just does its I/O.
+ */
+enum sd_req_stage {
+	SD_REQ_STAGE_RX,	/* the data is received */
+	SD_REQ_STAGE_QUEUED,	/* queued to a work queue */
+	SD_REQ_STAGE_WORKER,	/* picked up by a worker */
+	SD_REQ_STAGE_LOCAL_IO,	/* the local I/O is done */
+	SD_REQ_STAGE_FORWARD,	/* forwarded to the remote replicas */
+	SD_REQ_STAGE_ACKS,	/* the remote replicas answered */
+	SD_REQ_STAGE_DONE,	/* back in the main thread */
+	SD_REQ_STAGE_TX,	/* the response is sent */
+	SD_NR_REQ_STAGES,
+};
+
+#define SD_REQ_STAGE_NONE UINT32_MAX
+
+/* One traced request, SD_OP_TRACE_READ_REQS returns the recent ones */
+struct sd_req_trace {
+	uint8_t opcode;
+	uint8_t __pad[3];
+	uint32_t result;
+	uint64_t oid;
+	uint32_t stages[SD_NR_REQ_STAGES];
+};
+
+#define SD_METRIC_NAME_LEN   48
+#define SD_METRIC_LABEL_LEN  16
+
+enum sd_metric_type {
+	SD_METRIC_COUNTER,
+	SD_METRIC_GAUGE,
+	SD_METRIC_HISTOGRAM,
+};
+
+/*
+ * A metric of the node, SD_OP_STAT_METRICS returns all of them.  label names
+ * the work queue of the per-queue ones, empty otherwise.  A counter or a gauge
+ * is in value, a histogram has the number of samples there and their sum, and
+ * the percentiles are within 25%.  The latencies are in usec.
+ */
+struct sd_metric {
+	char name[SD_METRIC_NAME_LEN];
+	char label[SD_METRIC_LABEL_LEN];
+	uint32_t type;
+	uint32_t __pad;
+	uint64_t value;
+	uint64_t sum;
+	uint64_t p50;
+	uint64_t p99;
+	uint64_t max;
+};
+
 struct sd_node_req {
 	uint8_t		proto_ver;
 	uint8_t		opcode;
@@ -179,7 +443,8 @@ struct node_id {
 	uint16_t port;
 	uint8_t io_addr[16];
 	uint16_t io_port;
-	uint8_t pad[4];
+	uint8_t io_transport;	/* SD_TRANSPORT_* serving io_port */
+	uint8_t pad[3];
 };
 
 struct sd_node {
@@ -195,9 +460,21 @@ struct epoch_log {
 	uint32_t epoch;
 	uint32_t nr_nodes;
 	uint32_t nr_copies;
+	uint8_t placement;
+	uint8_t __pad[3];
 	struct sd_node nodes[SD_MAX_NODES];
 };
 
+/* Default foreground latency (ms) above which recovery backs off */
+#define SD_DEFAULT_RECOVERY_LATENCY 100
+
+struct recovery_throttle {
+	uint32_t max_bandwidth;	/* MB/s, 0 for unlimited */
+	uint32_t max_iops;	/* objects per second, 0 for unlimited */
+	uint32_t max_latency;	/* ms, 0 to never back off */
+	uint32_t __pad;
+};
+
 struct join_message {
 	uint8_t proto_ver;
 	uint8_t nr_copies;
@@ -210,8 +487,10 @@ struct join_message {
 	uint8_t inc_epoch; /* set non-zero when we increment epoch of all nodes */
 	uint8_t disable_recovery;
 	uint16_t cluster_flags;
-	uint32_t __pad;
+	uint8_t placement;
+	uint8_t __pad[3];
 	uint8_t store[STORE_LEN];
+	struct recovery_throttle recovery_throttle;
 
 	/*
 	 * A joining sheep puts the local node list here, which is nr_nodes
@@ -32,6 +32,7 @@ void early_log_init(const char *format_name,
 int log_init(const char *progname, int size, bool to_stdout, int level,
 	char *outfile);
 void log_close(void);
+uint64_t log_nr_dropped(void);
 void dump_logmsg(void *);
 void log_write(int prio, const char *func, int line, const char *fmt, ...)
 	__printf(4, 5);
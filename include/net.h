@@ -1,7 +1,10 @@
 #ifndef __NET_H__
 #define __NET_H__
 
+#include <poll.h>
+#include <time.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <arpa/inet.h>
 
 #include "sheepdog_proto.h"
@@ -17,6 +20,56 @@
 #define POLL_TIMEOUT 5 /* seconds */
 #define MAX_RETRY_COUNT (MAX_POLLTIME / POLL_TIMEOUT)
 
+/*
+ * Transports
+ *
+ * A transport provides the socket calls on the connections it creates, so
+ * that a network can be served by something else than the kernel TCP stack,
+ * e.g. RDMA through rsockets.  Every fd is bound to the transport which
+ * created it and the functions below, as well as the net_*() wrappers of the
+ * socket calls, dispatch on that.  The fds which were never bound are TCP.
+ */
+enum {
+	SD_TRANSPORT_TCP = 0,
+	SD_TRANSPORT_RDMA,
+	SD_NR_TRANSPORTS,
+};
+
+struct sd_transport {
+	const char *name;
+	int id;
+
+	int (*socket)(int domain, int type, int protocol);
+	int (*bind)(int fd, const struct sockaddr *addr, socklen_t len);
+	int (*listen)(int fd, int backlog);
+	int (*accept)(int fd, struct sockaddr *addr, socklen_t *len);
+	int (*connect)(int fd, const struct sockaddr *addr, socklen_t len);
+	int (*getpeername)(int fd, struct sockaddr *addr, socklen_t *len);
+	int (*setsockopt)(int fd, int level, int name, const void *val,
+			  socklen_t len);
+	int (*fcntl)(int fd, int cmd, ...);
+	ssize_t (*read)(int fd, void *buf, size_t count);
+	ssize_t (*write)(int fd, const void *buf, size_t count);
+	ssize_t (*writev)(int fd, const struct iovec *iov, int iovcnt);
+	ssize_t (*sendmsg)(int fd, const struct msghdr *msg, int flags);
+	int (*poll)(struct pollfd *fds, nfds_t nfds, int timeout);
+	int (*shutdown)(int fd, int how);
+	int (*close)(int fd);
+};
+
+const struct sd_transport *get_transport(int id);
+const struct sd_transport *find_transport(const char *name);
+const struct sd_transport *fd_transport(int fd);
+
+int net_accept(int fd, struct sockaddr *addr, socklen_t *len);
+int net_getpeername(int fd, struct sockaddr *addr, socklen_t *len);
+ssize_t net_read(int fd, void *buf, size_t count);
+ssize_t net_writev(int fd, const struct iovec *iov, int iovcnt);
+int net_poll(struct pollfd *fds, nfds_t nfds, int timeout);
+int net_ppoll(struct pollfd *fds, nfds_t nfds, const struct timespec *ts);
+int net_shutdown(int fd, int how);
+int net_close(int fd);
+
 enum conn_state {
 	C_IO_HEADER = 0,
 	C_IO_DATA_INIT,
@@ -53,12 +106,21 @@ int do_read(int sockfd, void *buf, int len,
 int rx(struct connection *conn, enum conn_state next_state);
 int tx(struct connection *conn, enum conn_state next_state);
 int connect_to(const char *name, int port);
+int connect_to_transport(const struct sd_transport *tp, const char *name,
+			 int port);
 int send_req(int sockfd, struct sd_req *hdr, void *data, unsigned int wlen,
 	     bool (*need_retry)(uint32_t), uint32_t);
+int submit_req(int sockfd, struct sd_req *hdr, void *data, unsigned int *rlen,
+	       bool (*need_retry)(uint32_t), uint32_t);
+int wait_rsp(int sockfd, struct sd_req *hdr, void *data, unsigned int rlen,
+	     bool (*need_retry)(uint32_t), uint32_t);
 int exec_req(int sockfd, struct sd_req *hdr, void *,
 	     bool (*need_retry)(uint32_t), uint32_t);
 int create_listen_ports(const char *bindaddr, int port,
 			int (*callback)(int fd, void *), void *data);
+int create_transport_listen_ports(const struct sd_transport *tp,
+				  const char *bindaddr, int port,
+				  int (*callback)(int fd, void *), void *data);
 int create_unix_domain_socket(const char *unix_path,
 			      int (*callback)(int, void *), void *data);
 
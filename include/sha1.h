@@ -23,5 +23,10 @@ struct sha1_ctx {
 void sha1_init(void *ctx);
 void sha1_update(void *ctx, const uint8_t *data, unsigned int len);
 void sha1_final(void *ctx, uint8_t *out);
+void sha1_multi(const uint8_t *const *data, unsigned int len,
+		uint8_t *const *out, int nr);
+void sha1_ranges(const void *buf, uint32_t len, uint32_t range,
+		 uint8_t *digests);
+const char *sha1_kernel_name(void);
 
 #endif
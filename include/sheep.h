@@ -21,6 +21,7 @@
 struct sd_vnode {
 	struct node_id  nid;
 	uint16_t	node_idx;
+	uint16_t	weight;		/* only used by the straw2 placement */
 	uint32_t	zone;
 	uint64_t        id;
 };
@@ -34,11 +35,41 @@ struct vnode_info {
 
 	int nr_zones;
 	int refcnt;
+	int placement;
+
+	/*
+	 * Placement table built by the sheep daemon for every membership.
+	 * buckets[] maps the top bits of the oid hash to the first vnode at
+	 * or after the bucket start, and replicas[] caches the zone-distinct
+	 * successors of every vnode, nr_replicas of them per vnode.
+	 */
+	int bucket_shift;
+	int nr_replicas;
+	uint16_t *buckets;
+	uint16_t *replicas;
 };
 
 struct vdi_copy {
 	uint32_t vid;
+	uint8_t nr_copies;
+	uint8_t block_size_shift;
+	uint16_t copy_policy;
+};
+
+/*
+ * The inode header fields a VDI lookup looks at.  Sent along with
+ * SD_OP_NOTIFY_VDI_ADD so that every sheep keeps its lookup index up to date,
+ * an empty name marks a deleted VDI.
+ */
+struct vdi_name_entry {
+	uint32_t vid;
+	uint32_t snap_id;
 	uint32_t nr_copies;
+	uint32_t __pad;
+	uint64_t create_time;
+	uint64_t snap_ctime;
+	char name[SD_MAX_VDI_LEN];
+	char tag[SD_MAX_VDI_TAG_LEN];
 };
 
 #define TRACE_GRAPH_ENTRY  0x01
@@ -300,4 +331,261 @@ static inline int nodes_to_vnodes(struct sd_node *nodes, int nr,
 	return nr_vnodes;
 }
 
+/*
+ * Straw2 placement
+ *
+ * Every node that stores data gets a single entry weighted by its number
+ * of vnodes.  For each object every entry draws a straw of length
+ * -log(u) / weight where u is a uniform hash of the object and the entry,
+ * and the shortest straws from distinct zones win.  Changing the weight
+ * of, adding or removing an entry only moves objects to or from that very
+ * entry, and the load is balanced in proportion to the weights without
+ * needing many virtual points per node.
+ *
+ * The logarithm is computed in fixed point so that all the nodes agree on
+ * the placement regardless of their floating point implementation.
+ */
+static inline uint64_t straw2_hash(uint64_t oid, uint64_t seed)
+{
+	uint64_t h = fnv_64a_buf(&oid, sizeof(oid), seed);
+
+	/* fnv doesn't mix the high bits of short keys well, finalize it */
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+
+	return h;
+}
+
+/* -log2(u / 2^48) in 16.16 fixed point, for u in [1, 2^48] */
+static inline uint32_t straw2_neg_log2(uint64_t u)
+{
+	int msb = 63 - __builtin_clzll(u), i;
+	uint64_t m;
+	uint32_t frac = 0;
+
+	/* normalize the mantissa to [1, 2) in Q1.31 */
+	if (msb >= 31)
+		m = u >> (msb - 31);
+	else
+		m = u << (31 - msb);
+
+	for (i = 0; i < 16; i++) {
+		m = (m * m) >> 31;
+		frac <<= 1;
+		if (m >= (1ULL << 32)) {
+			m >>= 1;
+			frac |= 1;
+		}
+	}
+
+	return (48U << 16) - ((uint32_t)msb << 16 | frac);
+}
+
+static inline int straw2_nodes_to_vnodes(struct sd_node *nodes, int nr,
+					 struct sd_vnode *vnodes)
+{
+	int i, j, nr_vnodes = 0;
+	uint64_t hval;
+
+	for (i = 0; i < nr; i++) {
+		if (!nodes[i].nr_vnodes)
+			continue;
+
+		if (vnodes) {
+			hval = fnv_64a_buf(&nodes[i].nid.port,
+					   sizeof(nodes[i].nid.port),
+					   FNV1A_64_INIT);
+			for (j = ARRAY_SIZE(nodes[i].nid.addr) - 1; j >= 0; j--)
+				hval = fnv_64a_buf(&nodes[i].nid.addr[j], 1,
+						   hval);
+
+			vnodes[nr_vnodes].id = hval;
+			vnodes[nr_vnodes].nid = nodes[i].nid;
+			vnodes[nr_vnodes].node_idx = i;
+			vnodes[nr_vnodes].zone = nodes[i].zone;
+			vnodes[nr_vnodes].weight = nodes[i].nr_vnodes;
+		}
+
+		nr_vnodes++;
+	}
+
+	if (vnodes)
+		qsort(vnodes, nr_vnodes, sizeof(*vnodes), vnode_cmp);
+
+	return nr_vnodes;
+}
+
+static inline void straw2_oid_to_vnodes(const struct sd_vnode *entries,
+					int nr_entries, uint64_t oid,
+					int nr_copies,
+					const struct sd_vnode **vnodes)
+{
+	uint32_t straws[SD_MAX_NODES];
+	int i, j, k, best;
+
+	for (i = 0; i < nr_entries; i++)
+		straws[i] = straw2_neg_log2((straw2_hash(oid, entries[i].id)
+					     >> 16) + 1);
+
+	for (k = 0; k < nr_copies; k++) {
+		best = -1;
+		for (i = 0; i < nr_entries; i++) {
+			for (j = 0; j < k; j++)
+				if (entries[i].zone == vnodes[j]->zone)
+					break;
+			if (j < k)
+				continue;
+
+			/* straws[i] / weight[i] < straws[best] / weight[best] */
+			if (best < 0 ||
+			    (uint64_t)straws[i] * entries[best].weight <
+			    (uint64_t)straws[best] * entries[i].weight)
+				best = i;
+		}
+		if (best < 0)
+			panic("can't find next new idx");
+		vnodes[k] = &entries[best];
+	}
+}
+
+static inline int placement_nodes_to_vnodes(int placement,
+					    struct sd_node *nodes, int nr,
+					    struct sd_vnode *vnodes)
+{
+	switch (placement) {
+	case SD_PLACEMENT_STRAW2:
+		return straw2_nodes_to_vnodes(nodes, nr, vnodes);
+	default:
+		return nodes_to_vnodes(nodes, nr, vnodes);
+	}
+}
+
+static inline void placement_oid_to_vnodes(int placement,
+					   const struct sd_vnode *entries,
+					   int nr_entries, uint64_t oid,
+					   int nr_copies,
+					   const struct sd_vnode **vnodes)
+{
+	switch (placement) {
+	case SD_PLACEMENT_STRAW2:
+		straw2_oid_to_vnodes(entries, nr_entries, oid, nr_copies,
+				     vnodes);
+		break;
+	default:
+		oid_to_vnodes(entries, nr_entries, oid, nr_copies, vnodes);
+		break;
+	}
+}
+
+static inline const char *placement_to_str(int placement)
+{
+	switch (placement) {
+	case SD_PLACEMENT_RING:
+		return "ring";
+	case SD_PLACEMENT_STRAW2:
+		return "straw2";
+	default:
+		return "unknown";
+	}
+}
+
+static inline int str_to_placement(const char *str)
+{
+	if (strcmp(str, "ring") == 0)
+		return SD_PLACEMENT_RING;
+	if (strcmp(str, "straw2") == 0)
+		return SD_PLACEMENT_STRAW2;
+	return -1;
+}
+
+/* The same as get_vnode_first_idx(), but uses the bucket table */
+static inline int vinfo_first_idx(const struct vnode_info *vinfo, uint64_t oid)
+{
+	uint64_t id = fnv_64a_buf(&oid, sizeof(oid), FNV1A_64_INIT);
+	int idx = vinfo->buckets[id >> vinfo->bucket_shift];
+
+	while (idx < vinfo->nr_vnodes && vinfo->vnodes[idx].id < id)
+		idx++;
+
+	return idx % vinfo->nr_vnodes;
+}
+
+static inline const struct sd_vnode *
+vinfo_oid_to_vnode(const struct vnode_info *vinfo, uint64_t oid, int copy_idx)
+{
+	const struct sd_vnode *vnodes[SD_MAX_COPIES];
+	int idx;
+
+	if (vinfo->placement != SD_PLACEMENT_RING) {
+		placement_oid_to_vnodes(vinfo->placement, vinfo->vnodes,
+					vinfo->nr_vnodes, oid, copy_idx + 1,
+					vnodes);
+		return vnodes[copy_idx];
+	}
+
+	if (!vinfo->buckets || copy_idx > vinfo->nr_replicas)
+		return oid_to_vnode(vinfo->vnodes, vinfo->nr_vnodes, oid,
+				    copy_idx);
+
+	idx = vinfo_first_idx(vinfo, oid);
+	if (copy_idx)
+		idx = vinfo->replicas[idx * vinfo->nr_replicas + copy_idx - 1];
+
+	return &vinfo->vnodes[idx];
+}
+
+static inline void vinfo_oid_to_vnodes(const struct vnode_info *vinfo,
+				       uint64_t oid, int nr_copies,
+				       const struct sd_vnode **vnodes)
+{
+	const uint16_t *succ;
+	int idx, i;
+
+	if (vinfo->placement != SD_PLACEMENT_RING || !vinfo->buckets ||
+	    nr_copies > vinfo->nr_replicas + 1) {
+		placement_oid_to_vnodes(vinfo->placement, vinfo->vnodes,
+					vinfo->nr_vnodes, oid, nr_copies,
+					vnodes);
+		return;
+	}
+
+	idx = vinfo_first_idx(vinfo, oid);
+	vnodes[0] = &vinfo->vnodes[idx];
+
+	succ = vinfo->replicas + idx * vinfo->nr_replicas;
+	for (i = 1; i < nr_copies; i++)
+		vnodes[i] = &vinfo->vnodes[succ[i - 1]];
+}
+
+static inline void vinfo_oid_to_nodes(const struct vnode_info *vinfo,
+				      uint64_t oid, int nr_copies,
+				      const struct sd_node **nodes)
+{
+	int i;
+	const struct sd_vnode *vnodes[SD_MAX_COPIES];
+
+	vinfo_oid_to_vnodes(vinfo, oid, nr_copies, vnodes);
+	for (i = 0; i < nr_copies; i++)
+		nodes[i] = &vinfo->nodes[vnodes[i]->node_idx];
+}
+
+/* Get the erasure code of copy_policy, false if it is not erasure coded */
+static inline bool ec_policy_to_dp(uint16_t policy, int *d, int *p)
+{
+	*d = (policy & SD_COPY_POLICY_EC_MASK) >> 4;
+	*p = policy & 0x0f;
+
+	return *d && *p;
+}
+
+/* The data strips must cut an object evenly into stripes */
+static inline bool ec_policy_valid(int d, int p)
+{
+	return d >= 2 && p >= 1 && d + p <= SD_EC_MAX_STRIPS &&
+		!(d & (d - 1));
+}
+
 #endif
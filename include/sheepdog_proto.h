@@ -26,6 +26,9 @@
 #define SD_OP_READ_OBJ       0x02
 #define SD_OP_WRITE_OBJ      0x03
 #define SD_OP_REMOVE_OBJ     0x04
+#define SD_OP_READ_OBJS      0x05
+#define SD_OP_WRITE_OBJS     0x06
+#define SD_OP_DISCARD_OBJ    0x07
 
 #define SD_OP_NEW_VDI        0x11
 #define SD_OP_LOCK_VDI       0x12
@@ -38,6 +41,8 @@
 #define SD_FLAG_CMD_COW      0x02
 #define SD_FLAG_CMD_CACHE    0x04
 #define SD_FLAG_CMD_DIRECT   0x08 /* don't use object cache */
+/* set the slot of the created object, echoed in the response when done */
+#define SD_FLAG_CMD_LINK     0x10
 /* flags above 0x80 are sheepdog-internal */
 
 #define SD_RES_SUCCESS       0x00 /* Success */
@@ -101,6 +106,14 @@
 #define SD_DATA_OBJ_SIZE (UINT64_C(1) << 22)
 #define SD_MAX_VDI_SIZE (SD_DATA_OBJ_SIZE * MAX_DATA_OBJS)
 
+/*
+ * The data objects of a VDI are 1 << block_size_shift bytes, an inode with
+ * a zero shift has objects of SD_DATA_OBJ_SIZE
+ */
+#define SD_DEFAULT_BLOCK_SIZE_SHIFT 22
+#define SD_MIN_BLOCK_SIZE_SHIFT 20
+#define SD_MAX_BLOCK_SIZE_SHIFT 26
+
 #define SD_INODE_SIZE (sizeof(struct sheepdog_inode))
 #define SD_INODE_HEADER_SIZE (sizeof(struct sheepdog_inode) - \
 			      sizeof(uint32_t) * MAX_DATA_OBJS)
@@ -119,8 +132,16 @@ struct sd_req {
 	union {
 		struct {
 			uint64_t	oid;
-			uint64_t	cow_oid;
-			uint32_t	copies;
+			union {
+				uint64_t	cow_oid;
+				/* bytes to discard from offset on */
+				uint64_t	length;
+			};
+			uint8_t		copies;
+			/* strip index + 1 of erasure coded objects */
+			uint8_t		ec_index;
+			/* # of nodes to pass a chained write on to */
+			uint16_t	nr_chain;
 			uint32_t	tgt_epoch;
 			uint64_t	offset;
 		} obj;
@@ -129,7 +150,13 @@ struct sd_req {
 			uint32_t	base_vdi_id;
 			uint32_t	copies;
 			uint32_t	snapid;
+			uint32_t	copy_policy;
+			uint32_t	block_size_shift;
 		} vdi;
+		struct {
+			uint32_t	nr;
+			uint32_t	copies;
+		} vec;
 		uint32_t		__pad[8];
 	};
 };
@@ -147,6 +174,8 @@ struct sd_rsp {
 			uint32_t	__pad;
 			uint32_t	copies;
 			uint64_t	offset;
+			/* # of requests the node is serving, set by reads */
+			uint32_t	load;
 		} obj;
 		struct {
 			uint32_t	__pad;
@@ -159,6 +188,43 @@ struct sd_rsp {
 	};
 };
 
+/*
+ * Vectored object requests
+ *
+ * SD_OP_READ_OBJS and SD_OP_WRITE_OBJS carry 'vec.nr' entries at the head of
+ * the data buffer, followed by the data of every entry in the same order.
+ * Reads send the entries only and get back the whole buffer, writes send the
+ * whole buffer and get back the entries.  The result of each object is
+ * returned in its entry, and the data of reads is never trimmed.
+ *
+ * Entries are processed concurrently, so they must not overlap.
+ */
+#define SD_VEC_CREATE        0x01 /* create the object, i.e. CREATE_AND_WRITE */
+
+struct sd_vec_entry {
+	uint64_t	oid;
+	uint64_t	cow_oid;
+	uint32_t	offset;
+	uint32_t	length;
+	uint16_t	flags;
+	uint16_t	__pad;
+	uint32_t	result;
+};
+
+static inline uint64_t sd_vec_list_size(const struct sd_req *hdr)
+{
+	return (uint64_t)hdr->vec.nr * sizeof(struct sd_vec_entry);
+}
+
+/*
+ * flags of sheepdog_inode.copy_policy
+ *
+ * The low byte, if not zero, makes the data objects erasure coded instead of
+ * replicated: (d << 4) | p for d data strips and p parity strips.
+ */
+#define SD_COPY_POLICY_EC_MASK  0x00ff
+#define SD_COPY_POLICY_COMPRESS 0x8000 /* compress the cold data objects */
+
 struct sheepdog_inode {
 	char name[SD_MAX_VDI_LEN];
 	char tag[SD_MAX_VDI_TAG_LEN];
@@ -224,6 +290,20 @@ static inline bool is_data_obj_writeable(const struct sheepdog_inode *inode,
 	return inode->vdi_id == inode->data_vdi_id[idx];
 }
 
+static inline uint32_t block_size_shift_to_objsize(uint8_t shift)
+{
+	if (!shift)
+		return SD_DATA_OBJ_SIZE;
+
+	return UINT32_C(1) << shift;
+}
+
+/* The size of the data objects of the VDI */
+static inline uint32_t get_inode_objsize(const struct sheepdog_inode *inode)
+{
+	return block_size_shift_to_objsize(inode->block_size_shift);
+}
+
 static inline bool is_vdi_obj(uint64_t oid)
 {
 	return !!(oid & VDI_BIT);
@@ -8,6 +8,8 @@
 #include <limits.h>
 #include <stdint.h>
 #include <unistd.h>
+#include <sys/uio.h>
+#include <time.h>
 #include <urcu/uatomic.h>
 
 #include "bitops.h"
@@ -65,6 +67,15 @@ static inline int after(uint32_t seq1, uint32_t seq2)
 	(void) (&_x == &_y);		\
 	_x > _y ? _x : _y; })
 
+/* Monotonic time in microseconds */
+static inline uint64_t get_usec_time(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
 static inline void *zalloc(size_t size)
 {
 	return calloc(1, size);
@@ -82,6 +93,7 @@ ssize_t xread(int fd, void *buf, size_t len);
 ssize_t xwrite(int fd, const void *buf, size_t len);
 ssize_t xpread(int fd, void *buf, size_t count, off_t offset);
 ssize_t xpwrite(int fd, const void *buf, size_t count, off_t offset);
+ssize_t xpwritev(int fd, struct iovec *iov, int iovcnt, off_t offset);
 int xmkdir(const char *pathname, mode_t mode);
 void pstrcpy(char *buf, int buf_size, const char *str);
 int rmdir_r(char *dir_path);
@@ -95,6 +107,7 @@ bool is_xattr_enabled(const char *path);
 void trim_zero_sectors(void *buf, uint64_t *offset, uint32_t *len);
 void untrim_zero_sectors(void *buf, uint64_t offset, uint32_t len,
 			 uint32_t requested_len);
+bool is_zero_buf(const void *buf, size_t len);
 
 #ifdef assert
 #undef assert
@@ -0,0 +1,116 @@
+/*
+ * Copyright (C) 2013 Taobao Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The CRC instructions of SSE4.2 or ARMv8 are used when the CPU has them,
+ * otherwise a byte is looked up at a time in the table.
+ */
+#include <string.h>
+
+#ifdef __x86_64__
+#include <nmmintrin.h>
+#endif
+#ifdef __aarch64__
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+
+#include "crc32c.h"
+
+/* the reversed polynomial */
+#define CRC32C_POLY 0x82f63b78
+
+static uint32_t crc32c_table[256];
+
+static uint32_t crc32c_generic(uint32_t crc, const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+
+	while (len--)
+		crc = crc32c_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+	return crc;
+}
+
+#ifdef __x86_64__
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+	uint64_t c = crc, v;
+
+	for (; len >= 8; len -= 8, p += 8) {
+		memcpy(&v, p, sizeof(v));
+		c = _mm_crc32_u64(c, v);
+	}
+	crc = c;
+	for (; len; len--)
+		crc = _mm_crc32_u8(crc, *p++);
+	return crc;
+}
+#endif
+
+#if defined(__aarch64__) && defined(HWCAP_CRC32)
+__attribute__((target("+crc")))
+static uint32_t crc32c_arm(uint32_t crc, const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+	uint64_t v;
+
+	for (; len >= 8; len -= 8, p += 8) {
+		memcpy(&v, p, sizeof(v));
+		crc = __crc32cd(crc, v);
+	}
+	for (; len; len--)
+		crc = __crc32cb(crc, *p++);
+	return crc;
+}
+#endif
+
+static uint32_t (*crc32c_update)(uint32_t crc, const void *buf,
+				 size_t len) = crc32c_generic;
+static const char *kernel_name = "generic";
+
+static void __attribute__((constructor)) crc32c_init(void)
+{
+	uint32_t c;
+	int i, j;
+
+	for (i = 0; i < 256; i++) {
+		c = i;
+		for (j = 0; j < 8; j++)
+			c = (c >> 1) ^ (c & 1 ? CRC32C_POLY : 0);
+		crc32c_table[i] = c;
+	}
+
+#ifdef __x86_64__
+	if (__builtin_cpu_supports("sse4.2")) {
+		crc32c_update = crc32c_sse42;
+		kernel_name = "sse4.2";
+	}
+#endif
+#if defined(__aarch64__) && defined(HWCAP_CRC32)
+	if (getauxval(AT_HWCAP) & HWCAP_CRC32) {
+		crc32c_update = crc32c_arm;
+		kernel_name = "armv8 crc";
+	}
+#endif
+}
+
+const char *crc32c_kernel_name(void)
+{
+	return kernel_name;
+}
+
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len)
+{
+	return ~crc32c_update(~crc, buf, len);
+}
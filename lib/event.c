@@ -13,6 +13,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <poll.h>
 #include <sys/epoll.h>
 #include <sys/timerfd.h>
 
@@ -20,9 +21,23 @@
 #include "util.h"
 #include "event.h"
 #include "logger.h"
+#include "net.h"
 
-static int efd;
-static LIST_HEAD(events_list);
+/*
+ * Every thread that runs an event loop calls init_event() first and gets its
+ * own epoll set.  The other calls act on the loop of the calling thread.
+ *
+ * A loop which watches the fds of a transport that epoll can't see, e.g.
+ * rsockets, is set up with init_event_transport() instead and polls all its
+ * fds with the poll() of that transport.
+ */
+static __thread int efd;
+static __thread struct list_head events_list;
+static __thread const struct sd_transport *poll_tp;
+static __thread struct list_head dead_list;
+static __thread struct pollfd *pfds;
+static __thread struct event_info **pfd_eis;
+static __thread int nr_pfds;
 
 #define TICK 1
 
@@ -69,10 +84,14 @@ struct event_info {
 	int fd;
 	void *data;
 	struct list_head ei_list;
+	/* for the poll based loop */
+	unsigned int events;
+	bool dead;
 };
 
 int init_event(int nr)
 {
+	INIT_LIST_HEAD(&events_list);
 	efd = epoll_create(nr);
 	if (efd < 0) {
 		sd_eprintf("failed to create epoll fd");
@@ -81,6 +100,18 @@ int init_event(int nr)
 	return 0;
 }
 
+int init_event_transport(int nr, const struct sd_transport *tp)
+{
+	INIT_LIST_HEAD(&events_list);
+	INIT_LIST_HEAD(&dead_list);
+	efd = -1;
+	poll_tp = tp;
+	nr_pfds = nr;
+	pfds = xmalloc(sizeof(*pfds) * nr_pfds);
+	pfd_eis = xmalloc(sizeof(*pfd_eis) * nr_pfds);
+	return 0;
+}
+
 static struct event_info *lookup_event(int fd)
 {
 	struct event_info *ei;
@@ -103,6 +134,12 @@ int register_event(int fd, event_handler_t h, void *data)
 	ei->handler = h;
 	ei->data = data;
 
+	if (poll_tp) {
+		ei->events = EPOLLIN;
+		list_add(&ei->ei_list, &events_list);
+		return 0;
+	}
+
 	memset(&ev, 0, sizeof(ev));
 	ev.events = EPOLLIN;
 	ev.data.ptr = ei;
@@ -126,6 +163,13 @@ void unregister_event(int fd)
 	if (!ei)
 		return;
 
+	/* the loop may still hold it, free it after the dispatch */
+	if (poll_tp) {
+		ei->dead = true;
+		list_move(&ei->ei_list, &dead_list);
+		return;
+	}
+
 	ret = epoll_ctl(efd, EPOLL_CTL_DEL, fd, NULL);
 	if (ret)
 		sd_eprintf("failed to delete epoll event for fd %d: %m", fd);
@@ -146,6 +190,11 @@ int modify_event(int fd, unsigned int events)
 		return 1;
 	}
 
+	if (poll_tp) {
+		ei->events = events;
+		return 0;
+	}
+
 	memset(&ev, 0, sizeof(ev));
 	ev.events = events;
 	ev.data.ptr = ei;
@@ -158,11 +207,57 @@ int modify_event(int fd, unsigned int events)
 	return 0;
 }
 
+/* EPOLLIN, EPOLLOUT, EPOLLERR etc. have the values of their POLL* twins */
+static void poll_event_loop(void)
+{
+	struct event_info *ei, *n;
+	int i, nr = 0, ret;
+
+	list_for_each_entry(ei, &events_list, ei_list) {
+		if (nr == nr_pfds) {
+			nr_pfds *= 2;
+			pfds = xrealloc(pfds, sizeof(*pfds) * nr_pfds);
+			pfd_eis = xrealloc(pfd_eis, sizeof(*pfd_eis) * nr_pfds);
+		}
+		pfds[nr].fd = ei->fd;
+		pfds[nr].events = ei->events;
+		pfds[nr].revents = 0;
+		pfd_eis[nr++] = ei;
+	}
+
+	ret = poll_tp->poll(pfds, nr, TICK * 1000);
+	if (ret < 0) {
+		if (errno == EINTR)
+			return;
+		sd_eprintf("poll failed: %m");
+		exit(1);
+	}
+
+	for (i = 0; i < nr && ret; i++) {
+		if (!pfds[i].revents)
+			continue;
+		ret--;
+		ei = pfd_eis[i];
+		if (!ei->dead)
+			ei->handler(ei->fd, pfds[i].revents, ei->data);
+	}
+
+	list_for_each_entry_safe(ei, n, &dead_list, ei_list) {
+		list_del(&ei->ei_list);
+		free(ei);
+	}
+}
+
 void event_loop(int timeout)
 {
 	int i, nr;
 	struct epoll_event events[128];
 
+	if (poll_tp) {
+		poll_event_loop();
+		return;
+	}
+
 	nr = epoll_wait(efd, events, ARRAY_SIZE(events), TICK * 1000);
 	if (nr < 0) {
 		if (errno == EINTR)
@@ -0,0 +1,235 @@
+/*
+ * Copyright (C) 2013 Taobao Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The parity is a Cauchy matrix applied to the data strips, so that every d x d
+ * submatrix of the generator is invertible.  Strips are multiplied by a
+ * constant a region at a time.  With SSSE3 the product of 16 bytes is looked up
+ * at once by PSHUFB in the tables of the products of the low and the high
+ * nibbles, otherwise in the full multiplication table.
+ */
+#include <stdbool.h>
+#include <string.h>
+
+#ifdef __x86_64__
+#include <tmmintrin.h>
+#endif
+
+#include "fec.h"
+
+/* x^8 + x^4 + x^3 + x^2 + 1 */
+#define GF_POLY 0x11d
+
+static uint8_t gf_exp[512];
+static uint8_t gf_log[256];
+static uint8_t gf_mul_table[256][256];
+/* products of the low and the high nibbles */
+static uint8_t gf_nibble_table[256][2][16];
+
+static inline uint8_t gf_mul(uint8_t a, uint8_t b)
+{
+	return gf_mul_table[a][b];
+}
+
+static inline uint8_t gf_inv(uint8_t a)
+{
+	return gf_exp[255 - gf_log[a]];
+}
+
+static void mul_region_generic(uint8_t *dst, const uint8_t *src, uint8_t c,
+			       size_t len, bool add)
+{
+	const uint8_t *t = gf_mul_table[c];
+	size_t i;
+
+	if (add)
+		for (i = 0; i < len; i++)
+			dst[i] ^= t[src[i]];
+	else
+		for (i = 0; i < len; i++)
+			dst[i] = t[src[i]];
+}
+
+#ifdef __x86_64__
+__attribute__((target("ssse3")))
+static void mul_region_ssse3(uint8_t *dst, const uint8_t *src, uint8_t c,
+			     size_t len, bool add)
+{
+	__m128i lo = _mm_loadu_si128((const __m128i *)gf_nibble_table[c][0]);
+	__m128i hi = _mm_loadu_si128((const __m128i *)gf_nibble_table[c][1]);
+	__m128i mask = _mm_set1_epi8(0x0f);
+	size_t i;
+
+	for (i = 0; i + 16 <= len; i += 16) {
+		__m128i s = _mm_loadu_si128((const __m128i *)(src + i));
+		__m128i r;
+
+		r = _mm_xor_si128(
+			_mm_shuffle_epi8(lo, _mm_and_si128(s, mask)),
+			_mm_shuffle_epi8(hi, _mm_and_si128(_mm_srli_epi64(s, 4),
+							   mask)));
+		if (add)
+			r = _mm_xor_si128(r, _mm_loadu_si128(
+						  (const __m128i *)(dst + i)));
+		_mm_storeu_si128((__m128i *)(dst + i), r);
+	}
+
+	mul_region_generic(dst + i, src + i, c, len - i, add);
+}
+#endif
+
+static void (*mul_region)(uint8_t *dst, const uint8_t *src, uint8_t c,
+			  size_t len, bool add) = mul_region_generic;
+static const char *kernel_name = "generic";
+
+static void __attribute__((constructor)) gf_init(void)
+{
+	int i, j, x = 1;
+
+	for (i = 0; i < 255; i++) {
+		gf_exp[i] = gf_exp[i + 255] = x;
+		gf_log[x] = i;
+		x <<= 1;
+		if (x & 0x100)
+			x ^= GF_POLY;
+	}
+
+	for (i = 1; i < 256; i++)
+		for (j = 1; j < 256; j++)
+			gf_mul_table[i][j] = gf_exp[gf_log[i] + gf_log[j]];
+
+	for (i = 0; i < 256; i++)
+		for (j = 0; j < 16; j++) {
+			gf_nibble_table[i][0][j] = gf_mul(i, j);
+			gf_nibble_table[i][1][j] = gf_mul(i, j << 4);
+		}
+
+#ifdef __x86_64__
+	if (__builtin_cpu_supports("ssse3")) {
+		mul_region = mul_region_ssse3;
+		kernel_name = "ssse3";
+	}
+#endif
+}
+
+const char *fec_kernel_name(void)
+{
+	return kernel_name;
+}
+
+void fec_init(struct fec *fec, int d, int p)
+{
+	int i, j;
+
+	memset(fec, 0, sizeof(*fec));
+	fec->d = d;
+	fec->p = p;
+
+	for (i = 0; i < d; i++)
+		fec->matrix[i][i] = 1;
+	/* x_i = d + i and y_j = j never meet */
+	for (i = 0; i < p; i++)
+		for (j = 0; j < d; j++)
+			fec->matrix[d + i][j] = gf_inv((d + i) ^ j);
+}
+
+/* Compute the parity strips[d..d+p-1] from the data strips[0..d-1] */
+void fec_encode(const struct fec *fec, uint8_t *const *strips, size_t len)
+{
+	int i, j;
+
+	for (i = fec->d; i < fec->d + fec->p; i++)
+		for (j = 0; j < fec->d; j++)
+			mul_region(strips[i], strips[j], fec->matrix[i][j], len,
+				   j > 0);
+}
+
+/* Invert the n x n matrix m in place, return -1 if it is singular */
+static int invert_matrix(uint8_t m[][FEC_MAX_STRIPS], int n)
+{
+	uint8_t inv[FEC_MAX_STRIPS][FEC_MAX_STRIPS] = { { 0 } };
+	int i, j, k;
+	uint8_t c;
+
+	for (i = 0; i < n; i++)
+		inv[i][i] = 1;
+
+	for (i = 0; i < n; i++) {
+		for (k = i; k < n && !m[k][i]; k++)
+			;
+		if (k == n)
+			return -1;
+		if (k != i)
+			for (j = 0; j < n; j++) {
+				c = m[i][j], m[i][j] = m[k][j], m[k][j] = c;
+				c = inv[i][j], inv[i][j] = inv[k][j],
+					inv[k][j] = c;
+			}
+
+		c = gf_inv(m[i][i]);
+		for (j = 0; j < n; j++) {
+			m[i][j] = gf_mul(m[i][j], c);
+			inv[i][j] = gf_mul(inv[i][j], c);
+		}
+
+		for (k = 0; k < n; k++) {
+			if (k == i || !m[k][i])
+				continue;
+			c = m[k][i];
+			for (j = 0; j < n; j++) {
+				m[k][j] ^= gf_mul(m[i][j], c);
+				inv[k][j] ^= gf_mul(inv[i][j], c);
+			}
+		}
+	}
+
+	memcpy(m, inv, sizeof(inv));
+	return 0;
+}
+
+/*
+ * Rebuild the strips in the 'want' bitmap from d of the strips in the 'avail'
+ * bitmap.  Return -1 if fewer than d strips are available.
+ */
+int fec_reconstruct(const struct fec *fec, uint8_t *const *strips,
+		    uint32_t avail, uint32_t want, size_t len)
+{
+	uint8_t m[FEC_MAX_STRIPS][FEC_MAX_STRIPS], coef[FEC_MAX_STRIPS];
+	int rows[FEC_MAX_STRIPS], i, j, k, n = 0, d = fec->d;
+
+	for (i = 0; i < d + fec->p && n < d; i++)
+		if (avail & (1U << i))
+			rows[n++] = i;
+	if (n < d)
+		return -1;
+
+	for (i = 0; i < d; i++)
+		memcpy(m[i], fec->matrix[rows[i]], sizeof(m[i]));
+	if (invert_matrix(m, d) < 0)
+		return -1;
+
+	for (i = 0; i < d + fec->p; i++) {
+		if (!(want & (1U << i)))
+			continue;
+
+		/* the row of strip i applied to the inverse */
+		for (k = 0; k < d; k++) {
+			coef[k] = 0;
+			for (j = 0; j < d; j++)
+				coef[k] ^= gf_mul(fec->matrix[i][j], m[j][k]);
+		}
+		for (k = 0; k < d; k++)
+			mul_region(strips[i], strips[rows[k]], coef[k], len,
+				   k > 0);
+	}
+
+	return 0;
+}
@@ -15,6 +15,7 @@
 #include <fcntl.h>
 #include <string.h>
 #include <stdarg.h>
+#include <inttypes.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -28,7 +29,6 @@
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <sys/prctl.h>
-#include <sys/sem.h>
 #include <pthread.h>
 #include <libgen.h>
 #include <sys/time.h>
@@ -55,31 +55,51 @@ struct logger_user_info *logger_user_info;
 static void dolog(int prio, const char *func, int line, const char *fmt,
 		  va_list ap) __printf(4, 0);
 
-union semun {
-	int val;
-	struct semid_ds *buf;
-	unsigned short int *array;
-	struct seminfo *__buf;
+/*
+ * Every thread of the sheep process logs into the ring of the log area which
+ * it claimed with its first message, and the logger process drains all the
+ * rings.  A ring has a single producer and a single consumer, so neither
+ * takes a lock.  The threads which come when all the rings are claimed share
+ * the last one, which is never claimed, and take shared_ring_lock to log.
+ * When a ring is full the message is dropped and counted instead of waiting
+ * for the logger.  The rings live in shared memory and their offsets only
+ * grow; the logger owns tail, the producers head.
+ */
+#define LOG_NR_RINGS 256
+#define LOG_SHARED_RING (LOG_NR_RINGS - 1)
+#define LOG_FLUSH_INTERVAL_US 100000
+
+struct log_ring {
+	uint64_t head;
+	uint64_t nr_dropped;
+	/* written by the logger only */
+	uint64_t tail __attribute__((aligned(64)));
+	uint64_t nr_reported;	/* of nr_dropped */
+	unsigned long owner __attribute__((aligned(64)));
 };
 
 struct logarea {
 	bool active;
-	char *tail;
-	char *start;
-	char *end;
-	int semid;
-	union semun semarg;
-	int fd;
+	uint64_t ring_size;
+	unsigned long nr_free_rings;
+	struct log_ring rings[LOG_NR_RINGS];
+	char *start;		/* of the buffers of the rings */
 };
 
-#define FUNC_NAME_SIZE 32 /* according to C89, including '\0' */
+#define LOG_PAD (-1)	/* prio of the padding at the end of a ring */
+
 struct logmsg {
+	uint32_t size;		/* in the ring, a multiple of 8 */
+	int32_t prio;
 	struct timeval tv;
-	int prio;
-	char func[FUNC_NAME_SIZE];
+	/*
+	 * __func__ is in the text of the binary, which the logger shares with
+	 * the threads, so it is formatted lazily like the rest.
+	 */
+	const char *func;
 	int line;
-	char worker_name[MAX_THREAD_NAME_LEN];
 	int worker_idx;
+	char worker_name[MAX_THREAD_NAME_LEN];
 
 	char str[0];
 };
@@ -105,13 +125,15 @@ static int log_fd = -1;
 static __thread const char *worker_name;
 static __thread int worker_idx;
 static struct logarea *la;
+static __thread struct log_ring *this_ring;
+static pthread_key_t ring_key;
+static pthread_once_t ring_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t shared_ring_lock = PTHREAD_MUTEX_INITIALIZER;
 static const char *log_name;
 static char *log_nowname;
 static int log_level = SDOG_INFO;
 static pid_t sheep_pid;
 static pid_t logger_pid;
-static key_t semkey;
-static char *log_buff;
 
 static int64_t max_logsize = 500 * 1024 * 1024;  /*500MB*/
 
@@ -138,7 +160,7 @@ init_log_formatter(void)
 
 static notrace int logarea_init(int size)
 {
-	int shmid;
+	int shmid, i;
 
 	shmid = shmget(IPC_PRIVATE, sizeof(struct logarea),
 		       0644 | IPC_CREAT | IPC_EXCL);
@@ -148,17 +170,20 @@ static notrace int logarea_init(int size)
 	}
 
 	la = shmat(shmid, NULL, 0);
-	if (!la) {
+	if (la == (void *)-1) {
 		syslog(LOG_ERR, "shmat logarea failed: %m");
 		return 1;
 	}
 
 	shmctl(shmid, IPC_RMID, NULL);
+	memset(la, 0, sizeof(*la));
 
-	if (size < MAX_MSG_SIZE)
+	if (size < MAX_MSG_SIZE * LOG_NR_RINGS)
 		size = LOG_SPACE_SIZE;
+	la->ring_size = size / LOG_NR_RINGS & ~7ULL;
 
-	shmid = shmget(IPC_PRIVATE, size, 0644 | IPC_CREAT | IPC_EXCL);
+	shmid = shmget(IPC_PRIVATE, la->ring_size * LOG_NR_RINGS,
+		       0644 | IPC_CREAT | IPC_EXCL);
 	if (shmid == -1) {
 		syslog(LOG_ERR, "shmget msg failed: %m");
 		shmdt(la);
@@ -166,33 +191,18 @@ static notrace int logarea_init(int size)
 	}
 
 	la->start = shmat(shmid, NULL, 0);
-	if (!la->start) {
+	if (la->start == (void *)-1) {
 		syslog(LOG_ERR, "shmat msg failed: %m");
 		shmdt(la);
 		return 1;
 	}
-	memset(la->start, 0, size);
 
 	shmctl(shmid, IPC_RMID, NULL);
 
-	la->end = la->start + size;
-	la->tail = la->start;
-
-	la->semid = semget(semkey, 1, 0666 | IPC_CREAT);
-	if (la->semid < 0) {
-		syslog(LOG_ERR, "semget failed: %m");
-		shmdt(la->start);
-		shmdt(la);
-		return 1;
-	}
-
-	la->semarg.val = 1;
-	if (semctl(la->semid, 0, SETVAL, la->semarg) < 0) {
-		syslog(LOG_ERR, "semctl failed: %m");
-		shmdt(la->start);
-		shmdt(la);
-		return 1;
-	}
+	for (i = 0; i < LOG_NR_RINGS; i++)
+		la->rings[i].owner = 0;
+	la->rings[LOG_SHARED_RING].owner = 1;
+	la->nr_free_rings = LOG_NR_RINGS - 1;
 
 	return 0;
 }
@@ -201,11 +211,54 @@ static void notrace free_logarea(void)
 {
 	if (log_fd >= 0)
 		close(log_fd);
-	semctl(la->semid, 0, IPC_RMID, la->semarg);
 	shmdt(la->start);
 	shmdt(la);
 }
 
+static inline char *ring_buf(const struct log_ring *ring)
+{
+	return la->start + (ring - la->rings) * la->ring_size;
+}
+
+/* Called at the exit of a thread, to hand its ring over to the next one */
+static notrace void put_ring(void *data)
+{
+	struct log_ring *ring = data;
+
+	uatomic_set(&ring->owner, 0);
+	uatomic_inc(&la->nr_free_rings);
+}
+
+static notrace void init_ring_key(void)
+{
+	pthread_key_create(&ring_key, put_ring);
+}
+
+static notrace struct log_ring *get_ring(void)
+{
+	struct log_ring *ring;
+
+	if (this_ring)
+		return this_ring;
+
+	if (!uatomic_read(&la->nr_free_rings))
+		return NULL;
+
+	pthread_once(&ring_once, init_ring_key);
+	for (ring = la->rings; ring < la->rings + LOG_NR_RINGS; ring++) {
+		if (uatomic_read(&ring->owner) ||
+		    uatomic_cmpxchg(&ring->owner, 0, 1) != 0)
+			continue;
+
+		uatomic_dec(&la->nr_free_rings);
+		pthread_setspecific(ring_key, ring);
+		this_ring = ring;
+		return ring;
+	}
+
+	return NULL;
+}
+
 static notrace int default_log_formatter(char *buff, size_t size,
 				const struct logmsg *msg)
 {
@@ -336,13 +389,71 @@ static notrace void init_logmsg(struct logmsg *msg, struct timeval *tv,
 {
 	msg->tv = *tv;
 	msg->prio = prio;
-	pstrcpy(msg->func, FUNC_NAME_SIZE, func);
+	msg->func = func;
 	msg->line = line;
 	if (worker_name)
 		pstrcpy(msg->worker_name, MAX_THREAD_NAME_LEN, worker_name);
+	else
+		msg->worker_name[0] = '\0';
 	msg->worker_idx = worker_idx;
 }
 
+/*
+ * Copy the message to the ring, or drop it if the ring is full.  A record
+ * doesn't wrap, the end of the ring is padded instead.
+ */
+static notrace void ring_enqueue(struct log_ring *ring, struct timeval *tv,
+				 int prio, const char *func, int line,
+				 const char *str, int len)
+{
+	uint64_t head, tail, pos, pad = 0;
+	uint32_t size = roundup(sizeof(struct logmsg) + len + 1, 8);
+	struct logmsg *msg;
+
+	head = ring->head;
+	tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+	pos = head % la->ring_size;
+	if (pos + size > la->ring_size)
+		pad = la->ring_size - pos;
+	if (head + pad + size - tail > la->ring_size) {
+		uatomic_inc(&ring->nr_dropped);
+		return;
+	}
+
+	if (pad) {
+		msg = (struct logmsg *)(ring_buf(ring) + pos);
+		msg->size = pad;
+		msg->prio = LOG_PAD;
+		head += pad;
+	}
+
+	msg = (struct logmsg *)(ring_buf(ring) + head % la->ring_size);
+	init_logmsg(msg, tv, prio, func, line);
+	msg->size = size;
+	memcpy(msg->str, str, len + 1);
+
+	/* pairs with the acquire in log_flush() */
+	__atomic_store_n(&ring->head, head + size, __ATOMIC_RELEASE);
+}
+
+/* Log to the ring of this thread, or to the shared one if it has none */
+static notrace void log_enqueue(struct timeval *tv, int prio,
+				const char *func, int line, const char *str,
+				int len)
+{
+	struct log_ring *ring = get_ring();
+
+	if (ring) {
+		ring_enqueue(ring, tv, prio, func, line, str, len);
+		return;
+	}
+
+	pthread_mutex_lock(&shared_ring_lock);
+	ring_enqueue(la->rings + LOG_SHARED_RING, tv, prio, func, line, str,
+		     len);
+	pthread_mutex_unlock(&shared_ring_lock);
+}
+
 static notrace void dolog(int prio, const char *func, int line,
 		const char *fmt, va_list ap)
 {
@@ -354,39 +465,15 @@ static notrace void dolog(int prio, const char *func, int line,
 
 	gettimeofday(&tv, NULL);
 	len = vsnprintf(str, MAX_MSG_SIZE, fmt, ap);
+	if (len >= MAX_MSG_SIZE)
+		len = MAX_MSG_SIZE - 1;
 	if (len + 1 < MAX_MSG_SIZE && str[len - 1] != '\n') {
 		str[len++] = '\n';
 		str[len] = '\0';
 	}
 
 	if (la) {
-		struct sembuf ops;
-
-		ops.sem_num = 0;
-		ops.sem_flg = SEM_UNDO;
-		ops.sem_op = -1;
-		if (semop(la->semid, &ops, 1) < 0) {
-			syslog(LOG_ERR, "semop up failed: %m");
-			return;
-		}
-
-		/* not enough space: drop msg */
-		if (len + sizeof(struct logmsg) + 1 > la->end - la->tail)
-			syslog(LOG_ERR, "enqueue: log area overrun, "
-			       "dropping message\n");
-		else {
-			/* ok, we can stage the msg in the area */
-			msg = (struct logmsg *)la->tail;
-			init_logmsg(msg, &tv, prio, func, line);
-			memcpy(msg->str, str, len + 1);
-			la->tail += sizeof(struct logmsg) + len + 1;
-		}
-
-		ops.sem_op = 1;
-		if (semop(la->semid, &ops, 1) < 0) {
-			syslog(LOG_ERR, "semop down failed: %m");
-			return;
-		}
+		log_enqueue(&tv, prio, func, line, str, len);
 	} else {
 		char str_final[MAX_MSG_SIZE];
 
@@ -440,41 +527,107 @@ notrace void log_write(int prio, const char *func, int line, const char *fmt, ..
 	va_end(ap);
 }
 
-static notrace void log_flush(void)
+/* Log that nr messages were dropped, straight to the file */
+static notrace void log_dropped(const char *who, uint64_t nr)
 {
-	struct sembuf ops;
-	size_t size, done = 0;
-	const struct logmsg *msg;
+	struct logmsg *msg;
+	char buf[sizeof(*msg) + MAX_MSG_SIZE];
+	struct timeval tv;
 
-	if (la->tail == la->start)
-		return;
+	msg = (struct logmsg *)buf;
+	memset(msg, 0, sizeof(*msg));
+	gettimeofday(&tv, NULL);
+	init_logmsg(msg, &tv, SDOG_WARNING, __func__, __LINE__);
+	snprintf(msg->str, MAX_MSG_SIZE, "%" PRIu64 " messages dropped, %s\n",
+		 nr, who);
+	log_syslog(msg);
+}
 
-	ops.sem_num = 0;
-	ops.sem_flg = SEM_UNDO;
-	ops.sem_op = -1;
-	if (semop(la->semid, &ops, 1) < 0) {
-		syslog(LOG_ERR, "semop up failed: %m");
-		exit(1);
+static inline struct logmsg *ring_peek(struct log_ring *ring, uint64_t head)
+{
+	struct logmsg *msg;
+
+	while (ring->tail < head) {
+		msg = (struct logmsg *)(ring_buf(ring) +
+					ring->tail % la->ring_size);
+		if (msg->prio != LOG_PAD)
+			return msg;
+		__atomic_store_n(&ring->tail, ring->tail + msg->size,
+				 __ATOMIC_RELEASE);
 	}
 
-	size = la->tail - la->start;
-	memcpy(log_buff, la->start, size);
-	memset(la->start, 0, size);
-	la->tail = la->start;
+	return NULL;
+}
 
-	ops.sem_op = 1;
-	if (semop(la->semid, &ops, 1) < 0) {
-		syslog(LOG_ERR, "semop down failed: %m");
-		exit(1);
+static inline bool msg_before(const struct logmsg *a, const struct logmsg *b)
+{
+	return a->tv.tv_sec < b->tv.tv_sec ||
+		(a->tv.tv_sec == b->tv.tv_sec && a->tv.tv_usec < b->tv.tv_usec);
+}
+
+/*
+ * Write out what the rings hold, merged in the order of the time stamps so
+ * that the messages of the threads interleave as they were logged.
+ */
+static notrace void log_flush(void)
+{
+	uint64_t heads[LOG_NR_RINGS], nr;
+	struct logmsg *msg, *first;
+	struct log_ring *ring, *from;
+	char who[64];
+	int i;
+
+	for (i = 0; i < LOG_NR_RINGS; i++)
+		/* pairs with the release in log_enqueue() */
+		heads[i] = __atomic_load_n(&la->rings[i].head,
+					   __ATOMIC_ACQUIRE);
+
+	for (;;) {
+		first = NULL;
+		from = NULL;
+		for (i = 0; i < LOG_NR_RINGS; i++) {
+			ring = la->rings + i;
+			msg = ring_peek(ring, heads[i]);
+			if (msg && (!first || msg_before(msg, first))) {
+				first = msg;
+				from = ring;
+			}
+		}
+		if (!first)
+			break;
+
+		log_syslog(first);
+		__atomic_store_n(&from->tail, from->tail + first->size,
+				 __ATOMIC_RELEASE);
 	}
 
-	while (done < size) {
-		msg = (const struct logmsg *)(log_buff + done);
-		log_syslog(msg);
-		done += sizeof(*msg) + strlen(msg->str) + 1;
+	for (i = 0; i < LOG_NR_RINGS; i++) {
+		ring = la->rings + i;
+		nr = uatomic_read(&ring->nr_dropped);
+		if (nr == ring->nr_reported)
+			continue;
+		if (i == LOG_SHARED_RING)
+			snprintf(who, sizeof(who), "shared log ring is full");
+		else
+			snprintf(who, sizeof(who), "log ring %d is full", i);
+		log_dropped(who, nr - ring->nr_reported);
+		ring->nr_reported = nr;
 	}
 }
 
+uint64_t log_nr_dropped(void)
+{
+	uint64_t nr = 0;
+	int i;
+
+	if (!la)
+		return 0;
+
+	for (i = 0; i < LOG_NR_RINGS; i++)
+		nr += uatomic_read(&la->rings[i].nr_dropped);
+	return nr;
+}
+
 static notrace void crash_handler(int signo)
 {
 	if (signo == SIGHUP)
@@ -496,7 +649,8 @@ static notrace void logger(char *log_dir, char *outfile)
 {
 	int fd;
 
-	log_buff = xzalloc(la->end - la->start);
+	/* the ring of the thread which forked us is not ours */
+	this_ring = NULL;
 
 	log_fd = open(outfile, O_CREAT | O_RDWR | O_APPEND, 0644);
 	if (log_fd < 0) {
@@ -551,11 +705,10 @@ static notrace void logger(char *log_dir, char *outfile)
 			pthread_mutex_unlock(&logsize_lock);
 		}
 
-		sleep(1);
+		usleep(LOG_FLUSH_INTERVAL_US);
 	}
 
 	log_flush();
-	free(log_buff);
 	free_logarea();
 	exit(0);
 }
@@ -594,8 +747,6 @@ notrace int log_init(const char *program_name, int size, bool to_stdout,
 	pstrcpy(tmp, sizeof(tmp), outfile);
 	pstrcpy(log_dir, sizeof(log_dir), dirname(tmp));
 
-	semkey = random();
-
 	if (to_stdout) {
 		if (is_stdout_console())
 			colorize = true;
@@ -20,7 +20,9 @@
 #include <net/if.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
+#include <pthread.h>
 #include <sys/epoll.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <sys/stat.h>
@@ -32,6 +34,199 @@
 #include "net.h"
 #include "logger.h"
 
+static int tcp_bind(int fd, const struct sockaddr *addr, socklen_t len)
+{
+	return bind(fd, addr, len);
+}
+
+static int tcp_accept(int fd, struct sockaddr *addr, socklen_t *len)
+{
+	return accept(fd, addr, len);
+}
+
+static int tcp_connect(int fd, const struct sockaddr *addr, socklen_t len)
+{
+	return connect(fd, addr, len);
+}
+
+static int tcp_getpeername(int fd, struct sockaddr *addr, socklen_t *len)
+{
+	return getpeername(fd, addr, len);
+}
+
+static const struct sd_transport tcp_transport = {
+	.name = "tcp",
+	.id = SD_TRANSPORT_TCP,
+	.socket = socket,
+	.bind = tcp_bind,
+	.listen = listen,
+	.accept = tcp_accept,
+	.connect = tcp_connect,
+	.getpeername = tcp_getpeername,
+	.setsockopt = setsockopt,
+	.fcntl = fcntl,
+	.read = read,
+	.write = write,
+	.writev = writev,
+	.sendmsg = sendmsg,
+	.poll = poll,
+	.shutdown = shutdown,
+	.close = close,
+};
+
+#ifdef ENABLE_RDMA
+extern const struct sd_transport rdma_transport;
+#endif
+
+static const struct sd_transport *transports[SD_NR_TRANSPORTS] = {
+	[SD_TRANSPORT_TCP] = &tcp_transport,
+#ifdef ENABLE_RDMA
+	[SD_TRANSPORT_RDMA] = &rdma_transport,
+#endif
+};
+
+/*
+ * The transport ids of the fds, indexed by the fd number.  rsockets hand out
+ * kernel fds too, so the numbers of the different transports never clash.
+ * The table is only allocated once an fd is bound to something else than TCP.
+ */
+static uint8_t *fd_transports;
+static int nr_fd_transports;
+static pthread_mutex_t fd_transports_lock = PTHREAD_MUTEX_INITIALIZER;
+
+const struct sd_transport *get_transport(int id)
+{
+	if (id < 0 || id >= SD_NR_TRANSPORTS)
+		return NULL;
+	return transports[id];
+}
+
+const struct sd_transport *find_transport(const char *name)
+{
+	int i;
+
+	for (i = 0; i < SD_NR_TRANSPORTS; i++)
+		if (transports[i] && !strcmp(transports[i]->name, name))
+			return transports[i];
+	return NULL;
+}
+
+notrace const struct sd_transport *fd_transport(int fd)
+{
+	uint8_t *table = __atomic_load_n(&fd_transports, __ATOMIC_ACQUIRE);
+
+	if (!table || fd < 0 || fd >= nr_fd_transports)
+		return &tcp_transport;
+	return transports[table[fd]];
+}
+
+static int bind_fd_transport(int fd, const struct sd_transport *tp)
+{
+	struct rlimit rlim;
+	uint8_t *table;
+	int nr;
+
+	if (tp == fd_transport(fd))
+		return 0;
+
+	pthread_mutex_lock(&fd_transports_lock);
+	if (!fd_transports) {
+		if (getrlimit(RLIMIT_NOFILE, &rlim) < 0 ||
+		    rlim.rlim_cur == RLIM_INFINITY)
+			nr = 1 << 20;
+		else
+			nr = rlim.rlim_cur;
+		table = xzalloc(nr);
+		nr_fd_transports = nr;
+		__atomic_store_n(&fd_transports, table, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&fd_transports_lock);
+
+	if (fd >= nr_fd_transports) {
+		sd_eprintf("fd %d is beyond the transport table", fd);
+		errno = EMFILE;
+		return -1;
+	}
+	fd_transports[fd] = tp->id;
+	return 0;
+}
+
+int net_accept(int fd, struct sockaddr *addr, socklen_t *len)
+{
+	const struct sd_transport *tp = fd_transport(fd);
+	int cfd;
+
+	cfd = tp->accept(fd, addr, len);
+	if (cfd >= 0 && bind_fd_transport(cfd, tp) < 0) {
+		tp->close(cfd);
+		return -1;
+	}
+	return cfd;
+}
+
+int net_getpeername(int fd, struct sockaddr *addr, socklen_t *len)
+{
+	return fd_transport(fd)->getpeername(fd, addr, len);
+}
+
+notrace ssize_t net_read(int fd, void *buf, size_t count)
+{
+	return fd_transport(fd)->read(fd, buf, count);
+}
+
+notrace ssize_t net_writev(int fd, const struct iovec *iov, int iovcnt)
+{
+	return fd_transport(fd)->writev(fd, iov, iovcnt);
+}
+
+/* The first fd which isn't TCP decides whose poll() watches them all */
+static const struct sd_transport *poll_transport(struct pollfd *fds,
+						 nfds_t nfds)
+{
+	const struct sd_transport *tp;
+	nfds_t i;
+
+	for (i = 0; i < nfds; i++) {
+		tp = fd_transport(fds[i].fd);
+		if (tp != &tcp_transport)
+			return tp;
+	}
+	return &tcp_transport;
+}
+
+int net_poll(struct pollfd *fds, nfds_t nfds, int timeout)
+{
+	return poll_transport(fds, nfds)->poll(fds, nfds, timeout);
+}
+
+int net_ppoll(struct pollfd *fds, nfds_t nfds, const struct timespec *ts)
+{
+	const struct sd_transport *tp = poll_transport(fds, nfds);
+
+	if (tp == &tcp_transport)
+		return ppoll(fds, nfds, ts, NULL);
+	return tp->poll(fds, nfds, ts->tv_sec * 1000 +
+			DIV_ROUND_UP(ts->tv_nsec, 1000000));
+}
+
+int net_shutdown(int fd, int how)
+{
+	return fd_transport(fd)->shutdown(fd, how);
+}
+
+/*
+ * Unbind the fd before closing it, another thread may get the number back
+ * for a TCP socket right after.
+ */
+int net_close(int fd)
+{
+	const struct sd_transport *tp = fd_transport(fd);
+
+	if (tp != &tcp_transport)
+		fd_transports[fd] = SD_TRANSPORT_TCP;
+	return tp->close(fd);
+}
+
 int conn_tx_off(struct connection *conn)
 {
 	conn->events &= ~EPOLLOUT;
@@ -72,7 +267,7 @@ int rx(struct connection *conn, enum conn_state next_state)
 {
 	int ret;
 
-	ret = read(conn->fd, conn->rx_buf, conn->rx_length);
+	ret = net_read(conn->fd, conn->rx_buf, conn->rx_length);
 	if (!ret) {
 		conn->c_rx_state = C_IO_CLOSED;
 		return 0;
@@ -97,7 +292,8 @@ notrace int tx(struct connection *conn, enum conn_state next_state)
 {
 	int ret;
 
-	ret = write(conn->fd, conn->tx_buf, conn->tx_length);
+	ret = fd_transport(conn->fd)->write(conn->fd, conn->tx_buf,
+					    conn->tx_length);
 	if (ret < 0) {
 		if (errno != EAGAIN && errno != EINTR)
 			conn->c_tx_state = C_IO_CLOSED;
@@ -113,8 +309,9 @@ notrace int tx(struct connection *conn, enum conn_state next_state)
 	return ret;
 }
 
-int create_listen_ports(const char *bindaddr, int port,
-		int (*callback)(int fd, void *), void *data)
+int create_transport_listen_ports(const struct sd_transport *tp,
+				  const char *bindaddr, int port,
+				  int (*callback)(int fd, void *), void *data)
 {
 	char servname[64];
 	int fd, ret, opt;
@@ -135,49 +332,52 @@ int create_listen_ports(const char *bindaddr, int port,
 	}
 
 	for (res = res0; res; res = res->ai_next) {
-		fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+		fd = tp->socket(res->ai_family, res->ai_socktype,
+				res->ai_protocol);
 		if (fd < 0)
 			continue;
+		if (bind_fd_transport(fd, tp) < 0) {
+			tp->close(fd);
+			continue;
+		}
 
 		opt = 1;
-		ret = setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt,
-				 sizeof(opt));
+		ret = tp->setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt,
+				     sizeof(opt));
 		if (ret)
 			sd_eprintf("failed to set SO_REUSEADDR: %m");
 
 		opt = 1;
 		if (res->ai_family == AF_INET6) {
-			ret = setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &opt,
-					 sizeof(opt));
+			ret = tp->setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY,
+					     &opt, sizeof(opt));
 			if (ret) {
-				close(fd);
+				net_close(fd);
 				continue;
 			}
 		}
 
-		ret = bind(fd, res->ai_addr, res->ai_addrlen);
+		ret = tp->bind(fd, res->ai_addr, res->ai_addrlen);
 		if (ret) {
 			sd_eprintf("failed to bind server socket: %m");
-			close(fd);
+			net_close(fd);
 			continue;
 		}
 
-		ret = listen(fd, SOMAXCONN);
+		ret = tp->listen(fd, SOMAXCONN);
 		if (ret) {
 			sd_eprintf("failed to listen on server socket: %m");
-			close(fd);
+			net_close(fd);
 			continue;
 		}
 
 		ret = set_nonblocking(fd);
-		if (ret < 0) {
-			close(fd);
+		if (ret < 0)
 			continue;
-		}
 
 		ret = callback(fd, data);
 		if (ret) {
-			close(fd);
+			net_close(fd);
 			continue;
 		}
 
@@ -192,7 +392,15 @@ int create_listen_ports(const char *bindaddr, int port,
 	return !success;
 }
 
-int connect_to(const char *name, int port)
+int create_listen_ports(const char *bindaddr, int port,
+			int (*callback)(int fd, void *), void *data)
+{
+	return create_transport_listen_ports(&tcp_transport, bindaddr, port,
+					     callback, data);
+}
+
+int connect_to_transport(const struct sd_transport *tp, const char *name,
+			 int port)
 {
 	char buf[64];
 	char hbuf[NI_MAXHOST], sbuf[NI_MAXSERV];
@@ -218,44 +426,49 @@ int connect_to(const char *name, int port)
 		if (ret)
 			continue;
 
-		fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+		fd = tp->socket(res->ai_family, res->ai_socktype,
+				res->ai_protocol);
 		if (fd < 0)
 			continue;
+		if (bind_fd_transport(fd, tp) < 0) {
+			tp->close(fd);
+			continue;
+		}
 
-		ret = setsockopt(fd, SOL_SOCKET, SO_LINGER, &linger_opt,
-				 sizeof(linger_opt));
+		ret = tp->setsockopt(fd, SOL_SOCKET, SO_LINGER, &linger_opt,
+				     sizeof(linger_opt));
 		if (ret) {
 			sd_eprintf("failed to set SO_LINGER: %m");
-			close(fd);
+			net_close(fd);
 			continue;
 		}
 
 		ret = set_snd_timeout(fd);
 		if (ret) {
 			sd_eprintf("failed to set send timeout: %m");
-			close(fd);
+			net_close(fd);
 			break;
 		}
 
 		ret = set_rcv_timeout(fd);
 		if (ret) {
 			sd_eprintf("failed to set recv timeout: %m");
-			close(fd);
+			net_close(fd);
 			break;
 		}
 
-		ret = connect(fd, res->ai_addr, res->ai_addrlen);
+		ret = tp->connect(fd, res->ai_addr, res->ai_addrlen);
 		if (ret) {
 			sd_eprintf("failed to connect to %s:%d: %m", name,
 				   port);
-			close(fd);
+			net_close(fd);
 			continue;
 		}
 
 		ret = set_nodelay(fd);
 		if (ret) {
 			sd_eprintf("%m");
-			close(fd);
+			net_close(fd);
 			break;
 		} else
 			goto success;
@@ -267,12 +480,17 @@ success:
 	return fd;
 }
 
+int connect_to(const char *name, int port)
+{
+	return connect_to_transport(&tcp_transport, name, port);
+}
+
 int do_read(int sockfd, void *buf, int len, bool (*need_retry)(uint32_t epoch),
 	    uint32_t epoch)
 {
 	int ret, repeat = MAX_RETRY_COUNT;
 reread:
-	ret = read(sockfd, buf, len);
+	ret = net_read(sockfd, buf, len);
 	if (ret < 0 || !ret) {
 		if (errno == EINTR)
 			goto reread;
@@ -316,7 +534,7 @@ static int do_write(int sockfd, struct msghdr *msg, int len,
 {
 	int ret, repeat = MAX_RETRY_COUNT;
 rewrite:
-	ret = sendmsg(sockfd, msg, 0);
+	ret = fd_transport(sockfd)->sendmsg(sockfd, msg, 0);
 	if (ret < 0) {
 		if (errno == EINTR)
 			goto rewrite;
@@ -374,23 +592,38 @@ int send_req(int sockfd, struct sd_req *hdr, void *data, unsigned int wlen,
 	return ret;
 }
 
-int exec_req(int sockfd, struct sd_req *hdr, void *data,
-	     bool (*need_retry)(uint32_t epoch), uint32_t epoch)
+/*
+ * Send the request with the data it carries and return in 'rlen' the length
+ * of the data that its response brings back, for wait_rsp().
+ */
+int submit_req(int sockfd, struct sd_req *hdr, void *data, unsigned int *rlen,
+	       bool (*need_retry)(uint32_t epoch), uint32_t epoch)
 {
-	int ret;
-	struct sd_rsp *rsp = (struct sd_rsp *)hdr;
-	unsigned int wlen, rlen;
+	unsigned int wlen;
 
-	if (hdr->flags & SD_FLAG_CMD_WRITE) {
+	if (hdr->opcode == SD_OP_READ_OBJS) {
+		wlen = sd_vec_list_size(hdr);
+		*rlen = hdr->data_length;
+	} else if (hdr->opcode == SD_OP_WRITE_OBJS) {
+		wlen = hdr->data_length;
+		*rlen = sd_vec_list_size(hdr);
+	} else if (hdr->flags & SD_FLAG_CMD_WRITE) {
 		wlen = hdr->data_length;
-		rlen = 0;
+		*rlen = 0;
 	} else {
 		wlen = 0;
-		rlen = hdr->data_length;
+		*rlen = hdr->data_length;
 	}
 
-	if (send_req(sockfd, hdr, data, wlen, need_retry, epoch))
-		return 1;
+	return send_req(sockfd, hdr, data, wlen, need_retry, epoch) ? 1 : 0;
+}
+
+/* Read the response to a submitted request into 'hdr' and 'data'. */
+int wait_rsp(int sockfd, struct sd_req *hdr, void *data, unsigned int rlen,
+	     bool (*need_retry)(uint32_t epoch), uint32_t epoch)
+{
+	int ret;
+	struct sd_rsp *rsp = (struct sd_rsp *)hdr;
 
 	ret = do_read(sockfd, rsp, sizeof(*rsp), need_retry, epoch);
 	if (ret) {
@@ -412,6 +645,17 @@ int exec_req(int sockfd, struct sd_req *hdr, void *data,
 	return 0;
 }
 
+int exec_req(int sockfd, struct sd_req *hdr, void *data,
+	     bool (*need_retry)(uint32_t epoch), uint32_t epoch)
+{
+	unsigned int rlen;
+
+	if (submit_req(sockfd, hdr, data, &rlen, need_retry, epoch))
+		return 1;
+
+	return wait_rsp(sockfd, hdr, data, rlen, need_retry, epoch);
+}
+
 char *addr_to_str(char *str, int size, const uint8_t *addr, uint16_t port)
 {
 	int  af = AF_INET6;
@@ -451,14 +695,15 @@ uint8_t *str_to_addr(const char *ipstr, uint8_t *addr)
 
 int set_nonblocking(int fd)
 {
+	const struct sd_transport *tp = fd_transport(fd);
 	int ret;
 
-	ret = fcntl(fd, F_GETFL);
+	ret = tp->fcntl(fd, F_GETFL);
 	if (ret < 0) {
 		sd_eprintf("fcntl F_GETFL failed: %m");
-		close(fd);
+		net_close(fd);
 	} else {
-		ret = fcntl(fd, F_SETFL, ret | O_NONBLOCK);
+		ret = tp->fcntl(fd, F_SETFL, ret | O_NONBLOCK);
 		if (ret < 0)
 			sd_eprintf("fcntl O_NONBLOCK failed: %m");
 	}
@@ -473,8 +718,8 @@ int set_snd_timeout(int fd)
 	timeout.tv_sec = POLL_TIMEOUT;
 	timeout.tv_usec = 0;
 
-	return setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, (char *)&timeout,
-			  sizeof(timeout));
+	return fd_transport(fd)->setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO,
+					    (char *)&timeout, sizeof(timeout));
 }
 
 int set_rcv_timeout(int fd)
@@ -487,8 +732,8 @@ int set_rcv_timeout(int fd)
 	timeout.tv_sec = MAX_POLLTIME;
 	timeout.tv_usec = 0;
 
-	return setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, (char *)&timeout,
-			  sizeof(timeout));
+	return fd_transport(fd)->setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO,
+					    (char *)&timeout, sizeof(timeout));
 }
 
 int set_nodelay(int fd)
@@ -496,7 +741,8 @@ int set_nodelay(int fd)
 	int ret, opt;
 
 	opt = 1;
-	ret = setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+	ret = fd_transport(fd)->setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &opt,
+					   sizeof(opt));
 	return ret;
 }
 
@@ -0,0 +1,217 @@
+/*
+ * Copyright (C) 2013 Taobao Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * RDMA transport
+ *
+ * The connections are rsockets, i.e. RDMA (InfiniBand or RoCE) streams behind
+ * a socket API.  rsockets register the buffers and move the data with RDMA
+ * writes of their own, so the transport doesn't have to manage memory regions
+ * and the request code stays the same for both transports.
+ *
+ * rsockets don't implement SO_RCVTIMEO and SO_SNDTIMEO, which the blocking
+ * peer connections rely on to give up on a dead node, so the timeouts are kept
+ * here and enforced with rpoll() before the blocking reads and writes.
+ *
+ * This transport, and the poll based net loop which only it uses, have not
+ * been run on an RDMA stack yet; tests/061 covers the TCP transport only.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <rdma/rsocket.h>
+
+#include "util.h"
+#include "net.h"
+#include "logger.h"
+
+struct rdma_timeout {
+	int rcv_ms;
+	int snd_ms;
+};
+
+static struct rdma_timeout *timeouts;
+static int nr_timeouts;
+static pthread_once_t timeouts_once = PTHREAD_ONCE_INIT;
+
+static void init_timeouts(void)
+{
+	struct rlimit rlim;
+
+	if (getrlimit(RLIMIT_NOFILE, &rlim) < 0 ||
+	    rlim.rlim_cur == RLIM_INFINITY)
+		nr_timeouts = 1 << 20;
+	else
+		nr_timeouts = rlim.rlim_cur;
+	timeouts = xzalloc(sizeof(*timeouts) * nr_timeouts);
+}
+
+static struct rdma_timeout *fd_timeout(int fd)
+{
+	pthread_once(&timeouts_once, init_timeouts);
+	if (fd < 0 || fd >= nr_timeouts)
+		return NULL;
+	return timeouts + fd;
+}
+
+/* Wait until the fd is ready for 'events', up to its timeout */
+static int rdma_wait(int fd, short events, int timeout)
+{
+	struct pollfd pfd = { .fd = fd, .events = events };
+	int ret;
+
+	if (!timeout)
+		return 0;
+again:
+	ret = rpoll(&pfd, 1, timeout);
+	if (ret < 0) {
+		if (errno == EINTR)
+			goto again;
+		return -1;
+	}
+	if (!ret) {
+		errno = EAGAIN;
+		return -1;
+	}
+	return 0;
+}
+
+static int rdma_bind(int fd, const struct sockaddr *addr, socklen_t len)
+{
+	return rbind(fd, addr, len);
+}
+
+static int rdma_accept(int fd, struct sockaddr *addr, socklen_t *len)
+{
+	int cfd = raccept(fd, addr, len);
+	struct rdma_timeout *t = fd_timeout(cfd);
+
+	if (t)
+		t->rcv_ms = t->snd_ms = 0;
+	return cfd;
+}
+
+static int rdma_connect(int fd, const struct sockaddr *addr, socklen_t len)
+{
+	return rconnect(fd, addr, len);
+}
+
+static int rdma_getpeername(int fd, struct sockaddr *addr, socklen_t *len)
+{
+	return rgetpeername(fd, addr, len);
+}
+
+static int rdma_socket(int domain, int type, int protocol)
+{
+	int fd = rsocket(domain, type, protocol);
+	struct rdma_timeout *t = fd_timeout(fd);
+
+	if (t)
+		t->rcv_ms = t->snd_ms = 0;
+	return fd;
+}
+
+static int rdma_setsockopt(int fd, int level, int name, const void *val,
+			   socklen_t len)
+{
+	const struct timeval *tv = val;
+	struct rdma_timeout *t;
+
+	if (level != SOL_SOCKET || (name != SO_RCVTIMEO && name != SO_SNDTIMEO))
+		return rsetsockopt(fd, level, name, val, len);
+
+	t = fd_timeout(fd);
+	if (!t || len < sizeof(*tv)) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (name == SO_RCVTIMEO)
+		t->rcv_ms = tv->tv_sec * 1000 + tv->tv_usec / 1000;
+	else
+		t->snd_ms = tv->tv_sec * 1000 + tv->tv_usec / 1000;
+	return 0;
+}
+
+static int rdma_fcntl(int fd, int cmd, ...)
+{
+	va_list ap;
+	int arg;
+
+	va_start(ap, cmd);
+	arg = va_arg(ap, int);
+	va_end(ap);
+
+	return rfcntl(fd, cmd, arg);
+}
+
+static ssize_t rdma_read(int fd, void *buf, size_t count)
+{
+	struct rdma_timeout *t = fd_timeout(fd);
+
+	if (t && rdma_wait(fd, POLLIN, t->rcv_ms) < 0)
+		return -1;
+	return rread(fd, buf, count);
+}
+
+static ssize_t rdma_write(int fd, const void *buf, size_t count)
+{
+	struct rdma_timeout *t = fd_timeout(fd);
+
+	if (t && rdma_wait(fd, POLLOUT, t->snd_ms) < 0)
+		return -1;
+	return rwrite(fd, buf, count);
+}
+
+static ssize_t rdma_writev(int fd, const struct iovec *iov, int iovcnt)
+{
+	struct rdma_timeout *t = fd_timeout(fd);
+
+	if (t && rdma_wait(fd, POLLOUT, t->snd_ms) < 0)
+		return -1;
+	return rwritev(fd, iov, iovcnt);
+}
+
+static ssize_t rdma_sendmsg(int fd, const struct msghdr *msg, int flags)
+{
+	struct rdma_timeout *t = fd_timeout(fd);
+
+	if (t && rdma_wait(fd, POLLOUT, t->snd_ms) < 0)
+		return -1;
+	return rsendmsg(fd, msg, flags);
+}
+
+static int rdma_poll(struct pollfd *fds, nfds_t nfds, int timeout)
+{
+	return rpoll(fds, nfds, timeout);
+}
+
+const struct sd_transport rdma_transport = {
+	.name = "rdma",
+	.id = SD_TRANSPORT_RDMA,
+	.socket = rdma_socket,
+	.bind = rdma_bind,
+	.listen = rlisten,
+	.accept = rdma_accept,
+	.connect = rdma_connect,
+	.getpeername = rdma_getpeername,
+	.setsockopt = rdma_setsockopt,
+	.fcntl = rdma_fcntl,
+	.read = rdma_read,
+	.write = rdma_write,
+	.writev = rdma_writev,
+	.sendmsg = rdma_sendmsg,
+	.poll = rdma_poll,
+	.shutdown = rshutdown,
+	.close = rclose,
+};
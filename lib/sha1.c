@@ -17,7 +17,25 @@
  * any later version.
  *
  */
+
+/*
+ * The blocks are hashed with the SHA extensions of x86 or the crypto
+ * extensions of ARMv8 when the CPU has them, selected at startup.  With AVX2,
+ * sha1_multi() hashes 8 buffers at once in its lanes, which even beats the SHA
+ * extensions one buffer at a time.
+ */
+#include <stdbool.h>
 #include <arpa/inet.h>
+
+#ifdef __x86_64__
+#include <immintrin.h>
+#endif
+#ifdef __aarch64__
+#include <arm_neon.h>
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+
 #include "sha1.h"
 
 #define SHA1_DIGEST_SIZE	20
@@ -54,7 +72,7 @@ static inline uint32_t rol(uint32_t value, uint32_t bits)
 	w = rol(w, 30);
 
 /* Hash a single 512-bit block. This is the core of the algorithm. */
-static void sha1_transform(uint32_t *state, const uint8_t *in)
+static void sha1_transform_generic(uint32_t *state, const uint8_t *in)
 {
 	uint32_t a, b, c, d, e;
 	uint32_t block32[16];
@@ -126,6 +144,299 @@ static void sha1_transform(uint32_t *state, const uint8_t *in)
 	memset(block32, 0x00, sizeof block32);
 }
 
+static void sha1_blocks_generic(uint32_t *state, const uint8_t *in,
+				unsigned int nr)
+{
+	for (; nr; nr--, in += 64)
+		sha1_transform_generic(state, in);
+}
+
+#ifdef __x86_64__
+/*
+ * 4 rounds of the SHA extensions, g is the index of the group.  m[g % 4] holds
+ * the words of the group, and the schedule of the next ones is advanced in
+ * the others.
+ */
+#define SHANI_ROUNDS4(g)						\
+do {									\
+	if ((g) == 0)							\
+		e[0] = _mm_add_epi32(e[0], m[0]);			\
+	else								\
+		e[(g) % 2] = _mm_sha1nexte_epu32(e[(g) % 2], m[(g) % 4]); \
+	e[((g) + 1) % 2] = abcd;					\
+	if ((g) >= 3 && (g) <= 18)					\
+		m[((g) + 1) % 4] = _mm_sha1msg2_epu32(m[((g) + 1) % 4],	\
+						      m[(g) % 4]);	\
+	abcd = _mm_sha1rnds4_epu32(abcd, e[(g) % 2], (g) / 5);		\
+	if ((g) >= 1 && (g) <= 16)					\
+		m[((g) + 3) % 4] = _mm_sha1msg1_epu32(m[((g) + 3) % 4],	\
+						      m[(g) % 4]);	\
+	if ((g) >= 2 && (g) <= 17)					\
+		m[((g) + 2) % 4] = _mm_xor_si128(m[((g) + 2) % 4],	\
+						 m[(g) % 4]);		\
+} while (0)
+
+__attribute__((target("sha,sse4.1")))
+static void sha1_blocks_shani(uint32_t *state, const uint8_t *in,
+			      unsigned int nr)
+{
+	const __m128i bswap = _mm_set_epi64x(0x0001020304050607ULL,
+					     0x08090a0b0c0d0e0fULL);
+	__m128i abcd, abcd_save, e_save, e[2], m[4];
+	int i;
+
+	abcd = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)state),
+				 0x1b);
+	e[0] = _mm_set_epi32(state[4], 0, 0, 0);
+
+	for (; nr; nr--, in += 64) {
+		abcd_save = abcd;
+		e_save = e[0];
+		for (i = 0; i < 4; i++)
+			m[i] = _mm_shuffle_epi8(_mm_loadu_si128(
+					(const __m128i *)(in + i * 16)), bswap);
+
+		SHANI_ROUNDS4(0); SHANI_ROUNDS4(1); SHANI_ROUNDS4(2);
+		SHANI_ROUNDS4(3); SHANI_ROUNDS4(4); SHANI_ROUNDS4(5);
+		SHANI_ROUNDS4(6); SHANI_ROUNDS4(7); SHANI_ROUNDS4(8);
+		SHANI_ROUNDS4(9); SHANI_ROUNDS4(10); SHANI_ROUNDS4(11);
+		SHANI_ROUNDS4(12); SHANI_ROUNDS4(13); SHANI_ROUNDS4(14);
+		SHANI_ROUNDS4(15); SHANI_ROUNDS4(16); SHANI_ROUNDS4(17);
+		SHANI_ROUNDS4(18); SHANI_ROUNDS4(19);
+
+		e[0] = _mm_sha1nexte_epu32(e[0], e_save);
+		abcd = _mm_add_epi32(abcd, abcd_save);
+	}
+
+	_mm_storeu_si128((__m128i *)state, _mm_shuffle_epi32(abcd, 0x1b));
+	state[4] = _mm_extract_epi32(e[0], 3);
+}
+
+#define SHA1_LANES 8
+
+#define X8_ROL(x, n) \
+	_mm256_or_si256(_mm256_slli_epi32(x, n), _mm256_srli_epi32(x, 32 - (n)))
+
+/* Hash a block of each of the 8 buffers, lane i of state[] is buffer i */
+__attribute__((target("avx2")))
+static void sha1_transform_x8(__m256i *state, const uint8_t *const *in)
+{
+	static const uint32_t k[4] = {
+		0x5A827999, 0x6ED9EBA1, 0x8F1BBCDC, 0xCA62C1D6
+	};
+	const __m256i bswap = _mm256_set_epi8(
+		12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3,
+		12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3);
+	__m256i w[16], a, b, c, d, e, f, t;
+	int i;
+
+	for (i = 0; i < 16; i++) {
+		t = _mm256_set_epi32(
+			*(const int *)(in[7] + i * 4),
+			*(const int *)(in[6] + i * 4),
+			*(const int *)(in[5] + i * 4),
+			*(const int *)(in[4] + i * 4),
+			*(const int *)(in[3] + i * 4),
+			*(const int *)(in[2] + i * 4),
+			*(const int *)(in[1] + i * 4),
+			*(const int *)(in[0] + i * 4));
+		w[i] = _mm256_shuffle_epi8(t, bswap);
+	}
+
+	a = state[0];
+	b = state[1];
+	c = state[2];
+	d = state[3];
+	e = state[4];
+
+	for (i = 0; i < 80; i++) {
+		if (i >= 16) {
+			t = _mm256_xor_si256(
+				_mm256_xor_si256(w[(i - 3) & 15],
+						 w[(i - 8) & 15]),
+				_mm256_xor_si256(w[(i - 14) & 15],
+						 w[i & 15]));
+			w[i & 15] = X8_ROL(t, 1);
+		}
+
+		if (i < 20)
+			f = _mm256_xor_si256(d, _mm256_and_si256(
+					     b, _mm256_xor_si256(c, d)));
+		else if (i < 40 || i >= 60)
+			f = _mm256_xor_si256(_mm256_xor_si256(b, c), d);
+		else
+			f = _mm256_or_si256(_mm256_and_si256(b, c),
+					    _mm256_and_si256(d,
+						_mm256_or_si256(b, c)));
+
+		t = _mm256_add_epi32(_mm256_add_epi32(X8_ROL(a, 5), f),
+				     _mm256_add_epi32(e, w[i & 15]));
+		t = _mm256_add_epi32(t, _mm256_set1_epi32(k[i / 20]));
+		e = d;
+		d = c;
+		c = X8_ROL(b, 30);
+		b = a;
+		a = t;
+	}
+
+	state[0] = _mm256_add_epi32(state[0], a);
+	state[1] = _mm256_add_epi32(state[1], b);
+	state[2] = _mm256_add_epi32(state[2], c);
+	state[3] = _mm256_add_epi32(state[3], d);
+	state[4] = _mm256_add_epi32(state[4], e);
+}
+
+/* Hash 8 buffers of len bytes */
+__attribute__((target("avx2")))
+static void sha1_x8(const uint8_t *const *data, unsigned int len,
+		    uint8_t *const *out)
+{
+	uint8_t tail[SHA1_LANES][128] __attribute__((aligned(32)));
+	uint32_t digest[5][SHA1_LANES];
+	const uint8_t *in[SHA1_LANES];
+	unsigned int off, rem = len % 64, nr_tail = rem < 56 ? 1 : 2;
+	uint64_t bits = (uint64_t)len << 3;
+	__m256i state[5];
+	int i, j;
+
+	state[0] = _mm256_set1_epi32(0x67452301);
+	state[1] = _mm256_set1_epi32(0xEFCDAB89);
+	state[2] = _mm256_set1_epi32(0x98BADCFE);
+	state[3] = _mm256_set1_epi32(0x10325476);
+	state[4] = _mm256_set1_epi32(0xC3D2E1F0);
+
+	for (off = 0; off + 64 <= len; off += 64) {
+		for (i = 0; i < SHA1_LANES; i++)
+			in[i] = data[i] + off;
+		sha1_transform_x8(state, in);
+	}
+
+	/* the padding is the same in every lane */
+	for (i = 0; i < SHA1_LANES; i++) {
+		memset(tail[i], 0, sizeof(tail[i]));
+		memcpy(tail[i], data[i] + off, rem);
+		tail[i][rem] = 0x80;
+		for (j = 0; j < 8; j++)
+			tail[i][nr_tail * 64 - 1 - j] = bits >> (j * 8);
+	}
+	for (j = 0; j < (int)nr_tail; j++) {
+		for (i = 0; i < SHA1_LANES; i++)
+			in[i] = tail[i] + j * 64;
+		sha1_transform_x8(state, in);
+	}
+
+	for (j = 0; j < 5; j++)
+		_mm256_storeu_si256((__m256i *)digest[j], state[j]);
+	for (i = 0; i < SHA1_LANES; i++)
+		for (j = 0; j < 5; j++) {
+			out[i][j * 4] = digest[j][i] >> 24;
+			out[i][j * 4 + 1] = digest[j][i] >> 16;
+			out[i][j * 4 + 2] = digest[j][i] >> 8;
+			out[i][j * 4 + 3] = digest[j][i];
+		}
+}
+#endif
+
+#if defined(__aarch64__) && defined(HWCAP_SHA1)
+/*
+ * 4 rounds of the crypto extensions, g is the index of the group.  m[g % 4]
+ * holds the words of the group, and the schedule of the next ones is advanced
+ * in the others.
+ */
+#define ARM_ROUNDS4(g, op)						\
+do {									\
+	wk = vaddq_u32(m[(g) % 4], vdupq_n_u32(k[(g) / 5]));		\
+	e1 = vsha1h_u32(vgetq_lane_u32(abcd, 0));			\
+	abcd = op(abcd, e0, wk);					\
+	e0 = e1;							\
+	if ((g) >= 3 && (g) <= 18)					\
+		m[((g) + 1) % 4] = vsha1su1q_u32(m[((g) + 1) % 4],	\
+						 m[(g) % 4]);		\
+	if ((g) >= 2 && (g) <= 17)					\
+		m[((g) + 2) % 4] = vsha1su0q_u32(m[((g) + 2) % 4],	\
+						 m[((g) + 3) % 4],	\
+						 m[(g) % 4]);		\
+} while (0)
+
+__attribute__((target("+crypto")))
+static void sha1_blocks_arm(uint32_t *state, const uint8_t *in,
+			    unsigned int nr)
+{
+	static const uint32_t k[4] = {
+		0x5A827999, 0x6ED9EBA1, 0x8F1BBCDC, 0xCA62C1D6
+	};
+	uint32x4_t abcd, abcd_save, wk, m[4];
+	uint32_t e0, e1, e_save;
+	int i;
+
+	abcd = vld1q_u32(state);
+	e0 = state[4];
+
+	for (; nr; nr--, in += 64) {
+		abcd_save = abcd;
+		e_save = e0;
+		for (i = 0; i < 4; i++)
+			m[i] = vreinterpretq_u32_u8(vrev32q_u8(
+					vld1q_u8(in + i * 16)));
+
+		ARM_ROUNDS4(0, vsha1cq_u32); ARM_ROUNDS4(1, vsha1cq_u32);
+		ARM_ROUNDS4(2, vsha1cq_u32); ARM_ROUNDS4(3, vsha1cq_u32);
+		ARM_ROUNDS4(4, vsha1cq_u32); ARM_ROUNDS4(5, vsha1pq_u32);
+		ARM_ROUNDS4(6, vsha1pq_u32); ARM_ROUNDS4(7, vsha1pq_u32);
+		ARM_ROUNDS4(8, vsha1pq_u32); ARM_ROUNDS4(9, vsha1pq_u32);
+		ARM_ROUNDS4(10, vsha1mq_u32); ARM_ROUNDS4(11, vsha1mq_u32);
+		ARM_ROUNDS4(12, vsha1mq_u32); ARM_ROUNDS4(13, vsha1mq_u32);
+		ARM_ROUNDS4(14, vsha1mq_u32); ARM_ROUNDS4(15, vsha1pq_u32);
+		ARM_ROUNDS4(16, vsha1pq_u32); ARM_ROUNDS4(17, vsha1pq_u32);
+		ARM_ROUNDS4(18, vsha1pq_u32); ARM_ROUNDS4(19, vsha1pq_u32);
+
+		abcd = vaddq_u32(abcd, abcd_save);
+		e0 += e_save;
+	}
+
+	vst1q_u32(state, abcd);
+	state[4] = e0;
+}
+#endif
+
+static void (*sha1_blocks)(uint32_t *state, const uint8_t *in,
+			   unsigned int nr) = sha1_blocks_generic;
+static bool use_x8;
+static const char *kernel_name = "generic";
+
+static void __attribute__((constructor)) sha1_select(void)
+{
+#ifdef __x86_64__
+	if (__builtin_cpu_supports("avx2"))
+		use_x8 = true;
+	if (__builtin_cpu_supports("sse4.1")) {
+		unsigned int eax, ebx, ecx, edx;
+
+		/* CPUID.(EAX=7, ECX=0):EBX.SHA[bit 29] */
+		__asm__("cpuid"
+			: "=a" (eax), "=b" (ebx), "=c" (ecx), "=d" (edx)
+			: "a" (7), "c" (0));
+		if (ebx & (1U << 29))
+			sha1_blocks = sha1_blocks_shani;
+	}
+	if (sha1_blocks == sha1_blocks_shani)
+		kernel_name = use_x8 ? "sha-ni, avx2 x8" : "sha-ni";
+	else if (use_x8)
+		kernel_name = "generic, avx2 x8";
+#endif
+#if defined(__aarch64__) && defined(HWCAP_SHA1)
+	if (getauxval(AT_HWCAP) & HWCAP_SHA1) {
+		sha1_blocks = sha1_blocks_arm;
+		kernel_name = "armv8 crypto";
+	}
+#endif
+}
+
+const char *sha1_kernel_name(void)
+{
+	return kernel_name;
+}
+
 void sha1_init(void *ctx)
 {
 	struct sha1_ctx *sctx = ctx;
@@ -148,9 +459,9 @@ void sha1_update(void *ctx, const uint8_t *data, unsigned int len)
 
 	if ((j + len) > 63) {
 		memcpy(&sctx->buffer[j], data, (i = 64-j));
-		sha1_transform(sctx->state, sctx->buffer);
-		for ( ; i + 63 < len; i += 64)
-			sha1_transform(sctx->state, &data[i]);
+		sha1_blocks(sctx->state, sctx->buffer, 1);
+		sha1_blocks(sctx->state, &data[i], (len - i) / 64);
+		i += (len - i) / 64 * 64;
 		j = 0;
 	} else
 		i = 0;
@@ -197,3 +508,57 @@ void sha1_final(void *ctx, uint8_t *out)
 	/* Wipe context */
 	memset(sctx, 0, sizeof *sctx);
 }
+
+static void sha1_one(const uint8_t *data, unsigned int len, uint8_t *out)
+{
+	struct sha1_ctx ctx;
+
+	sha1_init(&ctx);
+	sha1_update(&ctx, data, len);
+	sha1_final(&ctx, out);
+}
+
+/* Compute the digests of nr buffers of len bytes into out[] */
+void sha1_multi(const uint8_t *const *data, unsigned int len,
+		uint8_t *const *out, int nr)
+{
+	int i = 0;
+
+#ifdef __x86_64__
+	if (use_x8)
+		for (; i + SHA1_LANES <= nr; i += SHA1_LANES)
+			sha1_x8(data + i, len, out + i);
+#endif
+	for (; i < nr; i++)
+		sha1_one(data[i], len, out[i]);
+}
+
+#define SHA1_RANGES_BATCH 16
+
+/*
+ * Compute the digest of every 'range' bytes of buf into digests[], the last
+ * range being shorter if len isn't a multiple of it
+ */
+void sha1_ranges(const void *buf, uint32_t len, uint32_t range,
+		 uint8_t *digests)
+{
+	const uint8_t *data[SHA1_RANGES_BATCH];
+	uint8_t *out[SHA1_RANGES_BATCH];
+	uint32_t off = 0;
+	int nr;
+
+	/* the full ranges are hashed a batch at a time */
+	while (off + range <= len) {
+		for (nr = 0; nr < SHA1_RANGES_BATCH && off + range <= len;
+		     nr++) {
+			data[nr] = (const uint8_t *)buf + off;
+			out[nr] = digests;
+			off += range;
+			digests += SHA1_DIGEST_SIZE;
+		}
+		sha1_multi(data, range, out, nr);
+	}
+
+	if (off < len)
+		sha1_one((const uint8_t *)buf + off, len - off, digests);
+}
@@ -228,6 +228,47 @@ ssize_t xpwrite(int fd, const void *buf, size_t count, off_t offset)
 	return total;
 }
 
+static ssize_t _pwritev(int fd, const struct iovec *iov, int iovcnt,
+			off_t offset)
+{
+	ssize_t nr;
+	while (true) {
+		nr = pwritev(fd, iov, iovcnt, offset);
+		if ((nr < 0) && (errno == EAGAIN || errno == EINTR))
+			continue;
+		return nr;
+	}
+}
+
+/* Note: iov is modified on a short write */
+ssize_t xpwritev(int fd, struct iovec *iov, int iovcnt, off_t offset)
+{
+	ssize_t total = 0;
+
+	while (iovcnt > 0) {
+		ssize_t written = _pwritev(fd, iov, iovcnt, offset);
+		if (written < 0)
+			return -1;
+		if (!written) {
+			errno = ENOSPC;
+			return -1;
+		}
+		total += written;
+		offset += written;
+		while (iovcnt > 0 && written >= iov->iov_len) {
+			written -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (written) {
+			iov->iov_base = (char *)iov->iov_base + written;
+			iov->iov_len -= written;
+		}
+	}
+
+	return total;
+}
+
 int xmkdir(const char *pathname, mode_t mode)
 {
 	if (mkdir(pathname, mode) < 0 && errno != EEXIST)
@@ -359,6 +400,21 @@ void untrim_zero_sectors(void *buf, uint64_t offset, uint32_t len,
 		memset(p + offset + len, 0, requested_len - offset - len);
 }
 
+/* Return true if all the bytes of the buffer are zero */
+bool is_zero_buf(const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+	size_t n = min(len, (size_t)16);
+
+	while (n--)
+		if (*p++)
+			return false;
+
+	/* the first bytes are zero, so compare the buffer with itself */
+	return len <= 16 || memcmp(buf, (const uint8_t *)buf + 16,
+				   len - 16) == 0;
+}
+
 bool is_numeric(const char *s)
 {
 	const char *p = s;
@@ -0,0 +1,251 @@
+/*
+ * Copyright (C) 2013 Taobao Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * CPU affinity of the threads of sheep
+ *
+ * The threads are grouped by name, the name of their work queue or "net" for
+ * the network event loops, and each group can be bound to a set of CPUs.  It
+ * is given either by '-A name=cpus', where cpus is a list like "0-3,8" or
+ * "nodeN" for the CPUs of NUMA node N, or found out from sysfs: the I/O
+ * threads of an md disk are bound to the node of its controller and the
+ * network loops to the node of the NIC of the address they listen on.
+ *
+ * Memory is allocated on the node of the thread that first touches it, so
+ * the request pools and the buffers of the bound threads are node-local.
+ */
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <ifaddrs.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+
+#include "sheep_priv.h"
+
+struct affinity {
+	char name[SD_WQUEUE_NAME_LEN];
+	cpu_set_t cpus;
+	struct list_head list;
+};
+
+static LIST_HEAD(affinity_list);
+
+/* Parse a list of CPUs like "0-3,8,10-11" into 'set' */
+static int parse_cpu_list(const char *s, cpu_set_t *set)
+{
+	unsigned long first, last;
+	char *p;
+
+	CPU_ZERO(set);
+	do {
+		first = strtoul(s, &p, 10);
+		if (p == s)
+			return -1;
+		last = first;
+		if (*p == '-') {
+			s = p + 1;
+			last = strtoul(s, &p, 10);
+			if (p == s || last < first)
+				return -1;
+		}
+		if (last >= CPU_SETSIZE)
+			return -1;
+		for (; first <= last; first++)
+			CPU_SET(first, set);
+		s = p + 1;
+	} while (*p == ',');
+
+	if (*p && *p != '\n')
+		return -1;
+
+	return CPU_COUNT(set) ? 0 : -1;
+}
+
+static int numa_node_cpus(int node, cpu_set_t *set)
+{
+	char path[PATH_MAX], buf[4096];
+	FILE *fp;
+	int ret = -1;
+
+	snprintf(path, sizeof(path),
+		 "/sys/devices/system/node/node%d/cpulist", node);
+	fp = fopen(path, "r");
+	if (!fp)
+		return -1;
+	if (fgets(buf, sizeof(buf), fp))
+		ret = parse_cpu_list(buf, set);
+	fclose(fp);
+
+	return ret;
+}
+
+/* Return the NUMA node of the device at the sysfs path, or -1 if unknown */
+static int read_numa_node(const char *dev_path)
+{
+	char path[PATH_MAX];
+	FILE *fp;
+	int node = -1;
+
+	snprintf(path, sizeof(path), "%s/device/numa_node", dev_path);
+	fp = fopen(path, "r");
+	if (!fp)
+		return -1;
+	if (fscanf(fp, "%d", &node) != 1)
+		node = -1;
+	fclose(fp);
+
+	return node;
+}
+
+/*
+ * Bind the threads of 'name' to the CPUs of the NUMA node, unless they are
+ * already bound or the machine has only one node.
+ */
+static void set_node_affinity(const char *name, int node, const char *what)
+{
+	struct affinity *af;
+	cpu_set_t set;
+
+	if (node < 0 || get_affinity(name) ||
+	    access("/sys/devices/system/node/node1", F_OK) < 0)
+		return;
+
+	if (numa_node_cpus(node, &set) < 0)
+		return;
+
+	af = xzalloc(sizeof(*af));
+	pstrcpy(af->name, sizeof(af->name), name);
+	af->cpus = set;
+	list_add_tail(&af->list, &affinity_list);
+	sd_iprintf("%s bound to NUMA node %d of %s", name, node, what);
+}
+
+/* Set the affinity given as 'name=cpus' on the command line */
+int add_affinity(const char *arg)
+{
+	const char *cpus = strchr(arg, '=');
+	struct affinity *af;
+	cpu_set_t set;
+	int ret;
+
+	if (!cpus || cpus == arg || cpus - arg >= SD_WQUEUE_NAME_LEN)
+		return -1;
+	cpus++;
+
+	if (!strncmp(cpus, "node", 4))
+		ret = numa_node_cpus(atoi(cpus + 4), &set);
+	else
+		ret = parse_cpu_list(cpus, &set);
+	if (ret < 0)
+		return -1;
+
+	af = xzalloc(sizeof(*af));
+	memcpy(af->name, arg, cpus - 1 - arg);
+	af->cpus = set;
+	list_add_tail(&af->list, &affinity_list);
+
+	return 0;
+}
+
+const cpu_set_t *get_affinity(const char *name)
+{
+	struct affinity *af;
+
+	list_for_each_entry(af, &affinity_list, list)
+		if (!strcmp(af->name, name))
+			return &af->cpus;
+
+	return NULL;
+}
+
+void bind_thread(const char *name)
+{
+	const cpu_set_t *set = get_affinity(name);
+	int ret;
+
+	if (!set)
+		return;
+
+	ret = pthread_setaffinity_np(pthread_self(), sizeof(*set), set);
+	if (ret)
+		sd_eprintf("failed to bind %s, %s", name, strerror(ret));
+	else
+		sd_dprintf("%s bound to %d CPUs", name, CPU_COUNT(set));
+}
+
+/* Bind the threads to the node of the controller of the disk of 'path' */
+void set_disk_affinity(const char *name, const char *path)
+{
+	char dev_path[PATH_MAX], real[PATH_MAX], *p;
+	struct stat st;
+	int node;
+
+	if (stat(path, &st) < 0)
+		return;
+
+	snprintf(dev_path, sizeof(dev_path), "/sys/dev/block/%u:%u",
+		 major(st.st_dev), minor(st.st_dev));
+	if (!realpath(dev_path, real))
+		return;
+
+	/* a partition has its device in the parent directory */
+	node = read_numa_node(real);
+	p = strrchr(real, '/');
+	if (node < 0 && p) {
+		*p = '\0';
+		node = read_numa_node(real);
+	}
+
+	set_node_affinity(name, node, path);
+}
+
+/* Bind the threads to the node of the NIC that has the address 'addr' */
+void set_nic_affinity(const char *name, const char *addr)
+{
+	struct ifaddrs *ifa, *ifas;
+	char host[INET6_ADDRSTRLEN], dev_path[PATH_MAX];
+	const struct sockaddr *sa;
+	const void *a;
+
+	if (!addr || getifaddrs(&ifas) < 0)
+		return;
+
+	for (ifa = ifas; ifa; ifa = ifa->ifa_next) {
+		sa = ifa->ifa_addr;
+		if (!sa)
+			continue;
+		if (sa->sa_family == AF_INET)
+			a = &((const struct sockaddr_in *)sa)->sin_addr;
+		else if (sa->sa_family == AF_INET6)
+			a = &((const struct sockaddr_in6 *)sa)->sin6_addr;
+		else
+			continue;
+
+		if (!inet_ntop(sa->sa_family, a, host, sizeof(host)) ||
+		    strcmp(host, addr))
+			continue;
+
+		snprintf(dev_path, sizeof(dev_path), "/sys/class/net/%s",
+			 ifa->ifa_name);
+		set_node_affinity(name, read_numa_node(dev_path),
+				  ifa->ifa_name);
+		break;
+	}
+
+	freeifaddrs(ifas);
+}
@@ -117,6 +117,19 @@ struct cluster_driver {
 	 */
 	void (*unblock)(void *msg, size_t msg_len);
 
+	/*
+	 * Update the information of this node, e.g. its capacity
+	 *
+	 * The new node information is notified to all the nodes, which
+	 * replace the entry of this node in their membership and call
+	 * sd_update_node_handler() in the total order with the other events.
+	 * This is optional, drivers without it keep the node information as
+	 * of the join.
+	 *
+	 * Returns zero on success, -1 on error
+	 */
+	int (*update_node)(const struct sd_node *node);
+
 	struct list_head list;
 };
 
@@ -204,6 +217,8 @@ void sd_join_handler(const struct sd_node *joined,
 		     const void *opaque);
 void sd_leave_handler(const struct sd_node *left, const struct sd_node *members,
 		      size_t nr_members);
+void sd_update_node_handler(const struct sd_node *updated,
+			    const struct sd_node *members, size_t nr_members);
 void sd_notify_handler(const struct sd_node *sender, void *msg, size_t msg_len);
 bool sd_block_handler(const struct sd_node *sender);
 enum cluster_join_result sd_check_join_cb(const struct sd_node *joining,
@@ -12,6 +12,7 @@
 #include <unistd.h>
 #include <poll.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <corosync/cpg.h>
 #include <corosync/cfg.h>
 
@@ -20,6 +21,8 @@
 #include "work.h"
 
 #define CPG_INIT_RETRY_CNT 10
+/* the CPG messages are kept well below the limit of corosync */
+#define CPG_MAX_BATCH_SIZE (1024 * 1024)
 
 struct cpg_node {
 	uint32_t nodeid;
@@ -51,6 +54,7 @@ enum corosync_event_type {
 	COROSYNC_EVENT_TYPE_LEAVE,
 	COROSYNC_EVENT_TYPE_BLOCK,
 	COROSYNC_EVENT_TYPE_NOTIFY,
+	COROSYNC_EVENT_TYPE_UPDATE_NODE,
 };
 
 /* multicast message type */
@@ -61,6 +65,7 @@ enum corosync_message_type {
 	COROSYNC_MSG_TYPE_NOTIFY,
 	COROSYNC_MSG_TYPE_BLOCK,
 	COROSYNC_MSG_TYPE_UNBLOCK,
+	COROSYNC_MSG_TYPE_UPDATE_NODE,
 };
 
 struct corosync_event {
@@ -79,16 +84,43 @@ struct corosync_event {
 	struct list_head list;
 };
 
+/*
+ * The messages sent from the main thread are queued and go out together in
+ * one CPG message when the event loop gets to the send queue, so that a burst
+ * of cluster operations costs a CPG round instead of one per message.  A CPG
+ * message is a sequence of corosync_message, each of them followed by its
+ * nodes and its payload and padded to 8 bytes, which are delivered in order.
+ */
 struct corosync_message {
 	struct cpg_node sender;
 	enum corosync_message_type type:4;
 	enum cluster_join_result result:4;
 	uint32_t msg_len;
 	uint32_t nr_nodes;
-	struct cpg_node nodes[SD_MAX_NODES];
-	uint8_t msg[0];
+	/* nodes[nr_nodes] followed by msg[msg_len] */
+	uint8_t data[0];
 };
 
+static char *send_buf;
+static size_t send_len, send_buf_size;
+static int send_efd;
+
+static inline struct cpg_node *cmsg_nodes(struct corosync_message *cmsg)
+{
+	return (struct cpg_node *)cmsg->data;
+}
+
+static inline void *cmsg_msg(struct corosync_message *cmsg)
+{
+	return cmsg->data + sizeof(struct cpg_node) * cmsg->nr_nodes;
+}
+
+static inline size_t cmsg_size(size_t nr_nodes, size_t msg_len)
+{
+	return roundup(sizeof(struct corosync_message) +
+		       sizeof(struct cpg_node) * nr_nodes + msg_len, 8);
+}
+
 static bool cpg_node_equal(struct cpg_node *a, struct cpg_node *b)
 {
 	return (a->nodeid == b->nodeid && a->pid == b->pid);
@@ -163,33 +195,19 @@ static int corosync_get_local_addr(uint8_t *addr)
 	return 0;
 }
 
-static int send_message(enum corosync_message_type type,
-			enum cluster_join_result result,
-			struct cpg_node *sender, struct cpg_node *nodes,
-			size_t nr_nodes, void *msg, size_t msg_len)
+/*
+ * Send the queued messages in one CPG message.  They are kept queued if that
+ * fails, and the event loop is kicked to try them again.
+ */
+static int flush_messages(void)
 {
-	struct iovec iov[2];
-	int ret, iov_cnt = 1;
-	struct corosync_message cmsg = {
-		.type = type,
-		.msg_len = msg_len,
-		.result = result,
-		.sender = *sender,
-		.nr_nodes = nr_nodes,
-	};
+	struct iovec iov = { .iov_base = send_buf, .iov_len = send_len };
+	int ret;
 
-	if (nodes)
-		memcpy(cmsg.nodes, nodes, sizeof(*nodes) * nr_nodes);
-
-	iov[0].iov_base = &cmsg;
-	iov[0].iov_len = sizeof(cmsg);
-	if (msg) {
-		iov[1].iov_base = msg;
-		iov[1].iov_len = msg_len;
-		iov_cnt++;
-	}
+	if (!send_len)
+		return 0;
 retry:
-	ret = cpg_mcast_joined(cpg_handle, CPG_TYPE_AGREED, iov, iov_cnt);
+	ret = cpg_mcast_joined(cpg_handle, CPG_TYPE_AGREED, &iov, 1);
 	switch (ret) {
 	case CS_OK:
 		break;
@@ -198,12 +216,69 @@ retry:
 		sleep(1);
 		goto retry;
 	default:
-		sd_eprintf("failed to send message (%d)", ret);
+		sd_eprintf("failed to send %zd bytes of messages (%d)",
+			   send_len, ret);
+		eventfd_write(send_efd, 1);
 		return -1;
 	}
+
+	sd_dprintf("%zd bytes", send_len);
+	send_len = 0;
 	return 0;
 }
 
+static void send_handler(int fd, int events, void *data)
+{
+	eventfd_t value;
+
+	if (eventfd_read(fd, &value) < 0)
+		return;
+
+	/*
+	 * The senders of the queued messages have been told they were sent,
+	 * and the other nodes would wait for them forever
+	 */
+	if (flush_messages() < 0)
+		panic("failed to send the queued messages");
+}
+
+/*
+ * Queue the message, which is then as good as sent: if the queue can't be
+ * flushed to make room for it, the queue is kept and retried by send_handler.
+ */
+static void send_message(enum corosync_message_type type,
+			 enum cluster_join_result result,
+			 struct cpg_node *sender, struct cpg_node *nodes,
+			 size_t nr_nodes, void *msg, size_t msg_len)
+{
+	struct corosync_message *cmsg;
+	size_t size = cmsg_size(nr_nodes, msg_len);
+
+	if (send_len && send_len + size > CPG_MAX_BATCH_SIZE)
+		flush_messages();
+
+	if (send_len + size > send_buf_size) {
+		send_buf_size = max(send_len + size,
+				    (size_t)CPG_MAX_BATCH_SIZE);
+		send_buf = xrealloc(send_buf, send_buf_size);
+	}
+	if (!send_len)
+		eventfd_write(send_efd, 1);
+
+	cmsg = (struct corosync_message *)(send_buf + send_len);
+	memset(cmsg, 0, size);
+	cmsg->type = type;
+	cmsg->msg_len = msg_len;
+	cmsg->result = result;
+	cmsg->sender = *sender;
+	cmsg->nr_nodes = nr_nodes;
+	if (nodes)
+		memcpy(cmsg_nodes(cmsg), nodes, sizeof(*nodes) * nr_nodes);
+	if (msg)
+		memcpy(cmsg_msg(cmsg), msg, msg_len);
+	send_len += size;
+}
+
 static inline struct corosync_event *
 find_block_event(enum corosync_event_type type, struct cpg_node *sender)
 {
@@ -308,6 +383,7 @@ static bool __corosync_dispatch_one(struct corosync_event *cevent)
 		if (res == CJ_RES_MASTER_TRANSFER) {
 			sd_eprintf("failed to join sheepdog cluster:"
 				   " please retry when master is up");
+			flush_messages();
 			exit(1);
 		}
 
@@ -353,6 +429,16 @@ static bool __corosync_dispatch_one(struct corosync_event *cevent)
 		sd_notify_handler(&cevent->sender.ent, cevent->msg,
 						 cevent->msg_len);
 		break;
+	case COROSYNC_EVENT_TYPE_UPDATE_NODE:
+		idx = find_cpg_node(cpg_nodes, nr_cpg_nodes, &cevent->sender);
+		if (idx < 0)
+			break;
+		cpg_nodes[idx].ent = cevent->sender.ent;
+
+		build_node_list(cpg_nodes, nr_cpg_nodes, entries);
+		sd_update_node_handler(&cevent->sender.ent, entries,
+				       nr_cpg_nodes);
+		break;
 	}
 
 	return true;
@@ -464,13 +550,9 @@ static void queue_event(struct corosync_event *cevent)
 		list_add_tail(&cevent->list, &corosync_nonblock_event_list);
 }
 
-static void cdrv_cpg_deliver(cpg_handle_t handle,
-			     const struct cpg_name *group_name,
-			     uint32_t nodeid, uint32_t pid,
-			     void *msg, size_t msg_len)
+static void deliver_message(struct corosync_message *cmsg)
 {
 	struct corosync_event *cevent;
-	struct corosync_message *cmsg = msg;
 	int master;
 
 	sd_dprintf("%d", cmsg->type);
@@ -478,7 +560,8 @@ static void cdrv_cpg_deliver(cpg_handle_t handle,
 	switch (cmsg->type) {
 	case COROSYNC_MSG_TYPE_JOIN_REQUEST:
 		cevent = update_event(COROSYNC_EVENT_TYPE_JOIN_REQUEST,
-				      &cmsg->sender, cmsg->msg, cmsg->msg_len);
+				      &cmsg->sender, cmsg_msg(cmsg),
+				      cmsg->msg_len);
 		if (!cevent)
 			break;
 
@@ -487,7 +570,7 @@ static void cdrv_cpg_deliver(cpg_handle_t handle,
 		break;
 	case COROSYNC_MSG_TYPE_UNBLOCK:
 		cevent = update_event(COROSYNC_EVENT_TYPE_BLOCK, &cmsg->sender,
-				      cmsg->msg, cmsg->msg_len);
+				      cmsg_msg(cmsg), cmsg->msg_len);
 		if (cevent) {
 			list_del(&cevent->list);
 			free(cevent->msg);
@@ -506,10 +589,18 @@ static void cdrv_cpg_deliver(cpg_handle_t handle,
 		cevent->msg_len = cmsg->msg_len;
 		if (cmsg->msg_len) {
 			cevent->msg = xzalloc(cmsg->msg_len);
-			memcpy(cevent->msg, cmsg->msg, cmsg->msg_len);
+			memcpy(cevent->msg, cmsg_msg(cmsg), cmsg->msg_len);
 		} else
 			cevent->msg = NULL;
 
+		queue_event(cevent);
+		break;
+	case COROSYNC_MSG_TYPE_UPDATE_NODE:
+		cevent = xzalloc(sizeof(*cevent));
+		cevent->type = COROSYNC_EVENT_TYPE_UPDATE_NODE;
+		cevent->sender = cmsg->sender;
+		cevent->msg = NULL;
+
 		queue_event(cevent);
 		break;
 	case COROSYNC_MSG_TYPE_LEAVE:
@@ -529,7 +620,7 @@ static void cdrv_cpg_deliver(cpg_handle_t handle,
 		cevent->msg_len = cmsg->msg_len;
 		if (cmsg->msg_len) {
 			cevent->msg = xzalloc(cmsg->msg_len);
-			memcpy(cevent->msg, cmsg->msg, cmsg->msg_len);
+			memcpy(cevent->msg, cmsg_msg(cmsg), cmsg->msg_len);
 		} else
 			cevent->msg = NULL;
 
@@ -537,20 +628,36 @@ static void cdrv_cpg_deliver(cpg_handle_t handle,
 		break;
 	case COROSYNC_MSG_TYPE_JOIN_RESPONSE:
 		cevent = update_event(COROSYNC_EVENT_TYPE_JOIN_REQUEST,
-				      &cmsg->sender, cmsg->msg, cmsg->msg_len);
+				      &cmsg->sender, cmsg_msg(cmsg),
+				      cmsg->msg_len);
 		if (!cevent)
 			break;
 
 		cevent->type = COROSYNC_EVENT_TYPE_JOIN_RESPONSE;
 		cevent->result = cmsg->result;
 		cevent->nr_nodes = cmsg->nr_nodes;
-		memcpy(cevent->nodes, cmsg->nodes,
-		       sizeof(*cmsg->nodes) * cmsg->nr_nodes);
+		memcpy(cevent->nodes, cmsg_nodes(cmsg),
+		       sizeof(*cevent->nodes) * cmsg->nr_nodes);
 
 		break;
 	}
+}
 
-	__corosync_dispatch();
+static void cdrv_cpg_deliver(cpg_handle_t handle,
+			     const struct cpg_name *group_name,
+			     uint32_t nodeid, uint32_t pid,
+			     void *msg, size_t msg_len)
+{
+	struct corosync_message *cmsg;
+	size_t done = 0;
+
+	while (done < msg_len) {
+		cmsg = (struct corosync_message *)((char *)msg + done);
+		deliver_message(cmsg);
+		__corosync_dispatch();
+
+		done += cmsg_size(cmsg->nr_nodes, cmsg->msg_len);
+	}
 }
 
 static void build_cpg_node_list(struct cpg_node *nodes,
@@ -702,16 +809,17 @@ retry:
 
 	this_node.ent = *myself;
 
-	ret = send_message(COROSYNC_MSG_TYPE_JOIN_REQUEST, 0, &this_node,
-			   NULL, 0, opaque, opaque_len);
+	send_message(COROSYNC_MSG_TYPE_JOIN_REQUEST, 0, &this_node, NULL, 0,
+		     opaque, opaque_len);
 
-	return ret;
+	return flush_messages();
 }
 
 static int corosync_leave(void)
 {
-	return send_message(COROSYNC_MSG_TYPE_LEAVE, 0, &this_node, NULL, 0,
-			    NULL, 0);
+	send_message(COROSYNC_MSG_TYPE_LEAVE, 0, &this_node, NULL, 0, NULL, 0);
+
+	return flush_messages();
 }
 
 static void corosync_block(void)
@@ -728,8 +836,20 @@ static void corosync_unblock(void *msg, size_t msg_len)
 
 static int corosync_notify(void *msg, size_t msg_len)
 {
-	return send_message(COROSYNC_MSG_TYPE_NOTIFY, 0, &this_node,
-			   NULL, 0, msg, msg_len);
+	send_message(COROSYNC_MSG_TYPE_NOTIFY, 0, &this_node, NULL, 0, msg,
+		     msg_len);
+
+	return 0;
+}
+
+static int corosync_update_node(const struct sd_node *node)
+{
+	this_node.ent = *node;
+
+	send_message(COROSYNC_MSG_TYPE_UPDATE_NODE, 0, &this_node, NULL, 0,
+		     NULL, 0);
+
+	return 0;
 }
 
 static void corosync_handler(int listen_fd, int events, void *data)
@@ -811,6 +931,18 @@ again:
 		return -1;
 	}
 
+	send_efd = eventfd(0, EFD_NONBLOCK);
+	if (send_efd < 0) {
+		sd_eprintf("failed to create an eventfd, %m");
+		return -1;
+	}
+
+	ret = register_event(send_efd, send_handler, NULL);
+	if (ret) {
+		sd_eprintf("failed to register the send handler (%d)", ret);
+		return -1;
+	}
+
 	return 0;
 }
 
@@ -824,6 +956,7 @@ static struct cluster_driver cdrv_corosync = {
 	.notify		= corosync_notify,
 	.block		= corosync_block,
 	.unblock	= corosync_unblock,
+	.update_node	= corosync_update_node,
 };
 
 cdrv_register(cdrv_corosync);
@@ -62,6 +62,7 @@ enum local_event_type {
 	EVENT_GATEWAY,
 	EVENT_BLOCK,
 	EVENT_NOTIFY,
+	EVENT_UPDATE_NODE,
 };
 
 struct local_event {
@@ -279,6 +280,10 @@ static void add_event(enum local_event_type type, struct local_node *lnode,
 		n = find_lnode(lnode, ev.nr_lnodes, ev.lnodes);
 		n->gateway = true;
 		break;
+	case EVENT_UPDATE_NODE:
+		n = find_lnode(lnode, ev.nr_lnodes, ev.lnodes);
+		n->node = lnode->node;
+		break;
 	case EVENT_NOTIFY:
 	case EVENT_BLOCK:
 		break;
@@ -389,6 +394,19 @@ static void local_unblock(void *msg, size_t msg_len)
 	shm_queue_unlock();
 }
 
+static int local_update_node(const struct sd_node *node)
+{
+	this_node.node = *node;
+
+	shm_queue_lock();
+
+	add_event(EVENT_UPDATE_NODE, &this_node, NULL, 0);
+
+	shm_queue_unlock();
+
+	return 0;
+}
+
 /* Returns true if an event is processed */
 static bool local_process_event(void)
 {
@@ -483,6 +501,9 @@ static bool local_process_event(void)
 	case EVENT_NOTIFY:
 		sd_notify_handler(&ev->sender.node, ev->buf, ev->buf_len);
 		break;
+	case EVENT_UPDATE_NODE:
+		sd_update_node_handler(&ev->sender.node, nodes, nr_nodes);
+		break;
 	}
 out:
 	shm_queue_remove(ev);
@@ -568,6 +589,7 @@ static struct cluster_driver cdrv_local = {
 	.notify		= local_notify,
 	.block		= local_block,
 	.unblock	= local_unblock,
+	.update_node	= local_update_node,
 };
 
 cdrv_register(cdrv_local);
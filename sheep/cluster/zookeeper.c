@@ -47,6 +47,7 @@ enum zk_event_type {
 	EVENT_BLOCK,
 	EVENT_UNBLOCK,
 	EVENT_NOTIFY,
+	EVENT_UPDATE_NODE,
 };
 
 struct zk_node {
@@ -301,15 +302,88 @@ static void push_join_response(struct zk_event *ev)
 		   path, queue_pos, len);
 }
 
-static void zk_queue_pop_advance(struct zk_event *ev)
-{
+/*
+ * Queue events are fetched in pipelined batches: up to zk_batch_size
+ * zoo_aget() requests are in flight at once and the event handler only waits
+ * for the whole batch, instead of paying one server round trip per event.
+ * The batch grows while it comes back full and shrinks when the queue runs
+ * dry, so an idle cluster still issues a single request per kick.
+ */
+#define ZK_EVENT_BATCH_MAX 16
+
+struct zk_fetch {
+	int rc;
 	int len;
+	struct zk_event ev;
+};
+
+static struct zk_fetch zk_batch[ZK_EVENT_BATCH_MAX];
+static int zk_batch_size = 1;
+
+/* completions of the asynchronous calls run in the zookeeper thread */
+static int zk_async_pending;
+static pthread_mutex_t zk_async_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t zk_async_cond = PTHREAD_COND_INITIALIZER;
+
+static void zk_async_begin(int nr)
+{
+	pthread_mutex_lock(&zk_async_lock);
+	zk_async_pending = nr;
+	pthread_mutex_unlock(&zk_async_lock);
+}
+
+static void zk_async_done(void)
+{
+	pthread_mutex_lock(&zk_async_lock);
+	if (--zk_async_pending == 0)
+		pthread_cond_signal(&zk_async_cond);
+	pthread_mutex_unlock(&zk_async_lock);
+}
+
+static void zk_async_wait(void)
+{
+	pthread_mutex_lock(&zk_async_lock);
+	while (zk_async_pending)
+		pthread_cond_wait(&zk_async_cond, &zk_async_lock);
+	pthread_mutex_unlock(&zk_async_lock);
+}
+
+static void zk_fetch_completion(int rc, const char *value, int value_len,
+				const struct Stat *stat, const void *data)
+{
+	struct zk_fetch *f = (struct zk_fetch *)data;
+
+	f->rc = rc;
+	if (rc == ZOK) {
+		f->len = min(value_len, (int)sizeof(f->ev));
+		memcpy(&f->ev, value, f->len);
+	}
+	zk_async_done();
+}
+
+/* Fetch the nr queue nodes from pos on, leaving a data watch on each one */
+static void zk_queue_fetch(struct zk_fetch *f, int nr, int32_t pos)
+{
 	char path[MAX_NODE_STR_LEN];
+	int i, rc;
+
+	zk_async_begin(nr);
+	for (i = 0; i < nr; i++) {
+		snprintf(path, sizeof(path), QUEUE_ZNODE "/%010"PRId32,
+			 pos + i);
+		rc = zoo_aget(zhandle, path, 1, zk_fetch_completion, &f[i]);
+		if (rc != ZOK) {
+			sd_eprintf("failed, path:%s, %s", path, zerror(rc));
+			f[i].rc = rc;
+			zk_async_done();
+		}
+	}
+	zk_async_wait();
+}
 
-	len = sizeof(*ev);
-	snprintf(path, sizeof(path), QUEUE_ZNODE "/%010"PRId32, queue_pos);
-	assert(zk_get_data(path, ev, &len) == ZOK);
-	sd_dprintf("%s, type:%d, len:%d, pos:%"PRId32, path, ev->type, len,
+static void zk_queue_advance(struct zk_fetch *f)
+{
+	sd_dprintf("type:%d, len:%d, pos:%"PRId32, f->ev.type, f->len,
 		   queue_pos);
 	queue_pos++;
 }
@@ -528,6 +602,13 @@ static void zk_unblock(void *msg, size_t msg_len)
 	add_event(EVENT_UNBLOCK, &this_node, msg, msg_len);
 }
 
+static int zk_update_node(const struct sd_node *node)
+{
+	this_node.node = *node;
+
+	return add_event(EVENT_UPDATE_NODE, &this_node, NULL, 0);
+}
+
 static void zk_handle_join_request(struct zk_event *ev)
 {
 	enum cluster_join_result res;
@@ -551,19 +632,36 @@ static void zk_handle_join_request(struct zk_event *ev)
 	sd_dprintf("I'm the master now");
 }
 
+static void zk_watch_completion(int rc, const struct Stat *stat,
+				const void *data)
+{
+	if (rc != ZOK)
+		sd_eprintf("failed to watch member, %s", zerror(rc));
+	zk_async_done();
+}
+
+/* Set the member watches with pipelined requests, one round trip in total */
 static void watch_all_nodes(void)
 {
 	struct String_vector strs;
-	struct zk_node znode;
 	char path[MAX_NODE_STR_LEN];
-	int len = sizeof(znode);
+	int i, rc;
 
 	if (zk_member_empty())
 		return;
 
-	FOR_EACH_ZNODE(MEMBER_ZNODE, path, &strs) {
-		zk_get_data(path, &znode, &len);
+	zk_get_children(MEMBER_ZNODE, &strs);
+	zk_async_begin(strs.count);
+	for (i = 0; i < strs.count; i++) {
+		snprintf(path, sizeof(path), MEMBER_ZNODE "/%s", strs.data[i]);
+		rc = zoo_aexists(zhandle, path, 1, zk_watch_completion, NULL);
+		if (rc != ZOK) {
+			sd_eprintf("failed, path:%s, %s", path, zerror(rc));
+			zk_async_done();
+		}
 	}
+	zk_async_wait();
+	deallocate_String_vector(&strs);
 }
 
 static void init_node_list(struct zk_event *ev)
@@ -697,6 +795,23 @@ static void zk_handle_notify(struct zk_event *ev)
 	sd_notify_handler(&ev->sender.node, ev->buf, ev->buf_len);
 }
 
+static void zk_handle_update_node(struct zk_event *ev)
+{
+	struct zk_node *n;
+
+	sd_dprintf("UPDATE NODE %s", node_to_str(&ev->sender.node));
+	pthread_rwlock_wrlock(&zk_tree_lock);
+	n = zk_tree_search_nolock(&ev->sender.node.nid);
+	if (n)
+		n->node = ev->sender.node;
+	pthread_rwlock_unlock(&zk_tree_lock);
+	if (!n)
+		return;
+
+	build_node_list();
+	sd_update_node_handler(&ev->sender.node, sd_nodes, nr_sd_nodes);
+}
+
 static void (*const zk_event_handlers[])(struct zk_event *ev) = {
 	[EVENT_JOIN_REQUEST]	= zk_handle_join_request,
 	[EVENT_JOIN_RESPONSE]	= zk_handle_join_response,
@@ -704,6 +819,7 @@ static void (*const zk_event_handlers[])(struct zk_event *ev) = {
 	[EVENT_BLOCK]		= zk_handle_block,
 	[EVENT_UNBLOCK]		= zk_handle_unblock,
 	[EVENT_NOTIFY]		= zk_handle_notify,
+	[EVENT_UPDATE_NODE]	= zk_handle_update_node,
 };
 
 static const int zk_max_event_handlers = ARRAY_SIZE(zk_event_handlers);
@@ -711,7 +827,8 @@ static const int zk_max_event_handlers = ARRAY_SIZE(zk_event_handlers);
 static void zk_event_handler(int listen_fd, int events, void *data)
 {
 	eventfd_t value;
-	struct zk_event ev;
+	int32_t start;
+	int i;
 
 	sd_dprintf("%d, %d", events, queue_pos);
 	if (events & EPOLLHUP) {
@@ -726,14 +843,30 @@ static void zk_event_handler(int listen_fd, int events, void *data)
 		return;
 	}
 
-	if (!zk_queue_peek())
-		goto kick_block_event;
+	start = queue_pos;
+	zk_queue_fetch(zk_batch, zk_batch_size, start);
+	for (i = 0; i < zk_batch_size; i++) {
+		struct zk_fetch *f = zk_batch + i;
+
+		/*
+		 * Handlers rewind queue_pos to revisit an event (a join request
+		 * awaiting its response), so the rest of the batch is stale.
+		 */
+		if (queue_pos != start + i || f->rc != ZOK)
+			break;
+
+		zk_queue_advance(f);
+		if (f->ev.type < zk_max_event_handlers &&
+		    zk_event_handlers[f->ev.type])
+			zk_event_handlers[f->ev.type](&f->ev);
+		else
+			panic("unhandled type %d", f->ev.type);
+	}
 
-	zk_queue_pop_advance(&ev);
-	if (ev.type < zk_max_event_handlers && zk_event_handlers[ev.type])
-		zk_event_handlers[ev.type](&ev);
-	else
-		panic("unhandled type %d", ev.type);
+	if (i == zk_batch_size)
+		zk_batch_size = min(zk_batch_size * 2, ZK_EVENT_BATCH_MAX);
+	else if (i < zk_batch_size / 2)
+		zk_batch_size = max(zk_batch_size / 2, 1);
 
 	 /* Someone has created next event, go kick event handler. */
 	if (zk_queue_peek()) {
@@ -741,7 +874,6 @@ static void zk_event_handler(int listen_fd, int events, void *data)
 		return;
 	}
 
-kick_block_event:
 	/*
 	 * Kick block event only if there is no nonblock event. We perfer to
 	 * handle nonblock event becasue:
@@ -808,6 +940,7 @@ static struct cluster_driver cdrv_zookeeper = {
 	.notify     = zk_notify,
 	.block      = zk_block,
 	.unblock    = zk_unblock,
+	.update_node = zk_update_node,
 };
 
 cdrv_register(cdrv_zookeeper);
@@ -0,0 +1,277 @@
+/*
+ * Copyright (C) 2013 Taobao Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Compressed object images
+ *
+ * Every SD_ZCHUNK_SIZE chunk is deflated on its own, so that a read only
+ * inflates the chunks it covers and a peer can send any chunk aligned range
+ * of an image as it is stored.  The deflate streams are kept per thread
+ * because setting one up costs more than compressing a chunk at the fastest
+ * level.
+ */
+#include <zlib.h>
+
+#include "sheep_priv.h"
+
+static __thread z_stream *deflate_stream;
+
+static z_stream *get_deflate_stream(void)
+{
+	z_stream *s = deflate_stream;
+
+	if (s) {
+		deflateReset(s);
+		return s;
+	}
+
+	s = xzalloc(sizeof(*s));
+	if (deflateInit(s, Z_BEST_SPEED) != Z_OK) {
+		sd_eprintf("failed to initialize deflate, %s", s->msg);
+		free(s);
+		return NULL;
+	}
+	deflate_stream = s;
+	return s;
+}
+
+static inline uint32_t chunk_size(const struct sd_zobj_header *h, int idx)
+{
+	return min((uint32_t)SD_ZCHUNK_SIZE, h->length - idx * SD_ZCHUNK_SIZE);
+}
+
+/* Deflate the chunk into dst, return the compressed length */
+static int compress_chunk(const void *src, uint32_t len, void *dst,
+			  uint32_t max)
+{
+	z_stream *s = get_deflate_stream();
+	int ret;
+
+	if (!s)
+		return -1;
+
+	s->next_in = (Bytef *)src;
+	s->avail_in = len;
+	s->next_out = dst;
+	s->avail_out = max;
+	ret = deflate(s, Z_FINISH);
+	if (ret == Z_STREAM_END)
+		return s->total_out;
+	if (ret == Z_OK || ret == Z_BUF_ERROR)
+		/* doesn't fit */
+		return max;
+
+	sd_eprintf("failed to deflate, %d", ret);
+	return -1;
+}
+
+/*
+ * Compress len bytes of buf into img.  Return the length of the image, or 0
+ * if it is not shorter than max.
+ */
+int zobj_compress(const void *buf, uint32_t len, void *img, uint32_t max)
+{
+	struct sd_zobj_header *h = img;
+	const char *src = buf;
+	char *dst = (char *)img + sizeof(*h);
+	uint32_t done = sizeof(*h), n;
+	int i, clen;
+
+	if (len > SD_DATA_OBJ_SIZE || max <= sizeof(*h))
+		return 0;
+
+	memset(h, 0, sizeof(*h));
+	h->magic = SD_ZOBJ_MAGIC;
+	h->algo = SD_ZALGO_DEFLATE;
+	h->nr_chunks = DIV_ROUND_UP(len, SD_ZCHUNK_SIZE);
+	h->length = len;
+
+	for (i = 0; i < h->nr_chunks; i++, src += n) {
+		n = chunk_size(h, i);
+		if (is_zero_buf(src, n)) {
+			h->chunk_len[i] = 0;
+			continue;
+		}
+
+		if (done + n > max)
+			/* storing it as is must still fit */
+			clen = compress_chunk(src, n, dst, max - done);
+		else
+			clen = compress_chunk(src, n, dst, n);
+		if (clen < 0)
+			return -1;
+		if (done + clen >= max)
+			return 0;
+		if (clen >= n) {
+			memcpy(dst, src, n);
+			clen = n;
+		}
+		h->chunk_len[i] = clen;
+		dst += clen;
+		done += clen;
+	}
+
+	return done;
+}
+
+/* Check that img is a sane image of len bytes, stored in img_len bytes */
+bool zobj_valid(const void *img, uint32_t img_len, uint32_t len)
+{
+	const struct sd_zobj_header *h = img;
+	uint64_t size = sizeof(*h);
+	int i;
+
+	if (img_len < sizeof(*h) || h->magic != SD_ZOBJ_MAGIC ||
+	    h->algo != SD_ZALGO_DEFLATE || h->length != len ||
+	    h->nr_chunks != DIV_ROUND_UP(len, SD_ZCHUNK_SIZE))
+		return false;
+
+	for (i = 0; i < h->nr_chunks; i++) {
+		if (h->chunk_len[i] > chunk_size(h, i))
+			return false;
+		size += h->chunk_len[i];
+	}
+
+	return size <= img_len;
+}
+
+/* Offset in the image of the data of the chunk idx */
+uint32_t zobj_chunk_offset(const struct sd_zobj_header *h, int idx)
+{
+	uint32_t off = sizeof(*h);
+	int i;
+
+	for (i = 0; i < idx; i++)
+		off += h->chunk_len[i];
+
+	return off;
+}
+
+/* Inflate the chunk idx from src, the data of the chunk, to dst */
+int zobj_decompress_chunk(const struct sd_zobj_header *h, int idx,
+			  const void *src, void *dst)
+{
+	uLongf len = chunk_size(h, idx);
+	int ret;
+
+	if (!h->chunk_len[idx]) {
+		memset(dst, 0, len);
+		return 0;
+	}
+	if (h->chunk_len[idx] == len) {
+		memcpy(dst, src, len);
+		return 0;
+	}
+
+	ret = uncompress(dst, &len, src, h->chunk_len[idx]);
+	if (ret != Z_OK || len != chunk_size(h, idx)) {
+		sd_eprintf("failed to inflate chunk %d, %d", idx, ret);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Inflate the whole valid image to buf */
+int zobj_decompress(const void *img, void *buf)
+{
+	const struct sd_zobj_header *h = img;
+	const char *src = (const char *)img + sizeof(*h);
+	char *dst = buf;
+	int i;
+
+	for (i = 0; i < h->nr_chunks; i++) {
+		if (zobj_decompress_chunk(h, i, src, dst) < 0)
+			return -1;
+		src += h->chunk_len[i];
+		dst += chunk_size(h, i);
+	}
+
+	return 0;
+}
+
+/*
+ * Make sub the header of the image of len bytes at offset of the image h,
+ * which must be a chunk aligned range.
+ */
+int zobj_sub_header(const struct sd_zobj_header *h, uint32_t offset,
+		    uint32_t len, struct sd_zobj_header *sub)
+{
+	int first = offset / SD_ZCHUNK_SIZE;
+
+	if (offset % SD_ZCHUNK_SIZE || !len || offset + len > h->length ||
+	    (len % SD_ZCHUNK_SIZE && offset + len != h->length))
+		return -1;
+
+	memset(sub, 0, sizeof(*sub));
+	sub->magic = SD_ZOBJ_MAGIC;
+	sub->algo = h->algo;
+	sub->nr_chunks = DIV_ROUND_UP(len, SD_ZCHUNK_SIZE);
+	sub->length = len;
+	memcpy(sub->chunk_len, h->chunk_len + first,
+	       sizeof(sub->chunk_len[0]) * sub->nr_chunks);
+
+	return 0;
+}
+
+/*
+ * The compressor runs the compress operation of the store now and then, so
+ * that the objects get compressed some time after they have gone cold.
+ */
+#define COMPRESS_MAX_INTERVAL 600 /* seconds */
+
+static struct timer compress_timer;
+static struct work compress_work;
+static bool compress_running;
+
+static inline unsigned int compress_interval(void)
+{
+	uint32_t interval = max(sys->compress_age / 2, 1U);
+
+	return min(interval, (uint32_t)COMPRESS_MAX_INTERVAL);
+}
+
+static void do_compress(struct work *work)
+{
+	int ret = sd_store->compress();
+
+	if (ret != SD_RES_SUCCESS)
+		sd_eprintf("failed to compress objects, %s", sd_strerror(ret));
+}
+
+static void compress_done(struct work *work)
+{
+	compress_running = false;
+}
+
+static void compress_timer_fn(void *data)
+{
+	/* objects are moved around in recovery, leave them alone */
+	if (!compress_running && !node_in_recovery() && sd_store &&
+	    sd_store->compress) {
+		compress_running = true;
+		queue_work(sys->compress_wqueue, &compress_work);
+	}
+
+	add_timer(&compress_timer, compress_interval() * 1000);
+}
+
+int init_compressor(void)
+{
+	compress_work.fn = do_compress;
+	compress_work.done = compress_done;
+	compress_timer.callback = compress_timer_fn;
+	add_timer(&compress_timer, compress_interval() * 1000);
+
+	sd_iprintf("compress objects not written for %" PRIu32 " seconds",
+		   sys->compress_age);
+	return 0;
+}
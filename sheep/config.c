@@ -24,7 +24,8 @@ static struct sheepdog_config {
 	uint16_t flags;
 	uint8_t copies;
 	uint8_t store[STORE_LEN];
-	uint8_t __pad[3];
+	uint8_t placement;
+	uint8_t __pad[2];
 	uint16_t version;
 	uint64_t space;
 } config;
@@ -166,6 +167,20 @@ int get_cluster_flags(uint16_t *flags)
 	return SD_RES_SUCCESS;
 }
 
+int set_cluster_placement(uint8_t placement)
+{
+	config.placement = placement;
+
+	return write_config();
+}
+
+int get_cluster_placement(uint8_t *placement)
+{
+	*placement = config.placement;
+
+	return SD_RES_SUCCESS;
+}
+
 int set_cluster_store(const char *name)
 {
 	memset(config.store, 0, sizeof(config.store));
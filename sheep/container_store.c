@@ -0,0 +1,987 @@
+/*
+ * Copyright (C) 2013 Taobao Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The container store packs the objects into a few large preallocated files
+ * instead of keeping one file per object, so neither the startup nor the
+ * recovery has to walk huge directories.
+ *
+ * Every container is a chain of extents.  An extent starts with a one block
+ * header telling its state, its length and, if used, which object (and for a
+ * stale copy, which epoch) it holds; the data follows the header.  Free space
+ * is made of extents too, so the chain always covers the whole file and
+ * startup just walks the headers to rebuild the in-memory index.
+ *
+ * An object is written into a free extent first and only then its header is
+ * flipped to live, so creation is atomic.  Replacing an object leaves two
+ * live extents for a moment; the sequence number in the header tells the
+ * newer one after a crash.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <linux/falloc.h>
+
+#include "sheep_priv.h"
+#include "list.h"
+#include "rbtree.h"
+
+#define CONTAINER_SIZE (UINT64_C(256) << 20)
+#define CONTAINER_BLOCK 4096
+#define CONTAINER_MAGIC 0x5344434e
+#define CONTAINER_NAME "container."
+
+enum extent_state {
+	EXTENT_FREE,
+	EXTENT_LIVE,
+	EXTENT_STALE,
+};
+
+struct extent_header {
+	uint32_t magic;
+	uint8_t state;
+	uint8_t pad[3];
+	/* the epoch of a stale copy, 0 for the live one */
+	uint32_t epoch;
+	uint32_t pad2;
+	uint64_t oid;
+	/* including the header block */
+	uint64_t length;
+	uint64_t seq;
+};
+
+struct container {
+	int fd;
+	int idx;
+	/* free extents sorted by offset */
+	struct list_head free_list;
+};
+
+struct free_extent {
+	struct list_head list;
+	uint64_t offset;
+	uint64_t length;
+};
+
+struct extent {
+	struct rb_node rb;
+	uint64_t oid;
+	uint32_t epoch;
+	struct container *c;
+	uint64_t offset;
+	uint64_t length;
+	uint64_t seq;
+	/* the index holds one reference */
+	int refcnt;
+};
+
+/* protects everything below and the extent headers */
+static pthread_mutex_t store_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct rb_root extent_root = RB_ROOT;
+static struct container **containers;
+static int nr_containers;
+static uint64_t store_seq;
+
+static inline uint64_t data_offset(const struct extent *e)
+{
+	return e->offset + CONTAINER_BLOCK;
+}
+
+static inline uint64_t data_length(const struct extent *e)
+{
+	return e->length - CONTAINER_BLOCK;
+}
+
+static inline uint64_t extent_size(uint64_t oid)
+{
+	return CONTAINER_BLOCK +
+		roundup(get_store_objsize(oid), CONTAINER_BLOCK);
+}
+
+static int extent_cmp(uint64_t oid, uint32_t epoch, const struct extent *e)
+{
+	if (oid != e->oid)
+		return oid < e->oid ? -1 : 1;
+	if (epoch != e->epoch)
+		return epoch < e->epoch ? -1 : 1;
+	return 0;
+}
+
+static struct extent *extent_lookup(uint64_t oid, uint32_t epoch)
+{
+	struct rb_node *n = extent_root.rb_node;
+	struct extent *e;
+	int cmp;
+
+	while (n) {
+		e = rb_entry(n, struct extent, rb);
+		cmp = extent_cmp(oid, epoch, e);
+
+		if (cmp < 0)
+			n = n->rb_left;
+		else if (cmp > 0)
+			n = n->rb_right;
+		else
+			return e;
+	}
+
+	return NULL;
+}
+
+static struct extent *extent_insert(struct extent *new)
+{
+	struct rb_node **p = &extent_root.rb_node;
+	struct rb_node *parent = NULL;
+	struct extent *e;
+	int cmp;
+
+	while (*p) {
+		parent = *p;
+		e = rb_entry(parent, struct extent, rb);
+		cmp = extent_cmp(new->oid, new->epoch, e);
+
+		if (cmp < 0)
+			p = &(*p)->rb_left;
+		else if (cmp > 0)
+			p = &(*p)->rb_right;
+		else
+			return e;
+	}
+	rb_link_node(&new->rb, parent, p);
+	rb_insert_color(&new->rb, &extent_root);
+
+	return NULL;
+}
+
+static int write_header(struct container *c, uint64_t offset, int state,
+			uint64_t oid, uint32_t epoch, uint64_t length,
+			uint64_t seq)
+{
+	struct extent_header hdr = {
+		.magic = CONTAINER_MAGIC,
+		.state = state,
+		.epoch = epoch,
+		.oid = oid,
+		.length = length,
+		.seq = seq,
+	};
+
+	if (xpwrite(c->fd, &hdr, sizeof(hdr), offset) != sizeof(hdr)) {
+		sd_eprintf("failed to write extent header, container %d, "
+			   "offset %"PRIu64", %m", c->idx, offset);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Return the space to the container and merge it with its neighbours.  One
+ * header then covers the whole run and the inner ones are skipped, so it is
+ * rewritten unless we are loading the headers as they are.
+ */
+static void free_space(struct container *c, uint64_t offset, uint64_t length,
+		       bool sync)
+{
+	struct free_extent *f, *prev = NULL, *next = NULL, *new;
+
+	list_for_each_entry(f, &c->free_list, list) {
+		if (f->offset > offset) {
+			next = f;
+			break;
+		}
+		prev = f;
+	}
+
+	if (prev && prev->offset + prev->length == offset) {
+		prev->length += length;
+		new = prev;
+	} else {
+		new = xzalloc(sizeof(*new));
+		new->offset = offset;
+		new->length = length;
+		if (prev)
+			list_add(&new->list, &prev->list);
+		else
+			list_add(&new->list, &c->free_list);
+	}
+
+	if (next && new->offset + new->length == next->offset) {
+		new->length += next->length;
+		list_del(&next->list);
+		free(next);
+	}
+
+	if (sync)
+		write_header(c, new->offset, EXTENT_FREE, 0, 0, new->length, 0);
+}
+
+static void put_extent_locked(struct extent *e)
+{
+	if (--e->refcnt)
+		return;
+
+	free_space(e->c, e->offset, e->length, true);
+	free(e);
+}
+
+static void put_extent(struct extent *e)
+{
+	pthread_mutex_lock(&store_lock);
+	put_extent_locked(e);
+	pthread_mutex_unlock(&store_lock);
+}
+
+static struct extent *get_extent(uint64_t oid, uint32_t epoch)
+{
+	struct extent *e;
+
+	pthread_mutex_lock(&store_lock);
+	e = extent_lookup(oid, epoch);
+	if (e)
+		e->refcnt++;
+	pthread_mutex_unlock(&store_lock);
+
+	return e;
+}
+
+/* Drop the entry from the index, the space is freed by its last user */
+static void remove_extent_locked(struct extent *e)
+{
+	rb_erase(&e->rb, &extent_root);
+	put_extent_locked(e);
+}
+
+static int get_open_flags(void)
+{
+	int flags = O_RDWR | O_DSYNC;
+
+	if (sys->nosync)
+		flags &= ~O_DSYNC;
+
+	return flags;
+}
+
+static void container_path(int idx, char *path)
+{
+	snprintf(path, PATH_MAX, "%s/" CONTAINER_NAME "%d", obj_path, idx);
+}
+
+static struct container *open_container(int idx, bool create)
+{
+	struct container *c;
+	char path[PATH_MAX];
+	int fd, flags = get_open_flags();
+
+	container_path(idx, path);
+	if (create)
+		flags |= O_CREAT | O_EXCL;
+	fd = open(path, flags, def_fmode);
+	if (fd < 0) {
+		if (errno != ENOENT)
+			sd_eprintf("failed to open %s, %m", path);
+		return NULL;
+	}
+
+	c = xzalloc(sizeof(*c));
+	c->fd = fd;
+	c->idx = idx;
+	INIT_LIST_HEAD(&c->free_list);
+
+	containers = xrealloc(containers, sizeof(*containers) * (idx + 1));
+	containers[idx] = c;
+	nr_containers = idx + 1;
+
+	return c;
+}
+
+static struct container *add_container(void)
+{
+	struct container *c;
+	char path[PATH_MAX];
+
+	c = open_container(nr_containers, true);
+	if (!c)
+		return NULL;
+
+	if (prealloc(c->fd, CONTAINER_SIZE) < 0 ||
+	    write_header(c, 0, EXTENT_FREE, 0, 0, CONTAINER_SIZE, 0) < 0) {
+		container_path(c->idx, path);
+		unlink(path);
+		close(c->fd);
+		free(c);
+		nr_containers--;
+		return NULL;
+	}
+	free_space(c, 0, CONTAINER_SIZE, false);
+	sd_dprintf("container %d", c->idx);
+
+	return c;
+}
+
+/* Carve the first fitting free extent, return the offset or -1 */
+static int64_t carve_space(struct container *c, uint64_t length)
+{
+	struct free_extent *f;
+	uint64_t offset;
+
+	list_for_each_entry(f, &c->free_list, list) {
+		if (f->length < length)
+			continue;
+
+		/*
+		 * Split the chain on disk first, so that the extents carved
+		 * later from the rest are never hidden behind this one.
+		 */
+		offset = f->offset;
+		if (f->length > length &&
+		    (write_header(c, offset + length, EXTENT_FREE, 0, 0,
+				  f->length - length, 0) < 0 ||
+		     write_header(c, offset, EXTENT_FREE, 0, 0, length, 0) < 0))
+			return -1;
+
+		f->offset += length;
+		f->length -= length;
+		if (!f->length) {
+			list_del(&f->list);
+			free(f);
+		}
+		return offset;
+	}
+
+	return -1;
+}
+
+static struct extent *alloc_extent(uint64_t oid, uint32_t epoch)
+{
+	uint64_t length = extent_size(oid);
+	struct container *c = NULL;
+	struct extent *e;
+	int64_t offset = -1;
+	int i;
+
+	pthread_mutex_lock(&store_lock);
+	for (i = 0; i < nr_containers && offset < 0; i++) {
+		c = containers[i];
+		offset = carve_space(c, length);
+	}
+	if (offset < 0) {
+		c = add_container();
+		if (c)
+			offset = carve_space(c, length);
+	}
+	if (offset < 0) {
+		pthread_mutex_unlock(&store_lock);
+		return NULL;
+	}
+
+	e = xzalloc(sizeof(*e));
+	e->oid = oid;
+	e->epoch = epoch;
+	e->c = c;
+	e->offset = offset;
+	e->length = length;
+	e->seq = ++store_seq;
+	e->refcnt = 1;
+	pthread_mutex_unlock(&store_lock);
+
+	return e;
+}
+
+/* Make the new extent the one of its name, replacing the old one if any */
+static void publish_extent_locked(struct extent *e)
+{
+	struct extent *old;
+
+	old = extent_insert(e);
+	if (old) {
+		remove_extent_locked(old);
+		extent_insert(e);
+	}
+}
+
+static int zero_range(int fd, uint64_t offset, uint64_t length)
+{
+	static char zero[CONTAINER_BLOCK * 16];
+	size_t len;
+
+	if (!length)
+		return 0;
+
+	if (fallocate(fd, FALLOC_FL_ZERO_RANGE | FALLOC_FL_KEEP_SIZE,
+		      offset, length) == 0)
+		return 0;
+	if (errno != EOPNOTSUPP && errno != ENOSYS)
+		return -1;
+
+	while (length) {
+		len = min(length, sizeof(zero));
+		if (xpwrite(fd, zero, len, offset) != len)
+			return -1;
+		offset += len;
+		length -= len;
+	}
+
+	return 0;
+}
+
+/* Write a new live copy of the object into a fresh extent */
+static int write_new_extent(uint64_t oid, uint32_t epoch, int state,
+			    const void *buf, uint32_t length, uint64_t offset)
+{
+	uint64_t objsize = get_store_objsize(oid);
+	struct extent *e;
+	int fd;
+
+	e = alloc_extent(oid, epoch);
+	if (!e) {
+		sd_eprintf("no space for object %"PRIx64, oid);
+		return SD_RES_NO_SPACE;
+	}
+	fd = e->c->fd;
+
+	if (zero_range(fd, data_offset(e), offset) < 0 ||
+	    zero_range(fd, data_offset(e) + offset + length,
+		       objsize - offset - length) < 0) {
+		sd_eprintf("failed to clear object %"PRIx64", %m", oid);
+		goto err;
+	}
+
+	if (obj_pwrite(fd, buf, length, data_offset(e) + offset) != length) {
+		sd_eprintf("failed to write object %"PRIx64", %m", oid);
+		goto err;
+	}
+
+	if (write_header(e->c, e->offset, state, oid, epoch, e->length,
+			 e->seq) < 0)
+		goto err;
+
+	pthread_mutex_lock(&store_lock);
+	publish_extent_locked(e);
+	pthread_mutex_unlock(&store_lock);
+
+	return SD_RES_SUCCESS;
+err:
+	put_extent(e);
+	return SD_RES_EIO;
+}
+
+static int container_read_extent(uint64_t oid, uint32_t epoch,
+				 const struct siocb *iocb)
+{
+	struct extent *e;
+	ssize_t size;
+	int ret = SD_RES_SUCCESS;
+
+	e = get_extent(oid, epoch);
+	if (!e)
+		return SD_RES_NO_OBJ;
+
+	if (iocb->offset + iocb->length > data_length(e)) {
+		sd_eprintf("out of object %"PRIx64", offset %"PRIu64", size %"
+			   PRIu32, oid, iocb->offset, iocb->length);
+		ret = SD_RES_EIO;
+		goto out;
+	}
+
+	size = obj_pread(e->c->fd, iocb->buf, iocb->length,
+			 data_offset(e) + iocb->offset);
+	if (size != iocb->length) {
+		sd_eprintf("failed to read object %"PRIx64", offset=%"PRIu64
+			   ", size=%"PRIu32", result=%zd, %m", oid,
+			   iocb->offset, iocb->length, size);
+		ret = SD_RES_EIO;
+	}
+out:
+	put_extent(e);
+	return ret;
+}
+
+static int container_read(uint64_t oid, const struct siocb *iocb)
+{
+	uint32_t epoch = sys_epoch();
+	int ret;
+
+	ret = container_read_extent(oid, 0, iocb);
+
+	/*
+	 * If the request is againt the older epoch, try to read from
+	 * the stale copies
+	 */
+	while (ret == SD_RES_NO_OBJ && iocb->epoch < epoch) {
+		epoch--;
+		ret = container_read_extent(oid, epoch, iocb);
+	}
+
+	return ret;
+}
+
+/* Read the stale copy of the latest epoch, found in the index */
+static int container_read_stale(uint64_t oid, const struct siocb *iocb)
+{
+	struct rb_node *n;
+	struct extent *e, *last = NULL;
+	uint32_t epoch = 0;
+
+	/* the last extent of the object is the stale copy of the latest epoch */
+	pthread_mutex_lock(&store_lock);
+	n = extent_root.rb_node;
+	while (n) {
+		e = rb_entry(n, struct extent, rb);
+		if (extent_cmp(oid, UINT32_MAX, e) < 0)
+			n = n->rb_left;
+		else {
+			last = e;
+			n = n->rb_right;
+		}
+	}
+	if (last && last->oid == oid && last->epoch < sys_epoch())
+		epoch = last->epoch;
+	pthread_mutex_unlock(&store_lock);
+
+	if (!epoch)
+		return SD_RES_NO_OBJ;
+	return container_read_extent(oid, epoch, iocb);
+}
+
+static int container_write(uint64_t oid, const struct siocb *iocb)
+{
+	struct extent *e;
+	ssize_t size;
+	int ret = SD_RES_SUCCESS;
+
+	if (iocb->epoch < sys_epoch()) {
+		sd_dprintf("%"PRIu32" sys %"PRIu32, iocb->epoch, sys_epoch());
+		return SD_RES_OLD_NODE_VER;
+	}
+
+	e = get_extent(oid, 0);
+	if (!e)
+		return SD_RES_NO_OBJ;
+
+	if (iocb->offset + iocb->length > data_length(e)) {
+		sd_eprintf("out of object %"PRIx64", offset %"PRIu64", size %"
+			   PRIu32, oid, iocb->offset, iocb->length);
+		ret = SD_RES_EIO;
+		goto out;
+	}
+
+	size = obj_pwrite(e->c->fd, iocb->buf, iocb->length,
+			  data_offset(e) + iocb->offset);
+	if (size != iocb->length) {
+		sd_eprintf("failed to write object %"PRIx64", offset=%"PRIu64
+			   ", size=%"PRIu32", result=%zd, %m", oid,
+			   iocb->offset, iocb->length, size);
+		ret = errno == ENOSPC ? SD_RES_NO_SPACE : SD_RES_EIO;
+	}
+out:
+	put_extent(e);
+	return ret;
+}
+
+static int container_discard(uint64_t oid, const struct siocb *iocb)
+{
+	struct extent *e;
+	int ret = SD_RES_SUCCESS;
+
+	if (iocb->epoch < sys_epoch()) {
+		sd_dprintf("%"PRIu32" sys %"PRIu32, iocb->epoch, sys_epoch());
+		return SD_RES_OLD_NODE_VER;
+	}
+
+	e = get_extent(oid, 0);
+	if (!e)
+		return SD_RES_NO_OBJ;
+
+	if (iocb->offset + iocb->length > data_length(e)) {
+		sd_eprintf("out of object %"PRIx64", offset %"PRIu64", size %"
+			   PRIu32, oid, iocb->offset, iocb->length);
+		ret = SD_RES_EIO;
+		goto out;
+	}
+
+	/* the extent stays allocated in the container, only its blocks go */
+	if (punch_hole(e->c->fd, data_offset(e) + iocb->offset,
+		       iocb->length) < 0) {
+		sd_eprintf("failed to discard object %"PRIx64", %m", oid);
+		ret = SD_RES_EIO;
+	}
+out:
+	put_extent(e);
+	return ret;
+}
+
+static int container_create_and_write(uint64_t oid, const struct siocb *iocb)
+{
+	if (iocb->offset + iocb->length > get_store_objsize(oid))
+		return SD_RES_EIO;
+
+	return write_new_extent(oid, 0, EXTENT_LIVE, iocb->buf, iocb->length,
+				iocb->offset);
+}
+
+static bool container_exist(uint64_t oid)
+{
+	bool ret;
+
+	pthread_mutex_lock(&store_lock);
+	ret = !!extent_lookup(oid, 0);
+	pthread_mutex_unlock(&store_lock);
+
+	return ret;
+}
+
+static int container_remove_object(uint64_t oid)
+{
+	struct extent *e;
+
+	pthread_mutex_lock(&store_lock);
+	e = extent_lookup(oid, 0);
+	if (e)
+		remove_extent_locked(e);
+	pthread_mutex_unlock(&store_lock);
+
+	return e ? SD_RES_SUCCESS : SD_RES_NO_OBJ;
+}
+
+/* Copy the stale copy of 'tgt_epoch' back as the live object */
+static int container_link(uint64_t oid, uint32_t tgt_epoch)
+{
+	struct extent *e;
+	void *buf;
+	size_t len = get_store_objsize(oid);
+	int ret;
+
+	sd_dprintf("try link %"PRIx64" from snapshot with epoch %d", oid,
+		   tgt_epoch);
+
+	e = get_extent(oid, tgt_epoch);
+	if (!e)
+		return SD_RES_NO_OBJ;
+
+	buf = xvalloc(len);
+	if (obj_pread(e->c->fd, buf, len, data_offset(e)) != len) {
+		sd_eprintf("failed to read stale object %"PRIx64", %m", oid);
+		ret = SD_RES_EIO;
+		goto out;
+	}
+	ret = write_new_extent(oid, 0, EXTENT_LIVE, buf, len, 0);
+out:
+	free(buf);
+	put_extent(e);
+	return ret;
+}
+
+/* Turn the live copy into the stale copy of 'tgt_epoch' in place */
+static int move_extent_to_stale_locked(struct extent *e, uint32_t tgt_epoch)
+{
+	struct extent *old;
+	uint64_t seq = ++store_seq;
+
+	if (write_header(e->c, e->offset, EXTENT_STALE, e->oid, tgt_epoch,
+			 e->length, seq) < 0)
+		return SD_RES_EIO;
+
+	rb_erase(&e->rb, &extent_root);
+	e->epoch = tgt_epoch;
+	e->seq = seq;
+	old = extent_insert(e);
+	if (old) {
+		remove_extent_locked(old);
+		extent_insert(e);
+	}
+	sd_dprintf("moved object %"PRIx64, e->oid);
+
+	return SD_RES_SUCCESS;
+}
+
+/* Collect the oids of the live objects, the caller frees the array */
+static uint64_t *get_live_oids(int *nr)
+{
+	struct rb_node *n;
+	struct extent *e;
+	uint64_t *oids = NULL;
+	int alloc = 0;
+
+	*nr = 0;
+	pthread_mutex_lock(&store_lock);
+	for (n = rb_first(&extent_root); n; n = rb_next(n)) {
+		e = rb_entry(n, struct extent, rb);
+		if (e->epoch)
+			continue;
+		if (*nr == alloc) {
+			alloc = alloc ? alloc * 2 : 1024;
+			oids = xrealloc(oids, sizeof(*oids) * alloc);
+		}
+		oids[(*nr)++] = e->oid;
+	}
+	pthread_mutex_unlock(&store_lock);
+
+	return oids;
+}
+
+static int move_to_stale(uint64_t *oids, int nr, uint32_t tgt_epoch,
+			 bool (*filter)(uint64_t oid))
+{
+	struct extent *e;
+	int i, ret = SD_RES_SUCCESS;
+
+	for (i = 0; i < nr && ret == SD_RES_SUCCESS; i++) {
+		if (filter && !filter(oids[i]))
+			continue;
+
+		pthread_mutex_lock(&store_lock);
+		e = extent_lookup(oids[i], 0);
+		if (e)
+			ret = move_extent_to_stale_locked(e, tgt_epoch);
+		pthread_mutex_unlock(&store_lock);
+	}
+
+	return ret;
+}
+
+static int container_end_recover(uint32_t old_epoch,
+				 const struct vnode_info *old_vnode_info)
+{
+	uint64_t *oids;
+	int nr, ret;
+
+	if (old_epoch == 0)
+		return SD_RES_SUCCESS;
+
+	oids = get_live_oids(&nr);
+	ret = move_to_stale(oids, nr, old_epoch, oid_stale);
+	free(oids);
+
+	return ret;
+}
+
+static int container_purge_obj(void)
+{
+	uint64_t *oids;
+	int nr, ret;
+
+	oids = get_live_oids(&nr);
+	ret = move_to_stale(oids, nr, get_latest_epoch(), NULL);
+	free(oids);
+
+	return ret;
+}
+
+/* Free all the stale copies */
+static int container_cleanup(void)
+{
+	struct rb_node *n, *next;
+	struct extent *e;
+
+	pthread_mutex_lock(&store_lock);
+	for (n = rb_first(&extent_root); n; n = next) {
+		next = rb_next(n);
+		e = rb_entry(n, struct extent, rb);
+		if (e->epoch)
+			remove_extent_locked(e);
+	}
+	pthread_mutex_unlock(&store_lock);
+
+	return SD_RES_SUCCESS;
+}
+
+static void drop_containers(void)
+{
+	struct free_extent *f, *n;
+	struct rb_node *node;
+	int i;
+
+	while ((node = rb_first(&extent_root))) {
+		rb_erase(node, &extent_root);
+		free(rb_entry(node, struct extent, rb));
+	}
+
+	for (i = 0; i < nr_containers; i++) {
+		list_for_each_entry_safe(f, n, &containers[i]->free_list,
+					 list) {
+			list_del(&f->list);
+			free(f);
+		}
+		close(containers[i]->fd);
+		free(containers[i]);
+	}
+	free(containers);
+	containers = NULL;
+	nr_containers = 0;
+}
+
+static int container_format(void)
+{
+	char path[PATH_MAX];
+	int i, n;
+
+	sd_dprintf("try get a clean store");
+	pthread_mutex_lock(&store_lock);
+	n = nr_containers;
+	drop_containers();
+	pthread_mutex_unlock(&store_lock);
+
+	for (i = 0; ; i++) {
+		container_path(i, path);
+		if (unlink(path) < 0) {
+			if (errno == ENOENT && i >= n)
+				break;
+			if (errno != ENOENT) {
+				sd_eprintf("failed to remove %s, %m", path);
+				return SD_RES_EIO;
+			}
+		}
+	}
+
+	if (sys->enable_object_cache)
+		object_cache_format();
+
+	return SD_RES_SUCCESS;
+}
+
+/* Add the extent found at startup, the newer copy of the same name wins */
+static void load_extent(struct container *c, const struct extent_header *hdr,
+			uint64_t offset)
+{
+	struct extent *e, *old;
+
+	e = xzalloc(sizeof(*e));
+	e->oid = hdr->oid;
+	e->epoch = hdr->state == EXTENT_STALE ? hdr->epoch : 0;
+	e->c = c;
+	e->offset = offset;
+	e->length = hdr->length;
+	e->seq = hdr->seq;
+	e->refcnt = 1;
+	store_seq = max(store_seq, e->seq);
+
+	old = extent_insert(e);
+	if (!old)
+		return;
+
+	if (old->seq > e->seq) {
+		put_extent_locked(e);
+		return;
+	}
+	remove_extent_locked(old);
+	extent_insert(e);
+}
+
+static int load_container(struct container *c)
+{
+	struct extent_header hdr;
+	uint64_t offset = 0;
+	struct stat st;
+
+	if (fstat(c->fd, &st) < 0) {
+		sd_eprintf("failed to stat container %d, %m", c->idx);
+		return -1;
+	}
+
+	while (offset < st.st_size) {
+		if (xpread(c->fd, &hdr, sizeof(hdr), offset) != sizeof(hdr)) {
+			sd_eprintf("failed to read container %d, %m", c->idx);
+			return -1;
+		}
+		if (hdr.magic != CONTAINER_MAGIC || !hdr.length ||
+		    hdr.length % CONTAINER_BLOCK ||
+		    offset + hdr.length > st.st_size) {
+			sd_eprintf("container %d corrupted at %"PRIu64, c->idx,
+				   offset);
+			return -1;
+		}
+
+		if (hdr.state == EXTENT_FREE)
+			free_space(c, offset, hdr.length, false);
+		else
+			load_extent(c, &hdr, offset);
+		offset += hdr.length;
+	}
+
+	return 0;
+}
+
+static void init_copy_number(struct extent *e)
+{
+	struct sheepdog_inode *inode = xzalloc(SD_INODE_HEADER_SIZE);
+
+	if (xpread(e->c->fd, inode, SD_INODE_HEADER_SIZE, data_offset(e)) !=
+	    SD_INODE_HEADER_SIZE)
+		sd_eprintf("failed to read inode header %"PRIx64", %m",
+			   e->oid);
+	else
+		add_vdi_copy_number(oid_to_vid(e->oid), inode->nr_copies,
+				    inode->copy_policy,
+				    inode->block_size_shift);
+	free(inode);
+}
+
+static int container_init(void)
+{
+	struct rb_node *n;
+	struct extent *e;
+	int i, ret = SD_RES_SUCCESS;
+
+	sd_dprintf("use container store driver");
+	if (sys->enable_md || uatomic_is_true(&sys->use_journal)) {
+		sd_eprintf("container store doesn't support multiple disks "
+			   "or journaling");
+		return SD_RES_EIO;
+	}
+
+	pthread_mutex_lock(&store_lock);
+	drop_containers();
+	for (i = 0; open_container(i, false); i++)
+		if (load_container(containers[i]) < 0) {
+			ret = SD_RES_EIO;
+			goto out;
+		}
+
+	for (n = rb_first(&extent_root); n; n = rb_next(n)) {
+		e = rb_entry(n, struct extent, rb);
+		if (e->epoch)
+			continue;
+
+		objlist_cache_insert(e->oid);
+		if (is_vdi_obj(e->oid)) {
+			sd_dprintf("found the VDI object %" PRIx64, e->oid);
+			set_bit(oid_to_vid(e->oid), sys->vdi_inuse);
+			init_copy_number(e);
+		}
+	}
+	sd_iprintf("loaded %d containers", nr_containers);
+out:
+	pthread_mutex_unlock(&store_lock);
+	return ret;
+}
+
+static struct store_driver container_store = {
+	.name = "container",
+	.init = container_init,
+	.exist = container_exist,
+	.create_and_write = container_create_and_write,
+	.write = container_write,
+	.discard = container_discard,
+	.read = container_read,
+	.read_stale = container_read_stale,
+	.link = container_link,
+	.end_recover = container_end_recover,
+	.cleanup = container_cleanup,
+	.format = container_format,
+	.remove_object = container_remove_object,
+	.purge_obj = container_purge_obj,
+};
+
+add_store_driver(container_store);
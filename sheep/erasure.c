@@ -0,0 +1,469 @@
+/*
+ * Copyright (C) 2013 Taobao Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Gateway of erasure coded objects
+ *
+ * A request is mapped to the stripes it covers, and the strips of them are
+ * read or written on all their nodes at once.  Reads get the data strips and
+ * decode the ones that fail from the parity strips.  Writes read the stripes
+ * they cover partially first, then encode and write all the strips of their
+ * stripes.  The read-modify-write is serialized per object on this gateway,
+ * which is the only one writing to the VDI.
+ */
+#include "sheep_priv.h"
+#include "fec.h"
+
+#define EC_LOCKS 64
+
+static pthread_mutex_t ec_locks[EC_LOCKS] = {
+	[0 ... EC_LOCKS - 1] = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static inline pthread_mutex_t *oid_to_ec_lock(uint64_t oid)
+{
+	return ec_locks + fnv_64a_buf(&oid, sizeof(oid), FNV1A_64_INIT) %
+		EC_LOCKS;
+}
+
+struct ec_io {
+	struct request *req;
+	uint64_t oid;
+	struct fec fec;
+	int nr_strips;
+	const struct sd_vnode *vnodes[SD_EC_MAX_STRIPS];
+	/* the stripes [start, start + nr_stripes) of the object */
+	uint32_t start;
+	uint32_t nr_stripes;
+	uint8_t *strips[SD_EC_MAX_STRIPS];
+	void *buf;
+};
+
+static inline uint32_t stripe_size(const struct ec_io *io)
+{
+	return io->fec.d * SD_EC_STRIP_SIZE;
+}
+
+static inline uint32_t all_strips(const struct ec_io *io)
+{
+	return (1U << io->nr_strips) - 1;
+}
+
+/* Set up io for the stripes covering len bytes at offset of the object */
+static int ec_io_init(struct ec_io *io, struct request *req, uint64_t oid,
+		      uint64_t offset, uint32_t len)
+{
+	uint32_t strip_len;
+	int d, p, i;
+
+	if (!get_obj_erasure(oid, &d, &p))
+		return SD_RES_INVALID_PARMS;
+	if (req->vinfo->nr_zones < d + p) {
+		sd_eprintf("%d zones can't hold the %d strips of %"PRIx64,
+			   req->vinfo->nr_zones, d + p, oid);
+		return SD_RES_HALT;
+	}
+
+	memset(io, 0, sizeof(*io));
+	io->req = req;
+	io->oid = oid;
+	io->nr_strips = d + p;
+	fec_init(&io->fec, d, p);
+	vinfo_oid_to_vnodes(req->vinfo, oid, d + p, io->vnodes);
+
+	io->start = offset / stripe_size(io);
+	if (len)
+		io->nr_stripes = DIV_ROUND_UP(offset + len, stripe_size(io)) -
+			io->start;
+	strip_len = io->nr_stripes * SD_EC_STRIP_SIZE;
+	if (!strip_len)
+		return SD_RES_SUCCESS;
+	io->buf = xvalloc(strip_len * io->nr_strips);
+	for (i = 0; i < io->nr_strips; i++)
+		io->strips[i] = (uint8_t *)io->buf + strip_len * i;
+
+	return SD_RES_SUCCESS;
+}
+
+/* Copy len bytes at offset of the object between buf and the strips */
+static void ec_copy(struct ec_io *io, uint64_t offset, uint32_t len, void *buf,
+		    bool to_strips)
+{
+	uint64_t pos = offset - (uint64_t)io->start * stripe_size(io);
+	char *p = buf;
+
+	while (len) {
+		uint32_t stripe = pos / stripe_size(io);
+		uint32_t k = pos % stripe_size(io) / SD_EC_STRIP_SIZE;
+		uint32_t off = pos % SD_EC_STRIP_SIZE;
+		uint32_t n = min(len, SD_EC_STRIP_SIZE - off);
+		uint8_t *q = io->strips[k] + stripe * SD_EC_STRIP_SIZE + off;
+
+		if (to_strips)
+			memcpy(q, p, n);
+		else
+			memcpy(p, q, n);
+		p += n;
+		pos += n;
+		len -= n;
+	}
+}
+
+/* The data strips holding len bytes at offset of the object */
+static uint32_t data_strips(const struct ec_io *io, uint64_t offset,
+			    uint32_t len)
+{
+	uint32_t first, last;
+
+	if (io->nr_stripes > 1)
+		return (1U << io->fec.d) - 1;
+
+	first = offset % stripe_size(io) / SD_EC_STRIP_SIZE;
+	last = (offset + len - 1) % stripe_size(io) / SD_EC_STRIP_SIZE;
+	return ((1U << (last + 1)) - 1) & ~((1U << first) - 1);
+}
+
+static int ec_exec_local(struct ec_io *io, struct sd_req *hdr, void *buf)
+{
+	struct request fake = { };
+	int ret;
+
+	memcpy(&fake.rq, hdr, sizeof(*hdr));
+	fake.data = buf;
+	fake.op = get_sd_op(hdr->opcode);
+	fake.vinfo = io->req->vinfo;
+
+	ret = sheep_do_op_work(fake.op, &fake);
+	memcpy(hdr, &fake.rp, sizeof(fake.rp));
+	((struct sd_rsp *)hdr)->result = ret;
+
+	return ret;
+}
+
+/*
+ * Run the peer request on the strips in mask of the stripes [s, s + n) of io,
+ * and return the mask of the strips it succeeds on.  The first error is saved
+ * in *err.
+ */
+static uint32_t ec_exec(struct ec_io *io, int opcode, uint32_t mask,
+			uint32_t s, uint32_t n, int *err)
+{
+	struct sd_req hdrs[SD_EC_MAX_STRIPS], hdr, local_hdr;
+	const struct node_id *nids[SD_EC_MAX_STRIPS];
+	void *bufs[SD_EC_MAX_STRIPS], *buf, *local_buf = NULL;
+	int idx[SD_EC_MAX_STRIPS], nr = 0, local = -1, i;
+	uint32_t len = n * SD_EC_STRIP_SIZE, done = 0;
+
+	for (i = 0; i < io->nr_strips; i++) {
+		if (!(mask & (1U << i)))
+			continue;
+
+		sd_init_req(&hdr, opcode);
+		hdr.epoch = io->req->rq.epoch;
+		hdr.obj.oid = io->oid;
+		hdr.obj.offset = (uint64_t)(io->start + s) * SD_EC_STRIP_SIZE;
+		hdr.obj.copies = io->nr_strips;
+		hdr.obj.ec_index = i + 1;
+		if (opcode == SD_OP_DISCARD_PEER)
+			hdr.obj.length = len;
+		else
+			hdr.data_length = len;
+		if (opcode == SD_OP_WRITE_PEER ||
+		    opcode == SD_OP_CREATE_AND_WRITE_PEER)
+			hdr.flags = SD_FLAG_CMD_WRITE;
+		buf = io->buf ? io->strips[i] + s * SD_EC_STRIP_SIZE : NULL;
+
+		if (vnode_is_local(io->vnodes[i])) {
+			local = i;
+			local_hdr = hdr;
+			local_buf = buf;
+			continue;
+		}
+		hdrs[nr] = hdr;
+		nids[nr] = &io->vnodes[i]->nid;
+		bufs[nr] = buf;
+		idx[nr++] = i;
+	}
+
+	if (nr)
+		sheep_exec_reqs(nids, hdrs, bufs, nr);
+	if (local >= 0) {
+		ec_exec_local(io, &local_hdr, local_buf);
+		hdrs[nr] = local_hdr;
+		bufs[nr] = local_buf;
+		idx[nr++] = local;
+	}
+
+	for (i = 0; i < nr; i++) {
+		struct sd_rsp *rsp = (struct sd_rsp *)(hdrs + i);
+
+		if (rsp->result != SD_RES_SUCCESS) {
+			sd_eprintf("strip %d of %"PRIx64" failed, %s", idx[i],
+				   io->oid, sd_strerror(rsp->result));
+			if (*err == SD_RES_SUCCESS)
+				*err = rsp->result;
+			continue;
+		}
+		if (opcode == SD_OP_READ_PEER)
+			untrim_zero_sectors(bufs[i], rsp->obj.offset,
+					    rsp->data_length, len);
+		done |= 1U << idx[i];
+	}
+
+	return done;
+}
+
+/* Read the data strips in want of the stripes [s, s + n) of io */
+static int ec_read_strips(struct ec_io *io, uint32_t want, uint32_t s,
+			  uint32_t n)
+{
+	uint8_t *strips[SD_EC_MAX_STRIPS];
+	uint32_t avail, missing;
+	int i, err = SD_RES_SUCCESS;
+
+	avail = ec_exec(io, SD_OP_READ_PEER, want, s, n, &err);
+	missing = want & ~avail;
+	if (!missing)
+		return SD_RES_SUCCESS;
+
+	avail |= ec_exec(io, SD_OP_READ_PEER, all_strips(io) & ~want, s, n,
+			 &err);
+	for (i = 0; i < io->nr_strips; i++)
+		strips[i] = io->strips[i] + s * SD_EC_STRIP_SIZE;
+	if (fec_reconstruct(&io->fec, strips, avail, missing,
+			    n * SD_EC_STRIP_SIZE) < 0) {
+		sd_eprintf("only strips %x of %"PRIx64" are available", avail,
+			   io->oid);
+		return err;
+	}
+
+	sd_dprintf("decoded strips %x of %"PRIx64, missing, io->oid);
+	return SD_RES_SUCCESS;
+}
+
+static void ec_io_free(struct ec_io *io)
+{
+	free(io->buf);
+}
+
+int ec_read_obj(struct request *req)
+{
+	struct sd_req *hdr = &req->rq;
+	uint64_t offset = hdr->obj.offset;
+	uint32_t len = hdr->data_length;
+	struct ec_io io;
+	int ret;
+
+	if (offset + len > SD_DATA_OBJ_SIZE)
+		return SD_RES_INVALID_PARMS;
+
+	ret = ec_io_init(&io, req, hdr->obj.oid, offset, len);
+	if (ret != SD_RES_SUCCESS)
+		return ret;
+
+	if (len) {
+		ret = ec_read_strips(&io, data_strips(&io, offset, len), 0,
+				     io.nr_stripes);
+		if (ret != SD_RES_SUCCESS)
+			goto out;
+		ec_copy(&io, offset, len, req->data, false);
+	}
+
+	req->rp.data_length = len;
+	req->rp.obj.offset = 0;
+	req->rp.obj.copies = io.nr_strips;
+out:
+	ec_io_free(&io);
+	return ret;
+}
+
+/* Read the whole base object of a copy-on-write creation */
+static int read_cow_object(struct request *req, void *buf)
+{
+	struct request read_req = { };
+	struct sd_req *hdr = &read_req.rq;
+	struct sd_rsp *rsp = &read_req.rp;
+	int ret;
+
+	/* Create a fake gateway read request */
+	sd_init_req(hdr, SD_OP_READ_OBJ);
+	hdr->data_length = SD_DATA_OBJ_SIZE;
+	hdr->epoch = req->rq.epoch;
+	hdr->obj.oid = req->rq.obj.cow_oid;
+
+	read_req.data = buf;
+	read_req.op = get_sd_op(hdr->opcode);
+	read_req.vinfo = req->vinfo;
+
+	ret = gateway_read_obj(&read_req);
+	if (ret == SD_RES_SUCCESS)
+		untrim_zero_sectors(buf, rsp->obj.offset, rsp->data_length,
+				    SD_DATA_OBJ_SIZE);
+
+	return ret;
+}
+
+/*
+ * Write len bytes of data, or zeros if data is NULL, at offset of the object
+ * in place.
+ */
+static int ec_update(struct request *req, uint64_t offset, uint32_t len,
+		     void *data)
+{
+	struct ec_io io;
+	uint32_t data_mask, done, last;
+	int ret, err = SD_RES_SUCCESS;
+
+	ret = ec_io_init(&io, req, req->rq.obj.oid, offset, len);
+	if (ret != SD_RES_SUCCESS)
+		return ret;
+
+	data_mask = (1U << io.fec.d) - 1;
+	last = io.nr_stripes - 1;
+	if (offset % stripe_size(&io)) {
+		ret = ec_read_strips(&io, data_mask, 0, 1);
+		if (ret != SD_RES_SUCCESS)
+			goto out;
+	}
+	if ((offset + len) % stripe_size(&io) &&
+	    (last || !(offset % stripe_size(&io)))) {
+		ret = ec_read_strips(&io, data_mask, last, 1);
+		if (ret != SD_RES_SUCCESS)
+			goto out;
+	}
+
+	if (data)
+		ec_copy(&io, offset, len, data, true);
+	else {
+		void *zero = xzalloc(len);
+
+		ec_copy(&io, offset, len, zero, true);
+		free(zero);
+	}
+	fec_encode(&io.fec, io.strips, io.nr_stripes * SD_EC_STRIP_SIZE);
+
+	done = ec_exec(&io, SD_OP_WRITE_PEER, all_strips(&io), 0,
+		       io.nr_stripes, &err);
+	if (done != all_strips(&io))
+		ret = err;
+out:
+	ec_io_free(&io);
+	return ret;
+}
+
+int ec_write_obj(struct request *req)
+{
+	struct sd_req *hdr = &req->rq;
+	pthread_mutex_t *lock = oid_to_ec_lock(hdr->obj.oid);
+	int ret;
+
+	if (hdr->obj.offset + hdr->data_length > SD_DATA_OBJ_SIZE)
+		return SD_RES_INVALID_PARMS;
+	if (!hdr->data_length)
+		return SD_RES_SUCCESS;
+
+	pthread_mutex_lock(lock);
+	ret = ec_update(req, hdr->obj.offset, hdr->data_length, req->data);
+	pthread_mutex_unlock(lock);
+
+	return ret;
+}
+
+int ec_create_and_write_obj(struct request *req)
+{
+	struct sd_req *hdr = &req->rq;
+	pthread_mutex_t *lock = oid_to_ec_lock(hdr->obj.oid);
+	uint32_t done;
+	struct ec_io io;
+	void *buf;
+	int ret, err = SD_RES_SUCCESS;
+
+	if (hdr->obj.offset + hdr->data_length > SD_DATA_OBJ_SIZE)
+		return SD_RES_INVALID_PARMS;
+
+	ret = ec_io_init(&io, req, hdr->obj.oid, 0, SD_DATA_OBJ_SIZE);
+	if (ret != SD_RES_SUCCESS)
+		return ret;
+
+	buf = xvalloc(SD_DATA_OBJ_SIZE);
+	if ((hdr->flags & SD_FLAG_CMD_COW) &&
+	    hdr->data_length != SD_DATA_OBJ_SIZE) {
+		ret = read_cow_object(req, buf);
+		if (ret != SD_RES_SUCCESS) {
+			sd_eprintf("failed to read cow object");
+			goto out;
+		}
+	} else
+		memset(buf, 0, SD_DATA_OBJ_SIZE);
+	memcpy((char *)buf + hdr->obj.offset, req->data, hdr->data_length);
+
+	ec_copy(&io, 0, SD_DATA_OBJ_SIZE, buf, true);
+	fec_encode(&io.fec, io.strips, io.nr_stripes * SD_EC_STRIP_SIZE);
+
+	pthread_mutex_lock(lock);
+	done = ec_exec(&io, SD_OP_CREATE_AND_WRITE_PEER, all_strips(&io), 0,
+		       io.nr_stripes, &err);
+	pthread_mutex_unlock(lock);
+	if (done != all_strips(&io))
+		ret = err;
+out:
+	free(buf);
+	ec_io_free(&io);
+	return ret;
+}
+
+/*
+ * The whole stripes in the range are punched on all the nodes, whose parity of
+ * zeros is zeros, and the rest is written with zeros.
+ */
+int ec_discard_obj(struct request *req)
+{
+	struct sd_req *hdr = &req->rq;
+	pthread_mutex_t *lock = oid_to_ec_lock(hdr->obj.oid);
+	uint64_t offset = hdr->obj.offset, end = offset + hdr->obj.length;
+	uint64_t first, last;
+	uint32_t ssize, done;
+	struct ec_io io;
+	int d, p, ret = SD_RES_SUCCESS, err = SD_RES_SUCCESS;
+
+	if (end > SD_DATA_OBJ_SIZE || !get_obj_erasure(hdr->obj.oid, &d, &p))
+		return SD_RES_INVALID_PARMS;
+	if (offset == end)
+		return SD_RES_SUCCESS;
+
+	ssize = d * SD_EC_STRIP_SIZE;
+	first = roundup(offset, ssize);
+	last = end / ssize * ssize;
+
+	pthread_mutex_lock(lock);
+	if (first >= last) {
+		ret = ec_update(req, offset, end - offset, NULL);
+		goto out;
+	}
+	if (offset < first)
+		ret = ec_update(req, offset, first - offset, NULL);
+	if (ret == SD_RES_SUCCESS && last < end)
+		ret = ec_update(req, last, end - last, NULL);
+	if (ret != SD_RES_SUCCESS)
+		goto out;
+
+	ret = ec_io_init(&io, req, hdr->obj.oid, first, 0);
+	if (ret != SD_RES_SUCCESS)
+		goto out;
+	done = ec_exec(&io, SD_OP_DISCARD_PEER, all_strips(&io), 0,
+		       (last - first) / ssize, &err);
+	if (done != all_strips(&io))
+		ret = err;
+	ec_io_free(&io);
+out:
+	pthread_mutex_unlock(lock);
+	return ret;
+}
@@ -0,0 +1,272 @@
+/*
+ * Copyright (C) 2013 Taobao Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The deduplicator shares the identical cold data objects of the farm store.
+ * An object not written for sys->dedup_age seconds is hashed and linked into
+ * .dedup/ of its disk under the SHA1 of its data, or replaced with the file
+ * already there once their data compare equal (see share_object()).  Every
+ * pass first indexes the files in .dedup/ in memory and removes the ones no
+ * object links to anymore.  The objects already shared aren't hashed again.
+ */
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "farm.h"
+#include "sheep_priv.h"
+
+#define DEDUP_DIR ".dedup"
+#define DEDUP_MAX_INTERVAL 600 /* seconds */
+
+struct fingerprint {
+	struct rb_node rb;
+	unsigned char sha1[SHA1_LEN];
+	/* of the path of the disk */
+	uint64_t disk;
+};
+
+/* the state of the pass, the passes run one at a time */
+static struct rb_root fingerprints = RB_ROOT;
+static time_t pass_start;
+static void *pass_buf;
+static uint64_t nr_files, nr_freed, nr_new, nr_shared;
+
+static inline uint64_t disk_id(const char *wd)
+{
+	return fnv_64a_buf((void *)wd, strlen(wd), FNV1A_64_INIT);
+}
+
+static int fingerprint_cmp(const unsigned char *sha1, uint64_t disk,
+			   const struct fingerprint *fp)
+{
+	int ret = memcmp(sha1, fp->sha1, SHA1_LEN);
+
+	if (ret)
+		return ret;
+	if (disk != fp->disk)
+		return disk < fp->disk ? -1 : 1;
+	return 0;
+}
+
+/* Return true if the fingerprint is new */
+static bool fingerprint_insert(const unsigned char *sha1, uint64_t disk)
+{
+	struct rb_node **p = &fingerprints.rb_node, *parent = NULL;
+	struct fingerprint *fp;
+	int cmp;
+
+	while (*p) {
+		parent = *p;
+		fp = rb_entry(parent, struct fingerprint, rb);
+		cmp = fingerprint_cmp(sha1, disk, fp);
+		if (cmp < 0)
+			p = &(*p)->rb_left;
+		else if (cmp > 0)
+			p = &(*p)->rb_right;
+		else
+			return false;
+	}
+
+	fp = xmalloc(sizeof(*fp));
+	memcpy(fp->sha1, sha1, SHA1_LEN);
+	fp->disk = disk;
+	rb_link_node(&fp->rb, parent, p);
+	rb_insert_color(&fp->rb, &fingerprints);
+	return true;
+}
+
+static void fingerprints_free(void)
+{
+	struct rb_node *n;
+
+	while ((n = rb_first(&fingerprints))) {
+		rb_erase(n, &fingerprints);
+		free(rb_entry(n, struct fingerprint, rb));
+	}
+}
+
+/* Index the files of .dedup/ on the disk wd, removing the unused ones */
+static int index_dedup_dir(char *wd)
+{
+	uint64_t disk = disk_id(wd);
+	unsigned char sha1[SHA1_LEN];
+	char dir[PATH_MAX], path[PATH_MAX], hex[HEX_LEN + 1];
+	struct dirent *d;
+	struct stat st;
+	DIR *dp;
+	int i;
+
+	for (i = 0; i < 256; i++) {
+		snprintf(dir, sizeof(dir), "%s/" DEDUP_DIR "/%02x", wd, i);
+		dp = opendir(dir);
+		if (!dp)
+			continue;
+
+		while ((d = readdir(dp))) {
+			if (strlen(d->d_name) != HEX_LEN - 2)
+				continue;
+			snprintf(hex, sizeof(hex), "%02x%.*s", i, HEX_LEN - 2,
+				 d->d_name);
+			snprintf(path, sizeof(path), "%s/" DEDUP_DIR "/%02x/%s",
+				 wd, i, d->d_name);
+			if (get_sha1_hex(hex, sha1) < 0 || stat(path, &st) < 0)
+				continue;
+
+			if (st.st_nlink > 1) {
+				fingerprint_insert(sha1, disk);
+				nr_files++;
+			} else if (unlink(path) == 0)
+				nr_freed++;
+		}
+		closedir(dp);
+	}
+
+	return SD_RES_SUCCESS;
+}
+
+static int dedup_cold_object(uint64_t oid, char *wd, void *arg)
+{
+	uint16_t policy = get_vdi_copy_policy(oid_to_vid(oid));
+	char path[PATH_MAX], dedup_path[PATH_MAX];
+	unsigned char sha1[SHA1_LEN];
+	struct sha1_ctx ctx;
+	struct stat st;
+	bool found;
+	int fd;
+
+	/* the strips of erasure coded objects differ on every node */
+	if (!is_data_obj(oid) || (policy & SD_COPY_POLICY_EC_MASK))
+		return SD_RES_SUCCESS;
+
+	/* shared already, or compressed */
+	snprintf(path, sizeof(path), "%s/%016"PRIx64, wd, oid);
+	if (stat(path, &st) < 0 || st.st_nlink > 1 ||
+	    st.st_size != SD_DATA_OBJ_SIZE ||
+	    st.st_mtime + sys->dedup_age > pass_start)
+		return SD_RES_SUCCESS;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return SD_RES_SUCCESS;
+	if (xpread(fd, pass_buf, st.st_size, 0) != st.st_size) {
+		sd_eprintf("failed to read %s, %m", path);
+		close(fd);
+		return SD_RES_SUCCESS;
+	}
+	/* don't make the reads of the rest suffer from this scan */
+	posix_fadvise(fd, 0, st.st_size, POSIX_FADV_DONTNEED);
+	close(fd);
+
+	sha1_init(&ctx);
+	sha1_update(&ctx, pass_buf, st.st_size);
+	sha1_final(&ctx, sha1);
+
+	snprintf(path, sizeof(path), "%s/" DEDUP_DIR, wd);
+	sha1_path_in(path, sha1, dedup_path);
+	found = !fingerprint_insert(sha1, disk_id(wd));
+	if (!found) {
+		/* the fanout directory of the sha1 */
+		dedup_path[strlen(path) + 3] = '\0';
+		if (xmkdir(path, def_dmode) < 0 ||
+		    xmkdir(dedup_path, def_dmode) < 0) {
+			sd_eprintf("failed to create %s, %m", dedup_path);
+			return SD_RES_EIO;
+		}
+		dedup_path[strlen(path) + 3] = '/';
+	}
+
+	snprintf(path, sizeof(path), "%s/%016"PRIx64, wd, oid);
+	if (share_object(oid, path, &st, dedup_path, pass_buf) !=
+	    SD_RES_SUCCESS)
+		return SD_RES_SUCCESS;
+
+	if (found) {
+		nr_shared++;
+		sd_dprintf("%"PRIx64" shares %s", oid, sha1_to_hex(sha1));
+	} else
+		nr_new++;
+
+	return SD_RES_SUCCESS;
+}
+
+int farm_dedup(void)
+{
+	int ret;
+
+	pass_buf = valloc(SD_DATA_OBJ_SIZE);
+	if (!pass_buf)
+		return SD_RES_NO_MEM;
+
+	pass_start = time(NULL);
+	nr_files = nr_freed = nr_new = nr_shared = 0;
+	for_each_obj_path(index_dedup_dir);
+	ret = for_each_object_in_wd(dedup_cold_object, false, NULL);
+
+	sd_dprintf("%"PRIu64" shared files, %"PRIu64" added, %"PRIu64" freed, "
+		   "%"PRIu64" objects newly shared", nr_files + nr_new, nr_new,
+		   nr_freed, nr_shared);
+	fingerprints_free();
+	free(pass_buf);
+	return ret;
+}
+
+/*
+ * The deduplicator runs the dedup operation of the store now and then, like
+ * the compressor does.
+ */
+static struct timer dedup_timer;
+static struct work dedup_work;
+static bool dedup_running;
+
+static inline unsigned int dedup_interval(void)
+{
+	uint32_t interval = max(sys->dedup_age / 2, 1U);
+
+	return min(interval, (uint32_t)DEDUP_MAX_INTERVAL);
+}
+
+static void do_dedup(struct work *work)
+{
+	int ret = sd_store->dedup();
+
+	if (ret != SD_RES_SUCCESS)
+		sd_eprintf("failed to dedup objects, %s", sd_strerror(ret));
+}
+
+static void dedup_done(struct work *work)
+{
+	dedup_running = false;
+}
+
+static void dedup_timer_fn(void *data)
+{
+	/* objects are moved around in recovery, leave them alone */
+	if (!dedup_running && !node_in_recovery() && sd_store &&
+	    sd_store->dedup) {
+		dedup_running = true;
+		queue_work(sys->dedup_wqueue, &dedup_work);
+	}
+
+	add_timer(&dedup_timer, dedup_interval() * 1000);
+}
+
+int init_deduplicator(void)
+{
+	dedup_work.fn = do_dedup;
+	dedup_work.done = dedup_done;
+	dedup_timer.callback = dedup_timer_fn;
+	add_timer(&dedup_timer, dedup_interval() * 1000);
+
+	sd_iprintf("dedup objects not written for %" PRIu32 " seconds",
+		   sys->dedup_age);
+	return 0;
+}
@@ -64,6 +64,70 @@ err:
 	return ret;
 }
 
+/*
+ * The work on the entries of a trunk is spread over a pool of threads, one per
+ * CPU, which take them FARM_BATCH at a time so that they don't contend for the
+ * next one.
+ */
+#define FARM_BATCH		32
+#define FARM_MAX_WORKERS	16
+
+struct parallel_arg {
+	int (*fn)(uint64_t, void *);
+	void *arg;
+	uint64_t nr;
+	/* the next entry to work on */
+	uint64_t next;
+	bool failed;
+};
+
+static void *farm_parallel_main(void *arg)
+{
+	struct parallel_arg *pa = arg;
+	uint64_t i, end;
+
+	while (!uatomic_read(&pa->failed)) {
+		i = uatomic_add_return(&pa->next, FARM_BATCH) - FARM_BATCH;
+		if (i >= pa->nr)
+			break;
+
+		end = min(i + FARM_BATCH, pa->nr);
+		for (; i < end; i++)
+			if (pa->fn(i, pa->arg) < 0) {
+				uatomic_set(&pa->failed, true);
+				break;
+			}
+	}
+
+	return NULL;
+}
+
+/* Call fn(i, arg) for every i below nr, return -1 if any of them fails */
+int farm_parallel(uint64_t nr, int (*fn)(uint64_t, void *), void *arg)
+{
+	struct parallel_arg pa = { fn, arg, nr, 0, false };
+	pthread_t threads[FARM_MAX_WORKERS];
+	bool started[FARM_MAX_WORKERS] = { false };
+	long nr_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	int i, nr_workers;
+
+	nr_workers = max(nr_cpus, 1L);
+	nr_workers = min(nr_workers, FARM_MAX_WORKERS);
+	nr_workers = min((uint64_t)nr_workers, DIV_ROUND_UP(nr, FARM_BATCH));
+	for (i = 0; i < nr_workers; i++) {
+		if (pthread_create(threads + i, NULL, farm_parallel_main, &pa)) {
+			sd_eprintf("failed to create a thread, %m");
+			farm_parallel_main(&pa);
+		} else
+			started[i] = true;
+	}
+	for (i = 0; i < nr_workers; i++)
+		if (started[i])
+			pthread_join(threads[i], NULL);
+
+	return pa.failed ? -1 : 0;
+}
+
 static int get_trunk_sha1(uint32_t epoch, unsigned char *outsha1)
 {
 	int i, nr_logs = -1, ret = -1;
@@ -106,6 +170,9 @@ static int farm_init(void)
 	if (snap_init() < 0)
 		goto err;
 
+	if (trunk_init() < 0)
+		goto err;
+
 	if (default_init() < 0)
 		goto err;
 
@@ -150,48 +217,82 @@ out:
 	return ret;
 }
 
+struct restore_arg {
+	struct trunk_entry *entries;
+	struct vnode_info *vinfo;
+};
+
+/* Write the object back from the mapped sha1 file */
+static int restore_object(uint64_t i, void *arg)
+{
+	struct restore_arg *ra = arg;
+	struct trunk_entry *entry = ra->entries + i;
+	uint64_t oid = entry->oid;
+	struct sha1_file_hdr h;
+	struct siocb io = { 0 };
+	void *map, *buf = NULL;
+	int ret;
+
+	map = sha1_file_map(entry->sha1, &h);
+	if (!map) {
+		sd_eprintf("oid %"PRIx64" not restored", oid);
+		return -1;
+	}
+
+	io.length = h.size;
+	io.buf = map;
+	/* direct I/O can't write from the payload after the header */
+	if (sys->backend_dio && is_data_obj(oid)) {
+		buf = valloc(max(h.size, 1UL));
+		if (!buf) {
+			sd_eprintf("oid %"PRIx64" not restored, %m", oid);
+			sha1_file_unmap(map, &h);
+			return -1;
+		}
+		memcpy(buf, map, h.size);
+		io.buf = buf;
+	}
+	/* compressed objects are saved as they are stored */
+	if (is_data_obj(oid) && h.size < get_store_objsize(oid))
+		io.flags = SD_FLAG_CMD_COMPRESS;
+	io.ec_index = get_local_ec_index(ra->vinfo, oid);
+	ret = default_create_and_write(oid, &io);
+	sha1_file_unmap(map, &h);
+	free(buf);
+	if (ret != SD_RES_SUCCESS) {
+		sd_eprintf("oid %"PRIx64" not restored", oid);
+		return -1;
+	}
+
+	sd_dprintf("oid %"PRIx64" restored", oid);
+	return 0;
+}
+
 static int restore_objects_from_snap(uint32_t epoch)
 {
 	struct sha1_file_hdr hdr;
-	struct trunk_entry *trunk_buf, *trunk_free = NULL;
+	struct restore_arg ra = { NULL, NULL };
 	unsigned char trunk_sha1[SHA1_LEN];
-	uint64_t nr_trunks, i;
 	int ret = SD_RES_EIO;
 
 	if (get_trunk_sha1(epoch, trunk_sha1) < 0)
 		goto out;
 
-	trunk_free = trunk_buf = trunk_file_read(trunk_sha1, &hdr);
-	if (!trunk_buf)
+	/* the strips of erasure coded objects belong to the current nodes */
+	ra.vinfo = get_vnode_info_epoch(sys_epoch());
+	if (!ra.vinfo)
 		goto out;
 
-	nr_trunks = hdr.priv;
-	ret = SD_RES_SUCCESS;
-	for (i = 0; i < nr_trunks; i++, trunk_buf++) {
-		struct sha1_file_hdr h;
-		struct siocb io = { 0 };
-		uint64_t oid;
-		void *buffer = NULL;
-
-		oid = trunk_buf->oid;
-		buffer = sha1_file_read(trunk_buf->sha1, &h);
-		if (!buffer) {
-			sd_eprintf("oid %"PRIx64" not restored", oid);
-			goto out;
-		}
-		io.length = h.size;
-		io.buf = buffer;
-		ret = default_create_and_write(oid, &io);
-		if (ret != SD_RES_SUCCESS) {
-			sd_eprintf("oid %"PRIx64" not restored", oid);
-			goto out;
-		} else
-			sd_dprintf("oid %"PRIx64" restored", oid);
+	ra.entries = trunk_file_read(trunk_sha1, &hdr);
+	if (!ra.entries)
+		goto out;
 
-		free(buffer);
-	}
+	if (farm_parallel(hdr.priv, restore_object, &ra) == 0)
+		ret = SD_RES_SUCCESS;
 out:
-	free(trunk_free);
+	if (ra.vinfo)
+		put_vnode_info(ra.vinfo);
+	free(ra.entries);
 	return ret;
 }
 
@@ -218,6 +319,8 @@ static int farm_restore(const struct siocb *iocb)
 
 	sd_dprintf("try recover user epoch %d", epoch);
 
+	trunk_reset();
+
 	/* Remove all the objects of WD and object cache */
 	for_each_object_in_wd(rm_object, true, NULL);
 	if (sys->enable_object_cache)
@@ -250,14 +353,52 @@ out:
 	return ret;
 }
 
+/*
+ * The changes of the objects are tracked for the next snapshot, after they are
+ * done so that a snapshot racing with them doesn't miss them.
+ */
+static int farm_create_and_write(uint64_t oid, const struct siocb *iocb)
+{
+	int ret = default_create_and_write(oid, iocb);
+
+	trunk_mark_dirty(oid);
+	return ret;
+}
+
+static int farm_write(uint64_t oid, const struct siocb *iocb)
+{
+	int ret = default_write(oid, iocb);
+
+	trunk_mark_dirty(oid);
+	return ret;
+}
+
+static int farm_discard(uint64_t oid, const struct siocb *iocb)
+{
+	int ret = default_discard(oid, iocb);
+
+	trunk_mark_dirty(oid);
+	return ret;
+}
+
+static int farm_link(uint64_t oid, uint32_t tgt_epoch)
+{
+	int ret = default_link(oid, tgt_epoch);
+
+	trunk_mark_dirty(oid);
+	return ret;
+}
+
 static struct store_driver farm = {
 	.name = "farm",
 	.init = farm_init,
 	.exist = default_exist,
-	.create_and_write = default_create_and_write,
-	.write = default_write,
+	.create_and_write = farm_create_and_write,
+	.write = farm_write,
+	.discard = farm_discard,
 	.read = default_read,
-	.link = default_link,
+	.read_stale = default_read_stale,
+	.link = farm_link,
 	.end_recover = default_end_recover,
 	.snapshot = farm_snapshot,
 	.cleanup = default_cleanup,
@@ -265,7 +406,12 @@ static struct store_driver farm = {
 	.get_snap_file = farm_get_snap_file,
 	.format = default_format,
 	.purge_obj = default_purge_obj,
+	.shutdown = default_shutdown,
 	.remove_object = default_remove_object,
+	.read_compressed = default_read_compressed,
+	.compress = default_compress,
+	.get_ec_index = default_get_ec_index,
+	.dedup = farm_dedup,
 };
 
 add_store_driver(farm);
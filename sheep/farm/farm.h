@@ -42,11 +42,15 @@ struct trunk_entry {
 /* farm.c */
 extern char farm_dir[PATH_MAX];
 extern char farm_obj_dir[PATH_MAX];
+int farm_parallel(uint64_t nr, int (*fn)(uint64_t, void *), void *arg);
 
 /* sha1_file.c */
+void sha1_path_in(const char *dir, const unsigned char *sha1, char *buf);
 char *sha1_to_path(const unsigned char *sha1);
 int sha1_file_write(unsigned char *buf, unsigned len, unsigned char *);
 void *sha1_file_read(const unsigned char *sha1, struct sha1_file_hdr *);
+void *sha1_file_map(const unsigned char *sha1, struct sha1_file_hdr *);
+void sha1_file_unmap(void *buf, const struct sha1_file_hdr *);
 char *sha1_to_hex(const unsigned char *sha1);
 int get_sha1_hex(const char *hex, unsigned char *sha1);
 int sha1_file_try_delete(const unsigned char *sha1);
@@ -55,6 +59,11 @@ int sha1_file_try_delete(const unsigned char *sha1);
 int trunk_init(void);
 int trunk_file_write(unsigned char *outsha1);
 void *trunk_file_read(unsigned char *sha1, struct sha1_file_hdr *);
+void trunk_mark_dirty(uint64_t oid);
+void trunk_reset(void);
+
+/* dedup.c */
+int farm_dedup(void);
 
 /* snap.c */
 int snap_init(void);
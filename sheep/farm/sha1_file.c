@@ -45,22 +45,24 @@ static void fill_sha1_path(char *pathbuf, const unsigned char *sha1)
 	}
 }
 
-char *sha1_to_path(const unsigned char *sha1)
+/* Store the path of the file named after sha1 under dir into buf */
+void sha1_path_in(const char *dir, const unsigned char *sha1, char *buf)
 {
-
-	static char buf[PATH_MAX];
-	const char *objdir;
-	int len;
-
-	objdir = get_object_directory();
-	len = strlen(objdir);
+	int len = strlen(dir);
 
 	/* '/' + sha1(2) + '/' + sha1(38) + '\0' */
-	memcpy(buf, objdir, len);
+	memcpy(buf, dir, len);
 	buf[len] = '/';
 	buf[len+3] = '/';
 	buf[len+42] = '\0';
 	fill_sha1_path(buf + len + 1, sha1);
+}
+
+char *sha1_to_path(const unsigned char *sha1)
+{
+	static __thread char buf[PATH_MAX];
+
+	sha1_path_in(get_object_directory(), sha1, buf);
 	return buf;
 }
 
@@ -176,23 +178,6 @@ static void *map_sha1_file(const unsigned char *sha1, unsigned long *size)
 	return map;
 }
 
-static void *unpack_sha1_file(void *map, unsigned long mapsize, struct sha1_file_hdr *hdr)
-{
-	int hdr_len;
-	char *buf;
-
-	memcpy(hdr, map, sizeof(*hdr));
-	hdr_len = sizeof(*hdr);
-	buf = valloc(hdr->size);
-	if (!buf) {
-		sd_dprintf("%m");
-		return NULL;
-	}
-
-	memcpy(buf, (char *)map + hdr_len, mapsize - hdr_len);
-	return buf;
-}
-
 static int verify_sha1_file(const unsigned char *sha1, void *buf, unsigned long len)
 {
 	unsigned char tmp[SHA1_LEN];
@@ -210,22 +195,57 @@ static int verify_sha1_file(const unsigned char *sha1, void *buf, unsigned long
 	return 0;
 }
 
-void *sha1_file_read(const unsigned char *sha1, struct sha1_file_hdr *hdr)
+/*
+ * Map the verified sha1 file and return its payload, which stays valid until
+ * sha1_file_unmap()
+ */
+void *sha1_file_map(const unsigned char *sha1, struct sha1_file_hdr *hdr)
 {
 	unsigned long mapsize;
-	void *map, *buf;
+	void *map;
 
 	map = map_sha1_file(sha1, &mapsize);
-	if (map) {
-		if (verify_sha1_file(sha1, map, mapsize) < 0)
-			return NULL;
-		buf = unpack_sha1_file(map, mapsize, hdr);
-		munmap(map, mapsize);
-		return buf;
+	if (!map)
+		return NULL;
+
+	madvise(map, mapsize, MADV_SEQUENTIAL);
+	if (mapsize < sizeof(*hdr) ||
+	    verify_sha1_file(sha1, map, mapsize) < 0)
+		goto err;
+	memcpy(hdr, map, sizeof(*hdr));
+	if (hdr->size != mapsize - sizeof(*hdr)) {
+		sd_dprintf("bad size of %s", sha1_to_hex(sha1));
+		goto err;
 	}
+
+	return (char *)map + sizeof(*hdr);
+err:
+	munmap(map, mapsize);
 	return NULL;
 }
 
+void sha1_file_unmap(void *buf, const struct sha1_file_hdr *hdr)
+{
+	munmap((char *)buf - sizeof(*hdr), hdr->size + sizeof(*hdr));
+}
+
+void *sha1_file_read(const unsigned char *sha1, struct sha1_file_hdr *hdr)
+{
+	void *map, *buf;
+
+	map = sha1_file_map(sha1, hdr);
+	if (!map)
+		return NULL;
+
+	buf = valloc(max(hdr->size, 1UL));
+	if (buf)
+		memcpy(buf, map, hdr->size);
+	else
+		sd_dprintf("%m");
+	sha1_file_unmap(map, hdr);
+	return buf;
+}
+
 int sha1_file_try_delete(const unsigned char *sha1)
 {
 	char *filename = sha1_to_path(sha1);
@@ -259,7 +279,7 @@ int get_sha1_hex(const char *hex, unsigned char *sha1)
 
 char *sha1_to_hex(const unsigned char *sha1)
 {
-	static char buffer[50];
+	static __thread char buffer[50];
 	static const char hex[] = "0123456789abcdef";
 	char *buf = buffer;
 	int i;
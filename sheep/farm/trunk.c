@@ -24,9 +24,137 @@
 #include "strbuf.h"
 #include "list.h"
 #include "util.h"
+#include "rbtree.h"
 #include "sheepdog_proto.h"
 #include "sheep_priv.h"
 
+/*
+ * The objects changed since the last trunk taken by this sheep.  The next
+ * trunk takes the sha1 of the others from the last one, so only the changed
+ * objects are hashed again.  The changes are tracked from the first snapshot
+ * on; the changes made before are unknown, so the first trunk is full.
+ */
+#define DIRTY_SHARDS 16
+
+struct dirty_obj {
+	struct rb_node rb;
+	uint64_t oid;
+};
+
+struct dirty_shard {
+	pthread_mutex_t lock;
+	struct rb_root root;
+};
+
+static struct dirty_shard dirty_objs[DIRTY_SHARDS];
+static bool tracking;
+static bool has_last_trunk;
+static unsigned char last_trunk_sha1[SHA1_LEN];
+
+static inline int oid_to_dirty_shard(uint64_t oid)
+{
+	return fnv_64a_buf(&oid, sizeof(oid), FNV1A_64_INIT) % DIRTY_SHARDS;
+}
+
+static struct dirty_obj *dirty_lookup(struct rb_root *root, uint64_t oid)
+{
+	struct rb_node *n = root->rb_node;
+	struct dirty_obj *entry;
+
+	while (n) {
+		entry = rb_entry(n, struct dirty_obj, rb);
+		if (oid < entry->oid)
+			n = n->rb_left;
+		else if (oid > entry->oid)
+			n = n->rb_right;
+		else
+			return entry;
+	}
+
+	return NULL;
+}
+
+static void dirty_insert(struct rb_root *root, uint64_t oid)
+{
+	struct rb_node **p = &root->rb_node, *parent = NULL;
+	struct dirty_obj *entry, *new;
+
+	while (*p) {
+		parent = *p;
+		entry = rb_entry(parent, struct dirty_obj, rb);
+		if (oid < entry->oid)
+			p = &(*p)->rb_left;
+		else if (oid > entry->oid)
+			p = &(*p)->rb_right;
+		else
+			return;
+	}
+
+	new = xmalloc(sizeof(*new));
+	new->oid = oid;
+	rb_link_node(&new->rb, parent, p);
+	rb_insert_color(&new->rb, root);
+}
+
+static void dirty_free(struct rb_root *root)
+{
+	struct rb_node *n, *next;
+
+	for (n = rb_first(root); n; n = next) {
+		next = rb_next(n);
+		rb_erase(n, root);
+		free(rb_entry(n, struct dirty_obj, rb));
+	}
+}
+
+/* Record that the content of the object has changed */
+void trunk_mark_dirty(uint64_t oid)
+{
+	struct dirty_shard *shard = dirty_objs + oid_to_dirty_shard(oid);
+
+	if (!uatomic_read(&tracking))
+		return;
+
+	pthread_mutex_lock(&shard->lock);
+	dirty_insert(&shard->root, oid);
+	pthread_mutex_unlock(&shard->lock);
+}
+
+/* Forget the last trunk, the next one is taken from scratch */
+void trunk_reset(void)
+{
+	has_last_trunk = false;
+}
+
+/*
+ * Move the objects changed so far to roots[], the ones changed from now on
+ * are hashed by the next snapshot.
+ */
+static void take_dirty_objs(struct rb_root *roots)
+{
+	int i;
+
+	uatomic_set(&tracking, true);
+	for (i = 0; i < DIRTY_SHARDS; i++) {
+		pthread_mutex_lock(&dirty_objs[i].lock);
+		roots[i] = dirty_objs[i].root;
+		dirty_objs[i].root = RB_ROOT;
+		pthread_mutex_unlock(&dirty_objs[i].lock);
+	}
+}
+
+int trunk_init(void)
+{
+	int i;
+
+	for (i = 0; i < DIRTY_SHARDS; i++) {
+		pthread_mutex_init(&dirty_objs[i].lock, NULL);
+		dirty_objs[i].root = RB_ROOT;
+	}
+
+	return 0;
+}
+
 static int fill_entry_new_sha1(struct trunk_entry *entry)
 {
 	struct strbuf buf = STRBUF_INIT;
@@ -64,61 +192,160 @@ out:
 	return ret;
 }
 
-static int inc_object_nr(uint64_t oid, char *wd, void *arg)
+/*
+ * The snapshot of the objects is taken in parallel.  Every disk is scanned by
+ * a thread of its own, and the objects found are then read, hashed and saved
+ * by the workers of farm_parallel().
+ */
+struct trunk_scan {
+	pthread_mutex_t lock;
+	struct trunk_entry *entries;
+	uint64_t nr_entries;
+	uint64_t alloc;
+	/* the indexes of the entries to hash */
+	uint64_t *todo;
+	uint64_t nr_todo;
+};
+
+static int add_trunk_entry(uint64_t oid, char *path, void *arg)
 {
-	uint64_t *object_nr = arg;
+	struct trunk_scan *ts = arg;
 
-	(*object_nr)++;
+	pthread_mutex_lock(&ts->lock);
+	if (ts->nr_entries == ts->alloc) {
+		ts->alloc = max(ts->alloc * 2, (uint64_t)1024);
+		ts->entries = xrealloc(ts->entries,
+				       sizeof(*ts->entries) * ts->alloc);
+	}
+	memset(ts->entries + ts->nr_entries, 0, sizeof(*ts->entries));
+	ts->entries[ts->nr_entries++].oid = oid;
+	pthread_mutex_unlock(&ts->lock);
 
 	return SD_RES_SUCCESS;
 }
 
-static int init_trunk_entry(uint64_t oid, char *path, void *arg)
+static int hash_todo_entry(uint64_t i, void *arg)
 {
-	struct trunk_entry entry = {};
-	struct strbuf *buf = arg;
+	struct trunk_scan *ts = arg;
 
-	entry.oid = oid;
-	if (fill_entry_new_sha1(&entry) < 0)
-		return SD_RES_UNKNOWN;
+	return fill_entry_new_sha1(ts->entries + ts->todo[i]);
+}
 
-	strbuf_add(buf, &entry, sizeof(struct trunk_entry));
-	return SD_RES_SUCCESS;
+static int hash_objects(struct trunk_scan *ts)
+{
+	int ret = farm_parallel(ts->nr_todo, hash_todo_entry, ts);
+
+	sd_dprintf("%"PRIu64" of %"PRIu64" objects hashed", ts->nr_todo,
+		   ts->nr_entries);
+	return ret;
+}
+
+static int trunk_entry_cmp(const void *a, const void *b)
+{
+	const struct trunk_entry *x = a, *y = b;
+
+	if (x->oid == y->oid)
+		return 0;
+	return x->oid < y->oid ? -1 : 1;
+}
+
+/*
+ * Take the sha1 of the objects unchanged since the last trunk from it, and
+ * queue the others to be hashed.
+ */
+static void reuse_last_trunk(struct trunk_scan *ts, struct rb_root *dirty)
+{
+	struct sha1_file_hdr hdr;
+	struct trunk_entry *last = NULL, *found, *entry;
+	uint64_t i, nr_last = 0;
+
+	ts->todo = xmalloc(sizeof(*ts->todo) * max(ts->nr_entries, 1UL));
+	if (has_last_trunk) {
+		last = trunk_file_read(last_trunk_sha1, &hdr);
+		if (last) {
+			nr_last = hdr.priv;
+			qsort(last, nr_last, sizeof(*last), trunk_entry_cmp);
+		} else
+			sd_eprintf("failed to read the last trunk");
+	}
+
+	for (i = 0; i < ts->nr_entries; i++) {
+		entry = ts->entries + i;
+		found = NULL;
+		if (!dirty_lookup(dirty + oid_to_dirty_shard(entry->oid),
+				  entry->oid))
+			found = bsearch(entry, last, nr_last, sizeof(*last),
+					 trunk_entry_cmp);
+		if (found)
+			memcpy(entry->sha1, found->sha1, SHA1_LEN);
+		else
+			ts->todo[ts->nr_todo++] = i;
+	}
+
+	free(last);
+}
+
+/* The trunk must not point to the objects lost in a crash */
+static void sync_farm_objects(void)
+{
+	int fd;
+
+	if (sys->nosync)
+		return;
+
+	fd = open(farm_obj_dir, O_RDONLY);
+	if (fd < 0 || syncfs(fd) < 0)
+		sd_eprintf("failed to sync %s, %m", farm_obj_dir);
+	if (fd >= 0)
+		close(fd);
 }
 
 int trunk_file_write(unsigned char *outsha1)
 {
-	struct strbuf buf;
+	struct trunk_scan ts = { .lock = PTHREAD_MUTEX_INITIALIZER };
 	struct sha1_file_hdr hdr = {};
-	uint64_t data_size, object_nr = 0;
-	int ret = 0;
+	struct strbuf buf = STRBUF_INIT;
+	struct rb_root dirty[DIRTY_SHARDS];
+	uint64_t data_size;
+	int ret, i;
 
-	/* Add the hdr first */
-	for_each_object_in_wd(inc_object_nr, false, &object_nr);
+	take_dirty_objs(dirty);
+	ret = for_each_object_in_wd_parallel(add_trunk_entry, false, &ts);
 	if (ret != SD_RES_SUCCESS) {
 		ret = -1;
 		goto out;
 	}
-	data_size = sizeof(struct trunk_entry) * object_nr;
-	hdr.size = data_size;
-	hdr.priv = object_nr;
-	memcpy(hdr.tag, TAG_TRUNK, TAG_LEN);
-	strbuf_init(&buf, sizeof(hdr) + data_size);
-	strbuf_add(&buf, &hdr, sizeof(hdr));
 
-	ret = for_each_object_in_wd(init_trunk_entry, false,  &buf);
-	if (ret != SD_RES_SUCCESS) {
+	reuse_last_trunk(&ts, dirty);
+	if (hash_objects(&ts) < 0) {
 		ret = -1;
 		goto out;
 	}
+	sync_farm_objects();
+
+	/* Add the hdr first */
+	data_size = sizeof(struct trunk_entry) * ts.nr_entries;
+	hdr.size = data_size;
+	hdr.priv = ts.nr_entries;
+	memcpy(hdr.tag, TAG_TRUNK, TAG_LEN);
+	strbuf_grow(&buf, sizeof(hdr) + data_size);
+	strbuf_add(&buf, &hdr, sizeof(hdr));
+	strbuf_add(&buf, ts.entries, data_size);
 
 	if (sha1_file_write((void *)buf.buf, buf.len, outsha1) < 0) {
 		ret = -1;
 		goto out;
 	}
 	sd_dprintf("trunk sha1: %s", sha1_to_hex(outsha1));
+	memcpy(last_trunk_sha1, outsha1, SHA1_LEN);
 out:
+	/* the changes in dirty[] are lost if the trunk isn't written */
+	has_last_trunk = ret == 0;
+	for (i = 0; i < DIRTY_SHARDS; i++)
+		dirty_free(dirty + i);
 	strbuf_release(&buf);
+	free(ts.entries);
+	free(ts.todo);
 	return ret;
 }
 
@@ -0,0 +1,330 @@
+/*
+ * Copyright (C) 2013 Taobao Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The object fd cache keeps the backend object files open across requests,
+ * so small I/Os don't pay for the path lookup, open() and close() each time.
+ *
+ *    0 fds are named by oid and open flags, so O_DIRECT and O_DSYNC opens of
+ *      the same object are cached separately.
+ *    1 cached fds are shared by all threads, each user holds a reference
+ *      between fd_cache_get/open() and fd_cache_put().
+ *    2 the least recently used idle fd is closed when the cache is full.  If
+ *      every fd is busy, the new one is simply not cached.
+ *    3 whoever unlinks, renames or moves an object file must drop its fds
+ *      with fd_cache_invalidate(), or all of them with fd_cache_purge().
+ *      Busy fds are closed by their last user.
+ *    4 an fd opened before an invalidation of its shard is not cached, so a
+ *      racing open never brings back the file that was just replaced.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+
+#include "sheep_priv.h"
+#include "list.h"
+#include "rbtree.h"
+
+#define FD_CACHE_SHARDS 16
+#define FD_CACHE_MAX 8192
+
+struct fd_cache_shard {
+	pthread_mutex_t lock;
+	struct rb_root root;
+	/* the least recently used first */
+	struct list_head lru;
+	int nr;
+	/* bumped by every invalidation */
+	uint64_t gen;
+};
+
+static struct fd_cache_shard fd_cache[FD_CACHE_SHARDS];
+static int fd_cache_shard_size;
+
+static inline struct fd_cache_shard *oid_to_shard(uint64_t oid)
+{
+	return fd_cache +
+		fnv_64a_buf(&oid, sizeof(oid), FNV1A_64_INIT) % FD_CACHE_SHARDS;
+}
+
+static int fd_cache_cmp(uint64_t oid, int flags, const struct obj_fd *entry)
+{
+	if (oid != entry->oid)
+		return oid < entry->oid ? -1 : 1;
+	if (flags != entry->flags)
+		return flags < entry->flags ? -1 : 1;
+	return 0;
+}
+
+static struct obj_fd *fd_cache_lookup(struct fd_cache_shard *shard,
+				      uint64_t oid, int flags)
+{
+	struct rb_node *n = shard->root.rb_node;
+	struct obj_fd *entry;
+	int cmp;
+
+	while (n) {
+		entry = rb_entry(n, struct obj_fd, rb);
+		cmp = fd_cache_cmp(oid, flags, entry);
+
+		if (cmp < 0)
+			n = n->rb_left;
+		else if (cmp > 0)
+			n = n->rb_right;
+		else
+			return entry;
+	}
+
+	return NULL;
+}
+
+/* Return the first entry of the object in the tree order */
+static struct obj_fd *fd_cache_first(struct fd_cache_shard *shard,
+				     uint64_t oid)
+{
+	struct rb_node *n = shard->root.rb_node;
+	struct obj_fd *entry, *first = NULL;
+
+	while (n) {
+		entry = rb_entry(n, struct obj_fd, rb);
+
+		if (oid <= entry->oid) {
+			if (oid == entry->oid)
+				first = entry;
+			n = n->rb_left;
+		} else
+			n = n->rb_right;
+	}
+
+	return first;
+}
+
+static struct obj_fd *fd_cache_insert(struct fd_cache_shard *shard,
+				      struct obj_fd *new)
+{
+	struct rb_node **p = &shard->root.rb_node;
+	struct rb_node *parent = NULL;
+	struct obj_fd *entry;
+	int cmp;
+
+	while (*p) {
+		parent = *p;
+		entry = rb_entry(parent, struct obj_fd, rb);
+		cmp = fd_cache_cmp(new->oid, new->flags, entry);
+
+		if (cmp < 0)
+			p = &(*p)->rb_left;
+		else if (cmp > 0)
+			p = &(*p)->rb_right;
+		else
+			return entry;
+	}
+	rb_link_node(&new->rb, parent, p);
+	rb_insert_color(&new->rb, &shard->root);
+	list_add_tail(&new->lru, &shard->lru);
+	new->cached = true;
+	shard->nr++;
+
+	return NULL;
+}
+
+/* Unlink the entry from the cache, return true if nobody uses it anymore */
+static bool fd_cache_unlink(struct fd_cache_shard *shard, struct obj_fd *entry)
+{
+	rb_erase(&entry->rb, &shard->root);
+	list_del(&entry->lru);
+	entry->cached = false;
+	shard->nr--;
+
+	return entry->refcnt == 0;
+}
+
+static void free_obj_fd(struct obj_fd *entry)
+{
+	close(entry->fd);
+	free(entry);
+}
+
+/* Return the cached fd of the object, or NULL if it is not open yet */
+struct obj_fd *fd_cache_get(uint64_t oid, int flags)
+{
+	struct fd_cache_shard *shard = oid_to_shard(oid);
+	struct obj_fd *entry;
+
+	if (!fd_cache_shard_size)
+		return NULL;
+
+	pthread_mutex_lock(&shard->lock);
+	entry = fd_cache_lookup(shard, oid, flags);
+	if (entry) {
+		entry->refcnt++;
+		list_move_tail(&entry->lru, &shard->lru);
+	}
+	pthread_mutex_unlock(&shard->lock);
+
+	return entry;
+}
+
+/* Open the object at 'path' and cache the fd, return NULL with errno set */
+struct obj_fd *fd_cache_open(uint64_t oid, const char *path, int flags)
+{
+	struct fd_cache_shard *shard = oid_to_shard(oid);
+	struct obj_fd *new, *entry, *victim = NULL;
+	struct stat st;
+	uint64_t gen;
+	int fd;
+
+	pthread_mutex_lock(&shard->lock);
+	gen = shard->gen;
+	pthread_mutex_unlock(&shard->lock);
+
+	fd = open(path, flags, def_fmode);
+	if (fd < 0)
+		return NULL;
+	if (fstat(fd, &st) < 0) {
+		int err = errno;
+
+		close(fd);
+		errno = err;
+		return NULL;
+	}
+
+	new = xzalloc(sizeof(*new));
+	new->oid = oid;
+	new->flags = flags;
+	new->fd = fd;
+	new->size = st.st_size;
+	new->nlink = st.st_nlink;
+	new->refcnt = 1;
+	INIT_LIST_HEAD(&new->lru);
+
+	if (!fd_cache_shard_size)
+		return new;
+
+	pthread_mutex_lock(&shard->lock);
+	if (gen != shard->gen)
+		goto out;
+
+	entry = fd_cache_lookup(shard, oid, flags);
+	if (entry) {
+		/* Somebody else has opened it meanwhile */
+		entry->refcnt++;
+		list_move_tail(&entry->lru, &shard->lru);
+		pthread_mutex_unlock(&shard->lock);
+		free_obj_fd(new);
+		return entry;
+	}
+
+	if (shard->nr >= fd_cache_shard_size) {
+		list_for_each_entry(entry, &shard->lru, lru) {
+			if (entry->refcnt)
+				continue;
+			fd_cache_unlink(shard, entry);
+			victim = entry;
+			break;
+		}
+		if (!victim)
+			goto out;
+	}
+	fd_cache_insert(shard, new);
+out:
+	pthread_mutex_unlock(&shard->lock);
+	if (victim)
+		free_obj_fd(victim);
+
+	return new;
+}
+
+void fd_cache_put(struct obj_fd *entry)
+{
+	struct fd_cache_shard *shard = oid_to_shard(entry->oid);
+	bool release;
+
+	pthread_mutex_lock(&shard->lock);
+	release = --entry->refcnt == 0 && !entry->cached;
+	pthread_mutex_unlock(&shard->lock);
+
+	if (release)
+		free_obj_fd(entry);
+}
+
+/* Drop all the cached fds of the object */
+void fd_cache_invalidate(uint64_t oid)
+{
+	struct fd_cache_shard *shard = oid_to_shard(oid);
+	struct obj_fd *entry, *n;
+	struct rb_node *next;
+	LIST_HEAD(victims);
+
+	if (!fd_cache_shard_size)
+		return;
+
+	pthread_mutex_lock(&shard->lock);
+	shard->gen++;
+	entry = fd_cache_first(shard, oid);
+	while (entry && entry->oid == oid) {
+		next = rb_next(&entry->rb);
+		if (fd_cache_unlink(shard, entry))
+			list_add(&entry->lru, &victims);
+		entry = next ? rb_entry(next, struct obj_fd, rb) : NULL;
+	}
+	pthread_mutex_unlock(&shard->lock);
+
+	list_for_each_entry_safe(entry, n, &victims, lru)
+		free_obj_fd(entry);
+}
+
+/* Drop every cached fd, for e.g, when the object paths change */
+void fd_cache_purge(void)
+{
+	struct fd_cache_shard *shard;
+	struct obj_fd *entry, *n;
+	LIST_HEAD(victims);
+	int i;
+
+	if (!fd_cache_shard_size)
+		return;
+
+	for (i = 0; i < FD_CACHE_SHARDS; i++) {
+		shard = fd_cache + i;
+		pthread_mutex_lock(&shard->lock);
+		shard->gen++;
+		list_for_each_entry_safe(entry, n, &shard->lru, lru)
+			if (fd_cache_unlink(shard, entry))
+				list_add(&entry->lru, &victims);
+		pthread_mutex_unlock(&shard->lock);
+	}
+
+	list_for_each_entry_safe(entry, n, &victims, lru)
+		free_obj_fd(entry);
+}
+
+/* Cache at most a quarter of the allowed open files */
+void fd_cache_init(void)
+{
+	struct rlimit r;
+	uint64_t max = FD_CACHE_MAX;
+	int i;
+
+	for (i = 0; i < FD_CACHE_SHARDS; i++) {
+		pthread_mutex_init(&fd_cache[i].lock, NULL);
+		fd_cache[i].root = RB_ROOT;
+		INIT_LIST_HEAD(&fd_cache[i].lru);
+	}
+
+	if (getrlimit(RLIMIT_NOFILE, &r) == 0 && r.rlim_cur / 4 < max)
+		max = r.rlim_cur / 4;
+	fd_cache_shard_size = max / FD_CACHE_SHARDS;
+	sd_dprintf("cache %d object fds", fd_cache_shard_size * FD_CACHE_SHARDS);
+}
@@ -10,9 +10,13 @@
  * along with this program. If not, see <http://www.gnu.org/licenses/>.
  */
 #include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <poll.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/eventfd.h>
 
 #include "sheep_priv.h"
 
@@ -23,36 +27,548 @@ static inline void gateway_init_fwd_hdr(struct sd_req *fwd, struct sd_req *hdr)
 	fwd->proto_ver = SD_SHEEP_PROTO_VER;
 }
 
+static void gateway_untrim_rsp(struct request *req)
+{
+	if (req->rq.proto_ver < SD_PROTO_VER_TRIM_ZERO_SECTORS) {
+		/* the client doesn't support trimming zero bytes */
+		untrim_zero_sectors(req->data, req->rp.obj.offset,
+				    req->rp.data_length, req->rq.data_length);
+		req->rp.data_length = req->rq.data_length;
+		req->rp.obj.offset = 0;
+	}
+}
+
+/*
+ * Read routing and hedged reads
+ *
+ * A slow disk or a stalled peer shows up directly in the latency of the reads
+ * it serves.  So we keep the moving average of the read latency of each peer,
+ * and the number of requests it was serving when it last answered, which the
+ * peers piggyback on the read responses.  Remote replicas are tried in the
+ * order of their expected cost, those in our zone first as crossing zones
+ * costs twice as much, and with '-H pct=N' a read that takes longer than the
+ * N'th percentile of the recent remote reads is sent to the next replica as
+ * well.  The first answer wins.
+ *
+ * Without multiplexing, the connection of a losing read is closed because its
+ * response is still on the way.  With it, each read gets its own buffer that
+ * the receiver thread may fill after we are gone, and the winner is copied.
+ */
+#define NR_LATENCY_BUCKETS 256
+/* don't hedge until we know the latency this well */
+#define HEDGE_MIN_SAMPLES 128
+/* halve the histogram every this many reads to follow the recent ones */
+#define HEDGE_DECAY_SAMPLES 8192
+/* one read in this many ignores the cost to keep measuring all the peers */
+#define READ_EXPLORE 16
+#define READ_CROSS_ZONE_COST 2
+#define READ_LOAD_SCALE 4
+
+struct peer_latency {
+	struct rb_node rb;
+	struct node_id nid;
+	uint64_t avg; /* usec, 0 if unknown */
+	uint32_t load; /* requests that the peer was serving */
+};
+
+/* peer_latency entries are never freed, like the mux entries */
+static struct rb_root peer_latency_root = RB_ROOT;
+static uint64_t read_latency[NR_LATENCY_BUCKETS];
+static uint64_t nr_read_latency;
+static uint64_t hedge_delay; /* usec, 0 for no hedging */
+static pthread_mutex_t hedge_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Must be called with hedge_lock held */
+static uint64_t read_latency_percentile(uint32_t pct)
+{
+	uint64_t target = nr_read_latency * pct / 100, sum = 0;
+	int b;
+
+	for (b = 0; b < NR_LATENCY_BUCKETS - 1; b++) {
+		sum += read_latency[b];
+		if (sum > target)
+			break;
+	}
+
+	return bucket_to_latency(b + 1);
+}
+
+/* Must be called with hedge_lock held */
+static struct peer_latency *peer_latency_get(const struct node_id *nid)
+{
+	struct rb_node **p = &peer_latency_root.rb_node;
+	struct rb_node *parent = NULL;
+	struct peer_latency *pl;
+	int cmp;
+
+	while (*p) {
+		parent = *p;
+		pl = rb_entry(parent, struct peer_latency, rb);
+		cmp = node_id_cmp(nid, &pl->nid);
+		if (cmp < 0)
+			p = &(*p)->rb_left;
+		else if (cmp > 0)
+			p = &(*p)->rb_right;
+		else
+			return pl;
+	}
+
+	pl = xzalloc(sizeof(*pl));
+	pl->nid = *nid;
+	rb_link_node(&pl->rb, parent, p);
+	rb_insert_color(&pl->rb, &peer_latency_root);
+
+	return pl;
+}
+
+/*
+ * Account the read from 'nid' sent at 'start' and answered with 'rsp'.  A read
+ * that lost the race has no response yet, so its latency only counts against
+ * the peer.
+ */
+static void account_read_latency(const struct node_id *nid, uint64_t start,
+				 const struct sd_rsp *rsp)
+{
+	uint64_t us = get_usec_time() - start;
+	struct peer_latency *pl;
+	int b;
+
+	pthread_mutex_lock(&hedge_lock);
+	pl = peer_latency_get(nid);
+	pl->avg = pl->avg ? (pl->avg * 7 + us) / 8 : us;
+	if (!rsp)
+		goto out;
+
+	pl->load = rsp->obj.load;
+
+	read_latency[latency_to_bucket(us)]++;
+	if (++nr_read_latency >= HEDGE_DECAY_SAMPLES) {
+		nr_read_latency = 0;
+		for (b = 0; b < NR_LATENCY_BUCKETS; b++) {
+			read_latency[b] /= 2;
+			nr_read_latency += read_latency[b];
+		}
+	}
+	if (sys->hedge_percentile && nr_read_latency >= HEDGE_MIN_SAMPLES) {
+		us = read_latency_percentile(sys->hedge_percentile);
+		hedge_delay = max(us, (uint64_t)sys->hedge_min_delay);
+	}
+out:
+	pthread_mutex_unlock(&hedge_lock);
+}
+
+/*
+ * The expected cost of reading from the replica, which is the latency of the
+ * peer scaled by its load, twice when it serves READ_LOAD_SCALE requests.
+ * Unknown peers cost nothing so that they get measured soon.  Must be called
+ * with hedge_lock held.
+ */
+static uint64_t read_cost(const struct sd_vnode *v)
+{
+	const struct peer_latency *pl = peer_latency_get(&v->nid);
+	uint64_t cost = pl->avg * (READ_LOAD_SCALE + pl->load);
+
+	if (v->zone != sys->this_node.zone)
+		cost *= READ_CROSS_ZONE_COST;
+
+	return cost;
+}
+
+/*
+ * Fill 'nids' with the remote replicas in the order to try, the cheapest
+ * first, and return the number of them.
+ */
+static int order_remote_replicas(const struct sd_vnode **obj_vnodes,
+				 int nr_copies, const struct node_id **nids)
+{
+	uint64_t costs[SD_MAX_COPIES], cost;
+	const struct sd_vnode *v;
+	int i, k, nr = 0, j = random();
+	bool explore = random() % READ_EXPLORE == 0;
+
+	/* start from a random copy so that the equal ones share the load */
+	pthread_mutex_lock(&hedge_lock);
+	for (i = 0; i < nr_copies; i++) {
+		v = obj_vnodes[(i + j) % nr_copies];
+		if (vnode_is_local(v))
+			continue;
+
+		cost = explore ? 0 : read_cost(v);
+		for (k = nr; k > 0 && costs[k - 1] > cost; k--) {
+			costs[k] = costs[k - 1];
+			nids[k] = nids[k - 1];
+		}
+		costs[k] = cost;
+		nids[k] = &v->nid;
+		nr++;
+	}
+	pthread_mutex_unlock(&hedge_lock);
+
+	return nr;
+}
+
+static inline bool hedge_due(uint64_t sent, uint64_t delay)
+{
+	return get_usec_time() - sent >= delay;
+}
+
+static int hedged_read_sockfd(struct request *req, const struct node_id **nids,
+			      int nr, uint64_t delay)
+{
+	struct sockfd *sfds[SD_MAX_COPIES] = {};
+	struct pollfd pfds[SD_MAX_COPIES];
+	uint64_t start[SD_MAX_COPIES], elapsed;
+	int idx[SD_MAX_COPIES], i, j, next = 0, nr_pending = 0, nr_polled,
+	    ret = SD_RES_NETWORK_ERROR, repeat = MAX_RETRY_COUNT, pollret;
+	uint32_t epoch = req->rq.epoch;
+	bool done = false;
+	struct timespec ts;
+	struct sd_req hdr;
+	struct sd_rsp rsp;
+	unsigned rlen;
+
+	gateway_init_fwd_hdr(&hdr, &req->rq);
+	while (!done) {
+		/* send to the next replica if none is pending or it's time */
+		while (next < nr &&
+		       (!nr_pending || hedge_due(start[next - 1], delay))) {
+			i = next++;
+			start[i] = get_usec_time();
+			sfds[i] = sheep_get_sockfd(nids[i]);
+			if (!sfds[i])
+				continue;
+			if (send_req(sfds[i]->fd, &hdr, NULL, 0,
+				     sheep_need_retry, epoch)) {
+				sheep_del_sockfd(nids[i], sfds[i]);
+				sfds[i] = NULL;
+				continue;
+			}
+			if (nr_pending)
+				sd_dprintf("hedge %"PRIx64" to replica %d",
+					   hdr.obj.oid, i);
+			nr_pending++;
+		}
+		if (!nr_pending)
+			break;
+
+		nr_polled = 0;
+		for (i = 0; i < next; i++) {
+			if (!sfds[i])
+				continue;
+			pfds[nr_polled].fd = sfds[i]->fd;
+			pfds[nr_polled].events = POLLIN;
+			idx[nr_polled++] = i;
+		}
+
+		if (next < nr) {
+			elapsed = min(get_usec_time() - start[next - 1], delay);
+			ts.tv_sec = (delay - elapsed) / 1000000;
+			ts.tv_nsec = (delay - elapsed) % 1000000 * 1000;
+		} else {
+			ts.tv_sec = POLL_TIMEOUT;
+			ts.tv_nsec = 0;
+		}
+		pollret = net_ppoll(pfds, nr_polled, &ts);
+		if (pollret < 0) {
+			if (errno == EINTR)
+				continue;
+			panic("%m");
+		} else if (pollret == 0) {
+			/* time to hedge */
+			if (next < nr)
+				continue;
+			sd_eprintf("poll timeout %d", nr_pending);
+			if (sheep_need_retry(epoch) && repeat) {
+				repeat--;
+				continue;
+			}
+			ret = SD_RES_NETWORK_ERROR;
+			break;
+		}
+
+		for (j = 0; j < nr_polled && !done; j++) {
+			if (!pfds[j].revents)
+				continue;
+			i = idx[j];
+			nr_pending--;
+			if (!(pfds[j].revents & POLLIN) ||
+			    do_read(pfds[j].fd, &rsp, sizeof(rsp),
+				    sheep_need_retry, epoch)) {
+				sd_eprintf("remote node might have gone away");
+				ret = SD_RES_NETWORK_ERROR;
+				goto del;
+			}
+
+			ret = rsp.result;
+			rlen = min(rsp.data_length, req->rq.data_length);
+			if (ret != SD_RES_SUCCESS) {
+				if (rsp.data_length)
+					goto del;
+			} else if (rlen && do_read(pfds[j].fd, req->data, rlen,
+						   sheep_need_retry, epoch)) {
+				ret = SD_RES_NETWORK_ERROR;
+				goto del;
+			} else {
+				memcpy(&req->rp, &rsp, sizeof(rsp));
+				account_read_latency(nids[i], start[i], &rsp);
+				done = true;
+			}
+			sheep_put_sockfd(nids[i], sfds[i]);
+			sfds[i] = NULL;
+			continue;
+del:
+			sheep_del_sockfd(nids[i], sfds[i]);
+			sfds[i] = NULL;
+		}
+	}
+
+	/* the losers still have their responses on the way */
+	for (i = 0; i < next; i++) {
+		if (!sfds[i])
+			continue;
+		account_read_latency(nids[i], start[i], NULL);
+		sheep_del_sockfd(nids[i], sfds[i]);
+	}
+
+	return ret;
+}
+
+struct hedged_read {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	/* the legs not taken by the waiter yet, and whether it has gone */
+	int nr_inflight;
+	bool abandoned;
+	struct list_head done_list;
+};
+
+struct hedged_read_leg {
+	struct sockfd_mux_req mreq;
+	struct hedged_read *hr;
+	int idx;
+	struct list_head list;
+	char buf[];
+};
+
+static void free_hedged_read(struct hedged_read *hr)
+{
+	pthread_mutex_destroy(&hr->lock);
+	pthread_cond_destroy(&hr->cond);
+	free(hr);
+}
+
+/* Called from the mux receiver thread, the last leg frees the hedged read */
+static void hedged_read_leg_done(struct sockfd_mux_req *mreq)
+{
+	struct hedged_read_leg *leg = container_of(mreq, struct hedged_read_leg,
+						   mreq);
+	struct hedged_read *hr = leg->hr;
+	bool last;
+
+	pthread_mutex_lock(&hr->lock);
+	if (!hr->abandoned) {
+		list_add_tail(&leg->list, &hr->done_list);
+		pthread_cond_signal(&hr->cond);
+		pthread_mutex_unlock(&hr->lock);
+		return;
+	}
+	last = --hr->nr_inflight == 0;
+	pthread_mutex_unlock(&hr->lock);
+
+	free(leg);
+	if (last)
+		free_hedged_read(hr);
+}
+
+static bool hedged_read_submit(struct hedged_read *hr, struct request *req,
+			       struct sd_req *hdr, const struct node_id *nid,
+			       int idx)
+{
+	struct hedged_read_leg *leg;
+
+	leg = xzalloc(sizeof(*leg) + req->rq.data_length);
+	leg->hr = hr;
+	leg->idx = idx;
+	pthread_mutex_lock(&hr->lock);
+	hr->nr_inflight++;
+	pthread_mutex_unlock(&hr->lock);
+
+	/* don't hold hr->lock, the receiver takes it under the conn lock */
+	if (sheep_mux_submit_async(nid, hdr, leg->buf, &leg->mreq,
+				   hedged_read_leg_done) == SD_RES_SUCCESS)
+		return true;
+
+	pthread_mutex_lock(&hr->lock);
+	hr->nr_inflight--;
+	pthread_mutex_unlock(&hr->lock);
+	free(leg);
+
+	return false;
+}
+
+static int hedged_read_mux(struct request *req, const struct node_id **nids,
+			   int nr, uint64_t delay)
+{
+	struct hedged_read *hr = xzalloc(sizeof(*hr));
+	struct hedged_read_leg *leg, *t;
+	uint64_t start[SD_MAX_COPIES], elapsed, nsec;
+	bool pending[SD_MAX_COPIES] = {}, last;
+	int i, next = 0, nr_pending = 0, ret = SD_RES_NETWORK_ERROR;
+	struct timespec ts;
+	struct sd_req hdr;
+	unsigned rlen;
+
+	pthread_mutex_init(&hr->lock, NULL);
+	pthread_cond_init(&hr->cond, NULL);
+	INIT_LIST_HEAD(&hr->done_list);
+	gateway_init_fwd_hdr(&hdr, &req->rq);
+	for (;;) {
+		/* send to the next replica if none is pending or it's time */
+		while (next < nr &&
+		       (!nr_pending || hedge_due(start[next - 1], delay))) {
+			i = next++;
+			start[i] = get_usec_time();
+			if (!hedged_read_submit(hr, req, &hdr, nids[i], i))
+				continue;
+			if (nr_pending)
+				sd_dprintf("hedge %"PRIx64" to replica %d",
+					   hdr.obj.oid, i);
+			pending[i] = true;
+			nr_pending++;
+		}
+		if (!nr_pending)
+			break;
+
+		pthread_mutex_lock(&hr->lock);
+		while (list_empty(&hr->done_list)) {
+			/* the mux receiver times out the dead peers */
+			if (next == nr) {
+				pthread_cond_wait(&hr->cond, &hr->lock);
+				continue;
+			}
+			elapsed = get_usec_time() - start[next - 1];
+			if (elapsed >= delay)
+				break;
+			clock_gettime(CLOCK_REALTIME, &ts);
+			nsec = ts.tv_nsec + (delay - elapsed) * 1000;
+			ts.tv_sec += nsec / 1000000000;
+			ts.tv_nsec = nsec % 1000000000;
+			pthread_cond_timedwait(&hr->cond, &hr->lock, &ts);
+		}
+		leg = NULL;
+		if (!list_empty(&hr->done_list)) {
+			leg = list_first_entry(&hr->done_list,
+					       struct hedged_read_leg, list);
+			list_del(&leg->list);
+			hr->nr_inflight--;
+		}
+		pthread_mutex_unlock(&hr->lock);
+		/* time to hedge */
+		if (!leg)
+			continue;
+
+		i = leg->idx;
+		pending[i] = false;
+		nr_pending--;
+		ret = leg->mreq.result;
+		if (ret == SD_RES_SUCCESS) {
+			rlen = min(leg->mreq.rsp.data_length,
+				   req->rq.data_length);
+			memcpy(req->data, leg->buf, rlen);
+			memcpy(&req->rp, &leg->mreq.rsp, sizeof(req->rp));
+			account_read_latency(nids[i], start[i],
+					     &leg->mreq.rsp);
+		}
+		free(leg);
+		if (ret == SD_RES_SUCCESS)
+			break;
+	}
+
+	for (i = 0; i < next; i++)
+		if (pending[i])
+			account_read_latency(nids[i], start[i], NULL);
+
+	/* leave the buffers of the losers to the receiver */
+	pthread_mutex_lock(&hr->lock);
+	hr->abandoned = true;
+	list_for_each_entry_safe(leg, t, &hr->done_list, list) {
+		list_del(&leg->list);
+		hr->nr_inflight--;
+		free(leg);
+	}
+	last = !hr->nr_inflight;
+	pthread_mutex_unlock(&hr->lock);
+	if (last)
+		free_hedged_read(hr);
+
+	return ret;
+}
+
+/* Read one of the remote replicas, return the result of the last tried */
+static int gateway_read_remote(struct request *req,
+			       const struct node_id **nids, int nr)
+{
+	struct sd_req fwd_hdr;
+	struct sd_rsp *rsp = (struct sd_rsp *)&fwd_hdr;
+	uint64_t delay = uatomic_read(&hedge_delay), start;
+	int i, ret = SD_RES_NETWORK_ERROR;
+
+	trace_req_stage(req, SD_REQ_STAGE_FORWARD);
+	if (delay && nr > 1) {
+		if (sys->nr_mux_conns)
+			ret = hedged_read_mux(req, nids, nr, delay);
+		else
+			ret = hedged_read_sockfd(req, nids, nr, delay);
+		goto out;
+	}
+
+	for (i = 0; i < nr; i++) {
+		/*
+		 * We need to re-init it because rsp and req share the same
+		 * structure.
+		 */
+		gateway_init_fwd_hdr(&fwd_hdr, &req->rq);
+		start = get_usec_time();
+		ret = sheep_exec_req(nids[i], &fwd_hdr, req->data);
+		if (ret != SD_RES_SUCCESS)
+			continue;
+
+		/* Read success */
+		account_read_latency(nids[i], start, rsp);
+		memcpy(&req->rp, rsp, sizeof(*rsp));
+		break;
+	}
+out:
+	trace_req_stage(req, SD_REQ_STAGE_ACKS);
+	return ret;
+}
+
 /*
  * Try our best to read one copy and read local first.
  *
  * Return success if any read succeed. We don't call gateway_forward_request()
  * because we only read once.
  */
-int gateway_read_obj(struct request *req)
+static int gateway_read_replicas(struct request *req)
 {
 	int i, ret = SD_RES_SUCCESS;
-	struct sd_req fwd_hdr;
-	struct sd_rsp *rsp = (struct sd_rsp *)&fwd_hdr;
 	const struct sd_vnode *v;
 	const struct sd_vnode *obj_vnodes[SD_MAX_COPIES];
+	const struct node_id *nids[SD_MAX_COPIES];
 	uint64_t oid = req->rq.obj.oid;
-	int nr_copies, j;
+	int nr_copies, nr_remotes;
 
-	if (sys->enable_object_cache && !req->local &&
-	    !bypass_object_cache(req)) {
-		ret = object_cache_handle_request(req);
-		goto out;
-	}
+	if (is_erasure_obj(oid))
+		return ec_read_obj(req);
 
 	nr_copies = get_req_copy_number(req);
-	oid_to_vnodes(req->vinfo->vnodes, req->vinfo->nr_vnodes, oid,
-		      nr_copies, obj_vnodes);
+	vinfo_oid_to_vnodes(req->vinfo, oid, nr_copies, obj_vnodes);
 	for (i = 0; i < nr_copies; i++) {
 		v = obj_vnodes[i];
 		if (!vnode_is_local(v))
 			continue;
 		ret = peer_read_obj(req);
+		trace_req_stage(req, SD_REQ_STAGE_LOCAL_IO);
 		if (ret == SD_RES_SUCCESS)
 			goto out;
 
@@ -61,39 +577,80 @@ int gateway_read_obj(struct request *req)
 		break;
 	}
 
-	/*
-	 * Read random copy from cluster for better load balance, useful for
-	 * reading base VM's COW objects
-	 */
-	j = random();
-	for (i = 0; i < nr_copies; i++) {
-		int idx = (i + j) % nr_copies;
+	nr_remotes = order_remote_replicas(obj_vnodes, nr_copies, nids);
+	if (nr_remotes)
+		ret = gateway_read_remote(req, nids, nr_remotes);
+out:
+	return ret;
+}
 
-		v = obj_vnodes[idx];
-		if (vnode_is_local(v))
-			continue;
-		/*
-		 * We need to re-init it because rsp and req share the same
-		 * structure.
-		 */
-		gateway_init_fwd_hdr(&fwd_hdr, &req->rq);
-		ret = sheep_exec_req(&v->nid, &fwd_hdr, req->data);
-		if (ret != SD_RES_SUCCESS)
-			continue;
+/* Serve the read of an inode from the inode cache, filling it on a miss */
+static int gateway_read_inode(struct request *req)
+{
+	struct request fill_req = { };
+	struct sd_req *hdr = &fill_req.rq;
+	struct sd_rsp *rsp = &fill_req.rp;
+	uint32_t vid = oid_to_vid(req->rq.obj.oid), epoch;
+	struct sheepdog_inode *inode;
+	uint64_t gen;
+	int ret;
 
-		/* Read success */
-		memcpy(&req->rp, rsp, sizeof(*rsp));
-		break;
+	if (inode_cache_read(vid, req->data, req->rq.obj.offset,
+			     req->rq.data_length))
+		goto hit;
+
+	gen = inode_cache_gen(vid);
+	epoch = sys_epoch();
+
+	/* read the whole inode, the replicas trim the zeros at its end */
+	sd_init_req(hdr, SD_OP_READ_OBJ);
+	hdr->proto_ver = SD_PROTO_VER_TRIM_ZERO_SECTORS;
+	hdr->data_length = SD_INODE_SIZE;
+	hdr->epoch = req->rq.epoch;
+	hdr->obj.oid = req->rq.obj.oid;
+	hdr->obj.copies = get_req_copy_number(req);
+
+	inode = xvalloc(SD_INODE_SIZE);
+	fill_req.data = inode;
+	fill_req.op = req->op;
+	fill_req.vinfo = req->vinfo;
+
+	ret = gateway_read_replicas(&fill_req);
+	if (ret == SD_RES_SUCCESS) {
+		untrim_zero_sectors(inode, rsp->obj.offset, rsp->data_length,
+				    SD_INODE_SIZE);
+		inode_cache_insert(vid, gen, epoch, inode);
 	}
-out:
+	free(inode);
+
+	/* invalidated meanwhile, read the range the usual way */
 	if (ret == SD_RES_SUCCESS &&
-	    req->rq.proto_ver < SD_PROTO_VER_TRIM_ZERO_SECTORS) {
-		/* the client doesn't support trimming zero bytes */
-		untrim_zero_sectors(req->data, req->rp.obj.offset,
-				    req->rp.data_length, req->rq.data_length);
-		req->rp.data_length = req->rq.data_length;
-		req->rp.obj.offset = 0;
-	}
+	    !inode_cache_read(vid, req->data, req->rq.obj.offset,
+			      req->rq.data_length))
+		return gateway_read_replicas(req);
+	if (ret != SD_RES_SUCCESS)
+		return ret;
+hit:
+	req->rp.data_length = req->rq.data_length;
+	req->rp.obj.offset = 0;
+	return SD_RES_SUCCESS;
+}
+
+int gateway_read_obj(struct request *req)
+{
+	int ret;
+
+	if (sys->enable_object_cache && !req->local &&
+	    !bypass_object_cache(req))
+		ret = object_cache_handle_request(req);
+	else if (is_vdi_obj(req->rq.obj.oid) &&
+		 req->rq.obj.offset + req->rq.data_length <= SD_INODE_SIZE)
+		ret = gateway_read_inode(req);
+	else
+		ret = gateway_read_replicas(req);
+
+	if (ret == SD_RES_SUCCESS)
+		gateway_untrim_rsp(req);
 	return ret;
 }
 
@@ -157,7 +714,7 @@ static int wait_forward_request(struct write_info *wi, struct request *req)
 	struct sd_rsp *rsp = &req->rp;
 again:
 	pfd_info_init(wi, &pi);
-	pollret = poll(pi.pfds, pi.nr, 1000 * POLL_TIMEOUT);
+	pollret = net_poll(pi.pfds, pi.nr, 1000 * POLL_TIMEOUT);
 	if (pollret < 0) {
 		if (errno == EINTR)
 			goto again;
@@ -243,62 +800,106 @@ static int init_target_nodes(struct request *req, uint64_t oid,
 	const struct vnode_info *vinfo = req->vinfo;
 
 	nr_to_send = get_req_copy_number(req);
-	oid_to_nodes(vinfo->vnodes, vinfo->nr_vnodes, oid, nr_to_send,
-		     vinfo->nodes, target_nodes);
+	vinfo_oid_to_nodes(vinfo, oid, nr_to_send, target_nodes);
 
 	return nr_to_send;
 }
 
-static int gateway_forward_request(struct request *req)
+/*
+ * Chain replication
+ *
+ * With -C, the gateway sends a write only to the first remote replica, which
+ * passes it on to the others one after another, see SD_FLAG_CMD_CHAIN.  The
+ * egress of the gateway is the same whatever the number of copies, at the cost
+ * of one more hop per copy in latency.
+ *
+ * Drop the remote replicas after the first one from target_nodes and return the
+ * data to send to the first one, with them appended.  The caller frees it if it
+ * isn't req->data.
+ */
+static void *init_chain(struct request *req, struct sd_req *hdr,
+			const struct sd_node **target_nodes, int *nr_to_send)
 {
-	int i, err_ret = SD_RES_SUCCESS, ret, local = -1;
-	unsigned wlen;
+	struct node_id chain[SD_MAX_COPIES];
+	int i, nr = 0, nr_chain = 0;
+	bool head = false;
+	size_t len;
+	char *data;
+
+	if (!sys->chain_replication ||
+	    (hdr->opcode != SD_OP_WRITE_PEER &&
+	     hdr->opcode != SD_OP_CREATE_AND_WRITE_PEER))
+		return req->data;
+
+	for (i = 0; i < *nr_to_send; i++) {
+		if (node_is_local(target_nodes[i]) || !head) {
+			if (!node_is_local(target_nodes[i]))
+				head = true;
+			target_nodes[nr++] = target_nodes[i];
+		} else
+			chain[nr_chain++] = target_nodes[i]->nid;
+	}
+	if (!nr_chain)
+		return req->data;
+
+	len = sizeof(chain[0]) * nr_chain;
+	data = xmalloc(hdr->data_length + len);
+	memcpy(data, req->data, hdr->data_length);
+	memcpy(data + hdr->data_length, chain, len);
+	hdr->data_length += len;
+	hdr->flags |= SD_FLAG_CMD_CHAIN;
+	hdr->obj.nr_chain = nr_chain;
+	*nr_to_send = nr;
+
+	return data;
+}
+
+/*
+ * Multiplexed version of gateway_forward_request()
+ *
+ * Replicas share the long connections with the other requests, so we don't
+ * grab any sockfd and just collect the responses by waiting on them.
+ */
+static int gateway_mux_forward_request(struct request *req)
+{
+	int i, err_ret = SD_RES_SUCCESS, ret, local = -1, nr_sent = 0;
 	uint64_t oid = req->rq.obj.oid;
 	int nr_to_send;
-	struct write_info wi;
 	const struct sd_op_template *op;
 	struct sd_req hdr;
 	const struct sd_node *target_nodes[SD_MAX_NODES];
+	struct sockfd_mux_req mreqs[SD_MAX_COPIES];
+	void *data;
 
 	sd_dprintf("%"PRIx64, oid);
 
 	gateway_init_fwd_hdr(&hdr, &req->rq);
 	op = get_sd_op(hdr.opcode);
 
-	wlen = hdr.data_length;
 	nr_to_send = init_target_nodes(req, oid, target_nodes);
-	write_info_init(&wi, nr_to_send);
-
+	data = init_chain(req, &hdr, target_nodes, &nr_to_send);
 	for (i = 0; i < nr_to_send; i++) {
-		struct sockfd *sfd;
-		const struct node_id *nid;
-
 		if (node_is_local(target_nodes[i])) {
 			local = i;
 			continue;
 		}
 
-		nid = &target_nodes[i]->nid;
-		sfd = sheep_get_sockfd(nid);
-		if (!sfd) {
-			err_ret = SD_RES_NETWORK_ERROR;
-			break;
-		}
-
-		ret = send_req(sfd->fd, &hdr, req->data, wlen,
-			       sheep_need_retry, req->rq.epoch);
-		if (ret) {
-			sheep_del_sockfd(nid, sfd);
-			err_ret = SD_RES_NETWORK_ERROR;
-			sd_dprintf("fail %d", ret);
+		ret = sheep_mux_submit(&target_nodes[i]->nid, &hdr, data,
+				       mreqs + nr_sent);
+		if (ret != SD_RES_SUCCESS) {
+			err_ret = ret;
 			break;
 		}
-		write_info_advance(&wi, nid, sfd);
+		nr_sent++;
 	}
+	if (data != req->data)
+		free(data);
+	trace_req_stage(req, SD_REQ_STAGE_FORWARD);
 
 	if (local != -1 && err_ret == SD_RES_SUCCESS) {
 		assert(op);
 		ret = sheep_do_op_work(op, req);
+		trace_req_stage(req, SD_REQ_STAGE_LOCAL_IO);
 
 		if (ret != SD_RES_SUCCESS) {
 			sd_eprintf("fail to write local %"PRIx64", %s", oid,
@@ -307,33 +908,1345 @@ static int gateway_forward_request(struct request *req)
 		}
 	}
 
-	sd_dprintf("nr_sent %d, err %x", wi.nr_sent, err_ret);
-	if (wi.nr_sent > 0) {
-		ret = wait_forward_request(&wi, req);
-		if (ret != SD_RES_SUCCESS)
+	sd_dprintf("nr_sent %d, err %x", nr_sent, err_ret);
+	for (i = 0; i < nr_sent; i++) {
+		ret = sheep_mux_wait(mreqs + i);
+		if (ret != SD_RES_SUCCESS) {
+			sd_eprintf("fail %"PRIx64", %s", oid, sd_strerror(ret));
 			err_ret = ret;
+		}
 	}
+	trace_req_stage(req, SD_REQ_STAGE_ACKS);
 
 	return err_ret;
 }
 
-int gateway_write_obj(struct request *req)
+static int gateway_forward_request(struct request *req)
 {
-	if (!bypass_object_cache(req))
-		return object_cache_handle_request(req);
-
-	return gateway_forward_request(req);
-}
-
-int gateway_create_and_write_obj(struct request *req)
+	int i, err_ret = SD_RES_SUCCESS, ret, local = -1;
+	unsigned wlen;
+	uint64_t oid = req->rq.obj.oid;
+	int nr_to_send;
+	struct write_info wi;
+	const struct sd_op_template *op;
+	struct sd_req hdr;
+	const struct sd_node *target_nodes[SD_MAX_NODES];
+	void *data;
+
+	if (sys->nr_mux_conns)
+		return gateway_mux_forward_request(req);
+
+	sd_dprintf("%"PRIx64, oid);
+
+	gateway_init_fwd_hdr(&hdr, &req->rq);
+	op = get_sd_op(hdr.opcode);
+
+	nr_to_send = init_target_nodes(req, oid, target_nodes);
+	data = init_chain(req, &hdr, target_nodes, &nr_to_send);
+	wlen = hdr.data_length;
+	write_info_init(&wi, nr_to_send);
+
+	for (i = 0; i < nr_to_send; i++) {
+		struct sockfd *sfd;
+		const struct node_id *nid;
+
+		if (node_is_local(target_nodes[i])) {
+			local = i;
+			continue;
+		}
+
+		nid = &target_nodes[i]->nid;
+		sfd = sheep_get_sockfd(nid);
+		if (!sfd) {
+			err_ret = SD_RES_NETWORK_ERROR;
+			break;
+		}
+
+		ret = send_req(sfd->fd, &hdr, data, wlen,
+			       sheep_need_retry, req->rq.epoch);
+		if (ret) {
+			sheep_del_sockfd(nid, sfd);
+			err_ret = SD_RES_NETWORK_ERROR;
+			sd_dprintf("fail %d", ret);
+			break;
+		}
+		write_info_advance(&wi, nid, sfd);
+	}
+	if (data != req->data)
+		free(data);
+	trace_req_stage(req, SD_REQ_STAGE_FORWARD);
+
+	if (local != -1 && err_ret == SD_RES_SUCCESS) {
+		assert(op);
+		ret = sheep_do_op_work(op, req);
+		trace_req_stage(req, SD_REQ_STAGE_LOCAL_IO);
+
+		if (ret != SD_RES_SUCCESS) {
+			sd_eprintf("fail to write local %"PRIx64", %s", oid,
+				   sd_strerror(ret));
+			err_ret = ret;
+		}
+	}
+
+	sd_dprintf("nr_sent %d, err %x", wi.nr_sent, err_ret);
+	if (wi.nr_sent > 0) {
+		ret = wait_forward_request(&wi, req);
+		if (ret != SD_RES_SUCCESS)
+			err_ret = ret;
+	}
+	trace_req_stage(req, SD_REQ_STAGE_ACKS);
+
+	return err_ret;
+}
+
+/*
+ * Write our copy of a chained write while the next replica writes the rest of
+ * the chain.  Called by the peer write operations in a gateway worker, so that
+ * no I/O worker waits for another node.
+ */
+int gateway_chain_obj(struct request *req)
+{
+	struct sd_req *hdr = &req->rq, fwd;
+	struct sockfd_mux_req mreq;
+	struct write_info wi;
+	struct sockfd *sfd;
+	struct node_id *chain;
+	const struct node_id *next = NULL;
+	uint32_t nr_chain = hdr->obj.nr_chain;
+	size_t len = sizeof(*chain) * nr_chain;
+	int i, ret, err_ret;
+	char name[INET6_ADDRSTRLEN];
+
+	sd_dprintf("%"PRIx64", %"PRIu32" more", hdr->obj.oid, nr_chain);
+	if (!nr_chain || nr_chain >= SD_MAX_COPIES || hdr->data_length < len)
+		return SD_RES_INVALID_PARMS;
+
+	fwd = *hdr;
+	hdr->data_length -= len;
+	hdr->flags &= ~SD_FLAG_CMD_CHAIN;
+	hdr->obj.nr_chain = 0;
+	chain = (struct node_id *)((char *)req->data + hdr->data_length);
+
+	/* the request has been checked against our epoch, so must be there */
+	for (i = 0; i < req->vinfo->nr_nodes; i++)
+		if (!node_id_cmp(&req->vinfo->nodes[i].nid, chain))
+			next = &req->vinfo->nodes[i].nid;
+	if (!next) {
+		sd_eprintf("%s:%d isn't a member",
+			   addr_to_str(name, sizeof(name), chain->addr, 0),
+			   chain->port);
+		return SD_RES_INVALID_PARMS;
+	}
+
+	/* the data is followed by the rest of the chain */
+	memmove(chain, chain + 1, len - sizeof(*chain));
+	fwd.data_length -= sizeof(*chain);
+	if (--fwd.obj.nr_chain == 0)
+		fwd.flags &= ~SD_FLAG_CMD_CHAIN;
+
+	write_info_init(&wi, 1);
+	if (sys->nr_mux_conns)
+		err_ret = sheep_mux_submit(next, &fwd, req->data, &mreq);
+	else {
+		sfd = sheep_get_sockfd(next);
+		if (!sfd)
+			return SD_RES_NETWORK_ERROR;
+
+		if (send_req(sfd->fd, &fwd, req->data, fwd.data_length,
+			     sheep_need_retry, hdr->epoch)) {
+			sheep_del_sockfd(next, sfd);
+			return SD_RES_NETWORK_ERROR;
+		}
+		write_info_advance(&wi, next, sfd);
+		err_ret = SD_RES_SUCCESS;
+	}
+	if (err_ret != SD_RES_SUCCESS)
+		return err_ret;
+
+	err_ret = sheep_do_op_work(req->op, req);
+	if (err_ret != SD_RES_SUCCESS)
+		sd_eprintf("fail to write local %"PRIx64", %s", hdr->obj.oid,
+			   sd_strerror(err_ret));
+
+	if (sys->nr_mux_conns)
+		ret = sheep_mux_wait(&mreq);
+	else
+		ret = wait_forward_request(&wi, req);
+	if (ret != SD_RES_SUCCESS)
+		err_ret = ret;
+
+	return err_ret;
+}
+
+int gateway_write_obj(struct request *req)
 {
 	if (!bypass_object_cache(req))
 		return object_cache_handle_request(req);
 
+	if (is_erasure_obj(req->rq.obj.oid))
+		return ec_write_obj(req);
+
 	return gateway_forward_request(req);
 }
 
+/*
+ * With SD_FLAG_CMD_LINK, the gateway sets the slot of the created data object
+ * in its inode once the object is written, which saves the client the round
+ * trip of the inode write.  The slots which are linked while a slot write of
+ * the same inode is in flight wait for it and then go out together, one write
+ * per run of adjacent slots, so a sequential fill writes its inode in batches.
+ * The inodes of the objects created in the object cache are written there too.
+ * The flag is echoed in the response once the slot is set.  Older gateways
+ * leave it clear, so the clients know to write the slot themselves.
+ */
+struct link_waiter {
+	struct list_head list;
+	uint32_t idx;
+	bool cached;
+	uint16_t flags;
+	uint8_t copies;
+	int ret;
+	bool done;
+};
+
+struct link_batch {
+	struct list_head list;
+	uint32_t vid;
+	bool busy;
+	int nr_users;
+	/* sorted by the slot index */
+	struct list_head waiters;
+};
+
+static pthread_mutex_t link_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t link_cond = PTHREAD_COND_INITIALIZER;
+static LIST_HEAD(link_batches);
+
+static struct link_batch *get_link_batch(uint32_t vid)
+{
+	struct link_batch *batch;
+
+	list_for_each_entry(batch, &link_batches, list)
+		if (batch->vid == vid)
+			goto out;
+
+	batch = xzalloc(sizeof(*batch));
+	batch->vid = vid;
+	INIT_LIST_HEAD(&batch->waiters);
+	list_add(&batch->list, &link_batches);
+out:
+	batch->nr_users++;
+	return batch;
+}
+
+static void add_link_waiter(struct link_batch *batch, struct link_waiter *w)
+{
+	struct link_waiter *p;
+
+	list_for_each_entry(p, &batch->waiters, list)
+		if (p->idx > w->idx)
+			break;
+	list_add_tail(&w->list, &p->list);
+}
+
+static int write_inode_slots(uint32_t vid, uint32_t start, uint32_t nr,
+			     bool cached, uint16_t flags, uint8_t copies)
+{
+	struct sd_req hdr;
+	uint32_t *vids;
+	int i, ret;
+
+	vids = xmalloc(sizeof(*vids) * nr);
+	for (i = 0; i < nr; i++)
+		vids[i] = vid;
+
+	sd_init_req(&hdr, SD_OP_WRITE_OBJ);
+	hdr.flags = flags | SD_FLAG_CMD_WRITE;
+	hdr.data_length = sizeof(*vids) * nr;
+	hdr.obj.oid = vid_to_vdi_oid(vid);
+	hdr.obj.offset = SD_INODE_HEADER_SIZE + sizeof(*vids) * start;
+	hdr.obj.copies = copies;
+
+	if (cached) {
+		/* the local requests bypass the object cache */
+		struct request req = { .rq = hdr, .data = vids };
+
+		inode_cache_invalidate(vid);
+		ret = object_cache_handle_request(&req);
+	} else
+		ret = exec_local_req(&hdr, vids);
+	if (ret != SD_RES_SUCCESS)
+		sd_eprintf("failed to link %" PRIx32 " [%" PRIu32 ", %" PRIu32
+			   "], %s", vid, start, start + nr - 1,
+			   sd_strerror(ret));
+	free(vids);
+
+	return ret;
+}
+
+/* Write the slots of 'waiters' and set the result of each of them */
+static void flush_links(uint32_t vid, struct list_head *waiters)
+{
+	struct link_waiter *first, *last, *w;
+	int ret;
+
+	first = list_first_entry(waiters, struct link_waiter, list);
+	while (&first->list != waiters) {
+		last = first;
+		w = list_entry(first->list.next, struct link_waiter, list);
+		while (&w->list != waiters && w->idx <= last->idx + 1 &&
+		       w->cached == first->cached &&
+		       w->flags == first->flags && w->copies == first->copies) {
+			last = w;
+			w = list_entry(w->list.next, struct link_waiter, list);
+		}
+
+		ret = write_inode_slots(vid, first->idx,
+					last->idx - first->idx + 1,
+					first->cached, first->flags,
+					first->copies);
+		for (; first != w; first = list_entry(first->list.next,
+						      struct link_waiter,
+						      list))
+			first->ret = ret;
+	}
+}
+
+static int link_data_obj(const struct request *req, bool cached)
+{
+	struct link_waiter *w, waiter = {
+		.idx = data_oid_to_idx(req->rq.obj.oid),
+		.cached = cached,
+		.flags = req->rq.flags & SD_FLAG_CMD_CACHE,
+		.copies = req->rq.obj.copies,
+	};
+	uint32_t vid = oid_to_vid(req->rq.obj.oid);
+	struct link_batch *batch;
+	LIST_HEAD(waiters);
+
+	pthread_mutex_lock(&link_lock);
+	batch = get_link_batch(vid);
+	add_link_waiter(batch, &waiter);
+	while (!waiter.done) {
+		if (batch->busy) {
+			pthread_cond_wait(&link_cond, &link_lock);
+			continue;
+		}
+
+		batch->busy = true;
+		list_splice_init(&batch->waiters, &waiters);
+		pthread_mutex_unlock(&link_lock);
+
+		flush_links(vid, &waiters);
+
+		pthread_mutex_lock(&link_lock);
+		list_for_each_entry(w, &waiters, list)
+			w->done = true;
+		INIT_LIST_HEAD(&waiters);
+		batch->busy = false;
+		pthread_cond_broadcast(&link_cond);
+	}
+	if (!--batch->nr_users) {
+		list_del(&batch->list);
+		free(batch);
+	}
+	pthread_mutex_unlock(&link_lock);
+
+	return waiter.ret;
+}
+
+int gateway_create_and_write_obj(struct request *req)
+{
+	bool cached = !bypass_object_cache(req);
+	int ret;
+
+	if (cached)
+		ret = object_cache_handle_request(req);
+	else if (is_erasure_obj(req->rq.obj.oid))
+		ret = ec_create_and_write_obj(req);
+	else
+		ret = gateway_forward_request(req);
+
+	if (ret == SD_RES_SUCCESS && (req->rq.flags & SD_FLAG_CMD_LINK) &&
+	    is_data_obj(req->rq.obj.oid)) {
+		ret = link_data_obj(req, cached);
+		/* tell the client that it has nothing left to do */
+		if (ret == SD_RES_SUCCESS)
+			req->rp.flags |= SD_FLAG_CMD_LINK;
+	}
+
+	return ret;
+}
+
 int gateway_remove_obj(struct request *req)
 {
 	return gateway_forward_request(req);
 }
+
+/*
+ * A discard of a cached object goes to the cache, which punches its copy and
+ * writes the zeros back in time.  Otherwise the replicas punch it directly.
+ */
+int gateway_discard_obj(struct request *req)
+{
+	int ret;
+
+	if (!bypass_object_cache(req) && object_is_cached(req->rq.obj.oid)) {
+		ret = object_cache_discard(req);
+		if (ret != SD_RES_NO_CACHE)
+			return ret;
+	}
+
+	if (is_erasure_obj(req->rq.obj.oid))
+		return ec_discard_obj(req);
+
+	return gateway_forward_request(req);
+}
+
+/*
+ * Asynchronous gateway forwarding
+ *
+ * Normally a gateway worker is parked in poll() or sheep_exec_req() until the
+ * replicas reply, so the number of gateway threads grows with the number of
+ * outstanding requests.  In asynchronous mode a request is driven as a state
+ * machine instead:
+ *
+ *  - replica requests are sent by a few 'fwd' workers over the multiplexed
+ *    connections, which return as soon as the request is on the wire
+ *  - the local copy is read or written by an io worker
+ *  - acks are collected by the receiver threads of the connections and
+ *    handed over to the main thread
+ *
+ * Every outstanding step holds a reference to the 'struct gateway_fwd' and the
+ * main thread decides what to do next when the last one is dropped.  Reads try
+ * the local copy first and then one remote replica at a time, and writes fan
+ * out to all the replicas at once.
+ *
+ * With a write quorum (-W), a write is answered as soon as the local copy, if
+ * any, is written and sys->write_quorum replicas in total succeeded.  The
+ * 'struct gateway_fwd' then takes over the data of the request and lives on
+ * until the remaining replicas reply.  Meanwhile the write is 'lagging' and
+ * the requests which overlap it are held, so that nobody reads the old data
+ * from a slow replica and the writes to it are never reordered.  A lagging
+ * replica which fails is repaired by writing the object again through the
+ * normal gateway path, which retries on the new epoch like any other request.
+ *
+ * The lagging writes are logged before they are answered, with their range
+ * and the replicas which have them, so that a gateway which dies meanwhile
+ * repairs the range on the other replicas when it joins the cluster again.
+ */
+struct lagging_oid {
+	struct rb_node rb;
+	uint64_t oid;
+	struct list_head fwds; /* lagging writes to the object */
+	struct list_head waiters; /* requests held by them */
+};
+
+static struct rb_root lagging_root = RB_ROOT;
+
+struct gateway_fwd {
+	struct request *req;
+	struct sd_req hdr;
+	int refcnt;
+	int result;
+	/* set by the fwd worker, merged into result in the main thread */
+	int submit_result;
+
+	/* write quorum, 0 to wait for all the replicas */
+	int quorum;
+	int nr_acks;
+	bool local_pending;
+	bool submitted;
+	/* answered at the quorum, req is gone and rq and data are ours */
+	bool acked;
+	struct sd_req rq;
+	void *data;
+	uint64_t ack_time;
+	struct lagging_oid *lag;
+	struct list_head lag_list;
+	/* the record of the write in the lagging log, and its slot */
+	struct lagging_rec *lag_rec;
+	int lag_slot;
+	bool local_acked;
+
+	bool is_read;
+	/* the remote replicas to read in order, and when we sent to 'next' */
+	const struct node_id *nids[SD_MAX_COPIES];
+	int nr_remotes;
+	int next;
+	int nr_tried;
+	uint64_t start;
+
+	struct fwd_mux_req {
+		struct sockfd_mux_req mreq;
+		struct gateway_fwd *fwd;
+		struct list_head list;
+		struct node_id nid;
+		bool acked;
+	} mreqs[SD_MAX_COPIES];
+	int nr_mreqs;
+
+	struct work work;
+	struct work local_work;
+};
+
+static int fwd_efd;
+static LIST_HEAD(fwd_done_list);
+static pthread_mutex_t fwd_done_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Reads and writes only touch their range, the others the whole object */
+static bool req_overlap(const struct sd_req *a, const struct sd_req *b)
+{
+	if ((a->opcode != SD_OP_READ_OBJ && a->opcode != SD_OP_WRITE_OBJ) ||
+	    (b->opcode != SD_OP_READ_OBJ && b->opcode != SD_OP_WRITE_OBJ))
+		return true;
+
+	return a->obj.offset < b->obj.offset + b->data_length &&
+		b->obj.offset < a->obj.offset + a->data_length;
+}
+
+static struct lagging_oid *lagging_oid_get(uint64_t oid, bool create)
+{
+	struct rb_node **p = &lagging_root.rb_node;
+	struct rb_node *parent = NULL;
+	struct lagging_oid *lag;
+
+	while (*p) {
+		parent = *p;
+		lag = rb_entry(parent, struct lagging_oid, rb);
+		if (oid < lag->oid)
+			p = &(*p)->rb_left;
+		else if (oid > lag->oid)
+			p = &(*p)->rb_right;
+		else
+			return lag;
+	}
+
+	if (!create)
+		return NULL;
+
+	lag = xzalloc(sizeof(*lag));
+	lag->oid = oid;
+	INIT_LIST_HEAD(&lag->fwds);
+	INIT_LIST_HEAD(&lag->waiters);
+	rb_link_node(&lag->rb, parent, p);
+	rb_insert_color(&lag->rb, &lagging_root);
+
+	return lag;
+}
+
+/*
+ * Hold the request if it overlaps a lagging write, return true if held.  It is
+ * queued again when the write is done on all the replicas.
+ *
+ * Local requests are never held, the repairs of the lagging writes are among
+ * them.
+ */
+bool gateway_hold_request(struct request *req)
+{
+	struct lagging_oid *lag;
+	struct gateway_fwd *fwd;
+
+	if (req->local || RB_EMPTY_ROOT(&lagging_root))
+		return false;
+
+	lag = lagging_oid_get(req->rq.obj.oid, false);
+	if (!lag)
+		return false;
+
+	list_for_each_entry(fwd, &lag->fwds, lag_list) {
+		if (req_overlap(&fwd->rq, &req->rq)) {
+			sd_dprintf("%"PRIx64" waits for a lagging write",
+				   lag->oid);
+			list_add_tail(&req->request_list, &lag->waiters);
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/*
+ * The lagging log is an array of fixed size records in sys->dir, one for each
+ * lagging write, and a zero oid marks a free slot.  The slots are allocated
+ * and cleared in the main thread.  A record is synced before the write is
+ * answered, but cleared without a sync: a record left behind only costs a
+ * needless repair.
+ */
+struct lagging_rec {
+	uint64_t oid;
+	/* the range of the write */
+	uint64_t offset;
+	uint32_t length;
+	uint32_t nr_nids;
+	/* the replicas which are known to have the write */
+	struct node_id nids[SD_MAX_COPIES];
+};
+
+static int lagging_fd = -1;
+static unsigned long *lagging_slots;
+static int nr_lagging_slots;
+
+/* the records found at startup, repaired once the cluster is up */
+struct lagging_repair {
+	struct work work;
+	int nr;
+	struct lagging_rec *recs;
+	int *slots;
+	bool *done;
+};
+
+static struct lagging_repair *lagging_repair;
+
+/* Take the slot, growing the bitmap if needed */
+static void lagging_slot_take(int slot)
+{
+	int nr = roundup(slot + 1, BITS_PER_LONG);
+
+	if (nr > nr_lagging_slots) {
+		lagging_slots = xrealloc(lagging_slots, nr / BITS_PER_BYTE);
+		memset((char *)lagging_slots +
+		       nr_lagging_slots / BITS_PER_BYTE, 0,
+		       (nr - nr_lagging_slots) / BITS_PER_BYTE);
+		nr_lagging_slots = nr;
+	}
+	set_bit(slot, lagging_slots);
+}
+
+static int lagging_slot_get(void)
+{
+	int slot = find_next_zero_bit(lagging_slots, nr_lagging_slots, 0);
+
+	lagging_slot_take(slot);
+	return slot;
+}
+
+static void lagging_slot_put(int slot)
+{
+	uint64_t oid = 0;
+
+	if (xpwrite(lagging_fd, &oid, sizeof(oid),
+		    (off_t)slot * sizeof(struct lagging_rec)) != sizeof(oid))
+		/* repaired again on the next start, which is harmless */
+		sd_eprintf("failed to clear the lagging log, %m");
+	clear_bit(slot, lagging_slots);
+}
+
+static int lagging_log_write(int slot, const struct lagging_rec *rec)
+{
+	if (xpwrite(lagging_fd, rec, sizeof(*rec),
+		    (off_t)slot * sizeof(*rec)) != sizeof(*rec) ||
+	    (!sys->nosync && fdatasync(lagging_fd) < 0)) {
+		sd_eprintf("failed to log the lagging write %"PRIx64", %m",
+			   rec->oid);
+		return SD_RES_EIO;
+	}
+
+	return SD_RES_SUCCESS;
+}
+
+static int read_lagging_range(const struct node_id *nid, uint64_t oid,
+			      uint64_t offset, uint32_t len, void *buf)
+{
+	struct sd_req hdr;
+	struct sd_rsp *rsp = (struct sd_rsp *)&hdr;
+	int ret;
+
+	sd_init_req(&hdr, SD_OP_READ_PEER);
+	hdr.epoch = sys_epoch();
+	hdr.data_length = len;
+	hdr.obj.oid = oid;
+	hdr.obj.offset = offset;
+	ret = sheep_exec_req(nid, &hdr, buf);
+	if (ret == SD_RES_SUCCESS)
+		untrim_zero_sectors(buf, rsp->obj.offset, rsp->data_length,
+				    len);
+	return ret;
+}
+
+static int write_lagging_range(const struct node_id *nid, uint8_t opcode,
+			       uint64_t oid, uint64_t offset, uint32_t len,
+			       int nr_copies, void *buf)
+{
+	struct sd_req hdr;
+
+	sd_init_req(&hdr, opcode);
+	hdr.epoch = sys_epoch();
+	hdr.flags = SD_FLAG_CMD_WRITE;
+	hdr.data_length = len;
+	hdr.obj.oid = oid;
+	hdr.obj.offset = offset;
+	hdr.obj.copies = nr_copies;
+	return sheep_exec_req(nid, &hdr, buf);
+}
+
+static bool lagging_rec_has(const struct lagging_rec *rec,
+			    const struct node_id *nid)
+{
+	int i;
+
+	for (i = 0; i < rec->nr_nids; i++)
+		if (node_id_cmp(rec->nids + i, nid) == 0)
+			return true;
+	return false;
+}
+
+/*
+ * Copy the range of the lagging write from a replica which has it to the
+ * replicas of the current placement which aren't known to have it.  Nothing
+ * else is written, so the replicas which got the write keep whatever landed
+ * through the other gateways since then.  A replica which misses the object
+ * gets the whole of it.
+ *
+ * If none of the recorded replicas has the object any more, recovery has
+ * moved it and may have copied the lagging replica, which we can't tell from
+ * the others.  Then the current replicas must agree on the range, or the
+ * record is kept and the object needs 'collie vdi check'.
+ */
+static int repair_lagging_rec(const struct lagging_rec *rec)
+{
+	const struct sd_vnode *vnodes[SD_MAX_COPIES];
+	struct vnode_info *vinfo = get_vnode_info();
+	uint32_t objsize = get_store_objsize(rec->oid), len = rec->length;
+	void *buf = xvalloc(len), *cmp = xvalloc(len), *obj = NULL;
+	const struct node_id *src = NULL, *nid;
+	int i, nr_copies, nr_noobj = 0, nr_found = 0, ret = SD_RES_NO_OBJ;
+
+	nr_copies = get_obj_copy_number(rec->oid, vinfo->nr_zones);
+	vinfo_oid_to_vnodes(vinfo, rec->oid, nr_copies, vnodes);
+
+	for (i = 0; i < rec->nr_nids; i++) {
+		ret = read_lagging_range(rec->nids + i, rec->oid, rec->offset,
+					 len, buf);
+		if (ret == SD_RES_SUCCESS) {
+			src = rec->nids + i;
+			break;
+		}
+		if (ret == SD_RES_NO_OBJ)
+			nr_noobj++;
+	}
+	if (!src && nr_noobj < rec->nr_nids)
+		goto out;
+
+	if (!src) {
+		for (i = 0; i < nr_copies; i++) {
+			ret = read_lagging_range(&vnodes[i]->nid, rec->oid,
+						 rec->offset, len,
+						 nr_found ? cmp : buf);
+			if (ret == SD_RES_NO_OBJ)
+				continue;
+			if (ret != SD_RES_SUCCESS)
+				goto out;
+			if (nr_found++ && memcmp(buf, cmp, len)) {
+				sd_eprintf("the replicas of %"PRIx64" differ"
+					   " since it moved, check the vdi",
+					   rec->oid);
+				ret = SD_RES_EIO;
+				goto out;
+			}
+		}
+		/* removed since then if nobody has it */
+		ret = SD_RES_SUCCESS;
+		goto out;
+	}
+
+	for (i = 0; i < nr_copies; i++) {
+		nid = &vnodes[i]->nid;
+		if (lagging_rec_has(rec, nid))
+			continue;
+
+		ret = write_lagging_range(nid, SD_OP_WRITE_PEER, rec->oid,
+					  rec->offset, len, nr_copies, buf);
+		if (ret != SD_RES_NO_OBJ) {
+			if (ret != SD_RES_SUCCESS)
+				goto out;
+			continue;
+		}
+
+		if (!obj) {
+			obj = xvalloc(objsize);
+			ret = read_lagging_range(src, rec->oid, 0, objsize,
+						 obj);
+			if (ret != SD_RES_SUCCESS)
+				goto out;
+		}
+		ret = write_lagging_range(nid, SD_OP_CREATE_AND_WRITE_PEER,
+					  rec->oid, 0, objsize, nr_copies, obj);
+		if (ret != SD_RES_SUCCESS)
+			goto out;
+	}
+	ret = SD_RES_SUCCESS;
+out:
+	put_vnode_info(vinfo);
+	free(buf);
+	free(cmp);
+	free(obj);
+	return ret;
+}
+
+static void lagging_repair_work(struct work *work)
+{
+	struct lagging_repair *lr = container_of(work, struct lagging_repair,
+						 work);
+	int i, ret;
+
+	wait_get_vdis_done();
+	for (i = 0; i < lr->nr; i++) {
+		ret = repair_lagging_rec(lr->recs + i);
+		if (ret == SD_RES_SUCCESS) {
+			lr->done[i] = true;
+			sd_iprintf("repaired the lagging write %"PRIx64,
+				   lr->recs[i].oid);
+		} else
+			/* kept in the log for the next start */
+			sd_eprintf("failed to repair the lagging write %"PRIx64
+				   ", %s", lr->recs[i].oid, sd_strerror(ret));
+	}
+}
+
+static void lagging_repair_done(struct work *work)
+{
+	struct lagging_repair *lr = container_of(work, struct lagging_repair,
+						 work);
+	int i;
+
+	for (i = 0; i < lr->nr; i++)
+		if (lr->done[i])
+			lagging_slot_put(lr->slots[i]);
+	free(lr->recs);
+	free(lr->slots);
+	free(lr->done);
+	free(lr);
+}
+
+/*
+ * Repair the writes which were still lagging when this sheep stopped.  Called
+ * in the main thread whenever the cluster gets ready, the repair runs once.
+ */
+void gateway_repair_lagging_writes(void)
+{
+	struct lagging_repair *lr = lagging_repair;
+
+	if (!lr || sys->status != SD_STATUS_OK)
+		return;
+
+	lagging_repair = NULL;
+	sd_iprintf("repairing %d lagging writes of the last run", lr->nr);
+	lr->work.fn = lagging_repair_work;
+	lr->work.done = lagging_repair_done;
+	queue_work(sys->gateway_wqueue, &lr->work);
+}
+
+/* Open the lagging log and pick up the records of the last run */
+int gateway_lagging_init(const char *dir)
+{
+	struct lagging_rec rec;
+	struct lagging_repair *lr;
+	char path[PATH_MAX];
+	int slot = 0;
+	ssize_t n;
+
+	snprintf(path, sizeof(path), "%s/lagging_writes", dir);
+	lagging_fd = open(path, O_RDWR | O_CREAT, def_fmode);
+	if (lagging_fd < 0) {
+		sd_eprintf("failed to open %s, %m", path);
+		return -1;
+	}
+
+	lr = xzalloc(sizeof(*lr));
+	while ((n = xpread(lagging_fd, &rec, sizeof(rec),
+			   (off_t)slot * sizeof(rec))) == sizeof(rec)) {
+		if (rec.oid && rec.nr_nids && rec.nr_nids <= SD_MAX_COPIES &&
+		    rec.length) {
+			lr->recs = xrealloc(lr->recs,
+					    (lr->nr + 1) * sizeof(rec));
+			lr->slots = xrealloc(lr->slots,
+					     (lr->nr + 1) * sizeof(int));
+			lr->recs[lr->nr] = rec;
+			lr->slots[lr->nr] = slot;
+			lr->nr++;
+			/* not reused until repaired */
+			lagging_slot_take(slot);
+		}
+		slot++;
+	}
+	if (n < 0) {
+		sd_eprintf("failed to read %s, %m", path);
+		close(lagging_fd);
+		free(lr->recs);
+		free(lr->slots);
+		free(lr);
+		return -1;
+	}
+
+	if (!lr->nr) {
+		free(lr);
+		return 0;
+	}
+
+	lr->done = xzalloc(lr->nr * sizeof(bool));
+	lagging_repair = lr;
+	sd_iprintf("found %d lagging writes in %s", lr->nr, path);
+	return 0;
+}
+
+static void gateway_fwd_free(struct gateway_fwd *fwd)
+{
+	struct lagging_oid *lag = fwd->lag;
+	struct request *req, *t;
+	LIST_HEAD(waiters);
+
+	if (lag) {
+		list_del(&fwd->lag_list);
+		uatomic_dec(&sys->nr_lagging_writes);
+		list_splice_init(&lag->waiters, &waiters);
+		if (list_empty(&lag->fwds)) {
+			rb_erase(&lag->rb, &lagging_root);
+			free(lag);
+		}
+	}
+	free(fwd->data);
+	free(fwd);
+
+	list_for_each_entry_safe(req, t, &waiters, request_list) {
+		list_del(&req->request_list);
+		queue_gateway_request(req);
+	}
+}
+
+static void fwd_repair_work(struct work *work)
+{
+	struct gateway_fwd *fwd = container_of(work, struct gateway_fwd, work);
+	struct sd_req rq = fwd->rq;
+
+	fwd->submit_result = exec_local_req(&rq, fwd->data);
+}
+
+static void fwd_repair_done(struct work *work)
+{
+	struct gateway_fwd *fwd = container_of(work, struct gateway_fwd, work);
+
+	if (fwd->submit_result != SD_RES_SUCCESS)
+		/* the record stays in the log, repaired on the next start */
+		sd_eprintf("failed to repair %"PRIx64", %s", fwd->rq.obj.oid,
+			   sd_strerror(fwd->submit_result));
+	else
+		lagging_slot_put(fwd->lag_slot);
+	gateway_fwd_free(fwd);
+}
+
+static void gateway_fwd_answer(struct gateway_fwd *fwd)
+{
+	struct request *req = fwd->req;
+
+	/* vectored requests share the buffer of the parent */
+	if (req->vec_parent) {
+		if (req->data_length) {
+			fwd->data = xmalloc(req->data_length);
+			memcpy(fwd->data, req->data, req->data_length);
+		}
+	} else {
+		fwd->data = req->data;
+		req->data = NULL;
+	}
+
+	fwd->lag = lagging_oid_get(fwd->rq.obj.oid, true);
+	list_add_tail(&fwd->lag_list, &fwd->lag->fwds);
+	uatomic_inc(&sys->nr_lagging_writes);
+	metric_add(MC_QUORUM_ACKS, 1);
+	fwd->acked = true;
+	fwd->ack_time = get_usec_time();
+	fwd->req = NULL;
+
+	req->rp.result = SD_RES_SUCCESS;
+	trace_req_stage(req, SD_REQ_STAGE_ACKS);
+	req->work.done(&req->work);
+}
+
+static void fwd_log_work(struct work *work)
+{
+	struct gateway_fwd *fwd = container_of(work, struct gateway_fwd, work);
+
+	fwd->submit_result = lagging_log_write(fwd->lag_slot, fwd->lag_rec);
+}
+
+static void gateway_fwd_put(struct gateway_fwd *fwd);
+
+static void fwd_log_done(struct work *work)
+{
+	struct gateway_fwd *fwd = container_of(work, struct gateway_fwd, work);
+
+	free(fwd->lag_rec);
+	fwd->lag_rec = NULL;
+	if (fwd->submit_result == SD_RES_SUCCESS)
+		gateway_fwd_answer(fwd);
+	else {
+		/* wait for all the replicas then */
+		lagging_slot_put(fwd->lag_slot);
+		fwd->quorum = 0;
+	}
+	fwd->submit_result = SD_RES_SUCCESS;
+	gateway_fwd_put(fwd);
+}
+
+/*
+ * Answer the write if it reached the quorum, the rest goes on as lagging.  It
+ * is logged with the replicas which have it first, by fwd_log_work.
+ */
+static void gateway_fwd_ack(struct gateway_fwd *fwd)
+{
+	struct lagging_rec *rec;
+	int i;
+
+	if (!fwd->submitted || !fwd->quorum || fwd->acked || fwd->lag_rec ||
+	    fwd->local_pending || fwd->result != SD_RES_SUCCESS ||
+	    fwd->nr_acks < fwd->quorum)
+		return;
+
+	rec = xzalloc(sizeof(*rec));
+	rec->oid = fwd->rq.obj.oid;
+	rec->offset = fwd->rq.obj.offset;
+	rec->length = fwd->rq.data_length;
+	if (fwd->local_acked)
+		rec->nids[rec->nr_nids++] = sys->this_node.nid;
+	for (i = 0; i < fwd->nr_mreqs; i++)
+		if (fwd->mreqs[i].acked)
+			rec->nids[rec->nr_nids++] = fwd->mreqs[i].nid;
+
+	fwd->lag_rec = rec;
+	fwd->lag_slot = lagging_slot_get();
+	uatomic_inc(&fwd->refcnt);
+	fwd->work.fn = fwd_log_work;
+	fwd->work.done = fwd_log_done;
+	queue_work(sys->fwd_wqueue, &fwd->work);
+}
+
+/* All the replicas of a write answered at the quorum replied */
+static void gateway_fwd_lag_done(struct gateway_fwd *fwd)
+{
+	metric_observe(MH_QUORUM_LAG, get_usec_time() - fwd->ack_time);
+	if (fwd->result == SD_RES_SUCCESS) {
+		lagging_slot_put(fwd->lag_slot);
+		gateway_fwd_free(fwd);
+		return;
+	}
+
+	sd_eprintf("lagging write to %"PRIx64" failed, %s, writing it again",
+		   fwd->rq.obj.oid, sd_strerror(fwd->result));
+	metric_add(MC_QUORUM_REPAIRS, 1);
+	fwd->work.fn = fwd_repair_work;
+	fwd->work.done = fwd_repair_done;
+	queue_work(sys->fwd_wqueue, &fwd->work);
+}
+
+static void gateway_fwd_finish(struct gateway_fwd *fwd)
+{
+	struct request *req = fwd->req;
+
+	if (fwd->acked) {
+		gateway_fwd_lag_done(fwd);
+		return;
+	}
+
+	req->rp.result = fwd->result;
+	if (fwd->is_read && fwd->result == SD_RES_SUCCESS)
+		gateway_untrim_rsp(req);
+	if (fwd->nr_mreqs)
+		trace_req_stage(req, SD_REQ_STAGE_ACKS);
+	free(fwd);
+
+	/* return to the normal completion path, i.e. gateway_op_done() */
+	req->work.done(&req->work);
+}
+
+static void gateway_fwd_set_result(struct gateway_fwd *fwd, int ret)
+{
+	if (ret == SD_RES_SUCCESS)
+		return;
+
+	sd_eprintf("fail %"PRIx64", %s", fwd->hdr.obj.oid, sd_strerror(ret));
+	fwd->result = ret;
+}
+
+/* Pick up the next remote replica to read from, return false if no more */
+static bool gateway_fwd_read_next(struct gateway_fwd *fwd)
+{
+	if (fwd->nr_tried == fwd->nr_remotes)
+		return false;
+
+	fwd->next = fwd->nr_tried++;
+	return true;
+}
+
+static void fwd_read_work(struct work *work);
+static void fwd_submit_done(struct work *work);
+
+static void gateway_fwd_step(struct gateway_fwd *fwd)
+{
+	if (fwd->is_read && fwd->result != SD_RES_SUCCESS &&
+	    gateway_fwd_read_next(fwd)) {
+		uatomic_set(&fwd->refcnt, 1);
+		fwd->result = SD_RES_SUCCESS;
+		fwd->work.fn = fwd_read_work;
+		fwd->work.done = fwd_submit_done;
+		queue_work(sys->fwd_wqueue, &fwd->work);
+		return;
+	}
+
+	gateway_fwd_finish(fwd);
+}
+
+/* Must be called from the main thread */
+static void gateway_fwd_put(struct gateway_fwd *fwd)
+{
+	if (uatomic_sub_return(&fwd->refcnt, 1) > 0) {
+		gateway_fwd_ack(fwd);
+		return;
+	}
+
+	gateway_fwd_step(fwd);
+}
+
+static void fwd_mux_done(struct sockfd_mux_req *mreq)
+{
+	struct fwd_mux_req *fmreq = container_of(mreq, struct fwd_mux_req,
+						 mreq);
+	eventfd_t value = 1;
+
+	pthread_mutex_lock(&fwd_done_lock);
+	list_add_tail(&fmreq->list, &fwd_done_list);
+	pthread_mutex_unlock(&fwd_done_lock);
+
+	eventfd_write(fwd_efd, value);
+}
+
+static void fwd_done_handler(int fd, int events, void *data)
+{
+	struct fwd_mux_req *fmreq, *t;
+	struct gateway_fwd *fwd;
+	eventfd_t value;
+	LIST_HEAD(list);
+
+	if (eventfd_read(fd, &value) < 0)
+		return;
+
+	pthread_mutex_lock(&fwd_done_lock);
+	list_splice_init(&fwd_done_list, &list);
+	pthread_mutex_unlock(&fwd_done_lock);
+
+	list_for_each_entry_safe(fmreq, t, &list, list) {
+		list_del(&fmreq->list);
+		fwd = fmreq->fwd;
+
+		gateway_fwd_set_result(fwd, fmreq->mreq.result);
+		if (fwd->is_read && fmreq->mreq.result == SD_RES_SUCCESS) {
+			account_read_latency(fwd->nids[fwd->next], fwd->start,
+					     &fmreq->mreq.rsp);
+			memcpy(&fwd->req->rp, &fmreq->mreq.rsp,
+			       sizeof(fmreq->mreq.rsp));
+		} else if (fmreq->mreq.result == SD_RES_SUCCESS) {
+			fwd->nr_acks++;
+			fmreq->acked = true;
+		}
+		gateway_fwd_put(fwd);
+	}
+}
+
+static int fwd_submit(struct gateway_fwd *fwd, const struct node_id *nid,
+		      void *data)
+{
+	struct fwd_mux_req *fmreq = fwd->mreqs + fwd->nr_mreqs;
+	int ret;
+
+	fmreq->fwd = fwd;
+	fmreq->nid = *nid;
+	uatomic_inc(&fwd->refcnt);
+	ret = sheep_mux_submit_async(nid, &fwd->hdr, data,
+				     &fmreq->mreq, fwd_mux_done);
+	if (ret != SD_RES_SUCCESS) {
+		/* We still hold the submission reference */
+		uatomic_dec(&fwd->refcnt);
+		return ret;
+	}
+	fwd->nr_mreqs++;
+
+	return SD_RES_SUCCESS;
+}
+
+static void fwd_submit_done(struct work *work)
+{
+	struct gateway_fwd *fwd = container_of(work, struct gateway_fwd, work);
+
+	gateway_fwd_set_result(fwd, fwd->submit_result);
+	fwd->submitted = true;
+	gateway_fwd_put(fwd);
+}
+
+static void fwd_local_work(struct work *work)
+{
+	struct gateway_fwd *fwd = container_of(work, struct gateway_fwd,
+					       local_work);
+	struct request *req = fwd->req;
+
+	/* if the local read fails, we'll try the remote replicas */
+	if (fwd->is_read) {
+		trace_req_stage(req, SD_REQ_STAGE_WORKER);
+		fwd->submit_result = peer_read_obj(req);
+	} else
+		fwd->submit_result = sheep_do_op_work(get_sd_op(fwd->hdr.opcode),
+						      req);
+	trace_req_stage(req, SD_REQ_STAGE_LOCAL_IO);
+}
+
+static void fwd_local_done(struct work *work)
+{
+	struct gateway_fwd *fwd = container_of(work, struct gateway_fwd,
+					       local_work);
+
+	gateway_fwd_set_result(fwd, fwd->submit_result);
+	if (!fwd->is_read && fwd->submit_result == SD_RES_SUCCESS) {
+		fwd->nr_acks++;
+		fwd->local_acked = true;
+	}
+	fwd->local_pending = false;
+	fwd->submit_result = SD_RES_SUCCESS;
+	gateway_fwd_put(fwd);
+}
+
+static void fwd_read_work(struct work *work)
+{
+	struct gateway_fwd *fwd = container_of(work, struct gateway_fwd, work);
+	fwd->nr_mreqs = 0;
+	gateway_init_fwd_hdr(&fwd->hdr, &fwd->req->rq);
+	fwd->start = get_usec_time();
+	trace_req_stage(fwd->req, SD_REQ_STAGE_WORKER);
+	fwd->submit_result = fwd_submit(fwd, fwd->nids[fwd->next], fwd->data);
+	trace_req_stage(fwd->req, SD_REQ_STAGE_FORWARD);
+}
+
+static void fwd_write_work(struct work *work)
+{
+	struct gateway_fwd *fwd = container_of(work, struct gateway_fwd, work);
+	struct request *req = fwd->req;
+	const struct sd_node *target_nodes[SD_MAX_NODES];
+	int i, nr_to_send, local = -1, ret = SD_RES_SUCCESS;
+	void *data;
+
+	trace_req_stage(req, SD_REQ_STAGE_WORKER);
+	nr_to_send = init_target_nodes(req, req->rq.obj.oid, target_nodes);
+	data = init_chain(req, &fwd->hdr, target_nodes, &nr_to_send);
+	/* the head of a chain answers for all of it */
+	if (sys->write_quorum < nr_to_send && !req->local &&
+	    data == req->data && !is_vdi_obj(req->rq.obj.oid))
+		fwd->quorum = sys->write_quorum;
+	for (i = 0; i < nr_to_send; i++) {
+		if (node_is_local(target_nodes[i])) {
+			local = i;
+			continue;
+		}
+
+		ret = fwd_submit(fwd, &target_nodes[i]->nid, data);
+		if (ret != SD_RES_SUCCESS)
+			break;
+	}
+	if (data != req->data)
+		free(data);
+	if (ret != SD_RES_SUCCESS) {
+		fwd->submit_result = ret;
+		return;
+	}
+	trace_req_stage(req, SD_REQ_STAGE_FORWARD);
+
+	if (local != -1) {
+		fwd->local_pending = true;
+		uatomic_inc(&fwd->refcnt);
+		queue_work(md_get_io_wqueue(fwd->hdr.obj.oid),
+			   &fwd->local_work);
+	}
+}
+
+/*
+ * Queue the gateway request asynchronously.
+ *
+ * Return false if the request has to be processed by a gateway worker, for e.g,
+ * requests handled by the object cache or erasure coded objects.
+ */
+bool gateway_async_request(struct request *req)
+{
+	const struct sd_vnode *obj_vnodes[SD_MAX_COPIES];
+	struct gateway_fwd *fwd;
+	int i, nr_copies;
+
+	if (sys->enable_object_cache && !req->local)
+		return false;
+	if (is_erasure_obj(req->rq.obj.oid) &&
+	    req->rq.opcode != SD_OP_REMOVE_OBJ)
+		return false;
+	/* hedged reads wait for the first of the replicas in a worker */
+	if (sys->hedge_percentile && req->rq.opcode == SD_OP_READ_OBJ)
+		return false;
+	/* and so do the reads of the inodes, which go to the inode cache */
+	if (is_vdi_obj(req->rq.obj.oid) && req->rq.opcode == SD_OP_READ_OBJ)
+		return false;
+	/* the creates with SD_FLAG_CMD_LINK write the inode from the worker */
+	if (req->rq.flags & SD_FLAG_CMD_LINK)
+		return false;
+
+	fwd = xzalloc(sizeof(*fwd));
+	fwd->req = req;
+	fwd->result = SD_RES_SUCCESS;
+	fwd->refcnt = 1;
+	fwd->local_work.fn = fwd_local_work;
+	fwd->local_work.done = fwd_local_done;
+	fwd->work.done = fwd_submit_done;
+	gateway_init_fwd_hdr(&fwd->hdr, &req->rq);
+	fwd->rq = req->rq;
+	fwd->data = req->data;
+
+	if (req->rq.opcode != SD_OP_READ_OBJ) {
+		fwd->work.fn = fwd_write_work;
+		queue_work(sys->fwd_wqueue, &fwd->work);
+		return true;
+	}
+
+	fwd->is_read = true;
+	nr_copies = get_req_copy_number(req);
+	vinfo_oid_to_vnodes(req->vinfo, req->rq.obj.oid, nr_copies,
+			    obj_vnodes);
+	fwd->nr_remotes = order_remote_replicas(obj_vnodes, nr_copies,
+						fwd->nids);
+
+	for (i = 0; i < nr_copies; i++) {
+		if (!vnode_is_local(obj_vnodes[i]))
+			continue;
+		queue_work(md_get_io_wqueue(fwd->hdr.obj.oid),
+			   &fwd->local_work);
+		return true;
+	}
+
+	/* no local copy, go straight to the remote replicas */
+	fwd->result = SD_RES_NETWORK_ERROR;
+	fwd->refcnt = 0;
+	gateway_fwd_step(fwd);
+	return true;
+}
+
+int gateway_async_init(void)
+{
+	int ret;
+
+	fwd_efd = eventfd(0, EFD_NONBLOCK);
+	if (fwd_efd < 0) {
+		sd_eprintf("failed to create an event fd: %m");
+		return -1;
+	}
+
+	ret = register_event(fwd_efd, fwd_done_handler, NULL);
+	if (ret) {
+		sd_eprintf("failed to register event fd %m");
+		close(fwd_efd);
+		return -1;
+	}
+
+	return 0;
+}
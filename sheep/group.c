@@ -36,7 +36,7 @@ struct node {
 
 struct get_vdis_work {
 	struct work work;
-	DECLARE_BITMAP(vdi_inuse, SD_NR_VDIS);
+	bool complete;
 	size_t nr_members;
 	struct sd_node members[];
 };
@@ -47,6 +47,23 @@ static bool is_vdi_list_ready = true;
 
 static struct vnode_info *current_vnode_info;
 
+/*
+ * The vnode information of the past epochs never changes, but recovery asks
+ * for it every time it rolls back an epoch for an object, and building it
+ * means reading an epoch log, maybe from a remote node.  Keep the last few
+ * in an LRU, the most recently used first.  Each entry holds a reference.
+ *
+ * A vnode_info is a few megabytes, so only keep a handful.
+ */
+#define VNODE_INFO_CACHE_SIZE 4
+
+static struct vnode_info_cache_entry {
+	uint32_t epoch;
+	uint64_t ctime;
+	struct vnode_info *vinfo;
+} vnode_info_cache[VNODE_INFO_CACHE_SIZE];
+static pthread_mutex_t vnode_info_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
 static size_t get_join_message_size(struct join_message *jm)
 {
 	/*
@@ -158,8 +175,72 @@ void put_vnode_info(struct vnode_info *vnode_info)
 	if (vnode_info) {
 		assert(uatomic_read(&vnode_info->refcnt) > 0);
 
-		if (uatomic_sub_return(&vnode_info->refcnt, 1) == 0)
+		if (uatomic_sub_return(&vnode_info->refcnt, 1) == 0) {
+			free(vnode_info->buckets);
+			free(vnode_info->replicas);
 			free(vnode_info);
+		}
+	}
+}
+
+/*
+ * Precompute the placement of the hash ring so that the I/O path doesn't
+ * have to binary search the vnodes and walk the ring for zone-distinct
+ * successors on every request.
+ *
+ * The hash space is split into a power of two buckets, at least twice as
+ * many as the vnodes, and each bucket points at the first vnode whose id
+ * is not less than the bucket start, so a lookup only steps over a vnode
+ * or so.  The replica set only depends on the first vnode, so the
+ * successors are computed once per vnode.
+ */
+static void build_placement_table(struct vnode_info *vinfo)
+{
+	const struct sd_vnode *vnodes = vinfo->vnodes;
+	int nr_vnodes = vinfo->nr_vnodes, nr_zones = 0, order = 1;
+	int idxs[SD_MAX_COPIES], i, j, idx;
+	uint32_t zones[SD_MAX_COPIES];
+	uint64_t nr_buckets, b;
+
+	if (!nr_vnodes)
+		return;
+
+	/* count the zones that own vnodes, pure gateways have none */
+	for (i = 0; i < nr_vnodes && nr_zones < SD_MAX_COPIES; i++) {
+		for (j = 0; j < nr_zones; j++)
+			if (vnodes[i].zone == zones[j])
+				break;
+		if (j == nr_zones)
+			zones[nr_zones++] = vnodes[i].zone;
+	}
+
+	while ((1ULL << order) < 2ULL * nr_vnodes)
+		order++;
+	nr_buckets = 1ULL << order;
+
+	vinfo->bucket_shift = 64 - order;
+	vinfo->buckets = xmalloc(sizeof(*vinfo->buckets) * nr_buckets);
+	for (b = 0, idx = 0; b < nr_buckets; b++) {
+		while (idx < nr_vnodes &&
+		       vnodes[idx].id < (b << vinfo->bucket_shift))
+			idx++;
+		/* the ones past the last vnode scan to the end and wrap */
+		vinfo->buckets[b] = min(idx, nr_vnodes - 1);
+	}
+
+	vinfo->nr_replicas = nr_zones - 1;
+	if (!vinfo->nr_replicas)
+		return;
+
+	vinfo->replicas = xmalloc(sizeof(*vinfo->replicas) * nr_vnodes *
+				  vinfo->nr_replicas);
+	for (i = 0; i < nr_vnodes; i++) {
+		idxs[0] = i;
+		for (j = 1; j < nr_zones; j++) {
+			idxs[j] = get_vnode_next_idx(vnodes, nr_vnodes, idxs, j);
+			vinfo->replicas[i * vinfo->nr_replicas + j - 1] =
+				idxs[j];
+		}
 	}
 }
 
@@ -176,18 +257,81 @@ static struct vnode_info *alloc_vnode_info(const struct sd_node *nodes,
 
 	recalculate_vnodes(vnode_info->nodes, nr_nodes);
 
-	vnode_info->nr_vnodes = nodes_to_vnodes(vnode_info->nodes, nr_nodes,
-						vnode_info->vnodes);
+	vnode_info->placement = sys->placement;
+	vnode_info->nr_vnodes = placement_nodes_to_vnodes(sys->placement,
+							  vnode_info->nodes,
+							  nr_nodes,
+							  vnode_info->vnodes);
 	vnode_info->nr_zones = get_zones_nr_from(nodes, nr_nodes);
+	if (vnode_info->placement == SD_PLACEMENT_RING)
+		build_placement_table(vnode_info);
 	uatomic_set(&vnode_info->refcnt, 1);
 	return vnode_info;
 }
 
+/* Must be called with vnode_info_cache_lock held */
+static struct vnode_info *vnode_info_cache_lookup(uint32_t epoch,
+						  uint64_t ctime)
+{
+	struct vnode_info_cache_entry e;
+	int i;
+
+	for (i = 0; i < VNODE_INFO_CACHE_SIZE; i++) {
+		if (!vnode_info_cache[i].vinfo ||
+		    vnode_info_cache[i].epoch != epoch ||
+		    vnode_info_cache[i].ctime != ctime)
+			continue;
+
+		/* move it to the head */
+		e = vnode_info_cache[i];
+		memmove(vnode_info_cache + 1, vnode_info_cache,
+			sizeof(e) * i);
+		vnode_info_cache[0] = e;
+		return grab_vnode_info(e.vinfo);
+	}
+
+	return NULL;
+}
+
+/* Must be called with vnode_info_cache_lock held */
+static void vnode_info_cache_insert(uint32_t epoch, uint64_t ctime,
+				    struct vnode_info *vinfo)
+{
+	struct vnode_info_cache_entry *last;
+
+	last = vnode_info_cache + VNODE_INFO_CACHE_SIZE - 1;
+	put_vnode_info(last->vinfo);
+	memmove(vnode_info_cache + 1, vnode_info_cache,
+		sizeof(*last) * (VNODE_INFO_CACHE_SIZE - 1));
+
+	vnode_info_cache[0].epoch = epoch;
+	vnode_info_cache[0].ctime = ctime;
+	vnode_info_cache[0].vinfo = grab_vnode_info(vinfo);
+}
+
+/*
+ * Get the vnode information of the epoch.  Past epochs are immutable so
+ * they are served from the cache, the current one may still be rewritten
+ * while the cluster waits for the nodes to join.
+ *
+ * This can be called from any thread.
+ */
 struct vnode_info *get_vnode_info_epoch(uint32_t epoch)
 {
 	struct sd_node nodes[SD_MAX_NODES];
+	struct vnode_info *vinfo, *cached;
+	uint64_t ctime = get_cluster_ctime();
+	bool cacheable = before(epoch, sys->epoch);
 	int nr_nodes;
 
+	if (cacheable) {
+		pthread_mutex_lock(&vnode_info_cache_lock);
+		vinfo = vnode_info_cache_lookup(epoch, ctime);
+		pthread_mutex_unlock(&vnode_info_cache_lock);
+		if (vinfo)
+			return vinfo;
+	}
+
 	nr_nodes = epoch_log_read(epoch, nodes, sizeof(nodes));
 	if (nr_nodes < 0) {
 		nr_nodes = epoch_log_read_remote(epoch, nodes, sizeof(nodes),
@@ -196,7 +340,36 @@ struct vnode_info *get_vnode_info_epoch(uint32_t epoch)
 			return NULL;
 	}
 
-	return alloc_vnode_info(nodes, nr_nodes);
+	vinfo = alloc_vnode_info(nodes, nr_nodes);
+	if (!cacheable)
+		return vinfo;
+
+	pthread_mutex_lock(&vnode_info_cache_lock);
+	/* somebody may have built the same one meanwhile */
+	cached = vnode_info_cache_lookup(epoch, ctime);
+	if (cached) {
+		put_vnode_info(vinfo);
+		vinfo = cached;
+	} else
+		vnode_info_cache_insert(epoch, ctime, vinfo);
+	pthread_mutex_unlock(&vnode_info_cache_lock);
+
+	return vinfo;
+}
+
+/*
+ * Rebuild the current vnode information after the placement engine has
+ * changed, i.e. when the cluster is formatted.
+ *
+ * Must be called from the main thread.
+ */
+void refresh_vnode_info(void)
+{
+	struct vnode_info *old_vnode_info = current_vnode_info;
+
+	current_vnode_info = alloc_vnode_info(old_vnode_info->nodes,
+					      old_vnode_info->nr_nodes);
+	put_vnode_info(old_vnode_info);
 }
 
 int local_get_node_list(const struct sd_req *req, struct sd_rsp *rsp,
@@ -532,6 +705,13 @@ static int cluster_sanity_check(struct join_message *jm)
 		return CJ_RES_FAIL;
 	}
 
+	if (jm->placement != sys->placement) {
+		sd_eprintf("joining node placement doesn't match: %s vs %s",
+			   placement_to_str(jm->placement),
+			   placement_to_str(sys->placement));
+		return CJ_RES_FAIL;
+	}
+
 	return CJ_RES_SUCCESS;
 }
 
@@ -637,10 +817,10 @@ static int cluster_running_check(struct join_message *jm)
 	return CJ_RES_SUCCESS;
 }
 
-static int get_vdis_from(struct sd_node *node)
+static int get_vdis_from(struct sd_node *node, uint32_t since, bool *complete)
 {
-	struct sd_req hdr;
-	struct sd_rsp *rsp = (struct sd_rsp *)&hdr;
+	struct sd_vdi_copies_req hdr;
+	struct sd_vdi_copies_rsp *rsp = (struct sd_vdi_copies_rsp *)&hdr;
 	struct vdi_copy *vc = NULL;
 	int i, ret = SD_RES_SUCCESS;
 	unsigned int rlen;
@@ -651,27 +831,42 @@ static int get_vdis_from(struct sd_node *node)
 
 	rlen = SD_DATA_OBJ_SIZE; /* FIXME */
 	vc = xzalloc(rlen);
-	sd_init_req(&hdr, SD_OP_GET_VDI_COPIES);
+	sd_init_req((struct sd_req *)&hdr, SD_OP_GET_VDI_COPIES);
 	hdr.data_length = rlen;
 	hdr.epoch = sys_epoch();
-	ret = sheep_exec_req(&node->nid, &hdr, (char *)vc);
+	hdr.since = since;
+	ret = sheep_exec_req(&node->nid, (struct sd_req *)&hdr, (char *)vc);
 	if (ret != SD_RES_SUCCESS)
 		goto out;
 
 	count = rsp->data_length / sizeof(*vc);
 	for (i = 0; i < count; i++) {
 		set_bit(vc[i].vid, sys->vdi_inuse);
-		add_vdi_copy_number(vc[i].vid, vc[i].nr_copies);
+		add_vdi_copy_number(vc[i].vid, vc[i].nr_copies,
+				    vc[i].copy_policy, vc[i].block_size_shift);
 	}
+	*complete = !!(rsp->list_flags & SD_VDI_COPIES_COMPLETE);
+	sd_dprintf("%d entries since epoch %" PRIu32 " from %s%s", count, since,
+		   node_to_str(node), *complete ? ", complete" : "");
 out:
 	free(vc);
 	return ret;
 }
 
+/*
+ * A node which knows every VDI answers for the whole cluster, so we only
+ * have to ask the others until one of them does.  Otherwise (the cluster is
+ * starting up) the union of all the members is the complete list.
+ *
+ * If the list saved at our last epoch was complete, the peers only need to
+ * send the VDIs changed since then.
+ */
 static void do_get_vdis(struct work *work)
 {
 	struct get_vdis_work *w =
 		container_of(work, struct get_vdis_work, work);
+	uint32_t since = get_vdi_list_sync_epoch();
+	bool complete = false, failed = false;
 	int i, ret;
 
 	for (i = 0; i < w->nr_members; i++) {
@@ -679,18 +874,18 @@ static void do_get_vdis(struct work *work)
 		if (node_eq(&w->members[i], &sys->this_node))
 			continue;
 
-		ret = get_vdis_from(&w->members[i]);
-		if (ret != SD_RES_SUCCESS)
+		ret = get_vdis_from(&w->members[i], since, &complete);
+		if (ret != SD_RES_SUCCESS) {
 			/* try to read from another node */
+			failed = true;
 			continue;
+		}
 
-		/*
-		 * If a new comer try to join the running cluster, it only
-		 * need read one copy of bitmap from one of other members.
-		 */
-		if (sys->status == SD_STATUS_WAIT_FOR_FORMAT)
+		if (complete)
 			break;
 	}
+
+	w->complete = complete || !failed;
 }
 
 static void get_vdis_done(struct work *work)
@@ -698,6 +893,11 @@ static void get_vdis_done(struct work *work)
 	struct get_vdis_work *w =
 		container_of(work, struct get_vdis_work, work);
 
+	if (w->complete) {
+		sys->vdi_list_complete = true;
+		save_vdi_copy_list(sys->epoch);
+	}
+
 	pthread_mutex_lock(&wait_vdis_lock);
 	is_vdi_list_ready = true;
 	pthread_cond_broadcast(&wait_vdis_cond);
@@ -708,6 +908,8 @@ static void get_vdis_done(struct work *work)
 
 int log_current_epoch(void)
 {
+	save_vdi_copy_list(sys->epoch);
+
 	if (!current_vnode_info)
 		return update_epoch_log(sys->epoch, NULL, 0);
 	return update_epoch_log(sys->epoch, current_vnode_info->nodes,
@@ -766,6 +968,7 @@ static void finish_join(const struct join_message *msg,
 
 	sys->join_finished = true;
 	sys->epoch = msg->epoch;
+	sys->placement = msg->placement;
 
 	if (msg->cluster_status != SD_STATUS_OK)
 		update_exceptional_node_list(get_latest_epoch(), msg);
@@ -869,10 +1072,12 @@ static void update_cluster_info(const struct join_message *msg,
 
 			set_cluster_copies(sys->nr_copies);
 			set_cluster_flags(sys->flags);
+			set_cluster_placement(sys->placement);
 			set_cluster_ctime(msg->ctime);
 			/*FALLTHROUGH*/
 		case SD_STATUS_WAIT_FOR_JOIN:
 			sys->disable_recovery = msg->disable_recovery;
+			sys->recovery_throttle = msg->recovery_throttle;
 			get_vdis(nodes, nr_nodes);
 			break;
 		default:
@@ -905,6 +1110,7 @@ static void update_cluster_info(const struct join_message *msg,
 	put_vnode_info(old_vnode_info);
 
 	sockfd_cache_add(&joined->nid);
+	gateway_repair_lagging_writes();
 }
 
 /*
@@ -1031,10 +1237,12 @@ enum cluster_join_result sd_check_join_cb(const struct sd_node *joining,
 
 	jm->nr_copies = sys->nr_copies;
 	jm->cluster_flags = sys->flags;
+	jm->placement = sys->placement;
 	jm->epoch = sys->epoch;
 	jm->ctime = get_cluster_ctime();
 	jm->nr_failed_nodes = 0;
 	jm->disable_recovery = sys->disable_recovery;
+	jm->recovery_throttle = sys->recovery_throttle;
 
 	if (sd_store)
 		pstrcpy((char *)jm->store, sizeof(jm->store), sd_store->name);
@@ -1054,6 +1262,7 @@ static int send_join_request(struct sd_node *ent)
 	msg->proto_ver = SD_SHEEP_PROTO_VER;
 	msg->nr_copies = sys->nr_copies;
 	msg->cluster_flags = sys->flags;
+	msg->placement = sys->placement;
 	msg->epoch = sys->epoch;
 	msg->ctime = get_cluster_ctime();
 
@@ -1202,10 +1411,68 @@ void sd_leave_handler(const struct sd_node *left, const struct sd_node *members,
 	sockfd_cache_del(&left->nid);
 }
 
+/*
+ * A node has changed its information, e.g. it has lost a disk.  The vnodes
+ * are weighted by the node capacities, so this changes the placement and we
+ * start a new epoch just like for a membership change.
+ */
+void sd_update_node_handler(const struct sd_node *updated,
+			    const struct sd_node *members, size_t nr_members)
+{
+	struct vnode_info *old_vnode_info;
+
+	sd_dprintf("update %s, space %" PRIu64, node_to_str(updated),
+		   updated->space);
+
+	if (sys->status == SD_STATUS_SHUTDOWN)
+		return;
+
+	old_vnode_info = current_vnode_info;
+	current_vnode_info = alloc_vnode_info(members, nr_members);
+	switch (sys->status) {
+	case SD_STATUS_HALT:
+	case SD_STATUS_OK:
+		uatomic_inc(&sys->epoch);
+		log_current_epoch();
+		start_recovery(current_vnode_info, old_vnode_info);
+		break;
+	default:
+		break;
+	}
+
+	put_vnode_info(old_vnode_info);
+}
+
+/*
+ * Advertise the new capacity of this node to the cluster so that the vnode
+ * weights follow it.  Return true if the cluster is told, then the new epoch
+ * starts a recovery.
+ */
+bool update_node_space(uint64_t space)
+{
+	if (sys->gateway_only || sys->this_node.space == space)
+		return false;
+
+	sd_iprintf("capacity changes from %" PRIu64 " to %" PRIu64,
+		   sys->this_node.space, space);
+	sys->this_node.space = space;
+	set_cluster_space(space);
+
+	if (!sys->join_finished || !sys->cdrv->update_node)
+		return false;
+
+	if (sys->cdrv->update_node(&sys->this_node) < 0) {
+		sd_eprintf("failed to update the node information");
+		return false;
+	}
+
+	return true;
+}
+
 int create_cluster(int port, int64_t zone, int nr_vnodes,
 		   bool explicit_addr)
 {
-	int ret;
+	int ret, i;
 
 	if (!sys->cdrv) {
 		sys->cdrv = find_cdrv("corosync");
@@ -1248,6 +1515,7 @@ int create_cluster(int port, int64_t zone, int nr_vnodes,
 		sys->status = SD_STATUS_WAIT_FOR_JOIN;
 		get_cluster_copies(&sys->nr_copies);
 		get_cluster_flags(&sys->flags);
+		get_cluster_placement(&sys->placement);
 
 	} else {
 		sys->status = SD_STATUS_WAIT_FOR_FORMAT;
@@ -1260,6 +1528,8 @@ int create_cluster(int port, int64_t zone, int nr_vnodes,
 
 	INIT_LIST_HEAD(&sys->local_req_queue);
 	INIT_LIST_HEAD(&sys->req_wait_queue);
+	for (i = 0; i < REQ_OID_WAIT_QUEUES; i++)
+		INIT_LIST_HEAD(&sys->req_oid_wait_queue[i]);
 
 	ret = send_join_request(&sys->this_node);
 	if (ret != 0)
@@ -0,0 +1,288 @@
+/*
+ * Copyright (C) 2013 Taobao Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The inode cache keeps the recently read inodes in the gateway, so that the
+ * metadata operations and collie, which read them over and over, don't read
+ * up to 4 MB from the replicas each time.
+ *
+ *    0 an inode is read whole the first time and cached without the zeros at
+ *      its end, every read of the vdi object is then served from memory.
+ *    1 a write to an inode drops it from the cache of its gateway when it is
+ *      queued and when it is done, and is then broadcast with
+ *      SD_OP_NOTIFY_INODE_UPDATE so that the other sheep drop it too.  The
+ *      write is acked only once the broadcast is delivered back to its
+ *      gateway, so a client which was told that the write is done doesn't
+ *      find the old inode on the sheep which already got the broadcast.
+ *    2 a read which fills the cache doesn't insert what it read if the inode
+ *      was invalidated meanwhile, the invalidations bump a generation of the
+ *      shard of the vid for that.
+ *    3 the entries are stamped with the epoch they were read at and are only
+ *      used in that epoch, since a gateway which dies in the middle of a write
+ *      never broadcasts it.
+ *    4 the least recently used inodes are dropped beyond INODE_CACHE_SIZE.
+ */
+#include <pthread.h>
+
+#include "sheep_priv.h"
+#include "list.h"
+#include "rbtree.h"
+
+#define INODE_CACHE_SIZE (64 * 1024 * 1024)
+#define INODE_CACHE_GENS 256
+
+struct inode_cache_entry {
+	struct rb_node rb;
+	struct list_head lru;
+	uint32_t vid;
+	uint32_t epoch;
+	/* the inode up to its last non-zero byte, the rest is all zero */
+	uint32_t length;
+	char *data;
+	int refcnt;
+	bool cached;
+};
+
+static pthread_mutex_t inode_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct rb_root inode_cache_root = RB_ROOT;
+/* the least recently used first */
+static LIST_HEAD(inode_cache_lru);
+static size_t inode_cache_bytes;
+static uint64_t inode_cache_gens[INODE_CACHE_GENS];
+
+static struct inode_cache_entry *inode_cache_lookup(uint32_t vid)
+{
+	struct rb_node *n = inode_cache_root.rb_node;
+	struct inode_cache_entry *entry;
+
+	while (n) {
+		entry = rb_entry(n, struct inode_cache_entry, rb);
+
+		if (vid < entry->vid)
+			n = n->rb_left;
+		else if (vid > entry->vid)
+			n = n->rb_right;
+		else
+			return entry;
+	}
+
+	return NULL;
+}
+
+static void inode_cache_link(struct inode_cache_entry *new)
+{
+	struct rb_node **p = &inode_cache_root.rb_node;
+	struct rb_node *parent = NULL;
+	struct inode_cache_entry *entry;
+
+	while (*p) {
+		parent = *p;
+		entry = rb_entry(parent, struct inode_cache_entry, rb);
+
+		if (new->vid < entry->vid)
+			p = &(*p)->rb_left;
+		else
+			p = &(*p)->rb_right;
+	}
+	rb_link_node(&new->rb, parent, p);
+	rb_insert_color(&new->rb, &inode_cache_root);
+	list_add_tail(&new->lru, &inode_cache_lru);
+	new->cached = true;
+	inode_cache_bytes += new->length;
+}
+
+static void free_inode_cache_entry(struct inode_cache_entry *entry)
+{
+	free(entry->data);
+	free(entry);
+}
+
+/* Must be called with inode_cache_lock held */
+static void inode_cache_unlink(struct inode_cache_entry *entry)
+{
+	rb_erase(&entry->rb, &inode_cache_root);
+	list_del(&entry->lru);
+	entry->cached = false;
+	inode_cache_bytes -= entry->length;
+	if (!entry->refcnt)
+		free_inode_cache_entry(entry);
+}
+
+static inline uint64_t *vid_to_gen(uint32_t vid)
+{
+	return inode_cache_gens + vid % INODE_CACHE_GENS;
+}
+
+/* The generation to pass to inode_cache_insert() for what is read from now */
+uint64_t inode_cache_gen(uint32_t vid)
+{
+	uint64_t gen;
+
+	pthread_mutex_lock(&inode_cache_lock);
+	gen = *vid_to_gen(vid);
+	pthread_mutex_unlock(&inode_cache_lock);
+
+	return gen;
+}
+
+/*
+ * Copy the range of the cached inode into 'buf', return false if the inode
+ * isn't cached for the current epoch.
+ */
+bool inode_cache_read(uint32_t vid, void *buf, uint64_t offset, uint32_t len)
+{
+	struct inode_cache_entry *entry;
+	uint64_t end;
+
+	pthread_mutex_lock(&inode_cache_lock);
+	entry = inode_cache_lookup(vid);
+	if (entry && entry->epoch != sys_epoch()) {
+		inode_cache_unlink(entry);
+		entry = NULL;
+	}
+	if (entry) {
+		entry->refcnt++;
+		list_move_tail(&entry->lru, &inode_cache_lru);
+	}
+	pthread_mutex_unlock(&inode_cache_lock);
+
+	if (!entry) {
+		metric_add(MC_INODE_CACHE_MISSES, 1);
+		return false;
+	}
+
+	end = min(offset + len, (uint64_t)entry->length);
+	if (offset < end) {
+		memcpy(buf, entry->data + offset, end - offset);
+		memset((char *)buf + end - offset, 0, len - (end - offset));
+	} else
+		memset(buf, 0, len);
+	metric_add(MC_INODE_CACHE_HITS, 1);
+
+	pthread_mutex_lock(&inode_cache_lock);
+	if (!--entry->refcnt && !entry->cached)
+		free_inode_cache_entry(entry);
+	pthread_mutex_unlock(&inode_cache_lock);
+
+	return true;
+}
+
+/*
+ * Cache the whole inode read at 'epoch', unless it was invalidated since
+ * inode_cache_gen() returned 'gen'.
+ */
+void inode_cache_insert(uint32_t vid, uint64_t gen, uint32_t epoch,
+			const struct sheepdog_inode *inode)
+{
+	const uint64_t *p = (const uint64_t *)inode;
+	struct inode_cache_entry *new, *entry;
+	uint32_t n = SD_INODE_SIZE / sizeof(*p);
+
+	while (n && !p[n - 1])
+		n--;
+
+	new = xzalloc(sizeof(*new));
+	new->vid = vid;
+	new->epoch = epoch;
+	new->length = n * sizeof(*p);
+	new->data = xmalloc(new->length);
+	memcpy(new->data, inode, new->length);
+	INIT_LIST_HEAD(&new->lru);
+
+	pthread_mutex_lock(&inode_cache_lock);
+	if (gen != *vid_to_gen(vid) || epoch != sys_epoch()) {
+		pthread_mutex_unlock(&inode_cache_lock);
+		free_inode_cache_entry(new);
+		return;
+	}
+
+	entry = inode_cache_lookup(vid);
+	if (entry)
+		inode_cache_unlink(entry);
+
+	while (inode_cache_bytes + new->length > INODE_CACHE_SIZE &&
+	       !list_empty(&inode_cache_lru)) {
+		entry = list_first_entry(&inode_cache_lru,
+					 struct inode_cache_entry, lru);
+		inode_cache_unlink(entry);
+	}
+	inode_cache_link(new);
+	pthread_mutex_unlock(&inode_cache_lock);
+
+	sd_dprintf("%" PRIx32 ", %" PRIu32 " bytes", vid, new->length);
+}
+
+void inode_cache_invalidate(uint32_t vid)
+{
+	struct inode_cache_entry *entry;
+
+	pthread_mutex_lock(&inode_cache_lock);
+	(*vid_to_gen(vid))++;
+	entry = inode_cache_lookup(vid);
+	if (entry)
+		inode_cache_unlink(entry);
+	pthread_mutex_unlock(&inode_cache_lock);
+}
+
+/* Drop all the inodes, for when the objects are rewritten behind the gateway */
+void inode_cache_purge(void)
+{
+	struct inode_cache_entry *entry, *n;
+	int i;
+
+	pthread_mutex_lock(&inode_cache_lock);
+	for (i = 0; i < INODE_CACHE_GENS; i++)
+		inode_cache_gens[i]++;
+	list_for_each_entry_safe(entry, n, &inode_cache_lru, lru)
+		inode_cache_unlink(entry);
+	pthread_mutex_unlock(&inode_cache_lock);
+}
+
+static inline bool is_inode_update(const struct sd_req *hdr)
+{
+	switch (hdr->opcode) {
+	case SD_OP_CREATE_AND_WRITE_OBJ:
+	case SD_OP_WRITE_OBJ:
+	case SD_OP_REMOVE_OBJ:
+	case SD_OP_DISCARD_OBJ:
+		return is_vdi_obj(hdr->obj.oid);
+	default:
+		return false;
+	}
+}
+
+/* Called from the main thread when a gateway request is queued */
+void inode_cache_write_begin(const struct request *req)
+{
+	if (is_inode_update(&req->rq))
+		inode_cache_invalidate(oid_to_vid(req->rq.obj.oid));
+}
+
+/*
+ * Called from the main thread when a gateway request is done, return true if
+ * its ack is deferred until the update is delivered to the cluster.
+ */
+bool inode_cache_write_end(struct request *req)
+{
+	struct sd_req hdr;
+
+	if (!is_inode_update(&req->rq))
+		return false;
+
+	inode_cache_invalidate(oid_to_vid(req->rq.obj.oid));
+	if (req->vinfo && req->vinfo->nr_nodes < 2)
+		return false;
+
+	sd_init_req(&hdr, SD_OP_NOTIFY_INODE_UPDATE);
+	hdr.obj.oid = req->rq.obj.oid;
+	queue_local_req_nowait(&hdr, req);
+	return true;
+}
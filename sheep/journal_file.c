@@ -18,14 +18,28 @@
 #include <pthread.h>
 #include <stdint.h>
 #include <sys/mman.h>
+#include <sys/time.h>
 
 #include "sheep_priv.h"
 
+/*
+ * Directories that received journaled writes since a journal file was last
+ * committed, so that committing it only needs to sync the file systems of
+ * these directories.
+ */
+#define MAX_DIRTY_DIRS 64
+
+struct dirty_dirs {
+	int nr;
+	bool overflow; /* too many to track, fall back to sync() */
+	char *dirs[MAX_DIRTY_DIRS];
+};
+
 struct journal_file {
 	int fd;
 	off_t pos;
 	int commit_fd;
-	uatomic_bool in_commit;
+	bool in_commit;
 };
 
 struct journal_descriptor {
@@ -44,6 +58,16 @@ struct journal_descriptor {
 #define JOURNAL_MARKER_SIZE 4 /* Use marker to detect partial write */
 #define JOURNAL_META_SIZE (JOURNAL_DESC_SIZE + JOURNAL_MARKER_SIZE)
 
+/*
+ * Aligned entries put the descriptor and the end marker in sectors of their
+ * own, so that the payload starts at a sector boundary and can be handed to
+ * pwritev() straight from the request buffer without a bounce copy.
+ *
+ * | desc (512) | payload (rounded up to 512) | pad ... marker (512) |
+ */
+#define JOURNAL_DESC_MAGIC_ALIGNED 0xfee1901d
+#define JOURNAL_ALIGNED_META_SIZE (2 * SECTOR_SIZE)
+
 #define JOURNAL_END_MARKER 0xdeadbeef
 
 static const char *jfile_name[2] = { "journal_file0", "journal_file1", };
@@ -51,7 +75,12 @@ static int jfile_fds[2];
 static size_t jfile_size;
 
 static struct journal_file jfile;
-static pthread_spinlock_t jfile_lock;
+static pthread_mutex_t jfile_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t jfile_commit_cond = PTHREAD_COND_INITIALIZER;
+static struct dirty_dirs jfile_dirty[2]; /* indexed as jfile_fds */
+
+/* Writers that had to wait for a commit to finish, protected by jfile_lock */
+static uint64_t nr_commit_stalls, commit_stall_us;
 
 static int create_journal_file(const char *root, const char *name)
 {
@@ -117,10 +146,30 @@ out:
 	return -1;
 }
 
+static inline bool journal_entry_aligned(const struct journal_descriptor *jd)
+{
+	return jd->magic == JOURNAL_DESC_MAGIC_ALIGNED;
+}
+
+static inline size_t journal_entry_size(const struct journal_descriptor *jd)
+{
+	size_t meta = journal_entry_aligned(jd) ?
+		JOURNAL_ALIGNED_META_SIZE : JOURNAL_META_SIZE;
+
+	return meta + roundup(jd->size, SECTOR_SIZE);
+}
+
+static inline char *journal_entry_data(struct journal_descriptor *jd)
+{
+	size_t off = journal_entry_aligned(jd) ?
+		SECTOR_SIZE : JOURNAL_DESC_SIZE;
+
+	return (char *)jd + off;
+}
+
 static bool journal_entry_full_write(struct journal_descriptor *jd)
 {
-	char *end = (char *)jd +
-		roundup(jd->size, SECTOR_SIZE) + JOURNAL_META_SIZE;
+	char *end = (char *)jd + journal_entry_size(jd);
 	uint32_t marker = *(((uint32_t *)end) - 1);
 
 	if (marker != JOURNAL_END_MARKER)
@@ -133,12 +182,14 @@ static int replay_journal_entry(struct journal_descriptor *jd)
 	char path[PATH_MAX];
 	ssize_t size;
 	int fd, flags = O_WRONLY, ret = 0;
-	void *buf;
-	char *p = (char *)jd;
 
 	sd_dprintf("%"PRIx64", size %"PRIu64", off %"PRIu64", %d", jd->oid,
 		   jd->size, jd->offset, jd->create);
 
+	/* the object may have been deduplicated since the write was logged */
+	if (make_object_private(jd->oid) != SD_RES_SUCCESS)
+		return -1;
+
 	if (jd->create)
 		flags |= O_CREAT;
 	snprintf(path, sizeof(path), "%s%016" PRIx64, obj_path, jd->oid);
@@ -149,14 +200,11 @@ static int replay_journal_entry(struct journal_descriptor *jd)
 	}
 
 	if (jd->create) {
-		ret = prealloc(fd, get_objsize(jd->oid));
+		ret = prealloc(fd, get_store_objsize(jd->oid));
 		if (ret < 0)
 			goto out;
 	}
-	buf = xmalloc(jd->size);
-	p += JOURNAL_DESC_SIZE;
-	memcpy(buf, p, jd->size);
-	size = xpwrite(fd, buf, jd->size, jd->offset);
+	size = xpwrite(fd, journal_entry_data(jd), jd->size, jd->offset);
 	if (size != jd->size) {
 		sd_eprintf("write %zd, size %zu, errno %m", size, jd->size);
 		ret = -1;
@@ -189,7 +237,8 @@ static int do_recover(int fd)
 	end = (char *)map + st.st_size;
 	for (p = map; p < end;) {
 		jd = (struct journal_descriptor *)p;
-		if (jd->magic != JOURNAL_DESC_MAGIC) {
+		if (jd->magic != JOURNAL_DESC_MAGIC &&
+		    jd->magic != JOURNAL_DESC_MAGIC_ALIGNED) {
 			/* Empty area */
 			p += SECTOR_SIZE;
 			continue;
@@ -201,7 +250,7 @@ static int do_recover(int fd)
 		if (replay_journal_entry(jd) < 0)
 			return -1;
 skip:
-		p += JOURNAL_META_SIZE + roundup(jd->size, SECTOR_SIZE);
+		p += journal_entry_size(jd);
 	}
 	munmap(map, st.st_size);
 	/* Do a final sync() to assure data is reached to the disk */
@@ -251,7 +300,6 @@ int journal_file_init(const char *path, size_t size, bool skip)
 	fd = create_journal_file(path, jfile_name[1]);
 	jfile_fds[1] = fd;
 
-	pthread_spin_init(&jfile_lock, PTHREAD_PROCESS_PRIVATE);
 	return 0;
 }
 
@@ -262,14 +310,91 @@ static inline bool jfile_enough_space(size_t size)
 	return true;
 }
 
+static inline int jfile_index(int fd)
+{
+	return fd == jfile_fds[0] ? 0 : 1;
+}
+
+static void mark_dirty_dir(struct dirty_dirs *dd, const char *dir)
+{
+	int i;
+
+	if (dd->overflow)
+		return;
+
+	for (i = 0; i < dd->nr; i++)
+		if (strcmp(dd->dirs[i], dir) == 0)
+			return;
+
+	if (dd->nr == MAX_DIRTY_DIRS) {
+		dd->overflow = true;
+		return;
+	}
+	dd->dirs[dd->nr] = strdup(dir);
+	if (!dd->dirs[dd->nr]) {
+		dd->overflow = true;
+		return;
+	}
+	dd->nr++;
+}
+
+static void merge_dirty_dirs(struct dirty_dirs *dst,
+			     const struct dirty_dirs *src)
+{
+	int i;
+
+	if (src->overflow)
+		dst->overflow = true;
+	for (i = 0; i < src->nr; i++)
+		mark_dirty_dir(dst, src->dirs[i]);
+}
+
+static void reset_dirty_dirs(struct dirty_dirs *dd)
+{
+	int i;
+
+	for (i = 0; i < dd->nr; i++)
+		free(dd->dirs[i]);
+	dd->nr = 0;
+	dd->overflow = false;
+}
+
+static void sync_dirty_dirs(const struct dirty_dirs *dd)
+{
+	int i, fd;
+
+	if (dd->overflow) {
+		sync();
+		return;
+	}
+
+	for (i = 0; i < dd->nr; i++) {
+		sd_dprintf("%s", dd->dirs[i]);
+		fd = open(dd->dirs[i], O_RDONLY | O_DIRECTORY);
+		if (fd < 0) {
+			/* The disk might have been unplugged */
+			sd_eprintf("failed to open %s, %m", dd->dirs[i]);
+			continue;
+		}
+		if (syncfs(fd) < 0) {
+			sd_eprintf("failed to sync %s, %m", dd->dirs[i]);
+			sync();
+		}
+		close(fd);
+	}
+}
+
 /*
  * We rely on the kernel's page cache to cache data objects to 1) boost read
  * perfmance 2) simplify read path so that data commiting is simply a
- * sync() operation and We do it in a dedicated thread to avoid blocking
- * the writer by switch back and forth between two journal files.
+ * syncfs() of the disks that were written to, and We do it in a dedicated
+ * thread to avoid blocking the writer by switch back and forth between two
+ * journal files.
  */
 static void *commit_data(void *ignored)
 {
+	struct dirty_dirs *dd = jfile_dirty + jfile_index(jfile.commit_fd);
+	uint64_t start = get_usec_time();
 	int err;
 
 	/* Tell runtime to release resources after termination */
@@ -277,29 +402,46 @@ static void *commit_data(void *ignored)
 	if (err)
 		panic("%s", strerror(err));
 
-	sync();
+	/* Writers only touch the set of the active journal file */
+	sync_dirty_dirs(dd);
+	reset_dirty_dirs(dd);
 	if (ftruncate(jfile.commit_fd, 0) < 0)
 		panic("truncate %m");
 	if (prealloc(jfile.commit_fd, jfile_size) < 0)
 		panic("prealloc");
+	metric_observe(MH_JOURNAL_COMMIT, get_usec_time() - start);
 
-	uatomic_set_false(&jfile.in_commit);
+	pthread_mutex_lock(&jfile_lock);
+	jfile.in_commit = false;
+	pthread_cond_broadcast(&jfile_commit_cond);
+	pthread_mutex_unlock(&jfile_lock);
 
 	pthread_exit(NULL);
 }
 
-/* FIXME: Try not sleep inside lock */
+/* Called with jfile_lock held, which is dropped while waiting for a commit */
 static void switch_journal_file(void)
 {
 	int old = jfile.fd, err;
 	pthread_t thread;
 
-retry:
-	if (!uatomic_set_true(&jfile.in_commit)) {
+	if (jfile.in_commit) {
+		struct timeval start, end;
+
 		sd_eprintf("journal file in committing, "
 			   "you might need enlarge jfile size");
-		usleep(100000); /* Wait until committing is finished */
-		goto retry;
+		gettimeofday(&start, NULL);
+		while (jfile.in_commit)
+			pthread_cond_wait(&jfile_commit_cond, &jfile_lock);
+		gettimeofday(&end, NULL);
+
+		nr_commit_stalls++;
+		metric_add(MC_JOURNAL_STALLS, 1);
+		commit_stall_us += (end.tv_sec - start.tv_sec) * 1000000 +
+			end.tv_usec - start.tv_usec;
+		/* Somebody else might have switched while we were waiting */
+		if (old != jfile.fd)
+			return;
 	}
 
 	if (old == jfile_fds[0])
@@ -308,48 +450,96 @@ retry:
 		jfile.fd = jfile_fds[0];
 	jfile.commit_fd = old;
 	jfile.pos = 0;
+	jfile.in_commit = true;
 
 	err = pthread_create(&thread, NULL, commit_data, NULL);
 	if (err)
 		panic("%s", strerror(err));
 }
 
-int journal_file_write(uint64_t oid, const char *buf, size_t size,
-		       off_t offset, bool create)
+void journal_file_stat(void)
+{
+	pthread_mutex_lock(&jfile_lock);
+	sd_iprintf("journal: %"PRIu64" commit stalls, %"PRIu64" us in total",
+		   nr_commit_stalls, commit_stall_us);
+	pthread_mutex_unlock(&jfile_lock);
+}
+
+static inline bool is_sector_aligned(const void *buf, size_t size)
+{
+	return ((uintptr_t)buf % SECTOR_SIZE) == 0 && (size % SECTOR_SIZE) == 0;
+}
+
+static void fill_journal_meta(char *desc, char *tail,
+			      const struct journal_descriptor *jd)
 {
 	uint32_t marker = JOURNAL_END_MARKER;
-	int ret = SD_RES_SUCCESS;
-	ssize_t written, rusize = roundup(size, SECTOR_SIZE),
-		wsize = JOURNAL_META_SIZE + rusize;
-	off_t woff;
-	char *wbuffer, *p;
-	struct journal_descriptor jd = {
-		.magic = JOURNAL_DESC_MAGIC,
-		.offset = offset,
-		.size = size,
-		.oid = oid,
-		.create = create,
-	};
 
-	pthread_spin_lock(&jfile_lock);
-	if (!jfile_enough_space(wsize))
+	memset(desc, 0, SECTOR_SIZE);
+	memcpy(desc, jd, sizeof(*jd));
+	memset(tail, 0, SECTOR_SIZE);
+	memcpy(tail + SECTOR_SIZE - JOURNAL_MARKER_SIZE, &marker,
+	       JOURNAL_MARKER_SIZE);
+}
+
+/*
+ * Reserve wsize bytes in the current journal file and record that the
+ * entries written there dirtied 'dir' or 'dirs'.
+ */
+static int jfile_reserve(size_t wsize, off_t *woff, const char *dir,
+			 const struct dirty_dirs *dirs)
+{
+	struct dirty_dirs *dd;
+	int fd;
+
+	pthread_mutex_lock(&jfile_lock);
+	while (!jfile_enough_space(wsize))
 		switch_journal_file();
-	woff = jfile.pos;
+	fd = jfile.fd;
+	*woff = jfile.pos;
 	jfile.pos += wsize;
-	pthread_spin_unlock(&jfile_lock);
-
-	p = wbuffer = xvalloc(wsize);
-	memcpy(p, &jd, JOURNAL_DESC_SIZE);
-	p += JOURNAL_DESC_SIZE;
-	memcpy(p, buf, size);
-	p += size;
-	if (size < rusize) {
-		memset(p, 0, rusize - size);
-		p += rusize - size;
+
+	dd = jfile_dirty + jfile_index(fd);
+	if (dir)
+		mark_dirty_dir(dd, dir);
+	if (dirs)
+		merge_dirty_dirs(dd, dirs);
+	pthread_mutex_unlock(&jfile_lock);
+
+	return fd;
+}
+
+static int journal_write_direct(const struct journal_descriptor *jd,
+				const char *buf)
+{
+	int ret = SD_RES_SUCCESS, fd;
+	ssize_t written, rusize = roundup(jd->size, SECTOR_SIZE),
+		wsize = JOURNAL_ALIGNED_META_SIZE + rusize;
+	off_t woff;
+	char *meta, *bounce = NULL;
+	struct iovec iov[3];
+
+	fd = jfile_reserve(wsize, &woff, get_object_path(jd->oid), NULL);
+
+	meta = xvalloc(JOURNAL_ALIGNED_META_SIZE);
+	fill_journal_meta(meta, meta + SECTOR_SIZE, jd);
+
+	iov[0].iov_base = meta;
+	iov[0].iov_len = SECTOR_SIZE;
+	if (is_sector_aligned(buf, jd->size)) {
+		/* Request buffers come from valloc(), so this is the norm */
+		iov[1].iov_base = (void *)buf;
+	} else {
+		bounce = xvalloc(rusize);
+		memcpy(bounce, buf, jd->size);
+		memset(bounce + jd->size, 0, rusize - jd->size);
+		iov[1].iov_base = bounce;
 	}
-	memcpy(p, &marker, JOURNAL_MARKER_SIZE);
+	iov[1].iov_len = rusize;
+	iov[2].iov_base = meta + SECTOR_SIZE;
+	iov[2].iov_len = SECTOR_SIZE;
 
-	sd_dprintf("oid %lx, pos %zu, wsize %zu", oid, jfile.pos, wsize);
+	sd_dprintf("oid %"PRIx64", pos %zu, wsize %zu", jd->oid, woff, wsize);
 	/*
 	 * Concurrent writes with the same FD is okay because we don't have any
 	 * critical sections that need lock inside kernel write path, since we
@@ -357,7 +547,7 @@ int journal_file_write(uint64_t oid, const char *buf, size_t size,
 	 *
 	 * Feel free to correct me If I am wrong.
 	 */
-	written = xpwrite(jfile.fd, wbuffer, wsize, woff);
+	written = xpwritev(fd, iov, ARRAY_SIZE(iov), woff);
 	if (written != wsize) {
 		sd_eprintf("failed, written %zd, len %zu", written, wsize);
 		/* FIXME: teach journal file handle EIO gracefully */
@@ -365,6 +555,186 @@ int journal_file_write(uint64_t oid, const char *buf, size_t size,
 		goto out;
 	}
 out:
-	free(wbuffer);
+	free(bounce);
+	free(meta);
+	return ret;
+}
+
+/*
+ * Group commit
+ *
+ * Writers copy their entries into the segment being filled and sleep until
+ * it is on disk.  A dedicated thread writes out a whole segment with a single
+ * O_DSYNC write, waiting up to gc_delay microseconds for more entries to
+ * arrive, and then wakes up every writer of the batch at once.  Two segments
+ * are used so that writers can keep appending while the other one is being
+ * flushed.  Entries too large for a segment are written directly.  A failed
+ * flush fails the writers of its batch only; the segment isn't filled again
+ * until they have all seen it.
+ */
+struct jsegment {
+	char *buf;
+	size_t len;
+	struct dirty_dirs dirty;
+	/* writers of the last batch which haven't seen its result yet */
+	int nr_waiters;
+	bool failed;
+};
+
+static size_t gc_batch;
+static unsigned gc_delay;
+
+static pthread_mutex_t gc_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t gc_flush_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t gc_wait_cond = PTHREAD_COND_INITIALIZER;
+static struct jsegment gc_segs[2];
+static int gc_cur;
+static bool gc_full;
+/* generation of the segment being filled and of the last flushed one */
+static uint64_t gc_fill_gen = 1, gc_done_gen;
+
+static void gc_wait_for_batch(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_nsec += (long)gc_delay * 1000;
+	ts.tv_sec += ts.tv_nsec / 1000000000;
+	ts.tv_nsec %= 1000000000;
+
+	while (!gc_full &&
+	       pthread_cond_timedwait(&gc_flush_cond, &gc_lock, &ts) == 0)
+		;
+}
+
+static void *gc_flush_thread(void *ignored)
+{
+	struct jsegment *seg;
+	uint64_t gen;
+	ssize_t written;
+	off_t woff;
+	int fd;
+
+	pthread_mutex_lock(&gc_lock);
+	for (;;) {
+		while (!gc_segs[gc_cur].len)
+			pthread_cond_wait(&gc_flush_cond, &gc_lock);
+
+		if (gc_delay)
+			gc_wait_for_batch();
+
+		/* The other segment was emptied by the previous flush */
+		seg = gc_segs + gc_cur;
+		while (gc_segs[gc_cur ^ 1].nr_waiters)
+			pthread_cond_wait(&gc_wait_cond, &gc_lock);
+		gc_segs[gc_cur ^ 1].failed = false;
+		gen = gc_fill_gen++;
+		gc_cur ^= 1;
+		gc_full = false;
+		pthread_cond_broadcast(&gc_wait_cond);
+		pthread_mutex_unlock(&gc_lock);
+
+		fd = jfile_reserve(seg->len, &woff, NULL, &seg->dirty);
+		sd_dprintf("gen %"PRIu64", pos %zu, len %zu", gen, woff,
+			   seg->len);
+		written = xpwrite(fd, seg->buf, seg->len, woff);
+
+		pthread_mutex_lock(&gc_lock);
+		if (written != seg->len) {
+			sd_eprintf("failed, written %zd, len %zu, %m", written,
+				   seg->len);
+			seg->failed = true;
+		}
+		seg->len = 0;
+		reset_dirty_dirs(&seg->dirty);
+		gc_done_gen = gen;
+		pthread_cond_broadcast(&gc_wait_cond);
+	}
+
+	return NULL;
+}
+
+static int journal_write_grouped(const struct journal_descriptor *jd,
+				 const char *buf, size_t wsize)
+{
+	struct jsegment *seg;
+	const char *dir = get_object_path(jd->oid);
+	uint64_t gen;
+	char *p;
+	int ret;
+
+	pthread_mutex_lock(&gc_lock);
+	for (;;) {
+		seg = gc_segs + gc_cur;
+		if (seg->len + wsize <= gc_batch)
+			break;
+		gc_full = true;
+		pthread_cond_signal(&gc_flush_cond);
+		pthread_cond_wait(&gc_wait_cond, &gc_lock);
+	}
+
+	p = seg->buf + seg->len;
+	fill_journal_meta(p, p + wsize - SECTOR_SIZE, jd);
+	p += SECTOR_SIZE;
+	memcpy(p, buf, jd->size);
+	memset(p + jd->size, 0, wsize - JOURNAL_ALIGNED_META_SIZE - jd->size);
+	mark_dirty_dir(&seg->dirty, dir);
+	if (!seg->len)
+		pthread_cond_signal(&gc_flush_cond);
+	seg->len += wsize;
+	seg->nr_waiters++;
+
+	gen = gc_fill_gen;
+	while (gc_done_gen < gen)
+		pthread_cond_wait(&gc_wait_cond, &gc_lock);
+	ret = seg->failed ? SD_RES_EIO : SD_RES_SUCCESS;
+	if (!--seg->nr_waiters)
+		pthread_cond_broadcast(&gc_wait_cond);
+	pthread_mutex_unlock(&gc_lock);
+
 	return ret;
 }
+
+int journal_file_write(uint64_t oid, const char *buf, size_t size,
+		       off_t offset, bool create)
+{
+	size_t wsize = JOURNAL_ALIGNED_META_SIZE + roundup(size, SECTOR_SIZE);
+	struct journal_descriptor jd = {
+		.magic = JOURNAL_DESC_MAGIC_ALIGNED,
+		.offset = offset,
+		.size = size,
+		.oid = oid,
+		.create = create,
+	};
+	uint64_t start = get_usec_time();
+	int ret;
+
+	if (gc_batch && wsize <= gc_batch)
+		ret = journal_write_grouped(&jd, buf, wsize);
+	else
+		ret = journal_write_direct(&jd, buf);
+	metric_observe(MH_JOURNAL_WRITE, get_usec_time() - start);
+
+	return ret;
+}
+
+int journal_file_group_commit_init(size_t batch, unsigned delay)
+{
+	pthread_t thread;
+	int err;
+
+	gc_batch = roundup(batch, SECTOR_SIZE);
+	gc_delay = delay;
+	gc_segs[0].buf = xvalloc(gc_batch);
+	gc_segs[1].buf = xvalloc(gc_batch);
+
+	err = pthread_create(&thread, NULL, gc_flush_thread, NULL);
+	if (err) {
+		sd_eprintf("%s", strerror(err));
+		return -1;
+	}
+	pthread_detach(thread);
+
+	sd_iprintf("group commit, batch %zu, delay %uus", gc_batch, gc_delay);
+	return 0;
+}
@@ -16,6 +16,7 @@
 #include <sys/stat.h>
 #include <stdint.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <errno.h>
 #include <math.h>
 #include <sys/xattr.h>
@@ -26,116 +27,178 @@
 
 #define MD_DEFAULT_VDISKS 128
 #define MD_MAX_DISK 64 /* FIXME remove roof and make it dynamic */
-#define MD_MAX_VDISK (MD_MAX_DISK * MD_DEFAULT_VDISKS)
+#define MD_DEFAULT_IO_THREADS 32
 
 struct disk {
 	char path[PATH_MAX];
 	uint16_t nr_vdisks;
 	uint64_t space;
+
+	/* peer I/O against this disk is served by its own bounded queue */
+	size_t nr_io_threads;
+	char wq_name[16];
+	struct work_queue *wq;
 };
 
-struct vdisk {
-	uint16_t idx;
-	uint64_t id;
+/*
+ * The online disks and their vdisk ring.  A table is never modified once it
+ * is published, so the lookups on the I/O path just load the current table
+ * and need no lock.  Changes of the disks, which only happen in the main
+ * thread, build a new table and swap it in.
+ *
+ * Old tables are not freed because we have no way to know when the last
+ * reader is done with them.  Disks are only removed at runtime, so at most
+ * MD_MAX_DISK tables are ever retired.
+ */
+struct md_table {
+	int gen;
+	int nr_disks;
+	struct disk *disks[MD_MAX_DISK];
+	int nr_vds;
+	struct vdisk vds[];
 };
 
+static void md_start_rebalance(void);
+
+/* Disks are never moved or freed, so their paths can be handed out freely */
 static struct disk md_disks[MD_MAX_DISK];
-static struct vdisk md_vds[MD_MAX_VDISK];
+static int md_nr_disks;
 
-static pthread_rwlock_t md_lock = PTHREAD_RWLOCK_INITIALIZER;
-static int md_nr_disks; /* Protected by md_lock */
-static int md_nr_vds;
+static struct md_table *md_table;
 
-static inline int nr_online_disks(void)
+static struct work_queue *md_rebalance_wqueue;
+static uatomic_bool md_rebalance_pending;
+
+static inline struct md_table *get_md_table(void)
 {
-	int nr;
+	/* Pairs with uatomic_xchg() in publish_md_table() */
+	return uatomic_read(&md_table);
+}
 
-	pthread_rwlock_rdlock(&md_lock);
-	nr = md_nr_disks;
-	pthread_rwlock_unlock(&md_lock);
+static inline int nr_online_disks(void)
+{
+	struct md_table *t = get_md_table();
 
-	return nr;
+	return t ? t->nr_disks : 0;
 }
 
-static struct vdisk *oid_to_vdisk_from(struct vdisk *vds, int nr, uint64_t oid)
+static inline int disks_to_vdisks(struct disk **ds, int nmds,
+				  struct vdisk *vds)
 {
-	uint64_t id = fnv_64a_buf(&oid, sizeof(oid), FNV1A_64_INIT);
-	int start, end, pos;
+	int i, nr_vdisks = 0;
 
-	start = 0;
-	end = nr - 1;
+	for (i = 0; i < nmds; i++) {
+		path_to_vdisks(ds[i]->path, ds[i]->nr_vdisks, i,
+			       vds + nr_vdisks);
+		nr_vdisks += ds[i]->nr_vdisks;
+	}
+	qsort(vds, nr_vdisks, sizeof(*vds), vdisk_cmp);
 
-	if (id > vds[end].id || id < vds[start].id)
-		return &vds[start];
+	return nr_vdisks;
+}
 
-	for (;;) {
-		pos = (end - start) / 2 + start;
-		if (vds[pos].id < id) {
-			if (vds[pos + 1].id >= id)
-				return &vds[pos + 1];
-			start = pos;
-		} else
-			end = pos;
-	}
+static inline struct disk *oid_to_disk(struct md_table *t, uint64_t oid)
+{
+	return t->disks[oid_to_vdisk_from(t->vds, t->nr_vds, oid)->idx];
 }
 
-static int vdisk_cmp(const void *a, const void *b)
+/*
+ * The number of I/O threads for a disk can be given as a ':N' suffix of its
+ * path, so that fast and slow disks can be mixed in one sheep.
+ */
+static size_t parse_io_threads(char *path)
 {
-	const struct vdisk *d1 = a;
-	const struct vdisk *d2 = b;
+	char *p = strrchr(path, ':'), *end;
+	unsigned long nr;
 
-	if (d1->id < d2->id)
-		return -1;
-	if (d1->id > d2->id)
-		return 1;
-	return 0;
+	if (!p || !p[1])
+		return MD_DEFAULT_IO_THREADS;
+
+	nr = strtoul(p + 1, &end, 10);
+	if (*end || nr == 0 || nr == ULONG_MAX)
+		return MD_DEFAULT_IO_THREADS;
+
+	*p = '\0';
+	return nr;
 }
 
-static inline int disks_to_vdisks(struct disk *ds, int nmds, struct vdisk *vds)
+int md_init_disk(char *path)
 {
-	struct disk *d_iter = ds;
-	int i, j, nr_vdisks = 0;
-	uint64_t hval;
+	size_t nr_io_threads;
 
-	while (nmds--) {
-		hval = FNV1A_64_INIT;
+	if (md_nr_disks == MD_MAX_DISK) {
+		sd_eprintf("too many disks, max %d", MD_MAX_DISK);
+		return -1;
+	}
 
-		for (i = 0; i < d_iter->nr_vdisks; i++) {
-			hval = fnv_64a_buf(&nmds, sizeof(nmds), hval);
-			for (j = strlen(d_iter->path) - 1; j >= 0; j--)
-				hval = fnv_64a_buf(&d_iter->path[j], 1, hval);
+	nr_io_threads = parse_io_threads(path);
+	md_nr_disks++;
 
-			vds[nr_vdisks].id = hval;
-			vds[nr_vdisks].idx = d_iter - ds;
+	if (xmkdir(path, def_dmode) < 0)
+			panic("%s, %m", path);
+	pstrcpy(md_disks[md_nr_disks - 1].path, PATH_MAX, path);
+	md_disks[md_nr_disks - 1].nr_io_threads = nr_io_threads;
+	sd_iprintf("%s added to md, nr %d, %zu io threads",
+		   md_disks[md_nr_disks - 1].path, md_nr_disks, nr_io_threads);
+	return 0;
+}
 
-			nr_vdisks++;
-		}
+int md_init_wqueues(void)
+{
+	struct disk *disk;
+	int i;
+
+	if (!sys->enable_md)
+		return 0;
 
-		d_iter++;
+	for (i = 0; i < md_nr_disks; i++) {
+		disk = md_disks + i;
+		snprintf(disk->wq_name, sizeof(disk->wq_name), "md_io%d", i);
+		set_disk_affinity(disk->wq_name, disk->path);
+		disk->wq = init_bounded_work_queue(disk->wq_name,
+						   disk->nr_io_threads);
+		if (!disk->wq)
+			return -1;
 	}
-	qsort(vds, nr_vdisks, sizeof(*vds), vdisk_cmp);
 
-	return nr_vdisks;
+	md_rebalance_wqueue = init_ordered_work_queue("md_rebal");
+	if (!md_rebalance_wqueue)
+		return -1;
+	/* The disks might have been changed since the last run */
+	md_start_rebalance();
+
+	return 0;
 }
 
-static inline struct vdisk *oid_to_vdisk(uint64_t oid)
+/*
+ * Return the work queue serving the disk that 'oid' lives on, so that a slow
+ * disk only holds up the requests against itself.
+ */
+struct work_queue *md_get_io_wqueue(uint64_t oid)
 {
-	return oid_to_vdisk_from(md_vds, md_nr_vds, oid);
+	struct work_queue *wq = NULL;
+	struct md_table *t;
+
+	if (!sys->enable_md || !oid)
+		return sys->io_wqueue;
+
+	t = get_md_table();
+	if (t->nr_disks > 0)
+		wq = oid_to_disk(t, oid)->wq;
+
+	return wq ? wq : sys->io_wqueue;
 }
 
-int md_init_disk(char *path)
+void md_wqueue_stat(void)
 {
-	md_nr_disks++;
+	int i;
 
-	if (xmkdir(path, def_dmode) < 0)
-			panic("%s, %m", path);
-	pstrcpy(md_disks[md_nr_disks - 1].path, PATH_MAX, path);
-	sd_iprintf("%s added to md, nr %d", md_disks[md_nr_disks - 1].path,
-		   md_nr_disks);
-	return 0;
+	for (i = 0; i < md_nr_disks; i++)
+		if (md_disks[i].wq)
+			work_queue_stat(md_disks[i].wq);
 }
 
-static inline void calculate_vdisks(struct disk *disks, int nr_disks,
+static inline void calculate_vdisks(struct disk **disks, int nr_disks,
 			     uint64_t total)
 {
 	uint64_t avg_size = total / nr_disks;
@@ -143,11 +206,11 @@ static inline void calculate_vdisks(struct disk *disks, int nr_disks,
 	int i;
 
 	for (i = 0; i < nr_disks; i++) {
-		factor = (float)disks[i].space / (float)avg_size;
-		md_disks[i].nr_vdisks = rintf(MD_DEFAULT_VDISKS * factor);
+		factor = (float)disks[i]->space / (float)avg_size;
+		disks[i]->nr_vdisks = rintf(MD_DEFAULT_VDISKS * factor);
 		sd_dprintf("%s has %d vdisks, free space %" PRIu64,
-			   md_disks[i].path, md_disks[i].nr_vdisks,
-			   md_disks[i].space);
+			   disks[i]->path, disks[i]->nr_vdisks,
+			   disks[i]->space);
 	}
 }
 
@@ -176,9 +239,39 @@ create:
 	return size;
 }
 
+/* Build a table of 'disks' and return their total space */
+static struct md_table *alloc_md_table(struct disk **disks, int nr_disks,
+				       int gen, uint64_t *total)
+{
+	struct md_table *t;
+	int i, nr_vdisks = 0;
+
+	*total = 0;
+	for (i = 0; i < nr_disks; i++)
+		*total += disks[i]->space;
+	calculate_vdisks(disks, nr_disks, *total);
+	for (i = 0; i < nr_disks; i++)
+		nr_vdisks += disks[i]->nr_vdisks;
+
+	t = xzalloc(sizeof(*t) + sizeof(struct vdisk) * nr_vdisks);
+	t->gen = gen;
+	t->nr_disks = nr_disks;
+	memcpy(t->disks, disks, sizeof(*disks) * nr_disks);
+	t->nr_vds = disks_to_vdisks(t->disks, nr_disks, t->vds);
+
+	return t;
+}
+
+static void publish_md_table(struct md_table *t)
+{
+	/* uatomic_xchg() implies a full memory barrier */
+	(void)uatomic_xchg(&md_table, t);
+}
+
 uint64_t md_init_space(void)
 {
-	uint64_t total = 0;
+	struct disk *disks[MD_MAX_DISK];
+	uint64_t total;
 	int i;
 
 	if (!md_nr_disks)
@@ -188,10 +281,9 @@ uint64_t md_init_space(void)
 		if (!is_xattr_enabled(md_disks[i].path))
 			panic("multi-disk support need xattr feature");
 		md_disks[i].space = init_path_space(md_disks[i].path);
-		total += md_disks[i].space;
+		disks[i] = md_disks + i;
 	}
-	calculate_vdisks(md_disks, md_nr_disks, total);
-	md_nr_vds = disks_to_vdisks(md_disks, md_nr_disks, md_vds);
+	publish_md_table(alloc_md_table(disks, md_nr_disks, 0, &total));
 	sys->enable_md = true;
 
 	return total;
@@ -199,27 +291,15 @@ uint64_t md_init_space(void)
 
 char *get_object_path(uint64_t oid)
 {
-	struct vdisk *vd;
-	char *p;
+	struct disk *d;
 
 	if (!sys->enable_md)
 		return obj_path;
 
-	pthread_rwlock_rdlock(&md_lock);
-	vd = oid_to_vdisk(oid);
-	p = md_disks[vd->idx].path;
-	pthread_rwlock_unlock(&md_lock);
-	sd_dprintf("%d, %s", vd->idx, p);
+	d = oid_to_disk(get_md_table(), oid);
+	sd_dprintf("%d, %s", (int)(d - md_disks), d->path);
 
-	return p;
-}
-
-static char *get_object_path_nolock(uint64_t oid)
-{
-	struct vdisk *vd;
-
-	vd = oid_to_vdisk(oid);
-	return md_disks[vd->idx].path;
+	return d->path;
 }
 
 /* If cleanup is true, temporary objects will be removed */
@@ -240,8 +320,16 @@ static int for_each_object_in_path(char *path,
 	}
 
 	while ((d = readdir(dir))) {
-		if (!strncmp(d->d_name, ".", 1))
+		if (!strncmp(d->d_name, ".", 1)) {
+			/* left by the compressor */
+			if (cleanup && !strncmp(d->d_name, ZOBJ_TMP_PREFIX,
+						strlen(ZOBJ_TMP_PREFIX))) {
+				snprintf(p, PATH_MAX, "%s/%s", path, d->d_name);
+				sd_dprintf("remove tmp object %s", p);
+				unlink(p);
+			}
 			continue;
+		}
 
 		oid = strtoull(d->d_name, NULL, 16);
 		if (oid == 0 || oid == ULLONG_MAX)
@@ -272,17 +360,73 @@ int for_each_object_in_wd(int (*func)(uint64_t oid, char *path, void *arg),
 {
 	int i, ret = SD_RES_SUCCESS;
 
+	struct md_table *t;
+
 	if (!sys->enable_md)
 		return for_each_object_in_path(obj_path, func, cleanup, arg);
 
-	pthread_rwlock_rdlock(&md_lock);
-	for (i = 0; i < md_nr_disks; i++) {
-		ret = for_each_object_in_path(md_disks[i].path, func,
+	t = get_md_table();
+	for (i = 0; i < t->nr_disks; i++) {
+		ret = for_each_object_in_path(t->disks[i]->path, func,
 					      cleanup, arg);
 		if (ret != SD_RES_SUCCESS)
 			break;
 	}
-	pthread_rwlock_unlock(&md_lock);
+	return ret;
+}
+
+struct scan_arg {
+	pthread_t thread;
+	bool started;
+	char *path;
+	int (*func)(uint64_t oid, char *path, void *arg);
+	bool cleanup;
+	void *arg;
+	int ret;
+};
+
+static void *scan_path_main(void *p)
+{
+	struct scan_arg *s = p;
+
+	s->ret = for_each_object_in_path(s->path, s->func, s->cleanup, s->arg);
+	return NULL;
+}
+
+/* Same as for_each_object_in_wd(), with one thread per disk */
+int for_each_object_in_wd_parallel(int (*func)(uint64_t oid, char *path,
+					       void *arg),
+				   bool cleanup, void *arg)
+{
+	struct md_table *t;
+	struct scan_arg *s;
+	int i, ret = SD_RES_SUCCESS;
+
+	if (!sys->enable_md || get_md_table()->nr_disks < 2)
+		return for_each_object_in_wd(func, cleanup, arg);
+
+	t = get_md_table();
+	s = xzalloc(sizeof(*s) * t->nr_disks);
+	for (i = 0; i < t->nr_disks; i++) {
+		s[i].path = t->disks[i]->path;
+		s[i].func = func;
+		s[i].cleanup = cleanup;
+		s[i].arg = arg;
+		if (pthread_create(&s[i].thread, NULL, scan_path_main, s + i)) {
+			sd_eprintf("failed to create a thread, %m");
+			scan_path_main(s + i);
+		} else
+			s[i].started = true;
+	}
+	for (i = 0; i < t->nr_disks; i++) {
+		if (s[i].started)
+			pthread_join(s[i].thread, NULL);
+		if (s[i].ret != SD_RES_SUCCESS && ret == SD_RES_SUCCESS)
+			ret = s[i].ret;
+	}
+	sd_iprintf("scanned %d disks", t->nr_disks);
+	free(s);
+
 	return ret;
 }
 
@@ -290,16 +434,17 @@ int for_each_obj_path(int (*func)(char *path))
 {
 	int i, ret = SD_RES_SUCCESS;
 
+	struct md_table *t;
+
 	if (!sys->enable_md)
 		return func(obj_path);
 
-	pthread_rwlock_rdlock(&md_lock);
-	for (i = 0; i < md_nr_disks; i++) {
-		ret = func(md_disks[i].path);
+	t = get_md_table();
+	for (i = 0; i < t->nr_disks; i++) {
+		ret = func(t->disks[i]->path);
 		if (ret != SD_RES_SUCCESS)
 			break;
 	}
-	pthread_rwlock_unlock(&md_lock);
 	return ret;
 }
 
@@ -308,12 +453,12 @@ struct md_work {
 	char path[PATH_MAX];
 };
 
-static int path_to_disk_idx(char *path)
+static int path_to_disk_idx(struct md_table *t, char *path)
 {
 	int i;
 
-	for (i = 0; i < md_nr_disks; i++)
-		if (strcmp(md_disks[i].path, path) == 0)
+	for (i = 0; i < t->nr_disks; i++)
+		if (strcmp(t->disks[i]->path, path) == 0)
 			return i;
 
 	return -1;
@@ -327,35 +472,61 @@ static inline void kick_recover(void)
 	put_vnode_info(vinfo);
 }
 
-static void unplug_disk(int idx)
+static void unplug_disk(struct md_table *old, int idx)
 {
-	int i;
-
+	struct disk *disks[MD_MAX_DISK];
+	struct md_table *t;
+	uint64_t total = 0;
+	bool reweighted;
+	int i, nr = 0;
+
+	for (i = 0; i < old->nr_disks; i++)
+		if (i != idx)
+			disks[nr++] = old->disks[i];
+
+	if (nr > 0)
+		t = alloc_md_table(disks, nr, old->gen + 1, &total);
+	else {
+		/*
+		 * We need to keep last disk path to generate EIO when all
+		 * disks are broken
+		 */
+		t = xmalloc(sizeof(*t) + sizeof(struct vdisk) * old->nr_vds);
+		memcpy(t, old, sizeof(*t) + sizeof(struct vdisk) * old->nr_vds);
+		t->gen = old->gen + 1;
+		t->nr_disks = 0;
+	}
+	publish_md_table(t);
+	/* The objects are looked up from the new disks from now on */
+	fd_cache_purge();
+	sys->disk_space = total;
 	/*
-	 * We need to keep last disk path to generate EIO when all disks are
-	 * broken
+	 * The recovery of the new epoch of a reweighted node fetches the
+	 * objects of the broken disk as well
 	 */
-	for (i = idx; i < md_nr_disks - 1; i++)
-		md_disks[i] = md_disks[i + 1];
-	md_nr_disks--;
-	sys->disk_space = md_init_space();
-	if (md_nr_disks > 0)
-		kick_recover();
+	reweighted = update_node_space(total);
+
+	if (nr > 0) {
+		/* Only fetches the objects that were on the broken disk */
+		if (!reweighted)
+			kick_recover();
+		md_start_rebalance();
+	}
 }
 
+/* Runs in the main thread, which is the only updater of md_table */
 static void md_do_recover(struct work *work)
 {
 	struct md_work *mw = container_of(work, struct md_work, work);
+	struct md_table *t = get_md_table();
 	int idx;
 
-	pthread_rwlock_wrlock(&md_lock);
-	idx = path_to_disk_idx(mw->path);
+	idx = path_to_disk_idx(t, mw->path);
 	if (idx < 0)
 		/* Just ignore the duplicate EIO of the same path */
 		goto out;
-	unplug_disk(idx);
+	unplug_disk(t, idx);
 out:
-	pthread_rwlock_unlock(&md_lock);
 	free(mw);
 }
 
@@ -378,6 +549,80 @@ int md_handle_eio(char *fault_path)
 	return SD_RES_NETWORK_ERROR;
 }
 
+/*
+ * Moving an object between disks is a copy, so the movers of the same object
+ * are serialized by these locks.  Everybody looks up an object at the path of
+ * its current owner first and only moves it there through check_and_move().
+ * The writers may still hold the fd of the old copy though, so the move also
+ * keeps them away with lock_object_file() and drops the cached fds before it
+ * starts copying.
+ */
+#define MD_MOVE_LOCKS 64
+static pthread_mutex_t md_move_locks[MD_MOVE_LOCKS] = {
+	[0 ... MD_MOVE_LOCKS - 1] = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static inline pthread_mutex_t *oid_to_move_lock(uint64_t oid)
+{
+	return md_move_locks +
+		fnv_64a_buf(&oid, sizeof(oid), FNV1A_64_INIT) % MD_MOVE_LOCKS;
+}
+
+#define MD_TMP_PREFIX ".md."
+
+/* Copy 'old' to 'new' when they are on different file systems */
+static int copy_object(const char *old, const char *new)
+{
+	const char *base = strrchr(new, '/') + 1;
+	char tmp[PATH_MAX], *buf;
+	int sfd, dfd = -1, ret = -1;
+	ssize_t size;
+	off_t off = 0;
+
+	snprintf(tmp, sizeof(tmp), "%.*s" MD_TMP_PREFIX "%s",
+		 (int)(base - new), new, base);
+
+	sfd = open(old, O_RDONLY);
+	if (sfd < 0) {
+		sd_eprintf("failed to open %s, %m", old);
+		return -1;
+	}
+	dfd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, def_fmode);
+	if (dfd < 0) {
+		sd_eprintf("failed to open %s, %m", tmp);
+		goto out;
+	}
+
+	buf = xmalloc(SD_DATA_OBJ_SIZE);
+	while ((size = xpread(sfd, buf, SD_DATA_OBJ_SIZE, off)) > 0) {
+		if (xpwrite(dfd, buf, size, off) != size) {
+			sd_eprintf("failed to write %s, %m", tmp);
+			size = -1;
+			break;
+		}
+		off += size;
+	}
+	free(buf);
+	if (size < 0 || fdatasync(dfd) < 0) {
+		sd_eprintf("failed to copy %s to %s, %m", old, tmp);
+		goto out;
+	}
+
+	if (rename(tmp, new) < 0) {
+		sd_eprintf("failed to rename %s to %s, %m", tmp, new);
+		goto out;
+	}
+	ret = 0;
+out:
+	if (dfd >= 0) {
+		close(dfd);
+		if (ret < 0)
+			unlink(tmp);
+	}
+	close(sfd);
+	return ret;
+}
+
 static inline bool md_access(char *path)
 {
 	if (access(path, R_OK | W_OK) < 0) {
@@ -395,12 +640,12 @@ static int get_old_new_path(uint64_t oid, uint32_t epoch, char *path,
 	if (!epoch) {
 		snprintf(old, PATH_MAX, "%s/%016" PRIx64, path, oid);
 		snprintf(new, PATH_MAX, "%s/%016" PRIx64,
-			 get_object_path_nolock(oid), oid);
+			 get_object_path(oid), oid);
 	} else {
 		snprintf(old, PATH_MAX, "%s/.stale/%016"PRIx64".%"PRIu32, path,
 			 oid, epoch);
 		snprintf(new, PATH_MAX, "%s/.stale/%016"PRIx64".%"PRIu32,
-			 get_object_path_nolock(oid), oid, epoch);
+			 get_object_path(oid), oid, epoch);
 	}
 
 	if (!md_access(old))
@@ -411,31 +656,88 @@ static int get_old_new_path(uint64_t oid, uint32_t epoch, char *path,
 
 static int check_and_move(uint64_t oid, uint32_t epoch, char *path)
 {
+	pthread_mutex_t *lock = oid_to_move_lock(oid);
 	char old[PATH_MAX], new[PATH_MAX];
+	int ret = SD_RES_EIO;
 
 	if (get_old_new_path(oid, epoch, path, old, new) < 0)
 		return SD_RES_EIO;
 
+	pthread_mutex_lock(lock);
+	/* The stale objects are never written */
+	if (!epoch) {
+		lock_object_file(oid);
+		fd_cache_invalidate(oid);
+	}
+	if (md_access(new)) {
+		/* Somebody else has moved it or it was recovered meanwhile */
+		if (strcmp(old, new) != 0)
+			unlink(old);
+		ret = SD_RES_SUCCESS;
+		goto out;
+	}
+	if (!md_access(old))
+		goto out;
+
 	if (rename(old, new) < 0) {
-		sd_eprintf("old %s, new %s: %m", old, new);
-		return SD_RES_EIO;
+		if (errno != EXDEV) {
+			sd_eprintf("old %s, new %s: %m", old, new);
+			goto out;
+		}
+		if (copy_object(old, new) < 0)
+			goto out;
+		unlink(old);
 	}
 
 	sd_dprintf("from %s to %s", old, new);
-	return SD_RES_SUCCESS;
+	ret = SD_RES_SUCCESS;
+out:
+	if (!epoch)
+		unlock_object_file(oid);
+	pthread_mutex_unlock(lock);
+	return ret;
 }
 
 static int scan_wd(uint64_t oid, uint32_t epoch)
 {
+	struct md_table *t = get_md_table();
 	int i, ret = SD_RES_EIO;
 
-	pthread_rwlock_rdlock(&md_lock);
-	for (i = 0; i < md_nr_disks; i++) {
-		ret = check_and_move(oid, epoch, md_disks[i].path);
+	/* No table without multi-disk */
+	if (!t)
+		return ret;
+
+	for (i = 0; i < t->nr_disks; i++) {
+		ret = check_and_move(oid, epoch, t->disks[i]->path);
 		if (ret == SD_RES_SUCCESS)
 			break;
 	}
-	pthread_rwlock_unlock(&md_lock);
+	return ret;
+}
+
+/* Return true if any disk has 'oid', without moving it to its owner */
+bool md_has_object(uint64_t oid)
+{
+	struct md_table *t = get_md_table();
+	char path[PATH_MAX];
+	bool ret = false;
+	int i;
+
+	if (!t)
+		return ret;
+
+	for (i = 0; i < t->nr_disks; i++) {
+		int len;
+
+		pstrcpy(path, PATH_MAX, t->disks[i]->path);
+		len = strlen(path);
+		snprintf(path + len, PATH_MAX - len, "/%016" PRIx64, oid);
+		if (md_access(path)) {
+			ret = true;
+			break;
+		}
+	}
+
 	return ret;
 }
 
@@ -470,3 +772,109 @@ int md_get_stale_path(uint64_t oid, uint32_t epoch, char *path)
 
 	return SD_RES_NO_OBJ;
 }
+
+/*
+ * Background rebalancing
+ *
+ * After the set of disks changes, the objects whose owner disk changed are
+ * moved in the background, at most MD_REBALANCE_RATE bytes per second so that
+ * the disks keep serving requests.  The objects that haven't been moved yet
+ * are still found by md_exist(), which moves them on demand.  A rebalancing
+ * pass is aborted and restarted when the disks change again.
+ */
+#define MD_REBALANCE_RATE (32 * 1024 * 1024)
+
+static bool rebalance_aborted(int gen)
+{
+	return gen != get_md_table()->gen;
+}
+
+/* Move the objects on 'path' that now belong to other disks */
+static int rebalance_path(const char *path, int gen, uint64_t *nr_moved)
+{
+	char p[PATH_MAX];
+	struct dirent *d;
+	struct stat st;
+	uint64_t oid;
+	DIR *dir;
+	int ret;
+
+	dir = opendir(path);
+	if (!dir) {
+		sd_eprintf("failed to open %s, %m", path);
+		return -1;
+	}
+
+	while ((d = readdir(dir))) {
+		if (rebalance_aborted(gen))
+			break;
+
+		if (!strncmp(d->d_name, MD_TMP_PREFIX, strlen(MD_TMP_PREFIX))) {
+			/* Leftover of an interrupted copy */
+			snprintf(p, PATH_MAX, "%s/%s", path, d->d_name);
+			unlink(p);
+			continue;
+		}
+		if (!strncmp(d->d_name, ".", 1) || strlen(d->d_name) != 16)
+			continue;
+		oid = strtoull(d->d_name, NULL, 16);
+		if (oid == 0 || oid == ULLONG_MAX)
+			continue;
+
+		snprintf(p, PATH_MAX, "%s/%s", path, d->d_name);
+		if (stat(p, &st) < 0)
+			continue;
+
+		if (rebalance_aborted(gen) ||
+		    strcmp(get_object_path(oid), path) == 0)
+			continue;
+		ret = check_and_move(oid, 0, (char *)path);
+
+		if (ret != SD_RES_SUCCESS)
+			continue;
+		(*nr_moved)++;
+		usleep((uint64_t)st.st_size * 1000000 / MD_REBALANCE_RATE);
+	}
+	closedir(dir);
+
+	return 0;
+}
+
+static void md_rebalance_work(struct work *work)
+{
+	struct md_table *t;
+	uint64_t nr_moved = 0;
+	int i;
+
+	uatomic_set_false(&md_rebalance_pending);
+
+	t = get_md_table();
+	sd_iprintf("start rebalancing %d disks", t->nr_disks);
+	for (i = 0; i < t->nr_disks; i++)
+		if (rebalance_path(t->disks[i]->path, t->gen, &nr_moved) < 0 ||
+		    rebalance_aborted(t->gen))
+			break;
+	sd_iprintf("%s rebalancing, %"PRIu64" objects moved",
+		   i == t->nr_disks ? "finished" : "aborted", nr_moved);
+}
+
+static void md_rebalance_done(struct work *work)
+{
+	free(work);
+}
+
+static void md_start_rebalance(void)
+{
+	struct work *work;
+
+	if (!md_rebalance_wqueue)
+		return;
+	/* A pass queued but not started yet will see the latest disks */
+	if (!uatomic_set_true(&md_rebalance_pending))
+		return;
+
+	work = xzalloc(sizeof(*work));
+	work->fn = md_rebalance_work;
+	work->done = md_rebalance_done;
+	queue_work(md_rebalance_wqueue, work);
+}
@@ -0,0 +1,360 @@
+/*
+ * Copyright (C) 2013 Taobao Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Metrics registry
+ *
+ * The counters and the latency histograms are kept per thread, so updating
+ * them takes no lock nor atomic operation: each thread only adds to its own
+ * block, and the readers sum up the blocks of all the threads.  A block
+ * outlives its thread, the next new thread takes it over with its counts, so
+ * that the short lived workers of the dynamic queues don't lose them.
+ *
+ * metrics_snapshot() adds the gauges read from the modules, e.g. the depths
+ * of the work queues, and is served by SD_OP_STAT_METRICS and in the
+ * Prometheus text format on the "metrics" unix socket of the base directory.
+ */
+
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include "sheep_priv.h"
+
+#define NR_METRIC_BUCKETS 128
+#define MAX_WQUEUES 256
+
+struct metrics_hist {
+	uint64_t buckets[NR_METRIC_BUCKETS];
+	uint64_t sum;
+	uint64_t max;
+};
+
+struct metrics_block {
+	struct list_head list;
+	bool in_use;
+	uint64_t counters[NR_METRIC_COUNTERS];
+	struct metrics_hist hists[NR_METRIC_HISTS];
+};
+
+static const char * const counter_names[] = {
+	[MC_OC_HITS] = "object_cache_hits",
+	[MC_OC_MISSES] = "object_cache_misses",
+	[MC_SOCKFD_CACHED] = "sockfd_cached_gets",
+	[MC_SOCKFD_CONNECTS] = "sockfd_connects",
+	[MC_SOCKFD_SHORT] = "sockfd_short_gets",
+	[MC_SOCKFD_DROPS] = "sockfd_drops",
+	[MC_JOURNAL_STALLS] = "journal_commit_stalls",
+	[MC_RECOVERY_OBJS] = "recovery_objects",
+	[MC_RECOVERY_FAILS] = "recovery_failures",
+	[MC_RECOVERY_BYTES] = "recovery_bytes",
+	[MC_QUORUM_ACKS] = "write_quorum_acks",
+	[MC_QUORUM_REPAIRS] = "write_quorum_repairs",
+	[MC_INODE_CACHE_HITS] = "inode_cache_hits",
+	[MC_INODE_CACHE_MISSES] = "inode_cache_misses",
+};
+
+static const char * const hist_names[] = {
+	[MH_GATEWAY_READ] = "gateway_read_us",
+	[MH_GATEWAY_WRITE] = "gateway_write_us",
+	[MH_PEER_READ] = "peer_read_us",
+	[MH_PEER_WRITE] = "peer_write_us",
+	[MH_WORK_WAIT] = "work_wait_us",
+	[MH_WORK_RUN] = "work_run_us",
+	[MH_OC_PUSH] = "object_cache_push_us",
+	[MH_JOURNAL_WRITE] = "journal_write_us",
+	[MH_JOURNAL_COMMIT] = "journal_commit_us",
+	[MH_RECOVERY_OBJ] = "recovery_object_us",
+	[MH_QUORUM_LAG] = "write_quorum_lag_us",
+};
+
+static LIST_HEAD(block_list);
+static pthread_mutex_t block_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t block_key;
+static pthread_once_t block_once = PTHREAD_ONCE_INIT;
+
+static __thread struct metrics_block *this_block;
+
+/* Four buckets per power of two, so the percentiles are within 25% */
+int latency_to_bucket(uint64_t us)
+{
+	int msb;
+
+	if (us < 4)
+		return us;
+	msb = 63 - __builtin_clzll(us);
+	return (msb - 1) * 4 + ((us >> (msb - 2)) & 3);
+}
+
+/* Return the lowest latency of the bucket */
+uint64_t bucket_to_latency(int b)
+{
+	if (b < 4)
+		return b;
+	return (uint64_t)(4 + b % 4) << (b / 4 - 1);
+}
+
+/* Called at the exit of a thread, to hand its block over to the next one */
+static void put_block(void *data)
+{
+	struct metrics_block *b = data;
+
+	pthread_mutex_lock(&block_lock);
+	b->in_use = false;
+	pthread_mutex_unlock(&block_lock);
+}
+
+static void init_block_key(void)
+{
+	int err = pthread_key_create(&block_key, put_block);
+
+	if (err)
+		panic("%s", strerror(err));
+}
+
+static struct metrics_block *get_block(void)
+{
+	struct metrics_block *b;
+
+	if (this_block)
+		return this_block;
+
+	pthread_once(&block_once, init_block_key);
+
+	pthread_mutex_lock(&block_lock);
+	list_for_each_entry(b, &block_list, list)
+		if (!b->in_use)
+			goto found;
+	b = xzalloc(sizeof(*b));
+	list_add_tail(&b->list, &block_list);
+found:
+	b->in_use = true;
+	pthread_mutex_unlock(&block_lock);
+
+	pthread_setspecific(block_key, b);
+	this_block = b;
+	return b;
+}
+
+void metric_add(enum metric_counter c, uint64_t n)
+{
+	struct metrics_block *b = get_block();
+
+	uatomic_set(&b->counters[c], b->counters[c] + n);
+}
+
+void metric_observe(enum metric_hist h, uint64_t us)
+{
+	struct metrics_hist *hist = get_block()->hists + h;
+	int bucket = min(latency_to_bucket(us), NR_METRIC_BUCKETS - 1);
+
+	uatomic_set(&hist->buckets[bucket], hist->buckets[bucket] + 1);
+	uatomic_set(&hist->sum, hist->sum + us);
+	if (us > hist->max)
+		uatomic_set(&hist->max, us);
+}
+
+static uint64_t hist_percentile(const struct metrics_hist *hist,
+				uint64_t count, uint32_t pct)
+{
+	uint64_t target = count * pct / 100, sum = 0;
+	int b;
+
+	for (b = 0; b < NR_METRIC_BUCKETS - 1; b++) {
+		sum += hist->buckets[b];
+		if (sum > target)
+			break;
+	}
+
+	return min(bucket_to_latency(b + 1), hist->max);
+}
+
+static void add_metric(struct sd_metric *m, const char *name,
+		       const char *label, uint32_t type, uint64_t value)
+{
+	memset(m, 0, sizeof(*m));
+	pstrcpy(m->name, sizeof(m->name), name);
+	if (label)
+		pstrcpy(m->label, sizeof(m->label), label);
+	m->type = type;
+	m->value = value;
+}
+
+/*
+ * Fill metrics with the metrics of the node, return the number of them or -1
+ * if max is too small.  Must be called from the main thread.
+ */
+int metrics_snapshot(struct sd_metric *metrics, int max)
+{
+	struct wqueue_stat stats[MAX_WQUEUES];
+	uint64_t counters[NR_METRIC_COUNTERS] = {};
+	struct metrics_hist *hists, *h;
+	struct metrics_block *b;
+	struct sd_metric *m = metrics;
+	uint64_t cached, dirty, count;
+	int i, j, nr_wqueues;
+
+	nr_wqueues = get_wqueue_stats(stats, ARRAY_SIZE(stats));
+	if (nr_wqueues < 0)
+		nr_wqueues = 0;
+	if (max < NR_METRIC_COUNTERS + NR_METRIC_HISTS + 6 + nr_wqueues * 4)
+		return -1;
+
+	hists = xzalloc(sizeof(*hists) * NR_METRIC_HISTS);
+	pthread_mutex_lock(&block_lock);
+	list_for_each_entry(b, &block_list, list) {
+		for (i = 0; i < NR_METRIC_COUNTERS; i++)
+			counters[i] += uatomic_read(&b->counters[i]);
+		for (i = 0; i < NR_METRIC_HISTS; i++) {
+			h = b->hists + i;
+			for (j = 0; j < NR_METRIC_BUCKETS; j++)
+				hists[i].buckets[j] +=
+					uatomic_read(&h->buckets[j]);
+			hists[i].sum += uatomic_read(&h->sum);
+			hists[i].max = max(hists[i].max,
+					   uatomic_read(&h->max));
+		}
+	}
+	pthread_mutex_unlock(&block_lock);
+
+	for (i = 0; i < NR_METRIC_COUNTERS; i++)
+		add_metric(m++, counter_names[i], NULL, SD_METRIC_COUNTER,
+			   counters[i]);
+	add_metric(m++, "log_dropped_messages", NULL, SD_METRIC_COUNTER,
+		   log_nr_dropped());
+
+	for (i = 0; i < NR_METRIC_HISTS; i++) {
+		for (count = 0, j = 0; j < NR_METRIC_BUCKETS; j++)
+			count += hists[i].buckets[j];
+		add_metric(m, hist_names[i], NULL, SD_METRIC_HISTOGRAM, count);
+		m->sum = hists[i].sum;
+		m->max = hists[i].max;
+		if (count) {
+			m->p50 = hist_percentile(hists + i, count, 50);
+			m->p99 = hist_percentile(hists + i, count, 99);
+		}
+		m++;
+	}
+	free(hists);
+
+	add_metric(m++, "outstanding_requests", NULL, SD_METRIC_GAUGE,
+		   uatomic_read(&sys->nr_outstanding_reqs));
+	add_metric(m++, "lagging_writes", NULL, SD_METRIC_GAUGE,
+		   uatomic_read(&sys->nr_lagging_writes));
+	add_metric(m++, "recovery_remaining_objects", NULL, SD_METRIC_GAUGE,
+		   recovery_remaining_objects());
+	object_cache_usage(&cached, &dirty);
+	add_metric(m++, "object_cache_bytes", NULL, SD_METRIC_GAUGE, cached);
+	add_metric(m++, "object_cache_dirty_bytes", NULL, SD_METRIC_GAUGE,
+		   dirty);
+
+	/* grouped by the metric, as the text format wants */
+	for (i = 0; i < nr_wqueues; i++)
+		add_metric(m++, "work_pending", stats[i].name, SD_METRIC_GAUGE,
+			   stats[i].nr_pending);
+	for (i = 0; i < nr_wqueues; i++)
+		add_metric(m++, "work_running", stats[i].name, SD_METRIC_GAUGE,
+			   stats[i].nr_running);
+	for (i = 0; i < nr_wqueues; i++)
+		add_metric(m++, "work_threads", stats[i].name, SD_METRIC_GAUGE,
+			   stats[i].nr_threads);
+	for (i = 0; i < nr_wqueues; i++)
+		add_metric(m++, "work_queued", stats[i].name, SD_METRIC_COUNTER,
+			   stats[i].nr_queued);
+
+	return m - metrics;
+}
+
+#define MAX_METRICS 512
+
+static const char * const prom_types[] = {
+	[SD_METRIC_COUNTER] = "counter",
+	[SD_METRIC_GAUGE] = "gauge",
+	[SD_METRIC_HISTOGRAM] = "summary",
+};
+
+static void prom_add_metric(struct strbuf *buf, const struct sd_metric *m,
+			    bool first)
+{
+	char label[SD_METRIC_LABEL_LEN + 16] = "";
+	const char *sep = "";
+
+	if (first)
+		strbuf_addf(buf, "# TYPE sheep_%s %s\n", m->name,
+			    prom_types[m->type]);
+	if (m->label[0]) {
+		snprintf(label, sizeof(label), "queue=\"%s\"", m->label);
+		sep = ",";
+	}
+
+	if (m->type != SD_METRIC_HISTOGRAM) {
+		if (label[0])
+			strbuf_addf(buf, "sheep_%s{%s} %"PRIu64"\n", m->name,
+				    label, m->value);
+		else
+			strbuf_addf(buf, "sheep_%s %"PRIu64"\n", m->name,
+				    m->value);
+		return;
+	}
+
+	strbuf_addf(buf, "sheep_%s{%s%squantile=\"0.5\"} %"PRIu64"\n",
+		    m->name, label, sep, m->p50);
+	strbuf_addf(buf, "sheep_%s{%s%squantile=\"0.99\"} %"PRIu64"\n",
+		    m->name, label, sep, m->p99);
+	strbuf_addf(buf, "sheep_%s_sum %"PRIu64"\n", m->name, m->sum);
+	strbuf_addf(buf, "sheep_%s_count %"PRIu64"\n", m->name, m->value);
+}
+
+/* Answer a connection to the metrics socket, then close it */
+static void metrics_handler(int listen_fd, int events, void *data)
+{
+	struct sd_metric *metrics;
+	struct strbuf buf = STRBUF_INIT;
+	struct timeval tv = { .tv_sec = 1 };
+	int fd, i, nr;
+
+	fd = accept(listen_fd, NULL, NULL);
+	if (fd < 0) {
+		sd_eprintf("failed to accept a new connection: %m");
+		return;
+	}
+
+	metrics = xcalloc(MAX_METRICS, sizeof(*metrics));
+	nr = metrics_snapshot(metrics, MAX_METRICS);
+	for (i = 0; i < nr; i++)
+		prom_add_metric(&buf, metrics + i, i == 0 ||
+				strcmp(metrics[i].name, metrics[i - 1].name));
+	free(metrics);
+
+	/* we write in the main thread, don't wait long for a stuck reader */
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+	if (xwrite(fd, buf.buf, buf.len) != buf.len)
+		sd_dprintf("failed to write the metrics, %m");
+	strbuf_release(&buf);
+	close(fd);
+}
+
+static int metrics_listen_fn(int fd, void *data)
+{
+	return register_event(fd, metrics_handler, data);
+}
+
+int init_metrics_socket(const char *dir)
+{
+	char path[PATH_MAX];
+
+	snprintf(path, sizeof(path), "%s/metrics", dir);
+	unlink(path);
+
+	return create_unix_domain_socket(path, metrics_listen_fn, NULL);
+}
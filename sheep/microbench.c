@@ -0,0 +1,597 @@
+/*
+ * Copyright (C) 2013 Taobao Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Microbenchmarks of the data structures on the hot paths of sheep: the
+ * placement of objects on the vnodes and on the disks, the red-black trees
+ * of the fd and sockfd caches, sha1 and the work queue.
+ *
+ * The inputs only depend on the options, the seed included, so that two
+ * builds can be compared on the same machine.  Build and run it with
+ * 'make bench' at the top of the tree.
+ */
+
+#include <time.h>
+#include <pthread.h>
+
+#include "sheep_priv.h"
+#include "sha1.h"
+#include "option.h"
+
+#define MB_DEFAULT_NODES 16
+#define MB_DEFAULT_OBJECTS 100000
+#define MB_DEFAULT_DISKS 8
+#define MB_DEFAULT_WORKS 100000
+#define MB_VDISKS 128		/* MD_DEFAULT_VDISKS */
+#define MB_VDI_OBJECTS 1024	/* per VDI with -d vdis */
+#define MB_SHA1_BYTES (64 << 20)
+#define MB_SHA1_LANES 8
+
+static struct sd_option microbench_options[] = {
+	{'n', "nodes", true, "number of nodes (default 16)"},
+	{'v', "vnodes", true, "number of vnodes per node (default 64)"},
+	{'z', "zones", true, "number of zones (default one per node)"},
+	{'c', "copies", true, "number of copies (default 3)"},
+	{'o', "objects", true, "number of object ids (default 100000)"},
+	{'d', "distribution", true,
+	 "object ids: random, seq or vdis (default random)"},
+	{'D', "disks", true, "number of disks for md (default 8)"},
+	{'w', "works", true, "number of works to queue (default 100000)"},
+	{'s', "seed", true, "seed of the inputs (default 1)"},
+	{'b', "bench", true, "only run the benchmarks matching this"},
+	{'r', "raw", false, "raw output mode: omit headers"},
+	{'h', "help", false, "display this help and exit"},
+	{ 0, NULL, false, NULL },
+};
+
+static struct {
+	int nr_nodes;
+	int nr_vnodes;
+	int nr_zones;
+	int nr_copies;
+	int nr_oids;
+	const char *distribution;
+	int nr_disks;
+	int nr_works;
+	uint64_t seed;
+	const char *filter;
+	bool raw;
+} mb = {
+	.nr_nodes = MB_DEFAULT_NODES,
+	.nr_vnodes = SD_DEFAULT_VNODES,
+	.nr_copies = SD_DEFAULT_COPIES,
+	.nr_oids = MB_DEFAULT_OBJECTS,
+	.distribution = "random",
+	.nr_disks = MB_DEFAULT_DISKS,
+	.nr_works = MB_DEFAULT_WORKS,
+	.seed = 1,
+};
+
+static struct sd_node nodes[SD_MAX_NODES];
+static struct sd_vnode vnodes[SD_MAX_VNODES];
+static uint64_t *oids;
+
+/* works don't record metrics here */
+void metric_observe(enum metric_hist h, uint64_t us)
+{
+}
+
+/* xorshift64*, so that the inputs don't depend on the libc */
+static uint64_t mb_rand(void)
+{
+	mb.seed ^= mb.seed >> 12;
+	mb.seed ^= mb.seed << 25;
+	mb.seed ^= mb.seed >> 27;
+	return mb.seed * 2685821657736338717ULL;
+}
+
+static uint64_t nsec_time(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static bool want(const char *name)
+{
+	return !mb.filter || strstr(name, mb.filter);
+}
+
+/* bytes is the size of each op, 0 if it doesn't move data */
+static void report(const char *name, uint64_t nr_ops, uint64_t nsec,
+		   uint64_t bytes)
+{
+	double ns_per_op = nr_ops ? (double)nsec / nr_ops : 0;
+	double mbps = nsec ? (double)bytes * nr_ops * 1000000000 / nsec /
+		(1 << 20) : 0;
+
+	if (mb.raw)
+		printf("%s %" PRIu64 " %.1f %.1f\n", name, nr_ops, ns_per_op,
+		       bytes ? mbps : 0);
+	else if (bytes)
+		printf("%-28s %10" PRIu64 " %12.1f %10.1f\n", name, nr_ops,
+		       ns_per_op, mbps);
+	else
+		printf("%-28s %10" PRIu64 " %12.1f %10s\n", name, nr_ops,
+		       ns_per_op, "-");
+}
+
+static void init_nodes(void)
+{
+	int i;
+
+	for (i = 0; i < mb.nr_nodes; i++) {
+		/* 10.0.x.y, IPv4 mapped like str_to_addr() does */
+		nodes[i].nid.addr[10] = nodes[i].nid.addr[11] = 0xff;
+		nodes[i].nid.addr[12] = 10;
+		nodes[i].nid.addr[14] = i >> 8;
+		nodes[i].nid.addr[15] = i & 0xff;
+		nodes[i].nid.port = 7000;
+		nodes[i].nr_vnodes = mb.nr_vnodes;
+		nodes[i].zone = i % mb.nr_zones;
+	}
+}
+
+static void init_oids(void)
+{
+	uint32_t vid;
+	int i;
+
+	oids = xmalloc(sizeof(*oids) * mb.nr_oids);
+	vid = mb_rand() & (SD_NR_VDIS - 1);
+	for (i = 0; i < mb.nr_oids; i++) {
+		if (!strcmp(mb.distribution, "seq"))
+			oids[i] = vid_to_data_oid(vid, i % MAX_DATA_OBJS);
+		else if (!strcmp(mb.distribution, "vdis"))
+			oids[i] = vid_to_data_oid(
+				(vid + i / MB_VDI_OBJECTS) % SD_NR_VDIS,
+				i % MB_VDI_OBJECTS);
+		else
+			oids[i] = vid_to_data_oid(
+				mb_rand() & (SD_NR_VDIS - 1),
+				mb_rand() % MAX_DATA_OBJS);
+	}
+}
+
+static void bench_placement(int placement, const char *pname)
+{
+	const struct sd_vnode *v[SD_MAX_COPIES];
+	int i, nr_vnodes = 0, rounds = max(1, 10000 / mb.nr_nodes);
+	char name[64];
+	uint64_t start;
+
+	snprintf(name, sizeof(name), "%s/nodes_to_vnodes", pname);
+	if (want(name)) {
+		start = nsec_time();
+		for (i = 0; i < rounds; i++)
+			nr_vnodes = placement_nodes_to_vnodes(placement, nodes,
+							      mb.nr_nodes,
+							      vnodes);
+		report(name, rounds, nsec_time() - start, 0);
+	}
+
+	snprintf(name, sizeof(name), "%s/oid_to_vnodes", pname);
+	if (want(name)) {
+		nr_vnodes = placement_nodes_to_vnodes(placement, nodes,
+						      mb.nr_nodes, vnodes);
+		start = nsec_time();
+		for (i = 0; i < mb.nr_oids; i++)
+			placement_oid_to_vnodes(placement, vnodes, nr_vnodes,
+						oids[i], mb.nr_copies, v);
+		report(name, mb.nr_oids, nsec_time() - start, 0);
+	}
+}
+
+static void bench_md(void)
+{
+	struct vdisk *vds;
+	char path[PATH_MAX];
+	int i, nr_vds = mb.nr_disks * MB_VDISKS;
+	uint64_t start;
+
+	if (!want("md/oid_to_vdisk"))
+		return;
+
+	vds = xmalloc(sizeof(*vds) * nr_vds);
+	for (i = 0; i < mb.nr_disks; i++) {
+		snprintf(path, sizeof(path), "/var/lib/sheepdog/disk%d", i);
+		path_to_vdisks(path, MB_VDISKS, i, vds + i * MB_VDISKS);
+	}
+	qsort(vds, nr_vds, sizeof(*vds), vdisk_cmp);
+
+	start = nsec_time();
+	for (i = 0; i < mb.nr_oids; i++)
+		oid_to_vdisk_from(vds, nr_vds, oids[i]);
+	report("md/oid_to_vdisk", mb.nr_oids, nsec_time() - start, 0);
+
+	free(vds);
+}
+
+/* Keyed like the fd cache */
+struct oid_entry {
+	struct rb_node rb;
+	uint64_t oid;
+	bool linked;	/* false for the duplicates */
+};
+
+static struct oid_entry *oid_tree_insert(struct rb_root *root,
+					 struct oid_entry *new)
+{
+	struct rb_node **p = &root->rb_node;
+	struct rb_node *parent = NULL;
+	struct oid_entry *entry;
+
+	while (*p) {
+		parent = *p;
+		entry = rb_entry(parent, struct oid_entry, rb);
+
+		if (new->oid < entry->oid)
+			p = &(*p)->rb_left;
+		else if (new->oid > entry->oid)
+			p = &(*p)->rb_right;
+		else
+			return entry;
+	}
+	rb_link_node(&new->rb, parent, p);
+	rb_insert_color(&new->rb, root);
+
+	return NULL;
+}
+
+static struct oid_entry *oid_tree_lookup(struct rb_root *root, uint64_t oid)
+{
+	struct rb_node *n = root->rb_node;
+	struct oid_entry *entry;
+
+	while (n) {
+		entry = rb_entry(n, struct oid_entry, rb);
+
+		if (oid < entry->oid)
+			n = n->rb_left;
+		else if (oid > entry->oid)
+			n = n->rb_right;
+		else
+			return entry;
+	}
+
+	return NULL;
+}
+
+/* Keyed like the sockfd cache */
+struct nid_entry {
+	struct rb_node rb;
+	struct node_id nid;
+};
+
+static struct nid_entry *nid_tree_insert(struct rb_root *root,
+					 struct nid_entry *new)
+{
+	struct rb_node **p = &root->rb_node;
+	struct rb_node *parent = NULL;
+	struct nid_entry *entry;
+	int cmp;
+
+	while (*p) {
+		parent = *p;
+		entry = rb_entry(parent, struct nid_entry, rb);
+
+		cmp = node_id_cmp(&new->nid, &entry->nid);
+		if (cmp < 0)
+			p = &(*p)->rb_left;
+		else if (cmp > 0)
+			p = &(*p)->rb_right;
+		else
+			return entry;
+	}
+	rb_link_node(&new->rb, parent, p);
+	rb_insert_color(&new->rb, root);
+
+	return NULL;
+}
+
+static struct nid_entry *nid_tree_lookup(struct rb_root *root,
+					 const struct node_id *nid)
+{
+	struct rb_node *n = root->rb_node;
+	struct nid_entry *entry;
+	int cmp;
+
+	while (n) {
+		entry = rb_entry(n, struct nid_entry, rb);
+
+		cmp = node_id_cmp(nid, &entry->nid);
+		if (cmp < 0)
+			n = n->rb_left;
+		else if (cmp > 0)
+			n = n->rb_right;
+		else
+			return entry;
+	}
+
+	return NULL;
+}
+
+static void bench_rbtree(void)
+{
+	struct rb_root root = RB_ROOT, nid_root = RB_ROOT;
+	struct oid_entry *oes, *oe;
+	struct nid_entry *nes;
+	int i, nr = 0;
+	uint64_t start;
+
+	oes = xzalloc(sizeof(*oes) * mb.nr_oids);
+	for (i = 0; i < mb.nr_oids; i++)
+		oes[i].oid = oids[i];
+
+	start = nsec_time();
+	for (i = 0; i < mb.nr_oids; i++)
+		oes[i].linked = !oid_tree_insert(&root, oes + i);
+	if (want("rbtree/oid_insert"))
+		report("rbtree/oid_insert", mb.nr_oids, nsec_time() - start, 0);
+
+	start = nsec_time();
+	for (i = 0; i < mb.nr_oids; i++)
+		if (oid_tree_lookup(&root, oids[i]))
+			nr++;
+	if (want("rbtree/oid_lookup"))
+		report("rbtree/oid_lookup", nr, nsec_time() - start, 0);
+
+	start = nsec_time();
+	for (oe = oes; oe < oes + mb.nr_oids; oe++)
+		if (oe->linked)
+			rb_erase(&oe->rb, &root);
+	if (want("rbtree/oid_erase"))
+		report("rbtree/oid_erase", nr, nsec_time() - start, 0);
+	free(oes);
+
+	if (!want("rbtree/nid_lookup"))
+		return;
+
+	nes = xzalloc(sizeof(*nes) * mb.nr_nodes);
+	for (i = 0; i < mb.nr_nodes; i++) {
+		nes[i].nid = nodes[i].nid;
+		nid_tree_insert(&nid_root, nes + i);
+	}
+	start = nsec_time();
+	for (i = 0; i < mb.nr_oids; i++)
+		nid_tree_lookup(&nid_root, &nodes[oids[i] % mb.nr_nodes].nid);
+	report("rbtree/nid_lookup", mb.nr_oids, nsec_time() - start, 0);
+	free(nes);
+}
+
+static void bench_sha1(void)
+{
+	struct sha1_ctx ctx;
+	uint8_t *buf, digest[SHA1_LEN], *digests;
+	const uint8_t *data[MB_SHA1_LANES];
+	uint8_t *out[MB_SHA1_LANES];
+	int obj_size = SD_DATA_OBJ_SIZE, blk = 4096;
+	int i, j, nr;
+	uint64_t start;
+
+	buf = xmalloc(obj_size);
+	for (i = 0; i < obj_size; i += sizeof(uint64_t))
+		*(uint64_t *)(buf + i) = mb_rand();
+
+	if (want("sha1/4m")) {
+		nr = MB_SHA1_BYTES / obj_size;
+		start = nsec_time();
+		for (i = 0; i < nr; i++) {
+			sha1_init(&ctx);
+			sha1_update(&ctx, buf, obj_size);
+			sha1_final(&ctx, digest);
+		}
+		report("sha1/4m", nr, nsec_time() - start, obj_size);
+	}
+
+	if (want("sha1/4k")) {
+		nr = MB_SHA1_BYTES / blk;
+		start = nsec_time();
+		for (i = 0; i < nr; i++) {
+			sha1_init(&ctx);
+			sha1_update(&ctx, buf + (i * blk) % obj_size, blk);
+			sha1_final(&ctx, digest);
+		}
+		report("sha1/4k", nr, nsec_time() - start, blk);
+	}
+
+	digests = xmalloc(SHA1_LEN * (obj_size / blk));
+	if (want("sha1/multi_4k")) {
+		nr = MB_SHA1_BYTES / blk / MB_SHA1_LANES;
+		for (j = 0; j < MB_SHA1_LANES; j++)
+			out[j] = digests + j * SHA1_LEN;
+		start = nsec_time();
+		for (i = 0; i < nr; i++) {
+			for (j = 0; j < MB_SHA1_LANES; j++)
+				data[j] = buf + ((i * MB_SHA1_LANES + j) *
+						 blk) % obj_size;
+			sha1_multi(data, blk, out, MB_SHA1_LANES);
+		}
+		report("sha1/multi_4k", nr * MB_SHA1_LANES,
+		       nsec_time() - start, blk);
+	}
+
+	if (want("sha1/ranges_4k")) {
+		nr = MB_SHA1_BYTES / obj_size;
+		start = nsec_time();
+		for (i = 0; i < nr; i++)
+			sha1_ranges(buf, obj_size, blk, digests);
+		report("sha1/ranges_4k", nr * (obj_size / blk),
+		       nsec_time() - start, blk);
+	}
+
+	free(digests);
+	free(buf);
+}
+
+static int nr_works_done;
+
+static void mb_work_fn(struct work *work)
+{
+}
+
+static void mb_work_done(struct work *work)
+{
+	nr_works_done++;
+}
+
+static void bench_work(const char *name, enum wq_thread_control tc)
+{
+	struct work_queue *q;
+	struct work *works;
+	uint64_t start;
+	int i;
+
+	if (!want(name))
+		return;
+
+	q = init_work_queue(name, tc);
+	if (!q) {
+		fprintf(stderr, "failed to create the work queue %s\n", name);
+		exit(1);
+	}
+
+	works = xzalloc(sizeof(*works) * mb.nr_works);
+	nr_works_done = 0;
+	start = nsec_time();
+	for (i = 0; i < mb.nr_works; i++) {
+		works[i].fn = mb_work_fn;
+		works[i].done = mb_work_done;
+		queue_work(q, works + i);
+	}
+	while (nr_works_done < mb.nr_works)
+		event_loop(-1);
+	report(name, mb.nr_works, nsec_time() - start, 0);
+
+	free(works);
+}
+
+static void usage(int status)
+{
+	const struct sd_option *opt;
+
+	printf("Usage: microbench [OPTION]...\n"
+	       "Time the hot-path data structures of sheep\n\n");
+	sd_for_each_option(opt, microbench_options)
+		printf("  -%c, --%-18s%s\n", opt->ch, opt->name, opt->desc);
+	exit(status);
+}
+
+static int parse_int(const char *opt, int min, int max)
+{
+	char *p;
+	long v = strtol(opt, &p, 10);
+
+	if (opt == p || *p || v < min || v > max) {
+		fprintf(stderr, "'%s' is not a number between %d and %d\n",
+			opt, min, max);
+		exit(1);
+	}
+
+	return v;
+}
+
+int main(int argc, char **argv)
+{
+	static struct logger_user_info info;
+	struct option *long_options;
+	const char *short_options;
+	int ch, longindex;
+
+	long_options = build_long_options(microbench_options);
+	short_options = build_short_options(microbench_options);
+	while ((ch = getopt_long(argc, argv, short_options, long_options,
+				 &longindex)) >= 0) {
+		switch (ch) {
+		case 'n':
+			mb.nr_nodes = parse_int(optarg, 1, SD_MAX_NODES);
+			break;
+		case 'v':
+			mb.nr_vnodes = parse_int(optarg, 1, UINT16_MAX);
+			break;
+		case 'z':
+			mb.nr_zones = parse_int(optarg, 1, SD_MAX_NODES);
+			break;
+		case 'c':
+			mb.nr_copies = parse_int(optarg, 1, SD_MAX_COPIES);
+			break;
+		case 'o':
+			mb.nr_oids = parse_int(optarg, 1, INT32_MAX);
+			break;
+		case 'd':
+			if (strcmp(optarg, "random") && strcmp(optarg, "seq") &&
+			    strcmp(optarg, "vdis")) {
+				fprintf(stderr, "unknown distribution %s\n",
+					optarg);
+				exit(1);
+			}
+			mb.distribution = optarg;
+			break;
+		case 'D':
+			mb.nr_disks = parse_int(optarg, 1, 64);
+			break;
+		case 'w':
+			mb.nr_works = parse_int(optarg, 1, INT32_MAX);
+			break;
+		case 's':
+			/* xorshift gets stuck at zero */
+			mb.seed = parse_int(optarg, 1, INT32_MAX);
+			break;
+		case 'b':
+			mb.filter = optarg;
+			break;
+		case 'r':
+			mb.raw = true;
+			break;
+		case 'h':
+			usage(0);
+			break;
+		default:
+			usage(1);
+			break;
+		}
+	}
+
+	if (!mb.nr_zones)
+		mb.nr_zones = mb.nr_nodes;
+	if (mb.nr_nodes * mb.nr_vnodes > SD_MAX_VNODES) {
+		fprintf(stderr, "at most %d vnodes in total\n", SD_MAX_VNODES);
+		exit(1);
+	}
+	if (mb.nr_copies > mb.nr_zones) {
+		fprintf(stderr, "there must be a zone for each copy\n");
+		exit(1);
+	}
+
+	early_log_init("default", &info);
+	if (init_event(4096) || init_wqueue_eventfd()) {
+		fprintf(stderr, "failed to initialize the event loop\n");
+		exit(1);
+	}
+
+	init_nodes();
+	init_oids();
+
+	if (!mb.raw)
+		printf("%-28s %10s %12s %10s\n", "Benchmark", "Ops", "ns/op",
+		       "MB/s");
+	bench_placement(SD_PLACEMENT_RING, "ring");
+	bench_placement(SD_PLACEMENT_STRAW2, "straw2");
+	bench_md();
+	bench_rbtree();
+	bench_sha1();
+	bench_work("work/dynamic", WQ_DYNAMIC);
+	bench_work("work/ordered", WQ_ORDERED);
+
+	free(oids);
+	return 0;
+}
@@ -18,16 +18,18 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <sched.h>
 #include <errno.h>
 #include <sys/file.h>
 #include <dirent.h>
 #include <urcu/uatomic.h>
 #include <sys/eventfd.h>
+#include <sys/xattr.h>
+#include <sys/mman.h>
 
 #include "sheep_priv.h"
 #include "util.h"
 #include "strbuf.h"
-#include "rbtree.h"
 
 /*
  * Object Cache ID
@@ -45,11 +47,15 @@
 #define CACHE_INDEX_MASK      (CACHE_CREATE_BIT)
 
 #define CACHE_BLOCK_SIZE      ((UINT64_C(1) << 10) * 64) /* 64 KB */
+#define CACHE_NR_BLOCKS       64 /* Blocks tracked by one bitmap */
+#define CACHE_ALL_BLOCKS      UINT64_MAX
 
-#define CACHE_OBJECT_SIZE (SD_DATA_OBJ_SIZE / 1024 / 1024) /* M */
+/* The cached blocks of a partial object, kept to survive restarts */
+#define CACHE_PRESENT_NAME    "user.cache.present"
 
 struct global_cache {
-	uint32_t capacity; /* The real capacity of object cache of this node */
+	uint64_t capacity; /* Bytes cached on this node */
+	uint64_t dirty; /* Dirty bytes waiting to be pushed */
 	uatomic_bool in_reclaim; /* If the relcaimer is working */
 };
 
@@ -57,31 +63,77 @@ struct object_cache_entry {
 	uint32_t idx; /* Index of this entry */
 	int refcnt; /* Reference count of this entry */
 	uint64_t bmap; /* Each bit represents one dirty block in object */
+	/*
+	 * Each bit represents one block in the cache file.  Data objects are
+	 * pulled block by block on demand, so a random read miss doesn't
+	 * fetch the whole object.  VDI objects are always cached as a whole.
+	 */
+	uint64_t present;
+	uint64_t accessed; /* Blocks accessed since the reclaimer last looked */
 	struct object_cache *oc; /* Object cache this entry belongs to */
-	struct rb_node node; /* For lru tree of object cache */
-	struct list_head dirty_list; /* For dirty list of object cache */
-	struct list_head lru_list; /* For lru list of object cache */
+	struct hlist_node hash; /* For the index of the shard */
+	struct list_head dirty_list; /* For dirty list of the shard */
+	struct list_head lru_list; /* For lru or hot list of the shard */
+	uatomic_bool referenced; /* Hit since the reclaimer last looked at it */
+	bool hot; /* On the hot list, protected by shard lock */
 
 	pthread_rwlock_t lock; /* Entry lock */
 };
 
+/*
+ * The entries of a VDI are spread over OC_NR_SHARDS shards by their index, so
+ * that the I/O threads working on different objects of a busy VDI don't
+ * serialize on one lock.  Each shard has its own hash index, which grows with
+ * the number of its entries, and its own LRU and dirty lists.
+ *
+ * With OC_POLICY_CLOCK, new entries go to the cold (lru) list and a hit only
+ * sets the referenced bit of the entry.  The reclaimer promotes referenced
+ * cold entries to the hot list, evicts the others, and keeps the hot list no
+ * larger than the cold one by demoting the hot entries that weren't hit since
+ * its last pass.  Objects touched once by a sequential scan never become hot,
+ * so the scan can't flush the working set.
+ */
+#define OC_SHARD_BITS		4
+#define OC_NR_SHARDS		(1 << OC_SHARD_BITS)
+#define OC_INDEX_MIN_BITS	6
+
+struct oc_shard {
+	struct hlist_head *index; /* Entries hashed by idx */
+	unsigned int index_bits;
+	uint32_t nr_entries;
+	struct list_head lru_head; /* LRU or cold list for reclaimer */
+	struct list_head hot_head; /* Hot list of OC_POLICY_CLOCK */
+	uint32_t nr_hot;
+	struct list_head dirty_head; /* Dirty objects linked to this list */
+
+	pthread_rwlock_t lock; /* Shard lock */
+};
+
 struct object_cache {
 	uint32_t vid; /* The VID of this VDI */
-	uint32_t push_count; /* How many push threads queued in push phase. */
+	uint32_t block_size; /* A 64th of the size of its data objects */
+	int refcnt; /* Held by the hash table and the background writeback */
+	bool deleted; /* Unhashed, not to be written back any more */
+	pthread_mutex_t wb_lock; /* Held by the writeback of an entry */
 	struct hlist_node hash; /* VDI is linked to the global hash lists */
-	struct rb_root lru_tree; /* For faster object search */
-	struct list_head lru_head; /* Per VDI LRU list for reclaimer */
-	struct list_head dirty_head; /* Dirty objects linked to this list */
-	int push_efd; /* Used to synchronize between pusher and push threads */
 
-	pthread_rwlock_t lock; /* Cache lock */
+	/* Sequential read detection, protected by ra_lock */
+	pthread_mutex_t ra_lock;
+	uint32_t ra_last; /* Data object read last */
+	uint32_t ra_next; /* Next data object to prefetch */
+	uint32_t ra_window; /* Objects prefetched ahead, 0 if not sequential */
+	uint32_t ra_gen; /* Bumped to cancel the queued prefetches */
+
+	struct oc_shard shards[OC_NR_SHARDS];
 };
 
 static struct global_cache gcache;
 static char object_cache_dir[PATH_MAX];
 static int def_open_flags = O_RDWR;
+/* Cache data objects block by block, which needs xattr support */
+static bool block_cache;
 
-#define HASH_BITS	5
+#define HASH_BITS	10
 #define HASH_SIZE	(1 << HASH_BITS)
 
 static pthread_rwlock_t hashtable_lock[HASH_SIZE] = {
@@ -90,6 +142,138 @@ static pthread_rwlock_t hashtable_lock[HASH_SIZE] = {
 
 static struct hlist_head cache_hashtable[HASH_SIZE];
 
+/*
+ * Cache index
+ *
+ * The entries, with their dirty and cached blocks, are saved to the .index
+ * file of the cache directory every OC_INDEX_INTERVAL seconds in LRU order,
+ * and the changes since then are appended to the .journal file.  A restart
+ * maps the index and replays the journal instead of walking all the cache
+ * directories and assuming that everything is dirty.
+ *
+ * Each journal starts with the generation of the index it follows.  An index
+ * snapshot switches to a new journal first, then walks the entries, so the
+ * changes made during the walk can be in both of them and replaying them has
+ * to be harmless.  A change is logged and applied under the read side of
+ * index_lock, so it can't straddle the switch.
+ *
+ * Cache files are created and unlinked after their OC_REC_INTENT and
+ * OC_REC_DEL records are logged, so the replay finds the files left behind by
+ * a crash.  The OC_REC_DIRTY records are synced before the write that dirties
+ * the blocks is answered, so that acknowledged data is never reloaded as clean.
+ * They are only logged when a block gets dirty, not on every write.  The
+ * other records are only synced before the blocks are dropped.
+ */
+#define OC_INDEX_MAGIC		0x6f63696e /* "ocin" */
+#define OC_INDEX_INTERVAL	60 /* seconds between index snapshots */
+#define OC_INDEX_NAME		".index"
+#define OC_JOURNAL_NAME		".journal"
+
+enum oc_rec_type {
+	OC_REC_ADD = 1,	/* entry is cached with the recorded state */
+	OC_REC_INTENT,	/* cache file is about to be created */
+	OC_REC_DEL,	/* entry is reclaimed */
+	OC_REC_DIRTY,	/* blocks in bmap are dirtied */
+	OC_REC_DROP,	/* clean blocks in present are dropped */
+	OC_REC_DEL_VDI,	/* all the entries of the VDI are deleted */
+	OC_REC_MAX,
+};
+
+#define OC_REC_HOT		0x1 /* On the hot list */
+
+struct oc_index_header {
+	uint32_t magic;
+	uint32_t gen; /* The journals older than the index are stale */
+	uint64_t nr_entries; /* OC_REC_ADD records following the header */
+};
+
+struct oc_rec {
+	uint32_t magic;
+	uint16_t type;
+	uint16_t flags;
+	uint32_t vid;
+	uint32_t idx; /* Along with CACHE_CREATE_BIT */
+	uint64_t bmap;
+	uint64_t present;
+};
+
+static pthread_rwlock_t index_lock = PTHREAD_RWLOCK_INITIALIZER;
+static int journal_fd = -1; /* Nothing is logged until the cache is loaded */
+static uint32_t index_gen;
+static uatomic_bool journal_failed;
+
+/* Path of the file 'name' of the cache index, such as OC_JOURNAL_NAME */
+static void get_index_path(char *p, const char *name)
+{
+	int len = snprintf(p, PATH_MAX, "%s/%s", object_cache_dir, name);
+
+	if (len >= PATH_MAX)
+		panic("%s/%s is too long", object_cache_dir, name);
+}
+
+/* Path of the cache directory of the VDI */
+static void get_cache_vdi_path(char *p, uint32_t vid)
+{
+	int len = snprintf(p, PATH_MAX, "%s/%06"PRIx32, object_cache_dir, vid);
+
+	if (len >= PATH_MAX)
+		panic("the cache path of %"PRIx32" is too long", vid);
+}
+
+/* Path of the cache file of the object idx of the VDI, with the suffix */
+static void get_cache_path(char *p, uint32_t vid, uint32_t idx,
+			   const char *suffix)
+{
+	int len = snprintf(p, PATH_MAX, "%s/%06"PRIx32"/%08"PRIx32"%s",
+			   object_cache_dir, vid, idx, suffix);
+
+	if (len >= PATH_MAX)
+		panic("the cache path of %"PRIx32"/%"PRIx32" is too long", vid,
+		      idx);
+}
+
+static inline void begin_cache_event(void)
+{
+	pthread_rwlock_rdlock(&index_lock);
+}
+
+static inline void end_cache_event(void)
+{
+	pthread_rwlock_unlock(&index_lock);
+}
+
+/* Called between begin_cache_event() and end_cache_event() */
+static void log_cache_event(uint16_t type, uint16_t flags, uint32_t vid,
+			    uint32_t idx, uint64_t bmap, uint64_t present,
+			    bool sync)
+{
+	struct oc_rec rec = {
+		.magic = OC_INDEX_MAGIC,
+		.type = type,
+		.flags = flags,
+		.vid = vid,
+		.idx = idx,
+		.bmap = bmap,
+		.present = present,
+	};
+	char p[PATH_MAX];
+
+	if (journal_fd < 0)
+		return;
+
+	/* O_APPEND keeps the concurrent records apart */
+	if (xwrite(journal_fd, &rec, sizeof(rec)) == sizeof(rec) &&
+	    (!sync || fdatasync(journal_fd) == 0))
+		return;
+
+	/* The index is useless without the change, restart walks the cache */
+	sd_eprintf("failed to log cache event, %m");
+	if (uatomic_set_true(&journal_failed)) {
+		get_index_path(p, OC_INDEX_NAME);
+		unlink(p);
+	}
+}
+
 static inline bool entry_is_dirty(const struct object_cache_entry *entry)
 {
 	return !!entry->bmap;
@@ -119,13 +303,33 @@ static inline bool idx_has_vdi_bit(uint32_t idx)
 	return !!(idx & CACHE_VDI_BIT);
 }
 
-static uint64_t calc_object_bmap(size_t len, off_t offset)
+/* The size of the blocks which one bit of the bitmaps of the object covers */
+static inline uint32_t block_size_of(const struct object_cache *oc,
+				     uint32_t idx)
+{
+	if (idx_has_vdi_bit(idx))
+		return CACHE_BLOCK_SIZE;
+
+	return oc->block_size;
+}
+
+static inline uint32_t object_size_of(const struct object_cache *oc,
+				      uint32_t idx)
+{
+	if (idx_has_vdi_bit(idx))
+		return SD_INODE_SIZE;
+
+	return oc->block_size * CACHE_NR_BLOCKS;
+}
+
+static uint64_t calc_object_bmap(uint32_t bs, size_t len, off_t offset)
 {
 	int start, end, nr;
 	unsigned long bmap = 0;
 
-	start = offset / CACHE_BLOCK_SIZE;
-	end = DIV_ROUND_UP(len + offset, CACHE_BLOCK_SIZE);
+	/* The tail of a VDI object beyond 4 MB is covered by the last bit */
+	start = min((int)(offset / bs), CACHE_NR_BLOCKS - 1);
+	end = min((int)DIV_ROUND_UP(len + offset, bs), CACHE_NR_BLOCKS);
 	nr = end - start;
 
 	while (nr--)
@@ -134,6 +338,52 @@ static uint64_t calc_object_bmap(size_t len, off_t offset)
 	return (uint64_t)bmap;
 }
 
+/* Bytes of the cached object accounted in the capacity of the cache */
+static inline uint64_t cached_size(const struct object_cache *oc,
+				   uint32_t idx, uint64_t present)
+{
+	if (idx_has_vdi_bit(idx))
+		return SD_INODE_SIZE;
+
+	return __builtin_popcountll(present) * (uint64_t)oc->block_size;
+}
+
+static inline uint64_t dirty_size(const struct object_cache *oc,
+				  uint32_t idx, uint64_t bmap)
+{
+	return __builtin_popcountll(bmap) * (uint64_t)block_size_of(oc, idx);
+}
+
+static void save_cached_blocks(uint32_t vid, uint32_t idx, uint64_t present)
+{
+	char p[PATH_MAX];
+
+	get_cache_path(p, vid, idx, "");
+	if (present == CACHE_ALL_BLOCKS) {
+		if (removexattr(p, CACHE_PRESENT_NAME) < 0 && errno != ENODATA)
+			sd_eprintf("%s, %m", p);
+		return;
+	}
+	if (setxattr(p, CACHE_PRESENT_NAME, &present, sizeof(present), 0) < 0)
+		sd_eprintf("%s, %m", p);
+}
+
+/* A cache file without the xattr holds the whole object */
+static uint64_t load_cached_blocks(uint32_t vid, uint32_t idx)
+{
+	char p[PATH_MAX];
+	uint64_t present;
+
+	get_cache_path(p, vid, idx, "");
+	if (getxattr(p, CACHE_PRESENT_NAME, &present, sizeof(present)) < 0) {
+		if (errno != ENODATA)
+			sd_eprintf("%s, %m", p);
+		return CACHE_ALL_BLOCKS;
+	}
+
+	return present;
+}
+
 static inline void get_cache_entry(struct object_cache_entry *entry)
 {
 	uatomic_inc(&entry->refcnt);
@@ -149,31 +399,42 @@ static inline bool entry_in_use(struct object_cache_entry *entry)
 	return uatomic_read(&entry->refcnt) > 0;
 }
 
+static inline struct oc_shard *idx_to_shard(struct object_cache *oc,
+					    uint32_t idx)
+{
+	return oc->shards + ((idx & ~CACHE_INDEX_MASK) & (OC_NR_SHARDS - 1));
+}
+
+static inline struct oc_shard *entry_shard(struct object_cache_entry *entry)
+{
+	return idx_to_shard(entry->oc, entry_idx(entry));
+}
+
 /*
  * Mutual exclusive protection strategy:
  *
  * reader and writer:          no need to project since it is okay to read
  *                             unacked stale data.
- * reader, writer and pusher:    cache lock and entry lock and refcnt.
- * reader, writer and reclaimer: cache lock and entry refcnt.
- * pusher and reclaimer:       cache lock and entry refcnt.
+ * reader, writer and pusher:    shard lock and entry lock and refcnt.
+ * reader, writer and reclaimer: shard lock and entry refcnt.
+ * pusher and reclaimer:       shard lock and entry refcnt.
  *
- * entry->bmap is projected by mostly entry lock, sometimes cache lock.
- * dirty list is projected by cache lock.
+ * entry->bmap is projected by mostly entry lock, sometimes shard lock.
+ * dirty list is projected by shard lock.
  */
-static inline void read_lock_cache(struct object_cache *oc)
+static inline void read_lock_shard(struct oc_shard *shard)
 {
-	pthread_rwlock_rdlock(&oc->lock);
+	pthread_rwlock_rdlock(&shard->lock);
 }
 
-static inline void write_lock_cache(struct object_cache *oc)
+static inline void write_lock_shard(struct oc_shard *shard)
 {
-	pthread_rwlock_wrlock(&oc->lock);
+	pthread_rwlock_wrlock(&shard->lock);
 }
 
-static inline void unlock_cache(struct object_cache *oc)
+static inline void unlock_shard(struct oc_shard *shard)
 {
-	pthread_rwlock_unlock(&oc->lock);
+	pthread_rwlock_unlock(&shard->lock);
 }
 
 static inline void read_lock_entry(struct object_cache_entry *entry)
@@ -191,59 +452,95 @@ static inline void unlock_entry(struct object_cache_entry *entry)
 	pthread_rwlock_unlock(&entry->lock);
 }
 
+static inline struct hlist_head *shard_bucket(struct oc_shard *shard,
+					     uint32_t idx)
+{
+	/* The low bits were used to choose the shard */
+	return shard->index + hash_64(idx >> OC_SHARD_BITS, shard->index_bits);
+}
+
+static void init_shard(struct oc_shard *shard)
+{
+	shard->index_bits = OC_INDEX_MIN_BITS;
+	shard->index = xcalloc(1 << shard->index_bits, sizeof(*shard->index));
+	INIT_LIST_HEAD(&shard->lru_head);
+	INIT_LIST_HEAD(&shard->hot_head);
+	INIT_LIST_HEAD(&shard->dirty_head);
+	pthread_rwlock_init(&shard->lock, NULL);
+}
+
+static void destroy_shard(struct oc_shard *shard)
+{
+	pthread_rwlock_destroy(&shard->lock);
+	free(shard->index);
+}
+
+/* Double the hash index of the shard.  Called with the shard write locked */
+static void grow_shard_index(struct oc_shard *shard)
+{
+	struct hlist_head *old = shard->index;
+	int i, nr_old = 1 << shard->index_bits;
+	struct object_cache_entry *entry;
+	struct hlist_node *node, *t;
+
+	shard->index_bits++;
+	shard->index = xcalloc(1 << shard->index_bits, sizeof(*shard->index));
+	for (i = 0; i < nr_old; i++)
+		hlist_for_each_entry_safe(entry, node, t, old + i, hash) {
+			hlist_del(&entry->hash);
+			hlist_add_head(&entry->hash,
+				       shard_bucket(shard, entry_idx(entry)));
+		}
+	free(old);
+}
+
 static struct object_cache_entry *
-lru_tree_insert(struct rb_root *root, struct object_cache_entry *new)
+shard_index_insert(struct oc_shard *shard, struct object_cache_entry *new)
 {
-	struct rb_node **p = &root->rb_node;
-	struct rb_node *parent = NULL;
 	struct object_cache_entry *entry;
+	struct hlist_node *node;
+	struct hlist_head *head;
 	uint32_t idx = entry_idx(new);
 
-	while (*p) {
-		parent = *p;
-		entry = rb_entry(parent, struct object_cache_entry, node);
-
-		if (idx < entry_idx(entry))
-			p = &(*p)->rb_left;
-		else if (idx > entry_idx(entry))
-			p = &(*p)->rb_right;
-		else {
+	head = shard_bucket(shard, idx);
+	hlist_for_each_entry(entry, node, head, hash)
+		if (entry_idx(entry) == idx)
 			/* already has this entry */
 			return entry;
-		}
-	}
-	rb_link_node(&new->node, parent, p);
-	rb_insert_color(&new->node, root);
+
+	hlist_add_head(&new->hash, head);
+	if (++shard->nr_entries > (1U << shard->index_bits))
+		grow_shard_index(shard);
 
 	return NULL; /* insert successfully */
 }
 
-static struct object_cache_entry *lru_tree_search(struct rb_root *root,
-						  uint32_t idx)
+static struct object_cache_entry *shard_index_search(struct oc_shard *shard,
+						     uint32_t idx)
 {
-	struct rb_node *n = root->rb_node;
-	struct object_cache_entry *t;
-
-	while (n) {
-		t = rb_entry(n, struct object_cache_entry, node);
+	struct object_cache_entry *entry;
+	struct hlist_node *node;
 
-		if (idx < entry_idx(t))
-			n = n->rb_left;
-		else if (idx > entry_idx(t))
-			n = n->rb_right;
-		else
-			return t; /* found it */
-	}
+	hlist_for_each_entry(entry, node, shard_bucket(shard, idx), hash)
+		if (entry_idx(entry) == idx)
+			return entry; /* found it */
 
 	return NULL;
 }
 
+/* Called with the shard of the entry write locked */
 static inline void
 free_cache_entry(struct object_cache_entry *entry)
 {
-	struct object_cache *oc = entry->oc;
-
-	rb_erase(&entry->node, &oc->lru_tree);
+	struct oc_shard *shard = entry_shard(entry);
+
+	hlist_del(&entry->hash);
+	shard->nr_entries--;
+	if (entry->bmap)
+		uatomic_sub(&gcache.dirty, dirty_size(entry->oc, entry->idx,
+						      entry->bmap));
+	if (entry->hot)
+		shard->nr_hot--;
 	list_del_init(&entry->lru_list);
 	if (!list_empty(&entry->dirty_list))
 		list_del_init(&entry->dirty_list);
@@ -264,8 +561,7 @@ static int remove_cache_object(struct object_cache *oc, uint32_t idx)
 	int ret = SD_RES_SUCCESS;
 	char path[PATH_MAX];
 
-	snprintf(path, sizeof(path), "%s/%06"PRIx32"/%08"PRIx32,
-		 object_cache_dir, oc->vid, idx);
+	get_cache_path(path, oc->vid, idx, "");
 	sd_dprintf("%"PRIx64, idx_to_oid(oc->vid, idx));
 	if (unlink(path) < 0) {
 		sd_eprintf("failed to remove cached object %m");
@@ -285,8 +581,7 @@ static int read_cache_object_noupdate(uint32_t vid, uint32_t idx, void *buf,
 	int fd, flags = def_open_flags, ret = SD_RES_SUCCESS;
 	char p[PATH_MAX];
 
-	snprintf(p, sizeof(p), "%s/%06"PRIx32"/%08"PRIx32, object_cache_dir,
-		 vid, idx);
+	get_cache_path(p, vid, idx, "");
 
 	if (sys->object_cache_directio && !idx_has_vdi_bit(idx))
 		flags |= O_DIRECT;
@@ -320,8 +615,7 @@ static int write_cache_object_noupdate(uint32_t vid, uint32_t idx, void *buf,
 	int fd, flags = def_open_flags, ret = SD_RES_SUCCESS;
 	char p[PATH_MAX];
 
-	snprintf(p, sizeof(p), "%s/%06"PRIx32"/%08"PRIx32, object_cache_dir,
-		 vid, idx);
+	get_cache_path(p, vid, idx, "");
 	if (sys->object_cache_directio && !idx_has_vdi_bit(idx))
 		flags |= O_DIRECT;
 
@@ -347,60 +641,214 @@ out:
 	return ret;
 }
 
+static int discard_cache_object_noupdate(uint32_t vid, uint32_t idx,
+					 size_t count, off_t offset)
+{
+	int fd, ret = SD_RES_SUCCESS;
+	char p[PATH_MAX];
+
+	get_cache_path(p, vid, idx, "");
+	fd = open(p, def_open_flags, def_fmode);
+	if (fd < 0) {
+		sd_eprintf("%m");
+		return SD_RES_EIO;
+	}
+
+	if (punch_hole(fd, offset, count) < 0) {
+		sd_eprintf("count:%zu, offset %jd %m", count, (intmax_t)offset);
+		ret = SD_RES_EIO;
+	}
+
+	close(fd);
+	return ret;
+}
+
+/* Account a cache hit on the entry to the replacement policy */
+static void touch_cache_entry(struct object_cache_entry *entry)
+{
+	struct oc_shard *shard = entry_shard(entry);
+
+	if (sys->object_cache_policy == OC_POLICY_LRU) {
+		write_lock_shard(shard);
+		list_move_tail(&entry->lru_list, &shard->lru_head);
+		unlock_shard(shard);
+		return;
+	}
+
+	/* Don't dirty the cache line when the bit is already set */
+	if (!uatomic_is_true(&entry->referenced))
+		uatomic_set_true(&entry->referenced);
+}
+
+/*
+ * Pull the blocks in 'bmap' which are not cached yet from the backend.  Called
+ * with the entry write locked.
+ */
+static int pull_cache_blocks(struct object_cache_entry *entry, uint64_t bmap)
+{
+	uint32_t vid = entry->oc->vid, idx = entry_idx(entry);
+	uint32_t bs = block_size_of(entry->oc, idx);
+	uint64_t oid = idx_to_oid(vid, idx), missing, run;
+	int start, end, ret = SD_RES_SUCCESS;
+	size_t len;
+	off_t off;
+	void *buf;
+
+	missing = bmap & ~entry->present;
+	if (!missing)
+		return SD_RES_SUCCESS;
+
+	buf = xvalloc(bs * CACHE_NR_BLOCKS);
+	for (start = 0; start < CACHE_NR_BLOCKS; start = end) {
+		end = start + 1;
+		if (!(missing & (UINT64_C(1) << start)))
+			continue;
+		while (end < CACHE_NR_BLOCKS &&
+		       (missing & (UINT64_C(1) << end)))
+			end++;
+
+		off = start * bs;
+		len = (end - start) * bs;
+		ret = read_backend_object(oid, buf, len, off, 0);
+		if (ret != SD_RES_SUCCESS)
+			break;
+		ret = write_cache_object_noupdate(vid, idx, buf, len, off);
+		if (ret != SD_RES_SUCCESS)
+			break;
+
+		run = calc_object_bmap(bs, len, off);
+		uatomic_or(&entry->present, run);
+		uatomic_add(&gcache.capacity, cached_size(entry->oc, idx, run));
+	}
+	free(buf);
+	save_cached_blocks(vid, idx, entry->present);
+
+	sd_dprintf("%"PRIx64" pulled 0x%"PRIx64", present 0x%"PRIx64, oid,
+		   missing, entry->present);
+	return ret;
+}
+
+/* Make sure that the blocks which back [offset, offset + count) are cached */
+static int fill_cache_blocks(struct object_cache_entry *entry, size_t count,
+			     off_t offset)
+{
+	uint64_t bmap = calc_object_bmap(block_size_of(entry->oc, entry->idx),
+					 count, offset);
+	int ret;
+
+	if ((uatomic_read(&entry->accessed) & bmap) != bmap)
+		uatomic_or(&entry->accessed, bmap);
+	if ((uatomic_read(&entry->present) & bmap) == bmap)
+		return SD_RES_SUCCESS;
+
+	write_lock_entry(entry);
+	ret = pull_cache_blocks(entry, bmap);
+	unlock_entry(entry);
+
+	if (ret == SD_RES_SUCCESS)
+		object_cache_try_to_reclaim(1);
+	return ret;
+}
+
 static int read_cache_object(struct object_cache_entry *entry, void *buf,
-			     size_t count, off_t offset)
+			     size_t count, off_t offset, bool hit)
 {
 	uint32_t vid = entry->oc->vid, idx = entry_idx(entry);
-	struct object_cache *oc = entry->oc;
 	int ret;
 
+	ret = fill_cache_blocks(entry, count, offset);
+	if (ret != SD_RES_SUCCESS)
+		return ret;
+
 	ret = read_cache_object_noupdate(vid, idx, buf, count, offset);
 
-	if (ret == SD_RES_SUCCESS) {
-		write_lock_cache(oc);
-		list_move_tail(&entry->lru_list, &oc->lru_head);
-		unlock_cache(oc);
-	}
+	if (ret == SD_RES_SUCCESS && hit)
+		touch_cache_entry(entry);
 	return ret;
 }
 
+/* A NULL 'buf' discards the range, which then reads back as zeros */
 static int write_cache_object(struct object_cache_entry *entry, void *buf,
 			      size_t count, off_t offset, bool create,
-			      bool writeback)
+			      bool writeback, bool hit)
 {
 	uint32_t vid = entry->oc->vid, idx = entry_idx(entry);
 	uint64_t oid = idx_to_oid(vid, idx);
-	struct object_cache *oc = entry->oc;
+	struct oc_shard *shard = entry_shard(entry);
+	uint32_t bs = block_size_of(entry->oc, idx);
+	uint64_t bmap = calc_object_bmap(bs, count, offset), partial = 0;
+	uint64_t filled, dirtied;
 	struct sd_req hdr;
 	int ret;
 
 	write_lock_entry(entry);
 
-	ret = write_cache_object_noupdate(vid, idx, buf, count, offset);
+	/* The blocks which are written partially have to be pulled first */
+	if (offset % bs)
+		partial |= calc_object_bmap(bs, 1, offset);
+	if ((offset + count) % bs)
+		partial |= calc_object_bmap(bs, 1, offset + count - 1);
+	ret = pull_cache_blocks(entry, partial);
+	if (ret != SD_RES_SUCCESS) {
+		unlock_entry(entry);
+		return ret;
+	}
+
+	if (buf)
+		ret = write_cache_object_noupdate(vid, idx, buf, count, offset);
+	else
+		ret = discard_cache_object_noupdate(vid, idx, count, offset);
 	if (ret != SD_RES_SUCCESS) {
 		unlock_entry(entry);
 		return ret;
 	}
-	write_lock_cache(oc);
+	filled = bmap & ~entry->present;
+	if (filled) {
+		uatomic_or(&entry->present, filled);
+		uatomic_add(&gcache.capacity,
+			    cached_size(entry->oc, idx, filled));
+		save_cached_blocks(vid, idx, entry->present);
+	}
+	if ((uatomic_read(&entry->accessed) & bmap) != bmap)
+		uatomic_or(&entry->accessed, bmap);
 	if (writeback) {
-		entry->bmap |= calc_object_bmap(count, offset);
+		begin_cache_event();
+		write_lock_shard(shard);
+		dirtied = bmap & ~entry->bmap;
+		if (dirtied) {
+			uatomic_add(&gcache.dirty,
+				    dirty_size(entry->oc, idx, dirtied));
+			entry->bmap |= dirtied;
+		}
 		if (list_empty(&entry->dirty_list))
-			list_add_tail(&entry->dirty_list, &oc->dirty_head);
+			list_add_tail(&entry->dirty_list, &shard->dirty_head);
+		unlock_shard(shard);
+		/* synced before the write is answered, out of the shard lock */
+		if (dirtied)
+			log_cache_event(OC_REC_DIRTY, 0, vid, idx, dirtied, 0,
+					true);
+		end_cache_event();
 	}
-	list_move_tail(&entry->lru_list, &oc->lru_head);
-	unlock_cache(oc);
 
 	unlock_entry(entry);
 
+	if (hit)
+		touch_cache_entry(entry);
+
 	if (writeback)
 		goto out;
 
 	if (create)
 		sd_init_req(&hdr, SD_OP_CREATE_AND_WRITE_OBJ);
-	else
+	else if (buf)
 		sd_init_req(&hdr, SD_OP_WRITE_OBJ);
+	else
+		sd_init_req(&hdr, SD_OP_DISCARD_OBJ);
 	hdr.flags =  SD_FLAG_CMD_WRITE;
-	hdr.data_length = count;
+	if (buf)
+		hdr.data_length = count;
+	else
+		hdr.obj.length = count;
 
 	hdr.obj.oid = oid;
 	hdr.obj.offset = offset;
@@ -414,14 +862,15 @@ out:
 	return ret;
 }
 
-static int push_cache_object(uint32_t vid, uint32_t idx, uint64_t bmap,
-			     bool create)
+static int push_cache_object(struct object_cache *oc, uint32_t idx,
+			     uint64_t bmap, bool create)
 {
+	uint32_t vid = oc->vid, bs = block_size_of(oc, idx);
 	struct sd_req hdr;
 	void *buf;
 	off_t offset;
 	unsigned data_length;
-	int ret = SD_RES_NO_MEM;
+	int ret = SD_RES_SUCCESS;
 	uint64_t oid = idx_to_oid(vid, idx);
 	int first_bit, last_bit;
 
@@ -432,39 +881,55 @@ static int push_cache_object(uint32_t vid, uint32_t idx, uint64_t bmap,
 		return SD_RES_SUCCESS;
 	}
 
-	first_bit = ffsll(bmap) - 1;
-	last_bit = fls64(bmap) - 1;
-
-	sd_dprintf("bmap:0x%"PRIx64", first_bit:%d, last_bit:%d", bmap,
-		   first_bit, last_bit);
-	offset = first_bit * CACHE_BLOCK_SIZE;
-	data_length = (last_bit - first_bit + 1) * CACHE_BLOCK_SIZE;
-
 	/*
-	 * CACHE_BLOCK_SIZE may not be divisible by SD_INODE_SIZE,
-	 * so (offset + data_length) could larger than SD_INODE_SIZE
+	 * Push each run of dirty blocks separately because the clean blocks
+	 * between them might not be cached.  A created object is dirty as a
+	 * whole, so it is pushed by one request.
 	 */
-	if (is_vdi_obj(oid) && (offset + data_length) > SD_INODE_SIZE)
-		data_length = SD_INODE_SIZE - offset;
+	buf = xvalloc(is_vdi_obj(oid) ? SD_INODE_SIZE : bs * CACHE_NR_BLOCKS);
+	while (bmap) {
+		first_bit = ffsll(bmap) - 1;
+		last_bit = first_bit;
+		while (last_bit + 1 < CACHE_NR_BLOCKS &&
+		       (bmap & (UINT64_C(1) << (last_bit + 1))))
+			last_bit++;
+		if (last_bit == CACHE_NR_BLOCKS - 1)
+			bmap = 0;
+		else
+			bmap &= ~((UINT64_C(1) << (last_bit + 1)) - 1);
 
-	buf = xvalloc(data_length);
-	ret = read_cache_object_noupdate(vid, idx, buf, data_length, offset);
-	if (ret != SD_RES_SUCCESS)
-		goto out;
+		sd_dprintf("first_bit:%d, last_bit:%d", first_bit, last_bit);
+		offset = first_bit * bs;
+		data_length = (last_bit - first_bit + 1) * bs;
 
-	if (create)
-		sd_init_req(&hdr, SD_OP_CREATE_AND_WRITE_OBJ);
-	else
-		sd_init_req(&hdr, SD_OP_WRITE_OBJ);
-	hdr.flags = SD_FLAG_CMD_WRITE;
-	hdr.data_length = data_length;
-	hdr.obj.oid = oid;
-	hdr.obj.offset = offset;
+		/*
+		 * CACHE_BLOCK_SIZE may not be divisible by SD_INODE_SIZE, and
+		 * the last bit covers the tail of a VDI object beyond 4 MB
+		 */
+		if (is_vdi_obj(oid) && last_bit == CACHE_NR_BLOCKS - 1)
+			data_length = SD_INODE_SIZE - offset;
 
-	ret = exec_local_req(&hdr, buf);
-	if (ret != SD_RES_SUCCESS)
-		sd_eprintf("failed to push object %x", ret);
-out:
+		ret = read_cache_object_noupdate(vid, idx, buf, data_length,
+						 offset);
+		if (ret != SD_RES_SUCCESS)
+			break;
+
+		if (create)
+			sd_init_req(&hdr, SD_OP_CREATE_AND_WRITE_OBJ);
+		else
+			sd_init_req(&hdr, SD_OP_WRITE_OBJ);
+		hdr.flags = SD_FLAG_CMD_WRITE;
+		hdr.data_length = data_length;
+		hdr.obj.oid = oid;
+		hdr.obj.offset = offset;
+
+		ret = exec_local_req(&hdr, buf);
+		if (ret != SD_RES_SUCCESS) {
+			sd_eprintf("failed to push object %x", ret);
+			break;
+		}
+		create = false;
+	}
 	free(buf);
 	return ret;
 }
@@ -482,16 +947,99 @@ out:
  * 90% is targeted for a large cache quota such as 200G, then we have 20G
  * buffer which is large enough to prevent cache overrun.
  */
-#define HIGH_WATERMARK (sys->object_cache_size * 9 / 10)
-static void do_reclaim_object(struct object_cache *oc)
+#define HIGH_WATERMARK ((uint64_t)sys->object_cache_size * 1024 * 1024 * 9 / 10)
+
+/*
+ * Drop the clean blocks of a hot data object which weren't accessed since the
+ * last pass.  Called with the shard write locked, so nobody can start using
+ * the entry meanwhile.
+ */
+static void drop_cold_blocks(struct object_cache_entry *entry)
 {
-	struct object_cache_entry *entry, *t;
-	uint64_t oid;
-	uint32_t cap;
+	uint32_t vid = entry->oc->vid, idx = entry_idx(entry);
+	char p[PATH_MAX];
+	uint64_t cold;
+	int fd, i;
+
+	if (!block_cache || idx_has_vdi_bit(idx) || entry_in_use(entry))
+		return;
+
+	cold = entry->present & ~entry->bmap & ~entry->accessed;
+	uatomic_set(&entry->accessed, 0);
+	if (!cold)
+		return;
+
+	/* Forget the blocks before they are gone */
+	begin_cache_event();
+	uatomic_and(&entry->present, ~cold);
+	log_cache_event(OC_REC_DROP, 0, vid, idx, 0, cold, true);
+	end_cache_event();
+	save_cached_blocks(vid, idx, entry->present);
+	uatomic_sub(&gcache.capacity, cached_size(entry->oc, idx, cold));
+
+	get_cache_path(p, vid, idx, "");
+	fd = open(p, def_open_flags);
+	if (fd < 0)
+		return;
+	for (i = 0; i < CACHE_NR_BLOCKS; i++) {
+		if (!(cold & (UINT64_C(1) << i)))
+			continue;
+		if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+			      (off_t)i * entry->oc->block_size,
+			      entry->oc->block_size) < 0) {
+			sd_dprintf("failed to punch %s, %m", p);
+			break;
+		}
+	}
+	close(fd);
+	sd_dprintf("%"PRIx64" dropped 0x%"PRIx64, idx_to_oid(vid, idx), cold);
+}
 
-	write_lock_cache(oc);
-	list_for_each_entry_safe(entry, t, &oc->lru_head, lru_list) {
+/*
+ * Move the hot entries that weren't hit since the last pass to the cold list
+ * until the hot list is no larger than the cold one.  Called with the shard
+ * write locked.
+ */
+static void balance_hot_list(struct oc_shard *shard)
+{
+	struct object_cache_entry *entry;
+	uint32_t nr_scan = shard->nr_hot;
+
+	while (nr_scan-- && shard->nr_hot * 2 > shard->nr_entries) {
+		entry = list_first_entry(&shard->hot_head,
+					 struct object_cache_entry, lru_list);
+		if (uatomic_is_true(&entry->referenced)) {
+			uatomic_set_false(&entry->referenced);
+			drop_cold_blocks(entry);
+			list_move_tail(&entry->lru_list, &shard->hot_head);
+			continue;
+		}
+		entry->hot = false;
+		shard->nr_hot--;
+		list_move_tail(&entry->lru_list, &shard->lru_head);
+	}
+}
+
+static bool do_reclaim_shard(struct object_cache *oc, struct oc_shard *shard)
+{
+	struct object_cache_entry *entry, *t;
+	bool clock = sys->object_cache_policy == OC_POLICY_CLOCK;
+	bool done = false;
+	uint64_t oid, cap, size;
+
+	write_lock_shard(shard);
+	if (clock)
+		balance_hot_list(shard);
+	list_for_each_entry_safe(entry, t, &shard->lru_head, lru_list) {
 		oid = idx_to_oid(oc->vid, entry_idx(entry));
+		if (clock && uatomic_is_true(&entry->referenced)) {
+			/* Hit again since it was cached, promote it */
+			uatomic_set_false(&entry->referenced);
+			entry->hot = true;
+			shard->nr_hot++;
+			list_move_tail(&entry->lru_list, &shard->hot_head);
+			continue;
+		}
 		if (entry_in_use(entry)) {
 			sd_dprintf("%"PRIx64" is in use, skip...", oid);
 			continue;
@@ -500,15 +1048,40 @@ static void do_reclaim_object(struct object_cache *oc)
 			sd_dprintf("%"PRIx64" is dirty, skip...", oid);
 			continue;
 		}
-		if (remove_cache_object(oc, entry_idx(entry)) != SD_RES_SUCCESS)
+		begin_cache_event();
+		log_cache_event(OC_REC_DEL, 0, oc->vid, entry_idx(entry), 0, 0,
+				false);
+		if (remove_cache_object(oc, entry_idx(entry)) != SD_RES_SUCCESS) {
+			/* Still cached */
+			log_cache_event(OC_REC_ADD, entry->hot ? OC_REC_HOT : 0,
+					oc->vid, entry->idx, entry->bmap,
+					entry->present, false);
+			end_cache_event();
 			continue;
+		}
+		size = cached_size(oc, entry_idx(entry), entry->present);
 		free_cache_entry(entry);
-		cap = uatomic_sub_return(&gcache.capacity, CACHE_OBJECT_SIZE);
-		sd_dprintf("%"PRIx64" reclaimed. capacity:%"PRId32, oid, cap);
-		if (cap <= HIGH_WATERMARK)
+		end_cache_event();
+		cap = uatomic_sub_return(&gcache.capacity, size);
+		sd_dprintf("%"PRIx64" reclaimed. capacity:%"PRIu64, oid, cap);
+		if (cap <= HIGH_WATERMARK) {
+			done = true;
 			break;
+		}
 	}
-	unlock_cache(oc);
+	unlock_shard(shard);
+
+	return done;
+}
+
+static void do_reclaim_object(struct object_cache *oc)
+{
+	int i, j = random();
+
+	/* Start from a random shard for the same reason as do_reclaim() */
+	for (i = 0; i < OC_NR_SHARDS; i++)
+		if (do_reclaim_shard(oc, oc->shards + (i + j) % OC_NR_SHARDS))
+			break;
 }
 
 struct reclaim_work {
@@ -533,13 +1106,13 @@ static void do_reclaim(struct work *work)
 
 		pthread_rwlock_rdlock(&hashtable_lock[idx]);
 		hlist_for_each_entry(cache, node, head, hash) {
-			uint32_t cap;
+			uint64_t cap;
 
 			do_reclaim_object(cache);
 			cap = uatomic_read(&gcache.capacity);
 			if (cap <= HIGH_WATERMARK) {
 				pthread_rwlock_unlock(&hashtable_lock[idx]);
-				sd_dprintf("complete, capacity %"PRIu32, cap);
+				sd_dprintf("complete, capacity %"PRIu64, cap);
 				return;
 			}
 		}
@@ -560,7 +1133,7 @@ static int create_dir_for(uint32_t vid)
 	int ret = 0;
 	char p[PATH_MAX];
 
-	snprintf(p, sizeof(p), "%s/%06"PRIx32, object_cache_dir, vid);
+	get_cache_vdi_path(p, vid);
 	if (xmkdir(p, def_dmode) < 0) {
 		sd_eprintf("%s, %m", p);
 		ret = -1;
@@ -568,6 +1141,38 @@ static int create_dir_for(uint32_t vid)
 	return ret;
 }
 
+/*
+ * The data objects of the VDI are cached in CACHE_NR_BLOCKS blocks.  Their
+ * size is taken from the cached objects if there are any, since a gateway
+ * only learns the VDIs from its peers after the cache is loaded.
+ */
+static uint32_t data_block_size(uint32_t vid)
+{
+	uint32_t objsize = 0, idx;
+	char path[PATH_MAX];
+	struct dirent *d;
+	struct stat st;
+	DIR *dir;
+
+	get_cache_vdi_path(path, vid);
+	dir = opendir(path);
+	while (dir && !objsize && (d = readdir(dir))) {
+		if (strlen(d->d_name) != 8)
+			continue;
+		idx = strtoul(d->d_name, NULL, 16);
+		if (idx_has_vdi_bit(idx) ||
+		    fstatat(dirfd(dir), d->d_name, &st, 0) < 0)
+			continue;
+		objsize = st.st_size;
+	}
+	if (dir)
+		closedir(dir);
+
+	if (!objsize)
+		objsize = get_vdi_object_size(vid);
+	return objsize / CACHE_NR_BLOCKS;
+}
+
 static struct object_cache *find_object_cache(uint32_t vid, bool create)
 {
 	int h = hash(vid);
@@ -589,16 +1194,18 @@ static struct object_cache *find_object_cache(uint32_t vid, bool create)
 	}
 not_found:
 	if (create) {
+		int i;
+
 		cache = xzalloc(sizeof(*cache));
 		cache->vid = vid;
-		cache->lru_tree = RB_ROOT;
+		cache->refcnt = 1;
+		cache->block_size = data_block_size(vid);
 		create_dir_for(vid);
-		cache->push_efd = eventfd(0, 0);
-
-		INIT_LIST_HEAD(&cache->dirty_head);
-		INIT_LIST_HEAD(&cache->lru_head);
+		pthread_mutex_init(&cache->ra_lock, NULL);
+		pthread_mutex_init(&cache->wb_lock, NULL);
 
-		pthread_rwlock_init(&cache->lock, NULL);
+		for (i = 0; i < OC_NR_SHARDS; i++)
+			init_shard(cache->shards + i);
 		hlist_add_head(&cache->hash, head);
 	} else {
 		cache = NULL;
@@ -644,24 +1251,38 @@ alloc_cache_entry(struct object_cache *oc, uint32_t idx)
 	return entry;
 }
 
-static void add_to_lru_cache(struct object_cache *oc, uint32_t idx, bool create)
+/*
+ * Add the object whose cached blocks are 'present' to the cache.  If 'create'
+ * is true, the cached blocks are dirty and, when the whole object is cached,
+ * the object is created at the backend on push.  Called between
+ * begin_cache_event() and end_cache_event() unless the cache is being loaded.
+ */
+static void add_to_lru_cache(struct object_cache *oc, uint32_t idx, bool create,
+			     uint64_t present)
 {
 	struct object_cache_entry *entry = alloc_cache_entry(oc, idx);
+	struct oc_shard *shard = entry_shard(entry);
 
-	sd_dprintf("oid %"PRIx64" added", idx_to_oid(oc->vid, idx));
+	sd_dprintf("oid %"PRIx64" added, present 0x%"PRIx64,
+		   idx_to_oid(oc->vid, idx), present);
 
-	write_lock_cache(oc);
-	if (lru_tree_insert(&oc->lru_tree, entry))
+	entry->present = present;
+	write_lock_shard(shard);
+	if (shard_index_insert(shard, entry))
 		panic("the object already exist");
-	uatomic_add(&gcache.capacity, CACHE_OBJECT_SIZE);
-	list_add_tail(&entry->lru_list, &oc->lru_head);
+	uatomic_add(&gcache.capacity, cached_size(oc, idx, present));
+	list_add_tail(&entry->lru_list, &shard->lru_head);
 	if (create) {
-		/* Cache lock assure it is not raced with pusher */
-		entry->bmap = UINT64_MAX;
-		entry->idx |= CACHE_CREATE_BIT;
-		list_add_tail(&entry->dirty_list, &oc->dirty_head);
+		/* Shard lock assure it is not raced with pusher */
+		entry->bmap = present;
+		uatomic_add(&gcache.dirty, dirty_size(oc, idx, present));
+		if (present == CACHE_ALL_BLOCKS)
+			entry->idx |= CACHE_CREATE_BIT;
+		list_add_tail(&entry->dirty_list, &shard->dirty_head);
 	}
-	unlock_cache(oc);
+	log_cache_event(OC_REC_ADD, 0, oc->vid, entry->idx, entry->bmap,
+			present, false);
+	unlock_shard(shard);
 }
 
 static inline int lookup_path(char *path)
@@ -685,11 +1306,13 @@ static int object_cache_lookup(struct object_cache *oc, uint32_t idx,
 	int fd, ret, flags = def_open_flags;
 	char path[PATH_MAX];
 
-	snprintf(path, sizeof(path), "%s/%06"PRIx32"/%08"PRIx32,
-		 object_cache_dir, oc->vid, idx);
+	get_cache_path(path, oc->vid, idx, "");
 	if (!create)
 		return lookup_path(path);
 
+	begin_cache_event();
+	log_cache_event(OC_REC_INTENT, 0, oc->vid,
+			writeback ? idx | CACHE_CREATE_BIT : idx, 0, 0, false);
 	flags |= O_CREAT | O_TRUNC;
 	fd = open(path, flags, def_fmode);
 	if (fd < 0) {
@@ -697,29 +1320,34 @@ static int object_cache_lookup(struct object_cache *oc, uint32_t idx,
 		ret = SD_RES_EIO;
 		goto out;
 	}
-	ret = prealloc(fd, get_objsize(idx_to_oid(oc->vid, idx)));
+	ret = prealloc(fd, object_size_of(oc, idx));
 	if (ret < 0) {
 		ret = SD_RES_EIO;
 		goto out_close;
 	}
-	add_to_lru_cache(oc, idx, writeback);
-	object_cache_try_to_reclaim(0);
+	add_to_lru_cache(oc, idx, writeback, CACHE_ALL_BLOCKS);
 out_close:
 	close(fd);
 out:
+	end_cache_event();
+	if (ret == SD_RES_SUCCESS)
+		object_cache_try_to_reclaim(0);
 	return ret;
 }
 
+/*
+ * Called between begin_cache_event() and end_cache_event().  'create' tells
+ * that the object is going to be added dirty, to be created at the backend.
+ */
 static int create_cache_object(struct object_cache *oc, uint32_t idx,
 			       void *buffer, size_t buf_size, off_t offset,
-			       size_t obj_size)
+			       size_t obj_size, uint64_t present, bool create)
 {
 	int flags = def_open_flags | O_CREAT | O_EXCL, fd;
 	int ret = SD_RES_OID_EXIST;
 	char path[PATH_MAX], tmp_path[PATH_MAX];
 
-	snprintf(tmp_path, sizeof(tmp_path), "%s/%06"PRIx32"/%08"PRIx32".tmp",
-		object_cache_dir, oc->vid, idx);
+	get_cache_path(tmp_path, oc->vid, idx, ".tmp");
 	fd = open(tmp_path, flags, def_fmode);
 	if (fd < 0) {
 		if (errno == EEXIST) {
@@ -731,9 +1359,15 @@ static int create_cache_object(struct object_cache *oc, uint32_t idx,
 		goto out;
 	}
 
-	/* We need to extend it if the buffer is trimmed */
+	/*
+	 * We need to extend it if the buffer is trimmed.  The blocks which
+	 * are not cached are left as holes.
+	 */
 	if (offset != 0 || buf_size != obj_size) {
-		ret = prealloc(fd, obj_size);
+		if (present != CACHE_ALL_BLOCKS)
+			ret = ftruncate(fd, obj_size);
+		else
+			ret = prealloc(fd, obj_size);
 		if (ret < 0) {
 			ret = SD_RES_EIO;
 			sd_eprintf("%m");
@@ -747,9 +1381,16 @@ static int create_cache_object(struct object_cache *oc, uint32_t idx,
 		sd_eprintf("failed, vid %"PRIx32", idx %"PRIx32, oc->vid, idx);
 		goto out_close;
 	}
+	if (present != CACHE_ALL_BLOCKS &&
+	    fsetxattr(fd, CACHE_PRESENT_NAME, &present, sizeof(present), 0) < 0) {
+		ret = SD_RES_EIO;
+		sd_eprintf("%s, %m", tmp_path);
+		goto out_close;
+	}
 	/* This is intended to take care of partial write due to crash */
-	snprintf(path, sizeof(path), "%s/%06"PRIx32"/%08"PRIx32,
-		 object_cache_dir, oc->vid, idx);
+	get_cache_path(path, oc->vid, idx, "");
+	log_cache_event(OC_REC_INTENT, 0, oc->vid,
+			create ? idx | CACHE_CREATE_BIT : idx, 0, 0, false);
 	ret = link(tmp_path, path);
 	if (ret < 0) {
 		if (errno == EEXIST) {
@@ -770,16 +1411,62 @@ out:
 	return ret;
 }
 
+/*
+ * Fetch the blocks of a data object which back [offset, offset + count), cache
+ * them in the clean state
+ */
+static int object_cache_pull_blocks(struct object_cache *oc, uint32_t idx,
+				    size_t count, off_t offset)
+{
+	uint64_t oid = idx_to_oid(oc->vid, idx);
+	uint64_t bmap = calc_object_bmap(oc->block_size, count, offset);
+	int first_bit = ffsll(bmap) - 1, last_bit = fls64(bmap) - 1;
+	off_t off = first_bit * oc->block_size;
+	size_t len = (last_bit - first_bit + 1) * oc->block_size;
+	void *buf;
+	int ret;
+
+	buf = xvalloc(len);
+	ret = read_backend_object(oid, buf, len, off, 0);
+	if (ret != SD_RES_SUCCESS)
+		goto err;
+
+	sd_dprintf("oid %"PRIx64" pulled 0x%"PRIx64, oid, bmap);
+	begin_cache_event();
+	ret = create_cache_object(oc, idx, buf, len, off,
+				  object_size_of(oc, idx), bmap, false);
+	if (ret == SD_RES_SUCCESS)
+		add_to_lru_cache(oc, idx, false, bmap);
+	end_cache_event();
+	switch (ret) {
+	case SD_RES_SUCCESS:
+		object_cache_try_to_reclaim(1);
+		break;
+	case SD_RES_OID_EXIST:
+		ret = SD_RES_SUCCESS;
+		break;
+	default:
+		break;
+	}
+err:
+	free(buf);
+	return ret;
+}
+
 /* Fetch the object, cache it in the clean state */
-static int object_cache_pull(struct object_cache *oc, uint32_t idx)
+static int object_cache_pull(struct object_cache *oc, uint32_t idx,
+			     size_t count, off_t offset)
 {
 	struct sd_req hdr;
 	struct sd_rsp *rsp = (struct sd_rsp *)&hdr;
 	int ret = SD_RES_NO_MEM;
 	uint64_t oid = idx_to_oid(oc->vid, idx);
-	uint32_t data_length = get_objsize(oid);
+	uint32_t data_length = object_size_of(oc, idx);
 	void *buf;
 
+	if (block_cache && !idx_has_vdi_bit(idx))
+		return object_cache_pull_blocks(oc, idx, count, offset);
+
 	buf = xvalloc(data_length);
 	sd_init_req(&hdr, SD_OP_READ_OBJ);
 	hdr.data_length = data_length;
@@ -790,8 +1477,13 @@ static int object_cache_pull(struct object_cache *oc, uint32_t idx)
 		goto err;
 
 	sd_dprintf("oid %"PRIx64" pulled successfully", oid);
+	begin_cache_event();
 	ret = create_cache_object(oc, idx, buf, rsp->data_length,
-				  rsp->obj.offset, data_length);
+				  rsp->obj.offset, data_length, CACHE_ALL_BLOCKS,
+				  false);
+	if (ret == SD_RES_SUCCESS)
+		add_to_lru_cache(oc, idx, false, CACHE_ALL_BLOCKS);
+	end_cache_event();
 	/*
 	 * We try to delay reclaim objects to avoid object ping-pong
 	 * because the pulled object is clean and likely to be reclaimed
@@ -801,7 +1493,6 @@ static int object_cache_pull(struct object_cache *oc, uint32_t idx)
 	 */
 	switch (ret) {
 	case SD_RES_SUCCESS:
-		add_to_lru_cache(oc, idx, false);
 		object_cache_try_to_reclaim(1);
 		break;
 	case SD_RES_OID_EXIST:
@@ -815,29 +1506,73 @@ err:
 	return ret;
 }
 
+/* The completion of a flush, shared by the push works it queues */
+struct push_flush {
+	uint32_t count; /* How many push works are not done yet */
+	int ret; /* The first error of the pushes */
+	int efd; /* Signaled by the last push work done */
+};
+
 struct push_work {
 	struct work work;
 	struct object_cache_entry *entry;
+	struct push_flush *flush;
 };
 
+/*
+ * Push the dirty blocks of the entry back and return how many bytes were
+ * pushed.  Called with the entry write locked, so that a flush waits for the
+ * background writeback of the same entry.  The entry stays dirty if the push
+ * fails, e.g. while a node is leaving, to be pushed again later.
+ */
+static int writeback_entry(struct object_cache_entry *entry, uint64_t *len)
+{
+	struct object_cache *oc = entry->oc;
+	uint64_t bmap = entry->bmap, start = get_usec_time();
+	int ret;
+
+	*len = 0;
+	ret = push_cache_object(oc, entry_idx(entry), bmap,
+				!!(entry->idx & CACHE_CREATE_BIT));
+	if (ret != SD_RES_SUCCESS) {
+		sd_eprintf("failed to push %"PRIx64", %s",
+			   idx_to_oid(oc->vid, entry_idx(entry)),
+			   sd_strerror(ret));
+		return ret;
+	}
+	metric_observe(MH_OC_PUSH, get_usec_time() - start);
+	entry->idx &= ~CACHE_CREATE_BIT;
+	entry->bmap = 0;
+	*len = dirty_size(oc, entry->idx, bmap);
+	uatomic_sub(&gcache.dirty, *len);
+
+	return SD_RES_SUCCESS;
+}
+
 static void do_push_object(struct work *work)
 {
 	struct push_work *pw = container_of(work, struct push_work, work);
 	struct object_cache_entry *entry = pw->entry;
 	struct object_cache *oc = entry->oc;
-	uint64_t oid = idx_to_oid(oc->vid, entry_idx(entry));
+	struct push_flush *flush = pw->flush;
+	uint64_t oid = idx_to_oid(oc->vid, entry_idx(entry)), len;
+	struct oc_shard *shard = entry_shard(entry);
+	int ret;
 
 	sd_dprintf("%"PRIx64, oid);
 
-	read_lock_entry(entry);
-	if (push_cache_object(oc->vid, entry_idx(entry), entry->bmap,
-			      !!(entry->idx & CACHE_CREATE_BIT))
-	    != SD_RES_SUCCESS)
-		panic("push failed but should never fail");
-	if (uatomic_sub_return(&oc->push_count, 1) == 0)
-		eventfd_write(oc->push_efd, 1);
-	entry->idx &= ~CACHE_CREATE_BIT;
-	entry->bmap = 0;
+	write_lock_entry(entry);
+	ret = writeback_entry(entry, &len);
+	if (ret != SD_RES_SUCCESS) {
+		/* Fail the flush, the blocks are pushed by the next one */
+		uatomic_cmpxchg(&flush->ret, SD_RES_SUCCESS, ret);
+		write_lock_shard(shard);
+		if (list_empty(&entry->dirty_list))
+			list_add_tail(&entry->dirty_list, &shard->dirty_head);
+		unlock_shard(shard);
+	}
+	if (uatomic_sub_return(&flush->count, 1) == 0)
+		eventfd_write(flush->efd, 1);
 	unlock_entry(entry);
 
 	sd_dprintf("%"PRIx64" done", oid);
@@ -850,45 +1585,275 @@ static void push_object_done(struct work *work)
 	free(pw);
 }
 
+static bool has_dirty_entries(struct object_cache *oc)
+{
+	bool dirty = false;
+	int i;
+
+	for (i = 0; i < OC_NR_SHARDS && !dirty; i++) {
+		struct oc_shard *shard = oc->shards + i;
+
+		read_lock_shard(shard);
+		dirty = !list_empty(&shard->dirty_head);
+		unlock_shard(shard);
+	}
+
+	return dirty;
+}
+
 /*
  * Push back all the dirty objects before the FLUSH request to sheep replicated
  * storage synchronously.
  *
- * 1. Don't grab cache lock tight so we can serve RW requests while pushing.
+ * 1. Don't grab shard lock tight so we can serve RW requests while pushing.
  *    It is okay for allow subsequent RW after FLUSH because we only need to
  *    garantee the dirty objects before FLUSH to be pushed.
  * 2. Use threaded AIO to boost push performance, such as fsync(2) from VM.
+ * 3. Each flush waits for its own push works only, so the concurrent flushes of
+ *    the VDI don't take over the result of each other.
  */
 static int object_cache_push(struct object_cache *oc)
 {
 	struct object_cache_entry *entry, *t;
+	struct push_flush flush;
+	struct oc_shard *shard;
 	eventfd_t value;
+	int i;
 
-	write_lock_cache(oc);
-	if (list_empty(&oc->dirty_head)) {
-		unlock_cache(oc);
+	if (!has_dirty_entries(oc))
 		return SD_RES_SUCCESS;
-	}
-	list_for_each_entry_safe(entry, t, &oc->dirty_head, dirty_list) {
-		struct push_work *pw;
 
-		get_cache_entry(entry);
-		uatomic_inc(&oc->push_count);
-		pw = xzalloc(sizeof(struct push_work));
-		pw->work.fn = do_push_object;
-		pw->work.done = push_object_done;
-		pw->entry = entry;
-		queue_work(sys->oc_push_wqueue, &pw->work);
-		list_del_init(&entry->dirty_list);
+	flush.efd = eventfd(0, 0);
+	if (flush.efd < 0) {
+		sd_eprintf("failed to create eventfd, %m");
+		return SD_RES_EIO;
+	}
+	flush.ret = SD_RES_SUCCESS;
+	/*
+	 * Hold one count while queueing so that the push threads can't signal
+	 * completion before the dirty objects of all the shards are queued.
+	 */
+	flush.count = 1;
+	for (i = 0; i < OC_NR_SHARDS; i++) {
+		shard = oc->shards + i;
+		write_lock_shard(shard);
+		list_for_each_entry_safe(entry, t, &shard->dirty_head,
+					 dirty_list) {
+			struct push_work *pw;
+
+			get_cache_entry(entry);
+			uatomic_inc(&flush.count);
+			pw = xzalloc(sizeof(struct push_work));
+			pw->work.fn = do_push_object;
+			pw->work.done = push_object_done;
+			pw->entry = entry;
+			pw->flush = &flush;
+			queue_work(sys->oc_push_wqueue, &pw->work);
+			list_del_init(&entry->dirty_list);
+		}
+		unlock_shard(shard);
 	}
-	unlock_cache(oc);
+	if (uatomic_sub_return(&flush.count, 1) == 0)
+		/* Nothing queued or everything pushed already */
+		eventfd_write(flush.efd, 1);
 reread:
-	if (eventfd_read(oc->push_efd, &value) < 0) {
+	if (eventfd_read(flush.efd, &value) < 0) {
 		sd_eprintf("eventfd read failed, %m");
 		goto reread;
 	}
-	sd_dprintf("%"PRIx32" completed", oc->vid);
-	return SD_RES_SUCCESS;
+	close(flush.efd);
+	sd_dprintf("%"PRIx32" completed, %s", oc->vid, sd_strerror(flush.ret));
+	return flush.ret;
+}
+
+static void destroy_object_cache(struct object_cache *cache)
+{
+	struct object_cache_entry *entry, *t;
+	int i;
+
+	for (i = 0; i < OC_NR_SHARDS; i++) {
+		struct oc_shard *shard = cache->shards + i;
+
+		write_lock_shard(shard);
+		list_splice_init(&shard->hot_head, &shard->lru_head);
+		list_for_each_entry_safe(entry, t, &shard->lru_head, lru_list) {
+			uatomic_sub(&gcache.capacity,
+				    cached_size(cache, entry_idx(entry),
+						entry->present));
+			free_cache_entry(entry);
+		}
+		unlock_shard(shard);
+		destroy_shard(shard);
+	}
+	pthread_mutex_destroy(&cache->ra_lock);
+	pthread_mutex_destroy(&cache->wb_lock);
+	free(cache);
+}
+
+static inline void get_object_cache(struct object_cache *cache)
+{
+	uatomic_inc(&cache->refcnt);
+}
+
+static void put_object_cache(struct object_cache *cache)
+{
+	if (uatomic_sub_return(&cache->refcnt, 1) == 0)
+		destroy_object_cache(cache);
+}
+
+/* Find the cache of the VDI with a reference held, NULL if there is none */
+static struct object_cache *grab_object_cache(uint32_t vid)
+{
+	int h = hash(vid);
+	struct object_cache *cache;
+	struct hlist_node *node;
+
+	pthread_rwlock_rdlock(&hashtable_lock[h]);
+	hlist_for_each_entry(cache, node, cache_hashtable + h, hash) {
+		if (cache->vid == vid) {
+			get_object_cache(cache);
+			pthread_rwlock_unlock(&hashtable_lock[h]);
+			return cache;
+		}
+	}
+	pthread_rwlock_unlock(&hashtable_lock[h]);
+
+	return NULL;
+}
+
+/*
+ * Background writeback
+ *
+ * The dirty blocks are trickled back to the replicated storage when they take
+ * more than object_cache_dirty_ratio percent of the cache, oldest dirty
+ * objects first, until they are down to half of that.  The bandwidth can be
+ * capped by object_cache_writeback_rate in MB/s.  A guest flush then only
+ * needs to push what is still dirty.  The entries stay on the dirty list while
+ * they are written back, so a concurrent flush still finds them and waits on
+ * the entry lock.
+ */
+#define OC_WRITEBACK_INTERVAL	1 /* seconds */
+#define OC_WRITEBACK_BATCH	16 /* entries taken from a shard at a time */
+
+static inline uint64_t dirty_threshold(void)
+{
+	return (uint64_t)sys->object_cache_size * 1024 * 1024 *
+		sys->object_cache_dirty_ratio / 100;
+}
+
+/* Return true when the pass is over, done or to be retried by the next one */
+static bool writeback_shard(struct object_cache *oc, struct oc_shard *shard,
+			    uint64_t target)
+{
+	struct object_cache_entry *entry, *entries[OC_WRITEBACK_BATCH];
+	int i, nr = 0, ret;
+	uint64_t len;
+
+	read_lock_shard(shard);
+	list_for_each_entry(entry, &shard->dirty_head, dirty_list) {
+		get_cache_entry(entry);
+		entries[nr++] = entry;
+		if (nr == OC_WRITEBACK_BATCH)
+			break;
+	}
+	unlock_shard(shard);
+
+	for (i = 0; i < nr; i++) {
+		entry = entries[i];
+
+		pthread_mutex_lock(&oc->wb_lock);
+		if (oc->deleted) {
+			pthread_mutex_unlock(&oc->wb_lock);
+			for (; i < nr; i++)
+				put_cache_entry(entries[i]);
+			return false;
+		}
+		write_lock_entry(entry);
+		ret = writeback_entry(entry, &len);
+		unlock_entry(entry);
+
+		write_lock_shard(shard);
+		if (!entry->bmap)
+			list_del_init(&entry->dirty_list);
+		unlock_shard(shard);
+		pthread_mutex_unlock(&oc->wb_lock);
+		put_cache_entry(entry);
+
+		if (sys->object_cache_writeback_rate)
+			usleep(len * 1000000 /
+			       ((uint64_t)sys->object_cache_writeback_rate *
+				1024 * 1024));
+		if (ret != SD_RES_SUCCESS ||
+		    uatomic_read(&gcache.dirty) <= target) {
+			for (i++; i < nr; i++)
+				put_cache_entry(entries[i]);
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/*
+ * The caches of a hash bucket are referenced and the bucket unlocked before
+ * they are pushed, so that the pushes and the rate limiting don't hold off
+ * the deletion of the caches.
+ */
+static void object_cache_writeback(uint64_t target)
+{
+	struct object_cache *cache, **caches = NULL;
+	struct hlist_node *node;
+	int i, j, k, nr, alloc = 0;
+	bool done = false;
+
+	sd_dprintf("dirty %"PRIu64", target %"PRIu64,
+		   uatomic_read(&gcache.dirty), target);
+	for (i = 0; i < HASH_SIZE && !done; i++) {
+		nr = 0;
+		pthread_rwlock_rdlock(&hashtable_lock[i]);
+		hlist_for_each_entry(cache, node, cache_hashtable + i, hash) {
+			if (nr == alloc) {
+				alloc = alloc ? alloc * 2 : 16;
+				caches = xrealloc(caches,
+						  alloc * sizeof(*caches));
+			}
+			get_object_cache(cache);
+			caches[nr++] = cache;
+		}
+		pthread_rwlock_unlock(&hashtable_lock[i]);
+
+		for (j = 0; j < nr; j++) {
+			cache = caches[j];
+			for (k = 0; k < OC_NR_SHARDS && !done; k++)
+				done = writeback_shard(cache, cache->shards + k,
+						       target);
+			put_object_cache(cache);
+		}
+	}
+	free(caches);
+}
+
+static int save_cache_index(void);
+
+static void *oc_writeback_thread(void *ignored)
+{
+	int elapsed = 0;
+
+	for (;;) {
+		sleep(OC_WRITEBACK_INTERVAL);
+		elapsed += OC_WRITEBACK_INTERVAL;
+		if (elapsed >= OC_INDEX_INTERVAL) {
+			save_cache_index();
+			elapsed = 0;
+		}
+		/* Pushes can't succeed until the cluster is working */
+		if (uatomic_read(&sys->status) != SD_STATUS_OK)
+			continue;
+		if (uatomic_read(&gcache.dirty) > dirty_threshold())
+			object_cache_writeback(dirty_threshold() / 2);
+	}
+
+	return NULL;
 }
 
 bool object_is_cached(uint64_t oid)
@@ -904,11 +1869,29 @@ bool object_is_cached(uint64_t oid)
 	return (object_cache_lookup(cache, idx, 0, false) == SD_RES_SUCCESS);
 }
 
+/*
+ * Free the memory of the cache, the cache files are left alone.  The memory
+ * goes when the background writeback doesn't use the cache any more, but the
+ * entry it is pushing is waited for on wb_lock, so that nothing is written
+ * back once this returns.
+ */
+static void free_object_cache(struct object_cache *cache)
+{
+	int h = hash(cache->vid);
+
+	pthread_rwlock_wrlock(&hashtable_lock[h]);
+	hlist_del(&cache->hash);
+	cache->deleted = true;
+	pthread_rwlock_unlock(&hashtable_lock[h]);
+
+	pthread_mutex_lock(&cache->wb_lock);
+	pthread_mutex_unlock(&cache->wb_lock);
+	put_object_cache(cache);
+}
+
 void object_cache_delete(uint32_t vid)
 {
 	struct object_cache *cache;
-	int h = hash(vid);
-	struct object_cache_entry *entry, *t;
 	char path[PATH_MAX];
 
 	cache = find_object_cache(vid, false);
@@ -916,39 +1899,31 @@ void object_cache_delete(uint32_t vid)
 		return;
 
 	/* Firstly we free memeory */
-	pthread_rwlock_wrlock(&hashtable_lock[h]);
-	hlist_del(&cache->hash);
-	pthread_rwlock_unlock(&hashtable_lock[h]);
-
-	write_lock_cache(cache);
-	list_for_each_entry_safe(entry, t, &cache->lru_head, lru_list) {
-		free_cache_entry(entry);
-		uatomic_sub(&gcache.capacity, CACHE_OBJECT_SIZE);
-	}
-	unlock_cache(cache);
-	pthread_rwlock_destroy(&cache->lock);
-	close(cache->push_efd);
-	free(cache);
+	begin_cache_event();
+	log_cache_event(OC_REC_DEL_VDI, 0, vid, 0, 0, 0, false);
+	free_object_cache(cache);
+	end_cache_event();
 
 	/* Then we free disk */
-	snprintf(path, sizeof(path), "%s/%06"PRIx32, object_cache_dir, vid);
+	get_cache_vdi_path(path, vid);
 	rmdir_r(path);
 }
 
 static struct object_cache_entry *
 get_cache_entry_from(struct object_cache *cache, uint32_t idx)
 {
+	struct oc_shard *shard = idx_to_shard(cache, idx);
 	struct object_cache_entry *entry;
 
-	read_lock_cache(cache);
-	entry = lru_tree_search(&cache->lru_tree, idx);
+	read_lock_shard(shard);
+	entry = shard_index_search(shard, idx);
 	if (!entry) {
 		/* The cache entry may be reclaimed, so try again. */
-		unlock_cache(cache);
+		unlock_shard(shard);
 		return NULL;
 	}
 	get_cache_entry(entry);
-	unlock_cache(cache);
+	unlock_shard(shard);
 	return entry;
 }
 
@@ -956,14 +1931,15 @@ static int object_cache_flush_and_delete(struct object_cache *oc)
 {
 	DIR *dir;
 	struct dirent *d;
+	struct object_cache_entry *entry;
 	uint32_t vid = oc->vid;
 	uint32_t idx;
-	uint64_t all = UINT64_MAX;
+	uint64_t present;
 	int ret = 0;
 	char p[PATH_MAX];
 
 	sd_dprintf("%"PRIx32, vid);
-	snprintf(p, sizeof(p), "%s/%06"PRIx32, object_cache_dir, vid);
+	get_cache_vdi_path(p, vid);
 	dir = opendir(p);
 	if (!dir) {
 		sd_dprintf("%m");
@@ -984,7 +1960,15 @@ static int object_cache_flush_and_delete(struct object_cache *oc)
 		idx = strtoul(d->d_name, NULL, 16);
 		if (idx == ULLONG_MAX)
 			continue;
-		if (push_cache_object(vid, idx, all, true) !=
+		/* Only the cached blocks of a partial object can be pushed */
+		present = CACHE_ALL_BLOCKS;
+		entry = get_cache_entry_from(oc, idx);
+		if (entry) {
+			present = uatomic_read(&entry->present);
+			put_cache_entry(entry);
+		}
+		if (push_cache_object(oc, idx, present,
+				      present == CACHE_ALL_BLOCKS) !=
 		    SD_RES_SUCCESS) {
 			sd_dprintf("failed to push %"PRIx64,
 				   idx_to_oid(vid, idx));
@@ -1029,12 +2013,195 @@ bool bypass_object_cache(const struct request *req)
 	}
 
 	/* For vmstate && vdi_attr object, we don't do caching */
-	if (is_vmstate_obj(oid) || is_vdi_attr_obj(oid) ||
-	    req->rq.flags & SD_FLAG_CMD_COW)
+	if (is_vmstate_obj(oid) || is_vdi_attr_obj(oid))
+		return true;
+	/*
+	 * A COW in write-through mode has to reach the backend as a whole
+	 * object, so it is left to the replicas
+	 */
+	if ((req->rq.flags & SD_FLAG_CMD_COW) &&
+	    !(req->rq.flags & SD_FLAG_CMD_CACHE))
 		return true;
 	return false;
 }
 
+/*
+ * Read-ahead
+ *
+ * A VDI read in the order of its data objects, such as by a booting guest or
+ * an image scan, gets the next objects pulled in the background before they
+ * are asked for.  The window starts at OC_RA_MIN_WINDOW objects and doubles
+ * with each sequential object read, up to object_cache_readahead.  A read out
+ * of order closes the window and cancels the prefetches not started yet.
+ */
+#define OC_RA_MIN_WINDOW	2
+
+struct prefetch_work {
+	struct work work;
+	uint32_t vid;
+	uint32_t idx;
+	uint32_t gen;
+};
+
+static void do_prefetch(struct work *work)
+{
+	struct prefetch_work *pw = container_of(work, struct prefetch_work,
+						work);
+	struct object_cache *cache;
+	int ret;
+
+	/* the VDI may be deleted while the prefetches are queued */
+	cache = grab_object_cache(pw->vid);
+	if (!cache)
+		return;
+	if (uatomic_read(&cache->ra_gen) != pw->gen ||
+	    object_cache_lookup(cache, pw->idx, false, false) !=
+	    SD_RES_NO_CACHE)
+		goto out;
+
+	ret = object_cache_pull(cache, pw->idx,
+				object_size_of(cache, pw->idx), 0);
+	if (ret != SD_RES_SUCCESS)
+		/* Beyond the end of the VDI or not allocated yet */
+		sd_dprintf("failed to prefetch %"PRIx64", %x",
+			   idx_to_oid(pw->vid, pw->idx), ret);
+out:
+	put_object_cache(cache);
+}
+
+static void prefetch_done(struct work *work)
+{
+	struct prefetch_work *pw = container_of(work, struct prefetch_work,
+						work);
+	free(pw);
+}
+
+static void object_cache_readahead(struct object_cache *oc, uint32_t idx)
+{
+	uint32_t start, end, gen, i;
+
+	pthread_mutex_lock(&oc->ra_lock);
+	if (idx == oc->ra_last) {
+		pthread_mutex_unlock(&oc->ra_lock);
+		return;
+	}
+	if (idx != oc->ra_last + 1) {
+		if (oc->ra_window) {
+			sd_dprintf("%"PRIx32" random read, cancel read-ahead",
+				   oc->vid);
+			oc->ra_window = 0;
+			uatomic_inc(&oc->ra_gen);
+		}
+		oc->ra_last = idx;
+		pthread_mutex_unlock(&oc->ra_lock);
+		return;
+	}
+
+	oc->ra_last = idx;
+	if (!oc->ra_window) {
+		oc->ra_window = OC_RA_MIN_WINDOW;
+		oc->ra_next = idx + 1;
+	} else {
+		oc->ra_window *= 2;
+	}
+	oc->ra_window = min(oc->ra_window, sys->object_cache_readahead);
+	start = max(oc->ra_next, idx + 1);
+	end = min(idx + 1 + oc->ra_window, (uint32_t)MAX_DATA_OBJS);
+	oc->ra_next = max(start, end);
+	gen = uatomic_read(&oc->ra_gen);
+	pthread_mutex_unlock(&oc->ra_lock);
+
+	for (i = start; i < end; i++) {
+		struct prefetch_work *pw = xzalloc(sizeof(*pw));
+
+		pw->work.fn = do_prefetch;
+		pw->work.done = prefetch_done;
+		pw->vid = oc->vid;
+		pw->idx = i;
+		pw->gen = gen;
+		queue_work(sys->oc_prefetch_wqueue, &pw->work);
+	}
+}
+
+/* Read the object through the cache, pulling it in if it isn't cached */
+static int read_through_cache(struct object_cache *oc, uint32_t idx,
+			      void *buf, size_t count, off_t offset)
+{
+	struct object_cache_entry *entry;
+	bool hit;
+	int ret;
+
+retry:
+	ret = object_cache_lookup(oc, idx, false, false);
+	hit = ret == SD_RES_SUCCESS;
+	metric_add(hit ? MC_OC_HITS : MC_OC_MISSES, 1);
+	if (ret == SD_RES_NO_CACHE)
+		ret = object_cache_pull(oc, idx, count, offset);
+	if (ret != SD_RES_SUCCESS)
+		return ret;
+
+	entry = get_cache_entry_from(oc, idx);
+	if (!entry) {
+		sched_yield();
+		goto retry;
+	}
+	ret = read_cache_object(entry, buf, count, offset, hit);
+	put_cache_entry(entry);
+	return ret;
+}
+
+/*
+ * Copy-on-write of a clone's object in the cache.
+ *
+ * The clones read the objects they share with their base VDI by the oid of
+ * the base, so the cache of the base VDI already serves all the clones on the
+ * node.  The private copy of a clone is made from that cache too, instead of
+ * sending a COW request to the replicas of the base object: the base object is
+ * read through the cache of the base VDI, the copy is cached dirty as a whole
+ * in the cache of the clone, and pushed as a new object later.
+ */
+static int object_cache_cow(struct object_cache *oc, uint32_t idx,
+			    uint64_t cow_oid)
+{
+	struct object_cache *base;
+	uint32_t objsize = object_size_of(oc, idx);
+	void *buf;
+	int ret;
+
+	sd_dprintf("%"PRIx64" from %"PRIx64, idx_to_oid(oc->vid, idx), cow_oid);
+
+	base = find_object_cache(oid_to_vid(cow_oid), true);
+	buf = xvalloc(objsize);
+	ret = read_through_cache(base, object_cache_oid_to_idx(cow_oid), buf,
+				 objsize, 0);
+	if (ret != SD_RES_SUCCESS) {
+		sd_eprintf("failed to read cow object %"PRIx64", %x", cow_oid,
+			   ret);
+		goto out;
+	}
+
+	begin_cache_event();
+	ret = create_cache_object(oc, idx, buf, objsize, 0, objsize,
+				  CACHE_ALL_BLOCKS, true);
+	if (ret == SD_RES_SUCCESS)
+		add_to_lru_cache(oc, idx, true, CACHE_ALL_BLOCKS);
+	end_cache_event();
+	switch (ret) {
+	case SD_RES_SUCCESS:
+		object_cache_try_to_reclaim(0);
+		break;
+	case SD_RES_OID_EXIST:
+		/* Copied by a concurrent request */
+		ret = SD_RES_SUCCESS;
+		break;
+	default:
+		break;
+	}
+out:
+	free(buf);
+	return ret;
+}
+
 int object_cache_handle_request(struct request *req)
 {
 	struct sd_req *hdr = &req->rq;
@@ -1044,7 +2211,7 @@ int object_cache_handle_request(struct request *req)
 	struct object_cache *cache;
 	struct object_cache_entry *entry;
 	int ret;
-	bool create = false;
+	bool create = false, hit;
 
 	sd_dprintf("%08"PRIx32", len %"PRIu32", off %"PRIu64, idx,
 		   hdr->data_length, hdr->obj.offset);
@@ -1053,12 +2220,29 @@ int object_cache_handle_request(struct request *req)
 
 	if (req->rq.opcode == SD_OP_CREATE_AND_WRITE_OBJ)
 		create = true;
+	if (!(hdr->flags & SD_FLAG_CMD_WRITE) && !idx_has_vdi_bit(idx) &&
+	    sys->object_cache_readahead)
+		object_cache_readahead(cache, idx);
+	if (create && (hdr->flags & SD_FLAG_CMD_COW)) {
+		ret = object_cache_cow(cache, idx, hdr->obj.cow_oid);
+		if (ret != SD_RES_SUCCESS)
+			return ret;
+		/* Now a write to the private copy */
+		create = false;
+	}
 retry:
 	ret = object_cache_lookup(cache, idx, create,
 				  hdr->flags & SD_FLAG_CMD_CACHE);
+	/* The access that brings an object in doesn't count as a hit */
+	hit = !create && ret == SD_RES_SUCCESS;
+	if (hit)
+		metric_add(MC_OC_HITS, 1);
+	else if (ret == SD_RES_NO_CACHE)
+		metric_add(MC_OC_MISSES, 1);
 	switch (ret) {
 	case SD_RES_NO_CACHE:
-		ret = object_cache_pull(cache, idx);
+		ret = object_cache_pull(cache, idx, hdr->data_length,
+					hdr->obj.offset);
 		if (ret != SD_RES_SUCCESS)
 			return ret;
 		break;
@@ -1071,22 +2255,22 @@ retry:
 		sd_dprintf("retry oid %"PRIx64, oid);
 		/*
 		 * For the case that object exists but isn't added to object
-		 * list yet, we call pthread_yield() to expect other thread can
+		 * list yet, we call sched_yield() to expect other thread can
 		 * add object to list ASAP.
 		 */
-		pthread_yield();
+		sched_yield();
 		goto retry;
 	}
 
 	if (hdr->flags & SD_FLAG_CMD_WRITE) {
 		ret = write_cache_object(entry, req->data, hdr->data_length,
 					 hdr->obj.offset, create,
-					 hdr->flags & SD_FLAG_CMD_CACHE);
+					 hdr->flags & SD_FLAG_CMD_CACHE, hit);
 		if (ret != SD_RES_SUCCESS)
 			goto err;
 	} else {
 		ret = read_cache_object(entry, req->data, hdr->data_length,
-					hdr->obj.offset);
+					hdr->obj.offset, hit);
 		if (ret != SD_RES_SUCCESS)
 			goto err;
 		req->rp.data_length = hdr->data_length;
@@ -1113,7 +2297,33 @@ int object_cache_write(uint64_t oid, char *data, unsigned int datalen,
 		return SD_RES_NO_CACHE;
 	}
 
-	ret = write_cache_object(entry, data, datalen, offset, create, false);
+	ret = write_cache_object(entry, data, datalen, offset, create, false,
+				 true);
+	put_cache_entry(entry);
+	return ret;
+}
+
+int object_cache_discard(struct request *req)
+{
+	struct sd_req *hdr = &req->rq;
+	uint64_t oid = hdr->obj.oid;
+	struct object_cache *cache;
+	struct object_cache_entry *entry;
+	int ret;
+
+	if (hdr->obj.offset + hdr->obj.length > get_vdi_objsize(oid))
+		return SD_RES_INVALID_PARMS;
+
+	cache = find_object_cache(oid_to_vid(oid), false);
+	if (!cache)
+		return SD_RES_NO_CACHE;
+	entry = get_cache_entry_from(cache, object_cache_oid_to_idx(oid));
+	if (!entry)
+		return SD_RES_NO_CACHE;
+
+	ret = write_cache_object(entry, NULL, hdr->obj.length,
+				 hdr->obj.offset, false,
+				 hdr->flags & SD_FLAG_CMD_CACHE, true);
 	put_cache_entry(entry);
 	return ret;
 }
@@ -1135,7 +2345,7 @@ int object_cache_read(uint64_t oid, char *data, unsigned int datalen,
 		return SD_RES_NO_CACHE;
 	}
 
-	ret = read_cache_object(entry, data, datalen, offset);
+	ret = read_cache_object(entry, data, datalen, offset, true);
 	put_cache_entry(entry);
 	return ret;
 }
@@ -1166,16 +2376,442 @@ int object_cache_flush_and_del(const struct request *req)
 	return SD_RES_SUCCESS;
 }
 
+/* Called with the shard of the entry write locked while the cache is loaded */
+static void set_entry_state(struct object_cache_entry *entry, uint64_t bmap,
+			    uint64_t present)
+{
+	uint32_t idx = entry_idx(entry);
+
+	gcache.capacity += cached_size(entry->oc, idx, present) -
+		cached_size(entry->oc, idx, entry->present);
+	gcache.dirty += dirty_size(entry->oc, idx, bmap) -
+		dirty_size(entry->oc, idx, entry->bmap);
+	entry->bmap = bmap;
+	entry->present = present;
+	if (bmap && list_empty(&entry->dirty_list))
+		list_add_tail(&entry->dirty_list,
+			      &entry_shard(entry)->dirty_head);
+}
+
+/* Add the entry of an OC_REC_ADD record to the tail of its list */
+static void load_cache_entry(struct object_cache *oc, const struct oc_rec *rec)
+{
+	struct object_cache_entry *entry = alloc_cache_entry(oc, rec->idx);
+	struct oc_shard *shard = entry_shard(entry);
+
+	write_lock_shard(shard);
+	if (shard_index_insert(shard, entry)) {
+		/* Also in the index, which is as new */
+		unlock_shard(shard);
+		pthread_rwlock_destroy(&entry->lock);
+		free(entry);
+		return;
+	}
+	gcache.capacity += cached_size(oc, entry_idx(entry), 0);
+	set_entry_state(entry, rec->bmap, rec->present | rec->bmap);
+	if (rec->flags & OC_REC_HOT) {
+		entry->hot = true;
+		shard->nr_hot++;
+		list_add_tail(&entry->lru_list, &shard->hot_head);
+	} else {
+		list_add_tail(&entry->lru_list, &shard->lru_head);
+	}
+	unlock_shard(shard);
+}
+
+static bool cache_entry_exists(struct object_cache *oc, uint32_t idx)
+{
+	struct oc_shard *shard = idx_to_shard(oc, idx);
+	bool ret;
+
+	read_lock_shard(shard);
+	ret = !!shard_index_search(shard, idx);
+	unlock_shard(shard);
+
+	return ret;
+}
+
+/* The records whose cache files have to be checked after the replay */
+struct cache_replay {
+	struct oc_rec *recs;
+	size_t nr, alloc;
+};
+
+static void replay_cache_event(struct cache_replay *replay,
+			       const struct oc_rec *rec)
+{
+	uint32_t idx = rec->idx & ~CACHE_INDEX_MASK;
+	struct object_cache_entry *entry;
+	struct object_cache *cache;
+	struct oc_shard *shard;
+
+	if (rec->type == OC_REC_ADD) {
+		load_cache_entry(find_object_cache(rec->vid, true), rec);
+		return;
+	}
+
+	if (rec->type == OC_REC_INTENT || rec->type == OC_REC_DEL ||
+	    rec->type == OC_REC_DEL_VDI) {
+		if (replay->nr == replay->alloc) {
+			replay->alloc = replay->alloc ? replay->alloc * 2 : 64;
+			replay->recs = xrealloc(replay->recs, replay->alloc *
+						sizeof(*replay->recs));
+		}
+		replay->recs[replay->nr++] = *rec;
+		if (rec->type == OC_REC_INTENT)
+			return;
+	}
+
+	cache = find_object_cache(rec->vid, false);
+	if (!cache)
+		return;
+	if (rec->type == OC_REC_DEL_VDI) {
+		free_object_cache(cache);
+		return;
+	}
+
+	shard = idx_to_shard(cache, idx);
+	write_lock_shard(shard);
+	entry = shard_index_search(shard, idx);
+	if (!entry)
+		goto out;
+	switch (rec->type) {
+	case OC_REC_DEL:
+		gcache.capacity -= cached_size(cache, idx, entry->present);
+		free_cache_entry(entry);
+		break;
+	case OC_REC_DIRTY:
+		set_entry_state(entry, entry->bmap | rec->bmap,
+				entry->present | rec->bmap);
+		break;
+	case OC_REC_DROP:
+		set_entry_state(entry, entry->bmap,
+				(entry->present & ~rec->present) | entry->bmap);
+		break;
+	}
+out:
+	unlock_shard(shard);
+}
+
+/*
+ * Clean up after the operations interrupted by a crash: remove the cache files
+ * of the deleted entries and pick up the ones created before their entries
+ * were added.
+ */
+static void finish_cache_replay(struct cache_replay *replay)
+{
+	struct object_cache *cache;
+	const struct oc_rec *rec;
+	char p[PATH_MAX];
+	uint32_t idx;
+	size_t i;
+
+	for (i = 0; i < replay->nr; i++) {
+		rec = replay->recs + i;
+		idx = rec->idx & ~CACHE_INDEX_MASK;
+		cache = find_object_cache(rec->vid, false);
+		switch (rec->type) {
+		case OC_REC_DEL_VDI:
+			if (cache)
+				break;
+			get_cache_vdi_path(p, rec->vid);
+			rmdir_r(p);
+			break;
+		case OC_REC_DEL:
+			if (cache && cache_entry_exists(cache, idx))
+				break;
+			get_cache_path(p, rec->vid, idx, "");
+			if (unlink(p) == 0)
+				sd_dprintf("removed %s", p);
+			break;
+		case OC_REC_INTENT:
+			get_cache_path(p, rec->vid, idx, ".tmp");
+			unlink(p);
+			if (cache && cache_entry_exists(cache, idx))
+				break;
+			get_cache_path(p, rec->vid, idx, "");
+			if (access(p, R_OK | W_OK) < 0)
+				break;
+			sd_dprintf("found %s", p);
+			add_to_lru_cache(find_object_cache(rec->vid, true), idx,
+					 !!(rec->idx & CACHE_CREATE_BIT),
+					 load_cached_blocks(rec->vid, idx));
+			break;
+		}
+	}
+	free(replay->recs);
+}
+
+static void replay_cache_journal(struct cache_replay *replay, const char *name)
+{
+	const struct oc_index_header *hdr;
+	const struct oc_rec *rec;
+	char p[PATH_MAX];
+	struct stat st;
+	size_t i, nr;
+	void *map;
+	int fd;
+
+	get_index_path(p, name);
+	fd = open(p, O_RDONLY);
+	if (fd < 0)
+		return;
+	if (fstat(fd, &st) < 0 || st.st_size < sizeof(*hdr))
+		goto out;
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED) {
+		sd_eprintf("%s, %m", p);
+		goto out;
+	}
+
+	hdr = map;
+	if (hdr->magic != OC_INDEX_MAGIC || before(hdr->gen, index_gen))
+		goto out_unmap;
+	rec = (const struct oc_rec *)(hdr + 1);
+	nr = (st.st_size - sizeof(*hdr)) / sizeof(*rec);
+	for (i = 0; i < nr; i++, rec++) {
+		/* The records torn by a crash end the journal */
+		if (rec->magic != OC_INDEX_MAGIC || !rec->type ||
+		    rec->type >= OC_REC_MAX)
+			break;
+		replay_cache_event(replay, rec);
+	}
+	sd_dprintf("%s, gen %"PRIu32", %zu records", name, hdr->gen, i);
+out_unmap:
+	munmap(map, st.st_size);
+out:
+	close(fd);
+}
+
+/* Load the cache from the index and the journals, -1 if we can't */
+static int load_cache_index(void)
+{
+	struct cache_replay replay = {};
+	const struct oc_index_header *hdr;
+	const struct oc_rec *rec;
+	struct object_cache *cache = NULL;
+	char p[PATH_MAX];
+	struct stat st;
+	int fd, ret = -1;
+	uint64_t i;
+	void *map;
+
+	get_index_path(p, OC_INDEX_NAME);
+	fd = open(p, O_RDONLY);
+	if (fd < 0) {
+		if (errno != ENOENT)
+			sd_eprintf("%s, %m", p);
+		return -1;
+	}
+	if (fstat(fd, &st) < 0 || st.st_size < sizeof(*hdr))
+		goto out;
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED) {
+		sd_eprintf("%s, %m", p);
+		goto out;
+	}
+
+	hdr = map;
+	rec = (const struct oc_rec *)(hdr + 1);
+	if (hdr->magic != OC_INDEX_MAGIC ||
+	    st.st_size != sizeof(*hdr) + hdr->nr_entries * sizeof(*rec))
+		goto out_unmap;
+	for (i = 0; i < hdr->nr_entries; i++)
+		if (rec[i].magic != OC_INDEX_MAGIC || rec[i].type != OC_REC_ADD)
+			goto out_unmap;
+
+	index_gen = hdr->gen;
+	for (i = 0; i < hdr->nr_entries; i++, rec++) {
+		if (!cache || cache->vid != rec->vid)
+			cache = find_object_cache(rec->vid, true);
+		load_cache_entry(cache, rec);
+	}
+	replay_cache_journal(&replay, OC_JOURNAL_NAME".old");
+	replay_cache_journal(&replay, OC_JOURNAL_NAME);
+	finish_cache_replay(&replay);
+	sd_iprintf("loaded %"PRIu64" entries, gen %"PRIu32", capacity %"PRIu64
+		   ", dirty %"PRIu64, hdr->nr_entries, index_gen,
+		   gcache.capacity, gcache.dirty);
+	ret = 0;
+out_unmap:
+	munmap(map, st.st_size);
+out:
+	if (ret < 0)
+		sd_eprintf("%s is corrupted", p);
+	close(fd);
+	return ret;
+}
+
+#define OC_INDEX_BATCH	256 /* records written at a time */
+
+struct index_writer {
+	int fd;
+	off_t offset;
+	uint64_t nr_entries;
+	int nr;
+	struct oc_rec recs[OC_INDEX_BATCH];
+};
+
+static int flush_index_writer(struct index_writer *w)
+{
+	size_t len = w->nr * sizeof(w->recs[0]);
+
+	if (xpwrite(w->fd, w->recs, len, w->offset) != len) {
+		sd_eprintf("%m");
+		return -1;
+	}
+	w->offset += len;
+	w->nr = 0;
+	return 0;
+}
+
+static int save_cache_entry(struct index_writer *w,
+			    struct object_cache_entry *entry)
+{
+	struct oc_rec *rec = w->recs + w->nr++;
+
+	rec->magic = OC_INDEX_MAGIC;
+	rec->type = OC_REC_ADD;
+	rec->flags = entry->hot ? OC_REC_HOT : 0;
+	rec->vid = entry->oc->vid;
+	rec->idx = entry->idx;
+	rec->bmap = entry->bmap;
+	rec->present = uatomic_read(&entry->present);
+	w->nr_entries++;
+
+	if (w->nr == OC_INDEX_BATCH)
+		return flush_index_writer(w);
+	return 0;
+}
+
+/* The cold entries go first, so that the loaded lists stay in LRU order */
+static int save_shard_index(struct index_writer *w, struct oc_shard *shard)
+{
+	struct object_cache_entry *entry;
+	int ret = 0;
+
+	read_lock_shard(shard);
+	list_for_each_entry(entry, &shard->lru_head, lru_list)
+		if ((ret = save_cache_entry(w, entry)) < 0)
+			goto out;
+	list_for_each_entry(entry, &shard->hot_head, lru_list)
+		if ((ret = save_cache_entry(w, entry)) < 0)
+			goto out;
+out:
+	unlock_shard(shard);
+	return ret;
+}
+
+/* Start the journal of the index generation 'gen' */
+static int create_cache_journal(uint32_t gen)
+{
+	struct oc_index_header hdr = { .magic = OC_INDEX_MAGIC, .gen = gen };
+	char p[PATH_MAX], old[PATH_MAX];
+	int fd;
+
+	get_index_path(p, OC_JOURNAL_NAME);
+	get_index_path(old, OC_JOURNAL_NAME".old");
+	/* Needed until the new index is in place */
+	if (rename(p, old) < 0 && errno != ENOENT) {
+		sd_eprintf("%s, %m", p);
+		return -1;
+	}
+	fd = open(p, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, def_fmode);
+	if (fd < 0) {
+		sd_eprintf("%s, %m", p);
+		return -1;
+	}
+	if (xwrite(fd, &hdr, sizeof(hdr)) != sizeof(hdr) || fdatasync(fd) < 0) {
+		sd_eprintf("%s, %m", p);
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/* Called by one thread at a time */
+static int save_cache_index(void)
+{
+	struct oc_index_header hdr = { .magic = OC_INDEX_MAGIC };
+	char p[PATH_MAX], tmp[PATH_MAX];
+	struct object_cache *cache;
+	struct index_writer *w;
+	struct hlist_node *node;
+	int i, j, ret = -1;
+
+	get_index_path(p, OC_INDEX_NAME);
+	get_index_path(tmp, OC_INDEX_NAME".tmp");
+
+	pthread_rwlock_wrlock(&index_lock);
+	if (journal_fd >= 0)
+		close(journal_fd);
+	hdr.gen = ++index_gen;
+	journal_fd = create_cache_journal(hdr.gen);
+	uatomic_set_false(&journal_failed);
+	pthread_rwlock_unlock(&index_lock);
+	if (journal_fd < 0)
+		goto out;
+
+	w = xzalloc(sizeof(*w));
+	w->offset = sizeof(hdr);
+	w->fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, def_fmode);
+	if (w->fd < 0) {
+		sd_eprintf("%s, %m", tmp);
+		goto out_free;
+	}
+	for (i = 0; i < HASH_SIZE; i++) {
+		pthread_rwlock_rdlock(&hashtable_lock[i]);
+		hlist_for_each_entry(cache, node, cache_hashtable + i, hash) {
+			for (j = 0; j < OC_NR_SHARDS; j++)
+				if (save_shard_index(w, cache->shards + j) < 0) {
+					pthread_rwlock_unlock(&hashtable_lock[i]);
+					goto out_close;
+				}
+		}
+		pthread_rwlock_unlock(&hashtable_lock[i]);
+	}
+	if (flush_index_writer(w) < 0)
+		goto out_close;
+	hdr.nr_entries = w->nr_entries;
+	if (xpwrite(w->fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+	    fsync(w->fd) < 0) {
+		sd_eprintf("%s, %m", tmp);
+		goto out_close;
+	}
+	/* A change logged to the new journal may be lost */
+	if (uatomic_is_true(&journal_failed))
+		goto out_close;
+	if (rename(tmp, p) < 0) {
+		sd_eprintf("%s, %m", tmp);
+		goto out_close;
+	}
+	get_index_path(tmp, OC_JOURNAL_NAME".old");
+	unlink(tmp);
+	sd_dprintf("gen %"PRIu32", %"PRIu64" entries", hdr.gen,
+		   hdr.nr_entries);
+	ret = 0;
+out_close:
+	close(w->fd);
+	if (ret < 0)
+		unlink(tmp);
+out_free:
+	free(w);
+out:
+	if (ret < 0)
+		unlink(p);
+	return ret;
+}
+
 static int load_cache_object(struct object_cache *cache)
 {
 	DIR *dir;
 	struct dirent *d;
 	uint32_t idx;
+	uint64_t present;
 	char path[PATH_MAX];
 	int ret = 0;
 
-	snprintf(path, sizeof(path), "%s/%06"PRIx32, object_cache_dir,
-		 cache->vid);
+	get_cache_vdi_path(path, cache->vid);
 	dir = opendir(path);
 	if (!dir) {
 		sd_dprintf("%m");
@@ -1204,7 +2840,8 @@ static int load_cache_object(struct object_cache *cache)
 		 * false reclaim. Donot try to reclaim at loading phase becaue
 		 * cluster isn't fully working.
 		 */
-		add_to_lru_cache(cache, idx, true);
+		present = load_cached_blocks(cache->vid, idx);
+		add_to_lru_cache(cache, idx, true, present);
 		sd_dprintf("%"PRIx64, idx_to_oid(cache->vid, idx));
 	}
 
@@ -1244,10 +2881,17 @@ out:
 	return ret;
 }
 
+void object_cache_usage(uint64_t *cached, uint64_t *dirty)
+{
+	*cached = uatomic_read(&gcache.capacity);
+	*dirty = uatomic_read(&gcache.dirty);
+}
+
 int object_cache_init(const char *p)
 {
 	int ret = 0;
 	struct strbuf buf = STRBUF_INIT;
+	pthread_t thread;
 
 	strbuf_addstr(&buf, p);
 	if (xmkdir(buf.buf, def_dmode) < 0) {
@@ -1261,12 +2905,40 @@ int object_cache_init(const char *p)
 		ret = -1;
 		goto err;
 	}
+	/* the paths of the cache files can't be built otherwise */
+	if (buf.len + strlen("/000000/00000000.tmp") >= PATH_MAX) {
+		sd_eprintf("%s is too long", buf.buf);
+		ret = -1;
+		goto err;
+	}
 	strbuf_copyout(&buf, object_cache_dir, sizeof(object_cache_dir));
 
 	uatomic_set(&gcache.capacity, 0);
+	uatomic_set(&gcache.dirty, 0);
 	uatomic_set_false(&gcache.in_reclaim);
 
-	ret = load_cache();
+	block_cache = is_xattr_enabled(object_cache_dir);
+	if (!block_cache)
+		sd_iprintf("xattr is not supported, cache whole objects");
+
+	if (load_cache_index() < 0) {
+		ret = load_cache();
+		if (ret < 0)
+			goto err;
+	}
+	/* Journaling starts along with the new index */
+	save_cache_index();
+
+	ret = pthread_create(&thread, NULL, oc_writeback_thread, NULL);
+	if (ret) {
+		sd_eprintf("%s", strerror(ret));
+		ret = -1;
+		goto err;
+	}
+	pthread_detach(thread);
+	sd_iprintf("writeback, dirty ratio %"PRIu32"%%, rate %"PRIu32"MB/s",
+		   sys->object_cache_dirty_ratio,
+		   sys->object_cache_writeback_rate);
 err:
 	strbuf_release(&buf);
 	return ret;
@@ -1285,4 +2957,5 @@ void object_cache_format(void)
 		}
 	}
 	uatomic_set(&gcache.capacity, 0);
+	uatomic_set(&gcache.dirty, 0);
 }
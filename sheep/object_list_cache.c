@@ -21,19 +21,25 @@
 #include "strbuf.h"
 #include "util.h"
 
-struct objlist_cache_entry {
-	uint64_t oid;
-	struct list_head list;
-	struct rb_node node;
+/*
+ * The cached oids are kept sorted in fixed size chunks, so that there is no
+ * per-object allocation and both lookups and the object list replies can
+ * work on the chunks directly.  Inserting in order, as the startup scan and
+ * recovery mostly do, only ever appends to the last chunk.
+ */
+#define OBJLIST_CHUNK_SIZE 512
+
+struct objlist_chunk {
+	int nr;
+	uint64_t oids[OBJLIST_CHUNK_SIZE];
 };
 
 struct objlist_cache {
-	int tree_version;
-	int buf_version;
 	int cache_size;
-	uint64_t *buf;
-	struct list_head entry_list;
-	struct rb_root root;
+	/* sorted by oid */
+	struct objlist_chunk **chunks;
+	int nr_chunks;
+	int chunks_alloc;
 	pthread_rwlock_t lock;
 };
 
@@ -43,126 +49,255 @@ struct objlist_deletion_work {
 };
 
 static struct objlist_cache obj_list_cache = {
-	.tree_version	= 1,
-	.root		= RB_ROOT,
-	.entry_list     = LIST_HEAD_INIT(obj_list_cache.entry_list),
 	.lock		= PTHREAD_RWLOCK_INITIALIZER,
 };
 
-static struct objlist_cache_entry *objlist_cache_rb_insert(struct rb_root *root,
-		struct objlist_cache_entry *new)
+static inline uint64_t chunk_last(const struct objlist_chunk *chunk)
+{
+	return chunk->oids[chunk->nr - 1];
+}
+
+/* Return the index of the first oid not less than 'oid' in the chunk */
+static int chunk_lower_bound(const struct objlist_chunk *chunk, uint64_t oid)
+{
+	int lo = 0, hi = chunk->nr, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (chunk->oids[mid] < oid)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/*
+ * Return the index of the first chunk that may hold 'oid', that is the first
+ * one whose last oid is not less than it, or nr_chunks if there is none.
+ */
+static int objlist_cache_find_chunk(uint64_t oid)
 {
-	struct rb_node **p = &root->rb_node;
-	struct rb_node *parent = NULL;
-	struct objlist_cache_entry *entry;
+	int lo = 0, hi = obj_list_cache.nr_chunks, mid;
 
-	while (*p) {
-		parent = *p;
-		entry = rb_entry(parent, struct objlist_cache_entry, node);
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (chunk_last(obj_list_cache.chunks[mid]) < oid)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
 
-		if (new->oid < entry->oid)
-			p = &(*p)->rb_left;
-		else if (new->oid > entry->oid)
-			p = &(*p)->rb_right;
+static struct objlist_chunk *objlist_cache_add_chunk(int idx)
+{
+	struct objlist_chunk *chunk;
+
+	if (obj_list_cache.nr_chunks == obj_list_cache.chunks_alloc) {
+		if (obj_list_cache.chunks_alloc)
+			obj_list_cache.chunks_alloc *= 2;
 		else
-			return entry; /* already has this entry */
+			obj_list_cache.chunks_alloc = 16;
+		obj_list_cache.chunks = xrealloc(obj_list_cache.chunks,
+				sizeof(*obj_list_cache.chunks) *
+				obj_list_cache.chunks_alloc);
 	}
-	rb_link_node(&new->node, parent, p);
-	rb_insert_color(&new->node, root);
+	memmove(obj_list_cache.chunks + idx + 1, obj_list_cache.chunks + idx,
+		sizeof(*obj_list_cache.chunks) *
+		(obj_list_cache.nr_chunks - idx));
+	chunk = xmalloc(sizeof(*chunk));
+	chunk->nr = 0;
+	obj_list_cache.chunks[idx] = chunk;
+	obj_list_cache.nr_chunks++;
+
+	return chunk;
+}
 
-	return NULL; /* insert successfully */
+static void objlist_cache_del_chunk(int idx)
+{
+	free(obj_list_cache.chunks[idx]);
+	obj_list_cache.nr_chunks--;
+	memmove(obj_list_cache.chunks + idx, obj_list_cache.chunks + idx + 1,
+		sizeof(*obj_list_cache.chunks) *
+		(obj_list_cache.nr_chunks - idx));
 }
 
-static int objlist_cache_rb_remove(struct rb_root *root, uint64_t oid)
+/* Return false if the oid is already cached */
+static bool objlist_cache_add(uint64_t oid)
 {
-	struct rb_node **p = &root->rb_node;
-	struct rb_node *parent = NULL;
-	struct objlist_cache_entry *entry;
+	struct objlist_chunk *chunk, *next;
+	int idx, pos;
+
+	idx = objlist_cache_find_chunk(oid);
+	if (idx == obj_list_cache.nr_chunks) {
+		/* append, start a new chunk only when the last one is full */
+		if (idx && obj_list_cache.chunks[idx - 1]->nr <
+		    OBJLIST_CHUNK_SIZE)
+			chunk = obj_list_cache.chunks[idx - 1];
+		else
+			chunk = objlist_cache_add_chunk(idx);
+		chunk->oids[chunk->nr++] = oid;
+		return true;
+	}
 
-	while (*p) {
-		parent = *p;
-		entry = rb_entry(parent, struct objlist_cache_entry, node);
+	chunk = obj_list_cache.chunks[idx];
+	pos = chunk_lower_bound(chunk, oid);
+	if (chunk->oids[pos] == oid)
+		return false;
+
+	if (chunk->nr == OBJLIST_CHUNK_SIZE) {
+		/* split the full chunk in halves */
+		next = objlist_cache_add_chunk(idx + 1);
+		next->nr = OBJLIST_CHUNK_SIZE / 2;
+		chunk->nr -= next->nr;
+		memcpy(next->oids, chunk->oids + chunk->nr,
+		       sizeof(uint64_t) * next->nr);
+		if (pos > chunk->nr) {
+			pos -= chunk->nr;
+			chunk = next;
+		}
+	}
+	memmove(chunk->oids + pos + 1, chunk->oids + pos,
+		sizeof(uint64_t) * (chunk->nr - pos));
+	chunk->oids[pos] = oid;
+	chunk->nr++;
 
-		if (oid < entry->oid)
-			p = &(*p)->rb_left;
-		else if (oid > entry->oid)
-			p = &(*p)->rb_right;
-		else {
-			list_del(&entry->list);
-			rb_erase(parent, root);
-			free(entry);
-			return 0;
+	return true;
+}
+
+/* Remove the cached oids in [start, end), return how many were removed */
+static int objlist_cache_del_range(uint64_t start, uint64_t end)
+{
+	struct objlist_chunk *chunk;
+	int idx, from, to, nr = 0;
+
+	idx = objlist_cache_find_chunk(start);
+	while (idx < obj_list_cache.nr_chunks) {
+		chunk = obj_list_cache.chunks[idx];
+		from = chunk_lower_bound(chunk, start);
+		to = chunk_lower_bound(chunk, end);
+		if (from == to)
+			break;
+
+		nr += to - from;
+		if (from == 0 && to == chunk->nr) {
+			objlist_cache_del_chunk(idx);
+			continue;
 		}
+		memmove(chunk->oids + from, chunk->oids + to,
+			sizeof(uint64_t) * (chunk->nr - to));
+		chunk->nr -= to - from;
+		if (to < chunk->nr + (to - from))
+			break;
+		idx++;
 	}
+	obj_list_cache.cache_size -= nr;
 
-	return -1; /* fail to remove */
+	return nr;
 }
 
 void objlist_cache_remove(uint64_t oid)
 {
 	pthread_rwlock_wrlock(&obj_list_cache.lock);
-	if (!objlist_cache_rb_remove(&obj_list_cache.root, oid)) {
-		obj_list_cache.cache_size--;
-		obj_list_cache.tree_version++;
-	}
+	objlist_cache_del_range(oid, oid + 1);
 	pthread_rwlock_unlock(&obj_list_cache.lock);
 }
 
 int objlist_cache_insert(uint64_t oid)
 {
-	struct objlist_cache_entry *entry, *p;
-
-	entry = xzalloc(sizeof(*entry));
-	entry->oid = oid;
-	rb_init_node(&entry->node);
-
 	pthread_rwlock_wrlock(&obj_list_cache.lock);
-	p = objlist_cache_rb_insert(&obj_list_cache.root, entry);
-	if (p)
-		free(entry);
-	else {
-		list_add(&entry->list, &obj_list_cache.entry_list);
+	if (objlist_cache_add(oid))
 		obj_list_cache.cache_size++;
-		obj_list_cache.tree_version++;
-	}
 	pthread_rwlock_unlock(&obj_list_cache.lock);
 
 	return 0;
 }
 
-int get_obj_list(const struct sd_list_req *hdr, struct sd_list_rsp *rsp, void *data)
+/* Copy at most 'max' cached oids from 'oid' on to 'buf', return the count */
+static int objlist_cache_copy(uint64_t oid, uint64_t *buf, int max)
+{
+	struct objlist_chunk *chunk;
+	int idx, pos, n, nr = 0;
+
+	idx = objlist_cache_find_chunk(oid);
+	if (idx == obj_list_cache.nr_chunks)
+		return 0;
+
+	pos = chunk_lower_bound(obj_list_cache.chunks[idx], oid);
+	for (; idx < obj_list_cache.nr_chunks && nr < max; idx++, pos = 0) {
+		chunk = obj_list_cache.chunks[idx];
+		n = min(chunk->nr - pos, max - nr);
+		memcpy(buf + nr, chunk->oids + pos, sizeof(uint64_t) * n);
+		nr += n;
+	}
+	return nr;
+}
+
+/* Return the number of the cached oids less than 'oid' */
+static int objlist_cache_rank(uint64_t oid)
 {
-	int nr = 0;
-	struct objlist_cache_entry *entry;
+	int idx, i, nr = 0;
+
+	idx = objlist_cache_find_chunk(oid);
+	for (i = 0; i < idx; i++)
+		nr += obj_list_cache.chunks[i]->nr;
+	if (idx < obj_list_cache.nr_chunks)
+		nr += chunk_lower_bound(obj_list_cache.chunks[idx], oid);
+	return nr;
+}
 
-	/* first try getting the cached buffer with only a read lock held */
-	pthread_rwlock_rdlock(&obj_list_cache.lock);
-	if (obj_list_cache.tree_version == obj_list_cache.buf_version)
-		goto out;
+/* Return a sorted copy of the cached oids, the caller frees it */
+uint64_t *objlist_cache_get_all(int *nr)
+{
+	uint64_t *oids;
 
-	/* if that fails grab a write lock for the usually nessecary update */
+	pthread_rwlock_rdlock(&obj_list_cache.lock);
+	oids = xmalloc(sizeof(*oids) * (obj_list_cache.cache_size + 1));
+	*nr = objlist_cache_copy(0, oids, obj_list_cache.cache_size);
 	pthread_rwlock_unlock(&obj_list_cache.lock);
-	pthread_rwlock_wrlock(&obj_list_cache.lock);
-	if (obj_list_cache.tree_version == obj_list_cache.buf_version)
-		goto out;
 
-	obj_list_cache.buf_version = obj_list_cache.tree_version;
-	obj_list_cache.buf = xrealloc(obj_list_cache.buf,
-				obj_list_cache.cache_size * sizeof(uint64_t));
+	return oids;
+}
 
-	list_for_each_entry(entry, &obj_list_cache.entry_list, list) {
-		obj_list_cache.buf[nr++] = entry->oid;
-	}
+int get_obj_list(const struct sd_list_req *hdr, struct sd_list_rsp *rsp, void *data)
+{
+	int nr, left;
+	bool paged = hdr->list_flags & SD_LIST_PAGED;
+	uint64_t cursor = paged ? hdr->cursor : 0;
+	uint64_t next;
 
-out:
-	if (hdr->data_length < obj_list_cache.cache_size * sizeof(uint64_t)) {
-		pthread_rwlock_unlock(&obj_list_cache.lock);
-		sd_eprintf("GET_OBJ_LIST buffer too small");
-		return SD_RES_BUFFER_SMALL;
+	pthread_rwlock_rdlock(&obj_list_cache.lock);
+	rsp->list_flags = 0;
+	rsp->cursor = 0;
+	if (paged) {
+		left = obj_list_cache.cache_size - objlist_cache_rank(cursor);
+		nr = min(left, (int)(hdr->data_length / sizeof(uint64_t)));
+		if (!nr && left) {
+			pthread_rwlock_unlock(&obj_list_cache.lock);
+			sd_eprintf("GET_OBJ_LIST buffer too small");
+			return SD_RES_BUFFER_SMALL;
+		}
+		if (nr < left) {
+			/* the cursor is the first oid of the next page */
+			nr = objlist_cache_copy(cursor, data, nr);
+			objlist_cache_copy(((uint64_t *)data)[nr - 1] + 1,
+					   &next, 1);
+			rsp->list_flags = SD_LIST_MORE;
+			rsp->cursor = next;
+			goto out;
+		}
+	} else {
+		nr = obj_list_cache.cache_size;
+		if (hdr->data_length < nr * sizeof(uint64_t)) {
+			pthread_rwlock_unlock(&obj_list_cache.lock);
+			sd_eprintf("GET_OBJ_LIST buffer too small");
+			return SD_RES_BUFFER_SMALL;
+		}
 	}
-
-	rsp->data_length = obj_list_cache.cache_size * sizeof(uint64_t);
-	memcpy(data, obj_list_cache.buf, rsp->data_length);
+	nr = objlist_cache_copy(cursor, data, nr);
+out:
+	rsp->data_length = nr * sizeof(uint64_t);
 	pthread_rwlock_unlock(&obj_list_cache.lock);
 	return SD_RES_SUCCESS;
 }
@@ -171,8 +306,10 @@ static void objlist_deletion_work(struct work *work)
 {
 	struct objlist_deletion_work *ow =
 		container_of(work, struct objlist_deletion_work, work);
-	struct objlist_cache_entry *entry, *t;
-	uint32_t vid = ow->vid, entry_vid;
+	uint64_t base = (uint64_t)ow->vid << VDI_SPACE_SHIFT;
+	uint64_t next = (uint64_t)(ow->vid + 1) << VDI_SPACE_SHIFT;
+	uint32_t vid = ow->vid;
+	int nr;
 
 	/*
 	 * Before reclaiming the cache belonging to the VDI just deleted,
@@ -187,17 +324,12 @@ static void objlist_deletion_work(struct work *work)
 		return;
 	}
 
+	/* the data objects and the inode of the VDI are two ranges */
 	pthread_rwlock_wrlock(&obj_list_cache.lock);
-	list_for_each_entry_safe(entry, t, &obj_list_cache.entry_list, list) {
-		entry_vid = oid_to_vid(entry->oid);
-		if (entry_vid != vid)
-			continue;
-		sd_dprintf("delete object entry %" PRIx64, entry->oid);
-		list_del(&entry->list);
-		rb_erase(&entry->node, &obj_list_cache.root);
-		free(entry);
-	}
+	nr = objlist_cache_del_range(base, next);
+	nr += objlist_cache_del_range(VDI_BIT | base, VDI_BIT | next);
 	pthread_rwlock_unlock(&obj_list_cache.lock);
+	sd_dprintf("delete %d object entries of %" PRIx32, nr, vid);
 }
 
 static void objlist_deletion_done(struct work *work)
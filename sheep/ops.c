@@ -41,6 +41,12 @@ struct sd_op_template {
 	/* process request even when cluster is not working */
 	bool force;
 
+	/*
+	 * vectored gateway operations have no process_work() and are split into
+	 * one gateway request per object in the main thread
+	 */
+	bool vectored;
+
 	/*
 	 * process_work() will be called in a worker thread, and process_main()
 	 * will be called in the main thread.
@@ -64,7 +70,7 @@ struct sd_op_template {
 static int get_total_object_size(uint64_t oid, char *ignore, void *total)
 {
 	uint64_t *t = total;
-	*t += get_objsize(oid);
+	*t += get_store_objsize(oid);
 
 	return SD_RES_SUCCESS;
 }
@@ -102,6 +108,8 @@ static int cluster_new_vdi(struct request *req)
 	iocb.base_vid = hdr->vdi.base_vdi_id;
 	iocb.create_snapshot = !!hdr->vdi.snapid;
 	iocb.nr_copies = hdr->vdi.copies;
+	iocb.copy_policy = hdr->vdi.copy_policy;
+	iocb.block_size_shift = hdr->vdi.block_size_shift;
 
 	if (!iocb.nr_copies)
 		iocb.nr_copies = sys->nr_copies;
@@ -164,15 +172,13 @@ static void cache_delete_done(struct work *work)
 	free(dw);
 }
 
-static int post_cluster_del_vdi(const struct sd_req *req, struct sd_rsp *rsp,
-				void *data)
+/*
+ * The deletion waits for the background writeback of the cache, which needs
+ * the other nodes, so it must not block the main thread.
+ */
+static void queue_cache_deletion(uint32_t vid)
 {
-	unsigned long vid = rsp->vdi.vdi_id;
 	struct cache_deletion_work *dw;
-	int ret = rsp->result;
-
-	if (!sys->enable_object_cache)
-		return ret;
 
 	dw = xzalloc(sizeof(*dw));
 	dw->vid = vid;
@@ -180,6 +186,18 @@ static int post_cluster_del_vdi(const struct sd_req *req, struct sd_rsp *rsp,
 	dw->work.done = cache_delete_done;
 
 	queue_work(sys->deletion_wqueue, &dw->work);
+}
+
+static int post_cluster_del_vdi(const struct sd_req *req, struct sd_rsp *rsp,
+				void *data)
+{
+	unsigned long vid = rsp->vdi.vdi_id;
+	int ret = rsp->result;
+
+	if (!sys->enable_object_cache)
+		return ret;
+
+	queue_cache_deletion(vid);
 
 	return ret;
 }
@@ -242,6 +260,10 @@ static int cluster_make_fs(const struct sd_req *req, struct sd_rsp *rsp,
 	struct store_driver *driver;
 	char *store_name = data;
 
+	if (hdr->placement != SD_PLACEMENT_RING &&
+	    hdr->placement != SD_PLACEMENT_STRAW2)
+		return SD_RES_INVALID_PARMS;
+
 	driver = find_store_driver(data);
 	if (!driver)
 		return SD_RES_NO_STORE;
@@ -269,10 +291,19 @@ static int cluster_make_fs(const struct sd_req *req, struct sd_rsp *rsp,
 	set_cluster_copies(sys->nr_copies);
 	set_cluster_flags(sys->flags);
 
+	if (sys->placement != hdr->placement) {
+		sys->placement = hdr->placement;
+		refresh_vnode_info();
+	}
+	set_cluster_placement(sys->placement);
+
 	for (i = 1; i <= latest_epoch; i++)
 		remove_epoch(i);
 
 	memset(sys->vdi_inuse, 0, sizeof(sys->vdi_inuse));
+	clear_vdi_copy_list();
+	clear_vdi_index();
+	sys->vdi_list_complete = true;
 
 	sys->epoch = 1;
 
@@ -310,6 +341,20 @@ static int cluster_disable_recover(const struct sd_req *req,
 	return SD_RES_SUCCESS;
 }
 
+static int cluster_set_recovery(const struct sd_req *req,
+				struct sd_rsp *rsp, void *data)
+{
+	if (req->data_length != sizeof(sys->recovery_throttle))
+		return SD_RES_INVALID_PARMS;
+
+	memcpy(&sys->recovery_throttle, data, sizeof(sys->recovery_throttle));
+	sd_iprintf("recovery throttle: %"PRIu32" MB/s, %"PRIu32" objects/s, "
+		   "%"PRIu32" ms", sys->recovery_throttle.max_bandwidth,
+		   sys->recovery_throttle.max_iops,
+		   sys->recovery_throttle.max_latency);
+	return SD_RES_SUCCESS;
+}
+
 static int cluster_get_vdi_attr(struct request *req)
 {
 	const struct sd_req *hdr = &req->rq;
@@ -383,7 +428,13 @@ static int local_read_vdis(const struct sd_req *req, struct sd_rsp *rsp,
 static int local_get_vdi_copies(const struct sd_req *req, struct sd_rsp *rsp,
 			   void *data)
 {
-	rsp->data_length = fill_vdi_copy_list(data);
+	const struct sd_vdi_copies_req *hdr =
+		(const struct sd_vdi_copies_req *)req;
+	struct sd_vdi_copies_rsp *vrsp = (struct sd_vdi_copies_rsp *)rsp;
+
+	rsp->data_length = fill_vdi_copy_list(data, req->data_length,
+					      hdr->since);
+	vrsp->list_flags = sys->vdi_list_complete ? SD_VDI_COPIES_COMPLETE : 0;
 
 	return SD_RES_SUCCESS;
 }
@@ -399,6 +450,11 @@ static int local_stat_sheep(struct request *req)
 static int local_stat_recovery(const struct sd_req *req, struct sd_rsp *rsp,
 					void *data)
 {
+	if (req->data_length >= sizeof(struct recovery_wait_stat)) {
+		get_recovery_wait_stat(data);
+		rsp->data_length = sizeof(struct recovery_wait_stat);
+	}
+
 	if (node_in_recovery())
 		return SD_RES_NODE_IN_RECOVERY;
 
@@ -431,6 +487,7 @@ static int local_stat_cluster(struct request *req)
 							(time_t *)&log->time);
 
 		log->nr_copies = sys->nr_copies;
+		log->placement = sys->placement;
 
 		rsp->data_length += sizeof(*log);
 		epoch--;
@@ -577,8 +634,28 @@ static int cluster_notify_vdi_add(const struct sd_req *req, struct sd_rsp *rsp,
 {
 	uint32_t vid = *(uint32_t *)data;
 	uint32_t nr_copies = *(uint32_t *)((char *)data + sizeof(vid));
+	uint32_t copy_policy = 0;
+	size_t len = sizeof(vid) + sizeof(nr_copies) + sizeof(copy_policy);
+	const struct vdi_name_entry *e = (void *)((char *)data + len);
+	int i, nr_entries = 0;
+
+	/* older sheep don't send the policy */
+	if (req->data_length >= len)
+		copy_policy = *(uint32_t *)((char *)data + sizeof(vid) +
+					    sizeof(nr_copies));
+
+	/* a zero shift is the default object size */
+	add_vdi_copy_number(vid, nr_copies, copy_policy,
+			    req->vdi.block_size_shift);
 
-	add_vdi_copy_number(vid, nr_copies);
+	if (req->data_length > len)
+		nr_entries = (req->data_length - len) / sizeof(*e);
+	for (i = 0; i < nr_entries; i++)
+		update_vdi_index(e + i);
+
+	/* older sheep don't tell which headers changed */
+	if (!nr_entries)
+		clear_vdi_index();
 
 	return SD_RES_SUCCESS;
 }
@@ -587,16 +664,34 @@ static int cluster_notify_vdi_del(const struct sd_req *req, struct sd_rsp *rsp,
 				  void *data)
 {
 	uint32_t vid = *(uint32_t *)data;
+	struct vdi_name_entry e = { .vid = vid };
+
+	update_vdi_index(&e);
 
 	return objlist_cache_cleanup(vid);
 }
 
+/*
+ * The node the request came to deletes its cache before answering, in a
+ * worker since the deletion waits for the background writeback.  The other
+ * nodes queue the deletion of theirs, and the one of the sender finds nothing
+ * left to delete.
+ */
+static int cluster_delete_cache_work(struct request *req)
+{
+	if (sys->enable_object_cache)
+		object_cache_delete(oid_to_vid(req->rq.obj.oid));
+
+	return SD_RES_SUCCESS;
+}
+
 static int cluster_delete_cache(const struct sd_req *req, struct sd_rsp *rsp,
 				void *data)
 {
 	uint32_t vid = oid_to_vid(req->obj.oid);
 
-	object_cache_delete(vid);
+	if (sys->enable_object_cache)
+		queue_cache_deletion(vid);
 
 	return SD_RES_SUCCESS;
 }
@@ -666,6 +761,65 @@ static int local_set_cache_size(const struct sd_req *req, struct sd_rsp *rsp,
 	return SD_RES_SUCCESS;
 }
 
+static int cluster_notify_vdi_qos(const struct sd_req *req,
+				  struct sd_rsp *rsp, void *data)
+{
+	if (req->data_length < sizeof(struct sd_vdi_qos))
+		return SD_RES_INVALID_PARMS;
+
+	qos_set(data);
+	return SD_RES_SUCCESS;
+}
+
+static int cluster_notify_inode_update(const struct sd_req *req,
+				       struct sd_rsp *rsp, void *data)
+{
+	inode_cache_invalidate(oid_to_vid(req->obj.oid));
+	return SD_RES_SUCCESS;
+}
+
+static int local_get_vdi_qos(struct request *req)
+{
+	struct sd_vdi_qos *limits = req->data;
+	int ret;
+
+	if (req->rq.data_length < sizeof(*limits))
+		return SD_RES_INVALID_PARMS;
+
+	limits->vid = req->rq.vdi.base_vdi_id;
+	ret = get_vdi_qos(limits, NULL);
+	if (ret == SD_RES_SUCCESS)
+		req->rp.data_length = sizeof(*limits);
+
+	return ret;
+}
+
+static int local_stat_wqueue(const struct sd_req *req, struct sd_rsp *rsp,
+			     void *data)
+{
+	int nr;
+
+	nr = get_wqueue_stats(data, req->data_length /
+			      sizeof(struct wqueue_stat));
+	if (nr < 0)
+		return SD_RES_BUFFER_SMALL;
+
+	rsp->data_length = nr * sizeof(struct wqueue_stat);
+	return SD_RES_SUCCESS;
+}
+
+static int local_set_wqueue(const struct sd_req *req, struct sd_rsp *rsp,
+			    void *data)
+{
+	struct wqueue_stat *st = data;
+
+	if (req->data_length < sizeof(*st))
+		return SD_RES_INVALID_PARMS;
+
+	st->name[sizeof(st->name) - 1] = '\0';
+	return set_wqueue_limits(st->name, st->min_threads, st->max_threads);
+}
+
 static int cluster_restore(const struct sd_req *req, struct sd_rsp *rsp,
 			   void *data)
 {
@@ -676,6 +830,10 @@ static int cluster_restore(const struct sd_req *req, struct sd_rsp *rsp,
 		ret = sd_store->restore(&iocb);
 	else
 		ret = SD_RES_NO_SUPPORT;
+
+	/* the inodes are replaced with the ones of the snapshot */
+	clear_vdi_index();
+	inode_cache_purge();
 	return ret;
 }
 
@@ -742,6 +900,27 @@ static int local_trace_read_buf(struct request *request)
 	return SD_RES_SUCCESS;
 }
 
+static int local_trace_read_reqs(struct request *request)
+{
+	request->rp.data_length = reqtrace_read(request->data,
+						request->rq.data_length);
+	return SD_RES_SUCCESS;
+}
+
+static int local_stat_metrics(const struct sd_req *req, struct sd_rsp *rsp,
+			      void *data)
+{
+	int nr;
+
+	nr = metrics_snapshot(data, req->data_length /
+			      sizeof(struct sd_metric));
+	if (nr < 0)
+		return SD_RES_BUFFER_SMALL;
+
+	rsp->data_length = nr * sizeof(struct sd_metric);
+	return SD_RES_SUCCESS;
+}
+
 static int local_kill_node(const struct sd_req *req, struct sd_rsp *rsp,
 			   void *data)
 {
@@ -756,11 +935,12 @@ static int read_copy_from_replica(struct request *req, uint32_t epoch,
 	struct request read_req = { };
 	struct sd_req *hdr = &read_req.rq;
 	struct sd_rsp *rsp = &read_req.rp;
+	uint32_t objsize = get_vdi_objsize(oid);
 	int ret;
 
 	/* Create a fake gateway read request */
 	sd_init_req(hdr, SD_OP_READ_OBJ);
-	hdr->data_length = SD_DATA_OBJ_SIZE;
+	hdr->data_length = objsize;
 	hdr->epoch = epoch;
 
 	hdr->obj.oid = oid;
@@ -775,7 +955,7 @@ static int read_copy_from_replica(struct request *req, uint32_t epoch,
 
 	if (ret == SD_RES_SUCCESS)
 		untrim_zero_sectors(buf, rsp->obj.offset, rsp->data_length,
-				    SD_DATA_OBJ_SIZE);
+				    objsize);
 
 	return ret;
 }
@@ -789,12 +969,60 @@ int peer_remove_obj(struct request *req)
 	return sd_store->remove_object(oid);
 }
 
+/*
+ * Remove the objects of the list in the data buffer.  The sender grouped them
+ * by the placement at hdr.epoch, so the whole batch is refused if our epoch
+ * differs, and objects which are already gone don't count as a failure.
+ */
+int peer_remove_objs(struct request *req)
+{
+	const uint64_t *oids = req->data;
+	int i, nr = req->data_length / sizeof(*oids), ret, err = SD_RES_SUCCESS;
+
+	if (before(req->rq.epoch, sys_epoch()))
+		return SD_RES_OLD_NODE_VER;
+	else if (after(req->rq.epoch, sys_epoch()))
+		return SD_RES_NEW_NODE_VER;
+
+	for (i = 0; i < nr; i++) {
+		objlist_cache_remove(oids[i]);
+		ret = sd_store->remove_object(oids[i]);
+		if (ret != SD_RES_SUCCESS && ret != SD_RES_NO_OBJ) {
+			sd_eprintf("failed to remove %" PRIx64 ", %s", oids[i],
+				   sd_strerror(ret));
+			err = ret;
+		}
+	}
+
+	return err;
+}
+
+int peer_discard_obj(struct request *req)
+{
+	struct sd_req *hdr = &req->rq;
+	struct siocb iocb = { };
+	uint64_t oid = hdr->obj.oid;
+
+	if (!sd_store->discard)
+		return SD_RES_NO_SUPPORT;
+	if (hdr->obj.offset + hdr->obj.length > get_store_objsize(oid))
+		return SD_RES_INVALID_PARMS;
+
+	iocb.epoch = hdr->epoch;
+	iocb.flags = hdr->flags;
+	iocb.ec_index = hdr->obj.ec_index;
+	iocb.length = hdr->obj.length;
+	iocb.offset = hdr->obj.offset;
+
+	return sd_store->discard(oid, &iocb);
+}
+
 int peer_read_obj(struct request *req)
 {
 	struct sd_req *hdr = &req->rq;
 	struct sd_rsp *rsp = &req->rp;
 	int ret;
-	uint32_t epoch = hdr->epoch;
+	uint32_t epoch = hdr->epoch, len;
 	struct siocb iocb;
 
 	if (sys->gateway_only)
@@ -803,17 +1031,37 @@ int peer_read_obj(struct request *req)
 	memset(&iocb, 0, sizeof(iocb));
 	iocb.epoch = epoch;
 	iocb.flags = hdr->flags;
+	iocb.ec_index = hdr->obj.ec_index;
 	iocb.buf = req->data;
 	iocb.length = hdr->data_length;
 	iocb.offset = hdr->obj.offset;
+
+	rsp->obj.offset = 0;
+	len = 0;
+	/* send the compressed object as it is stored */
+	if ((hdr->flags & SD_FLAG_CMD_COMPRESS) && sd_store->read_compressed) {
+		ret = sd_store->read_compressed(hdr->obj.oid, &iocb, &len);
+		if (ret == SD_RES_SUCCESS && len) {
+			rsp->flags |= SD_FLAG_CMD_COMPRESS;
+			rsp->data_length = len;
+			goto copies;
+		}
+	}
+
 	ret = sd_store->read(hdr->obj.oid, &iocb);
 	if (ret != SD_RES_SUCCESS)
 		goto out;
 
 	rsp->data_length = hdr->data_length;
-	rsp->obj.offset = 0;
-	trim_zero_sectors(req->data, &rsp->obj.offset, &rsp->data_length);
-
+	if (hdr->flags & SD_FLAG_CMD_SPARSE)
+		len = pack_sparse_data(req->data, hdr->data_length);
+	if (len) {
+		rsp->flags |= SD_FLAG_CMD_SPARSE;
+		rsp->data_length = len;
+	} else
+		trim_zero_sectors(req->data, &rsp->obj.offset,
+				  &rsp->data_length);
+copies:
 	if (hdr->obj.copies)
 		rsp->obj.copies = hdr->obj.copies;
 	else
@@ -823,6 +1071,45 @@ out:
 	return ret;
 }
 
+int peer_get_obj_digest(struct request *req)
+{
+	struct sd_req *hdr = &req->rq;
+	struct sd_rsp *rsp = &req->rp;
+	uint64_t oid = hdr->obj.oid;
+	uint32_t len = get_store_objsize(oid), dlen;
+	struct siocb iocb = { 0 };
+	void *buf;
+	int ret;
+
+	if (sys->gateway_only)
+		return SD_RES_NO_OBJ;
+
+	dlen = DIV_ROUND_UP(len, SD_DIGEST_RANGE_SIZE) * SHA1_LEN;
+	if (hdr->data_length < dlen)
+		return SD_RES_BUFFER_SMALL;
+
+	buf = valloc(len);
+	if (!buf) {
+		sd_eprintf("%m");
+		return SD_RES_NO_MEM;
+	}
+
+	iocb.epoch = hdr->epoch;
+	iocb.flags = hdr->flags;
+	iocb.ec_index = hdr->obj.ec_index;
+	iocb.buf = buf;
+	iocb.length = len;
+	ret = sd_store->read(oid, &iocb);
+	if (ret != SD_RES_SUCCESS)
+		goto out;
+
+	get_obj_digests(buf, len, req->data);
+	rsp->data_length = dlen;
+out:
+	free(buf);
+	return ret;
+}
+
 static int do_create_and_write_obj(struct siocb *iocb, struct sd_req *hdr,
 				   uint32_t epoch, void *data)
 {
@@ -839,8 +1126,12 @@ int peer_write_obj(struct request *req)
 	struct siocb iocb = { };
 	uint64_t oid = hdr->obj.oid;
 
+	if (hdr->flags & SD_FLAG_CMD_CHAIN)
+		return gateway_chain_obj(req);
+
 	iocb.epoch = hdr->epoch;
 	iocb.flags = hdr->flags;
+	iocb.ec_index = hdr->obj.ec_index;
 	iocb.buf = req->data;
 	iocb.length = hdr->data_length;
 	iocb.offset = hdr->obj.offset;
@@ -858,15 +1149,21 @@ int peer_create_and_write_obj(struct request *req)
 	struct siocb iocb;
 	int ret = SD_RES_SUCCESS;
 
+	if (hdr->flags & SD_FLAG_CMD_CHAIN)
+		return gateway_chain_obj(req);
+
 	memset(&iocb, 0, sizeof(iocb));
 	iocb.epoch = epoch;
 	iocb.flags = hdr->flags;
-	iocb.length = get_objsize(oid);
+	iocb.ec_index = hdr->obj.ec_index;
+	iocb.length = get_store_objsize(oid);
 	if (hdr->flags & SD_FLAG_CMD_COW) {
+		uint32_t objsize = get_vdi_objsize(oid);
+
 		sd_dprintf("%" PRIx64 ", %" PRIx64, oid, hdr->obj.cow_oid);
 
-		buf = xvalloc(SD_DATA_OBJ_SIZE);
-		if (hdr->data_length != SD_DATA_OBJ_SIZE) {
+		buf = xvalloc(objsize);
+		if (hdr->data_length != objsize) {
 			ret = read_copy_from_replica(req, hdr->epoch,
 						     hdr->obj.cow_oid, buf);
 			if (ret != SD_RES_SUCCESS) {
@@ -877,7 +1174,7 @@ int peer_create_and_write_obj(struct request *req)
 
 		memcpy(buf + hdr->obj.offset, req->data, hdr->data_length);
 		memcpy(&cow_hdr, hdr, sizeof(cow_hdr));
-		cow_hdr.data_length = SD_DATA_OBJ_SIZE;
+		cow_hdr.data_length = objsize;
 		cow_hdr.obj.offset = 0;
 		trim_zero_sectors(buf, &cow_hdr.obj.offset,
 				  &cow_hdr.data_length);
@@ -972,9 +1269,23 @@ static struct sd_op_template sd_ops[] = {
 		.process_main = cluster_notify_vdi_add,
 	},
 
+	[SD_OP_NOTIFY_VDI_QOS] = {
+		.name = "NOTIFY_VDI_QOS",
+		.type = SD_OP_TYPE_CLUSTER,
+		.process_main = cluster_notify_vdi_qos,
+	},
+
+	[SD_OP_NOTIFY_INODE_UPDATE] = {
+		.name = "NOTIFY_INODE_UPDATE",
+		.type = SD_OP_TYPE_CLUSTER,
+		.force = true,
+		.process_main = cluster_notify_inode_update,
+	},
+
 	[SD_OP_DELETE_CACHE] = {
 		.name = "DELETE_CACHE",
 		.type = SD_OP_TYPE_CLUSTER,
+		.process_work = cluster_delete_cache_work,
 		.process_main = cluster_delete_cache,
 	},
 
@@ -1096,6 +1407,20 @@ static struct sd_op_template sd_ops[] = {
 		.process_work = local_trace_read_buf,
 	},
 
+	[SD_OP_TRACE_READ_REQS] = {
+		.name = "TRACE_READ_REQS",
+		.type = SD_OP_TYPE_LOCAL,
+		.force = true,
+		.process_work = local_trace_read_reqs,
+	},
+
+	[SD_OP_STAT_METRICS] = {
+		.name = "STAT_METRICS",
+		.type = SD_OP_TYPE_LOCAL,
+		.force = true,
+		.process_main = local_stat_metrics,
+	},
+
 	[SD_OP_KILL_NODE] = {
 		.name = "KILL_NODE",
 		.type = SD_OP_TYPE_LOCAL,
@@ -1109,6 +1434,26 @@ static struct sd_op_template sd_ops[] = {
 		.process_main = local_set_cache_size,
 	},
 
+	[SD_OP_GET_VDI_QOS] = {
+		.name = "GET_VDI_QOS",
+		.type = SD_OP_TYPE_LOCAL,
+		.process_work = local_get_vdi_qos,
+	},
+
+	[SD_OP_STAT_WQUEUE] = {
+		.name = "STAT_WQUEUE",
+		.type = SD_OP_TYPE_LOCAL,
+		.force = true,
+		.process_main = local_stat_wqueue,
+	},
+
+	[SD_OP_SET_WQUEUE] = {
+		.name = "SET_WQUEUE",
+		.type = SD_OP_TYPE_LOCAL,
+		.force = true,
+		.process_main = local_set_wqueue,
+	},
+
 	/* gateway I/O operations */
 	[SD_OP_CREATE_AND_WRITE_OBJ] = {
 		.name = "CREATE_AND_WRITE_OBJ",
@@ -1134,6 +1479,24 @@ static struct sd_op_template sd_ops[] = {
 		.process_work = gateway_remove_obj,
 	},
 
+	[SD_OP_DISCARD_OBJ] = {
+		.name = "DISCARD_OBJ",
+		.type = SD_OP_TYPE_GATEWAY,
+		.process_work = gateway_discard_obj,
+	},
+
+	[SD_OP_READ_OBJS] = {
+		.name = "READ_OBJS",
+		.type = SD_OP_TYPE_GATEWAY,
+		.vectored = true,
+	},
+
+	[SD_OP_WRITE_OBJS] = {
+		.name = "WRITE_OBJS",
+		.type = SD_OP_TYPE_GATEWAY,
+		.vectored = true,
+	},
+
 	/* peer I/O operations */
 	[SD_OP_CREATE_AND_WRITE_PEER] = {
 		.name = "CREATE_AND_WRITE_PEER",
@@ -1147,6 +1510,12 @@ static struct sd_op_template sd_ops[] = {
 		.process_work = peer_read_obj,
 	},
 
+	[SD_OP_GET_OBJ_DIGEST] = {
+		.name = "GET_OBJ_DIGEST",
+		.type = SD_OP_TYPE_PEER,
+		.process_work = peer_get_obj_digest,
+	},
+
 	[SD_OP_WRITE_PEER] = {
 		.name = "WRITE_PEER",
 		.type = SD_OP_TYPE_PEER,
@@ -1159,6 +1528,18 @@ static struct sd_op_template sd_ops[] = {
 		.process_work = peer_remove_obj,
 	},
 
+	[SD_OP_DISCARD_PEER] = {
+		.name = "DISCARD_PEER",
+		.type = SD_OP_TYPE_PEER,
+		.process_work = peer_discard_obj,
+	},
+
+	[SD_OP_REMOVE_PEERS] = {
+		.name = "REMOVE_PEERS",
+		.type = SD_OP_TYPE_PEER,
+		.process_work = peer_remove_objs,
+	},
+
 	[SD_OP_ENABLE_RECOVER] = {
 		.name = "ENABLE_RECOVER",
 		.type = SD_OP_TYPE_CLUSTER,
@@ -1170,6 +1551,12 @@ static struct sd_op_template sd_ops[] = {
 		.type = SD_OP_TYPE_CLUSTER,
 		.process_main = cluster_disable_recover,
 	},
+
+	[SD_OP_SET_RECOVERY] = {
+		.name = "SET_RECOVERY",
+		.type = SD_OP_TYPE_CLUSTER,
+		.process_main = cluster_set_recovery,
+	},
 };
 
 const struct sd_op_template *get_sd_op(uint8_t opcode)
@@ -1210,6 +1597,11 @@ bool is_force_op(const struct sd_op_template *op)
 	return !!op->force;
 }
 
+bool is_vectored_op(const struct sd_op_template *op)
+{
+	return !!op->vectored;
+}
+
 bool has_process_work(const struct sd_op_template *op)
 {
 	return !!op->process_work;
@@ -1228,8 +1620,12 @@ void do_process_work(struct work *work)
 	sd_dprintf("%x, %" PRIx64", %"PRIu32, req->rq.opcode, req->rq.obj.oid,
 		   req->rq.epoch);
 
+	trace_req_stage(req, SD_REQ_STAGE_WORKER);
 	if (req->op->process_work)
 		ret = req->op->process_work(req);
+	/* the gateways stamp their local I/O on their own */
+	if (!is_gateway_op(req->op))
+		trace_req_stage(req, SD_REQ_STAGE_LOCAL_IO);
 
 	if (ret != SD_RES_SUCCESS) {
 		sd_dprintf("failed: %x, %" PRIx64" , %u, %"PRIx32,
@@ -1255,6 +1651,7 @@ static int map_table[] = {
 	[SD_OP_READ_OBJ] = SD_OP_READ_PEER,
 	[SD_OP_WRITE_OBJ] = SD_OP_WRITE_PEER,
 	[SD_OP_REMOVE_OBJ] = SD_OP_REMOVE_PEER,
+	[SD_OP_DISCARD_OBJ] = SD_OP_DISCARD_PEER,
 };
 
 int gateway_to_peer_opcode(int opcode)
@@ -10,13 +10,19 @@
  */
 #include <errno.h>
 #include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include <libgen.h>
+#include <time.h>
+#include <sys/xattr.h>
+#include <linux/falloc.h>
 
 #include "sheep_priv.h"
 #include "config.h"
+#include "crc32c.h"
 
 static int get_open_flags(uint64_t oid, bool create, int fl)
 {
@@ -52,6 +58,43 @@ static int get_stale_obj_path(uint64_t oid, uint32_t epoch, char *path)
 	return md_get_stale_path(oid, epoch, path);
 }
 
+/*
+ * The epochs which the stale directories have copies of, in ascending order,
+ * so that looking for a stale copy doesn't probe every past epoch.  It may
+ * hold epochs whose copies are gone, but never misses one.
+ */
+static pthread_mutex_t stale_epochs_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint32_t *stale_epochs;
+static int nr_stale_epochs;
+
+static void add_stale_epoch(uint32_t epoch)
+{
+	int i;
+
+	pthread_mutex_lock(&stale_epochs_lock);
+	for (i = 0; i < nr_stale_epochs; i++)
+		if (stale_epochs[i] >= epoch)
+			break;
+	if (i == nr_stale_epochs || stale_epochs[i] != epoch) {
+		stale_epochs = xrealloc(stale_epochs, (nr_stale_epochs + 1) *
+					sizeof(*stale_epochs));
+		memmove(stale_epochs + i + 1, stale_epochs + i,
+			(nr_stale_epochs - i) * sizeof(*stale_epochs));
+		stale_epochs[i] = epoch;
+		nr_stale_epochs++;
+	}
+	pthread_mutex_unlock(&stale_epochs_lock);
+}
+
+static void clear_stale_epochs(void)
+{
+	pthread_mutex_lock(&stale_epochs_lock);
+	free(stale_epochs);
+	stale_epochs = NULL;
+	nr_stale_epochs = 0;
+	pthread_mutex_unlock(&stale_epochs_lock);
+}
+
 bool default_exist(uint64_t oid)
 {
 	return md_exist(oid);
@@ -81,11 +124,733 @@ static int err_to_sderr(char *path, uint64_t oid, int err)
 	}
 }
 
+/* Deallocate the range so that it reads back as zeros */
+int punch_hole(int fd, uint64_t offset, uint32_t len)
+{
+	static char zero[SD_SPARSE_BLOCK_SIZE * 16]
+		__attribute__((aligned(SD_SPARSE_BLOCK_SIZE)));
+	uint32_t n;
+
+	if (!len)
+		return 0;
+
+	if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+		      offset, len) == 0)
+		return 0;
+	if (errno != EOPNOTSUPP && errno != ENOSYS)
+		return -1;
+
+	/* no hole punching on this filesystem, write zeros instead */
+	while (len) {
+		n = min(len, (uint32_t)sizeof(zero));
+		if (obj_pwrite(fd, zero, n, offset) != n)
+			return -1;
+		offset += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+static int write_run(int fd, const char *p, uint32_t len, uint64_t offset,
+		     bool zero, bool new_file)
+{
+	if (!zero)
+		return obj_pwrite(fd, p, len, offset) == len ? 0 : -1;
+	if (new_file)
+		return 0;
+	return punch_hole(fd, offset, len);
+}
+
+/*
+ * Write the buffer, but punch out the whole blocks which are all zeros
+ * instead of writing them.  The zero blocks of a new file are already holes,
+ * so they are simply skipped.
+ */
+static ssize_t sparse_pwrite(int fd, const void *buf, uint32_t len,
+			     uint64_t offset, bool new_file)
+{
+	const char *p = buf;
+	uint32_t done, start = 0, n;
+	bool zero, run_zero = false;
+
+	for (done = 0; done < len; done += n) {
+		/* the partial blocks at the edges are always written */
+		n = min(len - done, SD_SPARSE_BLOCK_SIZE -
+			(uint32_t)((offset + done) % SD_SPARSE_BLOCK_SIZE));
+		zero = n == SD_SPARSE_BLOCK_SIZE && is_zero_buf(p + done, n);
+		if (done && zero != run_zero) {
+			if (write_run(fd, p + start, done - start,
+				      offset + start, run_zero, new_file) < 0)
+				return -1;
+			start = done;
+		}
+		run_zero = zero;
+	}
+
+	if (len && write_run(fd, p + start, len - start, offset + start,
+			     run_zero, new_file) < 0)
+		return -1;
+
+	return len;
+}
+
+static inline ssize_t write_obj_data(int fd, const void *buf, uint32_t len,
+				     uint64_t offset, bool new_file)
+{
+	if (sys->sparse)
+		return sparse_pwrite(fd, buf, len, offset, new_file);
+	return obj_pwrite(fd, buf, len, offset);
+}
+
+/*
+ * Compressed objects
+ *
+ * The data objects of the VDIs with SD_COPY_POLICY_COMPRESS are compressed
+ * once they haven't been written for sys->compress_age seconds.  The file of
+ * a compressed object holds its image, padded to SD_SPARSE_BLOCK_SIZE for
+ * direct I/O, and so is shorter than the object, which tells it from a plain
+ * one.  It is never modified in place; a write expands it back to the plain
+ * file first, to be compressed again when it gets cold.
+ *
+ * Both replace the object file with rename(), under the lock of the object
+ * held for write.  Writers hold it for read from getting the fd to the end
+ * of the write, so that no write gets lost in a file being replaced.
+ * Readers need no lock because the replaced file keeps the same data.
+ * md takes it for write as well while it moves the object between disks, so
+ * md_exist() must not be called with it held.
+ */
+#define OBJ_LOCKS 256
+/* to remember the mtime of the object found not worth compressing */
+#define ZOBJ_SKIP_NAME "user.sheepdog.zskip"
+
+static pthread_rwlock_t obj_locks[OBJ_LOCKS] = {
+	[0 ... OBJ_LOCKS - 1] = PTHREAD_RWLOCK_INITIALIZER,
+};
+
+static inline pthread_rwlock_t *oid_to_obj_lock(uint64_t oid)
+{
+	return obj_locks +
+		fnv_64a_buf(&oid, sizeof(oid), FNV1A_64_INIT) % OBJ_LOCKS;
+}
+
+void lock_object_file(uint64_t oid)
+{
+	pthread_rwlock_wrlock(oid_to_obj_lock(oid));
+}
+
+void unlock_object_file(uint64_t oid)
+{
+	pthread_rwlock_unlock(oid_to_obj_lock(oid));
+}
+
+/* Move the object to its owner if it is still on another disk */
+static inline void md_move_object(uint64_t oid, const char *path)
+{
+	if (sys->enable_md && access(path, F_OK) < 0 && errno == ENOENT)
+		md_exist(oid);
+}
+
+static inline bool is_compressed(uint64_t oid, uint64_t size)
+{
+	return is_data_obj(oid) && size < get_store_objsize(oid);
+}
+
+/*
+ * A node keeps the strip of an erasure coded object it had at its old position
+ * until recovery replaces it, so the index of the strip is kept with the file
+ * and checked by every request for a given one.
+ */
+#define EC_INDEX_NAME "user.sheepdog.ec_index"
+
+static int check_ec_index(int fd, uint64_t oid, const struct siocb *iocb)
+{
+	uint8_t idx;
+
+	if (!iocb->ec_index)
+		return SD_RES_SUCCESS;
+
+	if (fgetxattr(fd, EC_INDEX_NAME, &idx, sizeof(idx)) != sizeof(idx) ||
+	    idx != iocb->ec_index) {
+		sd_dprintf("%"PRIx64" doesn't have strip %d", oid,
+			   iocb->ec_index - 1);
+		return SD_RES_NO_OBJ;
+	}
+
+	return SD_RES_SUCCESS;
+}
+
+static int get_zobj_tmp_path(uint64_t oid, char *path)
+{
+	return snprintf(path, PATH_MAX, "%s/" ZOBJ_TMP_PREFIX "%016"PRIx64,
+			get_object_path(oid), oid);
+}
+
+/*
+ * Write buf to tmp_path and rename it to the object file, if
+ * keep(oid, path, arg) still says so with the lock of the object held.
+ */
+static int replace_object(uint64_t oid, const char *tmp_path, const void *buf,
+			  uint32_t len, bool (*keep)(const char *, void *),
+			  void *arg)
+{
+	pthread_rwlock_t *lock = oid_to_obj_lock(oid);
+	int flags = get_open_flags(oid, true, 0) & ~O_EXCL, fd, ret;
+	char path[PATH_MAX];
+
+	get_obj_path(oid, path);
+	fd = open(tmp_path, flags | O_TRUNC, def_fmode);
+	if (fd < 0) {
+		sd_eprintf("failed to open %s, %m", tmp_path);
+		return err_to_sderr(path, oid, errno);
+	}
+	if (obj_pwrite(fd, buf, len, 0) != len ||
+	    (!sys->nosync && fdatasync(fd) < 0)) {
+		sd_eprintf("failed to write %s, %m", tmp_path);
+		ret = err_to_sderr(path, oid, errno);
+		goto out;
+	}
+
+	if (keep)
+		pthread_rwlock_wrlock(lock);
+	if (keep && !keep(path, arg)) {
+		ret = SD_RES_SUCCESS;
+		goto out_unlock;
+	}
+	if (rename(tmp_path, path) < 0) {
+		sd_eprintf("failed to rename %s to %s, %m", tmp_path, path);
+		ret = err_to_sderr(path, oid, errno);
+		goto out_unlock;
+	}
+	fd_cache_invalidate(oid);
+	ret = SD_RES_SUCCESS;
+out_unlock:
+	if (keep)
+		pthread_rwlock_unlock(lock);
+out:
+	close(fd);
+	unlink(tmp_path);
+	return ret;
+}
+
+/* Replace the compressed object with the plain one */
+static int expand_object(uint64_t oid)
+{
+	pthread_rwlock_t *lock = oid_to_obj_lock(oid);
+	char path[PATH_MAX], tmp_path[PATH_MAX];
+	uint32_t len = get_objsize(oid);
+	void *img = NULL, *buf = NULL;
+	struct stat st;
+	int fd, ret;
+
+	get_obj_path(oid, path);
+	get_zobj_tmp_path(oid, tmp_path);
+
+	md_move_object(oid, path);
+	pthread_rwlock_wrlock(lock);
+	fd = open(path, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		ret = err_to_sderr(path, oid, errno);
+		goto out;
+	}
+	/* somebody else has expanded it meanwhile */
+	if (!is_compressed(oid, st.st_size)) {
+		ret = SD_RES_SUCCESS;
+		goto out;
+	}
+
+	img = xmalloc(st.st_size);
+	buf = valloc(len);
+	if (!buf) {
+		ret = SD_RES_NO_MEM;
+		goto out;
+	}
+	if (xpread(fd, img, st.st_size, 0) != st.st_size) {
+		sd_eprintf("failed to read %s, %m", path);
+		ret = err_to_sderr(path, oid, errno);
+		goto out;
+	}
+	if (!zobj_valid(img, st.st_size, len) || zobj_decompress(img, buf) < 0) {
+		sd_eprintf("corrupted compressed object %"PRIx64, oid);
+		ret = SD_RES_EIO;
+		goto out;
+	}
+
+	ret = replace_object(oid, tmp_path, buf, len, NULL, NULL);
+	sd_dprintf("%"PRIx64", %s", oid, sd_strerror(ret));
+out:
+	pthread_rwlock_unlock(lock);
+	if (fd >= 0)
+		close(fd);
+	free(img);
+	free(buf);
+	return ret;
+}
+
+/* The object file must be the very one we have looked at */
+static bool same_object_file(const char *path, void *arg)
+{
+	const struct stat *orig = arg;
+	struct stat st;
+
+	return stat(path, &st) == 0 && st.st_ino == orig->st_ino &&
+		st.st_size == orig->st_size &&
+		st.st_mtim.tv_sec == orig->st_mtim.tv_sec &&
+		st.st_mtim.tv_nsec == orig->st_mtim.tv_nsec;
+}
+
+/*
+ * The deduplicator replaces the identical cold objects of a disk with hard
+ * links to a single file in .dedup/ of the disk, which has one link more than
+ * the objects sharing it and is removed once it is the last one.  The path of
+ * that file is kept in the DEDUP_NAME xattr, and the objects are made private
+ * again before they are modified.
+ */
+#define DEDUP_NAME "user.sheepdog.dedup"
+
+/* Return true if the file at path holds exactly len bytes of data */
+static bool same_file_data(const char *path, const void *data, size_t len,
+			   void *buf)
+{
+	bool same;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return false;
+	same = xpread(fd, buf, len, 0) == len && memcmp(buf, data, len) == 0;
+	posix_fadvise(fd, 0, len, POSIX_FADV_DONTNEED);
+	close(fd);
+	return same;
+}
+
+/*
+ * Make the object file at path the one at dedup_path if it exists, or its
+ * first link otherwise, unless the object has changed since st was taken.
+ * data is what the caller hashed, which both files are compared with under
+ * the lock, since a write landing in the same mtime tick as the hashing
+ * isn't seen by st.
+ */
+int share_object(uint64_t oid, const char *path, const struct stat *st,
+		 const char *dedup_path, const void *data)
+{
+	pthread_rwlock_t *lock = oid_to_obj_lock(oid);
+	char tmp_path[PATH_MAX];
+	struct stat dst;
+	void *buf;
+	int ret = SD_RES_SUCCESS;
+
+	buf = valloc(max(st->st_size, (off_t)1));
+	if (!buf)
+		return SD_RES_NO_MEM;
+
+	pthread_rwlock_wrlock(lock);
+	if (!same_object_file(path, (void *)st) ||
+	    !same_file_data(path, data, st->st_size, buf)) {
+		ret = SD_RES_AGAIN;
+		goto out;
+	}
+
+	if (stat(dedup_path, &dst) == 0) {
+		if (dst.st_size != st->st_size ||
+		    !same_file_data(dedup_path, data, st->st_size, buf)) {
+			sd_eprintf("%s doesn't match %s", dedup_path, path);
+			ret = SD_RES_EIO;
+			goto out;
+		}
+		get_zobj_tmp_path(oid, tmp_path);
+		unlink(tmp_path);
+		if (link(dedup_path, tmp_path) < 0) {
+			/* removed meanwhile by the last object sharing it */
+			if (errno != ENOENT) {
+				sd_eprintf("failed to link %s, %m", dedup_path);
+				ret = SD_RES_EIO;
+			}
+			goto out;
+		}
+		if (rename(tmp_path, path) < 0) {
+			sd_eprintf("failed to rename %s to %s, %m", tmp_path,
+				   path);
+			unlink(tmp_path);
+			ret = SD_RES_EIO;
+			goto out;
+		}
+	} else if (setxattr(path, DEDUP_NAME, dedup_path, strlen(dedup_path),
+			    0) < 0 || link(path, dedup_path) < 0) {
+		sd_eprintf("failed to link %s to %s, %m", path, dedup_path);
+		ret = SD_RES_EIO;
+		goto out;
+	}
+	fd_cache_invalidate(oid);
+out:
+	pthread_rwlock_unlock(lock);
+	free(buf);
+	return ret;
+}
+
+/* Make the object private, by copying it unless only .dedup/ shares it */
+static int unshare_object(uint64_t oid)
+{
+	pthread_rwlock_t *lock = oid_to_obj_lock(oid);
+	char path[PATH_MAX], tmp_path[PATH_MAX], dedup_path[PATH_MAX];
+	struct stat st, dst;
+	void *buf = NULL;
+	ssize_t len;
+	int fd, ret;
+
+	get_obj_path(oid, path);
+	get_zobj_tmp_path(oid, tmp_path);
+
+	md_move_object(oid, path);
+	pthread_rwlock_wrlock(lock);
+	fd = open(path, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		ret = err_to_sderr(path, oid, errno);
+		goto out;
+	}
+	ret = SD_RES_SUCCESS;
+	if (st.st_nlink == 1)
+		goto out_private;
+
+	/* made private meanwhile */
+	len = fgetxattr(fd, DEDUP_NAME, dedup_path, sizeof(dedup_path) - 1);
+	if (len <= 0)
+		goto out;
+	if (st.st_nlink == 2) {
+		dedup_path[len] = '\0';
+		if (stat(dedup_path, &dst) == 0 && dst.st_ino == st.st_ino &&
+		    unlink(dedup_path) == 0 && fstat(fd, &st) == 0 &&
+		    st.st_nlink == 1)
+			goto out_private;
+	}
+
+	buf = valloc(max(st.st_size, (off_t)1));
+	if (!buf) {
+		ret = SD_RES_NO_MEM;
+		goto out;
+	}
+	if (xpread(fd, buf, st.st_size, 0) != st.st_size) {
+		sd_eprintf("failed to read %s, %m", path);
+		ret = err_to_sderr(path, oid, errno);
+		goto out;
+	}
+	ret = replace_object(oid, tmp_path, buf, st.st_size, NULL, NULL);
+	sd_dprintf("copied %"PRIx64", %s", oid, sd_strerror(ret));
+	goto out;
+out_private:
+	fremovexattr(fd, DEDUP_NAME);
+	fd_cache_invalidate(oid);
+out:
+	pthread_rwlock_unlock(lock);
+	if (fd >= 0)
+		close(fd);
+	free(buf);
+	return ret;
+}
+
+/*
+ * Make the object private if it is shared, for the journal replay that writes
+ * the object file behind the back of the store
+ */
+int make_object_private(uint64_t oid)
+{
+	char path[PATH_MAX];
+	struct stat st;
+
+	get_obj_path(oid, path);
+	if (stat(path, &st) < 0 || st.st_nlink == 1)
+		return SD_RES_SUCCESS;
+
+	return unshare_object(oid);
+}
+
+/* The other links of the object may be its stale copies made by recovery */
+static inline bool is_shared(const struct obj_fd *ofd)
+{
+	return ofd->nlink > 1 && fgetxattr(ofd->fd, DEDUP_NAME, NULL, 0) > 0;
+}
+
+/*
+ * Get the fd of the object to modify it, which is expanded first if it is
+ * compressed and made private if it is shared.  The lock of the object is held
+ * for read until put_plain_obj_fd().
+ */
+static int get_plain_obj_fd(uint64_t oid, int flags, struct obj_fd **ofd)
+{
+	pthread_rwlock_t *lock = oid_to_obj_lock(oid);
+	char path[PATH_MAX];
+	bool compressed, moved = false;
+	int ret;
+
+	for (;;) {
+		pthread_rwlock_rdlock(lock);
+		*ofd = fd_cache_get(oid, flags);
+		if (!*ofd) {
+			get_obj_path(oid, path);
+			*ofd = fd_cache_open(oid, path, flags);
+		}
+		if (!*ofd) {
+			ret = err_to_sderr(path, oid, errno);
+			pthread_rwlock_unlock(lock);
+			/* Found on another disk and moved to its owner */
+			if (ret == SD_RES_NO_OBJ && !moved && sys->enable_md &&
+			    md_exist(oid)) {
+				moved = true;
+				continue;
+			}
+			return ret;
+		}
+		compressed = is_compressed(oid, (*ofd)->size);
+		if (!compressed && !is_shared(*ofd))
+			return SD_RES_SUCCESS;
+
+		fd_cache_put(*ofd);
+		pthread_rwlock_unlock(lock);
+		if (compressed)
+			ret = expand_object(oid);
+		else
+			ret = unshare_object(oid);
+		if (ret != SD_RES_SUCCESS)
+			return ret;
+	}
+}
+
+static void put_plain_obj_fd(uint64_t oid, struct obj_fd *ofd)
+{
+	fd_cache_put(ofd);
+	pthread_rwlock_unlock(oid_to_obj_lock(oid));
+}
+
+/* The chunks of a compressed object covering a range */
+struct zobj_range {
+	struct sd_zobj_header hdr;
+	int first, last;
+	void *buf;
+	/* the data of the chunk 'first' in buf */
+	char *data;
+};
+
+static int read_zobj_range(uint64_t oid, int fd, uint64_t size,
+			   uint64_t offset, uint32_t len, struct zobj_range *zr)
+{
+	uint32_t hlen = roundup(sizeof(zr->hdr), SD_SPARSE_BLOCK_SIZE);
+	uint32_t start, end, astart, aend;
+	char path[PATH_MAX];
+	ssize_t n;
+
+	zr->buf = valloc(hlen);
+	if (!zr->buf)
+		return SD_RES_NO_MEM;
+	n = size < hlen ? 0 : obj_pread(fd, zr->buf, hlen, 0);
+	if (n != hlen)
+		goto err;
+	memcpy(&zr->hdr, zr->buf, sizeof(zr->hdr));
+	free(zr->buf);
+	zr->buf = NULL;
+
+	if (!zobj_valid(&zr->hdr, size, get_objsize(oid)) || !len ||
+	    offset + len > zr->hdr.length) {
+		sd_eprintf("corrupted compressed object %"PRIx64
+			   " or invalid range %"PRIu64", %"PRIu32, oid, offset,
+			   len);
+		return SD_RES_EIO;
+	}
+	zr->first = offset / SD_ZCHUNK_SIZE;
+	zr->last = (offset + len - 1) / SD_ZCHUNK_SIZE;
+
+	/* the image is padded, so the aligned range is still in the file */
+	start = zobj_chunk_offset(&zr->hdr, zr->first);
+	end = zobj_chunk_offset(&zr->hdr, zr->last + 1);
+	astart = start - start % SD_SPARSE_BLOCK_SIZE;
+	aend = roundup(end, SD_SPARSE_BLOCK_SIZE);
+	zr->buf = valloc(max(aend - astart, (uint32_t)SD_SPARSE_BLOCK_SIZE));
+	if (!zr->buf)
+		return SD_RES_NO_MEM;
+	zr->data = (char *)zr->buf + start - astart;
+	if (aend > astart) {
+		n = obj_pread(fd, zr->buf, aend - astart, astart);
+		if (n != aend - astart)
+			goto err;
+	}
+
+	return SD_RES_SUCCESS;
+err:
+	if (n >= 0)
+		errno = EIO;
+	free(zr->buf);
+	get_obj_path(oid, path);
+	sd_eprintf("failed to read compressed object %"PRIx64", %m", oid);
+	return err_to_sderr(path, oid, errno);
+}
+
+static int read_compressed(uint64_t oid, int fd, uint64_t size,
+			   const struct siocb *iocb)
+{
+	uint64_t off = iocb->offset, end = iocb->offset + iocb->length, cstart;
+	char *src, *dst = iocb->buf, *chunk = NULL;
+	struct zobj_range zr;
+	uint32_t clen, s, n;
+	int i, ret;
+
+	if (!iocb->length)
+		return SD_RES_SUCCESS;
+
+	ret = read_zobj_range(oid, fd, size, off, iocb->length, &zr);
+	if (ret != SD_RES_SUCCESS)
+		return ret;
+
+	src = zr.data;
+	for (i = zr.first; i <= zr.last; i++) {
+		cstart = (uint64_t)i * SD_ZCHUNK_SIZE;
+		clen = min((uint64_t)SD_ZCHUNK_SIZE, zr.hdr.length - cstart);
+		s = max(off, cstart) - cstart;
+		n = min(end, cstart + clen) - cstart - s;
+		if (n == clen) {
+			ret = zobj_decompress_chunk(&zr.hdr, i, src, dst);
+		} else {
+			if (!chunk)
+				chunk = xmalloc(SD_ZCHUNK_SIZE);
+			ret = zobj_decompress_chunk(&zr.hdr, i, src, chunk);
+			memcpy(dst, chunk + s, n);
+		}
+		if (ret < 0) {
+			sd_eprintf("corrupted compressed object %"PRIx64, oid);
+			ret = SD_RES_EIO;
+			goto out;
+		}
+		src += zr.hdr.chunk_len[i];
+		dst += n;
+	}
+	ret = SD_RES_SUCCESS;
+out:
+	free(chunk);
+	free(zr.buf);
+	return ret;
+}
+
+int default_read_compressed(uint64_t oid, const struct siocb *iocb,
+			    uint32_t *len)
+{
+	int flags = get_open_flags(oid, false, iocb->flags), ret;
+	struct sd_zobj_header sub;
+	struct zobj_range zr;
+	char path[PATH_MAX];
+	struct obj_fd *ofd;
+	uint32_t dlen;
+
+	*len = 0;
+	ofd = fd_cache_get(oid, flags);
+	if (!ofd) {
+		get_obj_path(oid, path);
+		ofd = fd_cache_open(oid, path, flags);
+		if (!ofd)
+			/* let the plain read find it */
+			return SD_RES_SUCCESS;
+	}
+
+	ret = SD_RES_SUCCESS;
+	if (!is_compressed(oid, ofd->size))
+		goto out;
+	ret = read_zobj_range(oid, ofd->fd, ofd->size, iocb->offset,
+			      iocb->length, &zr);
+	if (ret != SD_RES_SUCCESS)
+		goto out;
+
+	if (zobj_sub_header(&zr.hdr, iocb->offset, iocb->length, &sub) == 0) {
+		dlen = zobj_chunk_offset(&sub, sub.nr_chunks) - sizeof(sub);
+		if (sizeof(sub) + dlen < iocb->length) {
+			memcpy(iocb->buf, &sub, sizeof(sub));
+			memcpy((char *)iocb->buf + sizeof(sub), zr.data, dlen);
+			*len = sizeof(sub) + dlen;
+		}
+	}
+	free(zr.buf);
+out:
+	fd_cache_put(ofd);
+	return ret;
+}
+
+struct compress_arg {
+	time_t now;
+	void *buf;
+	void *img;
+};
+
+static int compress_cold_object(uint64_t oid, char *wd, void *arg)
+{
+	struct compress_arg *ca = arg;
+	char path[PATH_MAX], tmp_path[PATH_MAX];
+	uint32_t len = get_objsize(oid);
+	uint16_t policy = get_vdi_copy_policy(oid_to_vid(oid));
+	uint64_t skip;
+	struct stat st;
+	int fd, zlen;
+
+	/* the strips of erasure coded objects hardly compress */
+	if (!is_data_obj(oid) || !(policy & SD_COPY_POLICY_COMPRESS) ||
+	    (policy & SD_COPY_POLICY_EC_MASK))
+		return SD_RES_SUCCESS;
+
+	snprintf(path, sizeof(path), "%s/%016"PRIx64, wd, oid);
+	if (stat(path, &st) < 0 || is_compressed(oid, st.st_size) ||
+	    st.st_mtime + sys->compress_age > ca->now)
+		return SD_RES_SUCCESS;
+	if (getxattr(path, ZOBJ_SKIP_NAME, &skip, sizeof(skip)) ==
+	    sizeof(skip) && skip == st.st_mtime)
+		return SD_RES_SUCCESS;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return SD_RES_SUCCESS;
+	if (xpread(fd, ca->buf, len, 0) != len) {
+		sd_eprintf("failed to read %s, %m", path);
+		close(fd);
+		return SD_RES_SUCCESS;
+	}
+	/* don't make the reads of the rest suffer from this scan */
+	posix_fadvise(fd, 0, len, POSIX_FADV_DONTNEED);
+	close(fd);
+
+	/* not worth the inflating on read unless it saves an eighth */
+	zlen = zobj_compress(ca->buf, len, ca->img, len - len / 8);
+	if (zlen <= 0) {
+		skip = st.st_mtime;
+		setxattr(path, ZOBJ_SKIP_NAME, &skip, sizeof(skip), 0);
+		return SD_RES_SUCCESS;
+	}
+	memset((char *)ca->img + zlen, 0,
+	       roundup(zlen, SD_SPARSE_BLOCK_SIZE) - zlen);
+
+	get_zobj_tmp_path(oid, tmp_path);
+	if (replace_object(oid, tmp_path, ca->img,
+			   roundup(zlen, SD_SPARSE_BLOCK_SIZE),
+			   same_object_file, &st) == SD_RES_SUCCESS)
+		sd_dprintf("compressed %"PRIx64" to %d bytes", oid, zlen);
+
+	return SD_RES_SUCCESS;
+}
+
+int default_compress(void)
+{
+	struct compress_arg ca;
+	int ret = SD_RES_NO_MEM;
+
+	ca.now = time(NULL);
+	ca.buf = valloc(SD_DATA_OBJ_SIZE);
+	ca.img = valloc(SD_DATA_OBJ_SIZE);
+	if (ca.buf && ca.img)
+		ret = for_each_object_in_wd(compress_cold_object, false, &ca);
+
+	free(ca.buf);
+	free(ca.img);
+	return ret;
+}
+
 int default_write(uint64_t oid, const struct siocb *iocb)
 {
-	int flags = get_open_flags(oid, false, iocb->flags), fd,
-	    ret = SD_RES_SUCCESS;
+	int flags = get_open_flags(oid, false, iocb->flags), ret;
 	char path[PATH_MAX];
+	struct obj_fd *ofd;
 	ssize_t size;
 
 	if (iocb->epoch < sys_epoch()) {
@@ -93,8 +858,14 @@ int default_write(uint64_t oid, const struct siocb *iocb)
 		return SD_RES_OLD_NODE_VER;
 	}
 
-	get_obj_path(oid, path);
+	ret = get_plain_obj_fd(oid, flags, &ofd);
+	if (ret != SD_RES_SUCCESS)
+		return ret;
+	ret = check_ec_index(ofd->fd, oid, iocb);
+	if (ret != SD_RES_SUCCESS)
+		goto out;
 
+	/* journaled after the expansion, the replay writes a plain file */
 	if (uatomic_is_true(&sys->use_journal) &&
 	    journal_file_write(oid, iocb->buf, iocb->length, iocb->offset,
 			       false)
@@ -103,14 +874,16 @@ int default_write(uint64_t oid, const struct siocb *iocb)
 		uatomic_set_false(&sys->use_journal);
 		flags |= O_DSYNC;
 		sync();
+		put_plain_obj_fd(oid, ofd);
+		ret = get_plain_obj_fd(oid, flags, &ofd);
+		if (ret != SD_RES_SUCCESS)
+			return ret;
 	}
 
-	fd = open(path, flags, def_fmode);
-	if (fd < 0)
-		return err_to_sderr(path, oid, errno);
-
-	size = xpwrite(fd, iocb->buf, iocb->length, iocb->offset);
+	size = write_obj_data(ofd->fd, iocb->buf, iocb->length, iocb->offset,
+			      false);
 	if (size != iocb->length) {
+		get_obj_path(oid, path);
 		sd_eprintf("failed to write object %"PRIx64", path=%s, offset=%"
 			PRId64", size=%"PRId32", result=%zd, %m", oid, path,
 			iocb->offset, iocb->length, size);
@@ -118,19 +891,35 @@ int default_write(uint64_t oid, const struct siocb *iocb)
 		goto out;
 	}
 out:
-	close(fd);
+	put_plain_obj_fd(oid, ofd);
 	return ret;
 }
 
 static int make_stale_dir(char *path)
 {
 	char p[PATH_MAX];
+	struct dirent *d;
+	uint64_t oid;
+	uint32_t epoch;
+	DIR *dir;
 
 	snprintf(p, PATH_MAX, "%s/.stale", path);
 	if (xmkdir(p, def_dmode) < 0) {
 		sd_eprintf("%s failed, %m", p);
 		return SD_RES_EIO;
 	}
+
+	/* pick up the epochs of the copies left by the last run */
+	dir = opendir(p);
+	if (!dir) {
+		sd_eprintf("failed to open %s, %m", p);
+		return SD_RES_EIO;
+	}
+	while ((d = readdir(dir)))
+		if (sscanf(d->d_name, "%"SCNx64".%"SCNu32, &oid, &epoch) == 2)
+			add_stale_epoch(epoch);
+	closedir(dir);
+
 	return SD_RES_SUCCESS;
 }
 
@@ -155,6 +944,7 @@ int default_cleanup(void)
 	int ret;
 
 	ret = for_each_obj_path(purge_stale_dir);
+	clear_stale_epochs();
 	if (ret != SD_RES_SUCCESS)
 		return ret;
 
@@ -165,7 +955,7 @@ static int init_vdi_copy_number(uint64_t oid, char *wd)
 {
 	char path[PATH_MAX];
 	int fd, flags = get_open_flags(oid, false, 0), ret;
-	struct sheepdog_inode *inode = xzalloc(sizeof(*inode));
+	struct sheepdog_inode *inode = xzalloc(SD_INODE_HEADER_SIZE);
 
 	snprintf(path, sizeof(path), "%s/%016"PRIx64, wd, oid);
 
@@ -176,14 +966,16 @@ static int init_vdi_copy_number(uint64_t oid, char *wd)
 		goto out;
 	}
 
-	ret = xpread(fd, inode, SD_INODE_HEADER_SIZE, 0);
+	ret = obj_pread(fd, inode, SD_INODE_HEADER_SIZE, 0);
+	close(fd);
 	if (ret != SD_INODE_HEADER_SIZE) {
 		sd_eprintf("failed to read inode header, path=%s, %m", path);
 		ret = SD_RES_EIO;
 		goto out;
 	}
 
-	add_vdi_copy_number(oid_to_vid(oid), inode->nr_copies);
+	add_vdi_copy_number(oid_to_vid(oid), inode->nr_copies,
+			    inode->copy_policy, inode->block_size_shift);
 
 	ret = SD_RES_SUCCESS;
 out:
@@ -191,6 +983,9 @@ out:
 	return SD_RES_SUCCESS;
 }
 
+/* The disks are scanned in parallel, so serialize the bitmap updates */
+static pthread_mutex_t vdi_inuse_lock = PTHREAD_MUTEX_INITIALIZER;
+
 static int init_objlist_and_vdi_bitmap(uint64_t oid, char *wd, void *arg)
 {
 	int ret;
@@ -198,7 +993,9 @@ static int init_objlist_and_vdi_bitmap(uint64_t oid, char *wd, void *arg)
 
 	if (is_vdi_obj(oid)) {
 		sd_dprintf("found the VDI object %" PRIx64, oid);
+		pthread_mutex_lock(&vdi_inuse_lock);
 		set_bit(oid_to_vid(oid), sys->vdi_inuse);
+		pthread_mutex_unlock(&vdi_inuse_lock);
 		ret = init_vdi_copy_number(oid, wd);
 		if (ret != SD_RES_SUCCESS)
 			return ret;
@@ -206,16 +1003,246 @@ static int init_objlist_and_vdi_bitmap(uint64_t oid, char *wd, void *arg)
 	return SD_RES_SUCCESS;
 }
 
+/*
+ * The object index saves the object list and the copy numbers of the local
+ * VDIs at clean shutdown, so that the next startup doesn't have to scan the
+ * object directories and read every inode.  It records the modification time
+ * of every object directory and is trusted only if none of them has changed
+ * since, and it is removed once loaded.
+ */
+#define OBJ_INDEX_PATH "/obj_index"
+#define OBJ_INDEX_MAGIC 0x5344494e
+#define OBJ_INDEX_VERSION 2
+
+struct obj_index_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t nr_paths;
+	uint32_t nr_vdis;
+	uint64_t nr_oids;
+	/* crc32c of everything after the header */
+	uint64_t checksum;
+};
+
+struct obj_index_path {
+	char path[PATH_MAX];
+	uint64_t mtime_sec;
+	uint64_t mtime_nsec;
+};
+
+static char *obj_index_path;
+/* objects being created, whose temporary files a scan would clean up */
+static int nr_creating;
+static struct obj_index_path *index_paths;
+static int nr_index_paths;
+
+int init_obj_index_path(const char *base_path)
+{
+	int len = strlen(base_path) + strlen(OBJ_INDEX_PATH) + 1;
+
+	obj_index_path = xzalloc(len);
+	snprintf(obj_index_path, len, "%s" OBJ_INDEX_PATH, base_path);
+
+	return 0;
+}
+
+static int stat_obj_path(char *path)
+{
+	struct obj_index_path *p;
+	struct stat st;
+
+	if (stat(path, &st) < 0) {
+		sd_eprintf("failed to stat %s, %m", path);
+		return SD_RES_EIO;
+	}
+
+	index_paths = xrealloc(index_paths,
+			       sizeof(*index_paths) * (nr_index_paths + 1));
+	p = index_paths + nr_index_paths++;
+	memset(p, 0, sizeof(*p));
+	pstrcpy(p->path, sizeof(p->path), path);
+	p->mtime_sec = st.st_mtim.tv_sec;
+	p->mtime_nsec = st.st_mtim.tv_nsec;
+
+	return SD_RES_SUCCESS;
+}
+
+static int stat_obj_paths(void)
+{
+	free(index_paths);
+	index_paths = NULL;
+	nr_index_paths = 0;
+
+	return for_each_obj_path(stat_obj_path);
+}
+
+int default_shutdown(void)
+{
+	struct obj_index_header hdr = {
+		.magic = OBJ_INDEX_MAGIC,
+		.version = OBJ_INDEX_VERSION,
+	};
+	struct vdi_copy *vdis = NULL;
+	uint64_t *oids = NULL;
+	uint32_t csum;
+	char tmp[PATH_MAX];
+	int fd, i, nr_oids, nr_vdis = 0, ret = SD_RES_EIO;
+
+	stop_recovery();
+	if (stat_obj_paths() != SD_RES_SUCCESS)
+		return SD_RES_EIO;
+	/* The directories are stated, so anything done later invalidates us */
+	if (uatomic_read(&nr_creating)) {
+		sd_dprintf("objects are being created, don't save the index");
+		return SD_RES_SUCCESS;
+	}
+
+	oids = objlist_cache_get_all(&nr_oids);
+	for (i = 0; i < nr_oids; i++) {
+		if (!is_vdi_obj(oids[i]))
+			continue;
+		vdis = xrealloc(vdis, sizeof(*vdis) * (nr_vdis + 1));
+		vdis[nr_vdis].vid = oid_to_vid(oids[i]);
+		vdis[nr_vdis].nr_copies = get_vdi_copy_number(vdis[nr_vdis].vid);
+		vdis[nr_vdis].copy_policy =
+			get_vdi_copy_policy(vdis[nr_vdis].vid);
+		vdis[nr_vdis].block_size_shift =
+			get_vdi_block_size_shift(vdis[nr_vdis].vid);
+		nr_vdis++;
+	}
+
+	hdr.nr_paths = nr_index_paths;
+	hdr.nr_oids = nr_oids;
+	hdr.nr_vdis = nr_vdis;
+	csum = crc32c(0, index_paths, sizeof(*index_paths) * nr_index_paths);
+	csum = crc32c(csum, oids, sizeof(*oids) * nr_oids);
+	hdr.checksum = crc32c(csum, vdis, sizeof(*vdis) * nr_vdis);
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", obj_index_path);
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, def_fmode);
+	if (fd < 0) {
+		sd_eprintf("failed to open %s, %m", tmp);
+		goto out;
+	}
+	if (xwrite(fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+	    xwrite(fd, index_paths, sizeof(*index_paths) * nr_index_paths) !=
+	    sizeof(*index_paths) * nr_index_paths ||
+	    xwrite(fd, oids, sizeof(*oids) * nr_oids) !=
+	    sizeof(*oids) * nr_oids ||
+	    xwrite(fd, vdis, sizeof(*vdis) * nr_vdis) !=
+	    sizeof(*vdis) * nr_vdis || fdatasync(fd) < 0) {
+		sd_eprintf("failed to write %s, %m", tmp);
+		close(fd);
+		unlink(tmp);
+		goto out;
+	}
+	close(fd);
+	if (rename(tmp, obj_index_path) < 0) {
+		sd_eprintf("failed to rename %s, %m", tmp);
+		unlink(tmp);
+		goto out;
+	}
+	sd_iprintf("saved the index of %d objects", nr_oids);
+	ret = SD_RES_SUCCESS;
+out:
+	free(oids);
+	free(vdis);
+	return ret;
+}
+
+static void *read_index_part(int fd, size_t len)
+{
+	void *buf = xmalloc(len ? len : 1);
+
+	if (xread(fd, buf, len) != len) {
+		free(buf);
+		return NULL;
+	}
+	return buf;
+}
+
+/* Return true if the index is loaded, false if the store must be scanned */
+static bool load_obj_index(void)
+{
+	struct obj_index_header hdr;
+	struct obj_index_path *paths = NULL;
+	struct vdi_copy *vdis = NULL;
+	uint64_t *oids = NULL;
+	uint32_t csum;
+	bool loaded = false;
+	int fd, i;
+
+	fd = open(obj_index_path, O_RDONLY);
+	if (fd < 0) {
+		if (errno != ENOENT)
+			sd_eprintf("failed to open %s, %m", obj_index_path);
+		return false;
+	}
+	/* Whatever happens, the index is stale from now on */
+	unlink(obj_index_path);
+
+	if (xread(fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+	    hdr.magic != OBJ_INDEX_MAGIC || hdr.version != OBJ_INDEX_VERSION) {
+		sd_eprintf("invalid object index");
+		goto out;
+	}
+
+	paths = read_index_part(fd, sizeof(*paths) * hdr.nr_paths);
+	oids = read_index_part(fd, sizeof(*oids) * hdr.nr_oids);
+	vdis = read_index_part(fd, sizeof(*vdis) * hdr.nr_vdis);
+	if (!paths || !oids || !vdis) {
+		sd_eprintf("failed to read the object index, %m");
+		goto out;
+	}
+
+	csum = crc32c(0, paths, sizeof(*paths) * hdr.nr_paths);
+	csum = crc32c(csum, oids, sizeof(*oids) * hdr.nr_oids);
+	csum = crc32c(csum, vdis, sizeof(*vdis) * hdr.nr_vdis);
+	if (csum != hdr.checksum) {
+		sd_eprintf("object index corrupted");
+		goto out;
+	}
+
+	if (stat_obj_paths() != SD_RES_SUCCESS ||
+	    nr_index_paths != hdr.nr_paths ||
+	    memcmp(paths, index_paths, sizeof(*paths) * hdr.nr_paths)) {
+		sd_iprintf("object directories changed, ignore the index");
+		goto out;
+	}
+
+	for (i = 0; i < hdr.nr_oids; i++)
+		objlist_cache_insert(oids[i]);
+	for (i = 0; i < hdr.nr_vdis; i++) {
+		set_bit(vdis[i].vid, sys->vdi_inuse);
+		add_vdi_copy_number(vdis[i].vid, vdis[i].nr_copies,
+				    vdis[i].copy_policy,
+				    vdis[i].block_size_shift);
+	}
+	sd_iprintf("loaded the index of %"PRIu64" objects", hdr.nr_oids);
+	loaded = true;
+out:
+	close(fd);
+	free(paths);
+	free(oids);
+	free(vdis);
+	return loaded;
+}
+
 int default_init(void)
 {
 	int ret;
 
 	sd_dprintf("use plain store driver");
+	fd_cache_init();
 	ret = for_each_obj_path(make_stale_dir);
 	if (ret != SD_RES_SUCCESS)
 		return ret;
 
-	return for_each_object_in_wd(init_objlist_and_vdi_bitmap, true, NULL);
+	if (load_obj_index())
+		return SD_RES_SUCCESS;
+
+	return for_each_object_in_wd_parallel(init_objlist_and_vdi_bitmap,
+					      true, NULL);
 }
 
 static int default_read_from_path(uint64_t oid, char *path,
@@ -223,6 +1250,7 @@ static int default_read_from_path(uint64_t oid, char *path,
 {
 	int flags = get_open_flags(oid, false, iocb->flags), fd,
 	    ret = SD_RES_SUCCESS;
+	struct stat st;
 	ssize_t size;
 
 	fd = open(path, flags);
@@ -230,27 +1258,79 @@ static int default_read_from_path(uint64_t oid, char *path,
 	if (fd < 0)
 		return err_to_sderr(path, oid, errno);
 
-	size = xpread(fd, iocb->buf, iocb->length, iocb->offset);
+	ret = check_ec_index(fd, oid, iocb);
+	if (ret != SD_RES_SUCCESS)
+		goto out;
+
+	if (fstat(fd, &st) == 0 && is_compressed(oid, st.st_size)) {
+		ret = read_compressed(oid, fd, st.st_size, iocb);
+		goto out;
+	}
+
+	size = obj_pread(fd, iocb->buf, iocb->length, iocb->offset);
 	if (size != iocb->length) {
 		sd_eprintf("failed to read object %"PRIx64", path=%s, offset=%"
 			PRId64", size=%"PRId32", result=%zd, %m", oid, path,
 			iocb->offset, iocb->length, size);
 		ret = err_to_sderr(path, oid, errno);
 	}
-
+out:
 	close(fd);
 
 	return ret;
 }
 
+/* Read the object at its current path through the fd cache */
+static int default_read_cached(uint64_t oid, const struct siocb *iocb)
+{
+	int flags = get_open_flags(oid, false, iocb->flags),
+	    ret = SD_RES_SUCCESS;
+	char path[PATH_MAX];
+	struct obj_fd *ofd;
+	ssize_t size;
+
+	ofd = fd_cache_get(oid, flags);
+	if (!ofd) {
+		get_obj_path(oid, path);
+		ofd = fd_cache_open(oid, path, flags);
+		if (!ofd)
+			return err_to_sderr(path, oid, errno);
+	}
+
+	ret = check_ec_index(ofd->fd, oid, iocb);
+	if (ret != SD_RES_SUCCESS)
+		goto out;
+
+	if (is_compressed(oid, ofd->size)) {
+		ret = read_compressed(oid, ofd->fd, ofd->size, iocb);
+		goto out;
+	}
+
+	size = obj_pread(ofd->fd, iocb->buf, iocb->length, iocb->offset);
+	if (size != iocb->length) {
+		get_obj_path(oid, path);
+		sd_eprintf("failed to read object %"PRIx64", path=%s, offset=%"
+			PRId64", size=%"PRId32", result=%zd, %m", oid, path,
+			iocb->offset, iocb->length, size);
+		ret = err_to_sderr(path, oid, errno);
+	}
+out:
+	fd_cache_put(ofd);
+
+	return ret;
+}
+
 int default_read(uint64_t oid, const struct siocb *iocb)
 {
 	int ret;
 	char path[PATH_MAX];
 	uint32_t epoch = sys_epoch();
 
-	get_obj_path(oid, path);
-	ret = default_read_from_path(oid, path, iocb);
+	ret = default_read_cached(oid, iocb);
+
+	/* The object might be on another disk, not yet moved by rebalancing */
+	if (ret == SD_RES_NO_OBJ && sys->enable_md && md_exist(oid))
+		ret = default_read_cached(oid, iocb);
 
 	/*
 	 * If the request is againt the older epoch, try to read from
@@ -265,6 +1345,30 @@ int default_read(uint64_t oid, const struct siocb *iocb)
 	return ret;
 }
 
+/* Read the latest stale copy of the object, looking only where one can be */
+int default_read_stale(uint64_t oid, const struct siocb *iocb)
+{
+	char path[PATH_MAX];
+	uint32_t *epochs, epoch = sys_epoch();
+	int i, nr, ret = SD_RES_NO_OBJ;
+
+	pthread_mutex_lock(&stale_epochs_lock);
+	nr = nr_stale_epochs;
+	epochs = xmalloc(nr * sizeof(*epochs));
+	memcpy(epochs, stale_epochs, nr * sizeof(*epochs));
+	pthread_mutex_unlock(&stale_epochs_lock);
+
+	for (i = nr - 1; i >= 0 && ret == SD_RES_NO_OBJ; i--) {
+		if (epochs[i] >= epoch)
+			continue;
+		get_stale_obj_path(oid, epochs[i], path);
+		ret = default_read_from_path(oid, path, iocb);
+	}
+
+	free(epochs);
+	return ret;
+}
+
 /* Preallocate the whole object to get a better filesystem layout. */
 int prealloc(int fd, uint32_t size)
 {
@@ -281,19 +1385,94 @@ int prealloc(int fd, uint32_t size)
 	return 0;
 }
 
-int default_create_and_write(uint64_t oid, const struct siocb *iocb)
+/*
+ * Get what to create the object with from the compressed image in iocb: the
+ * padded image, or the plain data if the padding makes it as long as the
+ * object.
+ */
+static void *prepare_image(uint64_t oid, const struct siocb *iocb,
+			   uint32_t *len, bool *compressed)
+{
+	uint32_t objsize = get_objsize(oid);
+	uint32_t plen = roundup(iocb->length, SD_SPARSE_BLOCK_SIZE);
+	void *buf;
+
+	if (!is_data_obj(oid) || !zobj_valid(iocb->buf, iocb->length, objsize)) {
+		sd_eprintf("invalid compressed image of %"PRIx64, oid);
+		return NULL;
+	}
+
+	*compressed = plen < objsize;
+	*len = *compressed ? plen : objsize;
+	buf = valloc(*len);
+	if (!buf)
+		return NULL;
+
+	if (*compressed) {
+		memcpy(buf, iocb->buf, iocb->length);
+		memset((char *)buf + iocb->length, 0, plen - iocb->length);
+	} else if (zobj_decompress(iocb->buf, buf) < 0) {
+		sd_eprintf("corrupted compressed image of %"PRIx64, oid);
+		free(buf);
+		return NULL;
+	}
+
+	return buf;
+}
+
+/*
+ * Move the other strip of the object at path to the stale directory, where
+ * the nodes which recover it from our old position look for it.
+ */
+static void stash_other_strip(uint64_t oid, const char *path,
+			      const struct siocb *iocb)
+{
+	char stale_path[PATH_MAX];
+	uint8_t idx;
+
+	if (getxattr(path, EC_INDEX_NAME, &idx, sizeof(idx)) != sizeof(idx) ||
+	    idx == iocb->ec_index || iocb->epoch <= 1)
+		return;
+
+	get_stale_obj_path(oid, iocb->epoch - 1, stale_path);
+	add_stale_epoch(iocb->epoch - 1);
+	if (rename(path, stale_path) < 0)
+		sd_eprintf("failed to move %s to %s, %m", path, stale_path);
+	else
+		sd_dprintf("moved strip %d of %"PRIx64" to %s", idx - 1, oid,
+			   stale_path);
+}
+
+static int create_and_write(uint64_t oid, const struct siocb *iocb)
 {
 	char path[PATH_MAX], tmp_path[PATH_MAX];
 	int flags = get_open_flags(oid, true, iocb->flags);
+	pthread_rwlock_t *lock = oid_to_obj_lock(oid);
 	int ret, fd;
 	uint32_t len = iocb->length;
+	uint64_t offset = iocb->offset;
+	const void *data = iocb->buf;
+	void *img = NULL;
+	bool compressed = false;
 
 	get_obj_path(oid, path);
 	get_tmp_obj_path(oid, tmp_path);
 
-	if (uatomic_is_true(&sys->use_journal) &&
-	    journal_file_write(oid, iocb->buf, iocb->length, iocb->offset, true)
-	    != SD_RES_SUCCESS) {
+	if (iocb->flags & SD_FLAG_CMD_COMPRESS) {
+		img = prepare_image(oid, iocb, &len, &compressed);
+		if (!img)
+			return SD_RES_EIO;
+		data = img;
+		offset = 0;
+	}
+
+	if (compressed || iocb->ec_index) {
+		/* the journal replays plain writes only, without the index */
+		if (uatomic_is_true(&sys->use_journal) && !sys->nosync)
+			flags |= O_DSYNC;
+	} else if (uatomic_is_true(&sys->use_journal) &&
+		   journal_file_write(oid, data, len, offset, true)
+		   != SD_RES_SUCCESS) {
 		sd_eprintf("turn off journaling");
 		uatomic_set_false(&sys->use_journal);
 		flags |= O_DSYNC;
@@ -311,43 +1490,102 @@ int default_create_and_write(uint64_t oid, const struct siocb *iocb)
 			 * so it is okay to simply return success here.
 			 */
 			sd_dprintf("%s exists", tmp_path);
+			free(img);
 			return SD_RES_SUCCESS;
 		}
 
 		sd_eprintf("failed to open %s: %m", tmp_path);
+		free(img);
 		return err_to_sderr(path, oid, errno);
 	}
 
-	if (iocb->offset != 0 || iocb->length != get_objsize(oid)) {
-		ret = prealloc(fd, get_objsize(oid));
-		if (ret < 0) {
-			ret = err_to_sderr(path, oid, errno);
-			goto out;
-		}
+	if (compressed)
+		ret = 0;
+	else if (sys->sparse)
+		ret = ftruncate(fd, get_store_objsize(oid));
+	else if (offset != 0 || len != get_store_objsize(oid))
+		ret = prealloc(fd, get_store_objsize(oid));
+	else
+		ret = 0;
+	if (ret == 0 && iocb->ec_index)
+		ret = fsetxattr(fd, EC_INDEX_NAME, &iocb->ec_index,
+				sizeof(iocb->ec_index), 0);
+	if (ret < 0) {
+		ret = err_to_sderr(path, oid, errno);
+		goto out;
 	}
 
-	ret = xpwrite(fd, iocb->buf, len, iocb->offset);
+	if (compressed)
+		ret = obj_pwrite(fd, data, len, 0);
+	else
+		ret = write_obj_data(fd, data, len, offset, true);
 	if (ret != len) {
 		sd_eprintf("failed to write object. %m");
 		ret = err_to_sderr(path, oid, errno);
 		goto out;
 	}
 
+	/* don't replace the file under the writers or the compressor */
+	pthread_rwlock_wrlock(lock);
+	if (iocb->ec_index)
+		stash_other_strip(oid, path, iocb);
 	ret = rename(tmp_path, path);
 	if (ret < 0) {
+		pthread_rwlock_unlock(lock);
 		sd_eprintf("failed to rename %s to %s: %m", tmp_path, path);
 		ret = err_to_sderr(path, oid, errno);
 		goto out;
 	}
-	sd_dprintf("%"PRIx64, oid);
+	/* Readers may still hold the file we have just replaced */
+	fd_cache_invalidate(oid);
+	pthread_rwlock_unlock(lock);
+	sd_dprintf("%"PRIx64"%s", oid, compressed ? ", compressed" : "");
 	ret = SD_RES_SUCCESS;
 out:
 	if (ret != SD_RES_SUCCESS)
 		unlink(tmp_path);
 	close(fd);
+	free(img);
+	return ret;
+}
+
+int default_create_and_write(uint64_t oid, const struct siocb *iocb)
+{
+	int ret;
+
+	uatomic_inc(&nr_creating);
+	ret = create_and_write(oid, iocb);
+	/*
+	 * The callers list the object as well, but only once it is no longer
+	 * counted, which would let the index be saved without it.
+	 */
+	if (ret == SD_RES_SUCCESS)
+		objlist_cache_insert(oid);
+	uatomic_dec(&nr_creating);
+
 	return ret;
 }
 
+int default_get_ec_index(uint64_t oid, uint8_t *ec_index)
+{
+	char path[PATH_MAX];
+	ssize_t ret;
+
+	get_obj_path(oid, path);
+	ret = getxattr(path, EC_INDEX_NAME, ec_index, sizeof(*ec_index));
+	if (ret < 0 && errno == ENOENT && sys->enable_md && md_exist(oid))
+		/* Found on another disk and moved to its owner */
+		ret = getxattr(path, EC_INDEX_NAME, ec_index,
+			       sizeof(*ec_index));
+	if (ret == sizeof(*ec_index))
+		return SD_RES_SUCCESS;
+
+	*ec_index = 0;
+	if (ret < 0 && errno == ENOENT)
+		return SD_RES_NO_OBJ;
+	return SD_RES_SUCCESS;
+}
+
 int default_link(uint64_t oid, uint32_t tgt_epoch)
 {
 	char path[PATH_MAX], stale_path[PATH_MAX];
@@ -367,7 +1605,7 @@ int default_link(uint64_t oid, uint32_t tgt_epoch)
 	return SD_RES_SUCCESS;
 }
 
-static bool oid_stale(uint64_t oid)
+bool oid_stale(uint64_t oid)
 {
 	int i, nr_copies;
 	struct vnode_info *vinfo;
@@ -382,8 +1620,7 @@ static bool oid_stale(uint64_t oid)
 		goto out;
 	}
 
-	oid_to_vnodes(vinfo->vnodes, vinfo->nr_vnodes, oid,
-		      nr_copies, obj_vnodes);
+	vinfo_oid_to_vnodes(vinfo, oid, nr_copies, obj_vnodes);
 	for (i = 0; i < nr_copies; i++) {
 		v = obj_vnodes[i];
 		if (vnode_is_local(v)) {
@@ -405,11 +1642,13 @@ static int move_object_to_stale_dir(uint64_t oid, char *wd, void *arg)
 	snprintf(stale_path, PATH_MAX, "%s/.stale/%016"PRIx64".%"PRIu32, wd,
 		 oid, tgt_epoch);
 
+	add_stale_epoch(tgt_epoch);
 	if (rename(path, stale_path) < 0) {
 		sd_eprintf("failed to move stale object %"PRIX64" to %s, %m",
 			   oid, path);
 		return SD_RES_EIO;
 	}
+	fd_cache_invalidate(oid);
 
 	sd_dprintf("moved object %"PRIx64, oid);
 	return SD_RES_SUCCESS;
@@ -438,6 +1677,8 @@ int default_format(void)
 
 	sd_dprintf("try get a clean store");
 	ret = for_each_obj_path(purge_dir);
+	fd_cache_purge();
+	clear_stale_epochs();
 	if (ret != SD_RES_SUCCESS)
 		return ret;
 
@@ -447,6 +1688,36 @@ int default_format(void)
 	return SD_RES_SUCCESS;
 }
 
+int default_discard(uint64_t oid, const struct siocb *iocb)
+{
+	int flags = get_open_flags(oid, false, iocb->flags), ret;
+	char path[PATH_MAX];
+	struct obj_fd *ofd;
+
+	if (iocb->epoch < sys_epoch()) {
+		sd_dprintf("%"PRIu32" sys %"PRIu32, iocb->epoch, sys_epoch());
+		return SD_RES_OLD_NODE_VER;
+	}
+
+	ret = get_plain_obj_fd(oid, flags, &ofd);
+	if (ret != SD_RES_SUCCESS)
+		return ret;
+	ret = check_ec_index(ofd->fd, oid, iocb);
+	if (ret != SD_RES_SUCCESS)
+		goto out;
+
+	if (punch_hole(ofd->fd, iocb->offset, iocb->length) < 0) {
+		get_obj_path(oid, path);
+		sd_eprintf("failed to discard object %"PRIx64", offset=%"PRIu64
+			   ", size=%"PRIu32", %m", oid, iocb->offset,
+			   iocb->length);
+		ret = err_to_sderr(path, oid, errno);
+	}
+out:
+	put_plain_obj_fd(oid, ofd);
+	return ret;
+}
+
 int default_remove_object(uint64_t oid)
 {
 	char path[PATH_MAX];
@@ -460,6 +1731,7 @@ int default_remove_object(uint64_t oid)
 		sd_eprintf("failed to remove object %"PRIx64", %m", oid);
 		return SD_RES_EIO;
 	}
+	fd_cache_invalidate(oid);
 
 	return SD_RES_SUCCESS;
 }
@@ -477,13 +1749,19 @@ static struct store_driver plain_store = {
 	.exist = default_exist,
 	.create_and_write = default_create_and_write,
 	.write = default_write,
+	.discard = default_discard,
 	.read = default_read,
+	.read_stale = default_read_stale,
 	.link = default_link,
 	.end_recover = default_end_recover,
 	.cleanup = default_cleanup,
 	.format = default_format,
 	.remove_object = default_remove_object,
 	.purge_obj = default_purge_obj,
+	.shutdown = default_shutdown,
+	.read_compressed = default_read_compressed,
+	.compress = default_compress,
+	.get_ec_index = default_get_ec_index,
 };
 
 add_store_driver(plain_store);
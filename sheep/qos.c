@@ -0,0 +1,419 @@
+/*
+ * Copyright (C) 2013 Taobao Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Per-VDI I/O QoS at the gateway
+ *
+ * The data requests of a VDI pass two token buckets, one for its IOPS and one
+ * for its bandwidth limit, each holding one second worth of tokens.  The
+ * requests that find a bucket empty are held back in the order they came and
+ * released by a timer as the tokens come back.
+ *
+ * When more than sys->qos_depth gateway requests are in flight, the VDIs are
+ * served by start-time fair queueing: each VDI advances its virtual time by
+ * the cost of its requests divided by its weight, and the held requests of
+ * the VDI with the earliest virtual time go first when a request finishes.
+ *
+ * The limits are read from the SD_QOS_ATTR_KEY attribute the first time a
+ * VDI is seen, and updated by SD_OP_NOTIFY_VDI_QOS.  The attributes belong to
+ * the name of the VDI, so its snapshots share the limits.  Everything here
+ * runs in the main thread except the attribute lookup.
+ */
+#include "sheep_priv.h"
+
+/* The cost of a request is one plus a unit for this many bytes */
+#define QOS_COST_UNIT (128 * 1024)
+#define QOS_TIMER_INTERVAL 10 /* ms */
+
+struct vdi_qos {
+	struct rb_node node;
+	uint32_t vid;
+	uint32_t name_vid; /* where the attributes live, once loaded */
+	bool loaded;
+	bool loading;
+	struct sd_vdi_qos limits;
+
+	/* token buckets, may go negative for a request larger than a second */
+	double io_tokens;
+	double byte_tokens;
+	uint64_t refill_time; /* usec */
+
+	/* virtual time of the next request under fair queueing */
+	uint64_t vtime;
+	/* the requests held back, and the link in qos_backlog while any */
+	struct list_head held;
+	struct list_head backlog;
+};
+
+struct qos_load_work {
+	struct work work;
+	struct vdi_qos *qos;
+	struct sd_vdi_qos limits;
+	uint32_t name_vid;
+	uint64_t generation;
+	int ret;
+};
+
+static struct rb_root qos_root = RB_ROOT;
+static LIST_HEAD(qos_backlog);
+static uint64_t qos_vclock;
+static uint32_t qos_inflight;
+/* bumped by qos_set(), so that the lookups run meanwhile are dropped */
+static uint64_t qos_generation;
+static struct timer qos_timer;
+static bool qos_timer_armed;
+
+static struct vdi_qos *qos_search(uint32_t vid)
+{
+	struct rb_node *n = qos_root.rb_node;
+	struct vdi_qos *t;
+
+	while (n) {
+		t = rb_entry(n, struct vdi_qos, node);
+
+		if (vid < t->vid)
+			n = n->rb_left;
+		else if (vid > t->vid)
+			n = n->rb_right;
+		else
+			return t;
+	}
+
+	return NULL;
+}
+
+static struct vdi_qos *qos_insert(struct vdi_qos *new)
+{
+	struct rb_node **p = &qos_root.rb_node;
+	struct rb_node *parent = NULL;
+	struct vdi_qos *entry;
+
+	while (*p) {
+		parent = *p;
+		entry = rb_entry(parent, struct vdi_qos, node);
+
+		if (new->vid < entry->vid)
+			p = &(*p)->rb_left;
+		else if (new->vid > entry->vid)
+			p = &(*p)->rb_right;
+		else
+			return entry;
+	}
+	rb_link_node(&new->node, parent, p);
+	rb_insert_color(&new->node, &qos_root);
+
+	return NULL;
+}
+
+static struct vdi_qos *get_qos(uint32_t vid)
+{
+	struct vdi_qos *qos = qos_search(vid);
+
+	if (qos)
+		return qos;
+
+	qos = xzalloc(sizeof(*qos));
+	qos->vid = vid;
+	INIT_LIST_HEAD(&qos->held);
+	INIT_LIST_HEAD(&qos->backlog);
+	qos_insert(qos);
+
+	return qos;
+}
+
+static void set_limits(struct vdi_qos *qos, const struct sd_vdi_qos *limits)
+{
+	qos->limits = *limits;
+	qos->loaded = true;
+	/* start with full buckets */
+	qos->io_tokens = limits->iops;
+	qos->byte_tokens = limits->bps;
+	qos->refill_time = get_usec_time();
+}
+
+static int parse_qos_attr(const struct sheepdog_vdi_attr *vattr,
+			  struct sd_vdi_qos *limits)
+{
+	char value[SD_MAX_VDI_ATTR_VALUE_LEN + 1];
+	uint32_t len = min(vattr->value_len,
+			   (uint32_t)SD_MAX_VDI_ATTR_VALUE_LEN);
+
+	memcpy(value, vattr->value, len);
+	value[len] = '\0';
+	if (sscanf(value, "iops=%"SCNu32" bps=%"SCNu64" weight=%"SCNu32,
+		   &limits->iops, &limits->bps, &limits->weight) != 3) {
+		sd_eprintf("invalid qos of %"PRIx32", %s", limits->vid, value);
+		return SD_RES_INVALID_PARMS;
+	}
+
+	return SD_RES_SUCCESS;
+}
+
+/*
+ * Look up the limits of limits->vid in the attributes, left 0 if none, and
+ * return the VDI id they live under in name_vid.  Run by a worker.
+ */
+int get_vdi_qos(struct sd_vdi_qos *limits, uint32_t *name_vid)
+{
+	struct sheepdog_inode *inode = xmalloc(SD_INODE_HEADER_SIZE);
+	struct sheepdog_vdi_attr vattr;
+	uint32_t vid = limits->vid, attrid;
+	int ret;
+
+	memset(limits, 0, sizeof(*limits));
+	limits->vid = vid;
+	ret = read_object(vid_to_vdi_oid(vid), (char *)inode,
+			  SD_INODE_HEADER_SIZE, 0, get_vdi_copy_number(vid));
+	if (ret != SD_RES_SUCCESS)
+		goto out;
+
+	/* the attributes live under the hash of the name, like in ops.c */
+	vid = fnv_64a_buf(inode->name, strlen(inode->name), FNV1A_64_INIT);
+	vid &= SD_NR_VDIS - 1;
+	if (name_vid)
+		*name_vid = vid;
+
+	memset(&vattr, 0, sizeof(vattr));
+	pstrcpy(vattr.name, sizeof(vattr.name), inode->name);
+	pstrcpy(vattr.key, sizeof(vattr.key), SD_QOS_ATTR_KEY);
+	ret = get_vdi_attr(&vattr, SD_ATTR_OBJ_SIZE, vid, &attrid,
+			   inode->create_time, false, false, false);
+	if (ret == SD_RES_SUCCESS) {
+		ret = read_object(vid_to_attr_oid(vid, attrid),
+				  (char *)&vattr, SD_ATTR_OBJ_SIZE, 0,
+				  get_vdi_copy_number(vid));
+		if (ret == SD_RES_SUCCESS)
+			ret = parse_qos_attr(&vattr, limits);
+	}
+out:
+	/* no limits */
+	if (ret == SD_RES_NO_OBJ)
+		ret = SD_RES_SUCCESS;
+	free(inode);
+	return ret;
+}
+
+static void do_load_qos(struct work *work)
+{
+	struct qos_load_work *lw = container_of(work, struct qos_load_work,
+						work);
+
+	lw->ret = get_vdi_qos(&lw->limits, &lw->name_vid);
+}
+
+static void load_qos_done(struct work *work);
+
+static void load_qos(struct vdi_qos *qos)
+{
+	struct qos_load_work *lw;
+
+	if (qos->loaded || qos->loading)
+		return;
+
+	lw = xzalloc(sizeof(*lw));
+	lw->qos = qos;
+	lw->limits.vid = qos->vid;
+	lw->generation = qos_generation;
+	lw->work.fn = do_load_qos;
+	lw->work.done = load_qos_done;
+	qos->loading = true;
+	queue_work(sys->gateway_wqueue, &lw->work);
+}
+
+static void load_qos_done(struct work *work)
+{
+	struct qos_load_work *lw = container_of(work, struct qos_load_work,
+						work);
+	struct vdi_qos *qos = lw->qos;
+
+	/*
+	 * If SD_OP_NOTIFY_VDI_QOS came meanwhile, the limits we read may be
+	 * old, so read them again.  If the lookup failed, the VDI goes
+	 * unlimited and its next request tries again.
+	 */
+	qos->loading = false;
+	if (lw->generation != qos_generation) {
+		sd_dprintf("reload qos of %"PRIx32, qos->vid);
+		load_qos(qos);
+	} else if (lw->ret != SD_RES_SUCCESS)
+		sd_dprintf("failed to load qos of %"PRIx32", %s", qos->vid,
+			   sd_strerror(lw->ret));
+	else {
+		qos->name_vid = lw->name_vid;
+		set_limits(qos, &lw->limits);
+	}
+
+	free(lw);
+	qos_dispatch();
+}
+
+static void refill_tokens(struct vdi_qos *qos, uint64_t now)
+{
+	double sec = (now - qos->refill_time) / 1000000.0;
+
+	qos->refill_time = now;
+	if (qos->limits.iops)
+		qos->io_tokens = min(qos->io_tokens + sec * qos->limits.iops,
+				     (double)qos->limits.iops);
+	if (qos->limits.bps)
+		qos->byte_tokens = min(qos->byte_tokens +
+				       sec * qos->limits.bps,
+				       (double)qos->limits.bps);
+}
+
+/* The requests of a VDI wait until its limits are loaded */
+static inline bool has_tokens(const struct vdi_qos *qos)
+{
+	return !qos->loading && (!qos->limits.iops || qos->io_tokens >= 1) &&
+		(!qos->limits.bps || qos->byte_tokens > 0);
+}
+
+static inline bool under_depth(void)
+{
+	return !sys->qos_depth || qos_inflight < sys->qos_depth;
+}
+
+/* Charge the request to the VDI and let it go */
+static void admit(struct vdi_qos *qos, struct request *req)
+{
+	uint32_t weight = qos->limits.weight ? : SD_QOS_DEFAULT_WEIGHT;
+	uint64_t cost = 1 + req->rq.data_length / QOS_COST_UNIT, start;
+
+	if (qos->limits.iops)
+		qos->io_tokens -= 1;
+	if (qos->limits.bps)
+		qos->byte_tokens -= req->rq.data_length;
+
+	start = max(qos->vtime, qos_vclock);
+	qos->vtime = start + cost * SD_QOS_DEFAULT_WEIGHT * 1000 / weight;
+	qos_vclock = start;
+	qos_inflight++;
+}
+
+static void qos_timer_fn(void *data)
+{
+	qos_timer_armed = false;
+	qos_dispatch();
+}
+
+/*
+ * Release the held requests that may go now, the VDI with the earliest
+ * virtual time first, and keep the timer running while any VDI waits for
+ * tokens.
+ */
+void qos_dispatch(void)
+{
+	struct vdi_qos *qos, *best;
+	struct request *req;
+	uint64_t now = get_usec_time();
+	bool starved = false;
+
+	while (!list_empty(&qos_backlog) && under_depth()) {
+		best = NULL;
+		list_for_each_entry(qos, &qos_backlog, backlog) {
+			refill_tokens(qos, now);
+			if (!has_tokens(qos))
+				continue;
+			if (!best || qos->vtime < best->vtime)
+				best = qos;
+		}
+		if (!best)
+			break;
+
+		req = list_first_entry(&best->held, struct request, qos_list);
+		list_del(&req->qos_list);
+		if (list_empty(&best->held))
+			list_del_init(&best->backlog);
+		admit(best, req);
+		queue_gateway_request(req);
+	}
+
+	list_for_each_entry(qos, &qos_backlog, backlog)
+		if (!qos->loading && !has_tokens(qos))
+			starved = true;
+	if (starved && !qos_timer_armed) {
+		qos_timer.callback = qos_timer_fn;
+		qos_timer_armed = true;
+		add_timer(&qos_timer, QOS_TIMER_INTERVAL);
+	}
+}
+
+/*
+ * Return true if the gateway request is held back by the limits of its VDI,
+ * to be queued by qos_dispatch() later.
+ */
+bool qos_hold(struct request *req)
+{
+	uint64_t oid = req->rq.obj.oid;
+	struct vdi_qos *qos;
+
+	if (req->qos || req->local || !is_data_obj(oid))
+		return false;
+
+	switch (req->rq.opcode) {
+	case SD_OP_READ_OBJ:
+	case SD_OP_WRITE_OBJ:
+	case SD_OP_CREATE_AND_WRITE_OBJ:
+		break;
+	default:
+		return false;
+	}
+
+	qos = get_qos(oid_to_vid(oid));
+	load_qos(qos);
+	req->qos = qos;
+
+	if (list_empty(&qos->held)) {
+		refill_tokens(qos, get_usec_time());
+		if (has_tokens(qos) && under_depth()) {
+			admit(qos, req);
+			return false;
+		}
+		list_add_tail(&qos->backlog, &qos_backlog);
+	}
+
+	list_add_tail(&req->qos_list, &qos->held);
+	qos_dispatch();
+	return true;
+}
+
+/* Called when the gateway request admitted by qos_hold() is done */
+void qos_done(struct request *req)
+{
+	if (!req->qos)
+		return;
+
+	req->qos = NULL;
+	qos_inflight--;
+	if (!list_empty(&qos_backlog))
+		qos_dispatch();
+}
+
+/* Apply the limits to all the loaded snapshots of the VDI */
+void qos_set(const struct sd_vdi_qos *limits)
+{
+	struct vdi_qos *qos;
+	struct rb_node *n;
+
+	qos_generation++;
+	for (n = rb_first(&qos_root); n; n = rb_next(n)) {
+		qos = rb_entry(n, struct vdi_qos, node);
+		if (qos->loaded && qos->name_vid == limits->vid) {
+			set_limits(qos, limits);
+			qos->limits.vid = qos->vid;
+		}
+	}
+
+	sd_iprintf("vdi %"PRIx32", iops %"PRIu32", bps %"PRIu64", weight %"
+		   PRIu32, limits->vid, limits->iops, limits->bps,
+		   limits->weight);
+	qos_dispatch();
+}
@@ -15,8 +15,23 @@
 #include <sys/types.h>
 
 #include "sheep_priv.h"
+#include "fec.h"
 
 
+/*
+ * Recovery pipeline
+ *
+ * Objects are recovered by up to sys->recovery_max_objs concurrent works in
+ * the order of rw->oids.  rw->done is the index of the next object to start,
+ * so the objects before it are either recovered or in flight, and the latter
+ * are linked on rw->inflight_list.
+ *
+ * Each object is first tried from the replica whose node has the fewest
+ * objects in flight, and no more than sys->recovery_max_node_objs objects are
+ * read from one node at a time.  If all the replicas of the next object are
+ * busy, we wait for an object to finish instead of skipping ahead, so that
+ * rw->oids stays partitioned as described above.
+ */
 enum rw_state {
 	RW_INIT,
 	RW_RUN,
@@ -41,16 +56,40 @@ struct recovery_work {
 	uint64_t *prio_oids;
 	int nr_prio_oids;
 	int nr_scheduled_prio_oids;
+	/* the objects before it are accessed by clients, don't throttle them */
+	uint32_t prio_end;
+	/* the objects from it to the end are still sorted by obj_cmp() */
+	uint32_t sorted_start;
+
+	struct list_head inflight_list;
+	int nr_inflight;
+	/* objects in flight per source node, indexed by cur_vinfo->nodes */
+	int *nr_node_inflight;
 
 	struct vnode_info *old_vinfo;
 	struct vnode_info *cur_vinfo;
 };
 
+struct recovery_obj_work {
+	struct recovery_work *rw;
+	uint64_t oid;
+	/*
+	 * The replicas to read from, least busy first, and the indexes of
+	 * their nodes.  The object is striped over them if there are many.
+	 */
+	int nr_sources;
+	int copies[SD_MAX_COPIES];
+	int sources[SD_MAX_COPIES];
+	bool stop;
+
+	struct work work;
+	struct list_head list;
+};
+
 static struct recovery_work *next_rw;
 static struct recovery_work *recovering_work;
-/* Dynamically grown list buffer default as 4M (2T storage) */
-#define DEFAULT_LIST_BUFFER_SIZE (UINT64_C(1) << 22)
-static size_t list_buffer_size = DEFAULT_LIST_BUFFER_SIZE;
+/* Object lists are fetched from each node in pages of 128K (16K oids) */
+#define OBJ_LIST_PAGE_SIZE (UINT64_C(1) << 17)
 
 static int obj_cmp(const void *oid1, const void *oid2)
 {
@@ -63,13 +102,242 @@ static int obj_cmp(const void *oid1, const void *oid2)
 		return -1;
 	if (hval1 > hval2)
 		return 1;
+	/* break the ties so that bsearch() finds the very oid */
+	if (*(const uint64_t *)oid1 < *(const uint64_t *)oid2)
+		return -1;
+	if (*(const uint64_t *)oid1 > *(const uint64_t *)oid2)
+		return 1;
 	return 0;
 }
 
+/*
+ * Delta recovery
+ *
+ * A node back from a short outage finds most of its objects in the stale
+ * directory, identical or nearly so to the replicas.  Instead of copying
+ * such an object as a whole, we ask the replica for the SHA1 of each
+ * SD_DIGEST_RANGE_SIZE range and fetch only the ranges that differ from the
+ * stale local copy.
+ */
+static int read_stale_object(uint64_t oid, void *buf, uint32_t len)
+{
+	struct siocb iocb = { 0 };
+
+	if (!sd_store->read_stale)
+		return SD_RES_NO_OBJ;
+
+	iocb.buf = buf;
+	iocb.length = len;
+	return sd_store->read_stale(oid, &iocb);
+}
+
+/*
+ * The replicas send the compressed objects as they store them, if we can
+ * read them.
+ */
+#ifdef ENABLE_COMPRESSION
+#define RECOVERY_READ_FLAGS \
+	(SD_FLAG_CMD_RECOVERY | SD_FLAG_CMD_SPARSE | SD_FLAG_CMD_COMPRESS)
+#else
+#define RECOVERY_READ_FLAGS (SD_FLAG_CMD_RECOVERY | SD_FLAG_CMD_SPARSE)
+#endif
+
+/*
+ * Expand the data read with SD_FLAG_CMD_SPARSE to 'len' bytes.  The replicas
+ * don't send the zero blocks, so holes cost nothing to recover.
+ */
+static int expand_replica_data(void *buf, const struct sd_rsp *rsp,
+			       uint32_t len)
+{
+	if (rsp->flags & SD_FLAG_CMD_COMPRESS) {
+		if (unpack_compressed_data(buf, rsp->data_length, len) < 0) {
+			sd_eprintf("invalid compressed data, %"PRIu32" bytes",
+				   rsp->data_length);
+			return SD_RES_EIO;
+		}
+		return SD_RES_SUCCESS;
+	}
+
+	if (!(rsp->flags & SD_FLAG_CMD_SPARSE)) {
+		untrim_zero_sectors(buf, rsp->obj.offset, rsp->data_length,
+				    len);
+		return SD_RES_SUCCESS;
+	}
+
+	if (unpack_sparse_data(buf, rsp->data_length, len) < 0) {
+		sd_eprintf("invalid sparse data, %"PRIu32" bytes",
+			   rsp->data_length);
+		return SD_RES_EIO;
+	}
+	return SD_RES_SUCCESS;
+}
+
+static int read_replica_range(uint64_t oid, const struct sd_vnode *vnode,
+			      uint32_t epoch, uint32_t tgt_epoch, void *buf,
+			      uint32_t offset, uint32_t len)
+{
+	struct sd_req hdr;
+	struct sd_rsp *rsp = (struct sd_rsp *)&hdr;
+	int ret;
+
+	sd_init_req(&hdr, SD_OP_READ_PEER);
+	hdr.epoch = epoch;
+	hdr.flags = RECOVERY_READ_FLAGS;
+	hdr.data_length = len;
+	hdr.obj.oid = oid;
+	hdr.obj.offset = offset;
+	hdr.obj.tgt_epoch = tgt_epoch;
+
+	ret = sheep_exec_req(&vnode->nid, &hdr, (char *)buf + offset);
+	if (ret == SD_RES_SUCCESS) {
+		metric_add(MC_RECOVERY_BYTES, rsp->data_length);
+		ret = expand_replica_data((char *)buf + offset, rsp, len);
+	}
+	return ret;
+}
+
+/* Patch the stale copy in buf into the replica's version */
+static int recover_object_delta(uint64_t oid, const struct sd_vnode *vnode,
+				uint32_t epoch, uint32_t tgt_epoch, void *buf,
+				uint32_t len)
+{
+	struct sd_req hdr;
+	struct sd_rsp *rsp = (struct sd_rsp *)&hdr;
+	int nr = DIV_ROUND_UP(len, SD_DIGEST_RANGE_SIZE), i, start = -1, ret;
+	uint32_t dlen = nr * SHA1_LEN, fetched = 0, off, n;
+	uint8_t *remote, *local;
+
+	remote = xmalloc(dlen * 2);
+	local = remote + dlen;
+
+	sd_init_req(&hdr, SD_OP_GET_OBJ_DIGEST);
+	hdr.epoch = epoch;
+	hdr.flags = SD_FLAG_CMD_RECOVERY;
+	hdr.data_length = dlen;
+	hdr.obj.oid = oid;
+	hdr.obj.tgt_epoch = tgt_epoch;
+
+	ret = sheep_exec_req(&vnode->nid, &hdr, remote);
+	if (ret != SD_RES_SUCCESS)
+		goto out;
+	metric_add(MC_RECOVERY_BYTES, rsp->data_length);
+	if (rsp->data_length != dlen) {
+		sd_eprintf("invalid digest length %"PRIu32" of %"PRIx64,
+			   rsp->data_length, oid);
+		ret = SD_RES_EIO;
+		goto out;
+	}
+
+	get_obj_digests(buf, len, local);
+
+	/* fetch the runs of differing ranges, one request per run */
+	for (i = 0; i <= nr; i++) {
+		bool differ = i < nr && memcmp(remote + i * SHA1_LEN,
+					       local + i * SHA1_LEN,
+					       SHA1_LEN);
+		if (differ) {
+			if (start < 0)
+				start = i;
+			continue;
+		}
+		if (start < 0)
+			continue;
+
+		off = start * SD_DIGEST_RANGE_SIZE;
+		n = min(len, (uint32_t)i * SD_DIGEST_RANGE_SIZE) - off;
+		ret = read_replica_range(oid, vnode, epoch, tgt_epoch, buf,
+					 off, n);
+		if (ret != SD_RES_SUCCESS)
+			goto out;
+		fetched += n;
+		start = -1;
+	}
+	sd_dprintf("%"PRIx64" fetched %"PRIu32" of %"PRIu32" bytes", oid,
+		   fetched, len);
+out:
+	free(remote);
+	return ret;
+}
+
+/*
+ * Read the object in stripes from all the replicas at once, so that the
+ * rebuild of one object doesn't depend on the bandwidth of a single node.
+ */
+static int read_replica_stripes(uint64_t oid, const struct sd_vnode **vnodes,
+				int nr, uint32_t epoch, uint32_t tgt_epoch,
+				void *buf, uint32_t len)
+{
+	struct sd_req hdrs[SD_MAX_COPIES];
+	const struct node_id *nids[SD_MAX_COPIES];
+	void *bufs[SD_MAX_COPIES];
+	uint32_t offs[SD_MAX_COPIES], lens[SD_MAX_COPIES];
+	uint32_t stripe, off = 0;
+	int i, n, ret, good = -1;
+
+	stripe = roundup(DIV_ROUND_UP(len, nr), SD_DIGEST_RANGE_SIZE);
+	for (n = 0; n < nr && off < len; n++, off += stripe) {
+		sd_init_req(hdrs + n, SD_OP_READ_PEER);
+		hdrs[n].epoch = epoch;
+		hdrs[n].flags = RECOVERY_READ_FLAGS;
+		hdrs[n].data_length = lens[n] = min(stripe, len - off);
+		hdrs[n].obj.oid = oid;
+		hdrs[n].obj.offset = offs[n] = off;
+		hdrs[n].obj.tgt_epoch = tgt_epoch;
+		nids[n] = &vnodes[n]->nid;
+		bufs[n] = (char *)buf + off;
+	}
+
+	ret = sheep_exec_reqs(nids, hdrs, bufs, n);
+	for (i = 0; i < n; i++) {
+		struct sd_rsp *rsp = (struct sd_rsp *)(hdrs + i);
+
+		if (rsp->result == SD_RES_OLD_NODE_VER)
+			return rsp->result;
+		if (rsp->result != SD_RES_SUCCESS)
+			continue;
+		metric_add(MC_RECOVERY_BYTES, rsp->data_length);
+		rsp->result = expand_replica_data(bufs[i], rsp, lens[i]);
+		if (rsp->result != SD_RES_SUCCESS) {
+			ret = rsp->result;
+			continue;
+		}
+		good = i;
+	}
+	if (good < 0)
+		return ret;
+	if (ret == SD_RES_SUCCESS)
+		goto out;
+
+	/*
+	 * A node which has finished its own recovery may have moved the
+	 * object to its stale directory already, so read the stripes that
+	 * failed from a replica that answered.
+	 */
+	for (i = 0; i < n; i++) {
+		struct sd_rsp *rsp = (struct sd_rsp *)(hdrs + i);
+
+		if (rsp->result == SD_RES_SUCCESS)
+			continue;
+		ret = read_replica_range(oid, vnodes[good], epoch, tgt_epoch,
+					 buf, offs[i], lens[i]);
+		if (ret != SD_RES_SUCCESS)
+			return ret;
+	}
+out:
+	sd_dprintf("%"PRIx64" read from %d replicas", oid, n);
+	return SD_RES_SUCCESS;
+}
+
+/*
+ * Recover the object from the replicas on vnodes[].  The stripes are read
+ * from all of them if there are more than one, otherwise the whole object or
+ * the ranges that differ from the stale copy are read from vnodes[0].
+ */
 static int recover_object_from_replica(uint64_t oid,
-				       const struct sd_vnode *vnode,
+				       const struct sd_vnode **vnodes, int nr,
 				       uint32_t epoch, uint32_t tgt_epoch)
 {
+	const struct sd_vnode *vnode = vnodes[0];
 	struct sd_req hdr;
 	struct sd_rsp *rsp = (struct sd_rsp *)&hdr;
 	unsigned rlen;
@@ -77,21 +345,44 @@ static int recover_object_from_replica(uint64_t oid,
 	void *buf = NULL;
 	struct siocb iocb = { 0 };
 
-	if (vnode_is_local(vnode) && tgt_epoch < sys_epoch()) {
+	if (nr == 1 && vnode_is_local(vnode) && tgt_epoch < sys_epoch()) {
 		ret = sd_store->link(oid, tgt_epoch);
 		goto out;
 	}
 
-	rlen = get_objsize(oid);
+	rlen = get_vdi_objsize(oid);
 	buf = valloc(rlen);
 	if (!buf) {
 		sd_eprintf("%m");
 		goto out;
 	}
 
+	if (sys->recovery_delta &&
+	    read_stale_object(oid, buf, rlen) == SD_RES_SUCCESS) {
+		ret = recover_object_delta(oid, vnode, epoch, tgt_epoch, buf,
+					   rlen);
+		if (ret == SD_RES_SUCCESS) {
+			iocb.length = rlen;
+			goto write;
+		}
+		if (ret == SD_RES_OLD_NODE_VER)
+			goto out;
+		sd_dprintf("fall back to full copy of %"PRIx64", %s", oid,
+			   sd_strerror(ret));
+	}
+
+	if (nr > 1) {
+		ret = read_replica_stripes(oid, vnodes, nr, epoch, tgt_epoch,
+					   buf, rlen);
+		if (ret != SD_RES_SUCCESS)
+			goto out;
+		iocb.length = rlen;
+		goto write;
+	}
+
 	sd_init_req(&hdr, SD_OP_READ_PEER);
 	hdr.epoch = epoch;
-	hdr.flags = SD_FLAG_CMD_RECOVERY;
+	hdr.flags = RECOVERY_READ_FLAGS;
 	hdr.data_length = rlen;
 	hdr.obj.oid = oid;
 	hdr.obj.tgt_epoch = tgt_epoch;
@@ -99,9 +390,22 @@ static int recover_object_from_replica(uint64_t oid,
 	ret = sheep_exec_req(&vnode->nid, &hdr, buf);
 	if (ret != SD_RES_SUCCESS)
 		goto out;
+	metric_add(MC_RECOVERY_BYTES, rsp->data_length);
+	if (rsp->flags & SD_FLAG_CMD_COMPRESS) {
+		/* store the image as it is, which is still cold */
+		iocb.flags = SD_FLAG_CMD_COMPRESS;
+		iocb.length = rsp->data_length;
+	} else if (rsp->flags & SD_FLAG_CMD_SPARSE) {
+		ret = expand_replica_data(buf, rsp, rlen);
+		if (ret != SD_RES_SUCCESS)
+			goto out;
+		iocb.length = rlen;
+	} else {
+		iocb.length = rsp->data_length;
+		iocb.offset = rsp->obj.offset;
+	}
+write:
 	iocb.epoch = epoch;
-	iocb.length = rsp->data_length;
-	iocb.offset = rsp->obj.offset;
 	iocb.buf = buf;
 	ret = sd_store->create_and_write(oid, &iocb);
 out:
@@ -132,15 +436,35 @@ static bool is_invalid_vnode(const struct sd_vnode *entry,
  * the routine will try to recovery it from the nodes it has stayed,
  * at least, *theoretically* on consistent hash ring.
  */
-static int do_recover_object(struct recovery_work *rw)
+static int do_recover_object(struct recovery_obj_work *row)
 {
+	struct recovery_work *rw = row->rw;
 	struct vnode_info *old;
-	uint64_t oid = rw->oids[rw->done];
+	uint64_t oid = row->oid;
 	uint32_t epoch = rw->epoch, tgt_epoch = rw->epoch;
-	int nr_copies, ret, i;
+	int nr_copies, ret = -1, i;
+	int start = row->nr_sources ? row->copies[0] : 0;
 
 	old = grab_vnode_info(rw->old_vinfo);
 
+	if (row->nr_sources > 1) {
+		const struct sd_vnode *vnodes[SD_MAX_COPIES];
+
+		for (i = 0; i < row->nr_sources; i++)
+			vnodes[i] = vinfo_oid_to_vnode(old, oid,
+						       row->copies[i]);
+		ret = recover_object_from_replica(oid, vnodes, row->nr_sources,
+						  epoch, tgt_epoch);
+		if (ret == SD_RES_SUCCESS)
+			goto err;
+		if (ret == SD_RES_OLD_NODE_VER) {
+			row->stop = true;
+			goto err;
+		}
+		/* try the replicas one by one */
+		ret = -1;
+	}
+
 again:
 	sd_dprintf("try recover object %"PRIx64" from epoch %"PRIu32, oid,
 		   tgt_epoch);
@@ -150,18 +474,19 @@ again:
 	for (i = 0; i < nr_copies; i++) {
 		const struct sd_vnode *tgt_vnode;
 
-		tgt_vnode = oid_to_vnode(old->vnodes, old->nr_vnodes, oid, i);
+		tgt_vnode = vinfo_oid_to_vnode(old, oid,
+					       (i + start) % nr_copies);
 
 		if (is_invalid_vnode(tgt_vnode, rw->cur_vinfo->nodes,
 				     rw->cur_vinfo->nr_nodes))
 			continue;
-		ret = recover_object_from_replica(oid, tgt_vnode,
+		ret = recover_object_from_replica(oid, &tgt_vnode, 1,
 						  epoch, tgt_epoch);
 		if (ret == SD_RES_SUCCESS) {
 			/* Succeed */
 			break;
 		} else if (SD_RES_OLD_NODE_VER == ret) {
-			rw->stop = true;
+			row->stop = true;
 			goto err;
 		} else
 			ret = -1;
@@ -186,6 +511,7 @@ rollback:
 
 		put_vnode_info(old);
 		old = new_old;
+		start = 0;
 		goto again;
 	}
 err:
@@ -193,24 +519,218 @@ err:
 	return ret;
 }
 
-static void recover_object_work(struct work *work)
+/*
+ * Recovery of erasure coded objects
+ *
+ * The strip a node stores depends on its position in the object, so a node
+ * may have to replace the strip it has as well as to get a missing one.  The
+ * strip is copied from the node at our position of the older epoch if it has
+ * it, otherwise decoded from the strips at the other positions.
+ */
+static int read_old_strips(struct vnode_info *old, uint64_t oid, int want,
+			   uint32_t epoch, uint32_t tgt_epoch,
+			   struct recovery_work *rw, const struct fec *fec,
+			   uint8_t **strips, uint32_t len)
 {
-	struct recovery_work *rw = container_of(work, struct recovery_work,
-						work);
-	uint64_t oid = rw->oids[rw->done];
-	int ret;
+	const struct sd_vnode *vnodes[SD_EC_MAX_STRIPS];
+	const struct node_id *nids[SD_EC_MAX_STRIPS];
+	struct sd_req hdrs[SD_EC_MAX_STRIPS];
+	void *bufs[SD_EC_MAX_STRIPS];
+	int idx[SD_EC_MAX_STRIPS], nr = fec->d + fec->p, i, n = 0, ret;
+	uint32_t avail = 0;
+
+	if (old->nr_zones < nr)
+		return SD_RES_NO_OBJ;
+	vinfo_oid_to_vnodes(old, oid, nr, vnodes);
+
+	for (i = 0; i < nr; i++) {
+		if (is_invalid_vnode(vnodes[i], rw->cur_vinfo->nodes,
+				     rw->cur_vinfo->nr_nodes))
+			continue;
+		sd_init_req(hdrs + n, SD_OP_READ_PEER);
+		hdrs[n].epoch = epoch;
+		hdrs[n].flags = SD_FLAG_CMD_RECOVERY;
+		hdrs[n].data_length = len;
+		hdrs[n].obj.oid = oid;
+		hdrs[n].obj.tgt_epoch = tgt_epoch;
+		hdrs[n].obj.ec_index = i + 1;
+		nids[n] = &vnodes[i]->nid;
+		bufs[n] = strips[i];
+		idx[n] = i;
+		/* try the strip at our position alone first */
+		if (i != want) {
+			n++;
+			continue;
+		}
+		ret = sheep_exec_req(nids[n], hdrs + n, bufs[n]);
+		if (ret == SD_RES_SUCCESS) {
+			struct sd_rsp *rsp = (struct sd_rsp *)(hdrs + n);
+
+			metric_add(MC_RECOVERY_BYTES, rsp->data_length);
+			untrim_zero_sectors(bufs[n], rsp->obj.offset,
+					    rsp->data_length, len);
+			return SD_RES_SUCCESS;
+		}
+		if (ret == SD_RES_OLD_NODE_VER)
+			return ret;
+	}
+	if (n < fec->d)
+		return SD_RES_NO_OBJ;
+
+	sheep_exec_reqs(nids, hdrs, bufs, n);
+	for (i = 0; i < n; i++) {
+		struct sd_rsp *rsp = (struct sd_rsp *)(hdrs + i);
+
+		if (rsp->result == SD_RES_OLD_NODE_VER)
+			return rsp->result;
+		if (rsp->result != SD_RES_SUCCESS)
+			continue;
+		metric_add(MC_RECOVERY_BYTES, rsp->data_length);
+		untrim_zero_sectors(bufs[i], rsp->obj.offset, rsp->data_length,
+				    len);
+		avail |= 1U << idx[i];
+	}
+
+	if (fec_reconstruct(fec, strips, avail, 1U << want, len) < 0)
+		return SD_RES_NO_OBJ;
+	sd_dprintf("decoded strip %d of %"PRIx64" from %x", want, oid, avail);
+	return SD_RES_SUCCESS;
+}
+
+static int recover_erasure_object(struct recovery_obj_work *row)
+{
+	struct recovery_work *rw = row->rw;
+	struct vnode_info *old;
+	uint64_t oid = row->oid;
+	uint32_t epoch = rw->epoch, tgt_epoch = rw->epoch - 1;
+	uint32_t len = get_store_objsize(oid);
+	uint8_t *strips[SD_EC_MAX_STRIPS], cur, want;
+	struct siocb iocb = { 0 };
+	struct fec fec;
+	void *buf;
+	int d, p, i, ret;
+
+	want = get_local_ec_index(rw->cur_vinfo, oid);
+	if (!want)
+		return SD_RES_SUCCESS;
+	if (sd_store->get_ec_index(oid, &cur) == SD_RES_SUCCESS &&
+	    cur == want) {
+		sd_dprintf("the object is already recovered");
+		return SD_RES_SUCCESS;
+	}
 
-	sd_eprintf("done:%"PRIu32" count:%"PRIu32", oid:%"PRIx64, rw->done,
-		   rw->count, oid);
+	get_obj_erasure(oid, &d, &p);
+	fec_init(&fec, d, p);
+	buf = xvalloc(len * (d + p));
+	for (i = 0; i < d + p; i++)
+		strips[i] = (uint8_t *)buf + len * i;
+
+	old = grab_vnode_info(rw->old_vinfo);
+	for (;;) {
+		sd_dprintf("try recover strip %d of %"PRIx64" from epoch %"
+			   PRIu32, want - 1, oid, tgt_epoch);
+		ret = read_old_strips(old, oid, want - 1, epoch, tgt_epoch, rw,
+				      &fec, strips, len);
+		if (ret == SD_RES_SUCCESS || ret == SD_RES_OLD_NODE_VER)
+			break;
+
+		/* No luck, roll back to an older configuration */
+		put_vnode_info(old);
+		old = NULL;
+		while (!old && tgt_epoch > 1)
+			old = get_vnode_info_epoch(--tgt_epoch);
+		if (!old) {
+			ret = SD_RES_NO_OBJ;
+			break;
+		}
+	}
+	if (old)
+		put_vnode_info(old);
+
+	if (ret == SD_RES_OLD_NODE_VER) {
+		row->stop = true;
+		goto out;
+	}
+	if (ret != SD_RES_SUCCESS)
+		goto out;
+
+	iocb.epoch = epoch;
+	iocb.ec_index = want;
+	iocb.buf = strips[want - 1];
+	iocb.length = len;
+	ret = sd_store->create_and_write(oid, &iocb);
+	if (ret == SD_RES_SUCCESS) {
+		sd_dprintf("recovered strip %d of %"PRIx64" to epoch %d",
+			   want - 1, oid, epoch);
+		objlist_cache_insert(oid);
+	}
+out:
+	free(buf);
+	return ret;
+}
+
+static void recover_object(struct recovery_obj_work *row)
+{
+	uint64_t oid = row->oid, start = get_usec_time();
+	int ret, d, p;
+
+	sd_eprintf("done:%"PRIu32" count:%"PRIu32", oid:%"PRIx64,
+		   row->rw->done, row->rw->count, oid);
+
+	if (get_obj_erasure(oid, &d, &p)) {
+		ret = recover_erasure_object(row);
+		if (ret != SD_RES_SUCCESS) {
+			sd_eprintf("failed to recover object %"PRIx64", %s",
+				   oid, sd_strerror(ret));
+			metric_add(MC_RECOVERY_FAILS, 1);
+			return;
+		}
+		goto out;
+	}
 
 	if (sd_store->exist(oid)) {
 		sd_dprintf("the object is already recovered");
 		return;
 	}
 
-	ret = do_recover_object(rw);
-	if (ret < 0)
+	ret = do_recover_object(row);
+	if (ret < 0) {
 		sd_eprintf("failed to recover object %"PRIx64, oid);
+		metric_add(MC_RECOVERY_FAILS, 1);
+		return;
+	}
+out:
+	metric_add(MC_RECOVERY_OBJS, 1);
+	metric_observe(MH_RECOVERY_OBJ, get_usec_time() - start);
+}
+
+/* set at shutdown, the object works which start later skip their objects */
+static uatomic_bool recovery_stopped;
+static int nr_running_objs;
+
+static void recover_object_work(struct work *work)
+{
+	struct recovery_obj_work *row = container_of(work,
+						     struct recovery_obj_work,
+						     work);
+
+	uatomic_inc(&nr_running_objs);
+	if (uatomic_is_true(&recovery_stopped))
+		row->stop = true;
+	else
+		recover_object(row);
+	uatomic_dec(&nr_running_objs);
+}
+
+/*
+ * Stop recovering objects for the shutdown and wait for the ones in flight,
+ * so that no object is created behind the back of the store saving its index.
+ */
+void stop_recovery(void)
+{
+	uatomic_set_true(&recovery_stopped);
+	while (uatomic_read(&nr_running_objs))
+		usleep(100 * 1000);
 }
 
 bool node_in_recovery(void)
@@ -218,43 +738,129 @@ bool node_in_recovery(void)
 	return !!recovering_work;
 }
 
-static inline void prepare_schedule_oid(uint64_t oid)
+/* Return the number of the objects left to recover, main thread only */
+uint32_t recovery_remaining_objects(void)
 {
 	struct recovery_work *rw = recovering_work;
+
+	return rw ? rw->count - rw->done : 0;
+}
+
+/* Check if oid is in the list of the objects to be recovered later */
+static bool oid_in_pending(struct recovery_work *rw, uint64_t oid)
+{
+	int i, sorted = max(rw->done, rw->sorted_start);
+
+	for (i = rw->done; i < sorted; i++)
+		if (rw->oids[i] == oid)
+			return true;
+
+	return !!bsearch(&oid, rw->oids + sorted, rw->count - sorted,
+			 sizeof(uint64_t), obj_cmp);
+}
+
+static void add_prio_oid(struct recovery_work *rw, uint64_t oid)
+{
 	int i;
 
 	for (i = 0; i < rw->nr_prio_oids; i++)
 		if (rw->prio_oids[i] == oid)
 			return;
-	/*
-	 * We need this check because oid might not be recovered.
-	 * Very much unlikely though, but it might happen indeed.
-	 */
-	for (i = 0; i < rw->done; i++)
-		if (rw->oids[i] == oid) {
-			sd_dprintf("%"PRIx64" not recovered, don't schedule it",
-				   oid);
-			return;
-		}
-	/*
-	 * When auto recovery is enabled, the oid is currently being
-	 * recovered
-	 */
-	if (!sys->disable_recovery && rw->oids[rw->done] == oid)
-		return;
+
 	rw->nr_prio_oids++;
 	rw->prio_oids = xrealloc(rw->prio_oids,
 				 rw->nr_prio_oids * sizeof(uint64_t));
 	rw->prio_oids[rw->nr_prio_oids - 1] = oid;
+}
+
+/*
+ * Access-driven priority recovery
+ *
+ * A guest that hits an object in recovery is likely to hit its inode and the
+ * next objects soon, so they are scheduled right after it instead of blocking
+ * the guest again one by one.  Like readahead, the window grows while the
+ * accesses to a VDI go forward and shrinks back on a random access.
+ */
+#define NR_HOT_VDIS 64
+#define MIN_PREFETCH_OBJS 1
+#define MAX_PREFETCH_OBJS 32
+
+struct hot_vdi {
+	uint32_t vid;
+	uint32_t last_idx;
+	uint32_t window;
+	uint64_t access_time;
+};
+
+static struct hot_vdi hot_vdis[NR_HOT_VDIS];
+
+static struct hot_vdi *get_hot_vdi(uint32_t vid, bool *new)
+{
+	struct hot_vdi *h, *lru = hot_vdis;
+
+	for (h = hot_vdis; h < hot_vdis + NR_HOT_VDIS; h++) {
+		if (h->access_time && h->vid == vid) {
+			*new = false;
+			return h;
+		}
+		if (h->access_time < lru->access_time)
+			lru = h;
+	}
+
+	memset(lru, 0, sizeof(*lru));
+	lru->vid = vid;
+	*new = true;
+	return lru;
+}
+
+static void schedule_hot_objects(struct recovery_work *rw, uint64_t oid)
+{
+	uint32_t vid = oid_to_vid(oid), idx = data_oid_to_idx(oid), i;
+	struct hot_vdi *h;
+	bool new;
+
+	if (!is_data_obj(oid))
+		return;
+
+	h = get_hot_vdi(vid, &new);
+	if (!new && idx > h->last_idx && idx <= h->last_idx + h->window)
+		h->window = min(h->window * 2, (uint32_t)MAX_PREFETCH_OBJS);
+	else
+		h->window = MIN_PREFETCH_OBJS;
+	h->last_idx = idx;
+	h->access_time = get_usec_time();
+
+	if (oid_in_pending(rw, vid_to_vdi_oid(vid)))
+		add_prio_oid(rw, vid_to_vdi_oid(vid));
+	for (i = idx + 1; i <= idx + h->window && i < MAX_DATA_OBJS; i++)
+		if (oid_in_pending(rw, vid_to_data_oid(vid, i)))
+			add_prio_oid(rw, vid_to_data_oid(vid, i));
+}
+
+static inline void prepare_schedule_oid(uint64_t oid)
+{
+	struct recovery_work *rw = recovering_work;
+
+	add_prio_oid(rw, oid);
+	schedule_hot_objects(rw, oid);
 	resume_suspended_recovery();
 
 	sd_dprintf("%"PRIx64" nr_prio_oids %d", oid, rw->nr_prio_oids);
 }
 
+static bool oid_in_flight(struct recovery_work *rw, uint64_t oid)
+{
+	struct recovery_obj_work *row;
+
+	list_for_each_entry(row, &rw->inflight_list, list)
+		if (row->oid == oid)
+			return true;
+	return false;
+}
+
 bool oid_in_recovery(uint64_t oid)
 {
 	struct recovery_work *rw = recovering_work;
-	int i;
 
 	if (!node_in_recovery())
 		return false;
@@ -271,20 +877,16 @@ bool oid_in_recovery(uint64_t oid)
 	if (rw->state == RW_INIT)
 		return true;
 
-	/*
-	 * Check if oid is in the list that to be recovered later
-	 *
-	 * FIXME: do we need more efficient yet complex data structure?
-	 */
-	for (i = rw->done; i < rw->count; i++)
-		if (rw->oids[i] == oid)
-			break;
+	/* the requests are woken up when the object is done */
+	if (oid_in_flight(rw, oid))
+		return true;
 
 	/*
 	 * Newly created object after prepare_object_list() might not be
-	 * in the list
+	 * in the list.  The objects already done are not either, so we
+	 * don't schedule an object that failed to be recovered.
 	 */
-	if (i == rw->count) {
+	if (!oid_in_pending(rw, oid)) {
 		sd_eprintf("%"PRIx64" is not in the recovery list", oid);
 		return false;
 	}
@@ -298,6 +900,8 @@ static void free_recovery_work(struct recovery_work *rw)
 	put_vnode_info(rw->cur_vinfo);
 	put_vnode_info(rw->old_vinfo);
 	free(rw->oids);
+	free(rw->prio_oids);
+	free(rw->nr_node_inflight);
 	free(rw);
 }
 
@@ -375,24 +979,31 @@ static inline bool oid_in_prio_oids(struct recovery_work *rw, uint64_t oid)
  */
 static inline void finish_schedule_oids(struct recovery_work *rw)
 {
-	int i, nr_recovered = rw->done, new_idx;
+	int i, nr_recovered = rw->done, new_idx, sorted, new_sorted;
 	uint64_t *new_oids;
 
 	/* If I am the last oid, done */
-	if (nr_recovered == rw->count - 1)
+	if (nr_recovered >= rw->count - 1)
 		goto done;
 
-	new_oids = xmalloc(list_buffer_size);
+	new_oids = xmalloc(rw->count * sizeof(uint64_t));
 	memcpy(new_oids, rw->oids, nr_recovered * sizeof(uint64_t));
 	memcpy(new_oids + nr_recovered, rw->prio_oids,
 	       rw->nr_prio_oids * sizeof(uint64_t));
 	new_idx = nr_recovered + rw->nr_prio_oids;
+	rw->prio_end = new_idx;
 
+	/* the unsorted objects left are moved before the sorted ones */
+	sorted = max(rw->done, rw->sorted_start);
+	new_sorted = rw->count;
 	for (i = rw->done; i < rw->count; i++) {
+		if (i == sorted)
+			new_sorted = new_idx;
 		if (oid_in_prio_oids(rw, rw->oids[i]))
 			continue;
 		new_oids[new_idx++] = rw->oids[i];
 	}
+	rw->sorted_start = new_sorted;
 	/* rw->count should eq new_idx, otherwise something is wrong */
 	sd_dprintf("%snr_recovered %d, nr_prio_oids %d, count %d = new %d",
 		   rw->count == new_idx ? "" : "WARN: ", nr_recovered,
@@ -419,62 +1030,287 @@ static bool has_scheduled_objects(struct recovery_work *rw)
 	return rw->done < rw->nr_scheduled_prio_oids;
 }
 
-static void recover_next_object(struct recovery_work *rw)
+static void recover_object_main(struct work *work);
+static void recover_next_object(struct recovery_work *rw);
+
+/*
+ * Recovery throttling
+ *
+ * An object is started only when the token buckets of objects and bytes are
+ * not in debt, and the whole object is charged when it is started.  The
+ * buckets refill at max_iops and max_bandwidth and hold at most one second
+ * worth of tokens.  Objects that clients are waiting for aren't throttled.
+ *
+ * Once a second, the foreground latency is compared with max_latency.  If it
+ * is higher, the window and the rates are halved, down to 1/64.  Otherwise
+ * they are doubled back up to the configured values.
+ */
+#define RECOVERY_BACKOFF_INTERVAL 1000000 /* usec */
+#define RECOVERY_MAX_BACKOFF 6
+
+/* tokens are in millionths of an object and of a KB */
+static int64_t obj_tokens, kb_tokens;
+static uint64_t throttle_time, backoff_time;
+static int backoff;
+static struct timer throttle_timer;
+static bool throttle_timer_pending;
+
+static inline uint64_t throttled_rate(uint64_t rate)
 {
-	if (next_rw) {
-		run_next_rw(rw);
+	return rate ? max(rate >> backoff, (uint64_t)1) : 0;
+}
+
+static void refill_bucket(int64_t *tokens, uint64_t rate, uint64_t elapsed)
+{
+	if (!rate) {
+		*tokens = 0;
 		return;
 	}
+	*tokens = min(*tokens + (int64_t)(elapsed * rate),
+		      (int64_t)rate * 1000000);
+}
 
-	if (rw->nr_prio_oids)
-		finish_schedule_oids(rw);
+/* Return usec to wait until the bucket is out of debt, 0 if it is not */
+static uint64_t bucket_wait(int64_t tokens, uint64_t rate)
+{
+	if (tokens >= 0)
+		return 0;
+	return -tokens / rate + 1;
+}
 
-	if (sys->disable_recovery && !has_scheduled_objects(rw)) {
-		sd_dprintf("suspended");
-		rw->suspended = true;
-		/* suspend until resume_suspended_recovery() is called */
+static void update_recovery_backoff(uint64_t now)
+{
+	uint64_t max_latency = sys->recovery_throttle.max_latency * 1000ULL;
+	uint64_t latency;
+
+	if (now - backoff_time < RECOVERY_BACKOFF_INTERVAL)
 		return;
-	}
+	backoff_time = now;
 
-	/* Try recover next object */
-	queue_work(sys->recovery_wqueue, &rw->work);
+	latency = foreground_latency();
+	if (max_latency && latency > max_latency) {
+		if (backoff == RECOVERY_MAX_BACKOFF)
+			return;
+		backoff++;
+	} else if (backoff)
+		backoff--;
+	else
+		return;
+
+	sd_iprintf("foreground latency %"PRIu64" us, recovery at 1/%d speed",
+		   latency, 1 << backoff);
 }
 
-void resume_suspended_recovery(void)
+static uint32_t recovery_window(void)
 {
-	if (recovering_work && recovering_work->suspended) {
-		recovering_work->suspended = false;
-		recover_next_object(recovering_work);
+	return max(sys->recovery_max_objs >> backoff, 1U);
+}
+
+/* Return usec to wait before starting the next object, 0 to start it now */
+static uint64_t recovery_throttle_wait(void)
+{
+	uint64_t now = get_usec_time(), elapsed, iops, kbps;
+
+	iops = throttled_rate(sys->recovery_throttle.max_iops);
+	kbps = throttled_rate(sys->recovery_throttle.max_bandwidth * 1024ULL);
+	elapsed = min(now - throttle_time, (uint64_t)1000000);
+	throttle_time = now;
+
+	refill_bucket(&obj_tokens, iops, elapsed);
+	refill_bucket(&kb_tokens, kbps, elapsed);
+
+	return max(bucket_wait(obj_tokens, iops), bucket_wait(kb_tokens, kbps));
+}
+
+static void charge_recovery(uint64_t oid)
+{
+	if (sys->recovery_throttle.max_iops)
+		obj_tokens -= 1000000;
+	if (sys->recovery_throttle.max_bandwidth)
+		kb_tokens -= DIV_ROUND_UP(get_vdi_objsize(oid), 1024) *
+			1000000LL;
+}
+
+static void throttle_timer_fn(void *data)
+{
+	struct recovery_work *rw = recovering_work;
+
+	throttle_timer_pending = false;
+	if (rw && rw->state == RW_RUN && !rw->suspended)
+		recover_next_object(rw);
+}
+
+static void add_throttle_timer(uint64_t usec)
+{
+	if (throttle_timer_pending)
+		return;
+
+	throttle_timer_pending = true;
+	throttle_timer.callback = throttle_timer_fn;
+	add_timer(&throttle_timer, min(DIV_ROUND_UP(usec, 1000),
+				       (uint64_t)1000));
+}
+
+/* Return the index of the node in cur_vinfo or -1 if it has left */
+static int source_node_idx(struct recovery_work *rw,
+			   const struct sd_vnode *vnode)
+{
+	const struct sd_node *n;
+
+	n = bsearch(vnode, rw->cur_vinfo->nodes, rw->cur_vinfo->nr_nodes,
+		    sizeof(struct sd_node), node_id_cmp);
+	if (!n)
+		return -1;
+	return n - rw->cur_vinfo->nodes;
+}
+
+/*
+ * Start recovering the next object from the least busy replica, striped over
+ * the other replicas that are not at their limit.  Return false if all the
+ * replicas are at their limit, unless 'force' is set.
+ */
+static bool start_next_object(struct recovery_work *rw, bool force)
+{
+	struct recovery_obj_work *row;
+	struct vnode_info *old = rw->old_vinfo;
+	uint64_t oid = rw->oids[rw->done];
+	int nr_copies, i, j, idx, nr = 0;
+	int copies[SD_MAX_COPIES], sources[SD_MAX_COPIES];
+
+	/* sort the replicas by the objects in flight from their nodes */
+	nr_copies = get_obj_copy_number(oid, old->nr_zones);
+	for (i = 0; i < nr_copies; i++) {
+		const struct sd_vnode *v;
+
+		v = vinfo_oid_to_vnode(old, oid, i);
+		idx = source_node_idx(rw, v);
+		/* we don't have the object, or we wouldn't recover it */
+		if (idx < 0 || vnode_is_local(v))
+			continue;
+		for (j = nr; j > 0 && rw->nr_node_inflight[idx] <
+			     rw->nr_node_inflight[sources[j - 1]]; j--) {
+			copies[j] = copies[j - 1];
+			sources[j] = sources[j - 1];
+		}
+		copies[j] = i;
+		sources[j] = idx;
+		nr++;
 	}
+
+	if (nr && !force &&
+	    rw->nr_node_inflight[sources[0]] >= sys->recovery_max_node_objs)
+		return false;
+
+	row = xzalloc(sizeof(*row));
+	row->rw = rw;
+	row->oid = oid;
+	for (i = 0; i < nr; i++) {
+		if (i && rw->nr_node_inflight[sources[i]] >=
+		    sys->recovery_max_node_objs)
+			break;
+		row->copies[i] = copies[i];
+		row->sources[i] = sources[i];
+		row->nr_sources++;
+		rw->nr_node_inflight[sources[i]]++;
+	}
+	row->work.fn = recover_object_work;
+	row->work.done = recover_object_main;
+
+	list_add_tail(&row->list, &rw->inflight_list);
+	rw->nr_inflight++;
+	rw->done++;
+
+	queue_work(sys->recovery_wqueue, &row->work);
+	return true;
 }
 
-static void recover_object_main(struct work *work)
+static void recover_next_object(struct recovery_work *rw)
 {
-	struct recovery_work *rw = container_of(work, struct recovery_work,
-						work);
 	if (next_rw) {
-		run_next_rw(rw);
+		/* switch to the next recovery after the objects in flight */
+		if (!rw->nr_inflight)
+			run_next_rw(rw);
 		return;
 	}
 
 	if (rw->stop) {
+		if (rw->nr_inflight)
+			return;
 		/*
 		 * Stop this recovery process and wait for epoch to be
 		 * lifted and flush wait queue to requeue those
-		 * requests
+		 * requests.  start_recovery() resumes us to run the next
+		 * recovery.
 		 */
+		rw->suspended = true;
 		wakeup_all_requests();
 		sd_dprintf("recovery is stopped");
 		return;
 	}
 
-	wakeup_requests_on_oid(rw->oids[rw->done++]);
-	if (rw->done < rw->count) {
-		recover_next_object(rw);
-		return;
+	if (rw->nr_prio_oids)
+		finish_schedule_oids(rw);
+
+	update_recovery_backoff(get_usec_time());
+	while (rw->done < rw->count && rw->nr_inflight < recovery_window()) {
+		uint64_t oid = rw->oids[rw->done], wait;
+		bool prio = rw->done < rw->prio_end;
+
+		if (sys->disable_recovery && !has_scheduled_objects(rw)) {
+			sd_dprintf("suspended");
+			rw->suspended = true;
+			/*
+			 * suspend until resume_suspended_recovery() is
+			 * called
+			 */
+			break;
+		}
+
+		if (!prio) {
+			wait = recovery_throttle_wait();
+			if (wait) {
+				add_throttle_timer(wait);
+				break;
+			}
+		}
+
+		if (!start_next_object(rw, !rw->nr_inflight))
+			break;
+		if (!prio)
+			charge_recovery(oid);
+	}
+
+	if (!rw->nr_inflight && rw->done == rw->count)
+		finish_recovery(rw);
+}
+
+void resume_suspended_recovery(void)
+{
+	if (recovering_work && recovering_work->suspended) {
+		recovering_work->suspended = false;
+		recover_next_object(recovering_work);
 	}
+}
 
-	finish_recovery(rw);
+static void recover_object_main(struct work *work)
+{
+	struct recovery_obj_work *row = container_of(work,
+						     struct recovery_obj_work,
+						     work);
+	struct recovery_work *rw = row->rw;
+	int i;
+
+	list_del(&row->list);
+	rw->nr_inflight--;
+	for (i = 0; i < row->nr_sources; i++)
+		rw->nr_node_inflight[row->sources[i]]--;
+	if (row->stop)
+		rw->stop = true;
+
+	wakeup_requests_on_oid(row->oid);
+	free(row);
+
+	recover_next_object(rw);
 }
 
 static void finish_object_list(struct work *work)
@@ -490,86 +1326,128 @@ static void finish_object_list(struct work *work)
 		finish_recovery(rw);
 		return;
 	}
-	rw->work.fn = recover_object_work;
-	rw->work.done = recover_object_main;
 	recover_next_object(rw);
 	return;
 }
 
-/* Fetch the object list from all the nodes in the cluster */
-static uint64_t *fetch_object_list(struct sd_node *e, uint32_t epoch,
-				   size_t *nr_oids)
+/*
+ * The object list of a node, read a page at a time.  The pages come sorted
+ * by oid, so the lists of all the nodes can be merged into the recovery list
+ * without holding any of them as a whole.
+ */
+struct obj_list_stream {
+	struct sd_node *node;
+	uint64_t *buf;
+	size_t nr, pos;
+	uint64_t cursor;
+	bool more;
+};
+
+static int fetch_object_list_page(struct obj_list_stream *s, uint32_t epoch)
 {
-	char name[128];
 	struct sd_list_req hdr;
 	struct sd_list_rsp *rsp = (struct sd_list_rsp *)&hdr;
-	size_t buf_size = list_buffer_size;
-	uint64_t *buf = xmalloc(buf_size);
 	int ret;
 
-	addr_to_str(name, sizeof(name), e->nid.addr, 0);
-	sd_dprintf("%s %"PRIu32, name, e->nid.port);
-
-retry:
 	sd_init_req((struct sd_req *)&hdr, SD_OP_GET_OBJ_LIST);
 	hdr.tgt_epoch = epoch - 1;
-	hdr.data_length = buf_size;
+	hdr.data_length = OBJ_LIST_PAGE_SIZE;
 	hdr.epoch = sys_epoch();
-	ret = sheep_exec_req(&e->nid, (struct sd_req *)&hdr, buf);
+	hdr.list_flags = SD_LIST_PAGED;
+	hdr.cursor = s->cursor;
+	ret = sheep_exec_req(&s->node->nid, (struct sd_req *)&hdr, s->buf);
+
+	s->nr = s->pos = 0;
+	s->more = false;
+	if (ret != SD_RES_SUCCESS) {
+		sd_eprintf("failed to get the object list from %s, %s",
+			   node_to_str(s->node), sd_strerror(ret));
+		return ret;
+	}
 
-	switch (ret) {
-	case SD_RES_SUCCESS:
-		break;
-	case SD_RES_BUFFER_SMALL:
-		buf_size *= 2;
-		buf = xrealloc(buf, buf_size);
-		goto retry;
-	default:
-		free(buf);
-		return NULL;
+	s->nr = rsp->data_length / sizeof(uint64_t);
+	if (rsp->list_flags & SD_LIST_MORE) {
+		s->more = true;
+		s->cursor = rsp->cursor;
 	}
+	sd_dprintf("%s %zu%s", node_to_str(s->node), s->nr,
+		   s->more ? " more" : "");
+	return SD_RES_SUCCESS;
+}
+
+/* Get the smallest oid left in the stream, false if it is drained */
+static bool stream_peek(struct obj_list_stream *s, uint32_t epoch,
+			uint64_t *oid)
+{
+	while (s->pos == s->nr) {
+		if (!s->more)
+			return false;
+		if (fetch_object_list_page(s, epoch) != SD_RES_SUCCESS)
+			return false;
+	}
+	*oid = s->buf[s->pos];
+	return true;
+}
+
+/* Min-heap of the non-empty streams keyed by their next oid */
+static inline uint64_t stream_head(struct obj_list_stream *s)
+{
+	return s->buf[s->pos];
+}
 
-	*nr_oids = rsp->data_length / sizeof(uint64_t);
-	sd_dprintf("%zu", *nr_oids);
-	return buf;
+static void stream_heap_down(struct obj_list_stream **heap, int nr, int i)
+{
+	struct obj_list_stream *tmp;
+	int child;
+
+	while ((child = 2 * i + 1) < nr) {
+		if (child + 1 < nr &&
+		    stream_head(heap[child + 1]) < stream_head(heap[child]))
+			child++;
+		if (stream_head(heap[i]) <= stream_head(heap[child]))
+			break;
+		tmp = heap[i];
+		heap[i] = heap[child];
+		heap[child] = tmp;
+		i = child;
+	}
 }
 
-/* Screen out objects that don't belong to this node */
-static void screen_object_list(struct recovery_work *rw,
-			       uint64_t *oids, size_t nr_oids)
+/* Add oid to the recovery list if this node should hold one of the copies */
+static void screen_object(struct recovery_work *rw, uint64_t oid,
+			  size_t *size)
 {
 	const struct sd_vnode *vnodes[SD_MAX_COPIES];
-	int old_count = rw->count;
-	int nr_objs;
-	int i, j;
-
-	for (i = 0; i < nr_oids; i++) {
-		nr_objs = get_obj_copy_number(oids[i], rw->cur_vinfo->nr_zones);
-		if (!nr_objs) {
-			sd_eprintf("ERROR: can not find copy number for object"
-				   " %" PRIx64, oids[i]);
+	int nr_objs, j;
+
+	nr_objs = get_obj_copy_number(oid, rw->cur_vinfo->nr_zones);
+	if (!nr_objs) {
+		sd_eprintf("ERROR: can not find copy number for object"
+			   " %" PRIx64, oid);
+		return;
+	}
+	vinfo_oid_to_vnodes(rw->cur_vinfo, oid, nr_objs, vnodes);
+	for (j = 0; j < nr_objs; j++) {
+		if (!vnode_is_local(vnodes[j]))
 			continue;
+		/*
+		 * Recovery kicked by md only needs the objects that
+		 * were on the broken disk; misplaced ones are moved
+		 * by md rebalancing.
+		 */
+		if (rw->old_vinfo == rw->cur_vinfo && sys->enable_md &&
+		    md_has_object(oid))
+			return;
+
+		if (rw->count == *size) {
+			*size = *size ? *size * 2 :
+				OBJ_LIST_PAGE_SIZE / sizeof(uint64_t);
+			rw->oids = xrealloc(rw->oids,
+					    *size * sizeof(uint64_t));
 		}
-		oid_to_vnodes(rw->cur_vinfo->vnodes, rw->cur_vinfo->nr_vnodes,
-			      oids[i], nr_objs, vnodes);
-		for (j = 0; j < nr_objs; j++) {
-			if (!vnode_is_local(vnodes[j]))
-				continue;
-			if (bsearch(&oids[i], rw->oids, old_count,
-				    sizeof(uint64_t), obj_cmp))
-				continue;
-
-			rw->oids[rw->count++] = oids[i];
-			/* enlarge the list buffer if full */
-			if (rw->count == list_buffer_size / sizeof(uint64_t)) {
-				list_buffer_size *= 2;
-				rw->oids = xrealloc(rw->oids, list_buffer_size);
-			}
-			break;
-		}
+		rw->oids[rw->count++] = oid;
+		return;
 	}
-
-	qsort(rw->oids, rw->count, sizeof(uint64_t), obj_cmp);
 }
 
 static bool newly_joined(struct sd_node *node, struct recovery_work *rw)
@@ -580,46 +1458,75 @@ static bool newly_joined(struct sd_node *node, struct recovery_work *rw)
 	return true;
 }
 
-/* Prepare the object list that belongs to this node */
+/*
+ * Prepare the object list that belongs to this node
+ *
+ * The sorted object lists of all the nodes are merged, so each oid is
+ * screened once no matter how many nodes hold it.
+ */
 static void prepare_object_list(struct work *work)
 {
 	struct recovery_work *rw = container_of(work, struct recovery_work,
 						work);
 	struct sd_node *cur = rw->cur_vinfo->nodes;
 	int cur_nr = rw->cur_vinfo->nr_nodes;
-	int start = random() % cur_nr, i, end = cur_nr;
-	uint64_t *oids;
+	struct obj_list_stream *streams, **heap;
+	int i, nr = 0;
+	size_t size = 0;
+	uint64_t oid, next, last = 0;
+	bool first = true;
 
 	sd_dprintf("%u", rw->epoch);
 	wait_get_vdis_done();
-again:
-	/* We need to start at random node for better load balance */
-	for (i = start; i < end; i++) {
-		size_t nr_oids;
-		struct sd_node *node = cur + i;
 
-		if (next_rw) {
-			sd_dprintf("go to the next recovery");
-			return;
-		}
-		if (newly_joined(node, rw))
+	streams = xcalloc(cur_nr, sizeof(*streams));
+	heap = xcalloc(cur_nr, sizeof(*heap));
+	for (i = 0; i < cur_nr; i++) {
+		struct obj_list_stream *s = streams + i;
+
+		if (newly_joined(cur + i, rw))
 			/* new node doesn't have a list file */
 			continue;
 
-		oids = fetch_object_list(node, rw->epoch, &nr_oids);
-		if (!oids)
-			continue;
-		screen_object_list(rw, oids, nr_oids);
-		free(oids);
+		s->node = cur + i;
+		s->buf = xmalloc(OBJ_LIST_PAGE_SIZE);
+		s->more = true;
+		if (stream_peek(s, rw->epoch, &oid))
+			heap[nr++] = s;
 	}
+	for (i = nr / 2 - 1; i >= 0; i--)
+		stream_heap_down(heap, nr, i);
 
-	if (start != 0) {
-		end = start;
-		start = 0;
-		goto again;
+	while (nr > 0) {
+		struct obj_list_stream *s = heap[0];
+
+		if (next_rw) {
+			sd_dprintf("go to the next recovery");
+			goto out;
+		}
+
+		oid = stream_head(s);
+		s->pos++;
+		if (!stream_peek(s, rw->epoch, &next))
+			heap[0] = heap[--nr];
+		stream_heap_down(heap, nr, 0);
+
+		/* the same oid comes from every node that holds it */
+		if (!first && oid == last)
+			continue;
+		screen_object(rw, oid, &size);
+		last = oid;
+		first = false;
 	}
 
+	/* recover in hash order to spread the load over the VDIs */
+	qsort(rw->oids, rw->count, sizeof(uint64_t), obj_cmp);
 	sd_dprintf("%d", rw->count);
+out:
+	for (i = 0; i < cur_nr; i++)
+		free(streams[i].buf);
+	free(streams);
+	free(heap);
 }
 
 static inline bool node_is_gateway_only(void)
@@ -636,12 +1543,13 @@ int start_recovery(struct vnode_info *cur_vinfo, struct vnode_info *old_vinfo)
 
 	rw = xzalloc(sizeof(struct recovery_work));
 	rw->state = RW_INIT;
-	rw->oids = xmalloc(list_buffer_size);
 	rw->epoch = sys->epoch;
 	rw->count = 0;
 
 	rw->cur_vinfo = grab_vnode_info(cur_vinfo);
 	rw->old_vinfo = grab_vnode_info(old_vinfo);
+	INIT_LIST_HEAD(&rw->inflight_list);
+	rw->nr_node_inflight = xcalloc(cur_vinfo->nr_nodes, sizeof(int));
 
 	rw->work.fn = prepare_object_list;
 	rw->work.done = finish_object_list;
@@ -13,10 +13,12 @@
 #include <unistd.h>
 #include <netdb.h>
 #include <pthread.h>
+#include <signal.h>
 #include <sys/eventfd.h>
 #include <arpa/inet.h>
 #include <netinet/tcp.h>
 #include <sys/epoll.h>
+#include <sys/uio.h>
 #include <fcntl.h>
 #include <errno.h>
 
@@ -24,10 +26,40 @@
 #include "util.h"
 
 static void requeue_request(struct request *req);
+static void queue_request(struct request *req);
+
+static struct recovery_wait_stat recovery_wait_stat;
+
+static void account_recovery_wait(struct request *req)
+{
+	struct recovery_wait_stat *stat = &recovery_wait_stat;
+	uint64_t us;
+	int i;
+
+	if (!req->wait_time)
+		return;
+
+	us = get_usec_time() - req->wait_time;
+	req->wait_time = 0;
+
+	stat->nr_waits++;
+	stat->total_us += us;
+	stat->max_us = max(stat->max_us, us);
+	for (i = 0; i < SD_NR_WAIT_BUCKETS - 1; i++)
+		if (us < (UINT64_C(1000) << i))
+			break;
+	stat->buckets[i]++;
+}
+
+void get_recovery_wait_stat(struct recovery_wait_stat *stat)
+{
+	*stat = recovery_wait_stat;
+}
 
 static void del_requeue_request(struct request *req)
 {
 	list_del(&req->request_list);
+	account_recovery_wait(req);
 	requeue_request(req);
 }
 
@@ -38,8 +70,7 @@ static bool is_access_local(struct request *req, uint64_t oid)
 	int i;
 
 	nr_copies = get_req_copy_number(req);
-	oid_to_vnodes(req->vinfo->vnodes, req->vinfo->nr_vnodes, oid,
-		      nr_copies, obj_vnodes);
+	vinfo_oid_to_vnodes(req->vinfo, oid, nr_copies, obj_vnodes);
 
 	for (i = 0; i < nr_copies; i++) {
 		if (vnode_is_local(obj_vnodes[i]))
@@ -49,6 +80,66 @@ static bool is_access_local(struct request *req, uint64_t oid)
 	return false;
 }
 
+/*
+ * Foreground I/O latency
+ *
+ * A moving average of the latency of the gateway and peer requests from the
+ * clients and the other sheep, excluding the ones issued by recovery and the
+ * batched removes of the VDI deletion, which both back off when it rises.
+ * It's only updated in the main thread.
+ */
+#define FG_LATENCY_IDLE 1000000 /* usec without requests to read as idle */
+
+static uint64_t fg_latency, fg_latency_time;
+
+static void observe_latency(uint8_t opcode, uint64_t us)
+{
+	switch (opcode) {
+	case SD_OP_READ_OBJ:
+		metric_observe(MH_GATEWAY_READ, us);
+		break;
+	case SD_OP_WRITE_OBJ:
+	case SD_OP_CREATE_AND_WRITE_OBJ:
+		metric_observe(MH_GATEWAY_WRITE, us);
+		break;
+	case SD_OP_READ_PEER:
+		metric_observe(MH_PEER_READ, us);
+		break;
+	case SD_OP_WRITE_PEER:
+	case SD_OP_CREATE_AND_WRITE_PEER:
+		metric_observe(MH_PEER_WRITE, us);
+		break;
+	}
+}
+
+static void account_latency(struct request *req)
+{
+	uint64_t now;
+
+	if (!req->start_time)
+		return;
+
+	now = get_usec_time();
+	observe_latency(req->rq.opcode, now - req->start_time);
+	if (req->rq.flags & SD_FLAG_CMD_RECOVERY ||
+	    req->rq.opcode == SD_OP_REMOVE_PEERS)
+		return;
+
+	if (now - fg_latency_time > FG_LATENCY_IDLE)
+		fg_latency = now - req->start_time;
+	else
+		fg_latency = (fg_latency * 7 + now - req->start_time) / 8;
+	fg_latency_time = now;
+}
+
+/* Return the foreground latency in usec, 0 when idle */
+uint64_t foreground_latency(void)
+{
+	if (get_usec_time() - fg_latency_time > FG_LATENCY_IDLE)
+		return 0;
+	return fg_latency;
+}
+
 static void io_op_done(struct work *work)
 {
 	struct request *req = container_of(work, struct request, work);
@@ -67,6 +158,8 @@ static void io_op_done(struct work *work)
 		break;
 	}
 
+	trace_req_stage(req, SD_REQ_STAGE_DONE);
+	account_latency(req);
 	put_request(req);
 	return;
 }
@@ -98,6 +191,29 @@ static inline void sleep_on_wait_queue(struct request *req)
 	list_add_tail(&req->request_list, &sys->req_wait_queue);
 }
 
+/*
+ * The requests of the cases 3 and 4 are hashed by the oid, so that the
+ * recovery of an object only walks the requests which may wait for it.
+ */
+static inline struct list_head *oid_wait_queue(uint64_t oid)
+{
+	return sys->req_oid_wait_queue +
+		fnv_64a_buf(&oid, sizeof(oid), FNV1A_64_INIT) %
+		REQ_OID_WAIT_QUEUES;
+}
+
+static inline void sleep_on_oid_wait_queue(struct request *req)
+{
+	list_add_tail(&req->request_list, oid_wait_queue(req->local_oid));
+}
+
+static void finish_gateway_request(struct request *req)
+{
+	qos_done(req);
+	account_latency(req);
+	put_request(req);
+}
+
 static void gateway_op_done(struct work *work)
 {
 	struct request *req = container_of(work, struct request, work);
@@ -137,7 +253,10 @@ static void gateway_op_done(struct work *work)
 		break;
 	}
 
-	put_request(req);
+	trace_req_stage(req, SD_REQ_STAGE_DONE);
+	if (inode_cache_write_end(req))
+		return;
+	finish_gateway_request(req);
 	return;
 retry:
 	requeue_request(req);
@@ -152,6 +271,7 @@ static void local_op_done(struct work *work)
 						 &req->rp, req->data);
 	}
 
+	trace_req_stage(req, SD_REQ_STAGE_DONE);
 	put_request(req);
 }
 
@@ -197,13 +317,19 @@ static bool request_in_recovery(struct request *req)
 	if (oid_in_recovery(req->local_oid) &&
 	    !(req->rq.flags & SD_FLAG_CMD_RECOVERY)) {
 		sd_dprintf("%"PRIx64" wait on oid", req->local_oid);
-		sleep_on_wait_queue(req);
+		req->wait_time = get_usec_time();
+		sleep_on_oid_wait_queue(req);
 		return true;
 	}
 	return false;
 }
 
-/* Wakeup requests because of epoch mismatch */
+/*
+ * Wakeup requests because of epoch mismatch
+ *
+ * Only the requests which wait for an epoch we have reached are requeued,
+ * the others would just go back to sleep.
+ */
 void wakeup_requests_on_epoch(void)
 {
 	struct request *req, *t;
@@ -219,9 +345,10 @@ void wakeup_requests_on_epoch(void)
 			 * its epoch changes.
 			 */
 			assert(is_gateway_op(req->op));
+			if (before(sys->epoch, req->rp.epoch))
+				continue;
 			sd_dprintf("gateway %"PRIx64, req->rq.obj.oid);
 			req->rq.epoch = sys->epoch;
-			del_requeue_request(req);
 			break;
 		case SD_RES_NEW_NODE_VER:
 			/*
@@ -229,12 +356,15 @@ void wakeup_requests_on_epoch(void)
 			 * changes.
 			 */
 			assert(!is_gateway_op(req->op));
+			if (before(sys->epoch, req->rq.epoch))
+				continue;
 			sd_dprintf("peer %"PRIx64, req->rq.obj.oid);
-			del_requeue_request(req);
 			break;
 		default:
-			break;
+			continue;
 		}
+		recovery_wait_stat.wakeups[SD_WAKEUP_EPOCH]++;
+		del_requeue_request(req);
 	}
 
 	list_splice_init(&pending_list, &sys->req_wait_queue);
@@ -243,33 +373,45 @@ void wakeup_requests_on_epoch(void)
 /* Wakeup the requests on the oid that was previously being recoverred */
 void wakeup_requests_on_oid(uint64_t oid)
 {
+	struct list_head *queue = oid_wait_queue(oid);
 	struct request *req, *t;
 	LIST_HEAD(pending_list);
 
-	list_splice_init(&sys->req_wait_queue, &pending_list);
+	list_splice_init(queue, &pending_list);
 
 	list_for_each_entry_safe(req, t, &pending_list, request_list) {
 		if (req->local_oid != oid)
 			continue;
 		sd_dprintf("retry %" PRIx64, req->local_oid);
+		recovery_wait_stat.wakeups[SD_WAKEUP_OID]++;
 		del_requeue_request(req);
 	}
-	list_splice_init(&pending_list, &sys->req_wait_queue);
+	list_splice_init(&pending_list, queue);
 }
 
-void wakeup_all_requests(void)
+static void wakeup_queue(struct list_head *queue)
 {
 	struct request *req, *n;
 	LIST_HEAD(pending_list);
 
-	list_splice_init(&sys->req_wait_queue, &pending_list);
+	list_splice_init(queue, &pending_list);
 
 	list_for_each_entry_safe(req, n, &pending_list, request_list) {
 		sd_dprintf("%"PRIx64, req->rq.obj.oid);
+		recovery_wait_stat.wakeups[SD_WAKEUP_ALL]++;
 		del_requeue_request(req);
 	}
 }
 
+void wakeup_all_requests(void)
+{
+	int i;
+
+	wakeup_queue(&sys->req_wait_queue);
+	for (i = 0; i < REQ_OID_WAIT_QUEUES; i++)
+		wakeup_queue(&sys->req_oid_wait_queue[i]);
+}
+
 static void queue_peer_request(struct request *req)
 {
 	req->local_oid = req->rq.obj.oid;
@@ -285,13 +427,26 @@ static void queue_peer_request(struct request *req)
 
 	req->work.fn = do_process_work;
 	req->work.done = io_op_done;
-	queue_work(sys->io_wqueue, &req->work);
+	trace_req_stage(req, SD_REQ_STAGE_QUEUED);
+	/* chained writes wait for the next replica, see gateway_chain_obj() */
+	if (req->rq.flags & SD_FLAG_CMD_CHAIN)
+		queue_work(sys->gateway_wqueue, &req->work);
+	else
+		queue_work(md_get_io_wqueue(req->local_oid), &req->work);
 }
 
-static void queue_gateway_request(struct request *req)
+void queue_gateway_request(struct request *req)
 {
 	struct sd_req *hdr = &req->rq;
 
+	if (qos_hold(req))
+		return;
+
+	if (sys->write_quorum && gateway_hold_request(req))
+		return;
+
+	inode_cache_write_begin(req);
+
 	if (is_access_local(req, hdr->obj.oid))
 		req->local_oid = hdr->obj.oid;
 
@@ -310,13 +465,110 @@ static void queue_gateway_request(struct request *req)
 queue_work:
 	req->work.fn = do_process_work;
 	req->work.done = gateway_op_done;
+	trace_req_stage(req, SD_REQ_STAGE_QUEUED);
+	if (sys->async_gateway && gateway_async_request(req))
+		return;
 	queue_work(sys->gateway_wqueue, &req->work);
 }
 
+/*
+ * Split a vectored request into one gateway request per object.
+ *
+ * The children point into the data buffer of the parent and take the normal
+ * gateway path, so they are forwarded to their target nodes concurrently and
+ * retried on their own.  Each child holds a reference to the parent, which is
+ * answered when the last child is done.
+ */
+static void queue_vec_request(struct request *req)
+{
+	struct sd_req *hdr = &req->rq;
+	struct sd_vec_entry *vec = req->data;
+	uint64_t list_size = sd_vec_list_size(hdr), len = list_size;
+	bool write = hdr->opcode == SD_OP_WRITE_OBJS;
+	char *p;
+	int i;
+
+	if (!hdr->vec.nr || list_size > req->data_length) {
+		sd_eprintf("invalid number of entries %"PRIu32", %u",
+			   hdr->vec.nr, req->data_length);
+		goto invalid;
+	}
+
+	for (i = 0; i < hdr->vec.nr; i++)
+		len += vec[i].length;
+	if (len != req->data_length) {
+		sd_eprintf("invalid data length %u, expected %"PRIu64,
+			   req->data_length, len);
+		goto invalid;
+	}
+
+	req->rp.data_length = write ? list_size : req->data_length;
+	p = (char *)req->data + list_size;
+	for (i = 0; i < hdr->vec.nr; i++) {
+		struct request *child = xzalloc(sizeof(*child));
+		struct sd_req *rq = &child->rq;
+
+		/* proto_ver is left zero so that reads are never trimmed */
+		if (!write)
+			rq->opcode = SD_OP_READ_OBJ;
+		else if (vec[i].flags & SD_VEC_CREATE)
+			rq->opcode = SD_OP_CREATE_AND_WRITE_OBJ;
+		else
+			rq->opcode = SD_OP_WRITE_OBJ;
+		rq->flags = hdr->flags & (SD_FLAG_CMD_CACHE | SD_FLAG_CMD_DIRECT);
+		if (write)
+			rq->flags |= SD_FLAG_CMD_WRITE;
+		if (vec[i].cow_oid)
+			rq->flags |= SD_FLAG_CMD_COW;
+		rq->id = hdr->id;
+		rq->data_length = vec[i].length;
+		rq->obj.oid = vec[i].oid;
+		rq->obj.cow_oid = vec[i].cow_oid;
+		rq->obj.offset = vec[i].offset;
+		rq->obj.copies = hdr->vec.copies;
+
+		child->data = p;
+		child->data_length = vec[i].length;
+		child->vec_parent = req;
+		child->vec_entry = vec + i;
+		INIT_LIST_HEAD(&child->request_list);
+		uatomic_set(&child->refcnt, 1);
+
+		vec[i].result = SD_RES_SUCCESS;
+		uatomic_inc(&req->refcnt);
+		queue_request(child);
+		p += vec[i].length;
+	}
+
+	put_request(req);
+	return;
+invalid:
+	req->rp.result = SD_RES_INVALID_PARMS;
+	put_request(req);
+}
+
+static void finish_vec_request(struct request *req)
+{
+	struct request *parent = req->vec_parent;
+	int ret = req->rp.result;
+
+	req->vec_entry->result = ret;
+	if (ret != SD_RES_SUCCESS) {
+		sd_dprintf("%"PRIx64" failed, %s", req->rq.obj.oid,
+			   sd_strerror(ret));
+		parent->rp.result = ret;
+	}
+
+	put_vnode_info(req->vinfo);
+	free(req);
+	put_request(parent);
+}
+
 static void queue_local_request(struct request *req)
 {
 	req->work.fn = do_process_work;
 	req->work.done = local_op_done;
+	trace_req_stage(req, SD_REQ_STAGE_QUEUED);
 	queue_work(sys->io_wqueue, &req->work);
 }
 
@@ -392,7 +644,10 @@ static void queue_request(struct request *req)
 		queue_peer_request(req);
 	} else if (is_gateway_op(req->op)) {
 		hdr->epoch = sys->epoch;
-		queue_gateway_request(req);
+		if (is_vectored_op(req->op))
+			queue_vec_request(req);
+		else
+			queue_gateway_request(req);
 	} else if (is_local_op(req->op)) {
 		hdr->epoch = sys->epoch;
 		queue_local_request(req);
@@ -420,6 +675,7 @@ static void requeue_request(struct request *req)
 }
 
 static void clear_client_info(struct client_info *ci);
+static void destroy_client(struct client_info *ci);
 
 static struct request *alloc_local_request(void *data, int data_length)
 {
@@ -487,20 +743,144 @@ again:
 	return ret;
 }
 
+/*
+ * Queue the request locally from the main thread without waiting for it, it
+ * is freed when done.  The request can't carry any data.  'deferred_req', if
+ * any, is a gateway request whose ack waits for this one to be done.
+ */
+void queue_local_req_nowait(const struct sd_req *rq,
+			    struct request *deferred_req)
+{
+	struct request *req;
+
+	req = alloc_local_request(NULL, 0);
+	req->rq = *rq;
+	req->local_req_efd = -1;
+	req->deferred_req = deferred_req;
+
+	queue_request(req);
+}
+
+/*
+ * Client requests and their payloads are allocated in begin_rx() and freed
+ * in finish_tx() or clear_client_info(), both of which run in the thread
+ * serving the client, so the pools below are per thread and need no locking.
+ * Payloads are kept in a few size classes of page aligned buffers that can go
+ * straight to O_DIRECT.
+ */
+struct buf_pool {
+	size_t size;
+	int max_cached;
+	int prealloc;
+
+	int nr_cached;
+	void **cached;
+
+	uint64_t nr_hit;
+	uint64_t nr_miss;
+};
+
+static __thread struct buf_pool buf_pools[] = {
+	{ .size = 4096, .max_cached = 256, .prealloc = 64, },
+	{ .size = 64 * 1024, .max_cached = 64, .prealloc = 16, },
+	{ .size = 512 * 1024, .max_cached = 16, .prealloc = 4, },
+	{ .size = SD_DATA_OBJ_SIZE, .max_cached = 8, .prealloc = 4, },
+};
+
+#define MAX_CACHED_REQS 1024
+
+static __thread int nr_cached_reqs;
+static __thread struct request *cached_reqs[MAX_CACHED_REQS];
+static __thread uint64_t nr_req_hit, nr_req_miss;
+
+static struct buf_pool *find_buf_pool(size_t size)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(buf_pools); i++)
+		if (size <= buf_pools[i].size)
+			return buf_pools + i;
+	return NULL;
+}
+
+static void *alloc_req_data(size_t size)
+{
+	struct buf_pool *pool = find_buf_pool(size);
+
+	if (!pool)
+		return valloc(size);
+
+	if (pool->nr_cached) {
+		pool->nr_hit++;
+		return pool->cached[--pool->nr_cached];
+	}
+	pool->nr_miss++;
+	return valloc(pool->size);
+}
+
+static void free_req_data(void *data, size_t size)
+{
+	struct buf_pool *pool = find_buf_pool(size);
+
+	if (pool && pool->nr_cached < pool->max_cached)
+		pool->cached[pool->nr_cached++] = data;
+	else
+		free(data);
+}
+
+void init_request_pool(void)
+{
+	int i, j;
+
+	for (i = 0; i < ARRAY_SIZE(buf_pools); i++) {
+		struct buf_pool *pool = buf_pools + i;
+
+		pool->cached = xzalloc(sizeof(void *) * pool->max_cached);
+		for (j = 0; j < pool->prealloc; j++) {
+			void *buf = valloc(pool->size);
+
+			if (!buf)
+				break;
+			pool->cached[pool->nr_cached++] = buf;
+		}
+	}
+}
+
+void request_pool_stat(void)
+{
+	int i;
+
+	sd_iprintf("request: hit %"PRIu64", miss %"PRIu64, nr_req_hit,
+		   nr_req_miss);
+	for (i = 0; i < ARRAY_SIZE(buf_pools); i++)
+		sd_iprintf("buffer %zu: hit %"PRIu64", miss %"PRIu64
+			   ", cached %d", buf_pools[i].size,
+			   buf_pools[i].nr_hit, buf_pools[i].nr_miss,
+			   buf_pools[i].nr_cached);
+}
+
 static struct request *alloc_request(struct client_info *ci, int data_length)
 {
 	struct request *req;
 
-	req = zalloc(sizeof(struct request));
-	if (!req)
-		return NULL;
+	if (nr_cached_reqs) {
+		nr_req_hit++;
+		req = cached_reqs[--nr_cached_reqs];
+		memset(req, 0, sizeof(*req));
+	} else {
+		nr_req_miss++;
+		req = zalloc(sizeof(struct request));
+		if (!req)
+			return NULL;
+	}
 
 	req->ci = ci;
 	ci->refcnt++;
 	if (data_length) {
 		req->data_length = data_length;
-		req->data = valloc(data_length);
+		req->data = alloc_req_data(data_length);
 		if (!req->data) {
+			ci->refcnt--;
 			free(req);
 			return NULL;
 		}
@@ -508,6 +888,8 @@ static struct request *alloc_request(struct client_info *ci, int data_length)
 
 	INIT_LIST_HEAD(&req->request_list);
 	uatomic_set(&req->refcnt, 1);
+	req->start_time = get_usec_time();
+	reqtrace_start(req);
 
 	uatomic_inc(&sys->nr_outstanding_reqs);
 
@@ -517,11 +899,65 @@ static struct request *alloc_request(struct client_info *ci, int data_length)
 static void free_request(struct request *req)
 {
 	uatomic_dec(&sys->nr_outstanding_reqs);
+	reqtrace_finish(req);
 
 	req->ci->refcnt--;
 	put_vnode_info(req->vinfo);
-	free(req->data);
-	free(req);
+	if (req->data)
+		free_req_data(req->data, req->data_length);
+	if (nr_cached_reqs < MAX_CACHED_REQS)
+		cached_reqs[nr_cached_reqs++] = req;
+	else
+		free(req);
+}
+
+/*
+ * With -e, the client connections are spread over nr_net_loops threads which
+ * run their own event loop for the rx and tx of their clients.  Requests are
+ * still queued and completed in the main thread: the loops hand the received
+ * ones over through the local request queue, and get the finished ones back
+ * through done_reqs.
+ */
+struct listen_info {
+	bool is_inet_socket;
+	/* the loop which accepts and serves the clients itself, if any */
+	struct net_loop *loop;
+};
+
+#define MAX_LOOP_LISTEN_FDS 8
+
+struct net_loop {
+	pthread_t thread;
+	int efd;
+
+	pthread_mutex_t lock;
+	struct list_head new_clients;
+	struct list_head done_reqs;
+
+	/*
+	 * The fds of a transport which epoll can't watch, e.g. rsockets, are
+	 * served by a loop of their own, polling with the transport, which
+	 * listens on the ports of the transport too.
+	 */
+	const struct sd_transport *tp;
+	struct listen_info li;
+	int nr_listen_fds;
+	int listen_fds[MAX_LOOP_LISTEN_FDS];
+};
+
+#define NET_LOOP_EPOLL_SIZE 4096
+
+static struct net_loop *net_loops;
+
+static void net_loop_done(struct net_loop *loop, struct request *req)
+{
+	eventfd_t value = 1;
+
+	pthread_mutex_lock(&loop->lock);
+	list_add_tail(&req->request_list, &loop->done_reqs);
+	pthread_mutex_unlock(&loop->lock);
+
+	eventfd_write(loop->efd, value);
 }
 
 void put_request(struct request *req)
@@ -532,9 +968,17 @@ void put_request(struct request *req)
 	if (uatomic_sub_return(&req->refcnt, 1) > 0)
 		return;
 
-	if (req->local)
+	if (req->vec_parent) {
+		finish_vec_request(req);
+	} else if (req->local && req->local_req_efd < 0) {
+		if (req->deferred_req)
+			finish_gateway_request(req->deferred_req);
+		free_local_request(req);
+	} else if (req->local) {
 		eventfd_write(req->local_req_efd, value);
-	else {
+	} else if (ci->loop) {
+		net_loop_done(ci->loop, req);
+	} else {
 		if (conn_tx_on(&ci->conn)) {
 			clear_client_info(ci);
 			free_request(req);
@@ -552,7 +996,53 @@ static void init_rx_hdr(struct client_info *ci)
 	ci->conn.rx_buf = &ci->conn.rx_hdr;
 }
 
-static inline int begin_rx(struct client_info *ci)
+/*
+ * Receive into the current rx target from the buffered bytes, refilling the
+ * buffer with a single read per event.  Clients with a deep queue send many
+ * requests back to back, so one read usually brings all of them in.
+ * Payloads too big for the buffer are read straight into the request.
+ */
+static int client_rx(struct client_info *ci, enum conn_state next_state,
+		     bool *refilled)
+{
+	struct connection *conn = &ci->conn;
+	int ret, len;
+
+	if (ci->rx_cache_off == ci->rx_cache_len) {
+		if (*refilled)
+			return 0;
+		*refilled = true;
+
+		if (conn->rx_length >= CLIENT_RX_BUF_SIZE)
+			return rx(conn, next_state);
+
+		ret = net_read(conn->fd, ci->rx_cache, CLIENT_RX_BUF_SIZE);
+		if (!ret) {
+			conn->c_rx_state = C_IO_CLOSED;
+			return 0;
+		}
+		if (ret < 0) {
+			if (errno != EAGAIN && errno != EINTR)
+				conn->c_rx_state = C_IO_CLOSED;
+			return 0;
+		}
+		ci->rx_cache_off = 0;
+		ci->rx_cache_len = ret;
+	}
+
+	len = min(conn->rx_length, ci->rx_cache_len - ci->rx_cache_off);
+	memcpy(conn->rx_buf, ci->rx_cache + ci->rx_cache_off, len);
+	ci->rx_cache_off += len;
+
+	conn->rx_length -= len;
+	conn->rx_buf = (char *)conn->rx_buf + len;
+	if (!conn->rx_length)
+		conn->c_rx_state = next_state;
+
+	return len;
+}
+
+static inline int begin_rx(struct client_info *ci, bool *refilled)
 {
 	int ret;
 	uint64_t data_len;
@@ -562,7 +1052,7 @@ static inline int begin_rx(struct client_info *ci)
 
 	switch (conn->c_rx_state) {
 	case C_IO_HEADER:
-		ret = rx(conn, C_IO_DATA_INIT);
+		ret = client_rx(ci, C_IO_DATA_INIT, refilled);
 		if (!ret || conn->c_rx_state != C_IO_DATA_INIT)
 			break;
 	case C_IO_DATA_INIT:
@@ -578,16 +1068,20 @@ static inline int begin_rx(struct client_info *ci)
 		/* use le_to_cpu */
 		memcpy(&req->rq, hdr, sizeof(req->rq));
 
-		if (data_len && hdr->flags & SD_FLAG_CMD_WRITE) {
-			conn->c_rx_state = C_IO_DATA;
+		if (data_len && hdr->flags & SD_FLAG_CMD_WRITE)
 			conn->rx_length = data_len;
-			conn->rx_buf = req->data;
-		} else {
+		else if (data_len && hdr->opcode == SD_OP_READ_OBJS &&
+			 hdr->vec.nr)
+			/* vectored reads send the entries only */
+			conn->rx_length = min(data_len, sd_vec_list_size(hdr));
+		else {
 			conn->c_rx_state = C_IO_END;
 			break;
 		}
+		conn->c_rx_state = C_IO_DATA;
+		conn->rx_buf = req->data;
 	case C_IO_DATA:
-		ret = rx(conn, C_IO_END);
+		ret = client_rx(ci, C_IO_END, refilled);
 		break;
 	default:
 		sd_eprintf("bug: unknown state %d", conn->c_rx_state);
@@ -605,87 +1099,116 @@ static inline int begin_rx(struct client_info *ci)
 	return 0;
 }
 
-static inline void finish_rx(struct client_info *ci)
+static inline void finish_rx(struct client_info *ci, struct list_head *reqs)
 {
 	struct request *req;
 
 	req = ci->rx_req;
 	init_rx_hdr(ci);
+	trace_req_stage(req, SD_REQ_STAGE_RX);
 
 	sd_dprintf("%d, %s:%d", ci->conn.fd, ci->conn.ipstr, ci->conn.port);
-	queue_request(req);
+	if (ci->loop)
+		list_add_tail(&req->request_list, reqs);
+	else
+		queue_request(req);
 }
 
 static void do_client_rx(struct client_info *ci)
 {
-	if (begin_rx(ci) < 0)
-		return;
+	bool refilled = false;
+	eventfd_t value = 1;
+	LIST_HEAD(reqs);
 
-	finish_rx(ci);
+	/* queue_request() may drop the last reference of a dead client */
+	ci->refcnt++;
+	while (begin_rx(ci, &refilled) == 0)
+		finish_rx(ci, &reqs);
+
+	/* the main thread queues the requests received by the loops */
+	if (!list_empty(&reqs)) {
+		pthread_mutex_lock(&sys->local_req_lock);
+		list_splice_tail_init(&reqs, &sys->local_req_queue);
+		pthread_mutex_unlock(&sys->local_req_lock);
+		eventfd_write(sys->local_req_efd, value);
+	}
+
+	if (--ci->refcnt == 0 && is_conn_dead(&ci->conn))
+		destroy_client(ci);
 }
 
-static void init_tx_hdr(struct client_info *ci)
+/* Put as many finished requests as fit into one writev() */
+static void init_tx_batch(struct client_info *ci)
 {
-	struct sd_rsp *rsp = (struct sd_rsp *)&ci->conn.tx_hdr;
 	struct request *req;
+	struct sd_rsp *rsp;
+	struct iovec *iov = ci->tx_iov;
+	int nr_reqs = uatomic_read(&sys->nr_outstanding_reqs);
 
 	assert(!list_empty(&ci->done_reqs));
 
-	memset(rsp, 0, sizeof(*rsp));
+	while (!list_empty(&ci->done_reqs) &&
+	       ci->nr_tx_reqs < CLIENT_TX_BATCH) {
+		req = list_first_entry(&ci->done_reqs, struct request,
+				       request_list);
+		list_del(&req->request_list);
 
-	req = list_first_entry(&ci->done_reqs, struct request, request_list);
-	list_del(&req->request_list);
+		rsp = ci->tx_hdrs + ci->nr_tx_reqs;
+		ci->tx_reqs[ci->nr_tx_reqs++] = req;
 
-	ci->tx_req = req;
-	ci->conn.tx_length = sizeof(*rsp);
-	ci->conn.c_tx_state = C_IO_HEADER;
-	ci->conn.tx_buf = rsp;
+		/* use cpu_to_le */
+		memcpy(rsp, &req->rp, sizeof(*rsp));
 
-	/* use cpu_to_le */
-	memcpy(rsp, &req->rp, sizeof(*rsp));
+		rsp->epoch = sys->epoch;
+		rsp->opcode = req->rq.opcode;
+		rsp->id = req->rq.id;
+		/* for the read routing of the gateways, not counting us */
+		if (req->rq.opcode == SD_OP_READ_PEER ||
+		    req->rq.opcode == SD_OP_READ_OBJ)
+			rsp->obj.load = nr_reqs - 1;
 
-	rsp->epoch = sys->epoch;
-	rsp->opcode = req->rq.opcode;
-	rsp->id = req->rq.id;
+		iov->iov_base = rsp;
+		iov->iov_len = sizeof(*rsp);
+		iov++;
+		if (rsp->data_length) {
+			iov->iov_base = req->data;
+			iov->iov_len = rsp->data_length;
+			iov++;
+		}
+	}
+
+	ci->tx_iov_idx = 0;
+	ci->nr_tx_iov = iov - ci->tx_iov;
 }
 
-static inline int begin_tx(struct client_info *ci)
+static int begin_tx(struct client_info *ci)
 {
-	int ret, opt;
-	struct sd_rsp *rsp = (struct sd_rsp *)&ci->conn.tx_hdr;
+	struct iovec *iov;
+	ssize_t ret;
 
-	/* If short send happens, we don't need init hdr */
-	if (!ci->tx_req)
-		init_tx_hdr(ci);
+	/* If short send happens, we don't need init the batch */
+	if (!ci->nr_tx_reqs)
+		init_tx_batch(ci);
 
-	opt = 1;
-	setsockopt(ci->conn.fd, SOL_TCP, TCP_CORK, &opt, sizeof(opt));
+	ret = net_writev(ci->conn.fd, ci->tx_iov + ci->tx_iov_idx,
+		     ci->nr_tx_iov - ci->tx_iov_idx);
+	if (ret < 0) {
+		if (errno != EAGAIN && errno != EINTR)
+			ci->conn.c_tx_state = C_IO_CLOSED;
+		ret = 0;
+	}
 
-	switch (ci->conn.c_tx_state) {
-	case C_IO_HEADER:
-		ret = tx(&ci->conn, C_IO_DATA_INIT);
-		if (!ret)
-			break;
-
-		if (rsp->data_length) {
-			ci->conn.tx_length = rsp->data_length;
-			ci->conn.tx_buf = ci->tx_req->data;
-			ci->conn.c_tx_state = C_IO_DATA;
-		} else {
-			ci->conn.c_tx_state = C_IO_END;
+	while (ret > 0) {
+		iov = ci->tx_iov + ci->tx_iov_idx;
+		if (ret < iov->iov_len) {
+			iov->iov_base = (char *)iov->iov_base + ret;
+			iov->iov_len -= ret;
 			break;
 		}
-	case C_IO_DATA:
-		ret = tx(&ci->conn, C_IO_END);
-		if (!ret)
-			break;
-	default:
-		break;
+		ret -= iov->iov_len;
+		ci->tx_iov_idx++;
 	}
 
-	opt = 0;
-	setsockopt(ci->conn.fd, SOL_TCP, TCP_CORK, &opt, sizeof(opt));
-
 	if (is_conn_dead(&ci->conn)) {
 		clear_client_info(ci);
 		return -1;
@@ -696,21 +1219,27 @@ static inline int begin_tx(struct client_info *ci)
 /* Return 1 if short send happens or we have more data to send */
 static inline int finish_tx(struct client_info *ci)
 {
-	/* Finish sending one response */
-	if (ci->conn.c_tx_state == C_IO_END) {
-		sd_dprintf("connection from: %d, %s:%d", ci->conn.fd,
-			   ci->conn.ipstr, ci->conn.port);
-		free_request(ci->tx_req);
-		ci->tx_req = NULL;
+	int i;
+
+	/* Finish sending the batch of responses */
+	if (ci->tx_iov_idx == ci->nr_tx_iov) {
+		sd_dprintf("connection from: %d, %s:%d, %d responses",
+			   ci->conn.fd, ci->conn.ipstr, ci->conn.port,
+			   ci->nr_tx_reqs);
+		for (i = 0; i < ci->nr_tx_reqs; i++) {
+			trace_req_stage(ci->tx_reqs[i], SD_REQ_STAGE_TX);
+			free_request(ci->tx_reqs[i]);
+		}
+		ci->nr_tx_reqs = 0;
 	}
-	if (ci->tx_req || !list_empty(&ci->done_reqs))
+	if (ci->nr_tx_reqs || !list_empty(&ci->done_reqs))
 		return 1;
 	return 0;
 }
 
 static void do_client_tx(struct client_info *ci)
 {
-	if (!ci->tx_req && list_empty(&ci->done_reqs)) {
+	if (!ci->nr_tx_reqs && list_empty(&ci->done_reqs)) {
 		if (conn_tx_off(&ci->conn))
 			clear_client_info(ci);
 		return;
@@ -730,13 +1259,15 @@ static void do_client_tx(struct client_info *ci)
 static void destroy_client(struct client_info *ci)
 {
 	sd_dprintf("connection from: %s:%d", ci->conn.ipstr, ci->conn.port);
-	close(ci->conn.fd);
+	net_close(ci->conn.fd);
+	free(ci->rx_cache);
 	free(ci);
 }
 
 static void clear_client_info(struct client_info *ci)
 {
 	struct request *req, *t;
+	int i;
 
 	sd_dprintf("connection seems to be dead");
 
@@ -745,10 +1276,9 @@ static void clear_client_info(struct client_info *ci)
 		ci->rx_req = NULL;
 	}
 
-	if (ci->tx_req) {
-		free_request(ci->tx_req);
-		ci->tx_req = NULL;
-	}
+	for (i = 0; i < ci->nr_tx_reqs; i++)
+		free_request(ci->tx_reqs[i]);
+	ci->nr_tx_reqs = 0;
 
 	list_for_each_entry_safe(req, t, &ci->done_reqs, request_list) {
 		list_del(&req->request_list);
@@ -776,8 +1306,17 @@ static struct client_info *create_client(int fd, struct cluster_info *cluster)
 	if (!ci)
 		return NULL;
 
-	if (getpeername(fd, (struct sockaddr *)&from, &namesize))
+	ci->rx_cache = malloc(CLIENT_RX_BUF_SIZE);
+	if (!ci->rx_cache) {
+		free(ci);
 		return NULL;
+	}
+
+	if (net_getpeername(fd, (struct sockaddr *)&from, &namesize)) {
+		free(ci->rx_cache);
+		free(ci);
+		return NULL;
+	}
 
 	switch (from.ss_family) {
 	case AF_INET:
@@ -826,7 +1365,7 @@ static void listen_handler(int listen_fd, int events, void *data)
 	socklen_t namesize;
 	int fd, ret;
 	struct client_info *ci;
-	bool is_inet_socket = *(bool *)data;
+	struct listen_info *li = data;
 
 	if (sys->status == SD_STATUS_SHUTDOWN) {
 		sd_dprintf("unregistering connection %d", listen_fd);
@@ -835,29 +1374,43 @@ static void listen_handler(int listen_fd, int events, void *data)
 	}
 
 	namesize = sizeof(from);
-	fd = accept(listen_fd, (struct sockaddr *)&from, &namesize);
+	fd = net_accept(listen_fd, (struct sockaddr *)&from, &namesize);
 	if (fd < 0) {
 		sd_eprintf("failed to accept a new connection: %m");
 		return;
 	}
 
-	if (is_inet_socket) {
+	if (li->is_inet_socket) {
 		ret = set_nodelay(fd);
 		if (ret) {
-			close(fd);
+			net_close(fd);
 			return;
 		}
 	}
 
 	ret = set_nonblocking(fd);
-	if (ret) {
-		close(fd);
+	if (ret)
 		return;
-	}
 
-	ci = create_client(fd, data);
+	ci = create_client(fd, NULL);
 	if (!ci) {
-		close(fd);
+		net_close(fd);
+		return;
+	}
+
+	if (li->loop)
+		ci->loop = li->loop;
+	else if (sys->nr_net_loops) {
+		struct net_loop *loop = net_loops + fd % sys->nr_net_loops;
+		eventfd_t value = 1;
+
+		ci->loop = loop;
+		pthread_mutex_lock(&loop->lock);
+		list_add_tail(&ci->loop_list, &loop->new_clients);
+		pthread_mutex_unlock(&loop->lock);
+		eventfd_write(loop->efd, value);
+		sd_dprintf("accepted a new connection: %d, loop %d", fd,
+			   (int)(loop - net_loops));
 		return;
 	}
 
@@ -877,22 +1430,161 @@ static int create_listen_port_fn(int fd, void *data)
 
 int create_listen_port(char *bindaddr, int port)
 {
-	static bool is_inet_socket = true;
+	static struct listen_info li = { .is_inet_socket = true };
 
 	return create_listen_ports(bindaddr, port, create_listen_port_fn,
-				   &is_inet_socket);
+				   &li);
 }
 
 int init_unix_domain_socket(const char *dir)
 {
-	static bool is_inet_socket = false;
+	static struct listen_info li = { .is_inet_socket = false };
 	char unix_path[PATH_MAX];
 
 	snprintf(unix_path, sizeof(unix_path), "%s/sock", dir);
 	unlink(unix_path);
 
 	return create_unix_domain_socket(unix_path, create_listen_port_fn,
-					 &is_inet_socket);
+					 &li);
+}
+
+static void net_loop_handler(int fd, int events, void *data)
+{
+	struct net_loop *loop = data;
+	struct client_info *ci, *n;
+	struct request *req, *t;
+	LIST_HEAD(new_clients);
+	LIST_HEAD(done_reqs);
+	eventfd_t value;
+
+	if (eventfd_read(fd, &value) < 0)
+		return;
+
+	pthread_mutex_lock(&loop->lock);
+	list_splice_init(&loop->new_clients, &new_clients);
+	list_splice_init(&loop->done_reqs, &done_reqs);
+	pthread_mutex_unlock(&loop->lock);
+
+	list_for_each_entry_safe(ci, n, &new_clients, loop_list) {
+		list_del(&ci->loop_list);
+		if (register_event(ci->conn.fd, client_handler, ci))
+			destroy_client(ci);
+	}
+
+	list_for_each_entry_safe(req, t, &done_reqs, request_list) {
+		list_del(&req->request_list);
+		ci = req->ci;
+		if (conn_tx_on(&ci->conn)) {
+			/* the client is gone, drop it with the last request */
+			free_request(req);
+			clear_client_info(ci);
+		} else
+			list_add(&req->request_list, &ci->done_reqs);
+	}
+}
+
+static void *net_loop_main(void *arg)
+{
+	struct net_loop *loop = arg;
+	int i, ret;
+
+	set_thread_name("net", true);
+	bind_thread("net");
+
+	if (loop->tp)
+		ret = init_event_transport(NET_LOOP_EPOLL_SIZE, loop->tp);
+	else
+		ret = init_event(NET_LOOP_EPOLL_SIZE);
+	if (ret < 0)
+		panic("failed to init the event loop");
+	init_request_pool();
+	if (register_event(loop->efd, net_loop_handler, loop) < 0)
+		panic("failed to register the loop eventfd");
+	for (i = 0; i < loop->nr_listen_fds; i++)
+		if (register_event(loop->listen_fds[i], listen_handler,
+				   &loop->li) < 0)
+			panic("failed to register the listen fd");
+
+	for (;;)
+		event_loop(-1);
+
+	return NULL;
+}
+
+/*
+ * The signals are left to the main thread, which may not have blocked them
+ * yet when the loop of a transport is started along with its listen ports.
+ */
+static int start_net_loop(struct net_loop *loop)
+{
+	sigset_t mask, old;
+	int ret;
+
+	pthread_mutex_init(&loop->lock, NULL);
+	INIT_LIST_HEAD(&loop->new_clients);
+	INIT_LIST_HEAD(&loop->done_reqs);
+	loop->efd = eventfd(0, EFD_NONBLOCK);
+	if (loop->efd < 0) {
+		sd_eprintf("failed to create an eventfd, %m");
+		return -1;
+	}
+
+	sigfillset(&mask);
+	pthread_sigmask(SIG_BLOCK, &mask, &old);
+	ret = pthread_create(&loop->thread, NULL, net_loop_main, loop);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (ret) {
+		sd_eprintf("failed to create a net loop, %s", strerror(ret));
+		return -1;
+	}
+
+	return 0;
+}
+
+int init_net_loops(int nr)
+{
+	int i;
+
+	net_loops = xzalloc(sizeof(*net_loops) * nr);
+	for (i = 0; i < nr; i++)
+		if (start_net_loop(net_loops + i) < 0)
+			return -1;
+	sys->nr_net_loops = nr;
+
+	return 0;
+}
+
+static int add_loop_listen_fd(int fd, void *data)
+{
+	struct net_loop *loop = data;
+
+	if (loop->nr_listen_fds == ARRAY_SIZE(loop->listen_fds))
+		return -1;
+	loop->listen_fds[loop->nr_listen_fds++] = fd;
+	return 0;
+}
+
+int create_transport_listen_port(char *bindaddr, int port,
+				 const struct sd_transport *tp)
+{
+	struct net_loop *loop;
+
+	if (tp->id == SD_TRANSPORT_TCP)
+		return create_listen_port(bindaddr, port);
+
+	loop = xzalloc(sizeof(*loop));
+	loop->tp = tp;
+	loop->li.is_inet_socket = true;
+	loop->li.loop = loop;
+	if (create_transport_listen_ports(tp, bindaddr, port,
+					  add_loop_listen_fd, loop)) {
+		free(loop);
+		return -1;
+	}
+
+	sd_printf(SDOG_INFO, "serving %s:%d over %s", bindaddr, port,
+		  tp->name);
+	return start_net_loop(loop);
 }
 
 static void local_req_handler(int listen_fd, int events, void *data)
@@ -32,36 +32,75 @@
 #include "trace/trace.h"
 #include "util.h"
 #include "option.h"
+#include "sha1.h"
+#include "crc32c.h"
+#include "fec.h"
 
 #define EPOLL_SIZE 4096
 #define DEFAULT_OBJECT_DIR "/tmp"
 #define LOG_FILE_NAME "sheep.log"
+#define MAX_MUX_CONNS 64
+#define MAX_NET_LOOPS 64
+#define MAX_URINGS 16
+#define DEFAULT_MUX_CONNS 4
+#define DEFAULT_OC_DIRTY_RATIO 10 /* percent */
+#define DEFAULT_OC_READAHEAD 8 /* objects */
+#define OC_PREFETCH_THREADS 4
+#define DEFAULT_RECOVERY_OBJS 16
+#define DEFAULT_RECOVERY_NODE_OBJS 4
+#define MAX_RECOVERY_OBJS 1024
+#define DEFAULT_TRACE_SAMPLE 64
 
 LIST_HEAD(cluster_drivers);
 static const char program_name[] = "sheep";
 
 static struct sd_option sheep_options[] = {
+	{'a', "async-gateway", false,
+	 "forward gateway requests without parking worker threads"},
+	{'A', "affinity", true,
+	 "bind the threads of a work queue or 'net' to CPUs, name=cpus"},
 	{'b', "bindaddr", true, "specify IP address of interface to listen on"},
 	{'c', "cluster", true, "specify the cluster driver"},
+	{'C', "chain", false,
+	 "pass the writes from replica to replica instead of to all of them"},
 	{'d', "debug", false, "include debug messages in the log"},
 	{'D', "directio", false, "use direct IO for backend store"},
+	{'e', "event-loops", true,
+	 "serve client connections from N event loop threads"},
 	{'f', "foreground", false, "make the program run in the foreground"},
 	{'F', "log-format", true, "specify log format"},
 	{'g', "gateway", false, "make the progam run as a gateway mode"},
 	{'h', "help", false, "display this help and exit"},
+	{'H', "hedge", true,
+	 "resend the remote reads slower than a percentile, pct=N[,min=us]"},
 	{'i', "ioaddr", true, "use separate network card to handle IO requests"},
 	{'j', "journal", true, "use jouranl file to log all the write operations"},
 	{'l', "loglevel", true, "specify the level of logging detail"},
+	{'m', "multiplex", true,
+	 "multiplex peer requests over N connections per node"},
 	{'n', "nosync", false, "drop SYNC for write, only used for testing purpose"},
 	{'o', "stdout", false, "log to stdout instead of shared logger"},
 	{'p', "port", true, "specify the TCP port on which to listen"},
 	{'P', "pidfile", true, "create a pid file"},
+	{'Q', "qos-depth", true,
+	 "share the gateway by the VDI weights above N requests in flight"},
+	{'r', "recovery", true, "specify how many objects to recover at once"},
 	{'s', "disk-space", true, "specify the free disk space in megabytes"},
+	{'S', "sparse", false, "don't allocate space for zero blocks of objects"},
+	{'t', "trace-sample", true,
+	 "trace the stages of one in N requests, 0 to disable"},
 	{'u', "upgrade", false, "upgrade to the latest data layout"},
+	{'U', "io-uring", true, "do backend object I/O through N io_uring rings"},
 	{'v', "version", false, "show the version"},
 	{'w', "enable-cache", true, "enable object cache"},
+	{'W', "write-quorum", true,
+	 "answer the writes after N replicas, the others finish in background"},
+	{'x', "dedup", true,
+	 "share the identical cold objects of the farm store after N seconds"},
 	{'y', "myaddr", true, "specify the address advertised to other sheep"},
 	{'z', "zone", true, "specify the zone id"},
+	{'Z', "compress", true,
+	 "compress the cold objects of the compressed VDIs after N seconds"},
 	{ 0, NULL, false, NULL },
 };
 
@@ -228,6 +267,75 @@ static void object_cache_directio_set(char *s)
 	sys->object_cache_directio = true;
 }
 
+static void object_cache_policy_set(char *s)
+{
+	const char *header = "policy=";
+	const char *policy = s + strlen(header);
+
+	assert(!strncmp(s, header, strlen(header)));
+
+	if (!strcmp(policy, "clock"))
+		sys->object_cache_policy = OC_POLICY_CLOCK;
+	else if (!strcmp(policy, "lru"))
+		sys->object_cache_policy = OC_POLICY_LRU;
+	else {
+		fprintf(stderr, "Invalid object cache option '%s': "
+			"policy must be clock or lru\n", s);
+		exit(1);
+	}
+}
+
+static void object_cache_dirty_ratio_set(char *s)
+{
+	const char *header = "dirty_ratio=";
+	char *ratio = s + strlen(header), *p;
+	unsigned long val;
+
+	assert(!strncmp(s, header, strlen(header)));
+
+	val = strtoul(ratio, &p, 10);
+	if (ratio == p || *p || val > 100) {
+		fprintf(stderr, "Invalid object cache option '%s': "
+			"dirty_ratio must be an integer between 0 and 100\n", s);
+		exit(1);
+	}
+	sys->object_cache_dirty_ratio = val;
+}
+
+static void object_cache_writeback_rate_set(char *s)
+{
+	const char *header = "writeback_rate=";
+	char *rate = s + strlen(header), *p;
+	unsigned long val;
+
+	assert(!strncmp(s, header, strlen(header)));
+
+	val = strtoul(rate, &p, 10);
+	if (rate == p || *p || val > UINT32_MAX) {
+		fprintf(stderr, "Invalid object cache option '%s': "
+			"writeback_rate must be an integer in MB/s\n", s);
+		exit(1);
+	}
+	sys->object_cache_writeback_rate = val;
+}
+
+static void object_cache_readahead_set(char *s)
+{
+	const char *header = "readahead=";
+	char *nr = s + strlen(header), *p;
+	unsigned long val;
+
+	assert(!strncmp(s, header, strlen(header)));
+
+	val = strtoul(nr, &p, 10);
+	if (nr == p || *p || val > MAX_DATA_OBJS) {
+		fprintf(stderr, "Invalid object cache option '%s': "
+			"readahead must be a number of objects\n", s);
+		exit(1);
+	}
+	sys->object_cache_readahead = val;
+}
+
 static char ocpath[PATH_MAX];
 static void object_cache_dir_set(char *s)
 {
@@ -250,6 +358,10 @@ static void _object_cache_set(char *s)
 		{ "size=", object_cache_size_set },
 		{ "directio", object_cache_directio_set },
 		{ "dir=", object_cache_dir_set },
+		{ "policy=", object_cache_policy_set },
+		{ "dirty_ratio=", object_cache_dirty_ratio_set },
+		{ "writeback_rate=", object_cache_writeback_rate_set },
+		{ "readahead=", object_cache_readahead_set },
 		{ NULL, NULL },
 	};
 
@@ -270,6 +382,8 @@ static void object_cache_set(char *arg)
 {
 	sys->enable_object_cache = true;
 	sys->object_cache_size = 0;
+	sys->object_cache_dirty_ratio = DEFAULT_OC_DIRTY_RATIO;
+	sys->object_cache_readahead = DEFAULT_OC_READAHEAD;
 
 	parse_arg(arg, ",", _object_cache_set);
 
@@ -282,12 +396,18 @@ static void object_cache_set(char *arg)
 static char jpath[PATH_MAX];
 static bool jskip;
 static ssize_t jsize;
+static long jbatch = -1, jdelay = -1;
 #define MIN_JOURNAL_SIZE (64) /* 64M */
+#define DEFAULT_JOURNAL_BATCH (1024) /* 1M */
+#define MAX_JOURNAL_DELAY (1000000) /* 1s */
 
 static void init_journal_arg(char *arg)
 {
-	const char *d = "dir=", *sz = "size=", *sp = "skip";
-	int dl = strlen(d), szl = strlen(sz), spl = strlen(sp);
+	const char *d = "dir=", *sz = "size=", *sp = "skip", *b = "batch=",
+		   *dy = "delay=";
+	int dl = strlen(d), szl = strlen(sz), spl = strlen(sp), bl = strlen(b),
+	    dyl = strlen(dy);
+	char *p;
 
 	if (!strncmp(d, arg, dl)) {
 		arg += dl;
@@ -303,6 +423,23 @@ static void init_journal_arg(char *arg)
 		}
 	} else if (!strncmp(sp, arg, spl)) {
 		jskip = true;
+	} else if (!strncmp(b, arg, bl)) {
+		arg += bl;
+		jbatch = strtol(arg, &p, 10);
+		if (p == arg || *p || jbatch < 4 || jbatch == LONG_MAX) {
+			fprintf(stderr, "invalid batch %s, "
+				"must be at least 4(K)\n", arg);
+			exit(1);
+		}
+	} else if (!strncmp(dy, arg, dyl)) {
+		arg += dyl;
+		jdelay = strtol(arg, &p, 10);
+		if (p == arg || *p || jdelay < 0 || jdelay > MAX_JOURNAL_DELAY) {
+			fprintf(stderr, "invalid delay %s, "
+				"must be between 0 and %d(us)\n", arg,
+				MAX_JOURNAL_DELAY);
+			exit(1);
+		}
 	} else {
 		fprintf(stderr, "invalid paramters %s\n", arg);
 		exit(1);
@@ -310,10 +447,11 @@ static void init_journal_arg(char *arg)
 }
 
 static char *io_addr, *io_pt;
+static const struct sd_transport *io_tp;
 static void init_io_arg(char *arg)
 {
-	const char *host = "host=", *port = "port=";
-	int hl = strlen(host), pl = strlen(port);
+	const char *host = "host=", *port = "port=", *transport = "transport=";
+	int hl = strlen(host), pl = strlen(port), tl = strlen(transport);
 
 	if (!strncmp(host, arg, hl)) {
 		arg += hl;
@@ -321,14 +459,88 @@ static void init_io_arg(char *arg)
 	} else if (!strncmp(port, arg, pl)) {
 		arg += hl;
 		io_pt = arg;
+	} else if (!strncmp(transport, arg, tl)) {
+		arg += tl;
+		io_tp = find_transport(arg);
+		if (!io_tp) {
+			fprintf(stderr, "transport %s is not supported, "
+				"rdma needs sheep built with --enable-rdma\n",
+				arg);
+			exit(1);
+		}
 	} else {
 		fprintf(stderr, "invalid paramters %s. "
-			"Use '-i host=a.b.c.d,port=xxx'\n",
+			"Use '-i host=a.b.c.d,port=xxx[,transport=rdma]'\n",
 			arg);
 		exit(1);
 	}
 }
 
+static void init_recovery_arg(char *arg)
+{
+	const char *m = "max=", *n = "node=", *f = "full";
+	int ml = strlen(m), nl = strlen(n);
+	uint32_t *val;
+	unsigned long v;
+	char *p;
+
+	if (!strcmp(f, arg)) {
+		sys->recovery_delta = false;
+		return;
+	} else if (!strncmp(m, arg, ml)) {
+		arg += ml;
+		val = &sys->recovery_max_objs;
+	} else if (!strncmp(n, arg, nl)) {
+		arg += nl;
+		val = &sys->recovery_max_node_objs;
+	} else {
+		fprintf(stderr, "invalid parameters %s. "
+			"Use '-r max=N,node=N,full'\n", arg);
+		exit(1);
+	}
+
+	v = strtoul(arg, &p, 10);
+	if (p == arg || *p || v < 1 || v > MAX_RECOVERY_OBJS) {
+		fprintf(stderr, "Invalid recovery option '%s': must be an "
+			"integer between 1 and %u\n", arg, MAX_RECOVERY_OBJS);
+		exit(1);
+	}
+	*val = v;
+}
+
+#define MAX_HEDGE_MIN_DELAY 1000000
+
+static void init_hedge_arg(char *arg)
+{
+	const char *pct = "pct=", *min = "min=";
+	int pl = strlen(pct), ml = strlen(min);
+	unsigned long v;
+	char *p;
+
+	if (!strncmp(pct, arg, pl)) {
+		v = strtoul(arg + pl, &p, 10);
+		if (p == arg + pl || *p || v < 1 || v > 99) {
+			fprintf(stderr, "Invalid hedge percentile '%s': must "
+				"be an integer between 1 and 99\n", arg + pl);
+			exit(1);
+		}
+		sys->hedge_percentile = v;
+	} else if (!strncmp(min, arg, ml)) {
+		v = strtoul(arg + ml, &p, 10);
+		if (p == arg + ml || *p || v > MAX_HEDGE_MIN_DELAY) {
+			fprintf(stderr, "Invalid hedge delay '%s': must be an "
+				"integer between 0 and %u\n", arg + ml,
+				MAX_HEDGE_MIN_DELAY);
+			exit(1);
+		}
+		sys->hedge_min_delay = v;
+	} else {
+		fprintf(stderr, "invalid parameters %s. "
+			"Use '-H pct=N,min=us'\n", arg);
+		exit(1);
+	}
+}
+
 static int init_work_queues(void)
 {
 	if (init_wqueue_eventfd())
@@ -341,16 +553,37 @@ static int init_work_queues(void)
 	sys->block_wqueue = init_ordered_work_queue("block");
 	sys->sockfd_wqueue = init_ordered_work_queue("sockfd");
 	sys->md_wqueue = init_ordered_work_queue("md");
+	if (sys->compress_age) {
+		sys->compress_wqueue = init_ordered_work_queue("compress");
+		if (!sys->compress_wqueue)
+			return -1;
+	}
+	if (sys->dedup_age) {
+		sys->dedup_wqueue = init_ordered_work_queue("dedup");
+		if (!sys->dedup_wqueue)
+			return -1;
+	}
+	if (sys->async_gateway) {
+		sys->fwd_wqueue = init_work_queue("fwd", WQ_DYNAMIC);
+		if (!sys->fwd_wqueue || gateway_async_init())
+			return -1;
+	}
 	if (sys->enable_object_cache) {
 		sys->oc_reclaim_wqueue = init_ordered_work_queue("oc_reclaim");
 		sys->oc_push_wqueue = init_work_queue("oc_push", WQ_DYNAMIC);
-		if (!sys->oc_reclaim_wqueue || !sys->oc_push_wqueue)
+		sys->oc_prefetch_wqueue =
+			init_bounded_work_queue("oc_prefetch",
+						OC_PREFETCH_THREADS);
+		if (!sys->oc_reclaim_wqueue || !sys->oc_push_wqueue ||
+		    !sys->oc_prefetch_wqueue)
 			return -1;
 	}
 	if (!sys->gateway_wqueue || !sys->io_wqueue || !sys->recovery_wqueue ||
 	    !sys->deletion_wqueue || !sys->block_wqueue ||
 	    !sys->sockfd_wqueue || !sys->md_wqueue)
 			return -1;
+	if (md_init_wqueues())
+		return -1;
 	return 0;
 }
 
@@ -386,17 +619,21 @@ static void check_host_env(void)
 	else if (r.rlim_cur < RLIM_INFINITY)
 		sd_iprintf("Allowed core file size %lu, suggested unlimited",
 			   r.rlim_cur);
+
+	sd_iprintf("sha1: %s, crc32c: %s, erasure code: %s",
+		   sha1_kernel_name(), crc32c_kernel_name(), fec_kernel_name());
 }
 
 int main(int argc, char **argv)
 {
 	int ch, longindex, ret, port = SD_LISTEN_PORT, io_port = SD_LISTEN_PORT;
 	int log_level = SDOG_INFO, nr_vnodes = SD_DEFAULT_VNODES;
+	int nr_net_loops = 0, nr_urings = 0;
 	const char *dirp = DEFAULT_OBJECT_DIR, *short_options;
 	char *dir, *p, *pid_file = NULL, *bindaddr = NULL, path[PATH_MAX],
 	     *argp = NULL;
 	bool is_daemon = true, to_stdout = false, explicit_addr = false;
-	int64_t zone = -1, free_space = 0;
+	int64_t zone = -1, free_space = 0, age, depth, sample, quorum;
 	struct cluster_driver *cdrv;
 	struct option *long_options;
 	const char *log_format = "default";
@@ -405,6 +642,12 @@ int main(int argc, char **argv)
 	install_crash_handler(crash_handler);
 	signal(SIGPIPE, SIG_IGN);
 
+	sys->recovery_max_objs = DEFAULT_RECOVERY_OBJS;
+	sys->recovery_max_node_objs = DEFAULT_RECOVERY_NODE_OBJS;
+	sys->recovery_delta = true;
+	sys->recovery_throttle.max_latency = SD_DEFAULT_RECOVERY_LATENCY;
+	sys->trace_sample = DEFAULT_TRACE_SAMPLE;
+
 	long_options = build_long_options(sheep_options);
 	short_options = build_short_options(sheep_options);
 	while ((ch = getopt_long(argc, argv, short_options, long_options,
@@ -422,6 +665,9 @@ int main(int argc, char **argv)
 		case 'P':
 			pid_file = optarg;
 			break;
+		case 'r':
+			parse_arg(optarg, ",", init_recovery_arg);
+			break;
 		case 'f':
 			is_daemon = false;
 			break;
@@ -438,6 +684,37 @@ int main(int argc, char **argv)
 		case 'n':
 			sys->nosync = true;
 			break;
+		case 'm':
+			sys->nr_mux_conns = strtol(optarg, &p, 10);
+			if (optarg == p || sys->nr_mux_conns < 1 ||
+			    MAX_MUX_CONNS < sys->nr_mux_conns || *p != '\0') {
+				fprintf(stderr, "Invalid number of multiplexed "
+					"connections '%s': must be an integer "
+					"between 1 and %u\n", optarg,
+					MAX_MUX_CONNS);
+				exit(1);
+			}
+			break;
+		case 'e':
+			nr_net_loops = strtol(optarg, &p, 10);
+			if (optarg == p || nr_net_loops < 1 ||
+			    MAX_NET_LOOPS < nr_net_loops || *p != '\0') {
+				fprintf(stderr, "Invalid number of event loops "
+					"'%s': must be an integer between 1 and "
+					"%u\n", optarg, MAX_NET_LOOPS);
+				exit(1);
+			}
+			break;
+		case 'U':
+			nr_urings = strtol(optarg, &p, 10);
+			if (optarg == p || nr_urings < 1 ||
+			    MAX_URINGS < nr_urings || *p != '\0') {
+				fprintf(stderr, "Invalid number of io_uring "
+					"rings '%s': must be an integer between "
+					"1 and %u\n", optarg, MAX_URINGS);
+				exit(1);
+			}
+			break;
 		case 'y':
 			if (!str_to_addr(optarg, sys->this_node.nid.addr)) {
 				fprintf(stderr, "Invalid address: '%s'\n",
@@ -453,6 +730,9 @@ int main(int argc, char **argv)
 		case 'D':
 			sys->backend_dio = true;
 			break;
+		case 'S':
+			sys->sparse = true;
+			break;
 		case 'g':
 			/* same as '-v 0' */
 			nr_vnodes = 0;
@@ -471,6 +751,50 @@ int main(int argc, char **argv)
 			}
 			sys->this_node.zone = zone;
 			break;
+		case 'Z':
+			age = strtol(optarg, &p, 10);
+			if (optarg == p || age < 1 || UINT32_MAX < age ||
+			    *p != '\0') {
+				fprintf(stderr, "Invalid compression age '%s': "
+					"must be an integer between 1 and %u\n",
+					optarg, UINT32_MAX);
+				exit(1);
+			}
+			sys->compress_age = age;
+			break;
+		case 'x':
+			age = strtol(optarg, &p, 10);
+			if (optarg == p || age < 1 || UINT32_MAX < age ||
+			    *p != '\0') {
+				fprintf(stderr, "Invalid dedup age '%s': "
+					"must be an integer between 1 and %u\n",
+					optarg, UINT32_MAX);
+				exit(1);
+			}
+			sys->dedup_age = age;
+			break;
+		case 'Q':
+			depth = strtol(optarg, &p, 10);
+			if (optarg == p || depth < 1 || UINT32_MAX < depth ||
+			    *p != '\0') {
+				fprintf(stderr, "Invalid qos depth '%s': "
+					"must be an integer between 1 and %u\n",
+					optarg, UINT32_MAX);
+				exit(1);
+			}
+			sys->qos_depth = depth;
+			break;
+		case 't':
+			sample = strtol(optarg, &p, 10);
+			if (optarg == p || sample < 0 || UINT32_MAX < sample ||
+			    *p != '\0') {
+				fprintf(stderr, "Invalid trace sample '%s': "
+					"must be an integer between 0 and %u\n",
+					optarg, UINT32_MAX);
+				exit(1);
+			}
+			sys->trace_sample = sample;
+			break;
 		case 's':
 			free_space = strtoll(optarg, &p, 10);
 			if (optarg == p || free_space <= 0 ||
@@ -517,6 +841,8 @@ int main(int argc, char **argv)
 					exit(1);
 				}
 			sys->this_node.nid.io_port = io_port;
+			if (io_tp)
+				sys->this_node.nid.io_transport = io_tp->id;
 			break;
 		case 'j':
 			uatomic_set_true(&sys->use_journal);
@@ -527,6 +853,38 @@ int main(int argc, char **argv)
 				exit(1);
 			}
 			break;
+		case 'a':
+			sys->async_gateway = true;
+			break;
+		case 'C':
+			sys->chain_replication = true;
+			break;
+		case 'W':
+			quorum = strtol(optarg, &p, 10);
+			if (optarg == p || quorum < 1 || SD_MAX_COPIES < quorum
+			    || *p != '\0') {
+				fprintf(stderr, "Invalid write quorum '%s': "
+					"must be an integer between 1 and %d\n",
+					optarg, SD_MAX_COPIES);
+				exit(1);
+			}
+			sys->write_quorum = quorum;
+			break;
+		case 'H':
+			parse_arg(optarg, ",", init_hedge_arg);
+			if (!sys->hedge_percentile) {
+				fprintf(stderr, "Use '-H pct=N,min=us'\n");
+				exit(1);
+			}
+			break;
+		case 'A':
+			if (add_affinity(optarg) < 0) {
+				fprintf(stderr, "Invalid affinity '%s', "
+					"use name=cpus or name=nodeN\n",
+					optarg);
+				exit(1);
+			}
+			break;
 		case 'b':
 			if (!inetaddr_is_valid(optarg))
 				exit(1);
@@ -561,6 +919,24 @@ int main(int argc, char **argv)
 		sys->disk_space = 0;
 	}
 
+	/*
+	 * The journal replay writes plain data into the object files before
+	 * the object sizes of the VDIs are known, so it can't expand the
+	 * objects compressed since the writes were logged.
+	 */
+	if (sys->compress_age && uatomic_is_true(&sys->use_journal)) {
+		fprintf(stderr, "Compression can't be used with the journal\n");
+		exit(1);
+	}
+
+	/* the write quorum is collected by the asynchronous forwarding */
+	if (sys->write_quorum)
+		sys->async_gateway = true;
+
+	/* asynchronous forwarding relies on the multiplexed connections */
+	if (sys->async_gateway && !sys->nr_mux_conns)
+		sys->nr_mux_conns = DEFAULT_MUX_CONNS;
+
 	if (optind != argc) {
 		argp = strdup(argv[optind]);
 		dirp = strtok(argv[optind], ",");
@@ -597,17 +973,27 @@ int main(int argc, char **argv)
 	if (ret)
 		exit(1);
 
+	init_request_pool();
+
 	ret = create_listen_port(bindaddr, port);
 	if (ret)
 		exit(1);
 
-	if (io_addr && create_listen_port(io_addr, io_port))
+	if (io_addr &&
+	    create_transport_listen_port(io_addr, io_port,
+			get_transport(sys->this_node.nid.io_transport)))
 		exit(1);
+	if (io_addr && sys->this_node.nid.io_transport == SD_TRANSPORT_RDMA)
+		sd_iprintf("the rdma transport is EXPERIMENTAL");
 
 	ret = init_unix_domain_socket(dir);
 	if (ret)
 		exit(1);
 
+	ret = init_metrics_socket(dir);
+	if (ret)
+		exit(1);
+
 	local_req_init();
 
 	ret = init_signal();
@@ -634,8 +1020,20 @@ int main(int argc, char **argv)
 		ret = journal_file_init(jpath, jsize, jskip);
 		if (ret)
 			exit(1);
+		if (jbatch >= 0 || jdelay >= 0) {
+			if (jbatch < 0)
+				jbatch = DEFAULT_JOURNAL_BATCH;
+			ret = journal_file_group_commit_init(jbatch * 1024,
+							     max(jdelay, 0L));
+			if (ret)
+				exit(1);
+		}
 	}
 
+	ret = gateway_lagging_init(dir);
+	if (ret)
+		exit(1);
+
 	/*
 	 * After this function, we are multi-threaded.
 	 *
@@ -647,10 +1045,31 @@ int main(int argc, char **argv)
 	if (ret)
 		exit(1);
 
+	/* created after the signals are blocked, like the workers */
+	set_nic_affinity("net", io_addr ? io_addr : bindaddr);
+	if (nr_net_loops && init_net_loops(nr_net_loops))
+		exit(1);
+
+	if (nr_urings) {
+		if (uring_init(nr_urings))
+			exit(1);
+		sys->io_uring = true;
+	}
+
 	ret = init_store_driver(sys->gateway_only);
 	if (ret)
 		exit(1);
 
+	ret = load_vdi_copy_list();
+	if (ret)
+		exit(1);
+
+	if (sys->compress_age && !sys->gateway_only && init_compressor())
+		exit(1);
+
+	if (sys->dedup_age && !sys->gateway_only && init_deduplicator())
+		exit(1);
+
 	if (sys->enable_object_cache) {
 		if (!strlen(ocpath))
 			/* use object cache internally */
@@ -685,6 +1104,12 @@ int main(int argc, char **argv)
 		event_loop(-1);
 
 	sd_printf(SDOG_INFO, "shutdown");
+	if (sd_store && sd_store->shutdown && !sys->gateway_only)
+		sd_store->shutdown();
+	request_pool_stat();
+	md_wqueue_stat();
+	if (uatomic_is_true(&sys->use_journal))
+		journal_file_stat();
 
 	leave_cluster();
 	log_close();
@@ -13,8 +13,11 @@
 
 #include <inttypes.h>
 #include <stdbool.h>
+#include <pthread.h>
+#include <sched.h>
 #include <urcu/uatomic.h>
 #include <time.h>
+#include <sys/stat.h>
 
 #include "sheepdog_proto.h"
 #include "event.h"
@@ -26,12 +29,34 @@
 #include "rbtree.h"
 #include "strbuf.h"
 
+#define REQ_OID_WAIT_QUEUES 256
+
+/* bytes read from a client at once, and responses written at once */
+#define CLIENT_RX_BUF_SIZE (64 * 1024)
+#define CLIENT_TX_BATCH 16
+
+struct net_loop;
+
 struct client_info {
 	struct connection conn;
 
-	struct request *rx_req;
+	/* the event loop thread serving us, NULL for the main thread */
+	struct net_loop *loop;
+	struct list_head loop_list;
 
-	struct request *tx_req;
+	struct request *rx_req;
+	/* received but not yet parsed bytes */
+	char *rx_cache;
+	int rx_cache_off;
+	int rx_cache_len;
+
+	/* the responses in flight, header and data of each in tx_iov */
+	struct request *tx_reqs[CLIENT_TX_BATCH];
+	struct sd_rsp tx_hdrs[CLIENT_TX_BATCH];
+	struct iovec tx_iov[CLIENT_TX_BATCH * 2];
+	int nr_tx_reqs;
+	int tx_iov_idx;
+	int nr_tx_iov;
 
 	struct list_head done_reqs;
 
@@ -56,9 +81,26 @@ struct request {
 	int local_req_efd;
 
 	uint64_t local_oid;
+	uint64_t start_time; /* usec, 0 if not accounted */
+	uint64_t wait_time; /* usec it began to wait for recovery, or 0 */
+
+	/* the vectored request this per-object request is split from */
+	struct request *vec_parent;
+	struct sd_vec_entry *vec_entry;
+
+	/* the gateway request which is acked when this local one is done */
+	struct request *deferred_req;
 
 	struct vnode_info *vinfo;
 
+	/* the VDI this request is charged to, see qos.c */
+	struct vdi_qos *qos;
+	struct list_head qos_list;
+
+	/* the stages of a sampled request, see trace/reqtrace.c */
+	bool traced;
+	struct sd_req_trace trace;
+
 	struct work work;
 };
 
@@ -73,6 +115,7 @@ struct cluster_info {
 	uint32_t epoch;
 	uint32_t status;
 	uint16_t flags;
+	uint8_t placement;
 
 	uint64_t disk_space;
 
@@ -92,20 +135,49 @@ struct cluster_info {
 	struct list_head pending_notify_list;
 
 	DECLARE_BITMAP(vdi_inuse, SD_NR_VDIS);
+	/* the VDI bitmap and copy list cover every VDI of the cluster */
+	bool vdi_list_complete;
 
 	uint8_t nr_copies;
 	int local_req_efd;
 
 	pthread_mutex_t local_req_lock;
 	struct list_head local_req_queue;
+	/* requests waiting for the epoch to be lifted */
 	struct list_head req_wait_queue;
+	/* requests waiting for an object in recovery, hashed by the oid */
+	struct list_head req_oid_wait_queue[REQ_OID_WAIT_QUEUES];
 	int nr_outstanding_reqs;
 
 	bool gateway_only;
 	bool disable_recovery;
+	/* max objects recovered concurrently, overall and from one node */
+	uint32_t recovery_max_objs;
+	uint32_t recovery_max_node_objs;
+	struct recovery_throttle recovery_throttle;
+	/* fetch only the ranges that differ from the stale local copies */
+	bool recovery_delta;
 	bool nosync;
+	/* # of multiplexed connections per node, 0 means disabled */
+	int nr_mux_conns;
+	/* # of threads serving the client connections, 0 means main only */
+	int nr_net_loops;
+	bool async_gateway;
+	/* hedge the remote reads slower than this percentile, 0 for never */
+	uint32_t hedge_percentile;
+	uint32_t hedge_min_delay; /* usec */
+	/* answer the writes after this many replicas, 0 for all of them */
+	uint32_t write_quorum;
+	int nr_lagging_writes;
+	/* pass the writes along the replicas instead of fanning them out */
+	bool chain_replication;
+	/* share the gateway by the VDI weights above this many requests */
+	uint32_t qos_depth;
+	/* trace the stages of one in this many requests, 0 for none */
+	uint32_t trace_sample;
 
 	struct work_queue *gateway_wqueue;
+	struct work_queue *fwd_wqueue;
 	struct work_queue *io_wqueue;
 	struct work_queue *deletion_wqueue;
 	struct work_queue *recovery_wqueue;
@@ -114,15 +186,28 @@ struct cluster_info {
 	struct work_queue *sockfd_wqueue;
 	struct work_queue *oc_reclaim_wqueue;
 	struct work_queue *oc_push_wqueue;
+	struct work_queue *oc_prefetch_wqueue;
 	struct work_queue *md_wqueue;
+	struct work_queue *compress_wqueue;
+	struct work_queue *dedup_wqueue;
 
 	bool enable_object_cache;
 
 	uint32_t object_cache_size;
 	bool object_cache_directio;
+	int object_cache_policy;
+	uint32_t object_cache_dirty_ratio; /* percent of object_cache_size */
+	uint32_t object_cache_writeback_rate; /* MB/s, 0 for unlimited */
+	uint32_t object_cache_readahead; /* max objects, 0 to disable */
 
 	uatomic_bool use_journal;
 	bool backend_dio;
+	bool io_uring;
+	bool sparse;
+	/* compress the objects not written for this many seconds, 0 if not */
+	uint32_t compress_age;
+	/* dedup the objects not written for this many seconds, 0 if not */
+	uint32_t dedup_age;
 	/* upgrade data layout before starting service if necessary*/
 	bool upgrade;
 	bool enable_md;
@@ -130,6 +215,8 @@ struct cluster_info {
 
 struct siocb {
 	uint16_t flags;
+	/* strip index + 1 of erasure coded objects, 0 for any */
+	uint8_t ec_index;
 	uint32_t epoch;
 	void *buf;
 	uint32_t length;
@@ -143,6 +230,8 @@ struct vdi_iocb {
 	uint32_t base_vid;
 	bool create_snapshot;
 	int nr_copies;
+	uint16_t copy_policy;
+	uint8_t block_size_shift;
 };
 
 struct store_driver {
@@ -154,6 +243,13 @@ struct store_driver {
 	int (*create_and_write)(uint64_t oid, const struct siocb *);
 	int (*write)(uint64_t oid, const struct siocb *);
 	int (*read)(uint64_t oid, const struct siocb *);
+	/*
+	 * read the latest stale copy of the object, SD_RES_NO_OBJ if there is
+	 * none
+	 */
+	int (*read_stale)(uint64_t oid, const struct siocb *);
+	/* deallocate the range, which reads back as zeros afterwards */
+	int (*discard)(uint64_t oid, const struct siocb *);
 	int (*format)(void);
 	int (*remove_object)(uint64_t oid);
 	/* Operations in recovery */
@@ -167,13 +263,45 @@ struct store_driver {
 	int (*cleanup)(void);
 	int (*restore)(const struct siocb *);
 	int (*get_snap_file)(struct siocb *);
+	/* called at clean shutdown */
+	int (*shutdown)(void);
+	/* Operations for compressed objects */
+	/*
+	 * read the range as the image it is stored in, *len is set to 0 if
+	 * the object is not compressed or the image doesn't fit
+	 */
+	int (*read_compressed)(uint64_t oid, const struct siocb *,
+			       uint32_t *len);
+	/* compress the cold objects, called periodically by the compressor */
+	int (*compress)(void);
+	/*
+	 * share the identical cold objects, called periodically by the
+	 * deduplicator
+	 */
+	int (*dedup)(void);
+	/*
+	 * get the strip index + 1 of the erasure coded object, stores without
+	 * it don't support erasure coding
+	 */
+	int (*get_ec_index)(uint64_t oid, uint8_t *ec_index);
 };
 
 int default_init(void);
 bool default_exist(uint64_t oid);
 int default_create_and_write(uint64_t oid, const struct siocb *iocb);
 int default_write(uint64_t oid, const struct siocb *iocb);
+int default_discard(uint64_t oid, const struct siocb *iocb);
+int default_read_compressed(uint64_t oid, const struct siocb *iocb,
+			    uint32_t *len);
+int default_compress(void);
+int share_object(uint64_t oid, const char *path, const struct stat *st,
+		 const char *dedup_path, const void *data);
+int make_object_private(uint64_t oid);
+void lock_object_file(uint64_t oid);
+void unlock_object_file(uint64_t oid);
+int default_get_ec_index(uint64_t oid, uint8_t *ec_index);
 int default_read(uint64_t oid, const struct siocb *iocb);
+int default_read_stale(uint64_t oid, const struct siocb *iocb);
 int default_link(uint64_t oid, uint32_t tgt_epoch);
 int default_end_recover(uint32_t old_epoch,
 			const struct vnode_info *old_vnode_info);
@@ -181,7 +309,12 @@ int default_cleanup(void);
 int default_format(void);
 int default_remove_object(uint64_t oid);
 int default_purge_obj(void);
+int default_shutdown(void);
+int init_obj_index_path(const char *base_path);
+bool oid_stale(uint64_t oid);
 int for_each_object_in_wd(int (*func)(uint64_t, char *, void *), bool, void *);
+int for_each_object_in_wd_parallel(int (*func)(uint64_t, char *, void *), bool,
+				   void *);
 int for_each_obj_path(int (*func)(char *path));
 
 extern struct list_head store_drivers;
@@ -217,6 +350,8 @@ static inline uint32_t sys_epoch(void)
 }
 
 int create_listen_port(char *bindaddr, int port);
+int create_transport_listen_port(char *bindaddr, int port,
+				 const struct sd_transport *tp);
 int init_unix_domain_socket(const char *dir);
 
 int init_store_driver(bool is_gateway);
@@ -224,12 +359,23 @@ int init_global_pathnames(const char *d, char *);
 int init_base_path(const char *dir);
 int init_disk_space(const char *d);
 
-int fill_vdi_copy_list(void *data);
+int fill_vdi_copy_list(void *data, size_t len, uint32_t since);
+void clear_vdi_copy_list(void);
+int init_vdi_list_path(const char *base_path);
+int save_vdi_copy_list(uint32_t epoch);
+int load_vdi_copy_list(void);
+uint32_t get_vdi_list_sync_epoch(void);
 int get_vdi_copy_number(uint32_t vid);
 int get_obj_copy_number(uint64_t oid, int nr_zones);
 int get_max_copy_number(void);
 int get_req_copy_number(struct request *req);
-int add_vdi_copy_number(uint32_t vid, int nr_copies);
+int add_vdi_copy_number(uint32_t vid, int nr_copies, uint16_t copy_policy,
+			uint8_t block_size_shift);
+uint16_t get_vdi_copy_policy(uint32_t vid);
+uint8_t get_vdi_block_size_shift(uint32_t vid);
+uint32_t get_vdi_object_size(uint32_t vid);
+void update_vdi_index(const struct vdi_name_entry *e);
+void clear_vdi_index(void);
 int vdi_exist(uint32_t vid);
 int add_vdi(struct vdi_iocb *iocb, uint32_t *new_vid);
 
@@ -253,6 +399,8 @@ struct vnode_info *grab_vnode_info(struct vnode_info *vnode_info);
 struct vnode_info *get_vnode_info(void);
 void put_vnode_info(struct vnode_info *vinfo);
 struct vnode_info *get_vnode_info_epoch(uint32_t epoch);
+void refresh_vnode_info(void);
+bool update_node_space(uint64_t space);
 void wait_get_vdis_done(void);
 
 int get_nr_copies(struct vnode_info *vnode_info);
@@ -276,6 +424,8 @@ int set_cluster_copies(uint8_t copies);
 int get_cluster_copies(uint8_t *copies);
 int set_cluster_flags(uint16_t flags);
 int get_cluster_flags(uint16_t *flags);
+int set_cluster_placement(uint8_t placement);
+int get_cluster_placement(uint8_t *placement);
 int set_cluster_store(const char *name);
 int get_cluster_store(char *buf);
 int set_cluster_space(uint64_t space);
@@ -297,8 +447,10 @@ int get_obj_list(const struct sd_list_req *, struct sd_list_rsp *, void *);
 int objlist_cache_cleanup(uint32_t vid);
 
 int start_recovery(struct vnode_info *cur_vinfo, struct vnode_info *old_vinfo);
+void stop_recovery(void);
 bool oid_in_recovery(uint64_t oid);
 bool node_in_recovery(void);
+uint32_t recovery_remaining_objects(void);
 
 int read_backend_object(uint64_t oid, char *data, unsigned int datalen,
 		       uint64_t offset, int nr_copies);
@@ -307,16 +459,109 @@ int write_object(uint64_t oid, char *data, unsigned int datalen,
 int read_object(uint64_t oid, char *data, unsigned int datalen,
 		uint64_t offset, int nr_copies);
 int remove_object(uint64_t oid, int nr_copies);
+int remove_objects(const uint64_t *oids, int nr, int nr_copies);
+void get_obj_digests(const void *buf, uint32_t len, uint8_t *digests);
+uint32_t pack_sparse_data(void *buf, uint32_t len);
+int unpack_sparse_data(void *buf, uint32_t size, uint32_t len);
+int unpack_compressed_data(void *buf, uint32_t size, uint32_t len);
+bool get_obj_erasure(uint64_t oid, int *d, int *p);
+uint32_t get_vdi_objsize(uint64_t oid);
+uint32_t get_store_objsize(uint64_t oid);
+uint8_t get_local_ec_index(const struct vnode_info *vinfo, uint64_t oid);
+
+static inline bool is_erasure_obj(uint64_t oid)
+{
+	int d, p;
+
+	return get_obj_erasure(oid, &d, &p);
+}
 
 int exec_local_req(struct sd_req *rq, void *data);
+void queue_local_req_nowait(const struct sd_req *rq,
+			    struct request *deferred_req);
 void local_req_init(void);
 
 int prealloc(int fd, uint32_t size);
+int punch_hole(int fd, uint64_t offset, uint32_t len);
 
 int objlist_cache_insert(uint64_t oid);
+uint64_t *objlist_cache_get_all(int *nr);
 void objlist_cache_remove(uint64_t oid);
 
 void put_request(struct request *req);
+uint64_t foreground_latency(void);
+void get_recovery_wait_stat(struct recovery_wait_stat *stat);
+
+/* qos.c */
+bool qos_hold(struct request *req);
+void qos_done(struct request *req);
+void qos_dispatch(void);
+void qos_set(const struct sd_vdi_qos *limits);
+int get_vdi_qos(struct sd_vdi_qos *limits, uint32_t *name_vid);
+
+/* metrics.c */
+enum metric_counter {
+	MC_OC_HITS,
+	MC_OC_MISSES,
+	MC_SOCKFD_CACHED,
+	MC_SOCKFD_CONNECTS,
+	MC_SOCKFD_SHORT,
+	MC_SOCKFD_DROPS,
+	MC_JOURNAL_STALLS,
+	MC_RECOVERY_OBJS,
+	MC_RECOVERY_FAILS,
+	MC_RECOVERY_BYTES,
+	MC_QUORUM_ACKS,
+	MC_QUORUM_REPAIRS,
+	MC_INODE_CACHE_HITS,
+	MC_INODE_CACHE_MISSES,
+	NR_METRIC_COUNTERS,
+};
+
+enum metric_hist {
+	MH_GATEWAY_READ,
+	MH_GATEWAY_WRITE,
+	MH_PEER_READ,
+	MH_PEER_WRITE,
+	MH_WORK_WAIT,
+	MH_WORK_RUN,
+	MH_OC_PUSH,
+	MH_JOURNAL_WRITE,
+	MH_JOURNAL_COMMIT,
+	MH_RECOVERY_OBJ,
+	MH_QUORUM_LAG,
+	NR_METRIC_HISTS,
+};
+
+void metric_add(enum metric_counter c, uint64_t n);
+void metric_observe(enum metric_hist h, uint64_t us);
+int metrics_snapshot(struct sd_metric *metrics, int max);
+int init_metrics_socket(const char *dir);
+int latency_to_bucket(uint64_t us);
+uint64_t bucket_to_latency(int b);
+
+/* trace/reqtrace.c */
+void reqtrace_start(struct request *req);
+void reqtrace_finish(struct request *req);
+int reqtrace_read(void *buf, uint32_t len);
+
+static inline void trace_req_stage(struct request *req, enum sd_req_stage st)
+{
+	if (req->traced)
+		req->trace.stages[st] = get_usec_time() - req->start_time;
+}
+
+/* affinity.c */
+int add_affinity(const char *arg);
+const cpu_set_t *get_affinity(const char *name);
+void bind_thread(const char *name);
+void set_disk_affinity(const char *name, const char *path);
+void set_nic_affinity(const char *name, const char *addr);
+
+void queue_gateway_request(struct request *req);
+void init_request_pool(void);
+int init_net_loops(int nr);
+void request_pool_stat(void);
 
 /* Operations */
 
@@ -327,6 +572,7 @@ bool is_local_op(const struct sd_op_template *op);
 bool is_peer_op(const struct sd_op_template *op);
 bool is_gateway_op(const struct sd_op_template *op);
 bool is_force_op(const struct sd_op_template *op);
+bool is_vectored_op(const struct sd_op_template *op);
 bool has_process_work(const struct sd_op_template *op);
 bool has_process_main(const struct sd_op_template *op);
 void do_process_work(struct work *work);
@@ -363,15 +609,35 @@ int gateway_read_obj(struct request *req);
 int gateway_write_obj(struct request *req);
 int gateway_create_and_write_obj(struct request *req);
 int gateway_remove_obj(struct request *req);
+int gateway_discard_obj(struct request *req);
+bool gateway_async_request(struct request *req);
+bool gateway_hold_request(struct request *req);
+int gateway_chain_obj(struct request *req);
+int gateway_async_init(void);
+int gateway_lagging_init(const char *dir);
+void gateway_repair_lagging_writes(void);
+
+/* erasure.c */
+int ec_read_obj(struct request *req);
+int ec_write_obj(struct request *req);
+int ec_create_and_write_obj(struct request *req);
+int ec_discard_obj(struct request *req);
 
 /* backend store */
 int peer_read_obj(struct request *req);
+int peer_get_obj_digest(struct request *req);
 int peer_write_obj(struct request *req);
 int peer_create_and_write_obj(struct request *req);
 int peer_remove_obj(struct request *req);
+int peer_remove_objs(struct request *req);
+int peer_discard_obj(struct request *req);
 
 /* object_cache */
 
+/* Replacement policies of the object cache */
+#define OC_POLICY_CLOCK	0 /* Scan resistant, hot entries survive a scan */
+#define OC_POLICY_LRU	1 /* Strict LRU, every hit moves the entry */
+
 void object_cache_format(void);
 bool bypass_object_cache(const struct request *req);
 bool object_is_cached(uint64_t oid);
@@ -382,10 +648,12 @@ int object_cache_write(uint64_t oid, char *data, unsigned int datalen,
 		       uint64_t offset, uint16_t flags, bool create);
 int object_cache_read(uint64_t oid, char *data, unsigned int datalen,
 		      uint64_t offset);
+int object_cache_discard(struct request *req);
 int object_cache_flush_vdi(uint32_t vid);
 int object_cache_flush_and_del(const struct request *req);
 void object_cache_delete(uint32_t vid);
 int object_cache_init(const char *p);
+void object_cache_usage(uint64_t *cached, uint64_t *dirty);
 
 /* store layout migration */
 int sd_migrate_store(int from, int to);
@@ -404,10 +672,36 @@ struct sockfd *sheep_get_sockfd(const struct node_id *);
 void sheep_put_sockfd(const struct node_id *, struct sockfd *);
 void sheep_del_sockfd(const struct node_id *, struct sockfd *);
 int sheep_exec_req(const struct node_id *nid, struct sd_req *hdr, void *data);
+int sheep_exec_reqs(const struct node_id **nids, struct sd_req *hdrs,
+		    void **bufs, int nr);
 bool sheep_need_retry(uint32_t epoch);
 
+/* A request in flight over a multiplexed connection */
+struct sockfd_mux_req {
+	struct rb_node rb;
+	uint32_t id;
+	uint32_t epoch;
+	void *data;
+	unsigned int rlen;
+	struct sd_rsp rsp;
+	int result;
+	bool done;
+	pthread_cond_t cond;
+	void (*done_fn)(struct sockfd_mux_req *);
+	struct mux_conn *conn;
+};
+
+int sheep_mux_submit(const struct node_id *nid, struct sd_req *hdr,
+		     void *data, struct sockfd_mux_req *mreq);
+int sheep_mux_submit_async(const struct node_id *nid, struct sd_req *hdr,
+			   void *data, struct sockfd_mux_req *mreq,
+			   void (*done_fn)(struct sockfd_mux_req *));
+int sheep_mux_wait(struct sockfd_mux_req *mreq);
+
 /* journal_file.c */
 int journal_file_init(const char *path, size_t size, bool skip);
+int journal_file_group_commit_init(size_t batch, unsigned delay);
+void journal_file_stat(void);
 int journal_file_write(uint64_t oid, const char *buf, size_t size, off_t, bool);
 
 /* md.c */
@@ -416,6 +710,197 @@ uint64_t md_init_space(void);
 char *get_object_path(uint64_t oid);
 int md_handle_eio(char *);
 bool md_exist(uint64_t oid);
+bool md_has_object(uint64_t oid);
 int md_get_stale_path(uint64_t oid, uint32_t epoch, char *path);
+int md_init_wqueues(void);
+struct work_queue *md_get_io_wqueue(uint64_t oid);
+void md_wqueue_stat(void);
+
+/* A point of a disk on the ring of the disks, sorted by id */
+struct vdisk {
+	uint16_t idx; /* index into md_table.disks */
+	uint64_t id;
+};
+
+static inline int vdisk_cmp(const void *a, const void *b)
+{
+	const struct vdisk *d1 = a;
+	const struct vdisk *d2 = b;
+
+	if (d1->id < d2->id)
+		return -1;
+	if (d1->id > d2->id)
+		return 1;
+	return 0;
+}
+
+/*
+ * Fill vds with the nr points of the disk idx at path.  They only depend on
+ * the path, so that adding or removing a disk doesn't move objects between
+ * the others.
+ */
+static inline void path_to_vdisks(const char *path, int nr, uint16_t idx,
+				  struct vdisk *vds)
+{
+	uint64_t hval = FNV1A_64_INIT;
+	int i, j;
+
+	for (i = 0; i < nr; i++) {
+		for (j = strlen(path) - 1; j >= 0; j--)
+			hval = fnv_64a_buf(&path[j], 1, hval);
+
+		vds[i].id = hval;
+		vds[i].idx = idx;
+	}
+}
+
+static inline struct vdisk *oid_to_vdisk_from(struct vdisk *vds, int nr,
+					      uint64_t oid)
+{
+	uint64_t id = fnv_64a_buf(&oid, sizeof(oid), FNV1A_64_INIT);
+	int start, end, pos;
+
+	start = 0;
+	end = nr - 1;
+
+	if (id > vds[end].id || id < vds[start].id)
+		return &vds[start];
+
+	for (;;) {
+		pos = (end - start) / 2 + start;
+		if (vds[pos].id < id) {
+			if (vds[pos + 1].id >= id)
+				return &vds[pos + 1];
+			start = pos;
+		} else
+			end = pos;
+	}
+}
+
+/* fd_cache.c */
+struct obj_fd {
+	struct rb_node rb;
+	struct list_head lru;
+	uint64_t oid;
+	int flags;
+	int fd;
+	int refcnt;
+	bool cached;
+	/* of the file when it was opened */
+	uint64_t size;
+	nlink_t nlink;
+};
+
+void fd_cache_init(void);
+struct obj_fd *fd_cache_get(uint64_t oid, int flags);
+struct obj_fd *fd_cache_open(uint64_t oid, const char *path, int flags);
+void fd_cache_put(struct obj_fd *entry);
+void fd_cache_invalidate(uint64_t oid);
+void fd_cache_purge(void);
+
+/* inode_cache.c */
+uint64_t inode_cache_gen(uint32_t vid);
+bool inode_cache_read(uint32_t vid, void *buf, uint64_t offset, uint32_t len);
+void inode_cache_insert(uint32_t vid, uint64_t gen, uint32_t epoch,
+			const struct sheepdog_inode *inode);
+void inode_cache_invalidate(uint32_t vid);
+void inode_cache_purge(void);
+void inode_cache_write_begin(const struct request *req);
+bool inode_cache_write_end(struct request *req);
+
+/* uring.c */
+#ifdef ENABLE_IO_URING
+int uring_init(int nr);
+ssize_t uring_pread(int fd, void *buf, size_t count, off_t offset);
+ssize_t uring_pwrite(int fd, const void *buf, size_t count, off_t offset);
+#else
+static inline int uring_init(int nr)
+{
+	sd_eprintf("io_uring support is not compiled in");
+	return -1;
+}
+static inline ssize_t uring_pread(int fd, void *buf, size_t count,
+				  off_t offset)
+{
+	return xpread(fd, buf, count, offset);
+}
+static inline ssize_t uring_pwrite(int fd, const void *buf, size_t count,
+				   off_t offset)
+{
+	return xpwrite(fd, buf, count, offset);
+}
+#endif /* ENABLE_IO_URING */
+
+/* compress.c */
+/* the temporary files of the compressor, skipped by the object scans */
+#define ZOBJ_TMP_PREFIX ".z."
+
+#ifdef ENABLE_COMPRESSION
+int zobj_compress(const void *buf, uint32_t len, void *img, uint32_t max);
+bool zobj_valid(const void *img, uint32_t img_len, uint32_t len);
+uint32_t zobj_chunk_offset(const struct sd_zobj_header *h, int idx);
+int zobj_decompress_chunk(const struct sd_zobj_header *h, int idx,
+			  const void *src, void *dst);
+int zobj_decompress(const void *img, void *buf);
+int zobj_sub_header(const struct sd_zobj_header *h, uint32_t offset,
+		    uint32_t len, struct sd_zobj_header *sub);
+int init_compressor(void);
+#else
+static inline int zobj_compress(const void *buf, uint32_t len, void *img,
+				uint32_t max)
+{
+	return 0;
+}
+static inline bool zobj_valid(const void *img, uint32_t img_len,
+			      uint32_t len)
+{
+	sd_eprintf("compression support is not compiled in");
+	return false;
+}
+static inline uint32_t zobj_chunk_offset(const struct sd_zobj_header *h,
+					 int idx)
+{
+	return 0;
+}
+static inline int zobj_decompress_chunk(const struct sd_zobj_header *h,
+					int idx, const void *src, void *dst)
+{
+	return -1;
+}
+static inline int zobj_decompress(const void *img, void *buf)
+{
+	return -1;
+}
+static inline int zobj_sub_header(const struct sd_zobj_header *h,
+				  uint32_t offset, uint32_t len,
+				  struct sd_zobj_header *sub)
+{
+	return -1;
+}
+static inline int init_compressor(void)
+{
+	sd_eprintf("compression support is not compiled in");
+	return -1;
+}
+#endif /* ENABLE_COMPRESSION */
+
+/* farm/dedup.c */
+int init_deduplicator(void);
+
+/* Backend object I/O, through io_uring if it is enabled */
+static inline ssize_t obj_pread(int fd, void *buf, size_t count, off_t offset)
+{
+	if (sys->io_uring)
+		return uring_pread(fd, buf, count, offset);
+	return xpread(fd, buf, count, offset);
+}
+
+static inline ssize_t obj_pwrite(int fd, const void *buf, size_t count,
+				 off_t offset)
+{
+	if (sys->io_uring)
+		return uring_pwrite(fd, buf, count, offset);
+	return xpwrite(fd, buf, count, offset);
+}
 
 #endif
@@ -25,9 +25,12 @@
  *    5 the total number of FDs is scalable to massive nodes.
  *    6 total 3 APIs: sheep_{get,put,del}_sockfd().
  *    7 support dual connections to a single node.
+ *    8 optionally multiplex many outstanding requests over a few long
+ *      connections per node, see sheep_mux_{submit,wait}().
  */
 #include <urcu/uatomic.h>
 #include <pthread.h>
+#include <errno.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -179,7 +182,7 @@ static inline void destroy_all_slots(struct sockfd_cache_entry *entry)
 	int i;
 	for (i = 0; i < fds_count; i++)
 		if (entry->fds[i].fd != -1)
-			close(entry->fds[i].fd);
+			net_close(entry->fds[i].fd);
 }
 
 /*
@@ -217,12 +220,17 @@ false_out:
 	return false;
 }
 
+static void sheep_mux_del(const struct node_id *nid);
+
 /* When node craches, we should delete it from the cache */
 void sockfd_cache_del(const struct node_id *nid)
 {
 	char name[INET6_ADDRSTRLEN];
 	int n;
 
+	if (sys->nr_mux_conns)
+		sheep_mux_del(nid);
+
 	if (!sockfd_cache_destroy(nid))
 		return;
 
@@ -345,6 +353,21 @@ static inline int connect_to_addr(const uint8_t *addr, int port)
 	return connect_to(name, port);
 }
 
+/* The I/O address is served by the transport the node advertises */
+static inline int connect_to_io(const struct node_id *nid)
+{
+	const struct sd_transport *tp = get_transport(nid->io_transport);
+	char name[INET6_ADDRSTRLEN];
+
+	if (!tp) {
+		sd_eprintf("transport %d is not supported", nid->io_transport);
+		return -1;
+	}
+
+	addr_to_str(name, sizeof(name), nid->io_addr, 0);
+	return connect_to_transport(tp, name, nid->io_port);
+}
+
 /* Add the node back if it is still alive */
 static inline int revalidate_node(const struct node_id *nid)
 {
@@ -352,7 +375,7 @@ static inline int revalidate_node(const struct node_id *nid)
 	int fd;
 
 	if (use_io) {
-		fd = connect_to_addr(nid->io_addr, nid->io_port);
+		fd = connect_to_io(nid);
 		if (fd >= 0)
 			goto alive;
 	}
@@ -360,7 +383,7 @@ static inline int revalidate_node(const struct node_id *nid)
 	if (fd < 0)
 		return false;
 alive:
-	close(fd);
+	net_close(fd);
 	sockfd_cache_add(nid);
 	return true;
 }
@@ -393,12 +416,13 @@ grab:
 	check_idx(idx);
 	if (entry->fds[idx].fd != -1) {
 		sd_dprintf("%s:%d, idx %d", name, port, idx);
+		metric_add(MC_SOCKFD_CACHED, 1);
 		goto out;
 	}
 
 	/* Create a new cached connection for this vnode */
 	sd_dprintf("create cache connection %s:%d idx %d", name, port, idx);
-	fd = connect_to(name, port);
+	fd = use_io ? connect_to_io(nid) : connect_to(name, port);
 	if (fd < 0) {
 		if (use_io) {
 			sd_eprintf("fallback to non-io connection");
@@ -410,6 +434,7 @@ grab:
 		return NULL;
 	}
 new:
+	metric_add(MC_SOCKFD_CONNECTS, 1);
 	entry->fds[idx].fd = fd;
 out:
 	sfd = xmalloc(sizeof(*sfd));
@@ -463,6 +488,7 @@ struct sockfd *sheep_get_sockfd(const struct node_id *nid)
 	sfd->idx = -1;
 	sfd->fd = fd;
 	sd_dprintf("%d", fd);
+	metric_add(MC_SOCKFD_SHORT, 1);
 	return sfd;
 }
 
@@ -481,7 +507,7 @@ void sheep_put_sockfd(const struct node_id *nid, struct sockfd *sfd)
 {
 	if (sfd->idx == -1) {
 		sd_dprintf("%d", sfd->fd);
-		close(sfd->fd);
+		net_close(sfd->fd);
 		free(sfd);
 		return;
 	}
@@ -499,9 +525,10 @@ void sheep_put_sockfd(const struct node_id *nid, struct sockfd *sfd)
  */
 void sheep_del_sockfd(const struct node_id *nid, struct sockfd *sfd)
 {
+	metric_add(MC_SOCKFD_DROPS, 1);
 	if (sfd->idx == -1) {
 		sd_dprintf("%d", sfd->fd);
-		close(sfd->fd);
+		net_close(sfd->fd);
 		free(sfd);
 		return;
 	}
@@ -511,12 +538,537 @@ void sheep_del_sockfd(const struct node_id *nid, struct sockfd *sfd)
 	free(sfd);
 }
 
+
+/*
+ * Multiplexed peer connections
+ *
+ * In multiplexed mode all the requests to a node share sys->nr_mux_conns long
+ * connections instead of grabbing one fd exclusively for the whole round
+ * trip.  Senders serialize on the per-connection send lock only for the time to
+ * put the request on the wire, and a receiver thread per connection reads the
+ * responses in whatever order the peer completes them, matching them back to
+ * the waiters by sd_req.id.  Hence the number of in-flight requests to a node
+ * is no longer limited by the number of cached fds.
+ *
+ * mux entries are never freed.  They are named by IP:PORT and cost only a few
+ * bytes per node ever seen, while freeing them would require the waiters to
+ * refcount them.
+ */
+struct mux_conn {
+	int fd;
+	/* set while the receiver thread owns fd */
+	bool receiving;
+	uint64_t nr_inflight;
+	/* protects fd, receiving and the waiter tree */
+	pthread_mutex_t lock;
+	/* serializes the writers of a request header and payload */
+	pthread_mutex_t send_lock;
+	struct rb_root waiters;
+	struct mux_entry *entry;
+};
+
+struct mux_entry {
+	struct rb_node rb;
+	struct node_id nid;
+	unsigned long next;
+	int nr_conns;
+	struct mux_conn *conns;
+};
+
+static struct rb_root mux_root = RB_ROOT;
+static pthread_rwlock_t mux_lock = PTHREAD_RWLOCK_INITIALIZER;
+static uint32_t mux_next_id;
+
+static struct mux_entry *mux_entry_insert(struct mux_entry *new)
+{
+	struct rb_node **p = &mux_root.rb_node;
+	struct rb_node *parent = NULL;
+	struct mux_entry *entry;
+
+	while (*p) {
+		int cmp;
+
+		parent = *p;
+		entry = rb_entry(parent, struct mux_entry, rb);
+		cmp = node_id_cmp(&new->nid, &entry->nid);
+
+		if (cmp < 0)
+			p = &(*p)->rb_left;
+		else if (cmp > 0)
+			p = &(*p)->rb_right;
+		else
+			return entry;
+	}
+	rb_link_node(&new->rb, parent, p);
+	rb_insert_color(&new->rb, &mux_root);
+
+	return NULL; /* insert successfully */
+}
+
+static struct mux_entry *mux_entry_search(const struct node_id *nid)
+{
+	struct rb_node *n = mux_root.rb_node;
+	struct mux_entry *t;
+
+	while (n) {
+		int cmp;
+
+		t = rb_entry(n, struct mux_entry, rb);
+		cmp = node_id_cmp(nid, &t->nid);
+
+		if (cmp < 0)
+			n = n->rb_left;
+		else if (cmp > 0)
+			n = n->rb_right;
+		else
+			return t; /* found it */
+	}
+
+	return NULL;
+}
+
+static struct mux_entry *mux_entry_get(const struct node_id *nid)
+{
+	struct mux_entry *entry, *new;
+	int i;
+
+	pthread_rwlock_rdlock(&mux_lock);
+	entry = mux_entry_search(nid);
+	pthread_rwlock_unlock(&mux_lock);
+	if (entry)
+		return entry;
+
+	new = xzalloc(sizeof(*new));
+	memcpy(&new->nid, nid, sizeof(struct node_id));
+	new->nr_conns = sys->nr_mux_conns;
+	new->conns = xzalloc(sizeof(struct mux_conn) * new->nr_conns);
+	for (i = 0; i < new->nr_conns; i++) {
+		new->conns[i].fd = -1;
+		new->conns[i].waiters = RB_ROOT;
+		new->conns[i].entry = new;
+		pthread_mutex_init(&new->conns[i].lock, NULL);
+		pthread_mutex_init(&new->conns[i].send_lock, NULL);
+	}
+
+	pthread_rwlock_wrlock(&mux_lock);
+	entry = mux_entry_insert(new);
+	pthread_rwlock_unlock(&mux_lock);
+	if (entry) {
+		for (i = 0; i < new->nr_conns; i++) {
+			pthread_mutex_destroy(&new->conns[i].lock);
+			pthread_mutex_destroy(&new->conns[i].send_lock);
+		}
+		free(new->conns);
+		free(new);
+		return entry;
+	}
+
+	return new;
+}
+
+static void mux_waiter_insert(struct mux_conn *conn, struct sockfd_mux_req *new)
+{
+	struct rb_node **p = &conn->waiters.rb_node;
+	struct rb_node *parent = NULL;
+	struct sockfd_mux_req *mreq;
+
+	while (*p) {
+		parent = *p;
+		mreq = rb_entry(parent, struct sockfd_mux_req, rb);
+
+		if (new->id < mreq->id)
+			p = &(*p)->rb_left;
+		else
+			p = &(*p)->rb_right;
+	}
+	rb_link_node(&new->rb, parent, p);
+	rb_insert_color(&new->rb, &conn->waiters);
+	conn->nr_inflight++;
+}
+
+static struct sockfd_mux_req *mux_waiter_search(struct mux_conn *conn,
+						uint32_t id)
+{
+	struct rb_node *n = conn->waiters.rb_node;
+	struct sockfd_mux_req *t;
+
+	while (n) {
+		t = rb_entry(n, struct sockfd_mux_req, rb);
+
+		if (id < t->id)
+			n = n->rb_left;
+		else if (id > t->id)
+			n = n->rb_right;
+		else
+			return t; /* found it */
+	}
+
+	return NULL;
+}
+
+static void mux_waiter_finish(struct mux_conn *conn,
+			      struct sockfd_mux_req *mreq, int result)
+{
+	rb_erase(&mreq->rb, &conn->waiters);
+	conn->nr_inflight--;
+	mreq->result = result;
+	mreq->done = true;
+	/* mreq might be freed by the callback, so don't touch it after that */
+	if (mreq->done_fn)
+		mreq->done_fn(mreq);
+	else
+		pthread_cond_signal(&mreq->cond);
+}
+
+/* Must be called with conn->lock held */
+static void mux_fail_all_waiters(struct mux_conn *conn)
+{
+	struct rb_node *n;
+
+	while ((n = rb_first(&conn->waiters))) {
+		struct sockfd_mux_req *mreq;
+
+		mreq = rb_entry(n, struct sockfd_mux_req, rb);
+		mux_waiter_finish(conn, mreq, SD_RES_NETWORK_ERROR);
+	}
+}
+
+/* Make the receiver thread of the connection bail out */
+static void mux_conn_break(struct mux_conn *conn)
+{
+	pthread_mutex_lock(&conn->lock);
+	if (conn->receiving)
+		net_shutdown(conn->fd, SHUT_RDWR);
+	pthread_mutex_unlock(&conn->lock);
+}
+
+/*
+ * Idle connections time out by SO_RCVTIMEO, which is fine.  But if requests
+ * have been in flight over a whole timeout period without any response, the
+ * node is considered dead as wait_forward_request() does.  This is the only
+ * timeout for the requests without a waiting thread.
+ */
+static int mux_read(struct mux_conn *conn, void *buf, size_t len)
+{
+	bool stalled = false;
+	uint64_t nr_inflight;
+	int ret;
+
+	while (len) {
+		ret = net_read(conn->fd, buf, len);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0 && errno == EAGAIN) {
+			pthread_mutex_lock(&conn->lock);
+			nr_inflight = conn->nr_inflight;
+			pthread_mutex_unlock(&conn->lock);
+			if (!nr_inflight) {
+				stalled = false;
+				continue;
+			}
+			if (stalled) {
+				sd_eprintf("no response for %"PRIu64" requests",
+					   nr_inflight);
+				return -1;
+			}
+			stalled = true;
+			continue;
+		}
+		if (ret <= 0)
+			return -1;
+
+		stalled = false;
+		len -= ret;
+		buf = (char *)buf + ret;
+	}
+
+	return 0;
+}
+
+static int mux_drain(struct mux_conn *conn, size_t len)
+{
+	char buf[4096];
+
+	while (len) {
+		size_t n = min(len, sizeof(buf));
+
+		if (mux_read(conn, buf, n) < 0)
+			return -1;
+		len -= n;
+	}
+
+	return 0;
+}
+
+static void *mux_receiver(void *arg)
+{
+	struct mux_conn *conn = arg;
+	struct sockfd_mux_req *mreq;
+	struct sd_rsp rsp;
+	unsigned int rlen;
+	void *data;
+	int fd = conn->fd;
+	char name[INET6_ADDRSTRLEN];
+
+	set_thread_name("mux", true);
+	addr_to_str(name, sizeof(name), conn->entry->nid.addr, 0);
+
+	for (;;) {
+		if (mux_read(conn, &rsp, sizeof(rsp)) < 0)
+			break;
+
+		/*
+		 * Only this thread finishes the waiters of the connection, so
+		 * mreq stays valid until we call mux_waiter_finish().
+		 */
+		pthread_mutex_lock(&conn->lock);
+		mreq = mux_waiter_search(conn, rsp.id);
+		if (mreq) {
+			rlen = min(mreq->rlen, rsp.data_length);
+			data = mreq->data;
+		} else
+			rlen = 0;
+		pthread_mutex_unlock(&conn->lock);
+
+		if (!mreq)
+			sd_eprintf("no waiter for %"PRIu32", %s:%d", rsp.id,
+				   name, conn->entry->nid.port);
+
+		if (rlen && mux_read(conn, data, rlen) < 0)
+			break;
+		/* consume what the waiter doesn't want to keep the stream */
+		if (rsp.data_length > rlen &&
+		    mux_drain(conn, rsp.data_length - rlen) < 0)
+			break;
+
+		if (!mreq)
+			continue;
+
+		pthread_mutex_lock(&conn->lock);
+		memcpy(&mreq->rsp, &rsp, sizeof(rsp));
+		mux_waiter_finish(conn, mreq, rsp.result);
+		pthread_mutex_unlock(&conn->lock);
+	}
+
+	sd_dprintf("%s:%d, fd %d is broken", name, conn->entry->nid.port, fd);
+	/* Don't close fd under the senders */
+	pthread_mutex_lock(&conn->send_lock);
+	pthread_mutex_lock(&conn->lock);
+	mux_fail_all_waiters(conn);
+	net_close(fd);
+	conn->fd = -1;
+	conn->receiving = false;
+	pthread_mutex_unlock(&conn->lock);
+	pthread_mutex_unlock(&conn->send_lock);
+
+	return NULL;
+}
+
+/* Must be called with conn->lock held */
+static int mux_conn_open(struct mux_conn *conn)
+{
+	const struct node_id *nid = &conn->entry->nid;
+	pthread_attr_t attr;
+	pthread_t thread;
+	int fd = -1, ret;
+
+	if (nid->io_port) {
+		fd = connect_to_io(nid);
+		if (fd < 0)
+			sd_eprintf("fallback to non-io connection");
+	}
+	if (fd < 0)
+		fd = connect_to_addr(nid->addr, nid->port);
+	if (fd < 0)
+		return -1;
+
+	conn->fd = fd;
+	conn->receiving = true;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	ret = pthread_create(&thread, &attr, mux_receiver, conn);
+	pthread_attr_destroy(&attr);
+	if (ret) {
+		sd_eprintf("failed to create receiver thread, %s",
+			   strerror(ret));
+		net_close(fd);
+		conn->fd = -1;
+		conn->receiving = false;
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Send the request to the node over one of its multiplexed connections.
+ *
+ * The caller must call sheep_mux_wait() on success to collect the response,
+ * which is put into mreq->rsp as well as the payload into 'data'.
+ */
+int sheep_mux_submit(const struct node_id *nid, struct sd_req *hdr,
+		     void *data, struct sockfd_mux_req *mreq)
+{
+	return sheep_mux_submit_async(nid, hdr, data, mreq, NULL);
+}
+
+/*
+ * Send the request without a waiting thread.
+ *
+ * done_fn is called from the receiver thread once the response is received or
+ * the connection is broken, with the result in mreq->result.  done_fn must not
+ * issue any multiplexed request by itself because it is called with the
+ * connection locked.  If the request can't be submitted at all, error is
+ * returned and done_fn is never called.
+ *
+ * The caller must keep mreq, hdr and data alive until this function returns
+ * even if done_fn is called in the meantime.
+ */
+int sheep_mux_submit_async(const struct node_id *nid, struct sd_req *hdr,
+			   void *data, struct sockfd_mux_req *mreq,
+			   void (*done_fn)(struct sockfd_mux_req *))
+{
+	struct mux_entry *entry;
+	struct mux_conn *conn;
+	unsigned int wlen = 0;
+	int ret, fd;
+
+	if (hdr->flags & SD_FLAG_CMD_WRITE)
+		wlen = hdr->data_length;
+
+	entry = mux_entry_get(nid);
+	conn = entry->conns + uatomic_add_return(&entry->next, 1) %
+		entry->nr_conns;
+
+	memset(mreq, 0, sizeof(*mreq));
+	mreq->id = uatomic_add_return(&mux_next_id, 1);
+	mreq->epoch = hdr->epoch;
+	mreq->data = data;
+	mreq->rlen = wlen ? 0 : hdr->data_length;
+	mreq->conn = conn;
+	mreq->done_fn = done_fn;
+	if (!done_fn)
+		pthread_cond_init(&mreq->cond, NULL);
+	hdr->id = mreq->id;
+
+	/*
+	 * Register the waiter before sending so that the receiver can't see
+	 * the response earlier than the waiter.  The receiver closes fd only
+	 * with send_lock held, so fd can't be reused under us.
+	 */
+	pthread_mutex_lock(&conn->send_lock);
+	pthread_mutex_lock(&conn->lock);
+	if (!conn->receiving && mux_conn_open(conn) < 0) {
+		pthread_mutex_unlock(&conn->lock);
+		pthread_mutex_unlock(&conn->send_lock);
+		if (!done_fn)
+			pthread_cond_destroy(&mreq->cond);
+		return SD_RES_NETWORK_ERROR;
+	}
+	mux_waiter_insert(conn, mreq);
+	fd = conn->fd;
+	pthread_mutex_unlock(&conn->lock);
+
+	ret = send_req(fd, hdr, data, wlen, sheep_need_retry, hdr->epoch);
+	pthread_mutex_unlock(&conn->send_lock);
+	if (ret)
+		/*
+		 * The stream might be garbled by a short send.  The receiver
+		 * fails all the requests on this connection including us.
+		 */
+		mux_conn_break(conn);
+
+	if (!done_fn && ret) {
+		sheep_mux_wait(mreq);
+		return SD_RES_NETWORK_ERROR;
+	}
+
+	return SD_RES_SUCCESS;
+}
+
+/*
+ * Wait for the response of the request submitted by sheep_mux_submit().
+ *
+ * Like wait_forward_request(), we wait longer as long as the epoch doesn't
+ * change and blindly break the connection if the node doesn't respond at all.
+ * The receiver thread then fails all the waiters of the broken connection.
+ */
+int sheep_mux_wait(struct sockfd_mux_req *mreq)
+{
+	struct mux_conn *conn = mreq->conn;
+	int repeat = MAX_RETRY_COUNT;
+	struct timespec ts;
+
+	pthread_mutex_lock(&conn->lock);
+	while (!mreq->done) {
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += POLL_TIMEOUT;
+		if (pthread_cond_timedwait(&mreq->cond, &conn->lock, &ts) !=
+		    ETIMEDOUT || mreq->done)
+			continue;
+
+		if (sheep_need_retry(mreq->epoch) && repeat) {
+			repeat--;
+			continue;
+		}
+
+		sd_eprintf("%"PRIu32" timeout, %"PRIu64" in flight", mreq->id,
+			   conn->nr_inflight);
+		if (conn->receiving)
+			net_shutdown(conn->fd, SHUT_RDWR);
+		repeat = MAX_RETRY_COUNT;
+	}
+	pthread_mutex_unlock(&conn->lock);
+
+	pthread_cond_destroy(&mreq->cond);
+	return mreq->result;
+}
+
+/* Break all the multiplexed connections to the crashed node */
+static void sheep_mux_del(const struct node_id *nid)
+{
+	struct mux_entry *entry;
+	int i;
+
+	pthread_rwlock_rdlock(&mux_lock);
+	entry = mux_entry_search(nid);
+	pthread_rwlock_unlock(&mux_lock);
+	if (!entry)
+		return;
+
+	for (i = 0; i < entry->nr_conns; i++)
+		mux_conn_break(entry->conns + i);
+}
+
+static int sheep_mux_exec_req(const struct node_id *nid, struct sd_req *hdr,
+			      void *buf)
+{
+	struct sockfd_mux_req mreq;
+	int ret;
+
+	ret = sheep_mux_submit(nid, hdr, buf, &mreq);
+	if (ret != SD_RES_SUCCESS)
+		return ret;
+
+	ret = sheep_mux_wait(&mreq);
+	if (mreq.result != SD_RES_NETWORK_ERROR)
+		memcpy(hdr, &mreq.rsp, sizeof(mreq.rsp));
+	if (ret != SD_RES_SUCCESS)
+		sd_eprintf("failed %x", ret);
+
+	return ret;
+}
+
 int sheep_exec_req(const struct node_id *nid, struct sd_req *hdr, void *buf)
 {
 	struct sd_rsp *rsp = (struct sd_rsp *)hdr;
 	struct sockfd *sfd;
 	int ret;
 
+	if (sys->nr_mux_conns)
+		return sheep_mux_exec_req(nid, hdr, buf);
+
 	sfd = sheep_get_sockfd(nid);
 	if (!sfd)
 		return SD_RES_NETWORK_ERROR;
@@ -535,6 +1087,92 @@ int sheep_exec_req(const struct node_id *nid, struct sd_req *hdr, void *buf)
 	return ret;
 }
 
+/*
+ * Execute requests to different nodes in parallel; every request is sent
+ * before any response is waited for.  The responses are stored in hdrs[] as
+ * sheep_exec_req() does.  Return the first error, or SD_RES_SUCCESS.
+ */
+int sheep_exec_reqs(const struct node_id **nids, struct sd_req *hdrs,
+		    void **bufs, int nr)
+{
+	struct sockfd_mux_req *mreqs = NULL;
+	struct sockfd **sfds = NULL;
+	struct sd_rsp *rsp;
+	unsigned int wlen, rlen;
+	int i, ret = SD_RES_SUCCESS;
+
+	if (sys->nr_mux_conns) {
+		mreqs = xcalloc(nr, sizeof(*mreqs));
+		for (i = 0; i < nr; i++)
+			if (sheep_mux_submit(nids[i], hdrs + i, bufs[i],
+					     mreqs + i) != SD_RES_SUCCESS)
+				mreqs[i].conn = NULL;
+		for (i = 0; i < nr; i++) {
+			rsp = (struct sd_rsp *)(hdrs + i);
+			if (!mreqs[i].conn) {
+				rsp->result = SD_RES_NETWORK_ERROR;
+				continue;
+			}
+			sheep_mux_wait(mreqs + i);
+			if (mreqs[i].result != SD_RES_NETWORK_ERROR)
+				memcpy(rsp, &mreqs[i].rsp, sizeof(*rsp));
+			else
+				rsp->result = SD_RES_NETWORK_ERROR;
+		}
+		goto out;
+	}
+
+	sfds = xcalloc(nr, sizeof(*sfds));
+	for (i = 0; i < nr; i++) {
+		wlen = hdrs[i].flags & SD_FLAG_CMD_WRITE ?
+			hdrs[i].data_length : 0;
+		sfds[i] = sheep_get_sockfd(nids[i]);
+		if (!sfds[i])
+			continue;
+		if (send_req(sfds[i]->fd, hdrs + i, bufs[i], wlen,
+			     sheep_need_retry, hdrs[i].epoch)) {
+			sheep_del_sockfd(nids[i], sfds[i]);
+			sfds[i] = NULL;
+		}
+	}
+	for (i = 0; i < nr; i++) {
+		uint32_t epoch = hdrs[i].epoch;
+
+		rsp = (struct sd_rsp *)(hdrs + i);
+		rlen = hdrs[i].flags & SD_FLAG_CMD_WRITE ?
+			0 : hdrs[i].data_length;
+		if (!sfds[i]) {
+			rsp->result = SD_RES_NETWORK_ERROR;
+			continue;
+		}
+		if (do_read(sfds[i]->fd, rsp, sizeof(*rsp), sheep_need_retry,
+			    epoch))
+			goto err;
+		rlen = min(rlen, rsp->data_length);
+		if (rlen && do_read(sfds[i]->fd, bufs[i], rlen,
+				    sheep_need_retry, epoch))
+			goto err;
+		sheep_put_sockfd(nids[i], sfds[i]);
+		continue;
+err:
+		sd_dprintf("remote node might have gone away");
+		sheep_del_sockfd(nids[i], sfds[i]);
+		rsp->result = SD_RES_NETWORK_ERROR;
+	}
+out:
+	for (i = 0; i < nr; i++) {
+		rsp = (struct sd_rsp *)(hdrs + i);
+		if (rsp->result != SD_RES_SUCCESS) {
+			sd_eprintf("failed %x", rsp->result);
+			if (ret == SD_RES_SUCCESS)
+				ret = rsp->result;
+		}
+	}
+	free(mreqs);
+	free(sfds);
+	return ret;
+}
+
 bool sheep_need_retry(uint32_t epoch)
 {
 	return sys_epoch() == epoch;
@@ -27,6 +27,7 @@
 #include "strbuf.h"
 #include "util.h"
 #include "farm/farm.h"
+#include "sha1.h"
 
 char *obj_path;
 char *jrnl_path;
@@ -367,6 +368,17 @@ int init_disk_space(const char *base_path)
 	/* If it is restarted */
 	ret = get_cluster_space(&space_size);
 	if (space_size != 0) {
+		/*
+		 * The disks may have been plugged or unplugged since the
+		 * capacity was saved, e.g. a broken one plugged back.  md knows
+		 * the capacity of its disks unless the user has specified it.
+		 */
+		if (mds && mds != space_size && !sys->disk_space) {
+			sd_iprintf("capacity changes from %" PRIu64 " to %"
+				   PRIu64, space_size, mds);
+			space_size = mds;
+			ret = set_cluster_space(space_size);
+		}
 		sys->disk_space = space_size;
 		goto out;
 	}
@@ -416,6 +428,14 @@ int init_global_pathnames(const char *d, char *argp)
 	if (ret)
 		return ret;
 
+	ret = init_obj_index_path(d);
+	if (ret)
+		return ret;
+
+	ret = init_vdi_list_path(d);
+	if (ret)
+		return ret;
+
 	return 0;
 }
 
@@ -520,3 +540,274 @@ int remove_object(uint64_t oid, int copies)
 
 	return ret;
 }
+
+/*
+ * Remove the objects with one vectored request per target node, sent to all
+ * of them at once.  The objects of a node which refuses its batch, e.g.
+ * because the epoch changed under us, are removed one by one through the
+ * gateway, which retries them.
+ */
+int remove_objects(const uint64_t *oids, int nr, int nr_copies)
+{
+	struct vnode_info *vinfo;
+	const struct sd_node *target_nodes[SD_MAX_COPIES];
+	const struct node_id **nids;
+	struct sd_req *hdrs, local_hdr;
+	uint64_t **lists;
+	void **bufs;
+	int *counts, *idx, i, j, n = 0, local = -1, ret = SD_RES_SUCCESS;
+	uint32_t epoch = sys_epoch();
+	bool *failed;
+
+	vinfo = get_vnode_info();
+	nr_copies = min(nr_copies, vinfo->nr_zones);
+
+	lists = xcalloc(vinfo->nr_nodes, sizeof(*lists));
+	counts = xcalloc(vinfo->nr_nodes, sizeof(*counts));
+	for (i = 0; i < nr; i++) {
+		vinfo_oid_to_nodes(vinfo, oids[i], nr_copies, target_nodes);
+		for (j = 0; j < nr_copies; j++) {
+			int k = target_nodes[j] - vinfo->nodes;
+
+			if (!lists[k])
+				lists[k] = xmalloc(nr * sizeof(**lists));
+			lists[k][counts[k]++] = oids[i];
+		}
+	}
+
+	nids = xcalloc(vinfo->nr_nodes, sizeof(*nids));
+	hdrs = xcalloc(vinfo->nr_nodes, sizeof(*hdrs));
+	bufs = xcalloc(vinfo->nr_nodes, sizeof(*bufs));
+	idx = xcalloc(vinfo->nr_nodes, sizeof(*idx));
+	for (i = 0; i < vinfo->nr_nodes; i++) {
+		struct sd_req hdr;
+
+		if (!counts[i])
+			continue;
+
+		sd_init_req(&hdr, SD_OP_REMOVE_PEERS);
+		hdr.flags = SD_FLAG_CMD_WRITE;
+		hdr.epoch = epoch;
+		hdr.data_length = counts[i] * sizeof(**lists);
+		if (node_is_local(vinfo->nodes + i)) {
+			local = i;
+			local_hdr = hdr;
+			continue;
+		}
+		hdrs[n] = hdr;
+		nids[n] = &vinfo->nodes[i].nid;
+		bufs[n] = lists[i];
+		idx[n++] = i;
+	}
+
+	if (n)
+		sheep_exec_reqs(nids, hdrs, bufs, n);
+	if (local >= 0) {
+		exec_local_req(&local_hdr, lists[local]);
+		hdrs[n] = local_hdr;
+		idx[n++] = local;
+	}
+
+	failed = xcalloc(vinfo->nr_nodes, sizeof(*failed));
+	for (i = 0; i < n; i++) {
+		struct sd_rsp *rsp = (struct sd_rsp *)(hdrs + i);
+
+		if (rsp->result == SD_RES_SUCCESS)
+			continue;
+		sd_dprintf("%d objects on %s failed, %s", counts[idx[i]],
+			   node_to_str(vinfo->nodes + idx[i]),
+			   sd_strerror(rsp->result));
+		failed[idx[i]] = true;
+	}
+
+	for (i = 0; i < nr; i++) {
+		vinfo_oid_to_nodes(vinfo, oids[i], nr_copies, target_nodes);
+		for (j = 0; j < nr_copies; j++)
+			if (failed[target_nodes[j] - vinfo->nodes])
+				break;
+		if (j == nr_copies)
+			continue;
+		if (remove_object(oids[i], nr_copies) != SD_RES_SUCCESS)
+			ret = SD_RES_EIO;
+	}
+
+	for (i = 0; i < vinfo->nr_nodes; i++)
+		free(lists[i]);
+	free(lists);
+	free(counts);
+	free(nids);
+	free(hdrs);
+	free(bufs);
+	free(idx);
+	free(failed);
+	put_vnode_info(vinfo);
+
+	return ret;
+}
+
+/* Compute the SHA1 of every SD_DIGEST_RANGE_SIZE range of the object */
+void get_obj_digests(const void *buf, uint32_t len, uint8_t *digests)
+{
+	sha1_ranges(buf, len, SD_DIGEST_RANGE_SIZE, digests);
+}
+
+/*
+ * Pack the non-zero blocks of the read data in buf[] into the sparse format
+ * of SD_FLAG_CMD_SPARSE.  Return the packed size, or 0 if it doesn't make the
+ * data any shorter, in which case buf[] is left alone.
+ */
+uint32_t pack_sparse_data(void *buf, uint32_t len)
+{
+	struct sd_extent_list *list;
+	struct sd_extent *e = NULL;
+	uint32_t off, n, size;
+	char *packed, *p;
+
+	packed = xmalloc(len);
+	list = (struct sd_extent_list *)packed;
+	list->nr = 0;
+	list->__pad = 0;
+	size = sizeof(*list);
+	for (off = 0; off < len; off += n) {
+		n = min(len - off, (uint32_t)SD_SPARSE_BLOCK_SIZE);
+		if (is_zero_buf((char *)buf + off, n))
+			continue;
+		if (e && e->offset + e->length == off) {
+			e->length += n;
+			continue;
+		}
+		/* a new extent, give up if it is not going to be shorter */
+		size += sizeof(*e);
+		if (size + n >= len) {
+			free(packed);
+			return 0;
+		}
+		e = list->extents + list->nr++;
+		e->offset = off;
+		e->length = n;
+	}
+
+	p = packed + size;
+	for (n = 0; n < list->nr; n++) {
+		e = list->extents + n;
+		size += e->length;
+		if (size >= len) {
+			free(packed);
+			return 0;
+		}
+		memcpy(p, (char *)buf + e->offset, e->length);
+		p += e->length;
+	}
+	memcpy(buf, packed, size);
+	free(packed);
+
+	return size;
+}
+
+/* Expand the sparse data of 'size' bytes in buf[] to 'len' bytes */
+int unpack_sparse_data(void *buf, uint32_t size, uint32_t len)
+{
+	struct sd_extent_list *list;
+	struct sd_extent *e;
+	uint32_t hlen, data = 0, i;
+	char *p, *tmp;
+	int ret = -1;
+
+	if (size < sizeof(*list))
+		return -1;
+	hlen = sizeof(*list) + sizeof(*e) * ((struct sd_extent_list *)buf)->nr;
+	if (hlen > size)
+		return -1;
+
+	list = xmalloc(hlen);
+	memcpy(list, buf, hlen);
+	for (i = 0; i < list->nr; i++) {
+		e = list->extents + i;
+		if (e->offset + e->length > len || e->offset + e->length <
+		    e->offset)
+			goto out;
+		data += e->length;
+	}
+	if (hlen + data != size)
+		goto out;
+
+	tmp = xmalloc(data);
+	memcpy(tmp, (char *)buf + hlen, data);
+	memset(buf, 0, len);
+	for (i = 0, p = tmp; i < list->nr; i++) {
+		e = list->extents + i;
+		memcpy((char *)buf + e->offset, p, e->length);
+		p += e->length;
+	}
+	free(tmp);
+	ret = 0;
+out:
+	free(list);
+	return ret;
+}
+
+/* Expand the compressed image of 'size' bytes in buf[] to 'len' bytes */
+int unpack_compressed_data(void *buf, uint32_t size, uint32_t len)
+{
+	void *img;
+	int ret;
+
+	if (!zobj_valid(buf, size, len))
+		return -1;
+
+	img = xmalloc(size);
+	memcpy(img, buf, size);
+	ret = zobj_decompress(img, buf);
+	free(img);
+
+	return ret;
+}
+
+/* Get the erasure code of the data object, false if it is replicated */
+bool get_obj_erasure(uint64_t oid, int *d, int *p)
+{
+	if (!is_data_obj(oid))
+		return false;
+
+	return ec_policy_to_dp(get_vdi_copy_policy(oid_to_vid(oid)), d, p);
+}
+
+/* The size of the object as seen by the gateway, after the size of its VDI */
+uint32_t get_vdi_objsize(uint64_t oid)
+{
+	if (!is_data_obj(oid))
+		return get_objsize(oid);
+
+	return get_vdi_object_size(oid_to_vid(oid));
+}
+
+/* The size of the object as stored by a node, i.e. a strip of every stripe */
+uint32_t get_store_objsize(uint64_t oid)
+{
+	int d, p;
+
+	if (get_obj_erasure(oid, &d, &p))
+		return SD_DATA_OBJ_SIZE / d;
+
+	return get_vdi_objsize(oid);
+}
+
+/*
+ * Get the strip index + 1 of the erasure coded object that this node should
+ * store, 0 if it shouldn't store any.
+ */
+uint8_t get_local_ec_index(const struct vnode_info *vinfo, uint64_t oid)
+{
+	const struct sd_vnode *vnodes[SD_EC_MAX_STRIPS];
+	int d, p, i;
+
+	if (!get_obj_erasure(oid, &d, &p) || vinfo->nr_zones < d + p)
+		return 0;
+
+	vinfo_oid_to_vnodes(vinfo, oid, d + p, vnodes);
+	for (i = 0; i < d + p; i++)
+		if (vnode_is_local(vnodes[i]))
+			return i + 1;
+
+	return 0;
+}
@@ -0,0 +1,114 @@
+/*
+ * Copyright (C) 2013 Taobao Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Request stage tracing
+ *
+ * Unlike the function graph tracer, this one is always on and costs a few
+ * clock reads per sampled request.  One in sys->trace_sample requests is
+ * stamped at each stage it goes through, see enum sd_req_stage, and recorded
+ * when it is freed into a ring of the thread which received it, i.e. the main
+ * thread or a net loop.  The rings keep the latest REQTRACE_RING_SIZE records
+ * each and are read with SD_OP_TRACE_READ_REQS, which doesn't consume them.
+ */
+
+#include <string.h>
+#include <pthread.h>
+
+#include "../sheep_priv.h"
+
+#define REQTRACE_RING_SIZE 4096
+
+struct reqtrace_ring {
+	struct list_head list;
+	pthread_mutex_t lock;
+	uint64_t nr_pushed;
+	struct sd_req_trace recs[REQTRACE_RING_SIZE];
+};
+
+static LIST_HEAD(ring_list);
+static pthread_mutex_t ring_list_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static __thread struct reqtrace_ring *this_ring;
+static __thread uint32_t nr_sample_ticks;
+
+static struct reqtrace_ring *get_ring(void)
+{
+	if (this_ring)
+		return this_ring;
+
+	this_ring = xzalloc(sizeof(*this_ring));
+	pthread_mutex_init(&this_ring->lock, NULL);
+	pthread_mutex_lock(&ring_list_lock);
+	list_add_tail(&this_ring->list, &ring_list);
+	pthread_mutex_unlock(&ring_list_lock);
+
+	return this_ring;
+}
+
+/* Called when the request is allocated, to decide if we trace it */
+void reqtrace_start(struct request *req)
+{
+	int i;
+
+	if (!sys->trace_sample || ++nr_sample_ticks < sys->trace_sample)
+		return;
+
+	nr_sample_ticks = 0;
+	req->traced = true;
+	for (i = 0; i < SD_NR_REQ_STAGES; i++)
+		req->trace.stages[i] = SD_REQ_STAGE_NONE;
+}
+
+/* Called when the request is freed, in the thread which allocated it */
+void reqtrace_finish(struct request *req)
+{
+	struct reqtrace_ring *ring;
+	struct sd_req_trace *rec = &req->trace;
+
+	if (!req->traced)
+		return;
+
+	rec->opcode = req->rq.opcode;
+	rec->result = req->rp.result;
+	rec->oid = req->rq.obj.oid;
+
+	ring = get_ring();
+	pthread_mutex_lock(&ring->lock);
+	ring->recs[ring->nr_pushed++ % REQTRACE_RING_SIZE] = *rec;
+	pthread_mutex_unlock(&ring->lock);
+}
+
+/*
+ * Copy the records of all the rings to buf, oldest first in each ring, as
+ * many as fit.  Return the length copied.
+ */
+int reqtrace_read(void *buf, uint32_t len)
+{
+	struct reqtrace_ring *ring;
+	struct sd_req_trace *p = buf;
+	uint32_t room = len / sizeof(*p);
+	uint64_t i, from;
+
+	pthread_mutex_lock(&ring_list_lock);
+	list_for_each_entry(ring, &ring_list, list) {
+		pthread_mutex_lock(&ring->lock);
+		from = 0;
+		if (ring->nr_pushed > REQTRACE_RING_SIZE)
+			from = ring->nr_pushed - REQTRACE_RING_SIZE;
+		for (i = from; i < ring->nr_pushed && room; i++, room--)
+			*p++ = ring->recs[i % REQTRACE_RING_SIZE];
+		pthread_mutex_unlock(&ring->lock);
+	}
+	pthread_mutex_unlock(&ring_list_lock);
+
+	return (char *)p - (char *)buf;
+}
@@ -0,0 +1,301 @@
+/*
+ * Copyright (C) 2013 Taobao Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * io_uring engine for the backend object I/O
+ *
+ * The worker threads put their reads and writes on one of a few shared
+ * rings instead of issuing pread/pwrite themselves.  The rings are set up
+ * with a kernel polling thread when the kernel allows it, so submitting is a
+ * plain memory write.  One reaper thread per ring waits for the completions
+ * and wakes up the submitters.  Without SQPOLL, submitters enter the ring
+ * themselves, which still saves the reaping syscall per I/O.
+ */
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "sheep_priv.h"
+
+#define URING_DEPTH 256
+#define URING_SQ_IDLE 2000 /* ms before the polling thread sleeps */
+
+struct uring_wait {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	bool done;
+	int res;
+};
+
+struct uring {
+	int fd;
+	bool sqpoll;
+
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_flags, *sq_array;
+	unsigned sq_entries;
+	struct io_uring_sqe *sqes;
+
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	/* protects the submission queue and nr_inflight */
+	pthread_mutex_t lock;
+	pthread_cond_t space_cond;
+	unsigned nr_inflight;
+
+	pthread_t reaper;
+};
+
+static struct uring *urings;
+static int nr_urings;
+static __thread struct uring_wait *uring_waiter;
+static __thread struct uring *uring_ring;
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit,
+			      unsigned min_complete, unsigned flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+		       flags, NULL, 0);
+}
+
+static void *uring_mmap(int fd, size_t len, off_t offset)
+{
+	void *p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+		       MAP_SHARED | MAP_POPULATE, fd, offset);
+
+	return p == MAP_FAILED ? NULL : p;
+}
+
+static int uring_setup(struct uring *ring)
+{
+	struct io_uring_params p;
+	char *sq, *cq;
+
+	memset(&p, 0, sizeof(p));
+	p.flags = IORING_SETUP_SQPOLL;
+	p.sq_thread_idle = URING_SQ_IDLE;
+	ring->fd = sys_io_uring_setup(URING_DEPTH, &p);
+	if (ring->fd < 0) {
+		/* polling needs privileges on older kernels */
+		memset(&p, 0, sizeof(p));
+		ring->fd = sys_io_uring_setup(URING_DEPTH, &p);
+		if (ring->fd < 0) {
+			sd_eprintf("failed to set up io_uring, %m");
+			return -1;
+		}
+	} else
+		ring->sqpoll = true;
+
+	sq = uring_mmap(ring->fd, p.sq_off.array + p.sq_entries *
+			sizeof(unsigned), IORING_OFF_SQ_RING);
+	cq = uring_mmap(ring->fd, p.cq_off.cqes + p.cq_entries *
+			sizeof(struct io_uring_cqe), IORING_OFF_CQ_RING);
+	ring->sqes = uring_mmap(ring->fd, p.sq_entries *
+				sizeof(struct io_uring_sqe), IORING_OFF_SQES);
+	if (!sq || !cq || !ring->sqes) {
+		sd_eprintf("failed to map io_uring, %m");
+		close(ring->fd);
+		return -1;
+	}
+
+	ring->sq_head = (unsigned *)(sq + p.sq_off.head);
+	ring->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+	ring->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+	ring->sq_flags = (unsigned *)(sq + p.sq_off.flags);
+	ring->sq_array = (unsigned *)(sq + p.sq_off.array);
+	ring->sq_entries = p.sq_entries;
+
+	ring->cq_head = (unsigned *)(cq + p.cq_off.head);
+	ring->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+	ring->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+	pthread_mutex_init(&ring->lock, NULL);
+	pthread_cond_init(&ring->space_cond, NULL);
+
+	return 0;
+}
+
+static void uring_complete(struct uring *ring, struct io_uring_cqe *cqe)
+{
+	struct uring_wait *w = (struct uring_wait *)(uintptr_t)cqe->user_data;
+
+	pthread_mutex_lock(&w->lock);
+	w->res = cqe->res;
+	w->done = true;
+	pthread_cond_signal(&w->cond);
+	pthread_mutex_unlock(&w->lock);
+}
+
+static void *uring_reaper(void *arg)
+{
+	struct uring *ring = arg;
+	unsigned head, tail, nr;
+	int ret;
+
+	set_thread_name("uring", false);
+
+	for (;;) {
+		ret = sys_io_uring_enter(ring->fd, 0, 1,
+					 IORING_ENTER_GETEVENTS);
+		if (ret < 0 && errno != EINTR && errno != EAGAIN &&
+		    errno != EBUSY)
+			panic("failed to wait for io_uring, %m");
+
+		head = *ring->cq_head;
+		tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+		for (nr = 0; head != tail; head++, nr++)
+			uring_complete(ring,
+				       ring->cqes + (head & *ring->cq_mask));
+		__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+
+		if (!nr)
+			continue;
+
+		pthread_mutex_lock(&ring->lock);
+		ring->nr_inflight -= nr;
+		pthread_cond_broadcast(&ring->space_cond);
+		pthread_mutex_unlock(&ring->lock);
+	}
+
+	return NULL;
+}
+
+static struct uring_wait *get_uring_waiter(void)
+{
+	if (!uring_waiter) {
+		uring_waiter = xzalloc(sizeof(*uring_waiter));
+		pthread_mutex_init(&uring_waiter->lock, NULL);
+		pthread_cond_init(&uring_waiter->cond, NULL);
+		uring_ring = urings + gettid() % nr_urings;
+	}
+	return uring_waiter;
+}
+
+/* Queue one sqe and wait for its completion, return the cqe result */
+static int uring_rw(int op, int fd, void *buf, size_t count, off_t offset)
+{
+	struct uring_wait *w = get_uring_waiter();
+	struct uring *ring = uring_ring;
+	struct io_uring_sqe *sqe;
+	unsigned tail;
+
+	w->done = false;
+
+	pthread_mutex_lock(&ring->lock);
+	while (ring->nr_inflight >= ring->sq_entries)
+		pthread_cond_wait(&ring->space_cond, &ring->lock);
+	ring->nr_inflight++;
+
+	tail = *ring->sq_tail;
+	sqe = ring->sqes + (tail & *ring->sq_mask);
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = op;
+	sqe->fd = fd;
+	sqe->addr = (uintptr_t)buf;
+	sqe->len = count;
+	sqe->off = offset;
+	sqe->user_data = (uintptr_t)w;
+	ring->sq_array[tail & *ring->sq_mask] = tail & *ring->sq_mask;
+	__atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+	pthread_mutex_unlock(&ring->lock);
+
+	if (ring->sqpoll) {
+		__sync_synchronize();
+		if (__atomic_load_n(ring->sq_flags, __ATOMIC_RELAXED) &
+		    IORING_SQ_NEED_WAKEUP)
+			sys_io_uring_enter(ring->fd, 0, 0,
+					   IORING_ENTER_SQ_WAKEUP);
+	} else if (sys_io_uring_enter(ring->fd, 1, 0, 0) < 0)
+		panic("failed to submit to io_uring, %m");
+
+	pthread_mutex_lock(&w->lock);
+	while (!w->done)
+		pthread_cond_wait(&w->cond, &w->lock);
+	pthread_mutex_unlock(&w->lock);
+
+	return w->res;
+}
+
+static ssize_t uring_rw_full(int op, int fd, void *buf, size_t count,
+			     off_t offset)
+{
+	char *p = buf;
+	ssize_t total = 0;
+	int ret;
+
+	while (count > 0) {
+		ret = uring_rw(op, fd, p, count, offset);
+		if (ret < 0) {
+			if (ret == -EINTR || ret == -EAGAIN)
+				continue;
+			errno = -ret;
+			return -1;
+		}
+		if (!ret) {
+			if (op == IORING_OP_READ)
+				return total;
+			errno = ENOSPC;
+			return -1;
+		}
+		count -= ret;
+		p += ret;
+		total += ret;
+		offset += ret;
+	}
+
+	return total;
+}
+
+ssize_t uring_pread(int fd, void *buf, size_t count, off_t offset)
+{
+	return uring_rw_full(IORING_OP_READ, fd, buf, count, offset);
+}
+
+ssize_t uring_pwrite(int fd, const void *buf, size_t count, off_t offset)
+{
+	return uring_rw_full(IORING_OP_WRITE, fd, (void *)buf, count, offset);
+}
+
+int uring_init(int nr)
+{
+	int i, ret;
+
+	urings = xzalloc(sizeof(*urings) * nr);
+	for (i = 0; i < nr; i++) {
+		struct uring *ring = urings + i;
+
+		if (uring_setup(ring) < 0)
+			return -1;
+
+		ret = pthread_create(&ring->reaper, NULL, uring_reaper, ring);
+		if (ret) {
+			sd_eprintf("failed to create a reaper, %s",
+				   strerror(ret));
+			return -1;
+		}
+		sd_iprintf("io_uring %d, %u entries%s", i, ring->sq_entries,
+			   ring->sqpoll ? ", kernel polling" : "");
+	}
+	nr_urings = nr;
+
+	return 0;
+}
@@ -12,6 +12,9 @@
 #include <stdlib.h>
 #include <pthread.h>
 #include <sys/time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 #include "sheepdog_proto.h"
 #include "sheep_priv.h"
@@ -19,6 +22,9 @@
 struct vdi_copy_entry {
 	uint32_t vid;
 	unsigned int nr_copies;
+	uint16_t copy_policy;
+	uint8_t block_size_shift;
+	uint32_t epoch; /* when the entry was last changed */
 	struct rb_node node;
 };
 
@@ -86,6 +92,40 @@ int get_vdi_copy_number(uint32_t vid)
 	return entry->nr_copies;
 }
 
+uint16_t get_vdi_copy_policy(uint32_t vid)
+{
+	struct vdi_copy_entry *entry;
+	uint16_t policy = 0;
+
+	pthread_rwlock_rdlock(&vdi_copy_lock);
+	entry = vdi_copy_search(&vdi_copy_root, vid);
+	if (entry)
+		policy = entry->copy_policy;
+	pthread_rwlock_unlock(&vdi_copy_lock);
+
+	return policy;
+}
+
+uint8_t get_vdi_block_size_shift(uint32_t vid)
+{
+	struct vdi_copy_entry *entry;
+	uint8_t shift = 0;
+
+	pthread_rwlock_rdlock(&vdi_copy_lock);
+	entry = vdi_copy_search(&vdi_copy_root, vid);
+	if (entry)
+		shift = entry->block_size_shift;
+	pthread_rwlock_unlock(&vdi_copy_lock);
+
+	return shift;
+}
+
+/* The size of the data objects of the VDI */
+uint32_t get_vdi_object_size(uint32_t vid)
+{
+	return block_size_shift_to_objsize(get_vdi_block_size_shift(vid));
+}
+
 int get_obj_copy_number(uint64_t oid, int nr_zones)
 {
 	uint32_t vid;
@@ -119,23 +159,39 @@ int get_max_copy_number(void)
 	return nr_copies;
 }
 
-int add_vdi_copy_number(uint32_t vid, int nr_copies)
+int add_vdi_copy_number(uint32_t vid, int nr_copies, uint16_t copy_policy,
+			uint8_t block_size_shift)
 {
 	struct vdi_copy_entry *entry, *old;
 
+	/* the inodes carry the default shift, the list keeps it zero */
+	if (block_size_shift == SD_DEFAULT_BLOCK_SIZE_SHIFT)
+		block_size_shift = 0;
+
 	entry = xzalloc(sizeof(*entry));
 	entry->vid = vid;
 	entry->nr_copies = nr_copies;
+	entry->copy_policy = copy_policy;
+	entry->block_size_shift = block_size_shift;
 
-	sd_dprintf("%" PRIx32 ", %d", vid, nr_copies);
+	sd_dprintf("%" PRIx32 ", %d, %" PRIx16 ", %" PRIu8, vid, nr_copies,
+		   copy_policy, block_size_shift);
 
 	pthread_rwlock_wrlock(&vdi_copy_lock);
 	old = vdi_copy_insert(&vdi_copy_root, entry);
 	if (old) {
 		free(entry);
 		entry = old;
-		entry->nr_copies = nr_copies;
-	}
+		if (entry->nr_copies != nr_copies ||
+		    entry->copy_policy != copy_policy ||
+		    entry->block_size_shift != block_size_shift) {
+			entry->nr_copies = nr_copies;
+			entry->copy_policy = copy_policy;
+			entry->block_size_shift = block_size_shift;
+			entry->epoch = sys_epoch();
+		}
+	} else
+		entry->epoch = sys_epoch();
 
 	if (uatomic_read(&max_copies) == 0 ||
 	    nr_copies > uatomic_read(&max_copies))
@@ -145,18 +201,26 @@ int add_vdi_copy_number(uint32_t vid, int nr_copies)
 	return SD_RES_SUCCESS;
 }
 
-int fill_vdi_copy_list(void *data)
+/*
+ * Fill the entries changed at or after epoch 'since' into data, at most len
+ * bytes.  The caller passes 0 to get the whole list.
+ */
+int fill_vdi_copy_list(void *data, size_t len, uint32_t since)
 {
-	int nr = 0;
+	int nr = 0, max = len / sizeof(struct vdi_copy);
 	struct rb_node *n;
 	struct vdi_copy *vc = data;
 	struct vdi_copy_entry *entry;
 
 	pthread_rwlock_rdlock(&vdi_copy_lock);
-	for (n = rb_first(&vdi_copy_root); n; n = rb_next(n)) {
+	for (n = rb_first(&vdi_copy_root); n && nr < max; n = rb_next(n)) {
 		entry = rb_entry(n, struct vdi_copy_entry, node);
+		if (entry->epoch < since)
+			continue;
 		vc->vid = entry->vid;
 		vc->nr_copies = entry->nr_copies;
+		vc->copy_policy = entry->copy_policy;
+		vc->block_size_shift = entry->block_size_shift;
 		vc++;
 		nr++;
 	}
@@ -165,31 +229,323 @@ int fill_vdi_copy_list(void *data)
 	return nr * sizeof(*vc);
 }
 
-int vdi_exist(uint32_t vid)
+void clear_vdi_copy_list(void)
+{
+	struct rb_node *n;
+
+	pthread_rwlock_wrlock(&vdi_copy_lock);
+	while ((n = rb_first(&vdi_copy_root))) {
+		rb_erase(n, &vdi_copy_root);
+		free(rb_entry(n, struct vdi_copy_entry, node));
+	}
+	uatomic_set(&max_copies, 0);
+	pthread_rwlock_unlock(&vdi_copy_lock);
+}
+
+/*
+ * The copy list is saved at every epoch so that a restarted sheep only has
+ * to fetch the VDIs changed since then from a peer, instead of the whole
+ * list from every node.  The snapshot is only usable as a base for such a
+ * delta if the list covered every VDI of the cluster when it was taken.
+ */
+#define VDI_LIST_PATH "/vdi_list"
+#define VDI_LIST_COMPLETE 0x01
+
+struct vdi_list_header {
+	uint32_t epoch;
+	uint32_t flags;
+};
+
+static char *vdi_list_path;
+static uint32_t vdi_list_sync_epoch;
+
+int init_vdi_list_path(const char *base_path)
+{
+	int len = strlen(base_path) + strlen(VDI_LIST_PATH) + 1;
+
+	vdi_list_path = xzalloc(len);
+	snprintf(vdi_list_path, len, "%s" VDI_LIST_PATH, base_path);
+
+	return 0;
+}
+
+int save_vdi_copy_list(uint32_t epoch)
+{
+	struct vdi_list_header hdr = { .epoch = epoch };
+	struct rb_node *n;
+	struct vdi_copy *vc;
+	char tmp[PATH_MAX];
+	int fd, nr = 0, len, ret;
+
+	if (sys->vdi_list_complete)
+		hdr.flags |= VDI_LIST_COMPLETE;
+
+	pthread_rwlock_rdlock(&vdi_copy_lock);
+	for (n = rb_first(&vdi_copy_root); n; n = rb_next(n))
+		nr++;
+	pthread_rwlock_unlock(&vdi_copy_lock);
+
+	vc = xmalloc(sizeof(hdr) + nr * sizeof(*vc));
+	memcpy(vc, &hdr, sizeof(hdr));
+	len = sizeof(hdr) + fill_vdi_copy_list((char *)vc + sizeof(hdr),
+					       nr * sizeof(*vc), 0);
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", vdi_list_path);
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_DSYNC, def_fmode);
+	if (fd < 0) {
+		sd_eprintf("failed to open %s, %m", tmp);
+		goto err;
+	}
+	ret = xwrite(fd, vc, len);
+	close(fd);
+	if (ret != len) {
+		sd_eprintf("failed to write %s, %m", tmp);
+		goto err;
+	}
+	if (rename(tmp, vdi_list_path) < 0) {
+		sd_eprintf("failed to rename %s, %m", tmp);
+		goto err;
+	}
+	free(vc);
+	return SD_RES_SUCCESS;
+err:
+	free(vc);
+	return SD_RES_EIO;
+}
+
+/* Restore the copy list saved before the last shutdown */
+int load_vdi_copy_list(void)
+{
+	struct vdi_list_header hdr;
+	struct vdi_copy vc;
+	int fd, ret;
+
+	fd = open(vdi_list_path, O_RDONLY);
+	if (fd < 0) {
+		if (errno == ENOENT)
+			return SD_RES_SUCCESS;
+		sd_eprintf("failed to open %s, %m", vdi_list_path);
+		return SD_RES_EIO;
+	}
+
+	ret = xread(fd, &hdr, sizeof(hdr));
+	if (ret != sizeof(hdr))
+		goto out;
+
+	while (xread(fd, &vc, sizeof(vc)) == sizeof(vc)) {
+		set_bit(vc.vid, sys->vdi_inuse);
+		add_vdi_copy_number(vc.vid, vc.nr_copies, vc.copy_policy,
+				    vc.block_size_shift);
+	}
+
+	if (hdr.flags & VDI_LIST_COMPLETE)
+		vdi_list_sync_epoch = hdr.epoch;
+	sd_dprintf("epoch %" PRIu32 ", flags %" PRIx32, hdr.epoch, hdr.flags);
+out:
+	close(fd);
+	return SD_RES_SUCCESS;
+}
+
+/*
+ * The epoch since when this node has to fetch the copy list from its peers,
+ * or 0 if it needs the whole list.
+ */
+uint32_t get_vdi_list_sync_epoch(void)
+{
+	return vdi_list_sync_epoch;
+}
+
+/*
+ * Lookup index of the inode headers, keyed by vid.  The lookup still probes
+ * the vid slots from the hash of the name, since the probe order decides
+ * where new VDIs go, but it only has to read the inode of a slot the first
+ * time.  Every change of name, tag or snapshot state is broadcast with the
+ * vdi add and deletion notifications so the index of every sheep stays
+ * valid, and a sheep which cannot tell what changed drops the whole index.
+ */
+struct vdi_index_entry {
+	struct vdi_name_entry e;
+	struct rb_node node;
+};
+
+static struct rb_root vdi_index_root = RB_ROOT;
+static pthread_rwlock_t vdi_index_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+static struct vdi_index_entry *vdi_index_search(struct rb_root *root,
+						uint32_t vid)
+{
+	struct rb_node *n = root->rb_node;
+	struct vdi_index_entry *t;
+
+	while (n) {
+		t = rb_entry(n, struct vdi_index_entry, node);
+
+		if (vid < t->e.vid)
+			n = n->rb_left;
+		else if (vid > t->e.vid)
+			n = n->rb_right;
+		else
+			return t;
+	}
+
+	return NULL;
+}
+
+static struct vdi_index_entry *vdi_index_insert(struct rb_root *root,
+						struct vdi_index_entry *new)
 {
+	struct rb_node **p = &root->rb_node;
+	struct rb_node *parent = NULL;
+	struct vdi_index_entry *entry;
+
+	while (*p) {
+		parent = *p;
+		entry = rb_entry(parent, struct vdi_index_entry, node);
+
+		if (new->e.vid < entry->e.vid)
+			p = &(*p)->rb_left;
+		else if (new->e.vid > entry->e.vid)
+			p = &(*p)->rb_right;
+		else
+			return entry; /* already has this entry */
+	}
+	rb_link_node(&new->node, parent, p);
+	rb_insert_color(&new->node, root);
+
+	return NULL; /* insert successfully */
+}
+
+void update_vdi_index(const struct vdi_name_entry *e)
+{
+	struct vdi_index_entry *entry, *old;
+
+	entry = xmalloc(sizeof(*entry));
+	entry->e = *e;
+
+	sd_dprintf("%" PRIx32 " %s, snap %" PRIu32, e->vid, e->name,
+		   e->snap_id);
+
+	pthread_rwlock_wrlock(&vdi_index_lock);
+	old = vdi_index_insert(&vdi_index_root, entry);
+	if (old) {
+		old->e = *e;
+		free(entry);
+	}
+	pthread_rwlock_unlock(&vdi_index_lock);
+}
+
+void clear_vdi_index(void)
+{
+	struct rb_node *n;
+
+	pthread_rwlock_wrlock(&vdi_index_lock);
+	while ((n = rb_first(&vdi_index_root))) {
+		rb_erase(n, &vdi_index_root);
+		free(rb_entry(n, struct vdi_index_entry, node));
+	}
+	pthread_rwlock_unlock(&vdi_index_lock);
+}
+
+static void inode_to_name_entry(const struct sheepdog_inode *inode,
+				uint32_t vid, struct vdi_name_entry *e)
+{
+	memset(e, 0, sizeof(*e));
+	e->vid = vid;
+	e->snap_id = inode->snap_id;
+	e->nr_copies = inode->nr_copies;
+	e->create_time = inode->create_time;
+	e->snap_ctime = inode->snap_ctime;
+	memcpy(e->name, inode->name, sizeof(e->name));
+	memcpy(e->tag, inode->tag, sizeof(e->tag));
+}
+
+/* Get the header fields of the vid slot, reading the inode if not indexed */
+static int get_vdi_name_entry(uint32_t vid, struct vdi_name_entry *e)
+{
+	struct vdi_index_entry *entry, *old;
 	struct sheepdog_inode *inode;
-	int ret = 1;
-	int nr_copies;
+	int ret;
 
-	inode = xzalloc(sizeof(*inode));
-	nr_copies = get_vdi_copy_number(vid);
+	pthread_rwlock_rdlock(&vdi_index_lock);
+	entry = vdi_index_search(&vdi_index_root, vid);
+	if (entry)
+		*e = entry->e;
+	pthread_rwlock_unlock(&vdi_index_lock);
+	if (entry)
+		return SD_RES_SUCCESS;
 
+	inode = xmalloc(SD_INODE_HEADER_SIZE);
 	ret = read_object(vid_to_vdi_oid(vid), (char *)inode,
-			  sizeof(*inode), 0, nr_copies);
+			  SD_INODE_HEADER_SIZE, 0, get_vdi_copy_number(vid));
 	if (ret != SD_RES_SUCCESS) {
+		free(inode);
+		return SD_RES_EIO;
+	}
+
+	entry = xmalloc(sizeof(*entry));
+	inode_to_name_entry(inode, vid, &entry->e);
+	free(inode);
+
+	/* a notification which came in meanwhile is newer than what we read */
+	pthread_rwlock_wrlock(&vdi_index_lock);
+	old = vdi_index_insert(&vdi_index_root, entry);
+	if (old) {
+		free(entry);
+		entry = old;
+	}
+	*e = entry->e;
+	pthread_rwlock_unlock(&vdi_index_lock);
+
+	return SD_RES_SUCCESS;
+}
+
+int vdi_exist(uint32_t vid)
+{
+	struct vdi_name_entry e;
+
+	if (get_vdi_name_entry(vid, &e) != SD_RES_SUCCESS) {
 		sd_eprintf("fail to read vdi inode (%" PRIx32 ")", vid);
-		ret = 0;
-		goto out;
+		return 0;
 	}
 
-	if (*inode->name == '\0') {
-		ret = 0;
-		goto out;
+	return e.name[0] != '\0';
+}
+
+static int notify_vdi_add(uint32_t vdi_id, uint32_t nr_copies,
+			  uint32_t copy_policy, uint8_t block_size_shift,
+			  const struct vdi_name_entry *entries, int nr_entries);
+static int notify_vdi_deletion(uint32_t vdi_id);
+
+/*
+ * Read the header and the data_vdi_id entries of the inode within its size,
+ * the others are left zero.  Return the number of entries up to the last
+ * used one, or -1 on error, so that a clone only copies what is referenced.
+ */
+static int read_used_inode(uint32_t vid, struct sheepdog_inode *inode)
+{
+	uint64_t nr;
+	int ret;
+
+	ret = read_object(vid_to_vdi_oid(vid), (char *)inode,
+			  SD_INODE_HEADER_SIZE, 0, 0);
+	if (ret != SD_RES_SUCCESS)
+		return -1;
+
+	nr = min(DIV_ROUND_UP(inode->vdi_size, get_inode_objsize(inode)),
+		 (uint64_t)MAX_DATA_OBJS);
+	if (nr) {
+		ret = read_object(vid_to_vdi_oid(vid),
+				  (char *)inode->data_vdi_id,
+				  nr * sizeof(inode->data_vdi_id[0]),
+				  SD_INODE_HEADER_SIZE, 0);
+		if (ret != SD_RES_SUCCESS)
+			return -1;
 	}
-	ret = 1;
-out:
-	free(inode);
-	return ret;
+
+	while (nr && !inode->data_vdi_id[nr - 1])
+		nr--;
+
+	return nr;
 }
 
 /* TODO: should be performed atomically */
@@ -198,9 +554,10 @@ static int create_vdi_obj(struct vdi_iocb *iocb, uint32_t new_vid,
 {
 	/* we are not called concurrently */
 	struct sheepdog_inode *new = NULL, *base = NULL, *cur = NULL;
+	struct vdi_name_entry entries[2];
+	int nr_entries = 0, nr_used = 0;
 	struct timeval tv;
 	int ret = SD_RES_NO_MEM;
-	unsigned long block_size = SD_DATA_OBJ_SIZE;
 	const char *name = iocb->name;
 
 	new = xzalloc(sizeof(*new));
@@ -211,9 +568,8 @@ static int create_vdi_obj(struct vdi_iocb *iocb, uint32_t new_vid,
 		cur = xzalloc(SD_INODE_HEADER_SIZE);
 
 	if (iocb->base_vid) {
-		ret = read_object(vid_to_vdi_oid(iocb->base_vid), (char *)base,
-				  sizeof(*base), 0, 0);
-		if (ret != SD_RES_SUCCESS) {
+		nr_used = read_used_inode(iocb->base_vid, base);
+		if (nr_used < 0) {
 			ret = SD_RES_BASE_VDI_READ;
 			goto out;
 		}
@@ -243,16 +599,20 @@ static int create_vdi_obj(struct vdi_iocb *iocb, uint32_t new_vid,
 	new->vdi_id = new_vid;
 	new->create_time = (uint64_t) tv.tv_sec << 32 | tv.tv_usec * 1000;
 	new->vdi_size = iocb->size;
-	new->copy_policy = 0;
+	new->copy_policy = iocb->copy_policy;
 	new->nr_copies = iocb->nr_copies;
-	new->block_size_shift = find_next_bit(&block_size, BITS_PER_LONG, 0);
+	if (iocb->block_size_shift)
+		new->block_size_shift = iocb->block_size_shift;
+	else
+		new->block_size_shift = SD_DEFAULT_BLOCK_SIZE_SHIFT;
 	new->snap_id = snapid;
 
 	if (iocb->base_vid) {
 		int i;
 
 		new->parent_vdi_id = iocb->base_vid;
-		memcpy(new->data_vdi_id, base->data_vdi_id, sizeof(new->data_vdi_id));
+		memcpy(new->data_vdi_id, base->data_vdi_id,
+		       nr_used * sizeof(new->data_vdi_id[0]));
 
 		for (i = 0; i < ARRAY_SIZE(base->child_vdi_id); i++) {
 			if (!base->child_vdi_id[i]) {
@@ -287,10 +647,28 @@ static int create_vdi_obj(struct vdi_iocb *iocb, uint32_t new_vid,
 		}
 	}
 
-	ret = write_object(vid_to_vdi_oid(new_vid), (char *)new, sizeof(*new),
+	inode_to_name_entry(new, new_vid, &entries[nr_entries++]);
+	if (iocb->create_snapshot) {
+		if (cur_vid != iocb->base_vid)
+			inode_to_name_entry(cur, cur_vid,
+					    &entries[nr_entries++]);
+		else
+			inode_to_name_entry(base, iocb->base_vid,
+					    &entries[nr_entries++]);
+	}
+	notify_vdi_add(new_vid, iocb->nr_copies, iocb->copy_policy,
+		       iocb->block_size_shift, entries, nr_entries);
+
+	/* the entries after the used ones are created as zeros */
+	ret = write_object(vid_to_vdi_oid(new_vid), (char *)new,
+			   SD_INODE_HEADER_SIZE +
+			   nr_used * sizeof(new->data_vdi_id[0]),
 			   0, 0, true, iocb->nr_copies);
-	if (ret != 0)
+	if (ret != 0) {
+		/* the slot is free again */
+		notify_vdi_deletion(new_vid);
 		ret = SD_RES_VDI_WRITE;
+	}
 
 out:
 	free(new);
@@ -305,72 +683,54 @@ static int find_first_vdi(unsigned long start, unsigned long end,
 			  uint32_t *next_snap, unsigned int *inode_nr_copies,
 			  uint64_t *create_time)
 {
-	struct sheepdog_inode *inode = NULL;
+	struct vdi_name_entry e;
 	unsigned long i;
-	int ret = SD_RES_NO_MEM;
+	int ret;
 	bool vdi_found = false;
-	int nr_copies;
-
-	inode = malloc(SD_INODE_HEADER_SIZE);
-	if (!inode) {
-		sd_eprintf("failed to allocate memory");
-		goto out;
-	}
 
 	for (i = start; i >= end; i--) {
-		nr_copies = get_vdi_copy_number(i);
-		ret = read_object(vid_to_vdi_oid(i), (char *)inode,
-				  SD_INODE_HEADER_SIZE, 0, nr_copies);
-		if (ret != SD_RES_SUCCESS) {
-			ret = SD_RES_EIO;
-			goto out_free_inode;
-		}
+		ret = get_vdi_name_entry(i, &e);
+		if (ret != SD_RES_SUCCESS)
+			return ret;
 
-		if (inode->name[0] == '\0') {
+		if (e.name[0] == '\0') {
 			*deleted_nr = i;
 			continue; /* deleted */
 		}
 
-		if (!strncmp(inode->name, name, strlen(inode->name))) {
-			*next_snap = inode->snap_id + 1;
+		if (!strncmp(e.name, name, strlen(e.name))) {
+			*next_snap = e.snap_id + 1;
 
-			if (!(tag && tag[0]) && !snapid && inode->snap_ctime)
+			if (!(tag && tag[0]) && !snapid && e.snap_ctime)
 				break;
 
 			vdi_found = true;
 			if (tag && tag[0] &&
-			    strncmp(inode->tag, tag, sizeof(inode->tag)) != 0)
+			    strncmp(e.tag, tag, sizeof(e.tag)) != 0)
 				continue;
 			if (snapid) {
-				if (snapid != inode->snap_id)
+				if (snapid != e.snap_id)
 					continue;
 
-				if (inode->snap_ctime == 0) {
+				if (e.snap_ctime == 0) {
 					sd_dprintf("vdi %" PRIx32 " is not a "
-						   "snapshot\n", inode->vdi_id);
-					ret = SD_RES_INVALID_PARMS;
-					goto out_free_inode;
+						   "snapshot\n", e.vid);
+					return SD_RES_INVALID_PARMS;
 				}
 			}
 
-			*vid = inode->vdi_id;
-			*inode_nr_copies = inode->nr_copies;
+			*vid = e.vid;
+			*inode_nr_copies = e.nr_copies;
 			if (create_time)
-				*create_time = inode->create_time;
-			ret = SD_RES_SUCCESS;
-			goto out_free_inode;
+				*create_time = e.create_time;
+			return SD_RES_SUCCESS;
 		}
 	}
 
 	if (vdi_found)
-		ret = SD_RES_NO_TAG;
+		return SD_RES_NO_TAG;
 	else
-		ret = SD_RES_NO_VDI;
-
-out_free_inode:
-	free(inode);
-out:
-	return ret;
+		return SD_RES_NO_VDI;
 }
 
 static int do_lookup_vdi(const char *name, int namelen, uint32_t *vid,
@@ -432,19 +792,30 @@ int lookup_vdi(const char *name, const char *tag, uint32_t *vid,
 			     create_time);
 }
 
-static int notify_vdi_add(uint32_t vdi_id, uint32_t nr_copies)
+/*
+ * Register the copies of vdi_id and broadcast the changed inode headers, i.e.
+ * the new VDI and the one which became its snapshot.
+ */
+static int notify_vdi_add(uint32_t vdi_id, uint32_t nr_copies,
+			  uint32_t copy_policy, uint8_t block_size_shift,
+			  const struct vdi_name_entry *entries, int nr_entries)
 {
 	struct sd_req hdr;
 	int ret = SD_RES_SUCCESS;
 	char *buf;
+	size_t len = sizeof(vdi_id) + sizeof(nr_copies) + sizeof(copy_policy);
 
 	sd_init_req(&hdr, SD_OP_NOTIFY_VDI_ADD);
 	hdr.flags = SD_FLAG_CMD_WRITE;
-	hdr.data_length = sizeof(vdi_id) + sizeof(nr_copies);
+	hdr.data_length = len + nr_entries * sizeof(*entries);
+	hdr.vdi.block_size_shift = block_size_shift;
 
-	buf = xmalloc(sizeof(vdi_id) + sizeof(nr_copies));
+	buf = xmalloc(hdr.data_length);
 	memcpy(buf, &vdi_id, sizeof(vdi_id));
 	memcpy(buf + sizeof(vdi_id), &nr_copies, sizeof(nr_copies));
+	memcpy(buf + sizeof(vdi_id) + sizeof(nr_copies), &copy_policy,
+	       sizeof(copy_policy));
+	memcpy(buf + len, entries, nr_entries * sizeof(*entries));
 
 	ret = exec_local_req(&hdr, buf);
 	if (ret != SD_RES_SUCCESS)
@@ -462,7 +833,7 @@ int add_vdi(struct vdi_iocb *iocb, uint32_t *new_vid)
 	uint32_t next_snapid = 1;
 	unsigned long nr, deleted_nr = SD_NR_VDIS, right_nr = SD_NR_VDIS;
 	unsigned int dummy;
-	int ret;
+	int ret, d, p;
 	const char *name;
 
 	if (iocb->data_len != SD_MAX_VDI_LEN)
@@ -498,7 +869,36 @@ int add_vdi(struct vdi_iocb *iocb, uint32_t *new_vid)
 
 	*new_vid = nr;
 
-	notify_vdi_add(nr, iocb->nr_copies);
+	/* snapshots and clones keep the policy of their base by default */
+	if (!iocb->copy_policy && iocb->base_vid)
+		iocb->copy_policy = get_vdi_copy_policy(iocb->base_vid);
+	/* and always the object size, which the data objects are shared at */
+	if (iocb->base_vid)
+		iocb->block_size_shift =
+			get_vdi_block_size_shift(iocb->base_vid);
+	else if (iocb->block_size_shift == SD_DEFAULT_BLOCK_SIZE_SHIFT)
+		iocb->block_size_shift = 0;
+
+	if (iocb->block_size_shift &&
+	    (iocb->block_size_shift < SD_MIN_BLOCK_SIZE_SHIFT ||
+	     iocb->block_size_shift > SD_MAX_BLOCK_SIZE_SHIFT))
+		return SD_RES_INVALID_PARMS;
+	if (iocb->size > (uint64_t)block_size_shift_to_objsize(
+				iocb->block_size_shift) * MAX_DATA_OBJS)
+		return SD_RES_INVALID_PARMS;
+
+	/* the strips and the compressed images assume the default size */
+	if (iocb->block_size_shift && iocb->copy_policy)
+		return SD_RES_INVALID_PARMS;
+
+	if (ec_policy_to_dp(iocb->copy_policy, &d, &p)) {
+		if (!ec_policy_valid(d, p))
+			return SD_RES_INVALID_PARMS;
+		if (sd_store && !sd_store->get_ec_index)
+			return SD_RES_NO_SUPPORT;
+		/* every strip goes to its own zone */
+		iocb->nr_copies = d + p;
+	}
 
 	sd_iprintf("creating new %s %s: size %" PRIu64 ", vid %"
 		   PRIx32 ", base %" PRIx32 ", cur %" PRIx32 ", copies %d",
@@ -568,6 +968,7 @@ static LIST_HEAD(deletion_work_list);
 static int delete_inode(struct deletion_work *dw)
 {
 	struct sheepdog_inode *inode = NULL;
+	struct vdi_name_entry e;
 	int ret = SD_RES_SUCCESS;
 
 	inode = xzalloc(sizeof(*inode));
@@ -587,6 +988,10 @@ static int delete_inode(struct deletion_work *dw)
 		goto out;
 	}
 
+	/* the children still use the objects, so only the header changed */
+	inode_to_name_entry(inode, dw->vid, &e);
+	notify_vdi_add(dw->vid, dw->nr_copies, get_vdi_copy_policy(dw->vid),
+		       get_vdi_block_size_shift(dw->vid), &e, 1);
 out:
 	free(inode);
 	return ret;
@@ -609,13 +1014,42 @@ static int notify_vdi_deletion(uint32_t vdi_id)
 	return ret;
 }
 
+/*
+ * The data objects of a VDI are removed DELETION_BATCH at a time with one
+ * vectored request per node.  Before every batch, the deletion backs off while
+ * the foreground latency is above the one recovery backs off at, from
+ * DELETION_MIN_WAIT up to 64 times that.
+ */
+#define DELETION_BATCH 1024
+#define DELETION_MIN_WAIT 10000 /* usec */
+#define DELETION_MAX_BACKOFF 6
+
+static void deletion_throttle(int *backoff)
+{
+	uint64_t max_latency = sys->recovery_throttle.max_latency * 1000ULL;
+	uint64_t latency = foreground_latency();
+
+	if (!max_latency || latency <= max_latency) {
+		if (*backoff)
+			(*backoff)--;
+		return;
+	}
+
+	if (*backoff < DELETION_MAX_BACKOFF)
+		(*backoff)++;
+	sd_dprintf("foreground latency %" PRIu64 " us, wait %d us", latency,
+		   DELETION_MIN_WAIT << *backoff);
+	usleep(DELETION_MIN_WAIT << *backoff);
+}
+
 static void delete_one(struct work *work)
 {
 	struct deletion_work *dw = container_of(work, struct deletion_work, work);
 	uint32_t vdi_id = *(dw->buf + dw->count - dw->done - 1);
-	int ret, i, nr_deleted;
+	int ret, i, nr_objs = 0, nr_done, n, backoff = 0, progress = 0;
 	struct sheepdog_inode *inode = NULL;
 	int nr_copies;
+	uint64_t *oids = NULL;
 
 	sd_dprintf("%d %d, %16x", dw->done, dw->count, vdi_id);
 
@@ -637,40 +1071,53 @@ static void delete_one(struct work *work)
 	if (inode->vdi_size == 0 && inode->name[0] == '\0')
 		goto out;
 
-	for (nr_deleted = 0, i = 0; i < MAX_DATA_OBJS; i++) {
-		uint64_t oid;
-
+	oids = xmalloc(MAX_DATA_OBJS * sizeof(*oids));
+	for (i = 0; i < MAX_DATA_OBJS; i++) {
 		if (!inode->data_vdi_id[i])
 			continue;
 
-		oid = vid_to_data_oid(inode->data_vdi_id[i], i);
-
 		if (inode->data_vdi_id[i] != inode->vdi_id) {
 			sd_dprintf("object %" PRIx64 " is base's data, would"
-				   " not be deleted.", oid);
+				   " not be deleted.",
+				   vid_to_data_oid(inode->data_vdi_id[i], i));
 			continue;
 		}
 
-		ret = remove_object(oid, nr_copies);
-		if (ret != SD_RES_SUCCESS)
-			sd_eprintf("remove object %" PRIx64 " fail, %d", oid,
-				   ret);
-
-		nr_deleted++;
+		oids[nr_objs++] = vid_to_data_oid(inode->data_vdi_id[i], i);
 	}
 
-	if (nr_deleted)
-		notify_vdi_deletion(vdi_id);
+	if (nr_objs)
+		sd_iprintf("removing %d objects of %" PRIx32, nr_objs, vdi_id);
+	for (nr_done = 0; nr_done < nr_objs; nr_done += n) {
+		n = min(nr_objs - nr_done, DELETION_BATCH);
 
-	if (*(inode->name) == '\0')
-		goto out;
+		deletion_throttle(&backoff);
+		ret = remove_objects(oids + nr_done, n, nr_copies);
+		if (ret != SD_RES_SUCCESS)
+			sd_eprintf("failed to remove some objects of %" PRIx32
+				   ", %s", vdi_id, sd_strerror(ret));
+
+		/* report every tenth of a large VDI */
+		if ((nr_done + n) * 10 / nr_objs > progress) {
+			progress = (nr_done + n) * 10 / nr_objs;
+			if (nr_objs > DELETION_BATCH)
+				sd_iprintf("removed %d/%d objects of %" PRIx32,
+					   nr_done + n, nr_objs, vdi_id);
+		}
+	}
 
-	inode->vdi_size = 0;
-	memset(inode->name, 0, sizeof(inode->name));
+	if (*(inode->name) != '\0') {
+		inode->vdi_size = 0;
+		memset(inode->name, 0, sizeof(inode->name));
+
+		write_object(vid_to_vdi_oid(vdi_id), (void *)inode,
+			     sizeof(*inode), 0, 0, false, nr_copies);
+	}
 
-	write_object(vid_to_vdi_oid(vdi_id), (void *)inode,
-		     sizeof(*inode), 0, 0, false, nr_copies);
+	/* after the inode is cleared so that nobody indexes the old name */
+	notify_vdi_deletion(vdi_id);
 out:
+	free(oids);
 	free(inode);
 }
 
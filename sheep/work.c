@@ -42,7 +42,17 @@
  */
 #define WQ_PROTECTION_PERIOD 1000 /* ms */
 
+/* The most works that a worker takes at once */
+#define WQ_MAX_BATCH 16
+
+/* The queue latency above which the dynamic queues take more threads */
+#define WQ_LATENCY_TARGET 1000 /* us */
+
+/* The most threads of a dynamic queue whose works mostly sleep */
+#define WQ_DYNAMIC_MAX_THREADS 256
+
 static int efd;
+static size_t nr_cpus;
 int total_ordered_workers;
 LIST_HEAD(worker_info_list);
 
@@ -60,50 +70,126 @@ static uint64_t get_msec_time(void)
 	return tv.tv_sec * 1000 + tv.tv_usec / 1000;
 }
 
-static inline uint64_t wq_get_roof(enum wq_thread_control tc)
+static uint64_t get_thread_cpu_usec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * Fold the sample into the moving average.  The workers of a queue update
+ * the run times without a lock and may lose samples, which is fine for the
+ * sizing hints.
+ */
+static void wq_average(uint64_t *avg, uint64_t val)
+{
+	uatomic_set(avg, (uatomic_read(avg) * 7 + val) / 8);
+}
+
+/* Push the work onto the lock-free list, return true if it was empty */
+static bool work_push(struct work **head, struct work *work)
+{
+	struct work *old, *cur = uatomic_read(head);
+
+	do {
+		old = cur;
+		work->w_next = old;
+		cur = uatomic_cmpxchg(head, old, work);
+	} while (cur != old);
+
+	return !old;
+}
+
+/* Take all the works off the lock-free list, the first pushed first */
+static struct work *work_take_all(struct work **head)
+{
+	struct work *work = uatomic_xchg(head, NULL), *prev = NULL, *next;
+
+	while (work) {
+		next = work->w_next;
+		work->w_next = prev;
+		prev = work;
+		work = next;
+	}
+
+	return prev;
+}
+
+/*
+ * A dynamic queue takes more threads only while its works wait longer than
+ * WQ_LATENCY_TARGET in the queue or outnumber the threads, more threads
+ * hardly help otherwise.  It grows up to the number of its CPUs if its works
+ * mostly run on the CPU, and up to WQ_DYNAMIC_MAX_THREADS if they mostly
+ * sleep on the disks and the network.
+ */
+static bool wq_cpu_bound(struct worker_info *wi)
+{
+	return uatomic_read(&wi->cpu_usec) * 2 > uatomic_read(&wi->run_usec);
+}
+
+static inline uint64_t wq_get_roof(struct worker_info *wi)
 {
-	struct vnode_info *vinfo;
-	int nr_nodes;
 	uint64_t nr = 1;
 
-	switch (tc) {
+	switch (wi->tc) {
 	case WQ_ORDERED:
-		break;
+		return nr;
 	case WQ_DYNAMIC:
-		vinfo = get_vnode_info();
-		nr_nodes = vinfo->nr_nodes;
-		put_vnode_info(vinfo);
-		/* FIXME: 2 * nr_nodes threads. No rationale yet. */
-		nr = nr_nodes * 2;
+		if (wq_cpu_bound(wi))
+			nr = wi->nr_cpus;
+		else
+			nr = WQ_DYNAMIC_MAX_THREADS;
 		break;
 	case WQ_UNLIMITED:
 		nr = SIZE_MAX;
 		break;
+	case WQ_BOUNDED:
+		nr = wi->max_threads;
+		break;
 	default:
-		panic("Invalid threads control %d", tc);
+		panic("Invalid threads control %d", wi->tc);
 	}
-	return nr;
+
+	if (uatomic_read(&wi->max_limit))
+		nr = uatomic_read(&wi->max_limit);
+	return max(nr, (uint64_t)uatomic_read(&wi->min_limit));
 }
 
 static bool wq_need_grow(struct worker_info *wi)
 {
-	if (wi->nr_threads < wi->nr_pending + wi->nr_running &&
-	    wi->nr_threads * 2 <= wq_get_roof(wi->tc)) {
-		wi->tm_end_of_protection = get_msec_time() +
-			WQ_PROTECTION_PERIOD;
-		return true;
-	}
+	size_t nr_threads = uatomic_read(&wi->nr_threads);
+	size_t nr_pending = uatomic_read(&wi->nr_pending);
 
-	return false;
+	if (nr_threads >= nr_pending + uatomic_read(&wi->nr_running) ||
+	    nr_threads >= wq_get_roof(wi))
+		return false;
+
+	if (wi->tc == WQ_DYNAMIC && nr_pending <= nr_threads &&
+	    uatomic_read(&wi->wait_usec) < WQ_LATENCY_TARGET)
+		return false;
+
+	wi->tm_end_of_protection = get_msec_time() + WQ_PROTECTION_PERIOD;
+	return true;
 }
 
 /*
  * Return true if more than half of threads are not used more than
- * WQ_PROTECTION_PERIOD seconds
+ * WQ_PROTECTION_PERIOD seconds, or the queue has more threads than allowed
  */
 static bool wq_need_shrink(struct worker_info *wi)
 {
-	if (wi->nr_pending + wi->nr_running <= wi->nr_threads / 2)
+	size_t nr_threads = uatomic_read(&wi->nr_threads);
+
+	if (nr_threads <= max((size_t)1, uatomic_read(&wi->min_limit)))
+		return false;
+
+	if (nr_threads > wq_get_roof(wi))
+		return true;
+
+	if (uatomic_read(&wi->nr_pending) + uatomic_read(&wi->nr_running) <=
+	    nr_threads / 2)
 		/* we cannot shrink work queue during protection period. */
 		return wi->tm_end_of_protection <= get_msec_time();
 
@@ -118,12 +204,12 @@ static int create_worker_threads(struct worker_info *wi, size_t nr_threads)
 	int ret;
 
 	pthread_mutex_lock(&wi->startup_lock);
-	while (wi->nr_threads < nr_threads) {
-		wi->nr_threads++;
+	while (uatomic_read(&wi->nr_threads) < nr_threads) {
+		uatomic_inc(&wi->nr_threads);
 		ret = pthread_create(&thread, NULL, worker_routine, wi);
 		if (ret != 0) {
 			sd_eprintf("failed to create worker thread: %m");
-			wi->nr_threads--;
+			uatomic_dec(&wi->nr_threads);
 			pthread_mutex_unlock(&wi->startup_lock);
 			return -1;
 		}
@@ -134,104 +220,167 @@ static int create_worker_threads(struct worker_info *wi, size_t nr_threads)
 	return 0;
 }
 
+/*
+ * Works are queued without taking a lock, and the workers are only woken up
+ * when some of them are waiting for works.
+ */
 void queue_work(struct work_queue *q, struct work *work)
 {
 	struct worker_info *wi = container_of(q, struct worker_info, q);
+	size_t nr_pending;
 
-	pthread_mutex_lock(&wi->pending_lock);
-	wi->nr_pending++;
+	work->w_queued = get_usec_time();
+	nr_pending = uatomic_add_return(&wi->nr_pending, 1);
+	uatomic_inc(&wi->nr_queued);
+	if (nr_pending > wi->max_pending)
+		wi->max_pending = nr_pending;
 
 	if (wq_need_grow(wi))
 		/* double the thread pool size */
-		create_worker_threads(wi, wi->nr_threads * 2);
+		create_worker_threads(wi, min(uatomic_read(&wi->nr_threads) * 2,
+					      (size_t)wq_get_roof(wi)));
 
-	list_add_tail(&work->w_list, &wi->q.pending_list);
-	pthread_mutex_unlock(&wi->pending_lock);
+	work_push(&wi->pending_head, work);
 
-	pthread_cond_signal(&wi->pending_cond);
+	/* pairs with the check of pending_head in worker_routine() */
+	if (uatomic_read(&wi->nr_idle)) {
+		pthread_mutex_lock(&wi->pending_lock);
+		pthread_cond_signal(&wi->pending_cond);
+		pthread_mutex_unlock(&wi->pending_lock);
+	}
 }
 
+/*
+ * The workers notify the event fd only when the finished list of their queue
+ * was empty, so one wakeup of the main thread completes all the works
+ * finished by then.
+ */
 static void bs_thread_request_done(int fd, int events, void *data)
 {
 	int ret;
 	struct worker_info *wi;
-	struct work *work;
+	struct work *work, *next;
 	eventfd_t value;
-	LIST_HEAD(list);
 
 	ret = eventfd_read(fd, &value);
 	if (ret < 0)
 		return;
 
 	list_for_each_entry(wi, &worker_info_list, worker_info_siblings) {
-		pthread_mutex_lock(&wi->finished_lock);
-		list_splice_init(&wi->finished_list, &list);
-		pthread_mutex_unlock(&wi->finished_lock);
-
-		while (!list_empty(&list)) {
-			work = list_first_entry(&list, struct work, w_list);
-			list_del(&work->w_list);
-
+		work = work_take_all(&wi->finished_head);
+		while (work) {
+			next = work->w_next;
 			work->done(work);
+			work = next;
 		}
 	}
 }
 
+/*
+ * Return how many of the taken works a worker runs in a row.  The ordered
+ * queue runs them all, others share them among the threads.  The workers of
+ * an unlimited queue take one at a time, so that a work waiting for another
+ * of the same queue never holds it back.
+ */
+static size_t wq_batch_size(struct worker_info *wi, size_t nr_taken)
+{
+	size_t nr;
+
+	switch (wi->tc) {
+	case WQ_ORDERED:
+		return nr_taken;
+	case WQ_UNLIMITED:
+		return 1;
+	default:
+		nr = DIV_ROUND_UP(nr_taken, uatomic_read(&wi->nr_threads));
+		return min(nr, (size_t)WQ_MAX_BATCH);
+	}
+}
+
 static void *worker_routine(void *arg)
 {
 	struct worker_info *wi = arg;
-	struct work *work;
+	struct work *work, *n;
 	eventfd_t value = 1;
+	size_t nr_taken, nr;
+	uint64_t now, cpu, run;
+	LIST_HEAD(batch);
 
 	set_thread_name(wi->name, (wi->tc != WQ_ORDERED));
+	bind_thread(wi->name);
 
 	pthread_mutex_lock(&wi->startup_lock);
 	/* started this thread */
 	pthread_mutex_unlock(&wi->startup_lock);
 
-	pthread_mutex_lock(&wi->pending_lock);
-	wi->nr_running++;
-	pthread_mutex_unlock(&wi->pending_lock);
+	uatomic_inc(&wi->nr_running);
 
 	while (!(wi->q.wq_state & WQ_DEAD)) {
 
 		pthread_mutex_lock(&wi->pending_lock);
 		if (wq_need_shrink(wi)) {
-			wi->nr_running--;
-			wi->nr_threads--;
+			uatomic_dec(&wi->nr_running);
+			uatomic_dec(&wi->nr_threads);
 			pthread_mutex_unlock(&wi->pending_lock);
 			pthread_detach(pthread_self());
 			sd_dprintf("destroy thread %s %d, %zd", wi->name,
-				   gettid(), wi->nr_threads);
+				   gettid(), uatomic_read(&wi->nr_threads));
 			break;
 		}
 retest:
+		if (list_empty(&wi->q.pending_list))
+			for (work = work_take_all(&wi->pending_head); work;
+			     work = work->w_next)
+				list_add_tail(&work->w_list,
+					      &wi->q.pending_list);
+
 		if (list_empty(&wi->q.pending_list)) {
-			wi->nr_running--;
-			pthread_cond_wait(&wi->pending_cond, &wi->pending_lock);
+			uatomic_dec(&wi->nr_running);
+			uatomic_inc(&wi->nr_idle);
+			/* queue_work() signals if it sees us idle */
+			if (!uatomic_read(&wi->pending_head))
+				pthread_cond_wait(&wi->pending_cond,
+						  &wi->pending_lock);
+			uatomic_dec(&wi->nr_idle);
 			if (wi->q.wq_state & WQ_DEAD) {
 				pthread_mutex_unlock(&wi->pending_lock);
 				pthread_exit(NULL);
 			}
-			wi->nr_running++;
+			uatomic_inc(&wi->nr_running);
 			goto retest;
 		}
 
-		wi->nr_pending--;
-		work = list_first_entry(&wi->q.pending_list,
-				       struct work, w_list);
-
-		list_del(&work->w_list);
+		nr_taken = 0;
+		list_for_each_entry(work, &wi->q.pending_list, w_list)
+			nr_taken++;
+		nr = wq_batch_size(wi, nr_taken);
+		now = get_usec_time();
+		list_for_each_entry_safe(work, n, &wi->q.pending_list, w_list) {
+			if (!nr--)
+				break;
+			list_move_tail(&work->w_list, &batch);
+			uatomic_dec(&wi->nr_pending);
+			wq_average(&wi->wait_usec, now - work->w_queued);
+			metric_observe(MH_WORK_WAIT, now - work->w_queued);
+		}
 		pthread_mutex_unlock(&wi->pending_lock);
 
-		if (work->fn)
-			work->fn(work);
-
-		pthread_mutex_lock(&wi->finished_lock);
-		list_add_tail(&work->w_list, &wi->finished_list);
-		pthread_mutex_unlock(&wi->finished_lock);
+		list_for_each_entry_safe(work, n, &batch, w_list) {
+			list_del(&work->w_list);
+			if (work->fn) {
+				now = get_usec_time();
+				cpu = get_thread_cpu_usec();
+				work->fn(work);
+				wq_average(&wi->cpu_usec,
+					   get_thread_cpu_usec() - cpu);
+				run = get_usec_time() - now;
+				wq_average(&wi->run_usec, run);
+				metric_observe(MH_WORK_RUN, run);
+			}
 
-		eventfd_write(efd, value);
+			if (work_push(&wi->finished_head, work))
+				eventfd_write(efd, value);
+		}
 	}
 
 	pthread_exit(NULL);
@@ -268,21 +417,28 @@ int init_wqueue_eventfd(void)
  *     local requests that ask for creation of another thread to execute the
  *     requests and sleep-wait for responses.
  */
-struct work_queue *init_work_queue(const char *name, enum wq_thread_control tc)
+static struct work_queue *__init_work_queue(const char *name,
+					    enum wq_thread_control tc,
+					    size_t max_threads)
 {
 	int ret;
 	struct worker_info *wi;
+	const cpu_set_t *set;
+
+	if (!nr_cpus)
+		nr_cpus = max(sysconf(_SC_NPROCESSORS_ONLN), 1L);
 
 	wi = xzalloc(sizeof(*wi));
 	wi->name = name;
+	set = get_affinity(name);
+	wi->nr_cpus = set ? (size_t)CPU_COUNT(set) : nr_cpus;
 	wi->tc = tc;
+	wi->max_threads = max_threads;
 
 	INIT_LIST_HEAD(&wi->q.pending_list);
-	INIT_LIST_HEAD(&wi->finished_list);
 
 	pthread_cond_init(&wi->pending_cond, NULL);
 
-	pthread_mutex_init(&wi->finished_lock, NULL);
 	pthread_mutex_init(&wi->pending_lock, NULL);
 	pthread_mutex_init(&wi->startup_lock, NULL);
 
@@ -299,12 +455,93 @@ destroy_threads:
 	pthread_cond_destroy(&wi->pending_cond);
 	pthread_mutex_destroy(&wi->pending_lock);
 	pthread_mutex_destroy(&wi->startup_lock);
-	pthread_mutex_destroy(&wi->finished_lock);
 
 	return NULL;
 }
 
+struct work_queue *init_work_queue(const char *name, enum wq_thread_control tc)
+{
+	return __init_work_queue(name, tc, 0);
+}
+
 struct work_queue *init_ordered_work_queue(const char *name)
 {
 	return init_work_queue(name, WQ_ORDERED);
 }
+
+struct work_queue *init_bounded_work_queue(const char *name,
+					   size_t max_threads)
+{
+	return __init_work_queue(name, WQ_BOUNDED, max(max_threads, (size_t)1));
+}
+
+void work_queue_stat(struct work_queue *q)
+{
+	struct worker_info *wi = container_of(q, struct worker_info, q);
+
+	pthread_mutex_lock(&wi->pending_lock);
+	sd_iprintf("%s: threads %zu, pending %zu, running %zu, "
+		   "queued %"PRIu64", max pending %zu", wi->name,
+		   wi->nr_threads, wi->nr_pending, wi->nr_running,
+		   wi->nr_queued, wi->max_pending);
+	pthread_mutex_unlock(&wi->pending_lock);
+}
+
+int get_wqueue_stats(struct wqueue_stat *stats, int max)
+{
+	struct worker_info *wi;
+	struct wqueue_stat *st;
+	int nr = 0;
+
+	list_for_each_entry(wi, &worker_info_list, worker_info_siblings) {
+		if (nr == max)
+			return -1;
+		st = stats + nr++;
+		memset(st, 0, sizeof(*st));
+		pstrcpy(st->name, sizeof(st->name), wi->name);
+		st->type = wi->tc;
+		st->nr_threads = uatomic_read(&wi->nr_threads);
+		st->min_threads = uatomic_read(&wi->min_limit);
+		st->max_threads = uatomic_read(&wi->max_limit);
+		st->roof = min(wq_get_roof(wi), (uint64_t)UINT32_MAX);
+		st->nr_pending = uatomic_read(&wi->nr_pending);
+		st->nr_running = uatomic_read(&wi->nr_running);
+		st->max_pending = wi->max_pending;
+		st->nr_queued = uatomic_read(&wi->nr_queued);
+		st->wait_us = uatomic_read(&wi->wait_usec);
+		st->run_us = uatomic_read(&wi->run_usec);
+		st->cpu_us = uatomic_read(&wi->cpu_usec);
+	}
+
+	return nr;
+}
+
+/*
+ * The ordered queues keep their one thread, and the unlimited ones take no
+ * upper bound so that their works waiting for each other never hang.
+ */
+int set_wqueue_limits(const char *name, size_t min_limit, size_t max_limit)
+{
+	struct worker_info *wi;
+
+	list_for_each_entry(wi, &worker_info_list, worker_info_siblings) {
+		if (strcmp(wi->name, name))
+			continue;
+
+		if (wi->tc == WQ_ORDERED ||
+		    (wi->tc == WQ_UNLIMITED && max_limit) ||
+		    (max_limit && min_limit > max_limit))
+			return SD_RES_INVALID_PARMS;
+
+		uatomic_set(&wi->min_limit, min_limit);
+		uatomic_set(&wi->max_limit, max_limit);
+		sd_iprintf("%s: threads %zu to %zu", name, min_limit,
+			   max_limit);
+
+		if (create_worker_threads(wi, min_limit) < 0)
+			return SD_RES_SYSTEM_ERROR;
+		return SD_RES_SUCCESS;
+	}
+
+	return SD_RES_NO_OBJ;
+}
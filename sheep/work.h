@@ -5,24 +5,29 @@
 
 struct work;
 struct work_queue;
+struct wqueue_stat;
 
 typedef void (*work_func_t)(struct work *);
 
 struct work {
 	struct list_head w_list;
+	struct work *w_next;	/* link in the lock-free lists */
 	work_func_t fn;
 	work_func_t done;
+	uint64_t w_queued;	/* usec, when queued */
 };
 
 struct work_queue {
 	int wq_state;
+	/* the works taken from pending_head, in the queued order */
 	struct list_head pending_list;
 };
 
 enum wq_thread_control {
 	WQ_ORDERED, /* Only 1 thread created for work queue */
-	WQ_DYNAMIC, /* # of threads proportional to nr_nodes created */
+	WQ_DYNAMIC, /* # of threads adapted to the queue latency and CPU */
 	WQ_UNLIMITED, /* Unlimited # of threads created */
+	WQ_BOUNDED, /* At most max_threads threads created */
 };
 
 struct worker_info {
@@ -30,18 +35,33 @@ struct worker_info {
 
 	struct list_head worker_info_siblings;
 
-	pthread_mutex_t finished_lock;
-	struct list_head finished_list;
+	/* lock-free lists, pushed newest first, see work_push() */
+	struct work *pending_head;	/* pushed by queue_work() */
+	struct work *finished_head;	/* pushed by the workers */
 
-	/* wokers sleep on this and signaled by tgtd */
+	/* wokers sleep on this and signaled by queue_work() */
 	pthread_cond_t pending_cond;
-	/* locked by tgtd and workers */
+	/* locked by the workers taking works */
 	pthread_mutex_t pending_lock;
 	/* protected by pending_lock */
 	struct work_queue q;
+	/* updated atomically */
 	size_t nr_pending;
 	size_t nr_running;
 	size_t nr_threads;
+	size_t nr_idle;		/* waiting on pending_cond */
+	size_t max_threads;
+	size_t nr_cpus;		/* the CPUs the workers may run on */
+	/* set by SD_OP_SET_WQUEUE, 0 for the default */
+	size_t min_limit;
+	size_t max_limit;
+	/* queue depth statistics */
+	uint64_t nr_queued;
+	size_t max_pending;
+	/* moving averages of the works, in usec */
+	uint64_t wait_usec;	/* queued to taken by a worker */
+	uint64_t run_usec;	/* wall time of work->fn */
+	uint64_t cpu_usec;	/* CPU time of work->fn */
 	/* we cannot shrink work queue till this time */
 	uint64_t tm_end_of_protection;
 
@@ -55,6 +75,11 @@ extern int total_ordered_workers;
 
 struct work_queue *init_work_queue(const char *name, enum wq_thread_control);
 struct work_queue *init_ordered_work_queue(const char *name);
+struct work_queue *init_bounded_work_queue(const char *name,
+					   size_t max_threads);
+void work_queue_stat(struct work_queue *q);
+int get_wqueue_stats(struct wqueue_stat *stats, int max);
+int set_wqueue_limits(const char *name, size_t min_limit, size_t max_limit);
 void queue_work(struct work_queue *q, struct work *work);
 int init_wqueue_eventfd(void);
 
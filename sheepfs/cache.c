@@ -0,0 +1,710 @@
+/*
+ * Copyright (C) 2013 Taobao Inc.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License version
+ * 2 as published by the Free Software Foundation.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The block cache keeps CACHE_BLOCK_SIZE blocks of the mounted volumes in
+ * memory, up to sheepfs_cache_size bytes, and is off when that is zero.
+ *
+ * A read which starts where the previous read of the volume ended queues a
+ * read-ahead of the following blocks for the read-ahead thread, with a
+ * window doubling from CACHE_RA_MIN up to CACHE_RA_MAX blocks.  Writes only
+ * dirty the cached blocks, which the flusher thread writes back every
+ * CACHE_FLUSH_INTERVAL seconds or as soon as they take half of the cache,
+ * and writers wait for the write-back beyond that.  volume_sync() writes
+ * back the dirty blocks of the volume itself and also fails if an earlier
+ * write-back of the volume did.
+ */
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "sheepdog_proto.h"
+#include "sheep.h"
+#include "sheepfs.h"
+#include "rbtree.h"
+
+#define CACHE_BLOCK_SIZE      (128 * 1024)
+#define CACHE_RA_MIN          4
+#define CACHE_RA_MAX          32
+/* contiguous dirty blocks written back with one volume_rw() at most */
+#define CACHE_FLUSH_BATCH     (SD_DATA_OBJ_SIZE / CACHE_BLOCK_SIZE)
+#define CACHE_FLUSH_INTERVAL  1
+
+enum block_state {
+	BLOCK_LOADING,		/* being read, waited for on cache_cond */
+	BLOCK_CLEAN,
+	BLOCK_DIRTY,
+};
+
+struct cache_block {
+	struct rb_node rb;
+	struct list_head lru;	/* the least recently used first */
+	uint64_t key;		/* vid << 32 | block index */
+	enum block_state state;
+	int ref;		/* not evicted while referenced */
+	bool flushing;		/* its write-back is in flight */
+	char *data;
+};
+
+/* the read-ahead and write-back state of a volume */
+struct cache_volume {
+	struct rb_node rb;
+	uint32_t vid;
+	off_t next;		/* where a sequential read would start */
+	int window;		/* zero if not read sequentially */
+	uint32_t ra_end;	/* the first block not read ahead yet */
+	bool error;		/* a write-back failed since the last sync */
+};
+
+struct ra_work {
+	struct list_head list;
+	uint32_t vid;
+	uint32_t idx;
+	int nr;
+};
+
+uint64_t sheepfs_cache_size;
+
+static struct rb_root cache_root = RB_ROOT;
+static struct rb_root volume_root = RB_ROOT;
+static LIST_HEAD(cache_lru);
+static LIST_HEAD(ra_queue);
+static uint64_t cache_bytes, dirty_bytes;
+static bool flush_failed;	/* the last write-back pass failed */
+
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cache_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t flush_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t ra_cond = PTHREAD_COND_INITIALIZER;
+/* held for write while the cache is resized, so no I/O bypasses it */
+static pthread_rwlock_t cache_size_lock = PTHREAD_RWLOCK_INITIALIZER;
+static pthread_once_t cache_once = PTHREAD_ONCE_INIT;
+
+static inline uint64_t block_key(uint32_t vid, uint32_t idx)
+{
+	return (uint64_t)vid << 32 | idx;
+}
+
+static inline uint32_t block_vid(const struct cache_block *b)
+{
+	return b->key >> 32;
+}
+
+static inline off_t block_offset(const struct cache_block *b)
+{
+	return (off_t)(uint32_t)b->key * CACHE_BLOCK_SIZE;
+}
+
+static inline uint64_t dirty_limit(void)
+{
+	return sheepfs_cache_size / 2;
+}
+
+static struct cache_block *block_search(uint64_t key)
+{
+	struct rb_node *n = cache_root.rb_node;
+	struct cache_block *t;
+
+	while (n) {
+		t = rb_entry(n, struct cache_block, rb);
+
+		if (key < t->key)
+			n = n->rb_left;
+		else if (key > t->key)
+			n = n->rb_right;
+		else
+			return t; /* found it */
+	}
+
+	return NULL;
+}
+
+/* Return the first block whose key is not less than the key */
+static struct cache_block *block_search_from(uint64_t key)
+{
+	struct rb_node *n = cache_root.rb_node;
+	struct cache_block *t, *found = NULL;
+
+	while (n) {
+		t = rb_entry(n, struct cache_block, rb);
+
+		if (key <= t->key) {
+			found = t;
+			n = n->rb_left;
+		} else
+			n = n->rb_right;
+	}
+
+	return found;
+}
+
+static struct cache_block *block_insert(struct cache_block *new)
+{
+	struct rb_node **p = &cache_root.rb_node;
+	struct rb_node *parent = NULL;
+	struct cache_block *entry;
+
+	while (*p) {
+		parent = *p;
+		entry = rb_entry(parent, struct cache_block, rb);
+
+		if (new->key < entry->key)
+			p = &(*p)->rb_left;
+		else if (new->key > entry->key)
+			p = &(*p)->rb_right;
+		else
+			return entry; /* already has this entry */
+	}
+	rb_link_node(&new->rb, parent, p);
+	rb_insert_color(&new->rb, &cache_root);
+
+	return NULL; /* insert successfully */
+}
+
+static struct cache_volume *volume_search(uint32_t vid)
+{
+	struct rb_node *n = volume_root.rb_node;
+	struct cache_volume *t;
+
+	while (n) {
+		t = rb_entry(n, struct cache_volume, rb);
+
+		if (vid < t->vid)
+			n = n->rb_left;
+		else if (vid > t->vid)
+			n = n->rb_right;
+		else
+			return t;
+	}
+
+	return NULL;
+}
+
+static struct cache_volume *get_cache_volume(uint32_t vid)
+{
+	struct rb_node **p = &volume_root.rb_node;
+	struct rb_node *parent = NULL;
+	struct cache_volume *entry;
+
+	while (*p) {
+		parent = *p;
+		entry = rb_entry(parent, struct cache_volume, rb);
+
+		if (vid < entry->vid)
+			p = &(*p)->rb_left;
+		else if (vid > entry->vid)
+			p = &(*p)->rb_right;
+		else
+			return entry;
+	}
+
+	entry = xzalloc(sizeof(*entry));
+	entry->vid = vid;
+	rb_link_node(&entry->rb, parent, p);
+	rb_insert_color(&entry->rb, &volume_root);
+
+	return entry;
+}
+
+static void free_block(struct cache_block *b)
+{
+	rb_erase(&b->rb, &cache_root);
+	list_del(&b->lru);
+	cache_bytes -= CACHE_BLOCK_SIZE;
+	if (b->state == BLOCK_DIRTY)
+		dirty_bytes -= CACHE_BLOCK_SIZE;
+	free(b->data);
+	free(b);
+}
+
+/* Drop the least recently used clean blocks beyond the cache size */
+static void shrink_cache(void)
+{
+	struct cache_block *b, *n;
+
+	list_for_each_entry_safe(b, n, &cache_lru, lru) {
+		if (cache_bytes <= sheepfs_cache_size)
+			break;
+		if (b->state == BLOCK_CLEAN && !b->ref)
+			free_block(b);
+	}
+}
+
+static void mark_dirty(struct cache_block *b)
+{
+	if (b->state == BLOCK_DIRTY)
+		return;
+
+	b->state = BLOCK_DIRTY;
+	dirty_bytes += CACHE_BLOCK_SIZE;
+	if (dirty_bytes > dirty_limit())
+		pthread_cond_signal(&flush_cond);
+}
+
+/*
+ * Look up the block, waiting for it while it is being read.  If it isn't
+ * cached, a new block in BLOCK_LOADING state is returned, which the caller
+ * fills and others wait for.  The returned block is referenced.
+ */
+static struct cache_block *get_block(uint32_t vid, uint32_t idx)
+{
+	uint64_t key = block_key(vid, idx);
+	struct cache_block *b;
+
+	while ((b = block_search(key)) && b->state == BLOCK_LOADING)
+		pthread_cond_wait(&cache_cond, &cache_lock);
+
+	if (b) {
+		b->ref++;
+		list_move_tail(&b->lru, &cache_lru);
+		return b;
+	}
+
+	b = xzalloc(sizeof(*b));
+	b->key = key;
+	b->state = BLOCK_LOADING;
+	b->ref = 1;
+	b->data = xmalloc(CACHE_BLOCK_SIZE);
+	block_insert(b);
+	list_add_tail(&b->lru, &cache_lru);
+	cache_bytes += CACHE_BLOCK_SIZE;
+	shrink_cache();
+
+	return b;
+}
+
+static void put_block(struct cache_block *b)
+{
+	b->ref--;
+}
+
+/* Return how many of the len bytes at the offset lie inside the volume */
+static size_t volume_bytes(uint32_t vid, off_t offset, size_t len)
+{
+	uint64_t size = volume_vdi_size(vid);
+
+	if ((uint64_t)offset >= size)
+		return 0;
+	if (len > size - offset)
+		len = size - offset;
+	return len;
+}
+
+/*
+ * Read the nr contiguous blocks in BLOCK_LOADING state, which only the caller
+ * references, from the cluster.  They are freed if the read fails.  Must be
+ * called without cache_lock held.
+ */
+static int load_blocks(struct cache_block **blocks, int nr)
+{
+	char *buf = xzalloc(nr * CACHE_BLOCK_SIZE);
+	size_t len = volume_bytes(block_vid(blocks[0]), block_offset(blocks[0]),
+				  nr * CACHE_BLOCK_SIZE);
+	int i, ret = 0;
+
+	if (len)
+		ret = volume_rw(block_vid(blocks[0]), buf, len,
+				block_offset(blocks[0]), VOLUME_READ);
+
+	pthread_mutex_lock(&cache_lock);
+	for (i = 0; i < nr; i++) {
+		/* the waiters find the block gone and read it themselves */
+		if (ret < 0) {
+			free_block(blocks[i]);
+			continue;
+		}
+		memcpy(blocks[i]->data, buf + i * CACHE_BLOCK_SIZE,
+		       CACHE_BLOCK_SIZE);
+		blocks[i]->state = BLOCK_CLEAN;
+	}
+	pthread_cond_broadcast(&cache_cond);
+	pthread_mutex_unlock(&cache_lock);
+
+	free(buf);
+	return ret;
+}
+
+/*
+ * Write back the dirty blocks with keys in [from, to], each once.  If wait is
+ * set, the blocks being written back by others are waited for, so all the
+ * data written before is on the cluster when it returns.  Must be called
+ * without cache_lock held.
+ */
+static int flush_blocks(uint64_t from, uint64_t to, bool wait)
+{
+	struct cache_block *b, *run[CACHE_FLUSH_BATCH];
+	struct cache_volume *vol;
+	struct rb_node *n;
+	char *buf = xmalloc(CACHE_FLUSH_BATCH * CACHE_BLOCK_SIZE);
+	uint64_t key = from;
+	size_t len;
+	int nr, i, ret = 0, err;
+
+	pthread_mutex_lock(&cache_lock);
+	while ((b = block_search_from(key)) && b->key <= to) {
+		if (b->flushing && wait) {
+			pthread_cond_wait(&cache_cond, &cache_lock);
+			continue;
+		}
+		if (b->state != BLOCK_DIRTY || b->flushing) {
+			key = b->key + 1;
+			continue;
+		}
+
+		/* collect a run of contiguous dirty blocks */
+		nr = 0;
+		for (n = &b->rb; n && nr < CACHE_FLUSH_BATCH; n = rb_next(n)) {
+			b = rb_entry(n, struct cache_block, rb);
+			if (nr && (b->key != run[0]->key + nr || b->key > to ||
+				   b->state != BLOCK_DIRTY || b->flushing))
+				break;
+			run[nr] = b;
+			memcpy(buf + nr * CACHE_BLOCK_SIZE, b->data,
+			       CACHE_BLOCK_SIZE);
+			b->state = BLOCK_CLEAN;
+			b->flushing = true;
+			b->ref++;
+			dirty_bytes -= CACHE_BLOCK_SIZE;
+			nr++;
+		}
+		key = run[nr - 1]->key + 1;
+		pthread_mutex_unlock(&cache_lock);
+
+		/* the part beyond the end of the volume is dropped */
+		len = volume_bytes(block_vid(run[0]), block_offset(run[0]),
+				   nr * CACHE_BLOCK_SIZE);
+		err = len ? volume_rw(block_vid(run[0]), buf, len,
+				      block_offset(run[0]), VOLUME_WRITE) : 0;
+
+		pthread_mutex_lock(&cache_lock);
+		if (err < 0) {
+			sheepfs_pr("failed to write back %d blocks of vdi %"
+				   PRIx32 "\n", nr, block_vid(run[0]));
+			vol = get_cache_volume(block_vid(run[0]));
+			vol->error = true;
+			ret = -1;
+		}
+		for (i = 0; i < nr; i++) {
+			/* keep the data to retry, unless already rewritten */
+			if (err < 0)
+				mark_dirty(run[i]);
+			run[i]->flushing = false;
+			put_block(run[i]);
+		}
+		pthread_cond_broadcast(&cache_cond);
+	}
+	shrink_cache();
+	pthread_mutex_unlock(&cache_lock);
+
+	free(buf);
+	return ret;
+}
+
+static void *flush_thread(void *arg)
+{
+	struct timespec ts;
+	int ret;
+
+	for (;;) {
+		pthread_mutex_lock(&cache_lock);
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += CACHE_FLUSH_INTERVAL;
+		if (dirty_bytes <= dirty_limit() || flush_failed)
+			pthread_cond_timedwait(&flush_cond, &cache_lock, &ts);
+		pthread_mutex_unlock(&cache_lock);
+
+		ret = flush_blocks(0, UINT64_MAX, false);
+
+		pthread_mutex_lock(&cache_lock);
+		flush_failed = ret < 0;
+		/* wake up the writers waiting for the write-back */
+		pthread_cond_broadcast(&cache_cond);
+		pthread_mutex_unlock(&cache_lock);
+	}
+
+	return NULL;
+}
+
+static void *ra_thread(void *arg)
+{
+	struct cache_block *run[CACHE_RA_MAX];
+	struct ra_work *w;
+	uint64_t key;
+	int i, j, nr, ret;
+
+	for (;;) {
+		pthread_mutex_lock(&cache_lock);
+		while (list_empty(&ra_queue))
+			pthread_cond_wait(&ra_cond, &cache_lock);
+		w = list_first_entry(&ra_queue, struct ra_work, list);
+		list_del(&w->list);
+
+		/* read each run of the blocks not cached yet with one call */
+		i = 0;
+		while (i < w->nr && sheepfs_cache_size) {
+			for (nr = 0; i + nr < w->nr; nr++) {
+				key = block_key(w->vid, w->idx + i + nr);
+				if (block_search(key))
+					break;
+				run[nr] = get_block(w->vid, w->idx + i + nr);
+			}
+			if (!nr) {
+				i++;
+				continue;
+			}
+
+			pthread_mutex_unlock(&cache_lock);
+			ret = load_blocks(run, nr);
+			pthread_mutex_lock(&cache_lock);
+			if (ret < 0)
+				break;
+			for (j = 0; j < nr; j++)
+				put_block(run[j]);
+			i += nr;
+		}
+		shrink_cache();
+		pthread_mutex_unlock(&cache_lock);
+		free(w);
+	}
+
+	return NULL;
+}
+
+static void start_cache_threads(void)
+{
+	pthread_t thread;
+
+	/* not at startup, since fuse_main() forks into the background */
+	if (pthread_create(&thread, NULL, flush_thread, NULL) ||
+	    pthread_create(&thread, NULL, ra_thread, NULL)) {
+		sheepfs_pr("failed to create the block cache threads\n");
+		abort();
+	}
+}
+
+/* Queue the read-ahead after the read if the volume is read sequentially */
+static void read_ahead(uint32_t vid, off_t offset, size_t size)
+{
+	struct cache_volume *vol = get_cache_volume(vid);
+	uint32_t end = DIV_ROUND_UP(offset + size, CACHE_BLOCK_SIZE);
+	uint32_t nr_blocks = DIV_ROUND_UP(volume_vdi_size(vid),
+					  CACHE_BLOCK_SIZE);
+	uint32_t start, last;
+	uint64_t max = sheepfs_cache_size / CACHE_BLOCK_SIZE / 4;
+	struct ra_work *w;
+
+	if (max > CACHE_RA_MAX)
+		max = CACHE_RA_MAX;
+
+	if (offset != vol->next || max < CACHE_RA_MIN) {
+		vol->next = offset + size;
+		vol->window = 0;
+		vol->ra_end = 0;
+		return;
+	}
+	vol->next = offset + size;
+	/* the next window is queued when half of the last one is left */
+	if (vol->window && vol->ra_end >= end + vol->window / 2)
+		return;
+	if (!vol->window)
+		vol->window = CACHE_RA_MIN;
+	else if (vol->window * 2 <= (int)max)
+		vol->window *= 2;
+
+	start = max(end, vol->ra_end);
+	last = min(start + vol->window, nr_blocks);
+	if (start >= last)
+		return;
+
+	w = xzalloc(sizeof(*w));
+	w->vid = vid;
+	w->idx = start;
+	w->nr = last - start;
+	vol->ra_end = last;
+	list_add_tail(&w->list, &ra_queue);
+	pthread_cond_signal(&ra_cond);
+}
+
+static int cache_read(uint32_t vid, char *buf, size_t size, off_t offset)
+{
+	uint32_t idx = offset / CACHE_BLOCK_SIZE;
+	size_t start = offset % CACHE_BLOCK_SIZE, len, done = 0;
+	struct cache_block *b;
+
+	pthread_mutex_lock(&cache_lock);
+	while (done < size) {
+		len = CACHE_BLOCK_SIZE - start;
+		if (len > size - done)
+			len = size - done;
+
+		b = get_block(vid, idx);
+		if (b->state == BLOCK_LOADING) {
+			pthread_mutex_unlock(&cache_lock);
+			if (load_blocks(&b, 1) < 0)
+				return -1;
+			pthread_mutex_lock(&cache_lock);
+		}
+		memcpy(buf + done, b->data + start, len);
+		put_block(b);
+
+		done += len;
+		start = 0;
+		idx++;
+	}
+	read_ahead(vid, offset, size);
+	pthread_mutex_unlock(&cache_lock);
+
+	return 0;
+}
+
+static int cache_write(uint32_t vid, const char *buf, size_t size,
+		       off_t offset)
+{
+	uint32_t idx = offset / CACHE_BLOCK_SIZE;
+	size_t start = offset % CACHE_BLOCK_SIZE, len, done = 0;
+	struct cache_block *b;
+	bool loading;
+
+	pthread_mutex_lock(&cache_lock);
+	while (dirty_bytes > dirty_limit() && !flush_failed) {
+		pthread_cond_signal(&flush_cond);
+		pthread_cond_wait(&cache_cond, &cache_lock);
+	}
+
+	while (done < size) {
+		len = CACHE_BLOCK_SIZE - start;
+		if (len > size - done)
+			len = size - done;
+
+		b = get_block(vid, idx);
+		/* a partial write of a block reads the rest of it first */
+		if (b->state == BLOCK_LOADING && len < CACHE_BLOCK_SIZE) {
+			pthread_mutex_unlock(&cache_lock);
+			if (load_blocks(&b, 1) < 0)
+				return -1;
+			pthread_mutex_lock(&cache_lock);
+		}
+		memcpy(b->data + start, buf + done, len);
+		loading = b->state == BLOCK_LOADING;
+		mark_dirty(b);
+		if (loading)
+			pthread_cond_broadcast(&cache_cond);
+		put_block(b);
+
+		done += len;
+		start = 0;
+		idx++;
+	}
+	shrink_cache();
+	pthread_mutex_unlock(&cache_lock);
+
+	return 0;
+}
+
+/*
+ * Read or write the volume through the block cache, or directly if it is
+ * disabled.
+ */
+int volume_cache_rw(uint32_t vid, char *buf, size_t size, off_t offset,
+		    int rw)
+{
+	int ret;
+
+	pthread_rwlock_rdlock(&cache_size_lock);
+	if (!sheepfs_cache_size)
+		ret = volume_rw(vid, buf, size, offset, rw);
+	else {
+		pthread_once(&cache_once, start_cache_threads);
+		if (rw == VOLUME_READ)
+			ret = cache_read(vid, buf, size, offset);
+		else
+			ret = cache_write(vid, buf, size, offset);
+	}
+	pthread_rwlock_unlock(&cache_size_lock);
+
+	return ret;
+}
+
+/* Write back the cached data of the volume */
+int volume_cache_flush(uint32_t vid)
+{
+	struct cache_volume *vol;
+	int ret;
+
+	ret = flush_blocks(block_key(vid, 0), block_key(vid, UINT32_MAX), true);
+
+	pthread_mutex_lock(&cache_lock);
+	vol = volume_search(vid);
+	if (vol && vol->error) {
+		vol->error = false;
+		ret = -1;
+	}
+	pthread_mutex_unlock(&cache_lock);
+
+	return ret;
+}
+
+/* Write back and drop the cached data of the volume being unmounted */
+int volume_cache_drop(uint32_t vid)
+{
+	struct cache_block *b;
+	struct cache_volume *vol;
+	struct ra_work *w, *n;
+	uint64_t key = block_key(vid, 0);
+
+	if (volume_cache_flush(vid) < 0)
+		return -1;
+
+	pthread_mutex_lock(&cache_lock);
+	list_for_each_entry_safe(w, n, &ra_queue, list) {
+		if (w->vid == vid) {
+			list_del(&w->list);
+			free(w);
+		}
+	}
+	while ((b = block_search_from(key)) && block_vid(b) == vid) {
+		key = b->key + 1;
+		if (!b->ref)
+			free_block(b);
+	}
+	vol = volume_search(vid);
+	if (vol) {
+		rb_erase(&vol->rb, &volume_root);
+		free(vol);
+	}
+	pthread_mutex_unlock(&cache_lock);
+
+	return 0;
+}
+
+/* Resize the block cache, writing back and dropping all of it for zero */
+int volume_cache_resize(uint64_t size)
+{
+	int ret = 0;
+
+	pthread_rwlock_wrlock(&cache_size_lock);
+	pthread_mutex_lock(&cache_lock);
+	sheepfs_cache_size = size;
+	shrink_cache();
+	pthread_mutex_unlock(&cache_lock);
+
+	if (!size) {
+		ret = flush_blocks(0, UINT64_MAX, true);
+		pthread_mutex_lock(&cache_lock);
+		shrink_cache();
+		pthread_mutex_unlock(&cache_lock);
+	}
+	pthread_rwlock_unlock(&cache_size_lock);
+
+	return ret;
+}
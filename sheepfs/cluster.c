@@ -39,25 +39,70 @@ int create_cluster_layout(void)
 	return 0;
 }
 
-int cluster_info_read(const char *path, char *buf, size_t size, off_t ignore)
+static struct sheepfs_meta cluster_info_meta = SHEEPFS_META_INIT;
+
+int cluster_info_read(const char *path, char *buf, size_t size, off_t offset)
+{
+	return sheepfs_meta_read(path, &cluster_info_meta, buf, size, offset);
+}
+
+/* The same as the output of 'collie cluster info' */
+static int cluster_info_fill(struct strbuf *buf)
 {
-	return shadow_file_read(path, buf, size, 0);
+	struct sd_node nodes[SD_MAX_NODES];
+	struct sd_req hdr;
+	struct sd_rsp *rsp = (struct sd_rsp *)&hdr;
+	struct epoch_log *logs;
+	uint32_t epoch, master;
+	int i, j, nr_logs, ret;
+	time_t ti, ct;
+	struct tm tm;
+	char time_str[128], name[128];
+
+	if (get_node_list(nodes, &epoch, &master) < 0)
+		return -1;
+
+	logs = xmalloc(epoch * sizeof(*logs));
+	sd_init_req(&hdr, SD_OP_STAT_CLUSTER);
+	hdr.data_length = epoch * sizeof(*logs);
+
+	ret = sheepfs_exec_req(sdhost, sdport, &hdr, logs);
+	if (ret < 0) {
+		free(logs);
+		return -1;
+	}
+
+	strbuf_addf(buf, "Cluster status: %s\n",
+		    ret == SD_RES_SUCCESS ? "running" : sd_strerror(ret));
+
+	if (rsp->data_length > 0) {
+		ct = logs[0].ctime >> 32;
+		strbuf_addf(buf, "\nCluster created at %s\n",
+			    ctime_r(&ct, time_str));
+		strbuf_addstr(buf, "Epoch Time           Version\n");
+	}
+
+	nr_logs = rsp->data_length / sizeof(*logs);
+	for (i = 0; i < nr_logs; i++) {
+		ti = logs[i].time;
+		localtime_r(&ti, &tm);
+		strftime(time_str, sizeof(time_str), "%Y-%m-%d %H:%M:%S", &tm);
+
+		strbuf_addf(buf, "%s %6d [", time_str, logs[i].epoch);
+		for (j = 0; j < logs[i].nr_nodes; j++)
+			strbuf_addf(buf, "%s%s", j == 0 ? "" : ", ",
+				    addr_to_str(name, sizeof(name),
+						logs[i].nodes[j].nid.addr,
+						logs[i].nodes[j].nid.port));
+		strbuf_addstr(buf, "]\n");
+	}
+
+	free(logs);
+	return 0;
 }
 
 size_t cluster_info_get_size(const char *path)
 {
-	struct strbuf *buf;
-	size_t len;
-	char cmd[COMMAND_LEN];
-
-	snprintf(cmd, sizeof(cmd), "collie cluster info -a %s -p %d",
-		 sdhost, sdport);
-	buf = sheepfs_run_cmd(cmd);
-	if (!buf)
-		return 0;
-
-	len = shadow_file_write(path, buf->buf, buf->len);
-	strbuf_release(buf);
-	free(buf);
-	return len;
+	return sheepfs_meta_get_size(path, &cluster_info_meta,
+				     cluster_info_fill);
 }
@@ -27,6 +27,8 @@
 #define PATH_CONFIG_PCACHE "/config/page_cache"
 #define PATH_CONFIG_OCACHE "/config/object_cache"
 #define PATH_CONFIG_SHEEP  "/config/sheep_info"
+#define PATH_CONFIG_BCACHE "/config/block_cache"
+#define PATH_CONFIG_META_TTL "/config/metadata_ttl"
 
 int create_config_layout(void)
 {
@@ -48,6 +50,16 @@ int create_config_layout(void)
 	if (sheepfs_set_op(PATH_CONFIG_SHEEP, OP_CONFIG_SHEEP) < 0)
 		return -1;
 
+	if (shadow_file_create(PATH_CONFIG_BCACHE) < 0)
+		return -1;
+	if (sheepfs_set_op(PATH_CONFIG_BCACHE, OP_CONFIG_BCACHE) < 0)
+		return -1;
+
+	if (shadow_file_create(PATH_CONFIG_META_TTL) < 0)
+		return -1;
+	if (sheepfs_set_op(PATH_CONFIG_META_TTL, OP_CONFIG_META_TTL) < 0)
+		return -1;
+
 	return 0;
 }
 
@@ -134,3 +146,55 @@ size_t config_sheep_info_get_size(const char *path)
 {
 	return strlen(sdhost) + 1/* : */ + sizeof(sdport) + 1/* \n */;
 }
+
+/* The block cache size is in MB, and zero disables the cache */
+int config_bcache_read(const char *path, char *buf, size_t size, off_t ignore)
+{
+	snprintf(buf, size, "%"PRIu64"\n", sheepfs_cache_size / 1024 / 1024);
+	return strlen(buf);
+}
+
+int config_bcache_write(const char *path, const char *buf, size_t size,
+			off_t ignore)
+{
+	uint64_t value;
+
+	if (sscanf(buf, "%"SCNu64, &value) != 1 ||
+	    value > UINT64_MAX / 1024 / 1024)
+		return -EINVAL;
+
+	if (volume_cache_resize(value * 1024 * 1024) < 0)
+		return -EIO;
+
+	return size;
+}
+
+size_t config_bcache_get_size(const char *path)
+{
+	return 20/* UINT64_MAX */ + 1/* \n */;
+}
+
+/* The seconds that the cluster, node and vdi files are cached for */
+int config_meta_ttl_read(const char *path, char *buf, size_t size,
+			 off_t ignore)
+{
+	snprintf(buf, size, "%u\n", sheepfs_meta_ttl);
+	return strlen(buf);
+}
+
+int config_meta_ttl_write(const char *path, const char *buf, size_t size,
+			  off_t ignore)
+{
+	unsigned value;
+
+	if (sscanf(buf, "%u", &value) != 1)
+		return -EINVAL;
+
+	sheepfs_meta_ttl = value;
+	return size;
+}
+
+size_t config_meta_ttl_get_size(const char *path)
+{
+	return 10/* UINT32_MAX */ + 1/* \n */;
+}
@@ -26,6 +26,7 @@
 #include "util.h"
 #include "sheepfs.h"
 #include "sheepdog_proto.h"
+#include "net.h"
 
 #define SH_OP_NAME   "user.sheepfs.opcode"
 #define SH_OP_SIZE   sizeof(uint32_t)
@@ -36,11 +37,13 @@ static int sheepfs_debug;
 static int sheepfs_fg;
 int sheepfs_page_cache = false;
 int sheepfs_object_cache = true;
+unsigned sheepfs_meta_ttl = 1;
 char sdhost[32] = "localhost";
 int sdport = SD_LISTEN_PORT;
 
 static struct option const long_options[] = {
 	{"address", required_argument, NULL, 'a'},
+	{"blockcache", required_argument, NULL, 'b'},
 	{"debug", no_argument, NULL, 'd'},
 	{"help", no_argument, NULL, 'h'},
 	{"foreground", no_argument, NULL, 'f'},
@@ -50,7 +53,7 @@ static struct option const long_options[] = {
 	{NULL, 0, NULL, 0},
 };
 
-static const char *short_options = "a:dfhknp:";
+static const char *short_options = "a:b:dfhknp:";
 
 static struct sheepfs_file_operation {
 	int (*read)(const char *path, char *buf, size_t size, off_t);
@@ -74,6 +77,10 @@ static struct sheepfs_file_operation {
 	[OP_CONFIG_SHEEP]   = { config_sheep_info_read,
 				config_sheep_info_write,
 				config_sheep_info_get_size },
+	[OP_CONFIG_BCACHE]  = { config_bcache_read, config_bcache_write,
+				config_bcache_get_size },
+	[OP_CONFIG_META_TTL] = { config_meta_ttl_read, config_meta_ttl_write,
+				 config_meta_ttl_get_size },
 	[OP_VOLUME]         = { volume_read, volume_write, volume_get_size,
 				volume_sync, volume_open },
 };
@@ -251,14 +258,26 @@ static struct fuse_operations sheepfs_ops =  {
 	.open     = sheepfs_open,
 };
 
+/*
+ * Let FUSE pass requests as large as an object, which the volumes split into
+ * object requests in flight at once.  The kernel and libfuse may still cap
+ * them lower.
+ */
+#define SHEEPFS_MAX_IO ((unsigned)SD_DATA_OBJ_SIZE)
+
 static int sheepfs_main_loop(char *mountpoint)
 {
 	struct fuse_args args = FUSE_ARGS_INIT(0, NULL);
+	char opt[64];
 	int ret = -1;
 
 	fuse_opt_add_arg(&args, "sheepfs"); /* placeholder for argv[0] */
 	fuse_opt_add_arg(&args, "-oallow_root");
 	fuse_opt_add_arg(&args, "-obig_writes");
+	snprintf(opt, sizeof(opt), "-omax_read=%u,max_write=%u,"
+		 "max_readahead=%u", SHEEPFS_MAX_IO, SHEEPFS_MAX_IO,
+		 SHEEPFS_MAX_IO);
+	fuse_opt_add_arg(&args, opt);
 	fuse_opt_add_arg(&args, "-okernel_cache");
 	fuse_opt_add_arg(&args, "-ofsname=sheepfs");
 	fuse_opt_add_arg(&args, mountpoint);
@@ -268,6 +287,7 @@ static int sheepfs_main_loop(char *mountpoint)
 		fuse_opt_add_arg(&args, "-f");
 
 	sheepfs_pr("sheepfs daemon started\n");
+	/* multi-threaded, without '-s', so the volumes serve in parallel */
 	ret = fuse_main(args.argc, args.argv, &sheepfs_ops, NULL);
 	rmdir_r(sheepfs_shadow);
 	sheepfs_pr("sheepfs daemon exited %d\n", ret);
@@ -299,6 +319,7 @@ static void usage(int inval)
 Usage: sheepfs [OPTION]... MOUNTPOINT\n\
 Options:\n\
   -a  --address           specify the sheep address (default: localhost)\n\
+  -b  --blockcache        specify the block cache size in MB (default: 0)\n\
   -d, --debug             enable debug output (implies -f)\n\
   -f, --foreground        sheepfs run in the foreground\n\
   -k, --pagecache         use local kernel's page cache to access volume\n\
@@ -313,7 +334,7 @@ int main(int argc, char **argv)
 {
 	struct strbuf path = STRBUF_INIT;
 	int ch, longindex;
-	char *dir = NULL, *cwd;
+	char *dir = NULL, *cwd, *p;
 
 
 	while ((ch = getopt_long(argc, argv, short_options, long_options,
@@ -322,6 +343,17 @@ int main(int argc, char **argv)
 		case 'a':
 			memcpy(sdhost, optarg, strlen(optarg));
 			break;
+		case 'b':
+			sheepfs_cache_size = strtoull(optarg, &p, 10);
+			if (optarg == p || *p ||
+			    sheepfs_cache_size > UINT64_MAX / 1024 / 1024) {
+				fprintf(stderr,
+					"Invalid block cache size '%s'\n",
+					optarg);
+				exit(1);
+			}
+			sheepfs_cache_size *= 1024 * 1024;
+			break;
 		case 'd':
 			sheepfs_debug = true;
 			break;
@@ -402,3 +434,85 @@ err:
 	free(buf);
 	return NULL;
 }
+
+/* Execute the request on a new connection to the sheep at host:port */
+int sheepfs_exec_req(const char *host, int port, struct sd_req *hdr,
+		     void *data)
+{
+	struct sd_rsp *rsp = (struct sd_rsp *)hdr;
+	int fd, ret;
+
+	fd = connect_to(host, port);
+	if (fd < 0)
+		return -1;
+
+	ret = exec_req(fd, hdr, data, NULL, 0);
+	close(fd);
+	if (ret)
+		return -1;
+
+	return rsp->result;
+}
+
+/*
+ * The metadata files are generated when their size is asked for, at most
+ * once per sheepfs_meta_ttl seconds, and the readers share the result until
+ * then instead of querying the cluster each.
+ */
+size_t sheepfs_meta_get_size(const char *path, struct sheepfs_meta *meta,
+			     int (*fill)(struct strbuf *))
+{
+	struct strbuf buf = STRBUF_INIT;
+	uint64_t now = get_usec_time(), ttl = sheepfs_meta_ttl * 1000000ULL;
+	size_t len;
+
+	pthread_mutex_lock(&meta->lock);
+	if (!meta->stamp || now - meta->stamp >= ttl) {
+		if (fill(&buf) < 0) {
+			meta->len = 0;
+			meta->stamp = 0;
+		} else {
+			meta->len = shadow_file_write(path, buf.buf, buf.len);
+			meta->stamp = now;
+		}
+	}
+	len = meta->len;
+	pthread_mutex_unlock(&meta->lock);
+
+	strbuf_release(&buf);
+	return len;
+}
+
+int sheepfs_meta_read(const char *path, struct sheepfs_meta *meta, char *buf,
+		      size_t size, off_t offset)
+{
+	int ret;
+
+	/* not while the file is being regenerated */
+	pthread_mutex_lock(&meta->lock);
+	ret = shadow_file_read(path, buf, size, offset);
+	pthread_mutex_unlock(&meta->lock);
+
+	return ret;
+}
+
+char *size_to_str(uint64_t _size, char *str, int str_size)
+{
+	const char *units[] = {"MB", "GB", "TB", "PB", "EB", "ZB", "YB"};
+	int i = 0;
+	double size;
+
+	size = (double)_size;
+	size /= 1024 * 1024;
+	while (i < ARRAY_SIZE(units) - 1 && size >= 1024) {
+		i++;
+		size /= 1024;
+	}
+
+	if (size >= 10)
+		snprintf(str, str_size, "%.0lf %s", size, units[i]);
+	else
+		snprintf(str, str_size, "%.1lf %s", size, units[i]);
+
+	return str;
+}
@@ -46,47 +46,137 @@ int create_node_layout(void)
 	return 0;
 }
 
-int node_info_read(const char *path, char *buf, size_t size, off_t ignore)
+static struct sheepfs_meta node_info_meta = SHEEPFS_META_INIT;
+static struct sheepfs_meta node_list_meta = SHEEPFS_META_INIT;
+
+/* Return the number of the nodes, or -1 on error */
+int get_node_list(struct sd_node *nodes, uint32_t *epoch,
+		  uint32_t *master_idx)
+{
+	struct sd_node_req hdr;
+	struct sd_node_rsp *rsp = (struct sd_node_rsp *)&hdr;
+	int ret;
+
+	sd_init_req((struct sd_req *)&hdr, SD_OP_GET_NODE_LIST);
+	hdr.data_length = sizeof(*nodes) * SD_MAX_NODES;
+
+	ret = sheepfs_exec_req(sdhost, sdport, (struct sd_req *)&hdr, nodes);
+	if (ret != SD_RES_SUCCESS) {
+		sheepfs_pr("failed to get node list, %d\n", ret);
+		return -1;
+	}
+
+	*epoch = hdr.epoch;
+	*master_idx = rsp->master_idx;
+	return rsp->data_length / sizeof(*nodes);
+}
+
+static void cal_total_vdi_size(const struct sheepdog_inode *i, void *data)
+{
+	uint64_t *size = data;
+
+	if (!i->snap_ctime)
+		*size += i->vdi_size;
+}
+
+int node_info_read(const char *path, char *buf, size_t size, off_t offset)
 {
-	return shadow_file_read(path, buf, size, 0);
+	return sheepfs_meta_read(path, &node_info_meta, buf, size, offset);
+}
+
+/* The same as the output of 'collie node info' */
+static int node_info_fill(struct strbuf *buf)
+{
+	struct sd_node nodes[SD_MAX_NODES];
+	struct sd_node_req req;
+	struct sd_node_rsp *rsp = (struct sd_node_rsp *)&req;
+	uint64_t total_size = 0, total_avail = 0, total_vdi_size = 0;
+	char total_str[UINT64_DECIMAL_SIZE], avail_str[UINT64_DECIMAL_SIZE],
+	     vdi_size_str[UINT64_DECIMAL_SIZE], store_str[UINT64_DECIMAL_SIZE],
+	     used_str[UINT64_DECIMAL_SIZE], host[128];
+	uint32_t epoch, master;
+	int i, nr, success = 0;
+
+	nr = get_node_list(nodes, &epoch, &master);
+	if (nr < 0)
+		return -1;
+
+	strbuf_addstr(buf, "Id\tSize\tUsed\tUse%\n");
+	for (i = 0; i < nr; i++) {
+		addr_to_str(host, sizeof(host), nodes[i].nid.addr, 0);
+		sd_init_req((struct sd_req *)&req, SD_OP_STAT_SHEEP);
+		if (sheepfs_exec_req(host, nodes[i].nid.port,
+				     (struct sd_req *)&req, NULL) != 0)
+			continue;
+
+		size_to_str(rsp->store_size, store_str, sizeof(store_str));
+		size_to_str(rsp->store_size - rsp->store_free, used_str,
+			    sizeof(used_str));
+		strbuf_addf(buf, "%2d\t%s\t%s\t%3d%%\n", i, store_str,
+			    used_str, rsp->store_size == 0 ? 0 :
+			    (int)(((double)(rsp->store_size - rsp->store_free) /
+				   rsp->store_size) * 100));
+		success++;
+
+		total_size += rsp->store_size;
+		total_avail += rsp->store_free;
+	}
+
+	if (success == 0) {
+		sheepfs_pr("cannot get information from any nodes\n");
+		return -1;
+	}
+
+	if (parse_vdi(cal_total_vdi_size, SD_INODE_HEADER_SIZE,
+		      &total_vdi_size) < 0)
+		return -1;
+
+	size_to_str(total_size, total_str, sizeof(total_str));
+	size_to_str(total_size - total_avail, avail_str, sizeof(avail_str));
+	size_to_str(total_vdi_size, vdi_size_str, sizeof(vdi_size_str));
+	strbuf_addf(buf, "Total\t%s\t%s\t%3d%%\n\n"
+		    "Total virtual image size\t%s\n", total_str, avail_str,
+		    (int)(((double)(total_size - total_avail) / total_size) *
+			  100), vdi_size_str);
+
+	return 0;
 }
 
 size_t node_info_get_size(const char *path)
 {
-	struct strbuf *buf;
-	size_t len;
-	char cmd[COMMAND_LEN];
-
-	snprintf(cmd, sizeof(cmd), "collie node info -a %s -p %d",
-		 sdhost, sdport);
-	buf = sheepfs_run_cmd(cmd);
-	if (!buf)
-		return 0;
-
-	len = shadow_file_write(path, buf->buf, buf->len);
-	strbuf_release(buf);
-	free(buf);
-	return len;
+	return sheepfs_meta_get_size(path, &node_info_meta, node_info_fill);
 }
 
-int node_list_read(const char *path, char *buf, size_t size, off_t ignore)
+int node_list_read(const char *path, char *buf, size_t size, off_t offset)
 {
-	return shadow_file_read(path, buf, size, 0);
+	return sheepfs_meta_read(path, &node_list_meta, buf, size, offset);
+}
+
+/* The same as the output of 'collie node list' */
+static int node_list_fill(struct strbuf *buf)
+{
+	struct sd_node nodes[SD_MAX_NODES];
+	uint32_t epoch, master;
+	char data[128];
+	int i, nr;
+
+	nr = get_node_list(nodes, &epoch, &master);
+	if (nr < 0)
+		return -1;
+
+	strbuf_addstr(buf, "M   Id   Host:Port         V-Nodes       Zone\n");
+	for (i = 0; i < nr; i++) {
+		addr_to_str(data, sizeof(data), nodes[i].nid.addr,
+			    nodes[i].nid.port);
+		strbuf_addf(buf, "%c %4d   %-20s\t%2d%11d\n",
+			    i == master ? '*' : '-', i, data,
+			    nodes[i].nr_vnodes, nodes[i].zone);
+	}
+
+	return 0;
 }
 
 size_t node_list_get_size(const char *path)
 {
-	struct strbuf *buf;
-	size_t len;
-	char cmd[COMMAND_LEN];
-
-	snprintf(cmd, sizeof(cmd), "collie node list -a %s -p %d",
-		 sdhost, sdport);
-	buf = sheepfs_run_cmd(cmd);
-	if (!buf)
-		return 0;
-
-	len = shadow_file_write(path, buf->buf, buf->len);
-	strbuf_release(buf);
-	return len;
+	return sheepfs_meta_get_size(path, &node_list_meta, node_list_fill);
 }
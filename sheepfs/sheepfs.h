@@ -2,6 +2,10 @@
 #define SHEEPFS_H
 
 #include <fuse.h>
+#include <pthread.h>
+
+#include "sheepdog_proto.h"
+#include "sheep.h"
 
 enum sheepfs_opcode {
 	OP_NULL = 0,
@@ -14,19 +18,44 @@ enum sheepfs_opcode {
 	OP_CONFIG_PCACHE,
 	OP_CONFIG_OCACHE,
 	OP_CONFIG_SHEEP,
+	OP_CONFIG_BCACHE,
+	OP_CONFIG_META_TTL,
 	OP_VOLUME,
 };
 
 #define COMMAND_LEN  512
+#define UINT64_DECIMAL_SIZE 21
+
+#define VOLUME_READ   0
+#define VOLUME_WRITE  1
 
 extern char sheepfs_shadow[];
 extern int sheepfs_page_cache;
 extern int sheepfs_object_cache;
+extern uint64_t sheepfs_cache_size;
+extern unsigned sheepfs_meta_ttl;
 extern char sdhost[];
 extern int sdport;
 
 struct strbuf *sheepfs_run_cmd(const char *command);
 int sheepfs_set_op(const char *path, unsigned opcode);
+int sheepfs_exec_req(const char *host, int port, struct sd_req *hdr,
+		     void *data);
+char *size_to_str(uint64_t _size, char *str, int str_size);
+
+/* the cached content of a metadata file */
+struct sheepfs_meta {
+	pthread_mutex_t lock;
+	uint64_t stamp;		/* when it was generated, in usec */
+	size_t len;
+};
+
+#define SHEEPFS_META_INIT { .lock = PTHREAD_MUTEX_INITIALIZER, }
+
+size_t sheepfs_meta_get_size(const char *path, struct sheepfs_meta *meta,
+			     int (*fill)(struct strbuf *));
+int sheepfs_meta_read(const char *path, struct sheepfs_meta *meta, char *buf,
+		      size_t size, off_t offset);
 
 typedef void (*printf_fn)(const char *func, int line, const char *, ...)
 	__printf(3, 4);
@@ -60,6 +89,15 @@ int volume_remove_entry(const char *entry);
 int volume_sync(const char *path);
 int volume_open(const char *path, struct fuse_file_info *);
 int reset_socket_pool(void);
+int volume_rw(uint32_t vid, char *buf, size_t size, off_t offset, int rw);
+uint64_t volume_vdi_size(uint32_t vid);
+
+/* cache.c */
+int volume_cache_rw(uint32_t vid, char *buf, size_t size, off_t offset,
+		    int rw);
+int volume_cache_flush(uint32_t vid);
+int volume_cache_drop(uint32_t vid);
+int volume_cache_resize(uint64_t size);
 
 /* cluster.c */
 int cluster_info_read(const char *path, char *buf, size_t size, off_t);
@@ -70,6 +108,8 @@ int create_cluster_layout(void);
 int create_vdi_layout(void);
 int vdi_list_read(const char *path, char *buf, size_t size, off_t);
 size_t vdi_list_get_size(const char *path);
+int parse_vdi(void (*func)(const struct sheepdog_inode *, void *),
+	      size_t size, void *data);
 
 int vdi_mount_write(const char *, const char *buf, size_t size, off_t);
 int vdi_unmount_write(const char *, const char *buf, size_t, off_t);
@@ -80,6 +120,8 @@ size_t node_list_get_size(const char *path);
 int node_info_read(const char *path, char *buf, size_t size, off_t);
 size_t node_info_get_size(const char *path);
 int create_node_layout(void);
+int get_node_list(struct sd_node *nodes, uint32_t *epoch,
+		  uint32_t *master_idx);
 
 /* config.c */
 int create_config_layout(void);
@@ -96,4 +138,12 @@ int config_sheep_info_read(const char *path, char *, size_t size, off_t);
 int config_sheep_info_write(const char *, const char *, size_t, off_t);
 size_t config_sheep_info_get_size(const char *path);
 
+int config_bcache_read(const char *path, char *buf, size_t size, off_t);
+int config_bcache_write(const char *path, const char *, size_t, off_t);
+size_t config_bcache_get_size(const char *path);
+
+int config_meta_ttl_read(const char *path, char *buf, size_t size, off_t);
+int config_meta_ttl_write(const char *path, const char *, size_t, off_t);
+size_t config_meta_ttl_get_size(const char *path);
+
 #endif
@@ -51,27 +51,143 @@ int create_vdi_layout(void)
 	return 0;
 }
 
-int vdi_list_read(const char *path, char *buf, size_t size, off_t ignore)
+static struct sheepfs_meta vdi_list_meta = SHEEPFS_META_INIT;
+
+/*
+ * Call func for each existing vdi with its inode, which has the header and
+ * as much of the data_vdi_id[] as fits in size read.
+ */
+int parse_vdi(void (*func)(const struct sheepdog_inode *, void *),
+	      size_t size, void *data)
+{
+	struct sheepdog_inode *i = xmalloc(sizeof(*i));
+	struct sd_req hdr;
+	struct sd_rsp *rsp = (struct sd_rsp *)&hdr;
+	unsigned long nr;
+	unsigned int rlen;
+	int fd, ret = -1;
+	static DECLARE_BITMAP(vdi_inuse, SD_NR_VDIS);
+	static pthread_mutex_t vdi_inuse_lock = PTHREAD_MUTEX_INITIALIZER;
+
+	fd = connect_to(sdhost, sdport);
+	if (fd < 0) {
+		sheepfs_pr("failed to connect to %s:%d\n", sdhost, sdport);
+		free(i);
+		return -1;
+	}
+
+	pthread_mutex_lock(&vdi_inuse_lock);
+	sd_init_req(&hdr, SD_OP_READ_VDIS);
+	hdr.data_length = sizeof(vdi_inuse);
+	if (exec_req(fd, &hdr, vdi_inuse, NULL, 0) ||
+	    rsp->result != SD_RES_SUCCESS) {
+		sheepfs_pr("failed to read vdis\n");
+		goto out;
+	}
+
+	/* one connection for all the inodes */
+	for (nr = 0; nr < SD_NR_VDIS; nr++) {
+		if (!test_bit(nr, vdi_inuse))
+			continue;
+
+		memset(i, 0, SD_INODE_HEADER_SIZE);
+		sd_init_req(&hdr, SD_OP_READ_OBJ);
+		hdr.flags |= SD_FLAG_CMD_DIRECT;
+		hdr.obj.oid = vid_to_vdi_oid(nr);
+		hdr.data_length = SD_INODE_HEADER_SIZE;
+		if (exec_req(fd, &hdr, i, NULL, 0))
+			goto out;
+		if (rsp->result != SD_RES_SUCCESS) {
+			sheepfs_pr("failed to read inode header %lx\n", nr);
+			continue;
+		}
+
+		if (i->name[0] == '\0') /* this VDI has been deleted */
+			continue;
+
+		if (size > SD_INODE_HEADER_SIZE) {
+			rlen = DIV_ROUND_UP(i->vdi_size, get_inode_objsize(i)) *
+				sizeof(i->data_vdi_id[0]);
+			if (rlen > size - SD_INODE_HEADER_SIZE)
+				rlen = size - SD_INODE_HEADER_SIZE;
+
+			sd_init_req(&hdr, SD_OP_READ_OBJ);
+			hdr.flags |= SD_FLAG_CMD_DIRECT;
+			hdr.obj.oid = vid_to_vdi_oid(nr);
+			hdr.obj.offset = SD_INODE_HEADER_SIZE;
+			hdr.data_length = rlen;
+			if (exec_req(fd, &hdr, i->data_vdi_id, NULL, 0))
+				goto out;
+			if (rsp->result != SD_RES_SUCCESS) {
+				sheepfs_pr("failed to read inode %lx\n", nr);
+				continue;
+			}
+		}
+
+		func(i, data);
+	}
+	ret = 0;
+out:
+	pthread_mutex_unlock(&vdi_inuse_lock);
+	close(fd);
+	free(i);
+	return ret;
+}
+
+/* The same as the line of 'collie vdi list' */
+static void print_vdi_list(const struct sheepdog_inode *i, void *data)
+{
+	struct strbuf *buf = data;
+	int idx, nr_objs = DIV_ROUND_UP(i->vdi_size, get_inode_objsize(i));
+	uint64_t my_objs = 0, cow_objs = 0;
+	char vdi_size_str[16], my_objs_str[16], cow_objs_str[16];
+	bool is_current = !i->snap_ctime;
+	bool is_clone = i->snap_id == 1 && i->parent_vdi_id != 0;
+	time_t ti;
+	struct tm tm;
+	char dbuf[128];
+
+	ti = i->create_time >> 32;
+	localtime_r(&ti, &tm);
+	strftime(dbuf, sizeof(dbuf), "%Y-%m-%d %H:%M", &tm);
+
+	for (idx = 0; idx < nr_objs; idx++) {
+		if (!i->data_vdi_id[idx])
+			continue;
+		if (is_data_obj_writeable(i, idx))
+			my_objs++;
+		else
+			cow_objs++;
+	}
+
+	size_to_str(i->vdi_size, vdi_size_str, sizeof(vdi_size_str));
+	size_to_str(my_objs * get_inode_objsize(i), my_objs_str,
+		    sizeof(my_objs_str));
+	size_to_str(cow_objs * get_inode_objsize(i), cow_objs_str,
+		    sizeof(cow_objs_str));
+
+	strbuf_addf(buf, "%c %-8s %5d %7s %7s %7s %s  %7" PRIx32 " %5d %13s\n",
+		    is_current ? (is_clone ? 'c' : ' ') : 's',
+		    i->name, is_current ? 0 : i->snap_id, vdi_size_str,
+		    my_objs_str, cow_objs_str, dbuf, i->vdi_id, i->nr_copies,
+		    i->tag);
+}
+
+int vdi_list_read(const char *path, char *buf, size_t size, off_t offset)
+{
+	return sheepfs_meta_read(path, &vdi_list_meta, buf, size, offset);
+}
+
+static int vdi_list_fill(struct strbuf *buf)
 {
-	return shadow_file_read(path, buf, size, 0);
+	strbuf_addstr(buf, "  Name        Id    Size    Used  Shared    "
+		      "Creation time   VDI id  Copies  Tag\n");
+	return parse_vdi(print_vdi_list, SD_INODE_SIZE, buf);
 }
 
 size_t vdi_list_get_size(const char *path)
 {
-	struct strbuf *buf;
-	size_t len;
-	char cmd[COMMAND_LEN];
-
-	snprintf(cmd, sizeof(cmd), "collie vdi list -a %s -p %d",
-		sdhost, sdport);
-	buf = sheepfs_run_cmd(cmd);
-	if (!buf)
-		return 0;
-
-	len = shadow_file_write(path, buf->buf, buf->len);
-	strbuf_release(buf);
-	free(buf);
-	return len;
+	return sheepfs_meta_get_size(path, &vdi_list_meta, vdi_list_fill);
 }
 
 int vdi_mount_write(const char *path, const char *buf, size_t size,
@@ -19,7 +19,6 @@
 #include <stdio.h>
 #include <time.h>
 #include <assert.h>
-#include <urcu/uatomic.h>
 #include <pthread.h>
 
 #include "sheepdog_proto.h"
@@ -37,29 +36,29 @@
 #define SH_SIZE_NAME   "user.volume.size"
 #define SH_SIZE_SIZE   sizeof(size_t)
 
-#define VOLUME_READ   0
-#define VOLUME_WRITE  1
-
 /* #define DEBUG */
 
+#define SOCKET_POOL_SIZE      8
+#define SOCKET_POOL_MAX_IDLE  64
+
+struct socket_pool {
+	pthread_mutex_t lock;
+	int fds[SOCKET_POOL_MAX_IDLE];	/* the idle connections */
+	int nr_idle;
+	unsigned long gen;		/* bumped when the gateway changes */
+};
+
 struct vdi_inode {
 	struct rb_node rb;
 	uint32_t vid;
 	struct sheepdog_inode *inode;
 /*
- * FIXME
- * 1) Consider various VM request queue depth.
- * 2) Most drive presents 31 to Linux, I set it as 31 to expect that VM's
- *    real queue depth never exceed 31
+ * Socket pool is used for FUSE threads and the object requests that one
+ * FUSE request is split into.  All sockets point to the same gateway.  The
+ * pool starts with SOCKET_POOL_SIZE connections and grows when all of them
+ * are in use, keeping at most SOCKET_POOL_MAX_IDLE idle ones.
  */
-#define SOCKET_POOL_SIZE  31
-/*
- * Socket pool is used for FUSE read threads, which use threads
- * to simulate aysnc read. All sockets point to the same gateway
- */
-	int socket_pool[SOCKET_POOL_SIZE];
-	uatomic_bool socket_in_use[SOCKET_POOL_SIZE];
-	unsigned socket_poll_adder;
+	struct socket_pool pool;
 };
 
 static struct rb_root vdi_inode_tree = RB_ROOT;
@@ -114,132 +113,249 @@ int create_volume_layout(void)
 	return 0;
 }
 
+static int connect_gateway(void)
+{
+	int fd;
+
+	fd = connect_to(sdhost, sdport);
+	if (fd < 0) {
+		sheepfs_pr("connect_to %m\n");
+		return -1;
+	}
+
+	if (set_nodelay(fd)) {
+		sheepfs_pr("%m\n");
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
 /* We must use get/put_socket_fd in pair */
-static inline int get_socket_fd(struct vdi_inode *vdi, int *idx)
+static int get_socket_fd(struct vdi_inode *vdi, unsigned long *gen)
 {
-	int sock_idx, fd;
+	struct socket_pool *pool = &vdi->pool;
+	int fd = -1;
+
+	pthread_mutex_lock(&pool->lock);
+	*gen = pool->gen;
+	if (pool->nr_idle)
+		fd = pool->fds[--pool->nr_idle];
+	pthread_mutex_unlock(&pool->lock);
 
-retry:
-	sock_idx = uatomic_add_return(&vdi->socket_poll_adder, 1) %
-		   SOCKET_POOL_SIZE;
-	/* if socket_in_use[sock_idx] is false, set it to true, otherwise, retry */
-	if (uatomic_set_true(&vdi->socket_in_use[sock_idx]))
-		goto retry;
-	fd = vdi->socket_pool[sock_idx];
-	*idx = sock_idx;
+	if (fd < 0)
+		fd = connect_gateway();
 
 	return fd;
 }
 
-static inline void put_socket_fd(struct vdi_inode *vdi, int idx)
+/* A connection which failed, or is to the old gateway, is closed */
+static void put_socket_fd(struct vdi_inode *vdi, int fd, unsigned long gen,
+			  bool broken)
 {
-	uatomic_set_false(&vdi->socket_in_use[idx]);
+	struct socket_pool *pool = &vdi->pool;
+
+	pthread_mutex_lock(&pool->lock);
+	if (!broken && gen == pool->gen &&
+	    pool->nr_idle < SOCKET_POOL_MAX_IDLE) {
+		pool->fds[pool->nr_idle++] = fd;
+		fd = -1;
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	if (fd >= 0)
+		close(fd);
 }
 
 static int volume_rw_object(char *buf, uint64_t oid, size_t size,
-			    off_t off, int rw)
+			    off_t off, int rw);
+
+/* an object request, which several of may be in flight at once */
+struct volume_req {
+	struct sd_req hdr;
+	char *buf;
+	uint64_t oid;
+	size_t size;
+	off_t off;
+	int rw;
+
+	struct vdi_inode *vdi;
+	unsigned long idx;
+	bool create;
+	bool sent;
+	int fd;
+	unsigned long gen;
+	unsigned int rlen;
+};
+
+/* Prepare the request to the object and send it */
+static int volume_submit_req(struct volume_req *req)
 {
-	struct sd_req hdr = { 0 };
-	struct sd_rsp *rsp = (struct sd_rsp *)&hdr;
-	int ret, fd, sock_idx;
-	bool create = false;
-	uint32_t vid = oid_to_vid(oid);
+	struct sd_req *hdr = &req->hdr;
+	uint32_t vid = oid_to_vid(req->oid);
 	struct vdi_inode *vdi;
-	unsigned long idx = 0;
-	uint64_t cow_oid = 0;
+	uint64_t oid = req->oid, cow_oid = 0;
+	int ret;
+
+	memset(hdr, 0, sizeof(*hdr));
+	req->create = false;
+	req->sent = false;
 
 	pthread_rwlock_rdlock(&vdi_inode_tree_lock);
 	vdi = vdi_inode_tree_search(vid);
 	pthread_rwlock_unlock(&vdi_inode_tree_lock);
+	req->vdi = vdi;
 
 	if (is_data_obj(oid)) {
-		if (off % SECTOR_SIZE || size % SECTOR_SIZE) {
+		if (req->off % SECTOR_SIZE || req->size % SECTOR_SIZE) {
 			sheepfs_pr("offset or size not aligned\n");
 			return -1;
 		}
 
-		idx = data_oid_to_idx(oid);
+		req->idx = data_oid_to_idx(oid);
 		assert(vdi);
-		if (!vdi->inode->data_vdi_id[idx]) {
+		if (!vdi->inode->data_vdi_id[req->idx]) {
 			/* if object doesn't exist, we'er done */
-			if (rw == VOLUME_READ) {
-				memset(buf, 0, size);
-				goto done;
+			if (req->rw == VOLUME_READ) {
+				memset(req->buf, 0, req->size);
+				return 0;
 			}
-			create = true;
+			req->create = true;
 		} else {
-			if (rw == VOLUME_READ) {
+			if (req->rw == VOLUME_READ) {
 				oid = vid_to_data_oid(
-					vdi->inode->data_vdi_id[idx],
-					idx);
+					vdi->inode->data_vdi_id[req->idx],
+					req->idx);
 			/* in case we are writing a COW object */
-			} else if (!is_data_obj_writeable(vdi->inode, idx)) {
+			} else if (!is_data_obj_writeable(vdi->inode,
+							  req->idx)) {
 				cow_oid = vid_to_data_oid(
-						vdi->inode->data_vdi_id[idx],
-						idx);
-				hdr.flags |= SD_FLAG_CMD_COW;
-				create = true;
+					vdi->inode->data_vdi_id[req->idx],
+					req->idx);
+				hdr->flags |= SD_FLAG_CMD_COW;
+				req->create = true;
 			}
 		}
 	}
 
-	if (rw == VOLUME_READ)
-		hdr.opcode = SD_OP_READ_OBJ;
+	if (req->rw == VOLUME_READ)
+		hdr->opcode = SD_OP_READ_OBJ;
 	else {
-		hdr.opcode = create ?
+		hdr->opcode = req->create ?
 			SD_OP_CREATE_AND_WRITE_OBJ : SD_OP_WRITE_OBJ;
-		hdr.flags |= SD_FLAG_CMD_WRITE;
+		hdr->flags |= SD_FLAG_CMD_WRITE;
 	}
 
-	hdr.obj.oid = oid;
-	hdr.obj.offset = off;
-	hdr.obj.cow_oid = cow_oid;
-	hdr.data_length = size;
+	hdr->obj.oid = oid;
+	hdr->obj.offset = req->off;
+	hdr->obj.cow_oid = cow_oid;
+	hdr->data_length = req->size;
 	if (sheepfs_object_cache)
-		hdr.flags |= SD_FLAG_CMD_CACHE;
+		hdr->flags |= SD_FLAG_CMD_CACHE;
+
+	req->fd = get_socket_fd(vdi, &req->gen);
+	if (req->fd < 0)
+		return -1;
+	ret = submit_req(req->fd, hdr, req->buf, &req->rlen, NULL, 0);
+	if (ret) {
+		put_socket_fd(vdi, req->fd, req->gen, true);
+		sheepfs_pr("failed to send request for object %" PRIx64 "\n",
+			   req->oid);
+		return -1;
+	}
+	req->sent = true;
+
+	return 0;
+}
+
+/* Wait for the response to the request submitted by volume_submit_req() */
+static int volume_wait_req(struct volume_req *req)
+{
+	struct sd_rsp *rsp = (struct sd_rsp *)&req->hdr;
+	uint32_t vid = oid_to_vid(req->oid);
+	int ret;
 
-	fd = get_socket_fd(vdi, &sock_idx);
-	ret = exec_req(fd, &hdr, buf, NULL, 0);
-	put_socket_fd(vdi, sock_idx);
+	if (!req->sent)
+		return req->size;
+
+	ret = wait_rsp(req->fd, &req->hdr, req->buf, req->rlen, NULL, 0);
+	put_socket_fd(req->vdi, req->fd, req->gen, ret != 0);
 
 	if (ret || rsp->result != SD_RES_SUCCESS) {
 		sheepfs_pr("failed to %s object %" PRIx64 " ret %d, res %u\n",
-			   rw == VOLUME_READ ? "read" : "write",
-			   oid, ret, rsp->result);
+			   req->rw == VOLUME_READ ? "read" : "write",
+			   req->oid, ret, rsp->result);
 		return -1;
 	}
 
-	if (create) {
-		vdi->inode->data_vdi_id[idx] = vid;
+	if (req->create) {
+		req->vdi->inode->data_vdi_id[req->idx] = vid;
 		/* writeback inode update */
 		if (volume_rw_object((char *)&vid, vid_to_vdi_oid(vid),
 				     sizeof(vid),
-				     SD_INODE_HEADER_SIZE + sizeof(vid) * idx,
+				     SD_INODE_HEADER_SIZE +
+				     sizeof(vid) * req->idx,
 				     VOLUME_WRITE) < 0)
 			return -1;
 	}
-done:
-	return size;
+
+	return req->size;
 }
 
-/* Do sync read/write */
-static int volume_do_rw(const char *path, char *buf, size_t size,
-			 off_t offset, int rw)
+static int volume_rw_object(char *buf, uint64_t oid, size_t size,
+			    off_t off, int rw)
+{
+	struct volume_req req = {
+		.buf = buf,
+		.oid = oid,
+		.size = size,
+		.off = off,
+		.rw = rw,
+	};
+
+	if (volume_submit_req(&req) < 0)
+		return -1;
+
+	return volume_wait_req(&req);
+}
+
+static uint32_t volume_objsize(uint32_t vid)
+{
+	struct vdi_inode *vdi;
+	uint32_t objsize = SD_DATA_OBJ_SIZE;
+
+	pthread_rwlock_rdlock(&vdi_inode_tree_lock);
+	vdi = vdi_inode_tree_search(vid);
+	if (vdi)
+		objsize = get_inode_objsize(vdi->inode);
+	pthread_rwlock_unlock(&vdi_inode_tree_lock);
+
+	return objsize;
+}
+
+/*
+ * Read or write the objects which the range spans.  The requests to all the
+ * objects are sent before the first response is waited for, so a large read
+ * or write runs against the objects in parallel.
+ */
+int volume_rw(uint32_t vid, char *buf, size_t size, off_t offset, int rw)
 {
-	uint32_t vid;
 	uint64_t oid;
 	unsigned long idx;
 	off_t start;
-	size_t len, ret;
+	size_t len;
+	struct volume_req *reqs;
+	uint32_t objsize = volume_objsize(vid);
+	int nr = 0, i, ret = 0;
 
-	if (shadow_file_getxattr(path, SH_VID_NAME, &vid, SH_VID_SIZE) < 0)
-		return -1;
-
-	idx = offset / SD_DATA_OBJ_SIZE;
+	idx = offset / objsize;
 	oid = vid_to_data_oid(vid, idx);
-	start = offset % SD_DATA_OBJ_SIZE;
+	start = offset % objsize;
+
+	reqs = xzalloc(sizeof(*reqs) * DIV_ROUND_UP(start + size, objsize));
 
-	len = SD_DATA_OBJ_SIZE - start;
+	len = objsize - start;
 	if (size < len)
 		len = size;
 
@@ -250,19 +366,42 @@ static int volume_do_rw(const char *path, char *buf, size_t size,
 			   rw == VOLUME_READ ? "read" : "write",
 			   oid, start, len, size);
 #endif
-		ret = volume_rw_object(buf, oid, len, start, rw);
-
-		if (ret != len)
-			return -1;
+		reqs[nr].buf = buf;
+		reqs[nr].oid = oid;
+		reqs[nr].size = len;
+		reqs[nr].off = start;
+		reqs[nr].rw = rw;
+		if (volume_submit_req(reqs + nr) < 0) {
+			ret = -1;
+			break;
+		}
+		nr++;
 
 		oid++;
 		size -= len;
-		start = (start + len) % SD_DATA_OBJ_SIZE;
+		start = (start + len) % objsize;
 		buf += len;
-		len = size > SD_DATA_OBJ_SIZE ? SD_DATA_OBJ_SIZE : size;
+		len = size > objsize ? objsize : size;
 	} while (size > 0);
 
-	return 0;
+	/* all the sent requests are waited for, even after an error */
+	for (i = 0; i < nr; i++)
+		if (volume_wait_req(reqs + i) != (int)reqs[i].size)
+			ret = -1;
+
+	free(reqs);
+	return ret;
+}
+
+static int volume_do_rw(const char *path, char *buf, size_t size,
+			off_t offset, int rw)
+{
+	uint32_t vid;
+
+	if (shadow_file_getxattr(path, SH_VID_NAME, &vid, SH_VID_SIZE) < 0)
+		return -1;
+
+	return volume_cache_rw(vid, buf, size, offset, rw);
 }
 
 int volume_read(const char *path, char *buf, size_t size, off_t offset)
@@ -290,11 +429,27 @@ size_t volume_get_size(const char *path)
 	return size;
 }
 
+/* Return the size of the volume, or zero if it isn't mounted */
+uint64_t volume_vdi_size(uint32_t vid)
+{
+	struct vdi_inode *vdi;
+	uint64_t size = 0;
+
+	pthread_rwlock_rdlock(&vdi_inode_tree_lock);
+	vdi = vdi_inode_tree_search(vid);
+	if (vdi)
+		size = vdi->inode->vdi_size;
+	pthread_rwlock_unlock(&vdi_inode_tree_lock);
+
+	return size;
+}
+
 static int volume_do_sync(uint32_t vid)
 {
 	struct sd_req hdr = { 0 };
 	struct sd_rsp *rsp = (struct sd_rsp *)&hdr;
-	int ret, fd, idx;
+	int ret, fd;
+	unsigned long gen;
 	struct vdi_inode *vdi;
 
 	pthread_rwlock_rdlock(&vdi_inode_tree_lock);
@@ -304,9 +459,11 @@ static int volume_do_sync(uint32_t vid)
 	hdr.opcode = SD_OP_FLUSH_VDI;
 	hdr.obj.oid = vid_to_vdi_oid(vid);
 
-	fd = get_socket_fd(vdi, &idx);
+	fd = get_socket_fd(vdi, &gen);
+	if (fd < 0)
+		return -1;
 	ret = exec_req(fd, &hdr, NULL, NULL, 0);
-	put_socket_fd(vdi, idx);
+	put_socket_fd(vdi, fd, gen, ret != 0);
 
 	if (ret || rsp->result != SD_RES_SUCCESS) {
 		sheepfs_pr("failed to flush vdi %"PRIx32"\n", vid);
@@ -323,6 +480,9 @@ int volume_sync(const char *path)
 	if (shadow_file_getxattr(path, SH_VID_NAME, &vid, SH_VID_SIZE) < 0)
 		return -EIO;
 
+	if (volume_cache_flush(vid) < 0)
+		return -EIO;
+
 	if (sheepfs_object_cache && volume_do_sync(vid) < 0)
 		return -EIO;
 
@@ -336,33 +496,26 @@ int volume_open(const char *path, struct fuse_file_info *fi)
 	return 0;
 }
 
-static void destroy_socket_pool(int array[], int len)
+static void destroy_socket_pool(struct socket_pool *pool)
 {
 	int i;
-	for (i = 0; i < len; i++)
-		close(array[i]);
+
+	for (i = 0; i < pool->nr_idle; i++)
+		close(pool->fds[i]);
+	pool->nr_idle = 0;
 }
 
-static int setup_socket_pool(int array[], int len)
+static int setup_socket_pool(struct socket_pool *pool)
 {
-	int fd, i, ret;
+	int fd, i;
 
-	for (i = 0; i < len; i++) {
-		fd = connect_to(sdhost, sdport);
+	for (i = 0; i < SOCKET_POOL_SIZE; i++) {
+		fd = connect_gateway();
 		if (fd < 0) {
-			sheepfs_pr("connect_to %m\n");
-			destroy_socket_pool(array, --i);
+			destroy_socket_pool(pool);
 			return -1;
 		}
-
-		ret = set_nodelay(fd);
-		if (ret) {
-			sheepfs_pr("%m\n");
-			destroy_socket_pool(array, i);
-			return -1;
-		}
-
-		array[i] = fd;
+		pool->fds[pool->nr_idle++] = fd;
 	}
 
 	return 0;
@@ -377,12 +530,14 @@ int reset_socket_pool(void)
 	pthread_rwlock_rdlock(&vdi_inode_tree_lock);
 	for (node = rb_first(&vdi_inode_tree); node; node = rb_next(node)) {
 		vdi = rb_entry(node, struct vdi_inode, rb);
-		destroy_socket_pool(vdi->socket_pool, SOCKET_POOL_SIZE);
-		if (setup_socket_pool(vdi->socket_pool,
-			SOCKET_POOL_SIZE) < 0) {
-			ret = -1;
+		/* the connections in use are closed when they are put */
+		pthread_mutex_lock(&vdi->pool.lock);
+		destroy_socket_pool(&vdi->pool);
+		vdi->pool.gen++;
+		ret = setup_socket_pool(&vdi->pool);
+		pthread_mutex_unlock(&vdi->pool.lock);
+		if (ret < 0)
 			goto out;
-		}
 	}
 out:
 	pthread_rwlock_unlock(&vdi_inode_tree_lock);
@@ -391,21 +546,23 @@ out:
 
 static int init_vdi_info(const char *entry, uint32_t *vid, size_t *size)
 {
-	struct strbuf *buf;
-	void *inode_buf = NULL;
+	struct sd_req hdr;
+	struct sd_rsp *rsp = (struct sd_rsp *)&hdr;
+	char vdiname[SD_MAX_VDI_LEN + SD_MAX_VDI_TAG_LEN] = { 0 };
+	struct sheepdog_inode *inode_buf = NULL;
 	struct vdi_inode *inode = NULL, *dummy;
-	char command[COMMAND_LEN];
-
-	snprintf(command, sizeof(command), "collie vdi list -r %s -a %s -p %d",
-		 entry, sdhost, sdport);
-	buf = sheepfs_run_cmd(command);
-	if (!buf)
+	int ret;
+
+	pstrcpy(vdiname, SD_MAX_VDI_LEN, entry);
+	sd_init_req(&hdr, SD_OP_GET_VDI_INFO);
+	hdr.flags = SD_FLAG_CMD_WRITE;
+	hdr.data_length = sizeof(vdiname);
+	ret = sheepfs_exec_req(sdhost, sdport, &hdr, vdiname);
+	if (ret != SD_RES_SUCCESS) {
+		sheepfs_pr("failed to find vdi %s, %d\n", entry, ret);
 		return -1;
-	if (sscanf(buf->buf, "%*s %*s %*d %zu %*s %*s %*s %"PRIx32,
-	    size, vid) < 2) {
-		sheepfs_pr("failed to sscanf %s\n", entry);
-		goto err;
 	}
+	*vid = rsp->vdi.vdi_id;
 
 	inode_buf = malloc(SD_INODE_SIZE);
 	if (!inode_buf) {
@@ -415,7 +572,8 @@ static int init_vdi_info(const char *entry, uint32_t *vid, size_t *size)
 
 	inode = xzalloc(sizeof(*inode));
 	inode->vid = *vid;
-	if (setup_socket_pool(inode->socket_pool, SOCKET_POOL_SIZE) < 0) {
+	pthread_mutex_init(&inode->pool.lock, NULL);
+	if (setup_socket_pool(&inode->pool) < 0) {
 		sheepfs_pr("failed to setup socket pool\n");
 		goto err;
 	}
@@ -425,21 +583,19 @@ static int init_vdi_info(const char *entry, uint32_t *vid, size_t *size)
 	pthread_rwlock_unlock(&vdi_inode_tree_lock);
 	if (dummy)
 		goto err;
-	if (volume_rw_object(inode_buf, vid_to_vdi_oid(*vid), SD_INODE_SIZE,
+	if (volume_rw_object((char *)inode_buf, vid_to_vdi_oid(*vid),
+			     SD_INODE_SIZE,
 			     0, VOLUME_READ) < 0) {
 		rb_erase(&inode->rb, &vdi_inode_tree);
 		sheepfs_pr("failed to read inode for %"PRIx32"\n", *vid);
 		goto err;
 	}
 	inode->inode = inode_buf;
-	strbuf_release(buf);
-	free(buf);
+	*size = inode_buf->vdi_size;
 	return 0;
 err:
 	free(inode_buf);
 	free(inode);
-	strbuf_release(buf);
-	free(buf);
 	return -1;
 }
 
@@ -481,7 +637,8 @@ static int volume_sync_and_delete(uint32_t vid)
 {
 	struct sd_req hdr = { 0 };
 	struct sd_rsp *rsp = (struct sd_rsp *)&hdr;
-	int ret, fd, idx;
+	int ret, fd;
+	unsigned long gen;
 	struct vdi_inode *vdi;
 
 	pthread_rwlock_rdlock(&vdi_inode_tree_lock);
@@ -491,9 +648,11 @@ static int volume_sync_and_delete(uint32_t vid)
 	hdr.opcode = SD_OP_FLUSH_DEL_CACHE;
 	hdr.obj.oid = vid_to_vdi_oid(vid);
 
-	fd = get_socket_fd(vdi, &idx);
+	fd = get_socket_fd(vdi, &gen);
+	if (fd < 0)
+		return -1;
 	ret = exec_req(fd, &hdr, NULL, NULL, 0);
-	put_socket_fd(vdi, idx);
+	put_socket_fd(vdi, fd, gen, ret != 0);
 
 	if (ret || rsp->result != SD_RES_SUCCESS) {
 		sheepfs_pr("failed to flush vdi %" PRIx32 "\n", vid);
@@ -520,13 +679,16 @@ int volume_remove_entry(const char *entry)
 	if (shadow_file_getxattr(path, SH_VID_NAME, &vid, SH_VID_SIZE) < 0)
 		return -1;
 
+	if (volume_cache_drop(vid) < 0)
+		return -1;
+
 	if (sheepfs_object_cache && volume_sync_and_delete(vid) < 0)
 		return -1;
 
 	pthread_rwlock_rdlock(&vdi_inode_tree_lock);
 	vdi = vdi_inode_tree_search(vid);
 	pthread_rwlock_unlock(&vdi_inode_tree_lock);
-	destroy_socket_pool(vdi->socket_pool, SOCKET_POOL_SIZE);
+	destroy_socket_pool(&vdi->pool);
 
 	pthread_rwlock_wrlock(&vdi_inode_tree_lock);
 	rb_erase(&vdi->rb, &vdi_inode_tree);